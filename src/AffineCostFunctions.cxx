@@ -70,6 +70,25 @@ void
 PureAffineCostFunction<VDim, TReal>
 ::compute(const vnl_vector<double> &x, double *f, vnl_vector<double> *g)
 {
+  this->compute_gauss_newton(x, f, g, NULL);
+}
+
+template <unsigned int VDim, typename TReal>
+bool
+PureAffineCostFunction<VDim, TReal>
+::SupportsGaussNewton() const
+{
+  return m_Param->metric == GreedyParameters::SSD;
+}
+
+template <unsigned int VDim, typename TReal>
+void
+PureAffineCostFunction<VDim, TReal>
+::compute_gauss_newton(const vnl_vector<double> &x, double *f, vnl_vector<double> *g, vnl_matrix<double> *H)
+{
+  if(H && !this->SupportsGaussNewton())
+    throw GreedyException("Gauss-Newton optimization is only supported for the SSD metric");
+
   // Form a matrix/vector from x
   typename LinearTransformType::Pointer tran = LinearTransformType::New();
 
@@ -97,6 +116,7 @@ PureAffineCostFunction<VDim, TReal>
   // it is more readable if it is scaled by some large factor
   double metric_scale =
       (m_Param->metric == GreedyParameters::NCC
+       || m_Param->metric == GreedyParameters::NCC_APPROX
        || m_Param->metric == GreedyParameters::MI
        || m_Param->metric == GreedyParameters::NMI)
       ? -10000.0 : 1.0;
@@ -113,14 +133,19 @@ PureAffineCostFunction<VDim, TReal>
   if(m_Param->metric == GreedyParameters::SSD)
     {
     m_OFHelper->ComputeAffineMSDMatchAndGradient(
-          m_Level, tran, m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad);
+          m_Level, tran, m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad, H);
 
     }
-  else if(m_Param->metric == GreedyParameters::NCC)
+  else if(m_Param->metric == GreedyParameters::NCC || m_Param->metric == GreedyParameters::NCC_APPROX)
     {
+    // The approximate NCC has no affine gradient, so affine uses the exact NCC
+    if(!m_Parent && m_NCCWorkingImage.IsNull())
+      m_NCCWorkingImage = OFHelperType::MultiComponentImageType::New();
+
     m_OFHelper->ComputeAffineNCCMatchAndGradient(
           m_Level, tran, array_caster<VDim>::to_itkSize(m_Param->metric_radius),
-          m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad);
+          m_Metric, m_Mask, m_GradMetric, m_GradMask, m_Phi, out_metric, grad,
+          m_NCCWorkingImage);
     }
   else if(m_Param->metric == GreedyParameters::MI || m_Param->metric == GreedyParameters::NMI)
     {
@@ -136,6 +161,9 @@ PureAffineCostFunction<VDim, TReal>
     (*g) *= metric_scale;
     }
 
+  if(H)
+    (*H) *= metric_scale;
+
   // Scale the output metric
   out_metric.Scale(metric_scale);
 
@@ -143,8 +171,8 @@ PureAffineCostFunction<VDim, TReal>
   if(f)
     *f = out_metric.TotalMetric;
 
-  // Has the metric improved?
-  if(m_Parent->GetMetricLog().size())
+  // Has the metric improved? Functions without a parent do not report
+  if(m_Parent && m_Parent->GetMetricLog().size())
     {
     const std::vector<MultiComponentMetricReport> &log = m_Parent->GetMetricLog().back();
     if(log.size() == 0 || log.back().TotalMetric > out_metric.TotalMetric)
@@ -231,7 +259,9 @@ PhysicalSpaceAffineCostFunction<VDim, TReal>
   b_mov_inv = - Q_mov_inv * b_mov;
 
   // Take advantage of the fact that the transformation is linear in A and b to compute
-  // the Jacobian of the transformation ahead of time, and "lazily", using finite differences
+  // the Jacobian of the transformation ahead of time, and "lazily", using finite differences.
+  // The matrices above and this Jacobian are all that compute() needs, so the mapping
+  // is a constant linear map for the level and nothing is decomposed per evaluation
   int n = VDim * (VDim + 1);
   J_phys_vox.set_size(n, n);
   vnl_vector<double> x_phys(n, 0), x_vox_0(n), x_vox(n);
@@ -288,8 +318,9 @@ PhysicalSpaceAffineCostFunction<VDim, TReal>
     vnl_vector<double> g_vox(m_PureFunction.get_number_of_unknowns());
     m_PureFunction.compute(x_vox, f, &g_vox);
 
-    // Transform voxel-space gradient into physical-space gradient
-    *g = J_phys_vox.transpose() * g_vox;
+    // Transform voxel-space gradient into physical-space gradient. The product
+    // g_vox * J is J^T * g_vox, without forming the transposed matrix
+    *g = g_vox * J_phys_vox;
     }
   else
     {
@@ -298,6 +329,27 @@ PhysicalSpaceAffineCostFunction<VDim, TReal>
     }
 }
 
+template <unsigned int VDim, typename TReal>
+void
+PhysicalSpaceAffineCostFunction<VDim, TReal>
+::compute_gauss_newton(const vnl_vector<double> &x, double *f, vnl_vector<double> *g, vnl_matrix<double> *H)
+{
+  // Map to voxel space
+  vnl_vector<double> x_vox(m_PureFunction.get_number_of_unknowns());
+  this->map_phys_to_vox(x, x_vox);
+
+  // Compute the function, gradient and Hessian wrt voxel parameters
+  vnl_vector<double> g_vox(m_PureFunction.get_number_of_unknowns());
+  vnl_matrix<double> H_vox;
+  m_PureFunction.compute_gauss_newton(x_vox, f, &g_vox, H ? &H_vox : NULL);
+
+  // The mapping is linear, so the chain rule involves only the constant Jacobian
+  if(g)
+    *g = g_vox * J_phys_vox;
+  if(H)
+    *H = J_phys_vox.transpose() * H_vox * J_phys_vox;
+}
+
 template <unsigned int VDim, typename TReal>
 vnl_vector<double>
 PhysicalSpaceAffineCostFunction<VDim, TReal>
@@ -368,6 +420,30 @@ ScalingCostFunction<VDim, TReal>
     }
 }
 
+template <unsigned int VDim, typename TReal>
+void
+ScalingCostFunction<VDim, TReal>
+::compute_gauss_newton(const vnl_vector<double> &x, double *f, vnl_vector<double> *g, vnl_matrix<double> *H)
+{
+  // Scale the parameters so they are in unscaled units
+  vnl_vector<double> x_scaled = element_quotient(x, m_Scaling);
+
+  // Call the wrapped method
+  vnl_vector<double> g_scaled(x_scaled.size());
+  m_PureFunction->compute_gauss_newton(x_scaled, f, &g_scaled, H);
+
+  if(g)
+    *g = element_quotient(g_scaled, m_Scaling);
+
+  // The second derivatives scale by the product of the two parameter scales
+  if(H)
+    {
+    for(unsigned int i = 0; i < H->rows(); i++)
+      for(unsigned int j = 0; j < H->cols(); j++)
+        (*H)(i,j) /= m_Scaling[i] * m_Scaling[j];
+    }
+}
+
 // Get the parameters for the specified initial transform
 template <unsigned int VDim, typename TReal>
 vnl_vector<double>
@@ -28,6 +28,7 @@
 #define AFFINECOSTFUNCTIONS_H
 
 #include "GreedyAPI.h"
+#include "GreedyException.h"
 #include <vnl/vnl_cost_function.h>
 #include <vnl/vnl_random.h>
 #include <vnl/vnl_trace.h>
@@ -54,6 +55,14 @@ public:
   virtual vnl_vector<double> GetCoefficients(LinearTransformType *tran) = 0;
   virtual void GetTransform(const vnl_vector<double> &coeff, LinearTransformType *tran) = 0;
   virtual void compute(vnl_vector<double> const& x, double *f, vnl_vector<double>* g) = 0;
+
+  // Whether compute_gauss_newton() is available, i.e., the metric is a sum of squares
+  virtual bool SupportsGaussNewton() const { return false; }
+
+  // Compute the function, its gradient and the Gauss-Newton approximation of its Hessian
+  virtual void compute_gauss_newton(vnl_vector<double> const& x, double *f,
+                                    vnl_vector<double> *g, vnl_matrix<double> *H)
+    { throw GreedyException("Gauss-Newton optimization is not supported by this cost function"); }
 };
 
 /**
@@ -84,6 +93,11 @@ public:
   // Cost function computation
   virtual void compute(vnl_vector<double> const& x, double *f, vnl_vector<double>* g);
 
+  // Gauss-Newton computation, supported for the SSD metric
+  virtual bool SupportsGaussNewton() const;
+  virtual void compute_gauss_newton(vnl_vector<double> const& x, double *f,
+                                    vnl_vector<double> *g, vnl_matrix<double> *H);
+
 protected:
   typedef typename ParentType::ImageType ImageType;
   typedef typename ParentType::ImagePointer ImagePointer;
@@ -101,6 +115,10 @@ protected:
   VectorImagePointer m_Phi, m_GradMetric, m_GradMask;
   ImagePointer m_Metric, m_Mask;
 
+  // NCC working image for functions without a parent, which may be evaluated
+  // concurrently and so cannot share the working image of the helper
+  typename OFHelperType::MultiComponentImagePointer m_NCCWorkingImage;
+
   // Last set of coefficients evaluated
   vnl_vector<double> last_coeff;
 };
@@ -124,6 +142,10 @@ public:
   virtual void compute(vnl_vector<double> const& x, double *f, vnl_vector<double>* g);
   virtual vnl_vector<double> GetOptimalParameterScaling(const itk::Size<VDim> &image_dim);
 
+  virtual bool SupportsGaussNewton() const { return m_PureFunction.SupportsGaussNewton(); }
+  virtual void compute_gauss_newton(vnl_vector<double> const& x, double *f,
+                                    vnl_vector<double> *g, vnl_matrix<double> *H);
+
   void map_phys_to_vox(const vnl_vector<double> &x_phys, vnl_vector<double> &x_vox);
 
 protected:
@@ -163,6 +185,10 @@ public:
   // Cost function computation
   virtual void compute(vnl_vector<double> const& x, double *f, vnl_vector<double>* g);
 
+  virtual bool SupportsGaussNewton() const { return m_PureFunction->SupportsGaussNewton(); }
+  virtual void compute_gauss_newton(vnl_vector<double> const& x, double *f,
+                                    vnl_vector<double> *g, vnl_matrix<double> *H);
+
   const vnl_vector<double> &GetScaling() { return m_Scaling; }
 
 protected:
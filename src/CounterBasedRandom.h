@@ -0,0 +1,85 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __CounterBasedRandom_h_
+#define __CounterBasedRandom_h_
+
+#include <cmath>
+#include <stdint.h>
+
+/**
+ * A stateless counter-based random number generator, Philox4x32-10 from
+ * Salmon et al., "Parallel random numbers: as easy as 1, 2, 3" (SC 2011).
+ * Each output is a pure function of a 128-bit counter and a 64-bit key, so
+ * values can be generated in any order and by any number of threads, and a
+ * given counter always maps to the same value.
+ */
+class CounterBasedRandom
+{
+public:
+  CounterBasedRandom(uint32_t seed0, uint32_t seed1 = 0)
+    { m_Key[0] = seed0; m_Key[1] = seed1; }
+
+  /** Generate four 32-bit random words for the given counter */
+  void Generate(const uint32_t ctr[4], uint32_t out[4]) const
+    {
+    uint32_t c[4] = { ctr[0], ctr[1], ctr[2], ctr[3] };
+    uint32_t k[2] = { m_Key[0], m_Key[1] };
+    for(int r = 0; r < 10; r++)
+      {
+      uint64_t p0 = (uint64_t) 0xD2511F53u * c[0];
+      uint64_t p1 = (uint64_t) 0xCD9E8D57u * c[2];
+      uint32_t hi0 = (uint32_t) (p0 >> 32), lo0 = (uint32_t) p0;
+      uint32_t hi1 = (uint32_t) (p1 >> 32), lo1 = (uint32_t) p1;
+      c[0] = hi1 ^ c[1] ^ k[0]; c[1] = lo1;
+      c[2] = hi0 ^ c[3] ^ k[1]; c[3] = lo0;
+      k[0] += 0x9E3779B9u; k[1] += 0xBB67AE85u;
+      }
+    for(int i = 0; i < 4; i++)
+      out[i] = c[i];
+    }
+
+  /**
+   * Standard normal variate for an element of a stream. The index (e.g., voxel
+   * offset) fills the low 64 bits of the counter, the two stream identifiers
+   * (e.g., component and pyramid level) fill the rest
+   */
+  double Normal(uint64_t index, uint32_t stream0, uint32_t stream1) const
+    {
+    uint32_t ctr[4] = { (uint32_t) index, (uint32_t) (index >> 32), stream0, stream1 }, out[4];
+    Generate(ctr, out);
+
+    // Box-Muller transform, u1 is in (0,1) and u2 in [0,1)
+    const double two_m32 = 1.0 / 4294967296.0;
+    double u1 = (out[0] + 0.5) * two_m32, u2 = out[1] * two_m32;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+    }
+
+protected:
+  uint32_t m_Key[2];
+};
+
+#endif // __CounterBasedRandom_h_
@@ -33,6 +33,18 @@
 #include <string>
 #include <algorithm>
 #include <cstdarg>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <type_traits>
 
 #include "lddmm_common.h"
 #include "lddmm_data.h"
@@ -43,11 +55,18 @@
 #include <itkTimeProbe.h>
 #include <itkImageFileWriter.h>
 #include <itkCastImageFilter.h>
+#include <itkDefaultConvertPixelTraits.h>
 
 #include "MultiImageRegistrationHelper.h"
 #include "FastWarpCompositeImageFilter.h"
+#include "TransformChainWarpImageFilter.h"
 #include "MultiComponentImageMetricBase.h"
 #include "WarpFunctors.h"
+#include "ParallelGzip.h"
+#include "ParallelFor.h"
+#include "DisplacementJacobianDeterminantImageFilter.h"
+#include "OneDimensionalInPlaceGaussianFilter.h"
+#include "GreedyCudaDeformable.h"
 
 #include <vnl/algo/vnl_powell.h>
 #include <vnl/algo/vnl_svd.h>
@@ -91,6 +110,135 @@ private:
   
 };
 
+/**
+ * Report the outcome of -crop-mask once the helper has built the composites
+ */
+template <class TOFHelper>
+void ReportCropToMask(GreedyStdOut &gout, const GreedyParameters &param, TOFHelper &of_helper)
+{
+  if(param.crop_to_mask_margin < 0)
+    return;
+
+  if(of_helper.IsCroppedToMask())
+    gout.printf("Cropping reference space to mask: %d of %d voxels\n",
+                (int) of_helper.GetCropRegion().GetNumberOfPixels(),
+                (int) of_helper.GetUncroppedReferenceSpace()->GetBufferedRegion().GetNumberOfPixels());
+  else
+    gout.printf("Not cropping to the mask: the mask is empty or fills the image, "
+                "or the finest pyramid level is not full resolution\n");
+}
+
+
+/**
+ * Writes the intermediate images of -dump-moving from a background thread, so
+ * that the registration does not wait while they are compressed. Each image is
+ * copied when it is queued. At most a few copies are queued at a time, and
+ * queueing waits for room when the queue is full, which bounds their memory.
+ */
+template <class TLDDMM>
+class GreedyDumpWriter
+{
+public:
+  typedef typename TLDDMM::ImageType ImageType;
+  typedef typename TLDDMM::VectorImageType VectorImageType;
+
+  GreedyDumpWriter(unsigned int max_queued = 4)
+    : m_MaxQueued(max_queued), m_Stop(false) {}
+
+  ~GreedyDumpWriter() { this->Finish(); }
+
+  void WriteImage(ImageType *src, const char *fn)
+  {
+    DumpItem item;
+    item.img = TLDDMM::new_img(src);
+    TLDDMM::img_copy(src, item.img);
+    item.filename = fn;
+    this->Enqueue(item);
+  }
+
+  void WriteVectorImage(VectorImageType *src, const char *fn)
+  {
+    DumpItem item;
+    item.vimg = TLDDMM::new_vimg(src);
+    TLDDMM::vimg_copy(src, item.vimg);
+    item.filename = fn;
+    this->Enqueue(item);
+  }
+
+  /** Wait until all queued images are written and stop the thread */
+  void Finish()
+  {
+    {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Stop = true;
+    }
+    m_Condition.notify_all();
+    if(m_Thread.joinable())
+      m_Thread.join();
+    m_Stop = false;
+  }
+
+protected:
+
+  struct DumpItem
+  {
+    typename ImageType::Pointer img;
+    typename VectorImageType::Pointer vimg;
+    std::string filename;
+  };
+
+  void Enqueue(const DumpItem &item)
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    // The writer thread is started on first use
+    if(!m_Thread.joinable())
+      m_Thread = std::thread(&GreedyDumpWriter::WriteLoop, this);
+
+    m_Condition.wait(lock, [this] { return m_Queue.size() < m_MaxQueued; });
+    m_Queue.push_back(item);
+    m_Condition.notify_all();
+  }
+
+  void WriteLoop()
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while(true)
+      {
+      m_Condition.wait(lock, [this] { return m_Stop || m_Queue.size(); });
+      if(m_Queue.empty())
+        break;
+
+      DumpItem item = m_Queue.front();
+      m_Queue.pop_front();
+      m_Condition.notify_all();
+
+      // Write without holding the lock. A failed dump is reported but does not
+      // stop the registration
+      lock.unlock();
+      try
+        {
+        if(item.vimg)
+          TLDDMM::vimg_write(item.vimg, item.filename.c_str());
+        else
+          TLDDMM::img_write(item.img, item.filename.c_str());
+        }
+      catch(std::exception &exc)
+        {
+        fprintf(stderr, "Failed to write %s: %s\n", item.filename.c_str(), exc.what());
+        }
+      item = DumpItem();
+      lock.lock();
+      }
+  }
+
+  unsigned int m_MaxQueued;
+  bool m_Stop;
+  std::deque<DumpItem> m_Queue;
+  std::mutex m_Mutex;
+  std::condition_variable m_Condition;
+  std::thread m_Thread;
+};
 
 // Helper function to get the RAS coordinate of the center of 
 // an image
@@ -113,6 +261,63 @@ GetImageCenterinNiftiSpace(itk::ImageBase<VDim> *image)
 }
 
 
+// Helper functions to make images whose buffered region does not start at index zero
+// (e.g., the output of a padding or cropping filter) usable in the registration code,
+// which assumes zero-based regions. The image is rebased by moving the origin to the
+// first buffered voxel, so that its physical space is unchanged. The pixel buffer is
+// shared with the original image, i.e., no voxels are copied.
+template <unsigned int VDim>
+bool
+IsZeroBasedImage(const itk::ImageBase<VDim> *image)
+{
+  const itk::ImageRegion<VDim> &r = image->GetBufferedRegion();
+  for(unsigned int d = 0; d < VDim; d++)
+    if(r.GetIndex()[d] != 0 || r.GetSize()[d] != image->GetLargestPossibleRegion().GetSize()[d])
+      return false;
+  return true;
+}
+
+template <unsigned int VDim>
+void
+CopyZeroBasedGeometry(const itk::ImageBase<VDim> *image, itk::ImageBase<VDim> *view)
+{
+  itk::Point<double, VDim> origin;
+  image->TransformIndexToPhysicalPoint(image->GetBufferedRegion().GetIndex(), origin);
+  view->SetRegions(itk::ImageRegion<VDim>(image->GetBufferedRegion().GetSize()));
+  view->SetOrigin(origin);
+  view->SetSpacing(image->GetSpacing());
+  view->SetDirection(image->GetDirection());
+  view->SetNumberOfComponentsPerPixel(image->GetNumberOfComponentsPerPixel());
+}
+
+template <class TImage>
+itk::SmartPointer<TImage>
+ZeroBasedImageView(TImage *image)
+{
+  itk::SmartPointer<TImage> view = image;
+  if(!IsZeroBasedImage(image))
+    {
+    view = TImage::New();
+    CopyZeroBasedGeometry(image, view.GetPointer());
+    view->SetPixelContainer(image->GetPixelContainer());
+    }
+  return view;
+}
+
+template <unsigned int VDim>
+typename itk::ImageBase<VDim>::Pointer
+ZeroBasedImageBaseView(itk::ImageBase<VDim> *image)
+{
+  typename itk::ImageBase<VDim>::Pointer view = image;
+  if(!IsZeroBasedImage(image))
+    {
+    view = itk::ImageBase<VDim>::New();
+    CopyZeroBasedGeometry(image, view.GetPointer());
+    }
+  return view;
+}
+
+
 
 
 #include "itkTransformFileReader.h"
@@ -352,29 +557,85 @@ GreedyApproach<VDim, TReal>
     {
     itk::Object *cached_object = it->second.target;
     TImage *image = dynamic_cast<TImage *>(cached_object);
+
+    // Imported buffers may have a view of the requested type, or be converted to it
+    typename ImportedBufferMap::const_iterator itb = m_ImportedBuffers.find(filename);
+    itk::SmartPointer<TImage> converted;
+    if(!image && itb != m_ImportedBuffers.end())
+      {
+      for(unsigned int i = 0; i < itb->second.views.size() && !image; i++)
+        image = dynamic_cast<TImage *>(itb->second.views[i].GetPointer());
+      if(!image)
+        image = converted = ConvertImportedBuffer<TImage>(itb->second);
+      }
+
     if(!image)
       throw GreedyException("Cached image %s cannot be cast to type %s",
                             filename.c_str(), typeid(TImage).name());
-    itk::SmartPointer<TImage> pointer = image;
 
-    // The component type is unknown here
+    // Images computed in memory may have a non-zero region index
+    itk::SmartPointer<TImage> pointer = ZeroBasedImageView(image);
+
+    // Imported buffers know their component type, other cached images do not
+    if(comp_type)
+      *comp_type = itb != m_ImportedBuffers.end()
+                   ? itb->second.comp_type
+                   : itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+
+    return pointer;
+    }
+
+  // Quantized warps are not an ITK format and are read by LDDMMData
+  if(LDDMMType::vimg_is_quantized(filename.c_str()))
+    {
+    VectorImagePointer warp;
+    LDDMMType::vimg_read_quantized(filename.c_str(), warp);
+    TImage *image = dynamic_cast<TImage *>(warp.GetPointer());
+    if(!image)
+      throw GreedyException("Quantized warp %s cannot be read as type %s",
+                            filename.c_str(), typeid(TImage).name());
     if(comp_type)
-      *comp_type = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+      *comp_type = itk::ImageIOBase::FLOAT;
 
+    itk::SmartPointer<TImage> pointer = image;
     return pointer;
     }
 
-  // Read the image using ITK reader
+  // Map a decompressed copy of the image if one has been cached on disk
+  if(m_MappedImageCache.IsEnabled())
+    {
+    itk::SmartPointer<TImage> mapped = m_MappedImageCache.Read<TImage>(filename, comp_type);
+    if(mapped)
+      return mapped;
+    }
+
+  // Read the image using ITK reader, decompressing in parallel if the file was
+  // written by ParallelGzip
+  std::string fn_read = ParallelGzip::PrepareRead(filename);
   typedef itk::ImageFileReader<TImage> ReaderType;
   typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(filename.c_str());
-  reader->Update();
+  reader->SetFileName(fn_read.c_str());
+  try
+    {
+    reader->Update();
+    }
+  catch(...)
+    {
+    ParallelGzip::FinishRead(filename, fn_read);
+    throw;
+    }
+  ParallelGzip::FinishRead(filename, fn_read);
 
   // Store the component type if requested
   if(comp_type)
     *comp_type = reader->GetImageIO()->GetComponentType();
 
   itk::SmartPointer<TImage> pointer = reader->GetOutput();
+
+  // Add the decoded image to the on-disk cache for later reads
+  if(m_MappedImageCache.IsEnabled())
+    m_MappedImageCache.Store<TImage>(filename, pointer, reader->GetImageIO()->GetComponentType());
+
   return pointer;
 }
 
@@ -408,17 +669,14 @@ GreedyApproach<VDim, TReal>
     if(!image_base)
       throw GreedyException("Cached image %s cannot be cast to type %s",
                             filename.c_str(), typeid(ImageBaseType).name());
-    typename ImageBaseType::Pointer pointer = image_base;
+
+    // Images computed in memory may have a non-zero region index
+    typename ImageBaseType::Pointer pointer = ZeroBasedImageBaseView(image_base);
     return pointer;
     }
 
-  // Read the image using ITK reader
-  typedef itk::ImageFileReader<ImageType> ReaderType;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(filename.c_str());
-  reader->Update();
-
-  typename ImageBaseType::Pointer pointer = reader->GetOutput();
+  // Read the image from disk
+  typename ImageBaseType::Pointer pointer = LDDMMType::img_read(filename.c_str()).GetPointer();
   return pointer;
 }
 
@@ -462,6 +720,7 @@ GreedyApproach<VDim, TReal>
         typename CopyFilterType::Pointer copier = CopyFilterType::New();
         copier->SetInput(img);
         copier->GraftOutput(cached_typed);
+        ParallelFor::ApplyThreadQuota(copier);
         copier->Update();
         }
       else throw GreedyException("Cached image %s cannot be cast to type %s",
@@ -487,12 +746,14 @@ GreedyApproach<VDim, TReal>
     else
       {
       // Some other type (e.g., LabelImage). We use the image writer and ignore the comp
+      std::string fn_write = ParallelGzip::PrepareWrite(filename);
       typedef itk::ImageFileWriter<TImage> WriterType;
       typename WriterType::Pointer writer = WriterType::New();
-      writer->SetFileName(filename.c_str());
-      writer->SetUseCompression(true);
+      writer->SetFileName(fn_write.c_str());
+      writer->SetUseCompression(fn_write == filename);
       writer->SetInput(img);
       writer->Update();
+      ParallelGzip::FinishWrite(filename, fn_write);
       }
     }
 }
@@ -505,6 +766,12 @@ template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::ReadImages(GreedyParameters &param, OFHelperType &ofhelper)
 {
+  // If the helper belongs to a session and its fixed side has been built, only the
+  // moving images are read and the fixed side is kept
+  bool in_session = (m_SessionHelper && &ofhelper == m_SessionHelper);
+  bool reuse_fixed = in_session && m_SessionFixed.size() == param.inputs.size();
+  std::vector<CompositeImagePointer> moving_images;
+
   // If the parameters include a sequence of transforms, apply it first
   VectorImagePointer moving_pre_warp;
 
@@ -515,7 +782,9 @@ void GreedyApproach<VDim, TReal>
   for(int i = 0; i < param.inputs.size(); i++)
     {
     // Read fixed and moving images
-    CompositeImagePointer imgFix = ReadImageViaCache<CompositeImageType>(param.inputs[i].fixed);
+    CompositeImagePointer imgFix = reuse_fixed
+                                   ? m_SessionFixed[i]
+                                   : ReadImageViaCache<CompositeImageType>(param.inputs[i].fixed);
     CompositeImagePointer imgMov = ReadImageViaCache<CompositeImageType>(param.inputs[i].moving);
 
     // Store the fixed image and/or check it
@@ -536,19 +805,25 @@ void GreedyApproach<VDim, TReal>
 
       // Interpolate the moving image using the transform chain
       LDDMMType::interp_cimg(imgMov, moving_pre_warp, warped_moving, false, true);
+      imgMov = warped_moving;
+      }
 
-      // Add the image pair to the helper
-      ofhelper.AddImagePair(imgFix, warped_moving, param.inputs[i].weight);
+    if(reuse_fixed)
+      {
+      // The fixed image is already in the helper
+      moving_images.push_back(imgMov);
       }
     else
       {
-      // Add to the helper object
+      // Add the image pair to the helper, and keep the fixed image for the session
       ofhelper.AddImagePair(imgFix, imgMov, param.inputs[i].weight);
+      if(in_session)
+        m_SessionFixed.push_back(imgFix);
       }
     }
 
   // Read the fixed-space mask
-  if(param.gradient_mask.size())
+  if(param.gradient_mask.size() && !reuse_fixed)
     {
     typedef typename OFHelperType::FloatImageType MaskType;
     typename MaskType::Pointer imgMask =
@@ -557,7 +832,7 @@ void GreedyApproach<VDim, TReal>
     ofhelper.SetGradientMask(imgMask);
     }
 
-  if(param.gradient_mask_trim_radius.size() == VDim)
+  if(param.gradient_mask_trim_radius.size() == VDim && !reuse_fixed)
     {
     if(param.gradient_mask.size())
       throw GreedyException("Cannot specify both gradient mask and gradient mask trim radius");
@@ -566,11 +841,11 @@ void GreedyApproach<VDim, TReal>
     }
 
   // Read the moving-space mask
+  typename OFHelperType::FloatImagePointer imgMovMask;
   if(param.moving_mask.size())
     {
     typedef typename OFHelperType::FloatImageType MaskType;
-    typename MaskType::Pointer imgMovMask =
-        ReadImageViaCache<MaskType>(param.moving_mask);
+    imgMovMask = ReadImageViaCache<MaskType>(param.moving_mask);
 
     if(moving_pre_warp.IsNotNull())
       {
@@ -579,19 +854,16 @@ void GreedyApproach<VDim, TReal>
 
       // Interpolate the moving image using the transform chain
       LDDMMType::interp_img(imgMovMask, moving_pre_warp, warped_moving_mask, false, true);
-
-      // Add the warped mask to the helper
-      ofhelper.SetMovingMask(warped_moving_mask);
+      imgMovMask = warped_moving_mask;
       }
-    else
-      {
-      // Add the mask to the helper object
+
+    // Add the mask to the helper object
+    if(!reuse_fixed)
       ofhelper.SetMovingMask(imgMovMask);
-      }
     }
 
   // Set the fixed mask (distinct from gradient mask)
-  if(param.fixed_mask.size())
+  if(param.fixed_mask.size() && !reuse_fixed)
     {
     typedef typename OFHelperType::FloatImageType MaskType;
     typename MaskType::Pointer imgFixMask =
@@ -601,17 +873,139 @@ void GreedyApproach<VDim, TReal>
 
   // Generate the optimized composite images. For the NCC metric, we add random noise to
   // the composite images, specified in units of the interquartile intensity range.
-  double noise = (param.metric == GreedyParameters::NCC) ? param.ncc_noise_factor : 0.0;
+  bool is_ncc = param.metric == GreedyParameters::NCC || param.metric == GreedyParameters::NCC_APPROX;
+  double noise = is_ncc ? param.ncc_noise_factor : 0.0;
+
+  if(reuse_fixed)
+    {
+    // Rebuild only the moving side of the composite images
+    ofhelper.ReplaceMovingImages(moving_images, imgMovMask, noise);
+    }
+  else
+    {
+    // Build the composite images
+    ofhelper.BuildCompositeImages(noise);
 
-  // Build the composite images
-  ofhelper.BuildCompositeImages(noise);
+    // If the metric is NCC, then also apply special processing to the gradient masks
+    if(is_ncc)
+      ofhelper.DilateCompositeGradientMasksForNCC(array_caster<VDim>::to_itkSize(param.metric_radius));
+    }
+
+  // The finest level of the pyramids is a copy of the inputs, which can be dropped
+  if(param.flag_release_inputs)
+    ofhelper.ReleaseInputImages();
+
+  // Compensated summation for the NCC neighborhood sums
+  ofhelper.SetNCCCompensatedSummation(param.flag_ncc_compensated_sums);
+
+  // Parzen windowing for the mutual information histograms
+  ofhelper.SetMIParzenWindow(param.flag_mi_parzen);
 
-  // If the metric is NCC, then also apply special processing to the gradient masks
-  if(param.metric == GreedyParameters::NCC)
-    ofhelper.DilateCompositeGradientMasksForNCC(array_caster<VDim>::to_itkSize(param.metric_radius));
+  // Storage of the images read by the SSD metric
+  ofhelper.SetCompositeStorage(static_cast<typename OFHelperType::CompositeStorage>(param.half_storage));
 }
 
 #include <vnl/algo/vnl_lbfgs.h>
+#include "itkMultiThreader.h"
+
+/**
+ * Data shared by the threads that evaluate rigid search candidates. Each thread
+ * has its own cost function, so that the working images are not shared
+ */
+template <unsigned int VDim, typename TReal>
+struct RigidSearchThreadData
+{
+  typedef RigidCostFunction<VDim, TReal> CostFunction;
+  typedef typename CostFunction::LinearTransformType LinearTransformType;
+
+  std::vector<CostFunction *> functions;
+  std::vector<typename LinearTransformType::Pointer> candidates;
+  std::vector< vnl_vector<double> > coeff;
+  std::vector<double> values;
+};
+
+template <unsigned int VDim, typename TReal>
+ITK_THREAD_RETURN_TYPE RigidSearchThreadCallback(void *arg)
+{
+  itk::MultiThreader::ThreadInfoStruct *info = (itk::MultiThreader::ThreadInfoStruct *) arg;
+  RigidSearchThreadData<VDim, TReal> *data = (RigidSearchThreadData<VDim, TReal> *) info->UserData;
+
+  // Candidates are assigned to threads in an interleaved fashion
+  int tid = info->ThreadID, nt = info->NumberOfThreads;
+
+  // The candidates are evaluated concurrently, so each metric computation uses a
+  // single thread
+  ParallelFor::ThreadQuota quota(nt > 1 ? 1 : 0);
+  typename RigidSearchThreadData<VDim, TReal>::CostFunction *fn = data->functions[tid];
+  for(unsigned int i = tid; i < data->candidates.size(); i += nt)
+    {
+    // GetCoefficients also sets up the flip used by the cost function
+    data->coeff[i] = fn->GetCoefficients(data->candidates[i]);
+    fn->compute(data->coeff[i], &data->values[i], NULL);
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Levenberg-Marquardt minimization of an affine cost function that provides the
+ * Gauss-Newton approximation of its Hessian. Each iteration costs one evaluation
+ * of the metric, which also yields the gradient and the Hessian at the new point.
+ * The tolerance on the relative decrease of the function is the one used for LBFGS
+ */
+template <unsigned int VDim, typename TReal>
+void GaussNewtonAffineMinimize(AbstractAffineCostFunction<VDim, TReal> *acf,
+                               vnl_vector<double> &x, int max_evals, GreedyStdOut &gout)
+{
+  const double f_tol = 2.220446049250313e-9;
+  unsigned int n = x.size();
+
+  double f;
+  vnl_vector<double> g(n);
+  vnl_matrix<double> H;
+  acf->compute_gauss_newton(x, &f, &g, &H);
+
+  double lambda = 1.0e-3;
+  for(int iter = 1; iter < max_evals; iter++)
+    {
+    // Solve the damped normal equations (H + lambda diag(H)) dx = -g. The diagonal
+    // is floored so that parameters with no signal are still damped
+    double max_diag = 0.0;
+    for(unsigned int i = 0; i < n; i++)
+      max_diag = std::max(max_diag, H(i,i));
+
+    vnl_matrix<double> H_damp = H;
+    for(unsigned int i = 0; i < n; i++)
+      H_damp(i,i) += lambda * std::max(H(i,i), 1.0e-12 * max_diag);
+
+    vnl_vector<double> x_try = x + vnl_svd<double>(H_damp).solve(-g);
+
+    double f_try;
+    vnl_vector<double> g_try(n);
+    vnl_matrix<double> H_try;
+    acf->compute_gauss_newton(x_try, &f_try, &g_try, &H_try);
+
+    gout.printf("GN iter %3d  f = %12.8f  lambda = %8.2e  %s\n",
+                iter, f_try, lambda, f_try < f ? "accept" : "reject");
+
+    if(f_try < f)
+      {
+      // Accept the step and move towards Gauss-Newton
+      double df = (f - f_try) / std::max(std::max(fabs(f), fabs(f_try)), 1.0);
+      x = x_try; g = g_try; H = H_try; f = f_try;
+      lambda = std::max(lambda * 0.1, 1.0e-9);
+      if(df <= f_tol)
+        break;
+      }
+    else
+      {
+      // Reject the step and move towards gradient descent
+      lambda *= 10.0;
+      if(lambda > 1.0e8)
+        break;
+      }
+    }
+}
 
 template <unsigned int VDim, typename TReal>
 vnl_matrix<double>
@@ -667,10 +1061,10 @@ GreedyApproach<VDim, TReal>
       Q(i,j) = Qp(i,j);
     }
 
-  // A = vnl_matrix_inverse<double>(T_mov) * (Q * T_fix);
-  // b = vnl_matrix_inverse<double>(T_mov) * (p - s_mov + Q * s_fix);
-  A=vnl_svd<double>(T_mov).solve(Q * T_fix);
-  b=vnl_svd<double>(T_mov).solve(p - s_mov + Q * s_fix);
+  // Both solves share a single decomposition of T_mov
+  vnl_svd<double> svd_mov(T_mov);
+  A = svd_mov.solve(Q * T_fix);
+  b = svd_mov.solve(p - s_mov + Q * s_fix);
 
   typename LinearTransformType::MatrixType tran_A;
   typename LinearTransformType::OffsetType tran_b;
@@ -769,8 +1163,9 @@ int GreedyApproach<VDim, TReal>
   typedef ScalingCostFunction<VDim, TReal> ScalingCostFunction;
   typedef PhysicalSpaceAffineCostFunction<VDim, TReal> PhysicalSpaceAffineCostFunction;
 
-  // Create an optical flow helper object
-  OFHelperType of_helper;
+  // Create an optical flow helper object, or use the one kept by the session
+  OFHelperType local_helper;
+  OFHelperType &of_helper = this->GetRegistrationHelper(param, "affine", local_helper);
   
   // Object for text output
   GreedyStdOut gout(param.verbosity);
@@ -781,8 +1176,23 @@ int GreedyApproach<VDim, TReal>
   // Add random sampling jitter for affine stability at voxel edges
   of_helper.SetJitterSigma(param.affine_jitter);
 
+  // Crop the reference space to the mask if requested. The affine matrix is in
+  // physical space and is not affected by the crop
+  of_helper.SetCropToMask(param.crop_to_mask_margin);
+
   // Read the image pairs to register - this will also build the composite pyramids
   ReadImages(param, of_helper);
+  ReportCropToMask(gout, param, of_helper);
+
+  // Restrict the affine metric to a subsample of the voxels, fixed for the whole run
+  if(param.affine_sampling_fraction < 1.0)
+    {
+    itk::Size<VDim> ncc_radius = array_caster<VDim>::to_itkSize(param.metric_radius);
+    bool is_ncc = param.metric == GreedyParameters::NCC || param.metric == GreedyParameters::NCC_APPROX;
+    of_helper.BuildAffineSampleMasks(param.affine_sampling_fraction,
+                                     param.flag_affine_sampling_stratified,
+                                     is_ncc ? &ncc_radius : NULL);
+    }
 
   // Matrix describing current transform in physical space
   vnl_matrix<double> Q_physical;
@@ -790,8 +1200,10 @@ int GreedyApproach<VDim, TReal>
   // The number of resolution levels
   unsigned nlevels = param.iter_per_level.size();
 
-  // Clear the metric log
+  // Clear the metric log and the last result
   m_MetricLog.clear();
+  m_ProfileLog.clear();
+  m_Result.Reset();
 
   // Iterate over the resolution levels
   for(unsigned int level = 0; level < nlevels; ++level)
@@ -821,6 +1233,9 @@ int GreedyApproach<VDim, TReal>
       pure_acf = affine_acf;
       }
 
+    if(param.flag_gauss_newton && !acf->SupportsGaussNewton())
+      throw GreedyException("Gauss-Newton optimization (-gn) requires the SSD metric and 12 degrees of freedom");
+
     // Current transform
     typename LinearTransformType::Pointer tLevel = LinearTransformType::New();
 
@@ -905,7 +1320,11 @@ int GreedyApproach<VDim, TReal>
         search_fun.compute(xBest, &fBest, NULL);
         std::cout << "Rigid search -> Initial best: " << fBest << " " << xBest << std::endl;
 
-        // Loop over random iterations
+        // All of the random candidates are generated up front, in the same order as
+        // before, so that the result does not depend on how they are evaluated
+        typedef RigidSearchThreadData<VDim, TReal> SearchData;
+        SearchData sd;
+        std::vector< vnl_matrix<double> > Qp_candidates;
         for(int i = 0; i < param.rigid_search.iterations; i++)
           {
           // Depending on the search mode, we either apply a small rotation, or any random rotation,
@@ -956,19 +1375,56 @@ int GreedyApproach<VDim, TReal>
           typename LinearTransformType::Pointer tSearchTry = LinearTransformType::New();
           MapPhysicalRASSpaceToAffine(of_helper, level, Qp_search, tSearchTry);
 
-          // Evaluate the metric for this point
-          vnl_vector<double> xTry = search_fun.GetCoefficients(tSearchTry);
-          double f = 0.0;
-          search_fun.compute(xTry, &f, NULL);
+          sd.candidates.push_back(tSearchTry);
+          Qp_candidates.push_back(Qp_search);
+          }
+
+        // Number of threads used to evaluate the candidates
+        int n_search_threads = param.rigid_search.threads > 0
+            ? param.rigid_search.threads
+            : ParallelFor::GetNumberOfThreads();
+        n_search_threads = std::max(1, std::min(n_search_threads, param.rigid_search.iterations));
+
+        // Each thread gets its own cost function. These do not report to the metric log,
+        // and, having no parent, keep their own NCC working image
+        for(int t = 0; t < n_search_threads; t++)
+          sd.functions.push_back(new RigidCostFunction(&param, NULL, level, &of_helper));
+        sd.coeff.resize(sd.candidates.size());
+        sd.values.resize(sd.candidates.size(), 0.0);
+
+        if(n_search_threads > 1)
+          {
+          // Each search thread limits its own metric computations to one thread
+          itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+          mt->SetNumberOfThreads(n_search_threads);
+          mt->SetSingleMethod(RigidSearchThreadCallback<VDim, TReal>, &sd);
+          mt->SingleMethodExecute();
+          }
+        else
+          {
+          itk::MultiThreader::ThreadInfoStruct info;
+          info.ThreadID = 0;
+          info.NumberOfThreads = 1;
+          info.UserData = &sd;
+          RigidSearchThreadCallback<VDim, TReal>(&info);
+          }
+
+        for(int t = 0; t < n_search_threads; t++)
+          delete sd.functions[t];
+
+        // Pick the best candidate, in the order in which the candidates were generated
+        for(int i = 0; i < param.rigid_search.iterations; i++)
+          {
+          double f = sd.values[i];
 
           // Is this an improvement?
           if(f < fBest)
             {
             fBest = f;
-            tLevel->SetMatrix(tSearchTry->GetMatrix());
-            tLevel->SetOffset(tSearchTry->GetOffset());
+            tLevel->SetMatrix(sd.candidates[i]->GetMatrix());
+            tLevel->SetOffset(sd.candidates[i]->GetOffset());
             std::cout << "Rigid search -> Iter " << i << ": " << fBest << " "
-                      << xTry << " det = " << vnl_determinant(Qp_search)
+                      << sd.coeff[i] << " det = " << vnl_determinant(Qp_candidates[i])
                       <<  std::endl;
             }
           }
@@ -1082,6 +1538,10 @@ int GreedyApproach<VDim, TReal>
         optimizer->minimize(xLevel);
         delete optimizer;
 
+        }
+      else if(param.flag_gauss_newton)
+        {
+        GaussNewtonAffineMinimize(acf, xLevel, param.iter_per_level[level], gout);
         }
       else
         {
@@ -1137,8 +1597,11 @@ int GreedyApproach<VDim, TReal>
     delete pure_acf;
     }
 
-  // Write the final affine transform
-  this->WriteAffineMatrixViaCache(param.output, Q_physical);
+  // Store the final affine transform in the result and write it
+  m_Result.SetAffineMatrix(Q_physical);
+  m_Result.SetMetricLog(m_MetricLog);
+  if(param.output.size())
+    this->WriteAffineMatrixViaCache(param.output, Q_physical);
   return 0;
 }
 
@@ -1148,7 +1611,10 @@ int GreedyApproach<VDim, TReal>
 
 #include "itkStatisticsImageFilter.h"
 
-/** My own time probe because itk's use of fork is messing up my debugging */
+/**
+ * My own time probe because itk's use of fork is messing up my debugging. It keeps
+ * track of both wall time and CPU time, the latter being summed over all threads
+ */
 class GreedyTimeProbe
 {
 public:
@@ -1157,30 +1623,40 @@ public:
   void Stop();
   double GetMean() const;
   double GetTotal() const;
+  double GetTotalCPU() const;
+  unsigned long GetRuns() const { return m_Runs; }
 protected:
-  double m_TotalTime;
-  double m_StartTime;
+  typedef std::chrono::steady_clock ClockType;
+  double m_TotalTime, m_TotalCPUTime;
+  ClockType::time_point m_StartTime;
+  clock_t m_StartCPUTime;
+  bool m_Running;
   unsigned long m_Runs;
 };
 
 GreedyTimeProbe::GreedyTimeProbe()
 {
   m_TotalTime = 0.0;
-  m_StartTime = 0.0;
-  m_Runs = 0.0;
+  m_TotalCPUTime = 0.0;
+  m_StartCPUTime = 0;
+  m_Running = false;
+  m_Runs = 0;
 }
 
 void GreedyTimeProbe::Start()
 {
-  m_StartTime = clock();
+  m_StartTime = ClockType::now();
+  m_StartCPUTime = clock();
+  m_Running = true;
 }
 
 void GreedyTimeProbe::Stop()
 {
-  if(m_StartTime == 0.0)
+  if(!m_Running)
     throw GreedyException("Timer stop without start");
-  m_TotalTime += clock() - m_StartTime;
-  m_StartTime = 0.0;
+  m_TotalCPUTime += (clock() - m_StartCPUTime) * 1.0 / CLOCKS_PER_SEC;
+  m_TotalTime += std::chrono::duration<double>(ClockType::now() - m_StartTime).count();
+  m_Running = false;
   m_Runs++;
 }
 
@@ -1189,12 +1665,37 @@ double GreedyTimeProbe::GetMean() const
   if(m_Runs == 0)
     return 0.0;
   else
-    return m_TotalTime / (CLOCKS_PER_SEC * m_Runs);
+    return m_TotalTime / m_Runs;
 }
 
 double GreedyTimeProbe::GetTotal() const
 {
-  return m_TotalTime / CLOCKS_PER_SEC;
+  return m_TotalTime;
+}
+
+double GreedyTimeProbe::GetTotalCPU() const
+{
+  return m_TotalCPUTime;
+}
+
+// Add the timing of a phase to a level profile
+void AddPhaseToProfile(GreedyLevelProfile &profile, const char *name, const GreedyTimeProbe &probe)
+{
+  GreedyPhaseProfile phase;
+  phase.name = name;
+  phase.wall_time = probe.GetTotal();
+  phase.cpu_time = probe.GetTotalCPU();
+  phase.runs = probe.GetRuns();
+  profile.phases.push_back(phase);
+}
+
+// Memory used by the pixel buffer of an image (zero if not allocated)
+template <class TImage>
+size_t GetImageBufferBytes(TImage *image)
+{
+  if(!image || !image->GetPixelContainer())
+    return 0;
+  return image->GetPixelContainer()->Size() * sizeof(typename TImage::PixelContainer::Element);
 }
 
 template <unsigned int VDim, typename TReal>
@@ -1230,6 +1731,206 @@ GreedyApproach<VDim, TReal>
   return b_line;
 }
 
+/**
+ * Smoothing of the gradient and the update in the Fourier domain, used with
+ * -smooth-method FFT and NAVIER. The FFT plan and the kernel transforms are
+ * computed once per level, so the cost of each smoothing does not depend on
+ * sigma. The convolution is periodic, i.e., the field wraps around the edges
+ * of the image rather than being padded with zeros.
+ */
+template <unsigned int VDim, typename TReal>
+class GreedyFourierSmoother
+{
+public:
+  typedef LDDMMData<TReal, VDim> LDDMMType;
+  typedef typename LDDMMType::ImageType ImageType;
+  typedef typename LDDMMType::ImagePointer ImagePointer;
+  typedef typename LDDMMType::VectorImageType VectorImageType;
+  typedef typename LDDMMType::ImageBaseType ImageBaseType;
+  typedef typename LDDMMType::Vec Vec;
+  typedef typename LDDMMType::RegionType RegionType;
+
+  // Sigmas are in physical units, navier_alpha (used if positive) in voxels. The
+  // smoothed fields are set to zero outside of the region interior
+  GreedyFourierSmoother(ImageBaseType *ref, Vec sigma_pre_phys, Vec sigma_post_phys,
+                        double navier_alpha, const RegionType &interior)
+    : m_FFT(ref), m_Interior(interior)
+    {
+    Vec sigma_pre_vox, sigma_post_vox;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      sigma_pre_vox[d] = sigma_pre_phys[d] / ref->GetSpacing()[d];
+      sigma_post_vox[d] = sigma_post_phys[d] / ref->GetSpacing()[d];
+      }
+
+    m_KernelPre = LDDMMType::new_img(ref);
+    if(navier_alpha > 0)
+      LDDMMType::compute_navier_stokes_green_kernel_ft(m_KernelPre, navier_alpha);
+    else
+      LDDMMType::compute_gaussian_kernel_ft(m_KernelPre, sigma_pre_vox);
+
+    m_KernelPost = LDDMMType::new_img(ref);
+    LDDMMType::compute_gaussian_kernel_ft(m_KernelPost, sigma_post_vox);
+    }
+
+  // Smoothing with the pre and post kernel, the border is cleared as in
+  // vimg_smooth_withborder. The source and target may be the same image
+  void SmoothPre(VectorImageType *src, VectorImageType *trg)
+    {
+    m_FFT.convolution_fft(src, m_KernelPre, false, trg);
+    LDDMMType::vimg_clear_outside(trg, m_Interior);
+    }
+
+  void SmoothPost(VectorImageType *src, VectorImageType *trg)
+    {
+    m_FFT.convolution_fft(src, m_KernelPost, false, trg);
+    LDDMMType::vimg_clear_outside(trg, m_Interior);
+    }
+
+protected:
+  LDDMMFFTInterface<TReal, VDim> m_FFT;
+  ImagePointer m_KernelPre, m_KernelPost;
+  RegionType m_Interior;
+};
+
+/**
+ * Iterations of a deformable level on a CUDA device, used with -gpu. The images
+ * of the level are uploaded when the object is created, and the field stays on
+ * the device until it is read back with DownloadField. The steps mirror the CPU
+ * code in RunDeformable, see GreedyCudaDeformable
+ */
+template <unsigned int VDim, typename TReal>
+class GreedyDeviceLevel : public GreedyCudaDeformable
+{
+public:
+  typedef MultiImageOpticalFlowHelper<TReal, VDim> OFHelperType;
+  typedef LDDMMData<TReal, VDim> LDDMMType;
+  typedef typename LDDMMType::VectorImageType VectorImageType;
+  typedef typename LDDMMType::ImageBaseType ImageBaseType;
+  typedef typename LDDMMType::Vec Vec;
+  typedef typename LDDMMType::RegionType RegionType;
+
+  /**
+   * The reason why the iterations of a level cannot run on the device, or an
+   * empty string if they can
+   */
+  static std::string GetUnsupportedReason(const GreedyParameters &param, OFHelperType &of_helper,
+                                          int level, bool flag_restricted, bool flag_def_affine,
+                                          bool flag_track_inverse)
+    {
+    if(!std::is_same<TReal, float>::value)
+      return "the GPU requires single precision (-float)";
+    if(VDim != 2 && VDim != 3)
+      return "the GPU supports 2D and 3D images only";
+    if(param.metric != GreedyParameters::SSD && param.metric != GreedyParameters::NCC)
+      return "the GPU supports the SSD and NCC metrics only";
+    if(of_helper.GetFixedComposite(level)->GetNumberOfComponentsPerPixel() > (unsigned int) MaxComponents)
+      return "too many image components for the GPU";
+    if(param.smoothing_method != GreedyParameters::SMOOTH_ITK
+       && param.smoothing_method != GreedyParameters::SMOOTH_RECURSIVE)
+      return "the GPU supports Gaussian smoothing (-smooth-method ITK or RECURSIVE) only";
+    if(param.half_storage != GreedyParameters::HALF_NONE)
+      return "-half-storage is not supported on the GPU";
+    if(flag_restricted)
+      return "-mask-domain is not supported on the GPU";
+    if(flag_def_affine)
+      return "-ia-residual is not supported on the GPU";
+    if(param.metric == GreedyParameters::NCC && of_helper.GetMovingMask(level))
+      return "moving masks are not supported with NCC on the GPU";
+    if(flag_track_inverse)
+      return "-oinv-inc is not supported on the GPU";
+    if(param.flag_stationary_velocity_mode
+       && (param.flag_incompressibility_mode || param.flag_stationary_velocity_mode_use_lie_bracket
+           || param.sv_exp_refresh > 0))
+      return "-sv-incompr, -svlb and -sv-exp-refresh are not supported on the GPU";
+    if(param.flag_dump_moving)
+      return "-dump-moving is not supported on the GPU";
+    if(!GreedyCudaDeformable::IsDeviceAvailable())
+      return "no CUDA device is available";
+    return std::string();
+    }
+
+  GreedyDeviceLevel(OFHelperType &of_helper, int level, const GreedyParameters &param,
+                    Vec sigma_pre_phys, Vec sigma_post_phys, const RegionType &interior)
+    : GreedyCudaDeformable(VDim, GetSize(of_helper.GetFixedComposite(level)).data(),
+                           GetSize(of_helper.GetMovingComposite(level)).data(),
+                           of_helper.GetFixedComposite(level)->GetNumberOfComponentsPerPixel())
+    {
+    this->SetFixedImage(FloatBuffer(of_helper.GetFixedComposite(level)));
+    this->SetMovingImage(FloatBuffer(of_helper.GetMovingComposite(level)));
+    this->SetWeights(of_helper.GetWeights().data());
+
+    // As on the CPU, the SSD gradient is multiplied by the user's gradient mask,
+    // while NCC is restricted to the gradient mask of the helper
+    if(param.metric == GreedyParameters::NCC)
+      {
+      this->SetMetricToNCC(param.metric_radius.data());
+      this->SetFixedMask(FloatBuffer(of_helper.GetGradientMask(level)));
+      }
+    else
+      {
+      this->SetMetricToSSD();
+      this->SetFixedMask(param.gradient_mask.size() ? FloatBuffer(of_helper.GetGradientMask(level)) : NULL);
+      }
+
+    // Sigmas in voxel units, raised to the smallest sigma of the recursive smoother
+    ImageBaseType *ref = of_helper.GetReferenceSpace(level);
+    double min_sigma = param.smoothing_method == GreedyParameters::SMOOTH_RECURSIVE
+                       ? OneDimensionalInPlaceGaussianFilter<VectorImageType>::GetMinimumRecursiveSigma()
+                       : 0.0;
+    double sigma_pre[VDim], sigma_post[VDim];
+    int index[VDim], size[VDim];
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      sigma_pre[d] = sigma_pre_phys[d] / ref->GetSpacing()[d];
+      sigma_post[d] = sigma_post_phys[d] / ref->GetSpacing()[d];
+      if(sigma_pre[d] > 0.0)
+        sigma_pre[d] = std::max(sigma_pre[d], min_sigma);
+      if(sigma_post[d] > 0.0)
+        sigma_post[d] = std::max(sigma_post[d], min_sigma);
+      index[d] = interior.GetIndex(d) - ref->GetBufferedRegion().GetIndex(d);
+      size[d] = interior.GetSize(d);
+      }
+    this->SetSmoothingSigmas(sigma_pre, sigma_post);
+    this->SetSmoothingInterior(index, size);
+    }
+
+  void UploadField(VectorImageType *u) { this->SetField(FloatBuffer(u)); }
+
+  void DownloadField(VectorImageType *u) { this->GetField(FloatBuffer(u)); }
+
+  void ComputeMetric(bool use_exponent, double eps, MultiComponentMetricReport &report)
+    {
+    report.ComponentMetrics.set_size(this->m_Comp);
+    report.TotalMetric = this->ComputeMetricAndGradient(use_exponent, eps,
+                                                        report.ComponentMetrics.data_block());
+    }
+
+protected:
+
+  static std::vector<int> GetSize(ImageBaseType *image)
+    {
+    std::vector<int> size(VDim);
+    for(unsigned int d = 0; d < VDim; d++)
+      size[d] = image->GetBufferedRegion().GetSize(d);
+    return size;
+    }
+
+  // The device works in single precision. The double precision instantiation
+  // never creates this object, see GetUnsupportedReason
+  template <class TImage> static float *FloatBuffer(TImage *)
+    { throw GreedyException("-gpu requires single precision (-float)"); }
+
+  static float *FloatBuffer(itk::Image<itk::CovariantVector<float, VDim>, VDim> *image)
+    { return image->GetBufferPointer()->GetDataPointer(); }
+
+  static float *FloatBuffer(itk::VectorImage<float, VDim> *image)
+    { return image->GetBufferPointer(); }
+
+  static float *FloatBuffer(itk::Image<float, VDim> *image)
+    { return image ? image->GetBufferPointer() : NULL; }
+};
+
 /**
  * This is the main function of the GreedyApproach algorithm
  */
@@ -1237,8 +1938,11 @@ template <unsigned int VDim, typename TReal>
 int GreedyApproach<VDim, TReal>
 ::RunDeformable(GreedyParameters &param)
 {
-  // Create an optical flow helper object
-  OFHelperType of_helper;
+  typedef typename LDDMMType::Vec VectorType;
+
+  // Create an optical flow helper object, or use the one kept by the session
+  OFHelperType local_helper;
+  OFHelperType &of_helper = this->GetRegistrationHelper(param, "deformable", local_helper);
   
   // Object for text output
   GreedyStdOut gout(param.verbosity);
@@ -1246,27 +1950,137 @@ int GreedyApproach<VDim, TReal>
   // Set the scaling factors for multi-resolution
   of_helper.SetDefaultPyramidFactors(param.iter_per_level.size());
 
-  // Set the scaling mode depending on the metric
-  if(param.metric == GreedyParameters::MAHALANOBIS)
-    of_helper.SetScaleFixedImageWithVoxelSize(true);
+  // Precompute the fixed NCC sums if requested
+  if(param.metric == GreedyParameters::NCC && param.flag_ncc_precompute_fixed)
+    of_helper.SetNCCPrecomputeFixedSums(true);
+
+  // Crop the reference space to the mask if requested
+  of_helper.SetCropToMask(param.crop_to_mask_margin);
+
+  // With -ia-residual, the initial affine (in physical RAS space) is kept out of the
+  // deformation and composed with it inside the metric, at every level
+  bool flag_affine_residual = param.flag_affine_residual && !param.initial_warp.size()
+                              && (param.affine_init_mode == RAS_FILENAME
+                                  || param.affine_init_mode == RAS_IDENTITY);
+  vnl_matrix<double> Q_residual(VDim+1, VDim+1);
+  Q_residual.set_identity();
+  if(param.flag_affine_residual)
+    {
+    if(!flag_affine_residual)
+      throw GreedyException("-ia-residual requires -ia or -ia-identity, and no -id");
+    if(param.metric == GreedyParameters::MAHALANOBIS)
+      throw GreedyException("-ia-residual is not supported with the Mahalanobis metric");
+    if(param.metric == GreedyParameters::NCC_APPROX)
+      throw GreedyException("The NCC_APPROX metric can not be combined with an affine in the deformation (-ia-residual)");
+    if(param.affine_init_mode == RAS_FILENAME)
+      Q_residual = ReadAffineMatrixViaCache(param.affine_init_transform);
+    }
+
+  // With -crop-mask, the written warps are zero outside of the crop box and the moving
+  // images on the fixed grid are cropped, which is only valid if the deformation starts
+  // from the identity. An initial affine must be kept out of the field with -ia-residual
+  if(param.crop_to_mask_margin >= 0
+     && (param.initial_warp.size() || (param.affine_init_mode != VOX_IDENTITY && !flag_affine_residual)))
+    throw GreedyException("-crop-mask requires the deformation to start from the identity: "
+                          "it cannot be combined with -id, or with -ia, -ia-identity and other "
+                          "initializations unless -ia-residual is used");
+
+  // With -mask-domain, the moving images are sampled through a deformation affine,
+  // which the approximate NCC and Mahalanobis metrics do not support
+  if(param.mask_domain_margin >= 0
+     && (param.metric == GreedyParameters::NCC_APPROX || param.metric == GreedyParameters::MAHALANOBIS))
+    throw GreedyException("-mask-domain is not supported with the NCC_APPROX and Mahalanobis metrics");
 
   // Read the image pairs to register
   ReadImages(param, of_helper);
+  ReportCropToMask(gout, param, of_helper);
 
   // An image pointer desribing the current estimate of the deformation
   VectorImagePointer uLevel = NULL;
 
+  // In greedy mode, the inverse warp can be updated along with the forward warp
+  // at every iteration, so that no inversion is needed at the end. The pointer
+  // holds the approximate inverse of uLevel
+  VectorImagePointer uInvLevel = NULL;
+
+  // The inverse is computed if it is written or kept in the result
+  bool flag_inverse = param.inverse_warp.size() || (m_KeepResultWarps && m_ResultComputeInverse);
+  bool flag_track_inverse = flag_inverse && param.flag_inverse_incremental
+                            && !param.flag_stationary_velocity_mode;
+
   // The number of resolution levels
   unsigned nlevels = param.iter_per_level.size();
 
-  // Clear the metric log
+  // Filter used to smooth the gradient and the deformation
+  typename LDDMMType::SmoothingMethod smooth_method =
+      (typename LDDMMType::SmoothingMethod) param.smoothing_method;
+
+  // Smoothing in the Fourier domain is handled separately
+  bool flag_fourier_smoothing =
+      param.smoothing_method == GreedyParameters::SMOOTH_FFT ||
+      param.smoothing_method == GreedyParameters::SMOOTH_NAVIER;
+#ifndef _LDDMM_FFT_
+  if(flag_fourier_smoothing)
+    throw GreedyException("-smooth-method FFT and NAVIER require greedy to be built with FFTW");
+#endif
+#ifndef _GREEDY_CUDA_
+  if(param.flag_gpu)
+    throw GreedyException("-gpu requires greedy to be built with GREEDY_USE_CUDA");
+#endif
+
+  // Clear the metric log and the last result
   m_MetricLog.clear();
-
+  m_ConvergenceLog.clear();
+  m_ProfileLog.clear();
+  m_Result.Reset();
+
+  // Resume from the checkpoint of an interrupted run with the same parameters. The
+  // levels before the checkpoint are skipped, and their metric log is restored
+  std::string checkpoint_key;
+  DeformableCheckpoint ckpt;
+  bool flag_resume = false;
+  if(param.checkpoint_file.size())
+    {
+    checkpoint_key = GetCheckpointKey(param);
+    flag_resume = ReadDeformableCheckpoint(param.checkpoint_file, checkpoint_key, ckpt);
+    if(flag_resume)
+      {
+      m_MetricLog = ckpt.metric_log;
+      m_ConvergenceLog = ckpt.convergence_log;
+      gout.printf("Resuming from checkpoint %s at level %d, iteration %d\n",
+                  param.checkpoint_file.c_str(), ckpt.level, ckpt.iter);
+      }
+    }
+
+  // The workspace that provides the memory for the intermediate images. The
+  // memory is sized for the finest level up front, so that the coarser levels
+  // and later calls to RunDeformable do not allocate
+  GreedyWorkspace *ws = this->GetWorkspace();
+  ws->ReleaseAll();
+  if(nlevels > 0)
+    ws->Reserve(GetDeformableWorkspaceSizes(param, of_helper.GetReferenceSpace(nlevels - 1),
+                                            flag_track_inverse));
+
+  // Background writer for the intermediate images dumped with -dump-moving
+  GreedyDumpWriter<LDDMMType> dump_writer;
+
+  // With -id-skip, a coarse level that starts from the initial warp is skipped if
+  // the initial warp is already converged there. The next level then reads the
+  // initial warp again, rather than upsampling it from the coarse level
+  bool flag_skip_test = param.initial_warp.size() && param.initial_warp_skip_tol > 0;
+  bool flag_skipped_level = false;
+
   // Iterate over the resolution levels
   for(unsigned int level = 0; level < nlevels; ++level)
     {
-    // Add stage to metric log
-    m_MetricLog.push_back(std::vector<MultiComponentMetricReport>());
+    // Skip the levels that were completed before the checkpoint
+    bool resume_level = flag_resume && level == ckpt.level;
+    if(flag_resume && level < ckpt.level)
+      continue;
+
+    // Add stage to metric log, unless it was restored from the checkpoint
+    if(!resume_level)
+      m_MetricLog.push_back(std::vector<MultiComponentMetricReport>());
 
     // Reference space
     ImageBaseType *refspace = of_helper.GetReferenceSpace(level);
@@ -1289,6 +2103,22 @@ int GreedyApproach<VDim, TReal>
       gout.printf("%s%f", d==0 ? " " : "x", sigma_post_phys[d]);
     gout.printf("\n");
 
+    // The recursive smoother raises sigmas below its minimum, tell the user
+    if(param.smoothing_method == GreedyParameters::SMOOTH_RECURSIVE)
+      {
+      double min_sigma = OneDimensionalInPlaceGaussianFilter<VectorImageType>::GetMinimumRecursiveSigma();
+      bool clamped = false;
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        double s_pre = sigma_pre_phys[d] / refspace->GetSpacing()[d];
+        double s_post = sigma_post_phys[d] / refspace->GetSpacing()[d];
+        clamped |= (s_pre > 0.0 && s_pre < min_sigma) || (s_post > 0.0 && s_post < min_sigma);
+        }
+      if(clamped)
+        gout.printf("  Warning: smoothing sigmas below %g voxel are raised to %g voxel by "
+                    "-smooth-method RECURSIVE, use BOX for smaller sigmas\n", min_sigma, min_sigma);
+      }
+
     // Set up timers for different critical components of the optimization
     GreedyTimeProbe tm_Gradient, tm_Gaussian1, tm_Gaussian2, tm_Iteration,
       tm_Integration, tm_Update, tm_UpdatePDE, tm_PDE;
@@ -1302,75 +2132,48 @@ int GreedyApproach<VDim, TReal>
     // This is the exponentiated uk, in stationary velocity mode it is uk^(2^N)
     VectorImagePointer uk_exp = VectorImageType::New();
 
+    // The velocity field from which uk_exp was computed, used for incremental updates
+    VectorImagePointer uk_exp_src = VectorImageType::New();
+
     // A pointer to the full warp image - either uk in greedy mode, or uk_exp in diff demons mdoe
     VectorImageType *uFull;
 
-    // Matrix work image (for Lie Bracket) 
-    typedef typename LDDMMType::MatrixImageType MatrixImageType;
-    typename MatrixImageType::Pointer work_mat = MatrixImageType::New();
-
     // Sparse solver for incompressibility mode
     void *incompressibility_solver = NULL;
 
+    // Fourier domain smoother, if used
+    GreedyFourierSmoother<VDim, TReal> *fourier_smoother = NULL;
+
     // Mask used for incompressibility purposes
     ImagePointer incompressibility_mask = NULL;
 
-    // Allocate the intermediate data
-    LDDMMType::alloc_vimg(uk, refspace);
-    if(param.iter_per_level[level] > 0)
-      {
-      LDDMMType::alloc_img(iTemp, refspace);
-      LDDMMType::alloc_vimg(viTemp, refspace);
-      LDDMMType::alloc_vimg(uk1, refspace);
-
-      // These are only allocated in diffeomorphic demons mode
-      if(param.flag_stationary_velocity_mode)
-        {
-        LDDMMType::alloc_vimg(uk_exp, refspace);
-        LDDMMType::alloc_mimg(work_mat, refspace);
-        }
-
-      if(param.flag_stationary_velocity_mode && param.flag_incompressibility_mode)
-        {
-        if(param.gradient_mask.size())
-          {
-          std::cout << "Setting up incompressibility mask" << std::endl;
-          incompressibility_mask = LDDMMType::new_img(of_helper.GetGradientMask(level));
-          LDDMMType::img_copy(of_helper.GetGradientMask(level), incompressibility_mask);
-          LDDMMType::img_threshold_in_place(incompressibility_mask, 0.9, 1.0, 1.0, 0.0);
-          }
-
-        std::cout << "Setting up incompressibility solver" << std::endl;
-        incompressibility_solver = LDDMMType::poisson_pde_zero_boundary_initialize(uk, incompressibility_mask);
-        }
-      }
+    // The deformation field in the full reference space. Unless the iterations are
+    // restricted to the gradient mask bounding box, this is the same image as uk
+    VectorImagePointer uk_full = uk;
+    ws->AllocateImage(uk_full.GetPointer(), refspace);
 
     // Initialize the deformation field from last iteration
-    if(uLevel.IsNotNull())
+    bool level_from_initial_warp = false;
+    if(uLevel.IsNotNull() && !flag_skipped_level)
       {
-      LDDMMType::vimg_resample_identity(uLevel, refspace, uk);
-      LDDMMType::vimg_scale_in_place(uk, 2.0);
-      uLevel = uk;
+      LDDMMType::vimg_resample_identity(uLevel, refspace, uk_full);
+      LDDMMType::vimg_scale_in_place(uk_full, 2.0);
+
+      // The previous level's warp is no longer needed
+      ws->ReleaseImage(uLevel.GetPointer());
+      uLevel = uk_full;
       }
     else if(param.initial_warp.size())
       {
       // The user supplied an initial warp or initial root warp. In this case, we
       // do not start iteration from zero, but use the initial warp to start from
-      VectorImagePointer uInit = VectorImageType::New();
-
-      // Read the warp file
-      LDDMMType::vimg_read(param.initial_warp.c_str(), uInit );
-
-      // Convert the warp file into voxel units from physical units
-      OFHelperType::PhysicalWarpToVoxelWarp(uInit, uInit, uInit);
-
-      // Scale the initial warp by the pyramid level
-      LDDMMType::vimg_resample_identity(uInit, refspace, uk);
-      LDDMMType::vimg_scale_in_place(uk, 1.0 / (1 << level));
-      uLevel = uk;
-      itk::Index<VDim> test; test.Fill(24);
+      if(uLevel.IsNotNull())
+        ws->ReleaseImage(uLevel.GetPointer());
+      ReadInitialWarp(param.initial_warp, refspace, uk_full);
+      uLevel = uk_full;
+      level_from_initial_warp = true;
       }
-    else if(param.affine_init_mode != VOX_IDENTITY)
+    else if(param.affine_init_mode != VOX_IDENTITY && !flag_affine_residual)
       {
       typename LinearTransformType::Pointer tran = LinearTransformType::New();
 
@@ -1392,15 +2195,236 @@ int GreedyApproach<VDim, TReal>
         }
 
       // Create an initial warp
-      OFHelperType::AffineToField(tran, uk);
-      uLevel = uk;
+      OFHelperType::AffineToField(tran, uk_full);
+      uLevel = uk_full;
+      }
+
+    // Restore the deformation field saved in the checkpoint
+    if(resume_level)
+      {
+      if(ckpt.warp.size() != uk_full->GetBufferedRegion().GetNumberOfPixels() * VDim)
+        throw GreedyException("Checkpoint %s does not match the reference space of level %d",
+                              param.checkpoint_file.c_str(), level);
+      std::copy(ckpt.warp.begin(), ckpt.warp.end(), uk_full->GetBufferPointer()->GetDataPointer());
+      uLevel = uk_full;
+      }
+
+    // The residual affine in voxel units of this level. The deformation starts from
+    // zero and only holds what the affine does not explain
+    typename LinearTransformType::Pointer def_affine = NULL;
+    if(flag_affine_residual)
+      {
+      def_affine = LinearTransformType::New();
+      MapPhysicalRASSpaceToAffine(of_helper, level, Q_residual, def_affine);
+      }
+
+    // Optionally restrict the iterations at this level to the bounding box of the
+    // gradient mask. The box is padded by the support of the smoothing kernels and
+    // the metric radius, plus the user-specified margin. The helper then supplies
+    // cropped fixed images, and the deformation outside of the box is left unchanged.
+    // The moving images are not cropped, so that the deformation (which may hold the
+    // initial transform) can map the box anywhere in the moving image
+    typename OFHelperType::RegionType active_region = refspace->GetBufferedRegion();
+    if(param.mask_domain_margin >= 0 && param.iter_per_level[level] > 0)
+      {
+      int pad = 0;
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        double sigma_vox = (sigma_pre_phys[d] + sigma_post_phys[d]) / refspace->GetSpacing()[d];
+        int pad_d = (int) std::ceil(3.0 * sigma_vox);
+        if((param.metric == GreedyParameters::NCC || param.metric == GreedyParameters::NCC_APPROX)
+           && d < param.metric_radius.size())
+          pad_d += param.metric_radius[d];
+        pad = std::max(pad, pad_d);
+        }
+      int margin = param.mask_domain_margin + pad;
+
+      active_region = of_helper.GetGradientMaskBoundingRegion(level, margin);
+      if(active_region != refspace->GetBufferedRegion())
+        {
+        of_helper.RestrictLevelToRegion(level, active_region);
+        gout.printf("  Iterations restricted to %d of %d voxels\n",
+                    (int) active_region.GetNumberOfPixels(),
+                    (int) refspace->GetBufferedRegion().GetNumberOfPixels());
+
+        uk = VectorImageType::New();
+        }
+      }
+    bool flag_restricted = (uk != uk_full);
+
+    // The sample positions in the cropped space are shifted to the uncropped moving
+    // images. The border of the smoothed update is only cleared on the faces of the
+    // box that lie on the edge of the image, not on the faces created by the crop
+    typename OFHelperType::RegionType smooth_interior = refspace->GetBufferedRegion();
+    if(flag_restricted)
+      smooth_interior = typename OFHelperType::RegionType(active_region.GetSize());
+    smooth_interior.ShrinkByRadius(1);
+    if(flag_restricted)
+      {
+      def_affine = OFHelperType::GetRestrictedLevelAffine(active_region, def_affine);
+      const typename OFHelperType::RegionType &full_region = refspace->GetBufferedRegion();
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        long lo = smooth_interior.GetIndex(d), hi = lo + smooth_interior.GetSize(d);
+        if(active_region.GetIndex(d) > full_region.GetIndex(d))
+          lo--;
+        if(active_region.GetUpperIndex()[d] < full_region.GetUpperIndex()[d])
+          hi++;
+        smooth_interior.SetIndex(d, lo);
+        smooth_interior.SetSize(d, hi - lo);
+        }
+      }
+
+    // The space in which the iterations are performed
+    ImageBaseType *iterspace = of_helper.GetReferenceSpace(level);
+
+    // Allocate the intermediate data
+    if(flag_restricted)
+      {
+      ws->AllocateImage(uk.GetPointer(), iterspace);
+      OFHelperType::ExtractRegion(uk_full, active_region, uk);
+      }
+
+    // Set up the incrementally updated inverse warp for this level. The inverse of
+    // the restricted warp is not defined over the whole reference space, so in that
+    // case we fall back to inverting the final warp
+    VectorImagePointer uk_inv = NULL;
+    if(flag_track_inverse && flag_restricted)
+      {
+      gout.printf("  Incremental inverse disabled, the final warp will be inverted\n");
+      if(uInvLevel.IsNotNull())
+        ws->ReleaseImage(uInvLevel.GetPointer());
+      uInvLevel = NULL;
+      flag_track_inverse = false;
+      }
+    else if(flag_track_inverse)
+      {
+      uk_inv = VectorImageType::New();
+      ws->AllocateImage(uk_inv.GetPointer(), refspace);
+
+      // The inverse kept from a skipped level is replaced by the inverse of the
+      // initial warp read at this level
+      if(uInvLevel.IsNotNull() && level_from_initial_warp)
+        {
+        ws->ReleaseImage(uInvLevel.GetPointer());
+        uInvLevel = NULL;
+        }
+
+      if(uInvLevel.IsNotNull())
+        {
+        LDDMMType::vimg_resample_identity(uInvLevel, refspace, uk_inv);
+        LDDMMType::vimg_scale_in_place(uk_inv, 2.0);
+        ws->ReleaseImage(uInvLevel.GetPointer());
+        }
+      else if(resume_level)
+        {
+        if(ckpt.inverse_warp.size() != ckpt.warp.size())
+          throw GreedyException("Checkpoint %s does not hold the inverse warp", param.checkpoint_file.c_str());
+        std::copy(ckpt.inverse_warp.begin(), ckpt.inverse_warp.end(), uk_inv->GetBufferPointer()->GetDataPointer());
+        }
+      else if(uLevel.IsNotNull())
+        {
+        // The initial warp is inverted once, at the level where it is read
+        of_helper.ComputeDeformationFieldInverse(uk_full, uk_inv, param.warp_exponent);
+        }
+      uInvLevel = uk_inv;
+      }
+
+    if(param.iter_per_level[level] > 0)
+      {
+      ws->AllocateImage(iTemp.GetPointer(), iterspace);
+      ws->AllocateImage(viTemp.GetPointer(), iterspace);
+      ws->AllocateImage(uk1.GetPointer(), iterspace);
+
+      // These are only allocated in diffeomorphic demons mode
+      if(param.flag_stationary_velocity_mode)
+        {
+        ws->AllocateImage(uk_exp.GetPointer(), iterspace);
+        if(param.sv_exp_refresh > 0)
+          ws->AllocateImage(uk_exp_src.GetPointer(), iterspace);
+        }
+
+      if(param.flag_stationary_velocity_mode && param.flag_incompressibility_mode)
+        {
+        if(param.gradient_mask.size())
+          {
+          std::cout << "Setting up incompressibility mask" << std::endl;
+          incompressibility_mask = LDDMMType::new_img(of_helper.GetGradientMask(level));
+          LDDMMType::img_copy(of_helper.GetGradientMask(level), incompressibility_mask);
+          LDDMMType::img_threshold_in_place(incompressibility_mask, 0.9, 1.0, 1.0, 0.0);
+          }
 
-      itk::Index<VDim> test; test.Fill(24);
+        std::cout << "Setting up incompressibility solver" << std::endl;
+        incompressibility_solver = LDDMMType::poisson_pde_zero_boundary_initialize(
+                                     uk, incompressibility_mask,
+                                     (typename LDDMMType::PoissonSolverMethod) param.incompressibility_solver);
+        }
+
+      if(flag_fourier_smoothing)
+        {
+        double alpha = param.smoothing_method == GreedyParameters::SMOOTH_NAVIER
+                       ? param.smoothing_navier_alpha : 0.0;
+        fourier_smoother = new GreedyFourierSmoother<VDim, TReal>(
+                             iterspace, sigma_pre_phys, sigma_post_phys, alpha, smooth_interior);
+        }
+      }
+
+    // With -gpu, the iterations of this level run on the CUDA device, unless the
+    // level uses options that only the CPU code supports
+    GreedyDeviceLevel<VDim, TReal> *device = NULL;
+    if(param.flag_gpu && param.iter_per_level[level] > 0)
+      {
+      std::string reason = GreedyDeviceLevel<VDim, TReal>::GetUnsupportedReason(
+                             param, of_helper, level, flag_restricted, def_affine.IsNotNull(),
+                             flag_track_inverse);
+      if(reason.size())
+        {
+        gout.printf("  Iterations run on the CPU: %s\n", reason.c_str());
+        }
+      else
+        {
+        device = new GreedyDeviceLevel<VDim, TReal>(
+                   of_helper, level, param, sigma_pre_phys, sigma_post_phys, smooth_interior);
+        device->UploadField(uk);
+        gout.printf("  Iterations run on the GPU\n");
+        }
       }
 
+    // The first iteration, which is later than zero when resuming from the checkpoint
+    unsigned int iter_start = resume_level ? ckpt.iter : 0;
+
+    // Convergence record for this level, and the thresholds for early termination
+    GreedyLevelConvergence conv;
+    conv.level = level;
+    conv.iterations = iter_start;
+    conv.max_iterations = param.iter_per_level[level];
+    conv.converged = false;
+    conv.metric_change = -1.0;
+    conv.update_norm = -1.0;
+    double conv_tol = param.conv_tolerance[level];
+    double conv_upd = param.conv_update_norm[level];
+
+    // Whether this level may be skipped after evaluating the initial warp. The
+    // finest level is always run
+    bool skip_test = flag_skip_test && level_from_initial_warp && !resume_level
+                     && level + 1 < nlevels;
+    flag_skipped_level = false;
+
     // Iterate for this level
-    for(unsigned int iter = 0; iter < param.iter_per_level[level]; iter++)
+    for(unsigned int iter = iter_start; iter < param.iter_per_level[level]; iter++)
       {
+      // Save the state at the start of this iteration, so that an interrupted run
+      // can resume from here
+      if(param.checkpoint_file.size() && iter % param.checkpoint_interval == 0
+         && !(resume_level && iter == iter_start))
+        {
+        if(device)
+          device->DownloadField(uk);
+        if(flag_restricted)
+          OFHelperType::PasteRegion(uk, uk_full, active_region);
+        WriteDeformableCheckpoint(param.checkpoint_file, checkpoint_key, level, iter, uk_full, uk_inv);
+        }
+
       // Start the iteration timer
       tm_Iteration.Start();
 
@@ -1412,9 +2436,31 @@ int GreedyApproach<VDim, TReal>
         {
         tm_Integration.Start();
 
-        // This is the exponentiation of the stationary velocity field
-        // Take current warp to 'exponent' power - this is the actual warp
-        LDDMMType::vimg_exp(uk, uk_exp, viTemp, param.warp_exponent, 1.0);
+        if(device)
+          {
+          device->Exponentiate(param.warp_exponent);
+          }
+        else if(param.sv_exp_refresh > 0 && iter % param.sv_exp_refresh != 0 && iter != iter_start)
+          {
+          // Incremental update. With d = v' - v, exp(v') ~ exp(v) o exp(d) to first
+          // order, and since d is small, exp(d) ~ id + d. This costs a single
+          // composition instead of 2^N. uk1 is free at this point
+          LDDMMType::vimg_apply(viTemp, uk, uk_exp_src,
+                                [](VectorType &d, const VectorType &v1, const VectorType &v0) { d = v1 - v0; });
+          LDDMMType::vimg_compose(uk_exp, viTemp, uk1);
+          std::swap(uk_exp, uk1);
+          }
+        else
+          {
+          // This is the exponentiation of the stationary velocity field
+          // Take current warp to 'exponent' power - this is the actual warp
+          LDDMMType::vimg_exp(uk, uk_exp, viTemp, param.warp_exponent, 1.0);
+          }
+
+        // Remember the velocity field that uk_exp corresponds to
+        if(param.sv_exp_refresh > 0)
+          LDDMMType::vimg_copy(uk, uk_exp_src);
+
         uFull = uk_exp;
 
         tm_Integration.Stop();
@@ -1430,20 +2476,26 @@ int GreedyApproach<VDim, TReal>
       // Begin gradient computation
       tm_Gradient.Start();
 
-      // Switch based on the metric
-      if(param.metric == GreedyParameters::SSD)
+      // Switch based on the metric. On the device, the weights of both metrics are
+      // scaled by epsilon, as in the SSD and NCC code below
+      if(device)
         {
-        of_helper.ComputeOpticalFlowField(level, uFull, iTemp, metric_report, uk1, eps);
+        device->ComputeMetric(param.flag_stationary_velocity_mode, eps, metric_report);
+        metric_report.Scale(1.0 / eps);
+        }
+      else if(param.metric == GreedyParameters::SSD)
+        {
+        // If there is a mask, the gradient is multiplied by the mask inside the metric
+        of_helper.ComputeOpticalFlowField(level, uFull, iTemp, metric_report, uk1, eps,
+                                          param.gradient_mask.size() ? of_helper.GetGradientMask(level) : NULL,
+                                          def_affine);
         metric_report.Scale(1.0 / eps);
-
-        // If there is a mask, multiply the gradient by the mask
-        if(param.gradient_mask.size())
-          LDDMMType::vimg_multiply_in_place(uk1, of_helper.GetGradientMask(level));
         }
 
       else if(param.metric == GreedyParameters::MI || param.metric == GreedyParameters::NMI)
         {
-        of_helper.ComputeMIFlowField(level, param.metric == GreedyParameters::NMI, uFull, iTemp, metric_report, uk1, eps);
+        of_helper.ComputeMIFlowField(level, param.metric == GreedyParameters::NMI, uFull, iTemp, metric_report, uk1, eps,
+                                     def_affine);
 
         // If there is a mask, multiply the gradient by the mask
         if(param.gradient_mask.size())
@@ -1455,7 +2507,16 @@ int GreedyApproach<VDim, TReal>
         itk::Size<VDim> radius = array_caster<VDim>::to_itkSize(param.metric_radius);
 
         // Compute the metric - no need to multiply by the mask, this happens already in the NCC metric code
-        of_helper.ComputeNCCMetricImage(level, uFull, radius, iTemp, metric_report, uk1, eps);
+        of_helper.ComputeNCCMetricImage(level, uFull, radius, iTemp, metric_report, uk1, eps, def_affine);
+        metric_report.Scale(1.0 / eps);
+        }
+      else if(param.metric == GreedyParameters::NCC_APPROX)
+        {
+        itk::Size<VDim> radius = array_caster<VDim>::to_itkSize(param.metric_radius);
+
+        // Compute the metric - the gradient mask is applied in the metric code. There
+        // is no affine in the deformation, this is checked before the images are read
+        of_helper.ComputeApproximateNCCMetricImage(level, uFull, radius, iTemp, metric_report, uk1, eps);
         metric_report.Scale(1.0 / eps);
         }
       else if(param.metric == GreedyParameters::MAHALANOBIS)
@@ -1478,27 +2539,61 @@ int GreedyApproach<VDim, TReal>
         {
         char fname[256];
         sprintf(fname, "dump_gradient_lev%02d_iter%04d.nii.gz", level, iter);
-        LDDMMType::vimg_write(uk1, fname);
+        dump_writer.WriteVectorImage(uk1, fname);
         }
 
       // We have now computed the gradient vector field. Next, we smooth it
       tm_Gaussian1.Start();
-      LDDMMType::vimg_smooth_withborder(uk1, viTemp, sigma_pre_phys, 1);
+      if(device)
+        device->SmoothGradient();
+      else if(fourier_smoother)
+        fourier_smoother->SmoothPre(uk1, viTemp);
+      else
+        {
+        LDDMMType::vimg_smooth(uk1, viTemp, sigma_pre_phys, smooth_method, param.smoothing_box_passes);
+        LDDMMType::vimg_clear_outside(viTemp, smooth_interior);
+        }
       tm_Gaussian1.Stop();
 
       // After smoothing, compute the maximum vector norm and use it as a normalizing
-      // factor for the displacement field
-      if(param.time_step_mode == GreedyParameters::SCALE)
-        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iTemp, eps, false);
-      else if (param.time_step_mode == GreedyParameters::SCALEDOWN)
-        LDDMMType::vimg_normalize_to_fixed_max_length(viTemp, iTemp, eps, true);
+      // factor for the displacement field. The norm before the normalization is also
+      // what the convergence test compares to its threshold
+      if(param.time_step_mode != GreedyParameters::CONSTANT || conv_upd > 0 || skip_test)
+        {
+        TReal upd_min, upd_max;
+        if(device)
+          upd_max = device->GetUpdateMaximumNorm();
+        else
+          LDDMMType::vimg_norm_min_max(viTemp, NULL, upd_min, upd_max);
+        conv.update_norm = upd_max;
+
+        // Skip the level before the initial warp is updated if the update is small
+        if(skip_test && iter == 0 && upd_max < param.initial_warp_skip_tol)
+          {
+          tm_Iteration.Stop();
+          conv.converged = true;
+          flag_skipped_level = true;
+          gout.printf("Level %d skipped, the initial warp is converged (update %g vox)\n",
+                      level, conv.update_norm);
+          break;
+          }
+
+        if(upd_max > 0 && (param.time_step_mode == GreedyParameters::SCALE
+                           || (param.time_step_mode == GreedyParameters::SCALEDOWN && upd_max > eps)))
+          {
+          if(device)
+            device->ScaleUpdate(eps / upd_max);
+          else
+            LDDMMType::vimg_scale_in_place(viTemp, eps / upd_max);
+          }
+        }
 
       // Dump the smoothed gradient image if requested
       if(param.flag_dump_moving && 0 == iter % param.dump_frequency)
         {
         char fname[256];
         sprintf(fname, "dump_optflow_lev%02d_iter%04d.nii.gz", level, iter);
-        LDDMMType::vimg_write(viTemp, fname);
+        dump_writer.WriteVectorImage(viTemp, fname);
         }
 
       // Compute the updated deformation field - in uk1
@@ -1512,30 +2607,49 @@ int GreedyApproach<VDim, TReal>
         // v' = v + u (so-so)
         // v' = v + u + [v, u]/2 (this is the Lie bracket)
         
-        // Scale the update by 1 / 2^exponent (tiny update, first order approximation)
-        LDDMMType::vimg_scale_in_place(viTemp, 1.0 / (2 << param.warp_exponent));
+        // The update is scaled by 1 / 2^exponent (tiny update, first order approximation).
+        // The scaling is folded into the single pass that forms uk1
+        TReal s = 1.0 / (2 << param.warp_exponent);
 
         // Use appropriate update
         if(param.flag_stationary_velocity_mode_use_lie_bracket)
           {
-          // Use the Lie Bracket approximation (v + u + [v,u])
-          LDDMMType::lie_bracket(uk, viTemp, work_mat, uk1);
-          LDDMMType::vimg_scale_in_place(uk1, 0.5); 
-          LDDMMType::vimg_add_in_place(uk1, uk);
-          LDDMMType::vimg_add_in_place(uk1, viTemp);
+          // Use the Lie Bracket approximation (v + u + [v,u]/2). The bracket is linear
+          // in u, so it is computed on the unscaled update and scaled along with it
+          LDDMMType::lie_bracket(uk, viTemp, uk1);
+          LDDMMType::vimg_apply(uk1, uk, viTemp,
+                                [s](VectorType &w, const VectorType &v, const VectorType &u)
+                                { w = w * (0.5 * s) + v + u * s; });
+          }
+        else if(device)
+          {
+          device->AddScaledUpdate(s);
           }
         else
           {
-          LDDMMType::vimg_copy(uk, uk1);
-          LDDMMType::vimg_add_in_place(uk1, viTemp);
+          LDDMMType::vimg_apply(uk1, uk, viTemp,
+                                [s](VectorType &w, const VectorType &v, const VectorType &u)
+                                { w = v + u * s; });
           }
         }
       else
         {
         // This is compositive (uk1 = viTemp + uk o viTemp), which is what is done with
         // compositive demons and ANTS
-        LDDMMType::interp_vimg(uk, viTemp, 1.0, uk1);
-        LDDMMType::vimg_add_in_place(uk1, viTemp);
+        if(device)
+          device->ComposeUpdate();
+        else
+          LDDMMType::vimg_compose(uk, viTemp, uk1);
+
+        // The inverse of the composition is (id - viTemp) o (id + uk_inv) to first
+        // order, i.e., uk_inv - viTemp o (id + uk_inv). This only warm-starts the
+        // refinement below, which inverts the smoothed field. uk is free until it
+        // receives the smoothed update, so it holds the interpolated update
+        if(uk_inv)
+          {
+          LDDMMType::interp_vimg(viTemp, uk_inv, 1.0, uk);
+          LDDMMType::vimg_subtract_in_place(uk_inv, uk);
+          }
         }
       tm_Update.Stop();
 
@@ -1544,12 +2658,20 @@ int GreedyApproach<VDim, TReal>
         {
         char fname[256];
         sprintf(fname, "dump_uk1_lev%02d_iter%04d.nii.gz", level, iter);
-        LDDMMType::vimg_write(uk1, fname);
+        dump_writer.WriteVectorImage(uk1, fname);
         }
 
       // Another layer of smoothing (diffusion-like)
       tm_Gaussian2.Start();
-      LDDMMType::vimg_smooth_withborder(uk1, uk, sigma_post_phys, 1);
+      if(device)
+        device->SmoothField();
+      else if(fourier_smoother)
+        fourier_smoother->SmoothPost(uk1, uk);
+      else
+        {
+        LDDMMType::vimg_smooth(uk1, uk, sigma_post_phys, smooth_method, param.smoothing_box_passes);
+        LDDMMType::vimg_clear_outside(uk, smooth_interior);
+        }
       tm_Gaussian2.Stop();
 
       // Optional incompressibility step
@@ -1568,7 +2690,7 @@ int GreedyApproach<VDim, TReal>
           {
           char fname[256];
           sprintf(fname, "dump_divv_pre_lev%02d_iter%04d.nii.gz", level, iter);
-          LDDMMType::img_write(iTemp, fname);
+          dump_writer.WriteImage(iTemp, fname);
           }
 
         // TODO: this should not be temporary!
@@ -1592,15 +2714,56 @@ int GreedyApproach<VDim, TReal>
           char fname[256];
           sprintf(fname, "dump_divv_post_lev%02d_iter%04d.nii.gz", level, iter);
           LDDMMType::field_divergence(uk, iTemp, true);
-          LDDMMType::img_write(iTemp, fname);
+          dump_writer.WriteImage(iTemp, fname);
           }
         }
       tm_UpdatePDE.Stop();
+
+      // Bring the inverse in line with the smoothed (and projected) forward field
+      if(uk_inv)
+        LDDMMType::vimg_refine_inverse(uk, uk_inv, uk1, 3);
       tm_Iteration.Stop();
+      conv.iterations = iter + 1;
+
+      // Relative change of the metric over the last conv_window iterations
+      const std::vector<MultiComponentMetricReport> &mlog = m_MetricLog[level];
+      if(mlog.size() > (size_t) param.conv_window)
+        {
+        double m_old = mlog[mlog.size() - 1 - param.conv_window].TotalMetric;
+        double m_new = mlog.back().TotalMetric;
+        conv.metric_change = fabs(m_new - m_old) / (m_old != 0.0 ? fabs(m_old) : 1.0);
+        }
+
+      // Stop the level when all the enabled tests pass
+      if((conv_tol > 0 || conv_upd > 0)
+         && (conv_tol <= 0 || (conv.metric_change >= 0 && conv.metric_change < conv_tol))
+         && (conv_upd <= 0 || conv.update_norm < conv_upd))
+        {
+        conv.converged = true;
+        gout.printf("Level %d converged after %u iterations (metric change %g, update %g vox)\n",
+                    level, conv.iterations, conv.metric_change, conv.update_norm);
+        break;
+        }
       }
 
-    // Store the end result
-    uLevel = uk;
+    // Bring the field back from the device
+    if(device)
+      {
+      device->DownloadField(uk);
+      delete device;
+      }
+
+    // Record how the level ended
+    m_ConvergenceLog.push_back(conv);
+
+    // Store the end result. If the iterations were restricted, put the result
+    // back into the full reference space
+    if(flag_restricted)
+      {
+      OFHelperType::PasteRegion(uk, uk_full, active_region);
+      of_helper.RestoreLevel(level);
+      }
+    uLevel = uk_full;
 
     // Compute the jacobian of the deformation field - but only if we iterated at this level
     if(param.iter_per_level[level] > 0)
@@ -1610,14 +2773,24 @@ int GreedyApproach<VDim, TReal>
       LDDMMType::img_min_max(iTemp, jac_min, jac_max);
       gout.printf("END OF LEVEL %3d    DetJac Range: %8.4f  to %8.4f \n", level, jac_min, jac_max);
 
+      // Report how far the incremental inverse is from the true inverse, i.e., the
+      // largest displacement of uk_inv + uk o (id + uk_inv), in voxel units
+      if(uk_inv)
+        {
+        LDDMMType::vimg_compose(uk, uk_inv, uk1);
+        TReal res_min, res_max;
+        LDDMMType::vimg_norm_min_max(uk1, NULL, res_min, res_max);
+        gout.printf("  Incremental inverse max residual: %8.4f voxels\n", res_max);
+        }
+
       // Print final metric report
       MultiComponentMetricReport metric_report = this->GetMetricLog()[level].back();
       std::string iter_line = this->PrintIter(level, -1, metric_report);
       gout.printf("%s\n", iter_line.c_str());
       gout.flush();
       
-      // Print timing information
-      double n_it = param.iter_per_level[level];
+      // Print timing information, for the iterations run in this call
+      double n_it = std::max(1u, conv.iterations - iter_start);
       double t_total = tm_Iteration.GetTotal() / n_it;
       double t_gradient = tm_Gradient.GetTotal() / n_it;
       double t_gaussian = (tm_Gaussian1.GetTotal() + tm_Gaussian2.GetTotal()) / n_it;
@@ -1631,48 +2804,126 @@ int GreedyApproach<VDim, TReal>
         }
       gout.printf("  Avg. Integration Time     : %6.4fs  %5.2f%% \n", t_update, 100 * t_update / t_total);
       gout.printf("  Avg. Total Iteration Time : %6.4fs \n", t_total);
+
+      // Record the profile for this level
+      GreedyLevelProfile profile;
+      profile.level = level;
+      profile.iterations = conv.iterations;
+      profile.converged = conv.converged;
+      profile.voxels = active_region.GetNumberOfPixels();
+      profile.image_bytes =
+          GetImageBufferBytes(iTemp.GetPointer()) + GetImageBufferBytes(viTemp.GetPointer())
+          + GetImageBufferBytes(uk.GetPointer()) + GetImageBufferBytes(uk1.GetPointer())
+          + GetImageBufferBytes(uk_exp.GetPointer())
+          + GetImageBufferBytes(uk_exp_src.GetPointer())
+          + GetImageBufferBytes(incompressibility_mask.GetPointer());
+      profile.voxels_per_second = tm_Iteration.GetTotal() > 0
+                                  ? profile.voxels * n_it / tm_Iteration.GetTotal() : 0.0;
+
+      AddPhaseToProfile(profile, "iteration", tm_Iteration);
+      AddPhaseToProfile(profile, "integration", tm_Integration);
+      AddPhaseToProfile(profile, "gradient", tm_Gradient);
+      AddPhaseToProfile(profile, "smoothing_pre", tm_Gaussian1);
+      AddPhaseToProfile(profile, "update", tm_Update);
+      AddPhaseToProfile(profile, "smoothing_post", tm_Gaussian2);
+      AddPhaseToProfile(profile, "incompressibility", tm_UpdatePDE);
+      AddPhaseToProfile(profile, "pde_solve", tm_PDE);
+
+      m_ProfileLog.push_back(profile);
+      if(m_ProfileCallback)
+        m_ProfileCallback(profile, m_ProfileCallbackData);
       }
 
       // Deallocate the incompressibility solver
       if(incompressibility_solver)
         LDDMMType::poisson_pde_zero_boundary_dealloc(incompressibility_solver);
 
+      // Deallocate the Fourier smoother
+      delete fourier_smoother;
+
+      // Return the intermediate images to the workspace, except for uk, which is
+      // carried over to the next level as uLevel
+      ws->ReleaseImage(iTemp.GetPointer());
+      ws->ReleaseImage(viTemp.GetPointer());
+      ws->ReleaseImage(uk1.GetPointer());
+      ws->ReleaseImage(uk_exp.GetPointer());
+      ws->ReleaseImage(uk_exp_src.GetPointer());
+      if(flag_restricted)
+        ws->ReleaseImage(uk.GetPointer());
+
+      // The images of a coarse level are not needed once it is done. A session keeps
+      // the fixed side for the next registration
+      if(param.flag_release_levels && level + 1 < nlevels)
+        of_helper.ReleaseLevel(level, m_SessionHelper == NULL);
     }
 
   // The transformation field is in voxel units. To work with ANTS, it must be mapped
   // into physical offset units - just scaled by the spacing?
   ImageBaseType *warp_ref_space = of_helper.GetMovingReferenceSpace(nlevels - 1);
 
+  // If the reference space was cropped to the mask, the warps are placed back
+  // into the full space when they are written
+  if(of_helper.IsCroppedToMask())
+    warp_ref_space = of_helper.GetUncroppedReferenceSpace();
+
+  // The final forward and inverse warps in voxel units, kept in the result if requested
+  VectorImagePointer uResult, uResultInv;
+
   if(param.flag_stationary_velocity_mode)
     {
-    // Take current warp to 'exponent' power - this is the actual warp
+    // Take current warp to 'exponent' power - this is the actual warp. If the
+    // inverse is requested, it is exp(-v), computed alongside the forward warp
     VectorImagePointer uLevelExp = LDDMMType::new_vimg(uLevel);
     VectorImagePointer uLevelWork = LDDMMType::new_vimg(uLevel);
-    LDDMMType::vimg_exp(uLevel, uLevelExp, uLevelWork, param.warp_exponent, 1.0);
+    VectorImagePointer uLevelInv = NULL;
+    if(flag_inverse)
+      {
+      uLevelInv = LDDMMType::new_vimg(uLevel);
+      VectorImagePointer uLevelWorkInv = LDDMMType::new_vimg(uLevel);
+      LDDMMType::vimg_exp_with_inverse(uLevel, uLevelExp, uLevelInv, uLevelWork, uLevelWorkInv,
+                                       param.warp_exponent, 1.0);
+      }
+    else
+      {
+      LDDMMType::vimg_exp(uLevel, uLevelExp, uLevelWork, param.warp_exponent, 1.0);
+      }
+
+    uResult = of_helper.EmbedInUncroppedSpace(uLevelExp);
+    if(flag_inverse)
+      uResultInv = of_helper.EmbedInUncroppedSpace(uLevelInv);
 
     // Write the resulting transformation field (if provided)
     if(param.output.size())
       {
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevelExp, param.output.c_str(), param.warp_precision);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uResult,
+                                                 param.output.c_str(), param.warp_precision,
+                                                 param.warp_quant_bits, param.warp_quant_shrink);
       }
 
     // If asked to write root warp, do so
     if(param.root_warp.size())
       {
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevel, param.root_warp.c_str(), 0);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, of_helper.EmbedInUncroppedSpace(uLevel),
+                                                 param.root_warp.c_str(), 0,
+                                                 param.warp_quant_bits, param.warp_quant_shrink);
       }
 
-    // Compute the inverse (this is probably unnecessary for small warps)
+    // Write the inverse warp, exp(-v)
     if(param.inverse_warp.size())
       {
-      of_helper.ComputeDeformationFieldInverse(uLevel, uLevelWork, 0);
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevelWork, param.inverse_warp.c_str(), param.warp_precision);
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uResultInv,
+                                                 param.inverse_warp.c_str(), param.warp_precision,
+                                                 param.warp_quant_bits, param.warp_quant_shrink);
       }
     }
   else
     {
     // Write the resulting transformation field
-    WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uLevel, param.output.c_str(), param.warp_precision);
+    uResult = of_helper.EmbedInUncroppedSpace(uLevel);
+    if(param.output.size() || !m_KeepResultWarps)
+      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uResult,
+                                                 param.output.c_str(), param.warp_precision,
+                                                 param.warp_quant_bits, param.warp_quant_shrink);
 
     // If an inverse is requested, compute the inverse using the Chen 2008 fixed method.
     // A modification of this method is that if convergence is slow, we take the square
@@ -1684,16 +2935,48 @@ int GreedyApproach<VDim, TReal>
     // TODO: the maximum checks should only be done over the region where the warp is
     // not going outside of the image. Right now, they are meaningless and we are doing
     // extra work when computing the inverse.
-    if(param.inverse_warp.size())
+    if(flag_inverse)
       {
-      // Compute the inverse
-      VectorImagePointer uInverse = LDDMMType::new_vimg(uLevel);
-      of_helper.ComputeDeformationFieldInverse(uLevel, uInverse, param.warp_exponent);
+      // Compute the inverse, unless it has been maintained during the iterations
+      VectorImagePointer uInverse = uInvLevel;
+      if(!flag_track_inverse)
+        {
+        uInverse = LDDMMType::new_vimg(uLevel);
+        of_helper.ComputeDeformationFieldInverse(uLevel, uInverse, param.warp_exponent);
+        }
+      uResultInv = of_helper.EmbedInUncroppedSpace(uInverse);
 
       // Write the warp using compressed format
-      WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uInverse, param.inverse_warp.c_str(), param.warp_precision);
+      if(param.inverse_warp.size())
+        WriteCompressedWarpInPhysicalSpaceViaCache(warp_ref_space, uResultInv,
+                                                   param.inverse_warp.c_str(), param.warp_precision,
+                                                   param.warp_quant_bits, param.warp_quant_shrink);
       }
     }
+
+  // Keep the warps in the result. Warps that live in the workspace are taken out
+  // of it, so that they are not overwritten by the next registration
+  m_Result.SetMetricLog(m_MetricLog);
+  m_Result.SetConvergenceLog(m_ConvergenceLog);
+  if(m_KeepResultWarps)
+    {
+    ws->DetachImage(uResult.GetPointer());
+    if(uResultInv.IsNotNull())
+      ws->DetachImage(uResultInv.GetPointer());
+    m_Result.SetWarps(warp_ref_space, uResult, uResultInv);
+    }
+
+  // Write the timing profile if requested
+  if(param.profile_output.size())
+    WriteProfileLog(param.profile_output);
+
+  // The final warp has been written, so the workspace memory can be reused
+  ws->ReleaseAll();
+
+  // The registration is complete, and a later run should not resume from the checkpoint
+  if(param.checkpoint_file.size())
+    std::remove(param.checkpoint_file.c_str());
+
   return 0;
 }
 
@@ -1703,7 +2986,8 @@ int GreedyApproach<VDim, TReal>
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::WriteCompressedWarpInPhysicalSpaceViaCache(
-  ImageBaseType *moving_ref_space, VectorImageType *warp, const char *filename, double precision)
+  ImageBaseType *moving_ref_space, VectorImageType *warp, const char *filename, double precision,
+  int quant_bits, int quant_shrink)
 {
   // Define a _float_ output type, even if working with double precision (less space on disk)
   typedef CompressWarpFunctor<VectorImageType, VectorImageType> Functor;
@@ -1715,8 +2999,16 @@ void GreedyApproach<VDim, TReal>
   typename Filter::Pointer filter = Filter::New();
   filter->SetFunctor(functor);
   filter->SetInput(warp);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 
+  // Quantized warps that are not going to the cache are written by LDDMMData
+  if(!CheckCache<VectorImageType>(filename) && LDDMMType::vimg_is_quantized(filename))
+    {
+    LDDMMType::vimg_write_quantized(filter->GetOutput(), filename, quant_bits, quant_shrink);
+    return;
+    }
+
   // Write the resulting image via cache
   WriteImageViaCache(filter->GetOutput(), filename, itk::ImageIOBase::FLOAT);
 }
@@ -1735,17 +3027,80 @@ int GreedyApproach<VDim, TReal>
 {
   // Create an optical flow helper object
   OFHelperType of_helper;
+  this->ReadImagesForMetric(param, of_helper);
+  this->ComputeMetricWithHelper(param, of_helper, metric_report);
+  return 0;
+}
+
+template <unsigned int VDim, typename TReal>
+int GreedyApproach<VDim, TReal>
+::ComputeMetrics(std::vector<GreedyParameters> &params,
+                 std::vector<MultiComponentMetricReport> &metric_reports)
+{
+  // Group the problems by all parameters other than the initial transform, which
+  // do not affect how the images are read
+  std::map<std::string, unsigned int> group_index;
+  std::vector< std::vector<unsigned int> > groups;
+  for(unsigned int i = 0; i < params.size(); i++)
+    {
+    GreedyParameters key_param = params[i];
+    key_param.affine_init_mode = VOX_IDENTITY;
+    key_param.affine_init_transform = TransformSpec();
+    key_param.initial_warp.clear();
+    std::string key = key_param.GenerateCommandLine();
+
+    typename std::map<std::string, unsigned int>::iterator it = group_index.find(key);
+    if(it == group_index.end())
+      {
+      it = group_index.insert(std::make_pair(key, (unsigned int) groups.size())).first;
+      groups.push_back(std::vector<unsigned int>());
+      }
+    groups[it->second].push_back(i);
+    }
+
+  // Each group reads its images once and evaluates its problems in turn. The
+  // helper keeps metric working images between evaluations, so the problems
+  // within a group are not evaluated concurrently. The threads are split between
+  // the groups that run at the same time, so that the ITK filters of each group
+  // do not oversubscribe the machine
+  metric_reports.clear();
+  metric_reports.resize(params.size());
+  int n_group_threads = ParallelFor::GetNumberOfThreads();
+  int group_quota = std::max(1, n_group_threads / std::max(1, std::min(n_group_threads, (int) groups.size())));
+  ParallelFor::Run(groups.size(), 1, [&](long g0, long g1)
+    {
+    ParallelFor::ThreadQuota thread_quota(group_quota);
+    for(long g = g0; g < g1; g++)
+      {
+      OFHelperType of_helper;
+      this->ReadImagesForMetric(params[groups[g].front()], of_helper);
+      for(unsigned int j = 0; j < groups[g].size(); j++)
+        {
+        unsigned int i = groups[g][j];
+        this->ComputeMetricWithHelper(params[i], of_helper, metric_reports[i]);
+        }
+      }
+    });
+
+  return 0;
+}
 
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ReadImagesForMetric(GreedyParameters &param, OFHelperType &of_helper)
+{
   // Set the scaling factors for multi-resolution
   of_helper.SetDefaultPyramidFactors(1);
 
-  // Set the scaling mode depending on the metric
-  if(param.metric == GreedyParameters::MAHALANOBIS)
-    of_helper.SetScaleFixedImageWithVoxelSize(true);
-
   // Read the image pairs to register
   ReadImages(param, of_helper);
+}
 
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ComputeMetricWithHelper(GreedyParameters &param, OFHelperType &of_helper,
+                          MultiComponentMetricReport &metric_report)
+{
   // An image pointer desribing the current estimate of the deformation
   VectorImagePointer uLevel = NULL;
 
@@ -1780,16 +3135,7 @@ int GreedyApproach<VDim, TReal>
     {
     // The user supplied an initial warp or initial root warp. In this case, we
     // do not start iteration from zero, but use the initial warp to start from
-    VectorImagePointer uInit = VectorImageType::New();
-
-    // Read the warp file
-    LDDMMType::vimg_read(param.initial_warp.c_str(), uInit );
-
-    // Convert the warp file into voxel units from physical units
-    OFHelperType::PhysicalWarpToVoxelWarp(uInit, uInit, uInit);
-
-    // Scale the initial warp by the pyramid level
-    LDDMMType::vimg_resample_identity(uInit, refspace, uk);
+    ReadInitialWarp(param.initial_warp, refspace, uk);
     uLevel = uk;
     }
   else if(param.affine_init_mode != VOX_IDENTITY)
@@ -1850,12 +3196,15 @@ int GreedyApproach<VDim, TReal>
     // Compute the metric - no need to multiply by the mask, this happens already in the NCC metric code
     of_helper.ComputeNCCMetricImage(0, uFull, radius, iTemp, metric_report, uk1, 1.0);
     }
+  else if(param.metric == GreedyParameters::NCC_APPROX)
+    {
+    itk::Size<VDim> radius = array_caster<VDim>::to_itkSize(param.metric_radius);
+    of_helper.ComputeApproximateNCCMetricImage(0, uFull, radius, iTemp, metric_report, uk1, 1.0);
+    }
   else if(param.metric == GreedyParameters::MAHALANOBIS)
     {
     of_helper.ComputeMahalanobisMetricImage(0, uFull, iTemp, metric_report, uk1);
     }
-
-  return 0;
 }
 
 
@@ -1881,73 +3230,101 @@ int GreedyApproach<VDim, TReal>
     return -1;
     }
 
+  GreedyStdOut gout(param.verbosity);
+
   // Create an optical flow helper object
   OFHelperType of_helper;
 
-  // No multi-resolution
-  of_helper.SetDefaultPyramidFactors(1);
+  // Multi-resolution is only used for coarse-to-fine search
+  of_helper.SetDefaultPyramidFactors(param.brute_levels);
 
   // Read the image pairs to register
   ReadImages(param, of_helper);
 
-  // Reference space
-  ImageBaseType *refspace = of_helper.GetReferenceSpace(0);
-
-  // Intermediate images
-  VectorImagePointer u_best = LDDMMType::new_vimg(refspace);
-  VectorImagePointer u_curr = LDDMMType::new_vimg(refspace);
-  ImagePointer m_curr = LDDMMType::new_img(refspace);
-  ImagePointer m_best = LDDMMType::new_img(refspace);
-
-  // Allocate m_best to a negative value
-  m_best->FillBuffer(-100.0);
-
-  // Create a neighborhood for computing offsets
-  itk::Neighborhood<float, VDim> dummy_nbr;
-  itk::Size<VDim> search_rad = array_caster<VDim>::to_itkSize(param.brute_search_radius);
   itk::Size<VDim> metric_rad = array_caster<VDim>::to_itkSize(param.metric_radius);
-  dummy_nbr.SetRadius(search_rad);
 
-  // Iterate over all offsets
-  for(int k = 0; k < dummy_nbr.Size(); k++)
+  // Best displacement and metric at the current level
+  VectorImagePointer u_best;
+  ImagePointer m_best;
+
+  for(int level = 0; level < param.brute_levels; level++)
     {
-    // Get the offset corresponding to this iteration
-    itk::Offset<VDim> offset = dummy_nbr.GetOffset(k);
+    // Reference space for this level
+    ImageBaseType *refspace = of_helper.GetReferenceSpace(level);
+    int factor = 1 << (param.brute_levels - 1 - level);
 
-    // Fill the deformation field with this offset
-    typename LDDMMType::Vec vec_offset;
-    for(int i = 0; i < VDim; i++)
-      vec_offset[i] = offset[i];
-    u_curr->FillBuffer(vec_offset);
+    // The full radius is searched at the coarsest level. At the finer levels, the
+    // search is local, around the best displacement from the previous level
+    VectorImagePointer u_init;
+    itk::Size<VDim> search_rad;
+    if(u_best.IsNull())
+      {
+      for(unsigned int d = 0; d < VDim; d++)
+        search_rad[d] = (param.brute_search_radius[d] + factor - 1) / factor;
+      }
+    else
+      {
+      search_rad.Fill(param.brute_refine_radius);
+      u_init = LDDMMType::new_vimg(refspace);
+      LDDMMType::vimg_resample_identity(u_best, refspace, u_init);
+      LDDMMType::vimg_scale_in_place(u_init, 2.0);
+      }
 
-    // Perform interpolation and metric computation
-    MultiComponentMetricReport metric_report;
-    of_helper.ComputeNCCMetricImage(0, u_curr, metric_rad, m_curr, metric_report);
+    // Search all offsets, keeping track of the best match at each voxel
+    u_best = LDDMMType::new_vimg(refspace);
+    m_best = LDDMMType::new_img(refspace);
+    of_helper.ComputeNCCBruteForceSearch(level, metric_rad, search_rad, m_best, u_best, u_init);
 
-    // Temp: keep track of number of updates
-    unsigned long n_updates = 0;
+    std::ostringstream oss_rad;
+    oss_rad << search_rad;
+    gout.printf("Level %d (factor %d): searched radius %s\n", level, factor, oss_rad.str().c_str());
+    }
+
+  // Sub-voxel refinement at the finest level
+  if(param.flag_brute_subvoxel)
+    {
+    ImageBaseType *refspace = of_helper.GetReferenceSpace(param.brute_levels - 1);
+    itk::Size<VDim> zero_rad;
+    zero_rad.Fill(0);
+
+    VectorImagePointer u_shift = LDDMMType::new_vimg(refspace);
+    VectorImagePointer u_dummy = LDDMMType::new_vimg(refspace);
+    VectorImagePointer u_delta = LDDMMType::new_vimg(refspace);
+    ImagePointer m_minus = LDDMMType::new_img(refspace);
+    ImagePointer m_plus = LDDMMType::new_img(refspace);
 
-    // Out of laziness, just take a quick pass over the images
     typename VectorImageType::RegionType rgn = refspace->GetBufferedRegion();
-    itk::ImageRegionIterator<VectorImageType> it_u(u_best, rgn);
-    itk::ImageRegionConstIterator<ImageType> it_m_curr(m_curr, rgn);
-    itk::ImageRegionIterator<ImageType> it_m_best(m_best, rgn);
-    for(; !it_m_best.IsAtEnd(); ++it_m_best, ++it_m_curr, ++it_u)
+    for(unsigned int d = 0; d < VDim; d++)
       {
-      float v_curr = it_m_curr.Value();
-      if(v_curr > it_m_best.Value())
+      // Evaluate the metric one voxel either side of the best displacement
+      for(int side = -1; side <= 1; side += 2)
+        {
+        LDDMMType::vimg_copy(u_best, u_shift);
+        for(itk::ImageRegionIterator<VectorImageType> it(u_shift, rgn); !it.IsAtEnd(); ++it)
+          it.Value()[d] += side;
+
+        of_helper.ComputeNCCBruteForceSearch(param.brute_levels - 1, metric_rad, zero_rad,
+                                             side < 0 ? m_minus : m_plus, u_dummy, u_shift);
+        }
+
+      // Fit a parabola through the three values
+      itk::ImageRegionIterator<VectorImageType> it_d(u_delta, rgn);
+      itk::ImageRegionConstIterator<ImageType> it_m(m_best, rgn), it_mm(m_minus, rgn), it_mp(m_plus, rgn);
+      for(; !it_d.IsAtEnd(); ++it_d, ++it_m, ++it_mm, ++it_mp)
         {
-        it_m_best.Set(v_curr);
-        it_u.Set(vec_offset);
-        ++n_updates;
+        double m0 = it_m.Value(), mm = it_mm.Value(), mp = it_mp.Value();
+        double denom = mm - 2 * m0 + mp;
+        double delta = (denom < 0) ? 0.5 * (mm - mp) / denom : 0.0;
+        it_d.Value()[d] = std::max(-0.5, std::min(0.5, delta));
         }
       }
 
-    std::cout << "offset: " << offset << "     updates: " << n_updates << std::endl;
+    LDDMMType::vimg_add_in_place(u_best, u_delta);
     }
 
   LDDMMType::vimg_write(u_best, param.output.c_str());
-  LDDMMType::img_write(m_best, "mbest.nii.gz");
+  if(param.brute_metric_output.size())
+    LDDMMType::img_write(m_best, param.brute_metric_output.c_str());
 
   return 0;
 }
@@ -1960,13 +3337,10 @@ int GreedyApproach<VDim, TReal>
 
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
-::ReadTransformChain(const std::vector<TransformSpec> &tran_chain,
-                     ImageBaseType *ref_space,
-                     VectorImagePointer &out_warp)
+::CompileTransformChain(const std::vector<TransformSpec> &tran_chain,
+                        CompiledTransformChain &compiled)
 {
-  // Create the initial transform and set it to zero
-  out_warp = VectorImageType::New();
-  LDDMMType::alloc_vimg(out_warp, ref_space);
+  compiled.clear();
 
   // Read the sequence of transforms
   for(int i = 0; i < tran_chain.size(); i++)
@@ -1975,11 +3349,10 @@ void GreedyApproach<VDim, TReal>
     std::string tran = tran_chain[i].filename;
 
     // Determine if it's an affine transform
-    if(CheckCache<VectorImageType>(tran) || itk::ImageIOFactory::CreateImageIO(tran.c_str(), itk::ImageIOFactory::ReadMode))
+    if(CheckCache<VectorImageType>(tran)
+       || LDDMMType::vimg_is_quantized(tran.c_str())
+       || itk::ImageIOFactory::CreateImageIO(tran.c_str(), itk::ImageIOFactory::ReadMode))
       {
-      // Create a temporary warp
-      VectorImagePointer warp_tmp = LDDMMType::new_vimg(ref_space);
-
       // Read the next warp
       VectorImagePointer warp_i = ReadImageViaCache<VectorImageType>(tran);
 
@@ -1994,104 +3367,128 @@ void GreedyApproach<VDim, TReal>
         if(fabs(n - n_real) > 1.0e-4) 
           throw GreedyException("Currently only power of two exponents are supported for warps");
 
-        // Bring the transform into voxel space
+        // Bring the transform into voxel space. The warp may be shared with the
+        // cache, so the conversion is done into a new image
+        VectorImagePointer warp_vox = LDDMMType::new_vimg(warp_i);
         VectorImagePointer warp_exp = LDDMMType::new_vimg(warp_i);
-        OFHelperType::PhysicalWarpToVoxelWarp(warp_i, warp_i, warp_i);
+        VectorImagePointer warp_tmp = LDDMMType::new_vimg(warp_i);
+        OFHelperType::PhysicalWarpToVoxelWarp(warp_i, warp_i, warp_vox);
 
         // Square the transform N times (in its own space)
-        LDDMMType::vimg_exp(warp_i, warp_exp, warp_tmp, n, tran_chain[i].exponent / absexp);
+        LDDMMType::vimg_exp(warp_vox, warp_exp, warp_tmp, n, tran_chain[i].exponent / absexp);
 
         // Bring the transform back into physical space
-        OFHelperType::VoxelWarpToPhysicalWarp(warp_exp, warp_i, warp_i);
+        OFHelperType::VoxelWarpToPhysicalWarp(warp_exp, warp_i, warp_vox);
+        warp_i = warp_vox;
         }
 
-      // Now we need to compose the current transform and the overall warp.
-      LDDMMType::interp_vimg(warp_i, out_warp, 1.0, warp_tmp, false, true);
-      LDDMMType::vimg_add_in_place(out_warp, warp_tmp);
+      CompiledTransform ct;
+      ct.warp = warp_i;
+      compiled.push_back(ct);
       }
     else
       {
-      // Read the transform as a matrix
+      // Read the transform as a matrix. The matrix maps NIFTI (RAS) coordinates, so
+      // it is conjugated by the flip of the first two axes to map ITK coordinates
       vnl_matrix<double> mat = ReadAffineMatrixViaCache(tran_chain[i]);
-      vnl_matrix<double>  A = mat.extract(VDim, VDim);
-      vnl_vector<double> b = mat.get_column(VDim).extract(VDim), q;
+      vnl_matrix<double> A = mat.extract(VDim, VDim);
+      vnl_vector<double> b = mat.get_column(VDim).extract(VDim);
+      for(unsigned int r = 0; r < 2; r++)
+        {
+        b[r] = -b[r];
+        for(unsigned int c = 0; c < VDim; c++)
+          {
+          A(r, c) = -A(r, c);
+          A(c, r) = -A(c, r);
+          }
+        }
+
+      // Fold into the previous affine transform, if there is one
+      if(compiled.size() && compiled.back().warp.IsNull())
+        {
+        CompiledTransform &prev = compiled.back();
+        prev.b = A * prev.b + b;
+        prev.A = A * prev.A;
+        }
+      else
+        {
+        CompiledTransform ct;
+        ct.A = A;
+        ct.b = b;
+        compiled.push_back(ct);
+        }
+      }
+    }
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ComposeTransformChain(const CompiledTransformChain &compiled,
+                        ImageBaseType *ref_space,
+                        VectorImagePointer &out_warp)
+{
+  // Create the initial transform and set it to zero
+  out_warp = VectorImageType::New();
+  LDDMMType::alloc_vimg(out_warp, ref_space);
 
+  VectorImagePointer warp_tmp = NULL;
+  for(int i = 0; i < compiled.size(); i++)
+    {
+    const CompiledTransform &ct = compiled[i];
+    if(ct.warp)
+      {
+      // Compose the current transform and the overall warp
+      if(warp_tmp.IsNull())
+        warp_tmp = LDDMMType::new_vimg(ref_space);
+      if(ct.bricked_warp)
+        LDDMMType::interp_vimg(ct.bricked_warp, out_warp, 1.0, warp_tmp, false, true);
+      else
+        LDDMMType::interp_vimg(ct.warp, out_warp, 1.0, warp_tmp, false, true);
+      LDDMMType::vimg_add_in_place(out_warp, warp_tmp);
+      }
+    else
+      {
       // TODO: stick this in a filter to take advantage of threading!
       typedef itk::ImageRegionIteratorWithIndex<VectorImageType> IterType;
+      vnl_vector<double> pt2(VDim), q;
       for(IterType it(out_warp, out_warp->GetBufferedRegion()); !it.IsAtEnd(); ++it)
         {
-        itk::Point<double, VDim> pt, pt2;
+        itk::Point<double, VDim> pt;
         typename VectorImageType::IndexType idx = it.GetIndex();
 
         // Get the physical position
         // TODO: this calls IsInside() internally, which limits efficiency
         out_warp->TransformIndexToPhysicalPoint(idx, pt);
 
-        // Add the displacement (in DICOM coordinates) and
-        for(int i = 0; i < VDim; i++)
-          pt2[i] = pt[i] + it.Value()[i];
-
-        // Switch to NIFTI coordinates
-        pt2[0] = -pt2[0]; pt2[1] = -pt2[1];
-
-        // Apply the matrix - get the transformed coordinate in DICOM space
-        q = A * pt2.GetVnlVector() + b;
-        q[0] = -q[0]; q[1] = -q[1];
+        // Add the displacement and apply the affine transform
+        for(int d = 0; d < VDim; d++)
+          pt2[d] = pt[d] + it.Value()[d];
+        q = ct.A * pt2 + ct.b;
 
-        // Compute the difference in DICOM space
-        for(int i = 0; i < VDim; i++)
-          it.Value()[i] = q[i] - pt[i];
+        // Compute the difference
+        for(int d = 0; d < VDim; d++)
+          it.Value()[d] = q[d] - pt[d];
         }
       }
     }
 }
 
-#include "itkBinaryThresholdImageFilter.h"
-//#include "itkRecursiveGaussianImageFilter.h"
-#include "itkSmoothingRecursiveGaussianImageFilter.h"
-#include "itkNaryFunctorImageFilter.h"
-
-template <class TInputImage, class TOutputImage>
-class NaryLabelVotingFunctor
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ReadTransformChain(const std::vector<TransformSpec> &tran_chain,
+                     ImageBaseType *ref_space,
+                     VectorImagePointer &out_warp)
 {
-public:
-  typedef NaryLabelVotingFunctor<TInputImage,TOutputImage> Self;
-  typedef typename TInputImage::PixelType InputPixelType;
-  typedef typename TOutputImage::PixelType OutputPixelType;
-  typedef std::vector<OutputPixelType> LabelArray;
-
-  NaryLabelVotingFunctor(const LabelArray &labels)
-    : m_LabelArray(labels), m_Size(labels.size()) {}
-
-  NaryLabelVotingFunctor() : m_Size(0) {}
-
-
-  OutputPixelType operator() (const std::vector<InputPixelType> &pix)
-  {
-    InputPixelType best_val = pix[0];
-    int best_index = 0;
-    for(int i = 1; i < m_Size; i++)
-      if(pix[i] > best_val)
-        {
-        best_val = pix[i];
-        best_index = i;
-        }
-
-    return m_LabelArray[best_index];
-  }
-
-  bool operator != (const Self &other)
-    { return other.m_LabelArray != m_LabelArray; }
+  CompiledTransformChain compiled;
+  CompileTransformChain(tran_chain, compiled);
+  ComposeTransformChain(compiled, ref_space, out_warp);
+}
 
-protected:
-  LabelArray m_LabelArray;
-  int m_Size;
-};
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
 
 #include "itkMeshFileReader.h"
 #include "itkMeshFileWriter.h"
 #include "itkMesh.h"
-#include "itkTransformMeshFilter.h"
 
 template <unsigned int VDim, typename TArray>
 class PhysicalCoordinateTransform
@@ -2159,76 +3556,264 @@ public:
 
 
 
-template <unsigned int VDim, typename TReal>
-class WarpMeshTransformFunctor : public itk::DataObject
+/**
+ * Maps physical (LPS) points through a compiled transform chain one at a time, in
+ * the order of the chain as ComposeTransformChain does, sampling the warps with
+ * linear interpolation. The interpolators keep per-sample state, so each thread
+ * needs its own mapper
+ */
+template <class TChain, class TVectorImage, class TReal, unsigned int VDim>
+class CompiledChainPointMapper
 {
 public:
-  typedef WarpMeshTransformFunctor<VDim, TReal>       Self;
-  typedef itk::DataObject                             Superclass;
-  typedef itk::SmartPointer<Self>                     Pointer;
-  typedef itk::SmartPointer<const Self>               ConstPointer;
-
-  itkTypeMacro(WarpMeshTransformFunctor, itk::DataObject)
-  itkNewMacro(Self)
-
-  typedef GreedyApproach<VDim, TReal> GreedyAPI;
-  typedef typename GreedyAPI::VectorImageType VectorImageType;
-  typedef typename GreedyAPI::ImageBaseType ImageBaseType;
-  typedef FastLinearInterpolator<VectorImageType, TReal, VDim> FastInterpolator;
+  typedef FastLinearInterpolator<TVectorImage, TReal, VDim> FastInterpolator;
   typedef itk::ContinuousIndex<TReal, VDim> CIndexType;
   typedef itk::Point<TReal, VDim> PointType;
 
-  void SetWarp(VectorImageType *warp)
+  CompiledChainPointMapper(const TChain &chain)
+    : m_Chain(chain), m_Interp(chain.size())
   {
-    if(m_Interpolator) delete m_Interpolator;
-    m_Interpolator = new FastInterpolator(warp);
+    for(unsigned int k = 0; k < chain.size(); k++)
+      if(chain[k].warp)
+        m_Interp[k].reset(new FastInterpolator(chain[k].warp));
   }
 
-  void SetReferenceSpace(ImageBaseType *ref)
+  void Map(PointType &p)
   {
-    m_ReferenceSpace = ref;
+    for(unsigned int k = 0; k < m_Chain.size(); k++)
+      {
+      if(m_Chain[k].warp)
+        {
+        CIndexType cix;
+        typename TVectorImage::PixelType vec;
+        vec.Fill(0.0);
+        m_Chain[k].warp->TransformPhysicalPointToContinuousIndex(p, cix);
+        m_Interp[k]->Interpolate(cix.GetDataPointer(), &vec);
+        for(unsigned int d = 0; d < VDim; d++)
+          p[d] += vec[d];
+        }
+      else
+        {
+        PointType q;
+        for(unsigned int r = 0; r < VDim; r++)
+          {
+          q[r] = m_Chain[k].b[r];
+          for(unsigned int c = 0; c < VDim; c++)
+            q[r] += m_Chain[k].A(r, c) * p[c];
+          }
+        p = q;
+        }
+      }
   }
 
-  PointType TransformPoint(const PointType &x)
-  {
-    // Our convention is to use NIFTI/RAS coordinates for meshes, whereas ITK
-    // uses the DICOM/LPS convention. We transform point to LPS first
-    PointType x_lps, phi_x;
-
-    PhysicalCoordinateTransform<VDim, PointType>::ras_to_lps(x, x_lps);
+private:
+  const TChain &m_Chain;
+  std::vector< std::unique_ptr<FastInterpolator> > m_Interp;
+};
 
-    CIndexType cix;
-    typename VectorImageType::PixelType vec;
-    vec.Fill(0.0);
-    m_ReferenceSpace->TransformPhysicalPointToContinuousIndex(x_lps, cix);
-    m_Interpolator->Interpolate(cix.GetDataPointer(), &vec);
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::WarpMeshPoints(const CompiledTransformChain &compiled, TReal *points, long n_points)
+{
+  typedef CompiledChainPointMapper<CompiledTransformChain, VectorImageType, TReal, VDim> MapperType;
+  typedef typename MapperType::PointType PointType;
 
-    for(int d = 0; d < VDim; d++)
+  ParallelFor::Run(n_points, 4096, [&](long i0, long i1)
+    {
+    MapperType mapper(compiled);
+    for(long i = i0; i < i1; i++)
       {
-      phi_x[d] = vec[d] + x_lps[d];
+      // Our convention is to use NIFTI/RAS coordinates for meshes, whereas ITK
+      // uses the DICOM/LPS convention. We transform point to LPS first
+      PointType x, p;
+      for(unsigned int d = 0; d < VDim; d++)
+        x[d] = points[i * VDim + d];
+      PhysicalCoordinateTransform<VDim, PointType>::ras_to_lps(x, p);
+
+      mapper.Map(p);
+
+      PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(p, x);
+      for(unsigned int d = 0; d < VDim; d++)
+        points[i * VDim + d] = x[d];
       }
+    });
+}
 
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ResliceMesh(const ResliceMeshSpec &spec, const CompiledTransformChain &compiled)
+{
+  // Number of points read, mapped and written at a time by the streamed formats
+  const long block_size = 65536;
+  std::vector<TReal> block;
+  block.reserve(block_size * VDim);
 
-    PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(phi_x, phi_x);
+  std::string ext_in = itksys::SystemTools::GetFilenameExtension(spec.fixed);
+  std::string ext_out = itksys::SystemTools::GetFilenameExtension(spec.output);
 
-    return phi_x;
-  }
+  // CSV point lists, one point per line
+  if(ext_in == ".csv" && ext_out == ".csv")
+    {
+    std::ifstream fin(spec.fixed.c_str());
+    std::ofstream out(spec.output.c_str());
+    std::string f_line, f_token;
+    bool more = true;
+    while(more)
+      {
+      block.clear();
+      while(block.size() < (size_t) (block_size * VDim) && (more = (bool) std::getline(fin, f_line)))
+        {
+        std::istringstream iss(f_line);
+        for(unsigned int a = 0; a < VDim; a++)
+          {
+          if(!std::getline(iss, f_token, ','))
+            throw GreedyException("Error reading CSV file, line %s", f_line.c_str());
+          block.push_back(atof(f_token.c_str()));
+          }
+        }
 
-protected:
+      long n = block.size() / VDim;
+      WarpMeshPoints(compiled, block.data(), n);
+      for(long i = 0; i < n; i++)
+        for(unsigned int a = 0; a < VDim; a++)
+          out << block[i * VDim + a] << (a < VDim-1 ? "," : "\n");
+      }
+    return;
+    }
 
-  WarpMeshTransformFunctor() { m_Interpolator = NULL; }
-  ~WarpMeshTransformFunctor()
-  {
-    if(m_Interpolator)
-      delete m_Interpolator;
-  }
+  // Legacy ASCII VTK files. Only the POINTS section is rewritten, everything else
+  // (cells, point data) is copied through as is
+  if(ext_in == ".vtk" && ext_out == ".vtk")
+    {
+    std::ifstream fin(spec.fixed.c_str());
+    std::string header[3];
+    for(int k = 0; k < 3; k++)
+      std::getline(fin, header[k]);
+
+    std::string format = header[2];
+    format.erase(format.find_last_not_of(" \r\t") + 1);
+    if(fin.good() && header[0].find("# vtk DataFile") == 0 && format == "ASCII")
+      {
+      std::ofstream out(spec.output.c_str());
+      out.precision(std::numeric_limits<float>::max_digits10);
+      for(int k = 0; k < 3; k++)
+        out << header[k] << "\n";
+
+      // Copy up to the points, and the points header itself
+      std::string line;
+      long n_points = -1;
+      while(n_points < 0 && std::getline(fin, line))
+        {
+        out << line << "\n";
+        if(line.compare(0, 6, "POINTS") == 0)
+          {
+          std::istringstream iss(line.substr(6));
+          if(!(iss >> n_points))
+            throw GreedyException("Error reading VTK file %s, line %s", spec.fixed.c_str(), line.c_str());
+          }
+        }
 
-private:
+      // VTK points always have three coordinates, extra ones are passed through
+      const unsigned int vtk_dim = 3;
+      std::vector<double> extra;
+      for(long i0 = 0; i0 < n_points; i0 += block_size)
+        {
+        long n = std::min(block_size, n_points - i0);
+        block.resize(n * VDim);
+        extra.assign(n * vtk_dim, 0.0);
+        for(long i = 0; i < n; i++)
+          {
+          for(unsigned int a = 0; a < vtk_dim; a++)
+            {
+            double v;
+            if(!(fin >> v))
+              throw GreedyException("Error reading points from VTK file %s", spec.fixed.c_str());
+            if(a < VDim)
+              block[i * VDim + a] = v;
+            else
+              extra[i * vtk_dim + a] = v;
+            }
+          }
 
-  typename ImageBaseType::Pointer m_ReferenceSpace;
-  FastInterpolator *m_Interpolator;
+        WarpMeshPoints(compiled, block.data(), n);
+        for(long i = 0; i < n; i++)
+          for(unsigned int a = 0; a < vtk_dim; a++)
+            out << (a < VDim ? (double) block[i * VDim + a] : extra[i * vtk_dim + a])
+                << (a < vtk_dim - 1 ? " " : "\n");
+        }
 
-};
+      // Copy the rest of the file, starting with the remainder of the last points line
+      std::getline(fin, line);
+      if(line.find_first_not_of(" \r\t") != std::string::npos)
+        out << line << "\n";
+      while(std::getline(fin, line))
+        out << line << "\n";
+      return;
+      }
+    }
+
+  // Other formats (binary VTK, or a conversion between formats) are read whole by ITK
+  typedef itk::Mesh<TReal, VDim> MeshType;
+  typename MeshType::Pointer mesh;
+  if(ext_in == ".csv")
+    {
+    mesh = MeshType::New();
+    std::ifstream fin(spec.fixed.c_str());
+    std::string f_line, f_token;
+    unsigned int n_pts = 0;
+    while(std::getline(fin, f_line))
+      {
+      std::istringstream iss(f_line);
+      itk::Point<TReal, VDim> pt;
+      for(unsigned int a = 0; a < VDim; a++)
+        {
+        if(!std::getline(iss, f_token, ','))
+          throw GreedyException("Error reading CSV file, line %s", f_line.c_str());
+        pt[a] = atof(f_token.c_str());
+        }
+      mesh->SetPoint(n_pts++, pt);
+      }
+    }
+  else
+    {
+    typedef itk::MeshFileReader<MeshType> MeshReader;
+    typename MeshReader::Pointer reader = MeshReader::New();
+    reader->SetFileName(spec.fixed.c_str());
+    reader->Update();
+    mesh = reader->GetOutput();
+    }
+
+  // Map the points in place
+  long n = mesh->GetNumberOfPoints();
+  block.resize(n * VDim);
+  for(long i = 0; i < n; i++)
+    for(unsigned int a = 0; a < VDim; a++)
+      block[i * VDim + a] = mesh->GetPoint(i)[a];
+  WarpMeshPoints(compiled, block.data(), n);
+  for(long i = 0; i < n; i++)
+    {
+    itk::Point<TReal, VDim> pt;
+    for(unsigned int a = 0; a < VDim; a++)
+      pt[a] = block[i * VDim + a];
+    mesh->SetPoint(i, pt);
+    }
+
+  if(ext_out == ".csv")
+    {
+    std::ofstream out(spec.output.c_str());
+    for(long i = 0; i < n; i++)
+      for(unsigned int a = 0; a < VDim; a++)
+        out << block[i * VDim + a] << (a < VDim-1 ? "," : "\n");
+    }
+  else
+    {
+    typedef itk::MeshFileWriter<MeshType> MeshWriter;
+    typename MeshWriter::Pointer writer = MeshWriter::New();
+    writer->SetInput(mesh);
+    writer->SetFileName(spec.output.c_str());
+    writer->Update();
+    }
+}
 
 /**
  * This code computes the jacobian determinant field for a deformation. The
@@ -2248,6 +3833,41 @@ int GreedyApproach<VDim, TReal>
   // Convert the warp file into voxel units from physical units
   OFHelperType::PhysicalWarpToVoxelWarp(warp, warp, warp);
 
+  // In direct mode, the determinant and its statistics are computed in one pass
+  if(param.jacobian_param.flag_direct)
+    {
+    GreedyStdOut gout(param.verbosity);
+
+    typedef DisplacementJacobianDeterminantImageFilter<VectorImageType, ImageType> DetFilterType;
+    typename DetFilterType::Pointer fltDet = DetFilterType::New();
+    fltDet->SetInput(warp);
+    ParallelFor::ApplyThreadQuota(fltDet);
+    fltDet->Update();
+
+    const JacobianDeterminantStatistics &st = fltDet->GetStatistics();
+    char buffer[1024];
+    sprintf(buffer,
+            "Jacobian determinant: min %g, max %g, mean %g\n"
+            "  percentiles 1%%: %g, 5%%: %g, 50%%: %g, 95%%: %g, 99%%: %g\n"
+            "  folding voxels: %lu of %lu (%.4f%%)\n",
+            st.min, st.max, st.mean, st.p01, st.p05, st.p50, st.p95, st.p99,
+            st.n_folding, st.n_voxels, st.n_voxels ? st.n_folding * 100.0 / st.n_voxels : 0.0);
+    gout.printf("%s", buffer);
+
+    if(param.jacobian_param.out_stats.size())
+      {
+      std::ofstream fout(param.jacobian_param.out_stats.c_str());
+      if(!fout.good())
+        throw GreedyException("Unable to write Jacobian statistics to %s",
+                              param.jacobian_param.out_stats.c_str());
+      fout << buffer;
+      }
+
+    LDDMMType::img_write(fltDet->GetOutput(), param.jacobian_param.out_det_jac.c_str(),
+                         itk::ImageIOBase::FLOAT);
+    return 0;
+    }
+
   // Compute the root of the warp
   VectorImagePointer root_warp = VectorImageType::New();
   LDDMMType::alloc_vimg(root_warp, warp);
@@ -2296,250 +3916,731 @@ int GreedyApproach<VDim, TReal>
 }
 
 
-template <typename TReal, typename TLabel>
-class CompositeToLabelFunctor
-{
-  public:
-    short operator () (itk::VariableLengthVector<TReal> const &p) const { return (short) p[0]; }
-};
+#include "itkImageSource.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 
 /**
- * Run the reslice code - simply apply a warp or set of warps to images
+ * An image source that produces the resliced moving image one requested region
+ * at a time, so that it can be streamed into an itk::ImageFileWriter. For each
+ * region the transform chain is composed over the region only, and only the part
+ * of the moving image that the region maps into is read from disk
  */
 template <unsigned int VDim, typename TReal>
-int GreedyApproach<VDim, TReal>
-::RunReslice(GreedyParameters &param)
+class GreedyResliceStreamingSource
+    : public itk::ImageSource<typename LDDMMData<TReal, VDim>::CompositeImageType>
 {
-  // Object for text output
-  GreedyStdOut gout(param.verbosity);
-
-  GreedyResliceParameters r_param = param.reslice_param;
+public:
+  typedef GreedyApproach<VDim, TReal> ApproachType;
+  typedef typename ApproachType::LDDMMType LDDMMType;
+  typedef typename ApproachType::ImageBaseType ImageBaseType;
+  typedef typename ApproachType::ImageType ImageType;
+  typedef typename ApproachType::VectorImageType VectorImageType;
+  typedef typename ApproachType::VectorImagePointer VectorImagePointer;
+  typedef typename ApproachType::CompositeImageType CompositeImageType;
+  typedef typename ApproachType::CompositeImagePointer CompositeImagePointer;
+  typedef typename ApproachType::CompiledTransformChain CompiledTransformChain;
+  typedef itk::ImageFileReader<CompositeImageType> ReaderType;
+
+  typedef GreedyResliceStreamingSource<VDim, TReal> Self;
+  typedef itk::ImageSource<CompositeImageType> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+  typedef typename CompositeImageType::RegionType RegionType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
 
-  // Check the parameters
-  if(!r_param.ref_image.size())
-    throw GreedyException("A reference image (-rf) option is required for reslice commands");
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(GreedyResliceStreamingSource, itk::ImageSource)
+
+  /**
+   * Set up the source. The moving image is either given in memory, or as a reader
+   * that has been updated up to its output information, in which case it is read
+   * one region at a time
+   */
+  void SetUp(ApproachType *approach, ImageBaseType *ref,
+             const CompiledTransformChain *tran_chain, const ResliceSpec *spec,
+             CompositeImageType *moving, ReaderType *reader, unsigned int n_comp)
+  {
+    m_Approach = approach;
+    m_Reference = ref;
+    m_TransformChain = tran_chain;
+    m_Spec = spec;
+    m_Moving = moving;
+    m_Reader = reader;
+    m_NumberOfComponents = n_comp;
+    this->Modified();
+  }
 
-  if(r_param.images.size() + r_param.meshes.size() == 0
-     && !r_param.out_composed_warp.size()
-     && !r_param.out_jacobian_image.size())
-    throw GreedyException("No operation specified for reslice mode. "
-                          "Use one of -rm, -rs or -rc commands.");
+protected:
+  GreedyResliceStreamingSource()
+    : m_Approach(NULL), m_TransformChain(NULL), m_Spec(NULL), m_NumberOfComponents(1) {}
+  ~GreedyResliceStreamingSource() {}
 
-  // Read the fixed as a plain image (we don't care if it's composite)
-  typename ImageBaseType::Pointer ref = ReadImageBaseViaCache(r_param.ref_image);
+  virtual void GenerateOutputInformation() ITK_OVERRIDE
+  {
+    CompositeImageType *output = this->GetOutput();
+    output->CopyInformation(m_Reference);
+    output->SetNumberOfComponentsPerPixel(m_NumberOfComponents);
+  }
 
-  // Read the transform chain
-  VectorImagePointer warp;
-  ReadTransformChain(param.reslice_param.transforms, ref, warp);
+  virtual void GenerateData() ITK_OVERRIDE
+  {
+    CompositeImageType *output = this->GetOutput();
+    RegionType region = output->GetRequestedRegion();
+
+    // Create a reference space for the slab, with zero-based index so that the
+    // warp and the resliced slab can be created with the usual LDDMMData code
+    typename ImageType::Pointer slab = ImageType::New();
+    typename ImageType::PointType slab_origin;
+    output->TransformIndexToPhysicalPoint(region.GetIndex(), slab_origin);
+    slab->SetRegions(RegionType(region.GetSize()));
+    slab->SetOrigin(slab_origin);
+    slab->SetSpacing(output->GetSpacing());
+    slab->SetDirection(output->GetDirection());
+
+    // Compose the transforms over the slab
+    VectorImagePointer warp;
+    m_Approach->ComposeTransformChain(*m_TransformChain, slab, warp);
+
+    // The resliced slab, initialized to the outside value
+    CompositeImagePointer slab_out = LDDMMType::new_cimg(slab, m_NumberOfComponents);
+    typename CompositeImageType::PixelType outside(m_NumberOfComponents);
+    outside.Fill(m_Spec->interp.outside_value);
+    slab_out->FillBuffer(outside);
+
+    // Get the part of the moving image needed for this slab
+    CompositeImagePointer moving = m_Moving;
+    if(moving.IsNull())
+      {
+      CompositeImageType *mov_info = m_Reader->GetOutput();
+      RegionType mov_region;
+      if(ComputeMovingRegion(slab, warp, mov_info, mov_region))
+        {
+        mov_info->SetRequestedRegion(mov_region);
+        m_Reader->Update();
+        moving = ZeroBasedImageView(m_Reader->GetOutput());
+        }
+      }
 
-  // Write the composite warp if requested
-  if(r_param.out_composed_warp.size())
-    {
-    WriteImageViaCache(warp.GetPointer(), r_param.out_composed_warp.c_str(), itk::ImageIOBase::FLOAT);
-    }
+    // Perform the warp, unless the slab maps entirely outside of the moving image
+    if(moving.IsNotNull())
+      LDDMMType::interp_cimg(moving, warp, slab_out,
+                             m_Spec->interp.mode == InterpSpec::NEAREST,
+                             true, m_Spec->interp.outside_value);
 
-  // Compute the Jacobian of the warp if requested
-  if(r_param.out_jacobian_image.size())
-    {
-    ImagePointer iTemp = ImageType::New();
-    LDDMMType::alloc_img(iTemp, warp);
-    LDDMMType::field_jacobian_det(warp, iTemp);
+    // Hand the slab's memory over to the output
+    output->SetBufferedRegion(region);
+    output->SetPixelContainer(slab_out->GetPixelContainer());
+  }
 
-    WriteImageViaCache(iTemp.GetPointer(), r_param.out_jacobian_image.c_str(), itk::ImageIOBase::FLOAT);
-    }
+  virtual void EnlargeOutputRequestedRegion(itk::DataObject *) ITK_OVERRIDE {}
 
+  /**
+   * Find the region of the moving image that the voxels of the slab map into,
+   * padded by a voxel for interpolation. Returns false if the slab maps entirely
+   * outside of the moving image
+   */
+  static bool ComputeMovingRegion(ImageType *slab, VectorImageType *warp,
+                                  CompositeImageType *moving, RegionType &out_region)
+  {
+    itk::ContinuousIndex<double, VDim> lo, hi, cix;
+    lo.Fill(itk::NumericTraits<double>::max());
+    hi.Fill(-itk::NumericTraits<double>::max());
 
-  // Process image pairs
-  for(int i = 0; i < r_param.images.size(); i++)
-    {
-    const char *filename = r_param.images[i].moving.c_str();
+    typedef itk::ImageRegionConstIteratorWithIndex<VectorImageType> IterType;
+    for(IterType it(warp, warp->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+      {
+      itk::Point<double, VDim> pt;
+      slab->TransformIndexToPhysicalPoint(it.GetIndex(), pt);
+      for(unsigned int d = 0; d < VDim; d++)
+        pt[d] += it.Get()[d];
 
-    // Handle the special case of multi-label images
-    if(r_param.images[i].interp.mode == InterpSpec::LABELWISE)
-      {
-      // The label image is assumed to have a finite set of labels
-      typename CompositeImageType::Pointer moving = ReadImageViaCache<CompositeImageType>(filename);
-      if(moving->GetNumberOfComponentsPerPixel() > 1)
-        throw GreedyException("Label wise interpolation not supported for multi-component images");
-
-      // Cast the image to an image of shorts
-      typedef itk::Image<short, VDim> LabelImageType;
-      typedef CompositeToLabelFunctor<TReal, short> CastFunctor;
-      typedef itk::UnaryFunctorImageFilter<CompositeImageType, LabelImageType, CastFunctor> CastFilter;
-      typename CastFilter::Pointer fltCast = CastFilter::New();
-      fltCast->SetInput(moving);
-      fltCast->Update();
-      typename LabelImageType::Pointer label_image = fltCast->GetOutput();
-
-      // Scan the unique labels in the image
-      std::set<short> label_set;
-      short *labels = label_image->GetBufferPointer();
-      int n_pixels = label_image->GetPixelContainer()->Size();
-
-      // Get the list of unique pixels
-      short last_pixel = 0;
-      for(int j = 0; j < n_pixels; j++)
-        {
-        short pixel = labels[j];
-        if(last_pixel != pixel || i == 0)
-          {
-          label_set.insert(pixel);
-          last_pixel = pixel;
-          if(label_set.size() > 1000)
-            throw GreedyException("Label wise interpolation not supported for image %s "
-                                  "which has over 1000 distinct labels", filename);
-          }
+      moving->TransformPhysicalPointToContinuousIndex(pt, cix);
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        lo[d] = std::min(lo[d], cix[d]);
+        hi[d] = std::max(hi[d], cix[d]);
         }
+      }
 
-      // Turn this set into an array
-      std::vector<short> label_array(label_set.begin(), label_set.end());
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      long i0 = (long) std::floor(lo[d]) - 1, i1 = (long) std::ceil(hi[d]) + 1;
+      out_region.SetIndex(d, i0);
+      out_region.SetSize(d, i1 - i0 + 1);
+      }
 
-      // Create a N-way voting filter
-      typedef NaryLabelVotingFunctor<ImageType, LabelImageType> VotingFunctor;
-      VotingFunctor vf(label_array);
+    return out_region.Crop(moving->GetLargestPossibleRegion());
+  }
 
-      typedef itk::NaryFunctorImageFilter<ImageType, LabelImageType, VotingFunctor> VotingFilter;
-      typename VotingFilter::Pointer fltVoting = VotingFilter::New();
-      fltVoting->SetFunctor(vf);
+  ApproachType *m_Approach;
+  typename ImageBaseType::Pointer m_Reference;
+  const CompiledTransformChain *m_TransformChain;
+  const ResliceSpec *m_Spec;
+  CompositeImagePointer m_Moving;
+  typename ReaderType::Pointer m_Reader;
+  unsigned int m_NumberOfComponents;
+};
 
-      // Create a mini-pipeline of streaming filters
-      for(int j = 0; j < label_array.size(); j++)
-        {
-        // Set up a threshold filter for this label
-        typedef itk::BinaryThresholdImageFilter<LabelImageType, ImageType> ThresholdFilterType;
-        typename ThresholdFilterType::Pointer fltThreshold = ThresholdFilterType::New();
-        fltThreshold->SetInput(label_image);
-        fltThreshold->SetLowerThreshold(label_array[j]);
-        fltThreshold->SetUpperThreshold(label_array[j]);
-        fltThreshold->SetInsideValue(1.0);
-        fltThreshold->SetOutsideValue(0.0);
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ResliceImageStreaming(const ResliceSpec &spec, ImageBaseType *ref,
+                        const CompiledTransformChain &compiled,
+                        int slab_size, GreedyParameters::Verbosity verbosity)
+{
+  GreedyStdOut gout(verbosity);
 
-        // Set up a smoothing filter for this label
-        typedef itk::SmoothingRecursiveGaussianImageFilter<ImageType, ImageType> SmootherType;
-        typename SmootherType::Pointer fltSmooth = SmootherType::New();
-        fltSmooth->SetInput(fltThreshold->GetOutput());
+  // Read the header of the moving image
+  typedef itk::ImageFileReader<CompositeImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(spec.moving.c_str());
+  reader->UpdateOutputInformation();
+  itk::ImageIOBase *io = reader->GetImageIO();
+  itk::ImageIOBase::IOComponentType comp = io->GetComponentType();
+  unsigned int n_comp = io->GetNumberOfComponents();
+
+  // If the format does not allow reading a region of the file, read it once in full
+  CompositeImagePointer moving = NULL;
+  if(!io->CanStreamRead())
+    {
+    gout.printf("  Moving image %s cannot be read in pieces and will be read in full\n",
+                spec.moving.c_str());
+    reader->Update();
+    moving = reader->GetOutput();
+    reader = NULL;
+    }
 
-        // Work out the sigmas for the filter
-        if(r_param.images[i].interp.sigma.physical_units)
-          {
-          fltSmooth->SetSigma(r_param.images[i].interp.sigma.sigma);
-          }
-        else
-          {
-          typename SmootherType::SigmaArrayType sigma_array;
-          for(int d = 0; d < VDim; d++)
-            sigma_array[d] = r_param.images[i].interp.sigma.sigma * label_image->GetSpacing()[d];
-          fltSmooth->SetSigmaArray(sigma_array);
-          }
+  // Check that the output can be written in pieces
+  itk::ImageIOBase::Pointer out_io = itk::ImageIOFactory::CreateImageIO(
+        spec.output.c_str(), itk::ImageIOFactory::WriteMode);
+  if(out_io)
+    out_io->SetFileName(spec.output.c_str());
+  if(!out_io || !out_io->CanStreamWrite())
+    gout.printf("  Output image %s cannot be written in pieces and will be resliced in full\n",
+                spec.output.c_str());
+
+  // Number of slabs
+  unsigned int n_slices = ref->GetLargestPossibleRegion().GetSize()[VDim-1];
+  unsigned int n_slabs = (n_slices + slab_size - 1) / slab_size;
+  gout.printf("  Reslicing %s in %d slabs\n", spec.moving.c_str(), n_slabs);
+
+  // Set up the streaming pipeline. The writer requests the output one slab at a
+  // time, splitting along the last axis
+  typedef GreedyResliceStreamingSource<VDim, TReal> SourceType;
+  typename SourceType::Pointer source = SourceType::New();
+  source->SetUp(this, ref, &compiled, &spec, moving, reader, n_comp);
+
+  LDDMMType::cimg_write(source->GetOutput(), spec.output.c_str(), comp, n_slabs);
+}
 
-        // TODO: we should really be coercing the output into a vector image to speed up interpolation!
-        typedef FastWarpCompositeImageFilter<ImageType, ImageType, VectorImageType> InterpFilter;
-        typename InterpFilter::Pointer fltInterp = InterpFilter::New();
-        fltInterp->SetMovingImage(fltSmooth->GetOutput());
-        fltInterp->SetDeformationField(warp);
-        fltInterp->SetUsePhysicalSpace(true);
+template <typename TReal, typename TLabel>
+class CompositeToLabelFunctor
+{
+  public:
+    short operator () (itk::VariableLengthVector<TReal> const &p) const { return (short) p[0]; }
+};
 
-        fltInterp->Update();
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::CompositeImagePointer
+GreedyApproach<VDim, TReal>
+::ResliceCompositeImage(CompositeImageType *moving, ImageBaseType *ref,
+                        VectorImageType *warp, const CompiledTransformChain &compiled,
+                        bool use_nn, TReal outside_value)
+{
+  CompositeImagePointer warped;
+  if(warp)
+    {
+    // Allocate the warped image
+    warped = LDDMMType::new_cimg(ref, moving->GetNumberOfComponentsPerPixel());
 
-        // Add to the voting filter
-        fltVoting->SetInput(j, fltInterp->GetOutput());
-        }
+    // Perform the warp
+    LDDMMType::interp_cimg(moving, warp, warped, use_nn, true, outside_value);
+    }
+  else
+    {
+    // Map each voxel through the compiled chain, without composing a warp
+    typedef TransformChainWarpImageFilter<CompositeImageType, CompositeImageType, VectorImageType> ChainFilter;
+    typename ChainFilter::Pointer fltChain = ChainFilter::New();
+    fltChain->SetMovingImage(moving);
+    fltChain->SetReferenceSpace(ref);
+    for(int k = 0; k < compiled.size(); k++)
+      {
+      if(compiled[k].warp)
+        fltChain->AddDeformationField(compiled[k].warp);
+      else
+        fltChain->AddAffineTransform(typename ChainFilter::MatrixType(compiled[k].A),
+                                     typename ChainFilter::VectorType(compiled[k].b));
+      }
+    fltChain->SetUseNearestNeighbor(use_nn);
+    fltChain->SetOutsideValue(outside_value);
+    ParallelFor::ApplyThreadQuota(fltChain);
+    fltChain->Update();
+    warped = fltChain->GetOutput();
+    }
 
-      // TODO: test out streaming!
-      // Run this big pipeline
-      fltVoting->Update();
+  return warped;
+}
 
-      // Save
-      WriteImageViaCache(fltVoting->GetOutput(), r_param.images[i].output.c_str());
-      }
-    else
+/**
+ * Label-wise reslicing restricted to the support of each label. The indicator of
+ * each label is only smoothed over the bounding box of the label, padded by the
+ * support of the smoothing kernel, and is only interpolated at the voxels of the
+ * reference space that map into that box. To find these labels quickly, the moving
+ * image is divided into blocks, each listing the labels whose boxes overlap it.
+ * The label image holds the index of each voxel's label in label_array. The voxels
+ * of out_label are mapped through the transform chain one at a time, so no warp
+ * is composed.
+ */
+template <class TLabelImage, class TFloatImage, class TVectorImage, class TChain, class TSigmaArray>
+void ResliceLabelsSparse(TLabelImage *label_index, const std::vector<short> &label_array,
+                         const std::vector<typename TLabelImage::RegionType> &boxes,
+                         const TSigmaArray &sigma, const TChain &chain,
+                         TLabelImage *out_label)
+{
+  const unsigned int VDim = TLabelImage::ImageDimension;
+  typedef typename TLabelImage::RegionType RegionType;
+  typedef typename TLabelImage::IndexType IndexType;
+  typedef typename TFloatImage::PixelType RealType;
+  typedef FastLinearInterpolator<TFloatImage, RealType, VDim> FastInterpolator;
+  typedef CompiledChainPointMapper<TChain, TVectorImage, RealType, VDim> MapperType;
+  const int block_size = 16;
+  unsigned int n_labels = label_array.size();
+
+  // Smooth the indicator of each label over its box. The boxes are small, so the
+  // labels are smoothed in parallel rather than each with all the threads
+  std::vector<typename TFloatImage::Pointer> smoothed(n_labels);
+  ParallelFor::Run(n_labels, 1, [&](long k0, long k1)
+    {
+    ParallelFor::ThreadQuota quota(1);
+    for(long k = k0; k < k1; k++)
       {
-      // Read the input image and record its type
-      itk::ImageIOBase::IOComponentType comp;
-      CompositeImagePointer moving = ReadImageViaCache<CompositeImageType>(filename, &comp);
+      typename TFloatImage::Pointer indicator = TFloatImage::New();
+      indicator->CopyInformation(label_index);
+      indicator->SetRegions(boxes[k]);
+      indicator->Allocate();
+
+      itk::ImageRegionConstIterator<TLabelImage> it_lab(label_index, boxes[k]);
+      itk::ImageRegionIterator<TFloatImage> it_ind(indicator, boxes[k]);
+      for(; !it_lab.IsAtEnd(); ++it_lab, ++it_ind)
+        it_ind.Set(it_lab.Get() == (short) k ? 1.0 : 0.0);
+
+      typedef itk::SmoothingRecursiveGaussianImageFilter<TFloatImage, TFloatImage> SmootherType;
+      typename SmootherType::Pointer fltSmooth = SmootherType::New();
+      fltSmooth->SetInput(indicator);
+      fltSmooth->SetSigmaArray(sigma);
+      ParallelFor::ApplyThreadQuota(fltSmooth);
+      fltSmooth->Update();
+      smoothed[k] = fltSmooth->GetOutput();
+      }
+    });
+
+  // Assign the labels to the blocks that their boxes overlap
+  RegionType mov_region = label_index->GetLargestPossibleRegion();
+  IndexType grid_size;
+  unsigned int n_blocks = 1;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    grid_size[d] = (mov_region.GetSize()[d] + block_size - 1) / block_size;
+    n_blocks *= grid_size[d];
+    }
 
-      // Allocate the warped image
-      CompositeImagePointer warped = LDDMMType::new_cimg(ref, moving->GetNumberOfComponentsPerPixel());
+  std::vector< std::vector<unsigned int> > block_labels(n_blocks);
+  for(unsigned int k = 0; k < n_labels; k++)
+    {
+    IndexType b0, b1, b;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      b0[d] = (boxes[k].GetIndex()[d] - mov_region.GetIndex()[d]) / block_size;
+      b1[d] = (boxes[k].GetIndex()[d] + boxes[k].GetSize()[d] - 1 - mov_region.GetIndex()[d]) / block_size;
+      }
 
-      // Perform the warp
-      LDDMMType::interp_cimg(moving, warp, warped,
-                             r_param.images[i].interp.mode == InterpSpec::NEAREST,
-                             true, r_param.images[i].interp.outside_value);
+    // Visit every block between b0 and b1
+    for(b = b0; ; )
+      {
+      unsigned int offset = 0;
+      for(int d = VDim - 1; d >= 0; d--)
+        offset = offset * grid_size[d] + b[d];
+      block_labels[offset].push_back(k);
 
-      // Write, casting to the input component type
-      WriteImageViaCache(warped.GetPointer(), r_param.images[i].output.c_str(), comp);
+      unsigned int d = 0;
+      for(; d < VDim; d++)
+        {
+        if(++b[d] <= b1[d])
+          break;
+        b[d] = b0[d];
+        }
+      if(d == VDim)
+        break;
       }
     }
 
-  // Process meshes
-  for(int i = 0; i < r_param.meshes.size(); i++)
+  // Find the label with the largest smoothed value at each voxel of the reference
+  // space, one chunk of lines at a time
+  const RegionType &out_region = out_label->GetBufferedRegion();
+  long line_len = out_region.GetSize()[0];
+  long n_lines = out_region.GetNumberOfPixels() / line_len;
+  ParallelFor::Run(n_lines, 0, [&](long l0, long l1)
     {
-    typedef itk::Mesh<TReal, VDim> MeshType;
-    typedef itk::MeshFileReader<MeshType> MeshReader;
-    typename MeshType::Pointer mesh;
+    // The interpolators keep per-sample state, so each chunk has its own, created
+    // for the labels that it samples
+    MapperType mapper(chain);
+    std::vector< std::unique_ptr<FastInterpolator> > fi(n_labels);
 
-    if(itksys::SystemTools::GetFilenameExtension(r_param.meshes[i].fixed) == ".csv")
+    for(long l = l0; l < l1; l++)
       {
-      mesh = MeshType::New();
-
-      std::ifstream fin(r_param.meshes[i].fixed.c_str());
-      std::string f_line, f_token;
-      unsigned int n_pts = 0;
-      while(std::getline(fin, f_line))
+      IndexType idx = out_label->ComputeIndex(l * line_len);
+      short *p_out = out_label->GetBufferPointer() + l * line_len;
+      for(long i = 0; i < line_len; i++, idx[0]++)
         {
-        std::istringstream iss(f_line);
-        itk::Point<TReal, VDim> pt;
-        for(unsigned int a = 0; a < VDim; a++)
+        // Map the voxel into the moving image
+        typename MapperType::PointType pt;
+        out_label->TransformIndexToPhysicalPoint(idx, pt);
+        mapper.Map(pt);
+
+        itk::ContinuousIndex<RealType, VDim> cix;
+        label_index->TransformPhysicalPointToContinuousIndex(pt, cix);
+
+        // Find the block, allowing for the interpolation border around the image
+        unsigned int offset = 0;
+        bool inside = true;
+        for(int d = VDim - 1; d >= 0; d--)
           {
-          if(!std::getline(iss, f_token, ','))
-            throw GreedyException("Error reading CSV file, line %s", f_line.c_str());
-          pt[a] = atof(f_token.c_str());
+          double x = cix[d] - mov_region.GetIndex()[d];
+          if(x <= -1.0 || x >= mov_region.GetSize()[d])
+            inside = false;
+          long bd = std::max(0l, std::min((long) mov_region.GetSize()[d] - 1, (long) std::floor(x))) / block_size;
+          offset = offset * grid_size[d] + bd;
           }
-        mesh->SetPoint(n_pts++, pt);
+
+        RealType best_value = -1.0;
+        short best = label_array[0];
+        if(inside)
+          {
+          const std::vector<unsigned int> &bl = block_labels[offset];
+          for(unsigned int j = 0; j < bl.size(); j++)
+            {
+            unsigned int k = bl[j];
+            RealType cix_local[VDim], value;
+            for(unsigned int d = 0; d < VDim; d++)
+              cix_local[d] = cix[d] - boxes[k].GetIndex()[d];
+
+            if(!fi[k])
+              fi[k].reset(new FastInterpolator(smoothed[k]));
+            if(fi[k]->Interpolate(cix_local, &value) != FastInterpolator::OUTSIDE && value > best_value)
+              {
+              best_value = value;
+              best = label_array[k];
+              }
+            }
+          }
+
+        p_out[i] = best;
         }
       }
-    else
+    });
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ResliceLabelImage(const ResliceSpec &spec, ImageBaseType *ref,
+                    VectorImageType *warp, const CompiledTransformChain &compiled,
+                    unsigned int batch_size)
+{
+  const char *filename = spec.moving.c_str();
+
+  // The label image is assumed to have a finite set of labels
+  CompositeImagePointer moving = ReadImageViaCache<CompositeImageType>(filename);
+  if(moving->GetNumberOfComponentsPerPixel() > 1)
+    throw GreedyException("Label wise interpolation not supported for multi-component images");
+
+  // Cast the image to an image of shorts
+  typedef itk::Image<short, VDim> LabelImageType;
+  typedef CompositeToLabelFunctor<TReal, short> CastFunctor;
+  typedef itk::UnaryFunctorImageFilter<CompositeImageType, LabelImageType, CastFunctor> CastFilter;
+  typename CastFilter::Pointer fltCast = CastFilter::New();
+  fltCast->SetInput(moving);
+  ParallelFor::ApplyThreadQuota(fltCast);
+  fltCast->Update();
+  typename LabelImageType::Pointer label_image = fltCast->GetOutput();
+  moving = NULL;
+
+  // Scan the unique labels in the image
+  std::set<short> label_set;
+  short *labels = label_image->GetBufferPointer();
+  int n_pixels = label_image->GetPixelContainer()->Size();
+  short last_pixel = 0;
+  for(int j = 0; j < n_pixels; j++)
+    {
+    short pixel = labels[j];
+    if(last_pixel != pixel || j == 0)
       {
-      typename MeshReader::Pointer reader = MeshReader::New();
-      reader->SetFileName(r_param.meshes[i].fixed.c_str());
-      reader->Update();
-      mesh = reader->GetOutput();
+      label_set.insert(pixel);
+      last_pixel = pixel;
       }
+    }
 
-    typedef WarpMeshTransformFunctor<VDim, TReal> TransformType;
-    typename TransformType::Pointer transform = TransformType::New();
-    transform->SetWarp(warp);
-    transform->SetReferenceSpace(ref);
+  // Turn this set into an array, and replace each label by its index in the array
+  std::vector<short> label_array(label_set.begin(), label_set.end());
+  for(int j = 0; j < n_pixels; j++)
+    labels[j] = (short) (std::lower_bound(label_array.begin(), label_array.end(), labels[j])
+                         - label_array.begin());
 
-    typedef itk::TransformMeshFilter<MeshType, MeshType, TransformType> FilterType;
-    typename FilterType::Pointer filter = FilterType::New();
-    filter->SetTransform(transform);
-    filter->SetInput(mesh);
-    filter->Update();
+  // Work out the sigmas for smoothing, in physical units
+  typename LDDMMType::Vec sigma;
+  for(int d = 0; d < VDim; d++)
+    sigma[d] = spec.interp.sigma.physical_units
+               ? spec.interp.sigma.sigma
+               : spec.interp.sigma.sigma * label_image->GetSpacing()[d];
+
+  // The label at each voxel of the output
+  typename LabelImageType::Pointer best_label = LabelImageType::New();
+  best_label->CopyInformation(ref);
+  best_label->SetRegions(ref->GetBufferedRegion());
+  best_label->Allocate();
+  best_label->FillBuffer(label_array[0]);
+
+  // Find the bounding box of each label, padded by the support of the smoothing
+  // kernel and by one voxel for interpolation
+  typedef typename LabelImageType::RegionType RegionType;
+  unsigned int n_labels = label_array.size();
+  std::vector<typename LabelImageType::IndexType> box_lo(n_labels), box_hi(n_labels);
+  std::vector<bool> box_empty(n_labels, true);
+  typedef itk::ImageRegionConstIteratorWithIndex<LabelImageType> LabelIter;
+  for(LabelIter it(label_image, label_image->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    unsigned short k = (unsigned short) it.Get();
+    typename LabelImageType::IndexType idx = it.GetIndex();
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      box_lo[k][d] = box_empty[k] ? idx[d] : std::min(box_lo[k][d], idx[d]);
+      box_hi[k][d] = box_empty[k] ? idx[d] : std::max(box_hi[k][d], idx[d]);
+      }
+    box_empty[k] = false;
+    }
+
+  std::vector<RegionType> boxes(n_labels);
+  double box_voxels = 0.0;
+  for(unsigned int k = 0; k < n_labels; k++)
+    {
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      long pad = (long) std::ceil(3.0 * sigma[d] / label_image->GetSpacing()[d]) + 1;
+      boxes[k].SetIndex(d, box_lo[k][d] - pad);
+      boxes[k].SetSize(d, box_hi[k][d] - box_lo[k][d] + 1 + 2 * pad);
+      }
+    boxes[k].Crop(label_image->GetBufferedRegion());
+    box_voxels += boxes[k].GetNumberOfPixels();
+    }
+
+  // The sparse path pays off for parcellations, i.e., many labels that each cover
+  // a small part of the image. A set of labels that fits in one batch is smoothed
+  // and warped in a single dense pass, and the sparse path must do at most a
+  // quarter of the dense work while keeping no more smoothed voxels in memory
+  // than a dense batch does
+  batch_size = std::max(batch_size, 1u);
+  bool use_sparse = n_labels > batch_size
+                    && box_voxels <= 0.25 * n_labels * n_pixels
+                    && box_voxels <= (double) batch_size * n_pixels;
+  if(use_sparse)
+    {
+    // Map the voxels through the composed warp if there is one, otherwise
+    // through the compiled chain
+    CompiledTransformChain warp_chain(1);
+    warp_chain[0].warp = warp;
+
+    ResliceLabelsSparse<LabelImageType, ImageType, VectorImageType>(
+          label_image, label_array, boxes, sigma, warp ? warp_chain : compiled, best_label);
+
+    WriteImageViaCache(best_label.GetPointer(), spec.output.c_str());
+    return;
+    }
 
-    mesh = filter->GetOutput();
+  // The largest smoothed value at each voxel
+  ImagePointer best_value = LDDMMType::new_img(ref);
+  best_value->FillBuffer(-1.0);
 
-    if(itksys::SystemTools::GetFilenameExtension(r_param.meshes[i].output) == ".csv")
+  // Process the labels in batches. The indicator images of a batch are stored as the
+  // components of a single image, so that they are smoothed and warped together
+  for(unsigned int b0 = 0; b0 < label_array.size(); b0 += batch_size)
+    {
+    unsigned int nb = std::min((unsigned int) label_array.size() - b0, batch_size);
+
+    // Fill the indicator images
+    CompositeImagePointer indicator = LDDMMType::new_cimg(label_image, nb);
+    TReal *p_ind = indicator->GetBufferPointer();
+    for(int j = 0; j < n_pixels; j++, p_ind += nb)
+      {
+      unsigned int k = (unsigned short) labels[j] - b0;
+      if(k < nb)
+        p_ind[k] = 1.0;
+      }
+
+    // Smooth all the indicators at once
+    typedef itk::SmoothingRecursiveGaussianImageFilter<CompositeImageType, CompositeImageType> SmootherType;
+    typename SmootherType::Pointer fltSmooth = SmootherType::New();
+    fltSmooth->SetInput(indicator);
+    fltSmooth->SetSigmaArray(sigma);
+    ParallelFor::ApplyThreadQuota(fltSmooth);
+    fltSmooth->Update();
+    CompositeImagePointer smoothed = fltSmooth->GetOutput();
+    fltSmooth = NULL;
+    indicator = NULL;
+
+    // Warp them into the reference space
+    CompositeImagePointer warped = ResliceCompositeImage(smoothed, ref, warp, compiled, false, 0.0);
+    smoothed = NULL;
+
+    // Update the running maximum
+    const TReal *p_warped = warped->GetBufferPointer();
+    TReal *p_best = best_value->GetBufferPointer();
+    short *p_label = best_label->GetBufferPointer();
+    int n_ref = best_value->GetPixelContainer()->Size();
+    for(int j = 0; j < n_ref; j++, p_warped += nb)
       {
-      std::ofstream out(r_param.meshes[i].output.c_str());
-      for(unsigned int i = 0; i < mesh->GetNumberOfPoints(); i++)
+      for(unsigned int k = 0; k < nb; k++)
         {
-        itk::Point<TReal, VDim> pt = mesh->GetPoint(i);
-        for(unsigned int a = 0; a < VDim; a++)
-          out << pt[a] << (a < VDim-1 ? "," : "\n");
+        if(p_warped[k] > p_best[j])
+          {
+          p_best[j] = p_warped[k];
+          p_label[j] = label_array[b0 + k];
+          }
         }
       }
-    else
+    }
+
+  // Save
+  WriteImageViaCache(best_label.GetPointer(), spec.output.c_str());
+}
+
+/**
+ * Run the reslice code - simply apply a warp or set of warps to images
+ */
+template <unsigned int VDim, typename TReal>
+int GreedyApproach<VDim, TReal>
+::RunReslice(GreedyParameters &param)
+{
+  // Object for text output
+  GreedyStdOut gout(param.verbosity);
+
+  GreedyResliceParameters r_param = param.reslice_param;
+
+  // Check the parameters
+  if(!r_param.ref_image.size())
+    throw GreedyException("A reference image (-rf) option is required for reslice commands");
+
+  if(r_param.images.size() + r_param.meshes.size() == 0
+     && !r_param.out_composed_warp.size()
+     && !r_param.out_jacobian_image.size())
+    throw GreedyException("No operation specified for reslice mode. "
+                          "Use one of -rm, -rs or -rc commands.");
+
+  // Read the fixed as a plain image (we don't care if it's composite)
+  typename ImageBaseType::Pointer ref = ReadImageBaseViaCache(r_param.ref_image);
+
+  // Decide which images are resliced in slabs. Label-wise interpolation and images
+  // passed through the cache are always resliced in memory
+  std::vector<bool> streamed(r_param.images.size(), false);
+  bool need_full_warp = r_param.out_composed_warp.size()
+                        || r_param.out_jacobian_image.size() || r_param.flag_bricked;
+  for(int i = 0; i < r_param.images.size(); i++)
+    {
+    streamed[i] = r_param.slab_size > 0
+                  && r_param.images[i].interp.mode != InterpSpec::LABELWISE
+                  && !CheckCache<itk::Object>(r_param.images[i].moving)
+                  && !CheckCache<itk::Object>(r_param.images[i].output);
+    }
+
+  // Read the transform chain. Consecutive affine transforms are folded into one.
+  // The chain is only composed into a warp if some output needs the warp itself,
+  // otherwise images are resliced by mapping each voxel through the chain
+  CompiledTransformChain compiled;
+  CompileTransformChain(param.reslice_param.transforms, compiled);
+
+  // With bricked storage, the warps are converted to bricks once after reading, and
+  // the chain is always composed so that the images are resliced from bricks too
+  if(r_param.flag_bricked)
+    {
+    for(int k = 0; k < compiled.size(); k++)
       {
-      typedef itk::MeshFileWriter<MeshType> MeshWriter;
-      typename MeshWriter::Pointer writer = MeshWriter::New();
-      writer->SetInput(mesh);
-      writer->SetFileName(r_param.meshes[i].output.c_str());
-      writer->Update();
+      if(compiled[k].warp)
+        {
+        compiled[k].bricked_warp = LDDMMType::BrickedVectorImageType::New();
+        compiled[k].bricked_warp->Import(compiled[k].warp.GetPointer());
+        }
       }
     }
 
+  VectorImagePointer warp;
+  if(need_full_warp)
+    ComposeTransformChain(compiled, ref, warp);
+
+  // Write the composite warp if requested
+  if(r_param.out_composed_warp.size())
+    {
+    WriteImageViaCache(warp.GetPointer(), r_param.out_composed_warp.c_str(), itk::ImageIOBase::FLOAT);
+    }
+
+  // Compute the Jacobian of the warp if requested
+  if(r_param.out_jacobian_image.size())
+    {
+    ImagePointer iTemp = ImageType::New();
+    LDDMMType::alloc_img(iTemp, warp);
+    LDDMMType::field_jacobian_det(warp, iTemp);
+
+    WriteImageViaCache(iTemp.GetPointer(), r_param.out_jacobian_image.c_str(), itk::ImageIOBase::FLOAT);
+    }
+
+
+  // Process image pairs
+  for(int i = 0; i < r_param.images.size(); i++)
+    {
+    const char *filename = r_param.images[i].moving.c_str();
+
+    // Images larger than memory are resliced one slab at a time
+    if(streamed[i])
+      {
+      ResliceImageStreaming(r_param.images[i], ref, compiled,
+                            r_param.slab_size, param.verbosity);
+      }
+
+    // Handle the special case of multi-label images
+    else if(r_param.images[i].interp.mode == InterpSpec::LABELWISE)
+      {
+      ResliceLabelImage(r_param.images[i], ref, warp, compiled, r_param.label_batch_size);
+      }
+    else
+      {
+      // Read the input image and record its type
+      itk::ImageIOBase::IOComponentType comp;
+      CompositeImagePointer moving = ReadImageViaCache<CompositeImageType>(filename, &comp);
 
+      // Perform the warp, from a bricked copy of the moving image if requested
+      bool use_nn = r_param.images[i].interp.mode == InterpSpec::NEAREST;
+      CompositeImagePointer warped;
+      if(r_param.flag_bricked && warp)
+        {
+        typename LDDMMType::BrickedCompositeImagePointer bricked = LDDMMType::BrickedCompositeImageType::New();
+        bricked->Import(moving.GetPointer());
+        warped = LDDMMType::new_cimg(ref, moving->GetNumberOfComponentsPerPixel());
+        LDDMMType::interp_cimg(bricked, warp, warped, use_nn, true,
+                               r_param.images[i].interp.outside_value);
+        }
+      else
+        {
+        warped = ResliceCompositeImage(moving, ref, warp, compiled, use_nn,
+                                       r_param.images[i].interp.outside_value);
+        }
+
+      // Write, casting to the input component type
+      WriteImageViaCache(warped.GetPointer(), r_param.images[i].output.c_str(), comp);
+      }
+    }
+
+  // Process meshes. The transform chain is evaluated at each point, so this does
+  // not need the composed warp
+  for(int i = 0; i < r_param.meshes.size(); i++)
+    ResliceMesh(r_param.meshes[i], compiled);
 
   return 0;
 }
@@ -2550,35 +4651,104 @@ void GreedyApproach<VDim, TReal>
                       const std::vector<double> &weights,
                       VecFx &m1, MatFx &m2)
 {
+  typedef vnl_vector_fixed<double, VDim> VecD;
+  typedef vnl_matrix_fixed<double, VDim, VDim> MatD;
+
   int n = image->GetNumberOfComponentsPerPixel();
-  TReal sum_I = 0.0;
-  m1.fill(0.0); m2.fill(0.0);
+  typename CompositeImageType::RegionType region = image->GetBufferedRegion();
+  long nx = region.GetSize()[0];
+  long n_lines = region.GetNumberOfPixels() / std::max(nx, 1L);
+  const TReal *buffer = image->GetBufferPointer();
+
+  // Index to RAS coordinate map. The LPS map is direction * spacing plus the
+  // origin, and RAS flips the first two axes
+  MatD M; VecD p_org;
+  for(int a = 0; a < VDim; a++)
+    {
+    double sign = (a < 2) ? -1.0 : 1.0;
+    p_org[a] = sign * image->GetOrigin()[a];
+    for(int b = 0; b < VDim; b++)
+      M(a,b) = sign * image->GetDirection()(a,b) * image->GetSpacing()[b];
+    }
+  VecD s_x = M.get_column(0);
+  MatD s_xx = outer_product(s_x, s_x);
 
-  typedef itk::ImageRegionConstIteratorWithIndex<CompositeImageType> Iterator;
-  for(Iterator it(image, image->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+  // Partial sums for a range of scanlines
+  struct Partial
     {
-    typedef itk::Point<TReal, VDim> PointType;
-    PointType p_lps, p_ras;
-    image->TransformIndexToPhysicalPoint(it.GetIndex(), p_lps);
-    PhysicalCoordinateTransform<VDim, PointType>::lps_to_ras(p_lps, p_ras);
-    VecFx X(p_ras.GetDataPointer());
-    MatFx X2 = outer_product(X, X);
+    double sum; VecD m1; MatD m2;
+    Partial() : sum(0.0) { m1.fill(0.0); m2.fill(0.0); }
+    };
 
-    typename CompositeImageType::PixelType pix = it.Get();
+  // The lines are split into fixed chunks that are reduced in order, so that
+  // the result does not depend on the number of threads
+  long grain = std::max(1L, 16384L / std::max(nx, 1L));
+  long n_chunks = (n_lines + grain - 1) / grain;
+  std::vector<Partial> partial(n_chunks);
 
-    // Just weight the components of intensity by weight vector - this sort of makes sense?
-    TReal val = 0.0;
-    for(int k = 0; k < n; k++)
-      val += weights[k] * pix[k];
+  ParallelFor::Run(n_chunks, 1, [&](long c0, long c1)
+    {
+    for(long c = c0; c < c1; c++)
+      {
+      Partial &P = partial[c];
+      long l1 = std::min(n_lines, (c + 1) * grain);
+      for(long line = c * grain; line < l1; line++)
+        {
+        // Physical position of the first voxel in the line
+        VecD p0 = p_org;
+        long rem = line;
+        for(int b = 1; b < VDim; b++)
+          {
+          long size_b = region.GetSize()[b];
+          double idx = region.GetIndex()[b] + (rem % size_b);
+          rem /= size_b;
+          for(int a = 0; a < VDim; a++)
+            p0[a] += M(a,b) * idx;
+          }
+        for(int a = 0; a < VDim; a++)
+          p0[a] += M(a,0) * region.GetIndex()[0];
+
+        // Along the line X = p0 + j * s_x, so only the zeroth, first and second
+        // moments of the intensity in j are needed per voxel
+        const TReal *p = buffer + line * nx * n;
+        double S0 = 0.0, S1 = 0.0, S2 = 0.0;
+        for(long j = 0; j < nx; j++, p += n)
+          {
+          // Just weight the components of intensity by weight vector - this sort of makes sense?
+          double val = 0.0;
+          for(int k = 0; k < n; k++)
+            val += weights[k] * p[k];
+
+          S0 += val;
+          S1 += val * j;
+          S2 += val * j * j;
+          }
+
+        MatD p0_s = outer_product(p0, s_x);
+        P.sum += S0;
+        P.m1 += p0 * S0 + s_x * S1;
+        P.m2 += outer_product(p0, p0) * S0 + (p0_s + p0_s.transpose()) * S1 + s_xx * S2;
+        }
+      }
+    });
 
-    sum_I += val;
-    m1 += X * val;
-    m2 += X2 * val;
+  Partial total;
+  for(long c = 0; c < n_chunks; c++)
+    {
+    total.sum += partial[c].sum;
+    total.m1 += partial[c].m1;
+    total.m2 += partial[c].m2;
     }
 
   // Compute the mean and covariance from the sum of squares
-  m1 = m1 / sum_I;
-  m2 = (m2 - sum_I *  outer_product(m1, m1)) / sum_I;
+  VecD mean = total.m1 / total.sum;
+  MatD cov = (total.m2 - total.sum * outer_product(mean, mean)) / total.sum;
+  for(int a = 0; a < VDim; a++)
+    {
+    m1[a] = mean[a];
+    for(int b = 0; b < VDim; b++)
+      m2(a,b) = cov(a,b);
+    }
 }
 
 template <unsigned int VDim, typename TReal>
@@ -2596,9 +4766,7 @@ int GreedyApproach<VDim, TReal>
   // Read the image pairs to register
   ReadImages(param, of_helper);
 
-  // Compute the moments of intertia for the fixed and moving images. For now
-  // this is done in an iterator loop, out of laziness. Should be converted to
-  // a filter if this whole moments business proves useful
+  // Compute the moments of intertia for the fixed and moving images
   VecFx m1f, m1m;
   MatFx m2f, m2m;
 
@@ -2631,11 +4799,10 @@ int GreedyApproach<VDim, TReal>
   // Create a rigid registration problem
   PhysicalSpaceAffineCostFunction cost_fn(&param, this, 0, &of_helper);
 
-  // The best set of coefficients and the associated match value
-  vnl_vector<double> xBest;
-  TReal xBestMatch = vnl_numeric_traits<TReal>::maxval;
-
-  // Generate all possible flip matrices
+  // Generate all possible flip matrices, keeping the candidates allowed by the
+  // moments order and the determinant constraint
+  std::vector<MatFx> cand_F;
+  std::vector<vnl_vector<double> > cand_x;
   int n_flip = 1 << VDim;
   for(int k_flip = 0; k_flip < n_flip; k_flip++)
     {
@@ -2652,12 +4819,6 @@ int GreedyApproach<VDim, TReal>
     MatFx R = Vm * F * Vf.transpose();
     VecFx b = m1m - R * m1f;
 
-    vnl_matrix<TReal> A(VDim+1, VDim+1, 0.0);
-    A.set_identity();
-    A.update(R, 0, 0);
-    for(int d= 0 ;d< VDim;d++)
-      A(d,VDim) = b[d];
-
     // Ignore flips with the wrong determinant
     double det_R = vnl_determinant(R);
     if((param.moments_order == 2 && param.moments_flip_determinant == 1 && det_R < 0) ||
@@ -2670,17 +4831,59 @@ int GreedyApproach<VDim, TReal>
     vnl_vector<double> x(cost_fn.get_number_of_unknowns());
     flatten_affine_transform(R, b, x.data_block());
 
-    // Compute similarity
-    double f = 0.0;
-    cost_fn.compute(x, &f, NULL);
+    cand_F.push_back(F);
+    cand_x.push_back(x);
+    }
 
-    std::cout << "Metric for flip " << F.get_diagonal() << " : " << f << std::endl;
+  // Score the candidates in parallel. The pooled functions have no parent, so
+  // that they do not write to the metric log from several threads, and so that
+  // each keeps its own working images, including the NCC working image. The
+  // threads draw from a pool that grows only to the number of candidates
+  // evaluated at the same time. The first candidate is scored on its own, so
+  // that state the helper builds lazily (e.g., the MI histograms) exists before
+  // the threads start
+  std::vector<double> cand_f(cand_x.size(), 0.0);
+  std::vector<std::unique_ptr<PhysicalSpaceAffineCostFunction> > cost_pool;
+  std::mutex cost_pool_mutex;
+  if(cand_x.size())
+    {
+    cost_pool.emplace_back(new PhysicalSpaceAffineCostFunction(&param, NULL, 0, &of_helper));
+    cost_pool.back()->compute(cand_x[0], &cand_f[0], NULL);
+    }
+  ParallelFor::Run((long) cand_x.size() - 1, 1, [&](long j0, long j1)
+    {
+    std::unique_ptr<PhysicalSpaceAffineCostFunction> fn;
+      {
+      std::lock_guard<std::mutex> lock(cost_pool_mutex);
+      if(cost_pool.size())
+        {
+        fn = std::move(cost_pool.back());
+        cost_pool.pop_back();
+        }
+      }
+    if(!fn)
+      fn.reset(new PhysicalSpaceAffineCostFunction(&param, NULL, 0, &of_helper));
+
+    for(long i = j0 + 1; i < j1 + 1; i++)
+      fn->compute(cand_x[i], &cand_f[i], NULL);
+
+    std::lock_guard<std::mutex> lock(cost_pool_mutex);
+    cost_pool.push_back(std::move(fn));
+    });
+
+  // The best set of coefficients and the associated match value, taking the first
+  // candidate in flip order on ties
+  vnl_vector<double> xBest;
+  TReal xBestMatch = vnl_numeric_traits<TReal>::maxval;
+  for(unsigned int i = 0; i < cand_x.size(); i++)
+    {
+    std::cout << "Metric for flip " << cand_F[i].get_diagonal() << " : " << cand_f[i] << std::endl;
 
     // Compare
-    if(xBestMatch > f || xBest.size() == 0)
+    if(xBestMatch > cand_f[i] || xBest.size() == 0)
       {
-      xBestMatch = f;
-      xBest = x;
+      xBestMatch = cand_f[i];
+      xBest = cand_x[i];
       }
     }
 
@@ -2688,7 +4891,10 @@ int GreedyApproach<VDim, TReal>
   typename LinearTransformType::Pointer tran = LinearTransformType::New();
   cost_fn.GetTransform(xBest, tran);
   vnl_matrix<double> Q_physical = MapAffineToPhysicalRASSpace(of_helper, 0, tran);
-  this->WriteAffineMatrixViaCache(param.output, Q_physical);
+  m_Result.Reset();
+  m_Result.SetAffineMatrix(Q_physical);
+  if(param.output.size())
+    this->WriteAffineMatrixViaCache(param.output, Q_physical);
 
   return 0;
 }
@@ -2713,10 +4919,19 @@ int GreedyApproach<VDim, TReal>
   // Compute the inverse of the warp
   VectorImagePointer uInverse = VectorImageType::New();
   LDDMMType::alloc_vimg(uInverse, warp);
-  OFHelperType::ComputeDeformationFieldInverse(warp, uInverse, param.warp_exponent, true);
+
+  GreedyTimeProbe tm_inverse;
+  tm_inverse.Start();
+  OFHelperType::ComputeDeformationFieldInverse(warp, uInverse, param.warp_exponent, true,
+                                               param.invwarp_param.tolerance,
+                                               param.invwarp_param.max_iter);
+  tm_inverse.Stop();
+  printf("Warp inverse computed in %8.4f s (CPU time %8.4f s)\n",
+         tm_inverse.GetTotal(), tm_inverse.GetTotalCPU());
 
   // Write the warp using compressed format
-  WriteCompressedWarpInPhysicalSpaceViaCache(uInverse, warp, param.invwarp_param.out_warp.c_str(), param.warp_precision);
+  WriteCompressedWarpInPhysicalSpaceViaCache(uInverse, warp, param.invwarp_param.out_warp.c_str(), param.warp_precision,
+                                             param.warp_quant_bits, param.warp_quant_shrink);
 
   return 0;
 }
@@ -2745,7 +4960,8 @@ int GreedyApproach<VDim, TReal>
   OFHelperType::ComputeWarpRoot(warp, warp_root, param.warp_exponent, 1e-6);
 
   // Write the warp using compressed format
-  WriteCompressedWarpInPhysicalSpaceViaCache(warp_root, warp, param.warproot_param.out_warp.c_str(), param.warp_precision);
+  WriteCompressedWarpInPhysicalSpaceViaCache(warp_root, warp, param.warproot_param.out_warp.c_str(), param.warp_precision,
+                                             param.warp_quant_bits, param.warp_quant_shrink);
 
   return 0;
 }
@@ -2771,10 +4987,131 @@ template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::AddCachedInputObject(std::string key, itk::Object *object)
 {
+  m_ImportedBuffers.erase(key);
   m_ImageCache[key].target = object;
   m_ImageCache[key].force_write = false;
 }
 
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::AddCachedInputBuffer(std::string key, void *buffer,
+                       itk::ImageIOBase::IOComponentType comp_type, unsigned int ncomp,
+                       const typename ImageBaseType::SizeType &size,
+                       const typename ImageBaseType::SpacingType &spacing,
+                       const typename ImageBaseType::PointType &origin,
+                       const typename ImageBaseType::DirectionType &direction)
+{
+  if(ncomp == 0)
+    throw GreedyException("Image buffer %s must have at least one component", key.c_str());
+
+  ImportedBuffer &ib = m_ImportedBuffers[key];
+  ib.buffer = buffer;
+  ib.comp_type = comp_type;
+  ib.ncomp = ncomp;
+  ib.views.clear();
+
+  // The geometry of the buffer
+  typename ImageBaseType::RegionType region;
+  region.SetSize(size);
+  ib.geometry = ImageBaseType::New();
+  ib.geometry->SetRegions(region);
+  ib.geometry->SetSpacing(spacing);
+  ib.geometry->SetOrigin(origin);
+  ib.geometry->SetDirection(direction);
+
+  // Buffers of the internal type are wrapped as images, without copying. The
+  // images do not own the buffer
+  itk::ImageIOBase::IOComponentType comp_real =
+      sizeof(TReal) == sizeof(float) ? itk::ImageIOBase::FLOAT : itk::ImageIOBase::DOUBLE;
+  if(comp_type == comp_real)
+    {
+    unsigned long nvox = region.GetNumberOfPixels();
+    TReal *data = static_cast<TReal *>(buffer);
+
+    CompositeImagePointer cimg = CompositeImageType::New();
+    cimg->CopyInformation(ib.geometry);
+    cimg->SetRegions(region);
+    cimg->SetNumberOfComponentsPerPixel(ncomp);
+    cimg->GetPixelContainer()->SetImportPointer(data, nvox * ncomp, false);
+    ib.views.push_back(cimg.GetPointer());
+
+    if(ncomp == 1)
+      {
+      ImagePointer img = ImageType::New();
+      img->CopyInformation(ib.geometry);
+      img->SetRegions(region);
+      img->GetPixelContainer()->SetImportPointer(data, nvox, false);
+      ib.views.push_back(img.GetPointer());
+      }
+    else if(ncomp == VDim)
+      {
+      VectorImagePointer vimg = VectorImageType::New();
+      vimg->CopyInformation(ib.geometry);
+      vimg->SetRegions(region);
+      vimg->GetPixelContainer()->SetImportPointer(
+            reinterpret_cast<typename VectorImageType::PixelType *>(data), nvox, false);
+      ib.views.push_back(vimg.GetPointer());
+      }
+    }
+
+  // The cache entry refers to the main view, or to the geometry, which is enough
+  // for the reference space and is converted on read otherwise
+  m_ImageCache[key].target = ib.views.size() ? ib.views.front().GetPointer() : ib.geometry.GetPointer();
+  m_ImageCache[key].force_write = false;
+}
+
+template <class TIn, class TOut>
+void ConvertImportedComponents(const void *in, TOut *out, long n)
+{
+  const TIn *src = static_cast<const TIn *>(in);
+  ParallelFor::Run(n, 0, [src, out](long k0, long k1)
+    {
+    for(long k = k0; k < k1; k++)
+      out[k] = static_cast<TOut>(src[k]);
+    });
+}
+
+template <unsigned int VDim, typename TReal>
+template <class TImage>
+itk::SmartPointer<TImage>
+GreedyApproach<VDim, TReal>
+::ConvertImportedBuffer(const ImportedBuffer &ib)
+{
+  // Only images that store their components as TReal (composite, scalar and
+  // vector images) can be converted to
+  typedef typename itk::DefaultConvertPixelTraits<typename TImage::PixelType>::ComponentType ComponentType;
+  if(typeid(ComponentType) != typeid(TReal))
+    return NULL;
+
+  itk::SmartPointer<TImage> image = TImage::New();
+  image->CopyInformation(ib.geometry);
+  image->SetRegions(ib.geometry->GetBufferedRegion());
+  image->SetNumberOfComponentsPerPixel(ib.ncomp);
+  image->Allocate();
+  if(image->GetNumberOfComponentsPerPixel() != ib.ncomp)
+    return NULL;
+
+  TReal *out = reinterpret_cast<TReal *>(image->GetBufferPointer());
+  long n = (long) ib.geometry->GetBufferedRegion().GetNumberOfPixels() * ib.ncomp;
+  switch(ib.comp_type)
+    {
+    case itk::ImageIOBase::UCHAR:  ConvertImportedComponents<unsigned char>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::CHAR:   ConvertImportedComponents<signed char>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::USHORT: ConvertImportedComponents<unsigned short>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::SHORT:  ConvertImportedComponents<short>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::UINT:   ConvertImportedComponents<unsigned int>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::INT:    ConvertImportedComponents<int>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::ULONG:  ConvertImportedComponents<unsigned long>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::LONG:   ConvertImportedComponents<long>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::FLOAT:  ConvertImportedComponents<float>(ib.buffer, out, n); break;
+    case itk::ImageIOBase::DOUBLE: ConvertImportedComponents<double>(ib.buffer, out, n); break;
+    default:
+      throw GreedyException("Unsupported component type for image buffer");
+    }
+
+  return image;
+}
+
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::AddCachedOutputObject(std::string key, itk::Object *object, bool force_write)
@@ -2791,6 +5128,264 @@ GreedyApproach<VDim,TReal>
   return m_MetricLog;
 }
 
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::ReadInitialWarp(const std::string &filename, ImageBaseType *refspace, VectorImageType *result)
+{
+  // The warp may be shared with the cache, and is only read from here
+  VectorImagePointer uInit = ReadImageViaCache<VectorImageType>(filename);
+
+  // Resample the physical displacements to the level. This is an identity resampling
+  // in physical space, so the displacement vectors are unchanged
+  LDDMMType::vimg_resample_identity(uInit, refspace, result);
+
+  // The conversion to voxel units is linear in the displacement, since the warp is
+  // mapped into its own space, so it can be done after the resampling. Doing it in
+  // the level's space also gives the voxel units of that level directly
+  OFHelperType::PhysicalWarpToVoxelWarp(result, result, result);
+}
+
+template <unsigned int VDim, typename TReal>
+const typename GreedyApproach<VDim,TReal>::ConvergenceLogType &
+GreedyApproach<VDim,TReal>
+::GetConvergenceLog() const
+{
+  return m_ConvergenceLog;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::SetProfileCallback(ProfileCallback callback, void *client_data)
+{
+  m_ProfileCallback = callback;
+  m_ProfileCallbackData = client_data;
+}
+
+template <unsigned int VDim, typename TReal>
+const typename GreedyApproach<VDim,TReal>::ProfileLogType &
+GreedyApproach<VDim,TReal>
+::GetProfileLog() const
+{
+  return m_ProfileLog;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::WriteProfileLog(const std::string &filename) const
+{
+  std::ofstream out(filename.c_str());
+  if(!out.good())
+    throw GreedyException("Unable to open %s for writing profile", filename.c_str());
+
+  // Peak memory over all levels
+  size_t peak_bytes = 0;
+  for(unsigned int i = 0; i < m_ProfileLog.size(); i++)
+    peak_bytes = std::max(peak_bytes, m_ProfileLog[i].image_bytes);
+
+  out << "{" << std::endl;
+  out << "  \"dimension\": " << VDim << "," << std::endl;
+  out << "  \"precision\": \"" << (sizeof(TReal) == sizeof(float) ? "float" : "double") << "\"," << std::endl;
+  out << "  \"threads\": " << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << "," << std::endl;
+  out << "  \"peak_image_bytes\": " << peak_bytes << "," << std::endl;
+  out << "  \"levels\": [" << std::endl;
+  for(unsigned int i = 0; i < m_ProfileLog.size(); i++)
+    {
+    const GreedyLevelProfile &lp = m_ProfileLog[i];
+    out << "    {" << std::endl;
+    out << "      \"level\": " << lp.level << "," << std::endl;
+    out << "      \"iterations\": " << lp.iterations << "," << std::endl;
+    out << "      \"converged\": " << (lp.converged ? "true" : "false") << "," << std::endl;
+    out << "      \"voxels\": " << lp.voxels << "," << std::endl;
+    out << "      \"image_bytes\": " << lp.image_bytes << "," << std::endl;
+    out << "      \"voxels_per_second\": " << lp.voxels_per_second << "," << std::endl;
+    out << "      \"phases\": {" << std::endl;
+    for(unsigned int j = 0; j < lp.phases.size(); j++)
+      {
+      const GreedyPhaseProfile &pp = lp.phases[j];
+      out << "        \"" << pp.name << "\": { "
+          << "\"wall_time\": " << pp.wall_time << ", "
+          << "\"cpu_time\": " << pp.cpu_time << ", "
+          << "\"runs\": " << pp.runs << " }"
+          << (j + 1 < lp.phases.size() ? "," : "") << std::endl;
+      }
+    out << "      }" << std::endl;
+    out << "    }" << (i + 1 < m_ProfileLog.size() ? "," : "") << std::endl;
+    }
+  out << "  ]" << std::endl;
+  out << "}" << std::endl;
+}
+
+template <unsigned int VDim, typename TReal>
+std::string GreedyApproach<VDim, TReal>
+::GetCheckpointKey(const GreedyParameters &param)
+{
+  // Options that do not change the result may differ between the runs
+  GreedyParameters key_param = param;
+  key_param.threads = 0;
+  key_param.flag_pin_threads = false;
+  key_param.checkpoint_interval = GreedyParameters().checkpoint_interval;
+  key_param.profile_output.clear();
+  key_param.memory_budget = 0.0;
+  key_param.flag_release_inputs = false;
+  key_param.flag_release_levels = false;
+  return key_param.GenerateCommandLine();
+}
+
+// Magic string at the start of the checkpoint file, followed by the format version
+static const char greedy_checkpoint_magic[8] = { 'G', 'R', 'D', 'Y', 'C', 'K', 'P', 'T' };
+static const uint32_t greedy_checkpoint_version = 1;
+
+template <class T>
+void WriteCheckpointValue(std::ostream &out, const T &value)
+{
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <class T>
+T ReadCheckpointValue(std::istream &in)
+{
+  T value;
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  return value;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::WriteDeformableCheckpoint(const std::string &filename, const std::string &key,
+                            unsigned int level, unsigned int iter,
+                            VectorImageType *warp, VectorImageType *inverse_warp)
+{
+  // Write to a temporary file, which replaces the checkpoint when complete, so
+  // that an interruption while writing leaves the last checkpoint intact
+  std::string fn_temp = filename + ".tmp";
+  std::ofstream out(fn_temp.c_str(), std::ios::binary);
+  if(!out.good())
+    throw GreedyException("Unable to write checkpoint file %s", fn_temp.c_str());
+
+  out.write(greedy_checkpoint_magic, sizeof(greedy_checkpoint_magic));
+  WriteCheckpointValue<uint32_t>(out, greedy_checkpoint_version);
+  WriteCheckpointValue<uint32_t>(out, VDim);
+  WriteCheckpointValue<uint32_t>(out, sizeof(TReal));
+  WriteCheckpointValue<uint32_t>(out, key.size());
+  out.write(key.c_str(), key.size());
+  WriteCheckpointValue<uint32_t>(out, level);
+  WriteCheckpointValue<uint32_t>(out, iter);
+
+  // Metric log up to and including the current level
+  WriteCheckpointValue<uint32_t>(out, m_MetricLog.size());
+  for(unsigned int i = 0; i < m_MetricLog.size(); i++)
+    {
+    WriteCheckpointValue<uint32_t>(out, m_MetricLog[i].size());
+    for(unsigned int j = 0; j < m_MetricLog[i].size(); j++)
+      {
+      const MultiComponentMetricReport &mr = m_MetricLog[i][j];
+      WriteCheckpointValue<double>(out, mr.TotalMetric);
+      WriteCheckpointValue<uint32_t>(out, mr.ComponentMetrics.size());
+      out.write(reinterpret_cast<const char *>(mr.ComponentMetrics.data_block()),
+                sizeof(double) * mr.ComponentMetrics.size());
+      }
+    }
+
+  // Convergence log of the completed levels
+  WriteCheckpointValue<uint32_t>(out, m_ConvergenceLog.size());
+  for(unsigned int i = 0; i < m_ConvergenceLog.size(); i++)
+    {
+    const GreedyLevelConvergence &conv = m_ConvergenceLog[i];
+    WriteCheckpointValue<uint32_t>(out, conv.level);
+    WriteCheckpointValue<uint32_t>(out, conv.iterations);
+    WriteCheckpointValue<uint32_t>(out, conv.max_iterations);
+    WriteCheckpointValue<uint8_t>(out, conv.converged ? 1 : 0);
+    WriteCheckpointValue<double>(out, conv.metric_change);
+    WriteCheckpointValue<double>(out, conv.update_norm);
+    }
+
+  // The warp and, if tracked, the inverse warp
+  VectorImageType *fields[] = { warp, inverse_warp };
+  for(unsigned int k = 0; k < 2; k++)
+    {
+    uint64_t n = fields[k] ? fields[k]->GetBufferedRegion().GetNumberOfPixels() * VDim : 0;
+    WriteCheckpointValue<uint64_t>(out, n);
+    if(n)
+      out.write(reinterpret_cast<const char *>(fields[k]->GetBufferPointer()->GetDataPointer()),
+                sizeof(TReal) * n);
+    }
+
+  out.close();
+  if(out.fail())
+    throw GreedyException("Unable to write checkpoint file %s", fn_temp.c_str());
+
+  if(std::rename(fn_temp.c_str(), filename.c_str()) != 0)
+    throw GreedyException("Unable to replace checkpoint file %s", filename.c_str());
+}
+
+template <unsigned int VDim, typename TReal>
+bool GreedyApproach<VDim, TReal>
+::ReadDeformableCheckpoint(const std::string &filename, const std::string &key,
+                           DeformableCheckpoint &ckpt)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if(!in.good())
+    return false;
+
+  // Check the header
+  char magic[sizeof(greedy_checkpoint_magic)];
+  in.read(magic, sizeof(magic));
+  if(!in.good() || memcmp(magic, greedy_checkpoint_magic, sizeof(magic)) != 0
+     || ReadCheckpointValue<uint32_t>(in) != greedy_checkpoint_version)
+    throw GreedyException("File %s is not a greedy checkpoint", filename.c_str());
+
+  if(ReadCheckpointValue<uint32_t>(in) != VDim || ReadCheckpointValue<uint32_t>(in) != sizeof(TReal))
+    throw GreedyException("Checkpoint %s was written with a different dimension or precision", filename.c_str());
+
+  std::string ckpt_key(ReadCheckpointValue<uint32_t>(in), ' ');
+  in.read(&ckpt_key[0], ckpt_key.size());
+  if(ckpt_key != key)
+    throw GreedyException("Checkpoint %s was written for a different registration, remove it to start over",
+                          filename.c_str());
+
+  ckpt.level = ReadCheckpointValue<uint32_t>(in);
+  ckpt.iter = ReadCheckpointValue<uint32_t>(in);
+
+  ckpt.metric_log.resize(ReadCheckpointValue<uint32_t>(in));
+  for(unsigned int i = 0; i < ckpt.metric_log.size() && in.good(); i++)
+    {
+    ckpt.metric_log[i].resize(ReadCheckpointValue<uint32_t>(in));
+    for(unsigned int j = 0; j < ckpt.metric_log[i].size() && in.good(); j++)
+      {
+      MultiComponentMetricReport &mr = ckpt.metric_log[i][j];
+      mr.TotalMetric = ReadCheckpointValue<double>(in);
+      mr.ComponentMetrics.set_size(ReadCheckpointValue<uint32_t>(in));
+      in.read(reinterpret_cast<char *>(mr.ComponentMetrics.data_block()),
+              sizeof(double) * mr.ComponentMetrics.size());
+      }
+    }
+
+  ckpt.convergence_log.resize(ReadCheckpointValue<uint32_t>(in));
+  for(unsigned int i = 0; i < ckpt.convergence_log.size() && in.good(); i++)
+    {
+    GreedyLevelConvergence &conv = ckpt.convergence_log[i];
+    conv.level = ReadCheckpointValue<uint32_t>(in);
+    conv.iterations = ReadCheckpointValue<uint32_t>(in);
+    conv.max_iterations = ReadCheckpointValue<uint32_t>(in);
+    conv.converged = ReadCheckpointValue<uint8_t>(in) != 0;
+    conv.metric_change = ReadCheckpointValue<double>(in);
+    conv.update_norm = ReadCheckpointValue<double>(in);
+    }
+
+  std::vector<TReal> *fields[] = { &ckpt.warp, &ckpt.inverse_warp };
+  for(unsigned int k = 0; k < 2 && in.good(); k++)
+    {
+    fields[k]->resize(ReadCheckpointValue<uint64_t>(in));
+    if(fields[k]->size())
+      in.read(reinterpret_cast<char *>(&(*fields[k])[0]), sizeof(TReal) * fields[k]->size());
+    }
+
+  if(!in.good() || ckpt.metric_log.size() != ckpt.level + 1 || ckpt.metric_log.back().size() != ckpt.iter)
+    throw GreedyException("Checkpoint file %s is truncated or corrupt", filename.c_str());
+
+  return true;
+}
+
 template<unsigned int VDim, typename TReal>
 MultiComponentMetricReport GreedyApproach<VDim, TReal>
 ::GetLastMetricReport() const
@@ -2807,6 +5402,112 @@ MultiComponentMetricReport GreedyApproach<VDim, TReal>
   return MultiComponentMetricReport();
 }
 
+template <unsigned int VDim, typename TReal>
+GreedyApproach<VDim, TReal>
+::GreedyApproach()
+{
+  m_ProfileCallback = NULL;
+  m_ProfileCallbackData = NULL;
+  m_Workspace = NULL;
+  m_KeepResultWarps = false;
+  m_ResultComputeInverse = false;
+  m_SessionHelper = NULL;
+}
+
+template <unsigned int VDim, typename TReal>
+GreedyApproach<VDim, TReal>
+::~GreedyApproach()
+{
+  this->EndSession();
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::BeginSession()
+{
+  this->EndSession();
+  m_SessionHelper = new OFHelperType();
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::EndSession()
+{
+  delete m_SessionHelper;
+  m_SessionHelper = NULL;
+  m_SessionKey.clear();
+  m_SessionFixed.clear();
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::OFHelperType &
+GreedyApproach<VDim, TReal>
+::GetRegistrationHelper(const GreedyParameters &param, const char *mode, OFHelperType &local_helper)
+{
+  if(!m_SessionHelper)
+    return local_helper;
+
+  // Everything that goes into building the fixed side of the helper
+  std::ostringstream oss;
+  oss << mode << "|" << param.metric << "|" << param.iter_per_level.size()
+      << "|" << param.gradient_mask << "|" << param.fixed_mask
+      << "|" << param.crop_to_mask_margin << "|" << param.affine_jitter
+      << "|" << param.ncc_noise_factor << "|" << param.flag_ncc_precompute_fixed;
+  for(unsigned int i = 0; i < param.inputs.size(); i++)
+    oss << "|" << param.inputs[i].fixed << ":" << param.inputs[i].weight;
+  for(unsigned int i = 0; i < param.metric_radius.size(); i++)
+    oss << "|r" << param.metric_radius[i];
+  for(unsigned int i = 0; i < param.gradient_mask_trim_radius.size(); i++)
+    oss << "|t" << param.gradient_mask_trim_radius[i];
+
+  // If any of it has changed, start over with a new helper
+  if(oss.str() != m_SessionKey)
+    {
+    this->BeginSession();
+    m_SessionKey = oss.str();
+    }
+
+  return *m_SessionHelper;
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyApproach<VDim, TReal>::ResultType &
+GreedyApproach<VDim, TReal>
+::GetResult()
+{
+  return m_Result;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::SetKeepResultWarps(bool keep, bool compute_inverse)
+{
+  m_KeepResultWarps = keep;
+  m_ResultComputeInverse = compute_inverse;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::SetWorkspace(GreedyWorkspace *workspace)
+{
+  m_Workspace = workspace;
+}
+
+template <unsigned int VDim, typename TReal>
+GreedyWorkspace *
+GreedyApproach<VDim, TReal>
+::GetWorkspace()
+{
+  return m_Workspace ? m_Workspace : &m_InternalWorkspace;
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyApproach<VDim, TReal>
+::SetMappedImageCacheDirectory(const std::string &dir)
+{
+  m_MappedImageCache.SetDirectory(dir);
+}
+
 template <unsigned int VDim, typename TReal>
 void GreedyApproach<VDim, TReal>
 ::ConfigThreads(const GreedyParameters &param)
@@ -2823,6 +5524,11 @@ void GreedyApproach<VDim, TReal>
     gout.printf("Executing with the default number of threads: %d\n",
                 itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
     }
+
+  // Size the pool for the parallel loops now, before the thread count may be split
+  // between concurrent registrations
+  ParallelFor::SetThreadAffinity(param.flag_pin_threads);
+  ParallelFor::SetNumberOfThreads(itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
 }
 
 template<unsigned int VDim, typename TReal>
@@ -2831,6 +5537,12 @@ int GreedyApproach<VDim, TReal>
 {
   ConfigThreads(param);
 
+  if(param.image_cache_dir.size())
+    m_MappedImageCache.SetDirectory(param.image_cache_dir);
+
+  if(param.gzip_level > 0)
+    ParallelGzip::SetCompressionLevel(param.gzip_level);
+
   switch(param.mode)
     {
     case GreedyParameters::GREEDY:
@@ -2859,6 +5571,440 @@ int GreedyApproach<VDim, TReal>
 
 
 
+template <unsigned int VDim, typename TReal>
+void GreedyRegistrationResult<VDim, TReal>
+::Reset()
+{
+  m_HasAffine = false;
+  m_Affine.clear();
+  m_ReferenceSpace = NULL;
+  m_Warp = NULL;
+  m_InverseWarp = NULL;
+  m_PhysicalWarp = NULL;
+  m_PhysicalInverseWarp = NULL;
+  m_MetricLog.clear();
+  m_ConvergenceLog.clear();
+}
+
+template <unsigned int VDim, typename TReal>
+void GreedyRegistrationResult<VDim, TReal>
+::SetWarps(ImageBaseType *ref_space, VectorImageType *warp, VectorImageType *inverse)
+{
+  m_ReferenceSpace = ref_space;
+  m_Warp = warp;
+  m_InverseWarp = inverse;
+  m_PhysicalWarp = NULL;
+  m_PhysicalInverseWarp = NULL;
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyRegistrationResult<VDim, TReal>::VectorImageType *
+GreedyRegistrationResult<VDim, TReal>
+::GetPhysicalWarp()
+{
+  if(m_PhysicalWarp.IsNull() && m_Warp.IsNotNull())
+    {
+    m_PhysicalWarp = LDDMMType::new_vimg(m_Warp);
+    MultiImageOpticalFlowHelper<TReal, VDim>::VoxelWarpToPhysicalWarp(m_Warp, m_ReferenceSpace, m_PhysicalWarp);
+    }
+  return m_PhysicalWarp;
+}
+
+template <unsigned int VDim, typename TReal>
+typename GreedyRegistrationResult<VDim, TReal>::VectorImageType *
+GreedyRegistrationResult<VDim, TReal>
+::GetPhysicalInverseWarp()
+{
+  if(m_PhysicalInverseWarp.IsNull() && m_InverseWarp.IsNotNull())
+    {
+    m_PhysicalInverseWarp = LDDMMType::new_vimg(m_InverseWarp);
+    MultiImageOpticalFlowHelper<TReal, VDim>::VoxelWarpToPhysicalWarp(m_InverseWarp, m_ReferenceSpace, m_PhysicalInverseWarp);
+    }
+  return m_PhysicalInverseWarp;
+}
+
+void GreedyMemoryStage::Add(const std::string &buffer_name, size_t bytes)
+{
+  if(bytes > 0)
+    {
+    GreedyMemoryBuffer buf = { buffer_name, bytes };
+    buffers.push_back(buf);
+    }
+}
+
+size_t GreedyMemoryStage::GetTotalBytes() const
+{
+  size_t total = 0;
+  for(unsigned int i = 0; i < buffers.size(); i++)
+    total += buffers[i].bytes;
+  return total;
+}
+
+int GreedyMemoryEstimate::GetPeakStage() const
+{
+  int peak = -1;
+  for(unsigned int i = 0; i < stages.size(); i++)
+    if(peak < 0 || stages[i].GetTotalBytes() > stages[peak].GetTotalBytes())
+      peak = i;
+  return peak;
+}
+
+size_t GreedyMemoryEstimate::GetPeakBytes() const
+{
+  int peak = GetPeakStage();
+  return peak < 0 ? 0 : stages[peak].GetTotalBytes();
+}
+
+std::string GreedyMemoryEstimate::GetReport(unsigned int max_buffers) const
+{
+  const double mb = 1024.0 * 1024.0;
+  std::ostringstream oss;
+  char line[256];
+
+  int peak = GetPeakStage();
+  snprintf(line, sizeof(line), "Estimated peak memory: %.1f MB (%s)\n",
+           GetPeakBytes() / mb, peak < 0 ? "no stages" : stages[peak].name.c_str());
+  oss << line;
+
+  for(unsigned int i = 0; i < stages.size(); i++)
+    {
+    const GreedyMemoryStage &st = stages[i];
+    snprintf(line, sizeof(line), "  %-28s : %10.1f MB%s\n",
+             st.name.c_str(), st.GetTotalBytes() / mb, (int) i == peak ? "  <- peak" : "");
+    oss << line;
+
+    // The largest buffers of the stage
+    std::vector<GreedyMemoryBuffer> sorted = st.buffers;
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const GreedyMemoryBuffer &a, const GreedyMemoryBuffer &b) { return a.bytes > b.bytes; });
+    for(unsigned int j = 0; j < sorted.size() && j < max_buffers; j++)
+      {
+      snprintf(line, sizeof(line), "      %-34s : %10.1f MB\n", sorted[j].name.c_str(), sorted[j].bytes / mb);
+      oss << line;
+      }
+    }
+
+  return oss.str();
+}
+
+template <unsigned int VDim, typename TReal>
+std::vector<size_t>
+GreedyApproach<VDim, TReal>
+::GetDeformableWorkspaceSizes(const GreedyParameters &param, ImageBaseType *ref_fine,
+                              bool flag_track_inverse)
+{
+  size_t vec_bytes = GreedyWorkspace::GetImageBytes<VectorImageType>(ref_fine);
+  size_t img_bytes = GreedyWorkspace::GetImageBytes<ImageType>(ref_fine);
+
+  // Two copies of uk are needed while the previous level is upsampled
+  std::vector<size_t> sizes(4, vec_bytes);
+  sizes.push_back(img_bytes);
+  if(param.flag_stationary_velocity_mode)
+    {
+    sizes.push_back(vec_bytes);
+    if(param.sv_exp_refresh > 0)
+      sizes.push_back(vec_bytes);
+    }
+  if(flag_track_inverse)
+    sizes.insert(sizes.end(), 2, vec_bytes);
+  return sizes;
+}
+
+template <unsigned int VDim, typename TReal>
+void
+GreedyApproach<VDim, TReal>
+::ReadImageHeader(const std::string &filename, typename ImageBaseType::SizeType &size,
+                  unsigned int &ncomp)
+{
+  // Buffers and objects passed in through the cache
+  typename ImportedBufferMap::const_iterator it = m_ImportedBuffers.find(filename);
+  if(it != m_ImportedBuffers.end())
+    {
+    size = it->second.geometry->GetBufferedRegion().GetSize();
+    ncomp = it->second.ncomp;
+    return;
+    }
+
+  ImageBaseType *cached = this->CheckCache<ImageBaseType>(filename);
+  if(cached)
+    {
+    size = cached->GetBufferedRegion().GetSize();
+    ncomp = cached->GetNumberOfComponentsPerPixel();
+    return;
+    }
+
+  // Otherwise only the header of the file is read
+  itk::ImageIOBase::Pointer io =
+      itk::ImageIOFactory::CreateImageIO(filename.c_str(), itk::ImageIOFactory::ReadMode);
+  if(!io)
+    throw GreedyException("Unable to read the header of image %s", filename.c_str());
+
+  io->SetFileName(filename.c_str());
+  io->ReadImageInformation();
+  for(unsigned int d = 0; d < VDim; d++)
+    size[d] = d < io->GetNumberOfDimensions() ? io->GetDimensions(d) : 1;
+  ncomp = io->GetNumberOfComponents();
+}
+
+template <unsigned int VDim, typename TReal>
+void
+GreedyApproach<VDim, TReal>
+::EstimateMemory(const GreedyParameters &param, GreedyMemoryEstimate &est)
+{
+  if(param.mode != GreedyParameters::GREEDY && param.mode != GreedyParameters::AFFINE)
+    throw GreedyException("Memory can only be estimated for affine and deformable registration");
+
+  if(param.inputs.size() == 0)
+    throw GreedyException("No image pairs specified for the memory estimate");
+
+  est.stages.clear();
+  bool deformable = (param.mode == GreedyParameters::GREEDY);
+  size_t s = sizeof(TReal);
+
+  // The sizes and number of components of the inputs. With moving pre-transforms,
+  // the moving images are resampled into the fixed space as they are read
+  typedef typename ImageBaseType::SizeType SizeType;
+  SizeType sz_fix, sz_mov, sz;
+  sz_fix.Fill(1); sz_mov.Fill(1);
+  unsigned int nc_fix = 0, nc_mov = 0, nc = 0;
+  for(unsigned int i = 0; i < param.inputs.size(); i++)
+    {
+    ReadImageHeader(param.inputs[i].fixed, sz, nc);
+    if(i == 0)
+      sz_fix = sz;
+    nc_fix += nc;
+
+    ReadImageHeader(param.inputs[i].moving, sz, nc);
+    if(i == 0)
+      sz_mov = sz;
+    nc_mov += nc;
+    }
+
+  size_t nvox_read_mov = 1;
+  for(unsigned int d = 0; d < VDim; d++)
+    nvox_read_mov *= sz_mov[d];
+  bool pre_warp = param.moving_pre_transforms.size() > 0;
+  if(pre_warp)
+    sz_mov = sz_fix;
+
+  // Voxels at each level of the pyramids, with the sizes computed by cimg_downsample
+  unsigned int nlevels = std::max((size_t) 1, param.iter_per_level.size());
+  unsigned int L = nlevels - 1;
+  std::vector<size_t> nvox_fix(nlevels, 1), nvox_mov(nlevels, 1);
+  for(unsigned int l = 0; l < nlevels; l++)
+    {
+    double f = (double) (1 << (nlevels - 1 - l));
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      nvox_fix[l] *= (size_t) std::ceil(sz_fix[d] / f);
+      nvox_mov[l] *= (size_t) std::ceil(sz_mov[d] / f);
+      }
+    }
+  size_t nv = nvox_fix[L];
+
+  // The levels of the pyramid that are freed as the registration goes on. A session
+  // keeps the inputs and the fixed side for the next registration
+  bool release_fixed = m_SessionHelper == NULL;
+  bool release_inputs = param.flag_release_inputs;
+  bool release_levels = param.flag_release_levels && deformable;
+
+  // Sum of the sizes of the levels of a pyramid, starting at a given level
+  auto pyramid_bytes = [&](const std::vector<size_t> &nvox, size_t elt_bytes, unsigned int first)
+    {
+    size_t total = 0;
+    for(unsigned int l = first; l < nlevels; l++)
+      total += nvox[l] * elt_bytes;
+    return total;
+    };
+
+  // Sizes of the inputs as held by the helper
+  size_t b_fix_in = nv * nc_fix * s;
+  size_t b_mov_in = nvox_mov[L] * nc_mov * s;
+  size_t b_masks = (param.gradient_mask.size() ? nv * s : 0)
+                   + (param.fixed_mask.size() ? nv * s : 0)
+                   + (param.moving_mask.size() ? nvox_mov[L] * s : 0);
+  size_t b_warp = nv * VDim * s;
+
+  // The images that are held between the stages. The finest level of the
+  // gradient and moving masks is the mask itself, and only the coarser levels
+  // are additional
+  auto add_held = [&](GreedyMemoryStage &st, bool after_build, unsigned int done_levels)
+    {
+    unsigned int first_fix = release_levels && release_fixed ? done_levels : 0;
+    unsigned int first_mov = release_levels ? done_levels : 0;
+    if(!(after_build && release_inputs && release_fixed))
+      st.Add("fixed input images", b_fix_in);
+    if(!(after_build && release_inputs))
+      st.Add("moving input images", b_mov_in);
+    st.Add("masks", b_masks);
+    if(!after_build)
+      return;
+
+    st.Add("fixed pyramid", pyramid_bytes(nvox_fix, nc_fix * s, first_fix));
+    st.Add("moving pyramid", pyramid_bytes(nvox_mov, nc_mov * s, first_mov));
+
+    size_t b_mask_pyr = 0;
+    if(param.gradient_mask.size())
+      b_mask_pyr += pyramid_bytes(nvox_fix, s, first_fix) - nv * s;
+    else if(param.gradient_mask_trim_radius.size())
+      b_mask_pyr += pyramid_bytes(nvox_fix, s, first_fix);
+    if(param.moving_mask.size())
+      b_mask_pyr += pyramid_bytes(nvox_mov, s, first_mov) - nvox_mov[L] * s;
+    st.Add("mask pyramids", b_mask_pyr);
+
+    if(!deformable && param.affine_jitter > 0)
+      st.Add("jitter images", pyramid_bytes(nvox_fix, VDim * s, 0));
+    };
+
+  // Reading the inputs
+  est.stages.push_back(GreedyMemoryStage());
+  GreedyMemoryStage &st_read = est.stages.back();
+  st_read.name = "Reading the inputs";
+  add_held(st_read, false, 0);
+  if(pre_warp)
+    {
+    st_read.Add("moving images before pre-transforms", nvox_read_mov * nc_mov * s);
+    st_read.Add("pre-transform warp", b_warp);
+    }
+
+  // Building the pyramids. The peak is while the moving pyramid is built, with the
+  // fixed pyramid complete and the finest moving level being smoothed
+  est.stages.push_back(GreedyMemoryStage());
+  GreedyMemoryStage &st_build = est.stages.back();
+  st_build.name = "Building the pyramids";
+  add_held(st_build, false, 0);
+  st_build.Add("fixed pyramid", pyramid_bytes(nvox_fix, nc_fix * s, 0));
+  st_build.Add("moving pyramid", pyramid_bytes(nvox_mov, nc_mov * s, 0));
+  if(nlevels > 1)
+    st_build.Add("smoothing buffer", nvox_mov[L] * nc_mov * s);
+
+  // The workspace of deformable registration, reserved for the finest level
+  typename ImageType::Pointer ref_fine = ImageType::New();
+  typename ImageType::RegionType ref_region;
+  ref_region.SetSize(sz_fix);
+  ref_fine->SetRegions(ref_region);
+
+  bool flag_inverse = param.inverse_warp.size() || (m_KeepResultWarps && m_ResultComputeInverse);
+  bool flag_track_inverse = flag_inverse && param.flag_inverse_incremental
+                            && !param.flag_stationary_velocity_mode;
+  size_t b_workspace = 0;
+  if(deformable)
+    {
+    std::vector<size_t> ws_sizes = GetDeformableWorkspaceSizes(param, ref_fine, flag_track_inverse);
+    for(unsigned int i = 0; i < ws_sizes.size(); i++)
+      b_workspace += ws_sizes[i];
+    }
+
+  int n_threads = param.threads > 0 ? param.threads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  // The iterations at each level
+  for(unsigned int l = 0; l < nlevels; l++)
+    {
+    est.stages.push_back(GreedyMemoryStage());
+    GreedyMemoryStage &st = est.stages.back();
+    std::ostringstream oss;
+    oss << "Level " << l + 1 << " of " << nlevels;
+    st.name = oss.str();
+    add_held(st, true, l);
+    st.Add("workspace", b_workspace);
+    if(!deformable)
+      st.Add("metric image", nvox_fix[l] * s);
+
+    // Images that the metrics cache for each level they are used at
+    unsigned int first_cached = release_levels && release_fixed ? l : 0;
+    auto cached_bytes = [&](size_t elt_bytes)
+      {
+      size_t total = 0;
+      for(unsigned int k = first_cached; k <= l; k++)
+        total += nvox_fix[k] * elt_bytes;
+      return total;
+      };
+
+    // The working memory of the metric at this level
+    bool is_ncc = param.metric == GreedyParameters::NCC
+                  || (param.metric == GreedyParameters::NCC_APPROX && !deformable);
+    if(is_ncc)
+      {
+      bool fixed_sums = deformable && param.flag_ncc_precompute_fixed;
+      unsigned int n_sum = fixed_sums ? 3 : 6;
+      unsigned int nc_work = deformable
+                             ? nc_fix * (n_sum + 3 * VDim) + (fixed_sums ? 1 : 0)
+                             : nc_fix * (6 + 3 * VDim * (1 + VDim));
+      st.Add("NCC working image", nvox_fix[l] * nc_work * s);
+      if(fixed_sums)
+        {
+        st.Add("NCC fixed sums", cached_bytes(3 * nc_fix * s));
+        st.Add("NCC missing sample markers", nvox_fix[l] * nc_fix);
+        }
+      }
+    else if(param.metric == GreedyParameters::NCC_APPROX)
+      {
+      // The working image holds J and the sums of J, J^2 and IJ for each component,
+      // the cached fixed sums hold the count, I and the sums of I and I^2
+      st.Add("NCC working image", nvox_fix[l] * 4 * nc_fix * s);
+      st.Add("NCC fixed sums", cached_bytes((1 + 3 * nc_fix) * s));
+      st.Add("NCC fixed gradients", cached_bytes(nc_fix * VDim * s));
+      }
+    else if(param.metric == GreedyParameters::MI || param.metric == GreedyParameters::NMI)
+      {
+      st.Add("MI binned images", (nvox_fix[l] + nvox_mov[l]) * nc_fix);
+      st.Add("MI per-thread histograms", (size_t) n_threads * nc_fix * 128 * 128 * s);
+      }
+    else if(param.metric == GreedyParameters::MAHALANOBIS)
+      {
+      st.Add("Mahalanobis statistics", cached_bytes(nc_fix * s));
+      }
+    else if(param.metric == GreedyParameters::SSD && param.half_storage != GreedyParameters::HALF_NONE)
+      {
+      st.Add("16-bit composite copies", (nvox_fix[l] + nvox_mov[l]) * nc_fix * 2);
+      }
+
+    if(!deformable)
+      {
+      if(param.affine_sampling_fraction < 1.0)
+        st.Add("affine sample masks", pyramid_bytes(nvox_fix, s, 0));
+      continue;
+      }
+
+    // The incompressibility solver holds an index image and either a sparse matrix
+    // with 2 * VDim + 1 entries per row, or the multigrid arrays. These are rough
+    if(param.flag_stationary_velocity_mode && param.flag_incompressibility_mode)
+      {
+      size_t per_voxel = param.incompressibility_solver == GreedyParameters::INCOMPR_MULTIGRID
+                         ? sizeof(long) + 10 * sizeof(double)
+                         : sizeof(long) + (2 * VDim + 1) * (sizeof(double) + sizeof(long)) + 4 * sizeof(double);
+      st.Add("incompressibility solver (approx.)", nvox_fix[l] * per_voxel);
+      }
+
+    // The FFT buffer and the kernel transforms
+    if(param.smoothing_method == GreedyParameters::SMOOTH_FFT
+       || param.smoothing_method == GreedyParameters::SMOOTH_NAVIER)
+      st.Add("Fourier smoother", nvox_fix[l] * (2 * s + 2 * sizeof(double)));
+    }
+
+  // Computing and writing the final warps, with the pyramids of the last level
+  if(deformable)
+    {
+    est.stages.push_back(GreedyMemoryStage());
+    GreedyMemoryStage &st_out = est.stages.back();
+    st_out.name = "Writing the output";
+    add_held(st_out, true, L);
+    st_out.Add("workspace", b_workspace);
+    if(param.flag_stationary_velocity_mode)
+      st_out.Add("exponentiated warps", (flag_inverse ? 4 : 2) * b_warp);
+    else if(flag_inverse && !flag_track_inverse)
+      st_out.Add("inverse warp and work images", 4 * b_warp);
+    st_out.Add("physical space warp", b_warp);
+    }
+}
+
+template class GreedyRegistrationResult<2, float>;
+template class GreedyRegistrationResult<3, float>;
+template class GreedyRegistrationResult<4, float>;
+template class GreedyRegistrationResult<2, double>;
+template class GreedyRegistrationResult<3, double>;
+template class GreedyRegistrationResult<4, double>;
+
 template class GreedyApproach<2, float>;
 template class GreedyApproach<3, float>;
 template class GreedyApproach<4, float>;
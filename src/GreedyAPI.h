@@ -32,17 +32,186 @@
 #include "MultiComponentMetricReport.h"
 #include "lddmm_data.h"
 #include "AffineCostFunctions.h"
+#include "GreedyWorkspace.h"
+#include "GreedyMappedImageCache.h"
 #include <vnl/vnl_random.h>
 #include <map>
 #include "itkCommand.h"
 
 template <typename T, unsigned int V> class MultiImageOpticalFlowHelper;
+template <unsigned int V, typename T> class GreedyResliceStreamingSource;
 
 namespace itk {
   template <typename T, unsigned int D1, unsigned int D2> class MatrixOffsetTransformBase;
 
 }
 
+/**
+ * Timing of a single phase (gradient, smoothing, etc.) of deformable registration
+ * at one resolution level. Wall time is elapsed real time, CPU time is summed over
+ * all threads, so the ratio of the two indicates how well the phase is threaded.
+ */
+struct GreedyPhaseProfile
+{
+  std::string name;
+  double wall_time, cpu_time;
+  unsigned long runs;
+};
+
+/**
+ * How one resolution level of deformable registration ended. With the early
+ * termination options (-conv-tol, -conv-update), a level stops before running
+ * max_iterations once the metric and the update have settled.
+ */
+struct GreedyLevelConvergence
+{
+  unsigned int level;
+  unsigned int iterations, max_iterations;
+  bool converged;
+
+  // Relative change of the metric over the last window of iterations (negative if
+  // fewer iterations than the window were run), and the largest smoothed update
+  // at the last iteration in voxels (negative if it was not computed)
+  double metric_change, update_norm;
+};
+
+/**
+ * Profile of one resolution level of deformable registration, reported to the
+ * profile callback and written by GreedyApproach::WriteProfileLog
+ */
+struct GreedyLevelProfile
+{
+  unsigned int level;
+
+  // Number of iterations run, which is less than requested if the level converged
+  unsigned int iterations;
+  bool converged;
+
+  // Number of voxels in the reference space at this level
+  unsigned long voxels;
+
+  // Total size of the intermediate images allocated for this level, in bytes
+  size_t image_bytes;
+
+  // Voxel iterations per second of wall time
+  double voxels_per_second;
+
+  // Timing for the individual phases, the first entry is the whole iteration
+  std::vector<GreedyPhaseProfile> phases;
+};
+
+/**
+ * A buffer, or a group of buffers of the same kind, in a memory estimate
+ */
+struct GreedyMemoryBuffer
+{
+  std::string name;
+  size_t bytes;
+};
+
+/**
+ * The buffers that are allocated at the same time during one stage of a
+ * registration, e.g., the iterations at one resolution level
+ */
+struct GreedyMemoryStage
+{
+  std::string name;
+  std::vector<GreedyMemoryBuffer> buffers;
+
+  /** Add a buffer to the stage, buffers of zero size are left out */
+  void Add(const std::string &buffer_name, size_t bytes);
+
+  size_t GetTotalBytes() const;
+};
+
+/**
+ * Estimate of the memory used by a registration, computed by
+ * GreedyApproach::EstimateMemory before any image is read. The peak memory of
+ * the registration is the total of the largest stage
+ */
+struct GreedyMemoryEstimate
+{
+  std::vector<GreedyMemoryStage> stages;
+
+  /** The index of the stage with the largest total, or -1 if there are no stages */
+  int GetPeakStage() const;
+
+  size_t GetPeakBytes() const;
+
+  /** A report of the peak memory, and of the largest buffers in each stage */
+  std::string GetReport(unsigned int max_buffers = 4) const;
+};
+
+/**
+ * The result of the last registration run by a GreedyApproach object, kept in
+ * memory so that programs linking to the API do not need to read the outputs
+ * back from files. The affine matrix and the metric log are always recorded.
+ * The warps from deformable registration are only kept if requested with
+ * GreedyApproach::SetKeepResultWarps, since they are full-size images.
+ *
+ * The warps are stored as computed, in voxel units of the reference space. The
+ * physical-space warps (what is written to warp files, minus the rounding to
+ * the warp precision) are computed on first access and then kept.
+ */
+template <unsigned int VDim, typename TReal = double>
+class GreedyRegistrationResult
+{
+public:
+  typedef LDDMMData<TReal, VDim> LDDMMType;
+  typedef typename LDDMMType::ImageBaseType ImageBaseType;
+  typedef typename LDDMMType::VectorImageType VectorImageType;
+  typedef typename LDDMMType::VectorImagePointer VectorImagePointer;
+  typedef std::vector< std::vector<MultiComponentMetricReport> > MetricLogType;
+  typedef std::vector<GreedyLevelConvergence> ConvergenceLogType;
+
+  GreedyRegistrationResult() : m_HasAffine(false) {}
+
+  /** Clear the result */
+  void Reset();
+
+  /** Whether an affine matrix is stored (affine and moments modes) */
+  bool HasAffineMatrix() const { return m_HasAffine; }
+
+  /** The affine matrix in physical (RAS) space, same as written to file */
+  const vnl_matrix<double> &GetAffineMatrix() const { return m_Affine; }
+
+  /** The reference space of the warps, or NULL if no warps are stored */
+  ImageBaseType *GetReferenceSpace() const { return m_ReferenceSpace; }
+
+  /** The forward warp in voxel units, or NULL if no warp is stored */
+  VectorImageType *GetVoxelWarp() const { return m_Warp; }
+
+  /** The inverse warp in voxel units, or NULL if no inverse was computed */
+  VectorImageType *GetVoxelInverseWarp() const { return m_InverseWarp; }
+
+  /** The forward warp in physical units, computed on first access */
+  VectorImageType *GetPhysicalWarp();
+
+  /** The inverse warp in physical units, computed on first access */
+  VectorImageType *GetPhysicalInverseWarp();
+
+  /** The metric values recorded at each iteration of each level */
+  const MetricLogType &GetMetricLog() const { return m_MetricLog; }
+
+  /** How each level of deformable registration ended */
+  const ConvergenceLogType &GetConvergenceLog() const { return m_ConvergenceLog; }
+
+  // These are used by GreedyApproach to fill out the result
+  void SetAffineMatrix(const vnl_matrix<double> &Q) { m_Affine = Q; m_HasAffine = true; }
+  void SetWarps(ImageBaseType *ref_space, VectorImageType *warp, VectorImageType *inverse);
+  void SetMetricLog(const MetricLogType &log) { m_MetricLog = log; }
+  void SetConvergenceLog(const ConvergenceLogType &log) { m_ConvergenceLog = log; }
+
+protected:
+  bool m_HasAffine;
+  vnl_matrix<double> m_Affine;
+  typename ImageBaseType::Pointer m_ReferenceSpace;
+  VectorImagePointer m_Warp, m_InverseWarp;
+  VectorImagePointer m_PhysicalWarp, m_PhysicalInverseWarp;
+  MetricLogType m_MetricLog;
+  ConvergenceLogType m_ConvergenceLog;
+};
+
 /**
  * This is the top level class for the greedy software. It contains methods
  * for deformable and affine registration.
@@ -67,17 +236,29 @@ public:
   typedef vnl_matrix_fixed<TReal, VDim, VDim> MatFx;
 
   typedef std::vector< std::vector<MultiComponentMetricReport> > MetricLogType;
+  typedef std::vector<GreedyLevelConvergence> ConvergenceLogType;
+
+  typedef GreedyRegistrationResult<VDim, TReal> ResultType;
 
   typedef MultiImageOpticalFlowHelper<TReal, VDim> OFHelperType;
 
   typedef itk::MatrixOffsetTransformBase<TReal, VDim, VDim> LinearTransformType;
 
+  typedef std::vector<GreedyLevelProfile> ProfileLogType;
+
+  // Callback called at the end of each level of deformable registration
+  typedef void (*ProfileCallback)(const GreedyLevelProfile &profile, void *client_data);
+
   struct ImagePair {
     ImagePointer fixed, moving;
     VectorImagePointer grad_moving;
     double weight;
   };
 
+  GreedyApproach();
+
+  ~GreedyApproach();
+
   static void ConfigThreads(const GreedyParameters &param);
 
   int Run(GreedyParameters &param);
@@ -102,6 +283,16 @@ public:
 
   int ComputeMetric(GreedyParameters &param, MultiComponentMetricReport &metric_report);
 
+  /**
+   * Compute the metric for a batch of problems, each given by its parameters
+   * (image pairs, masks and initial transform), as in ComputeMetric(). Problems
+   * that differ only in the initial transform share the images and pyramid read
+   * for the first of them, and these groups are evaluated in parallel. The
+   * reports are returned in the order of the parameters.
+   */
+  int ComputeMetrics(std::vector<GreedyParameters> &params,
+                     std::vector<MultiComponentMetricReport> &metric_reports);
+
   /**
    * Add an image that is already in memory to the internal cache, and
    * associate it with a filename. This provides a way for images already
@@ -131,6 +322,25 @@ public:
    */
   void AddCachedInputObject(std::string key, itk::Object *object);
 
+  /**
+   * Add a caller-owned image buffer to the input cache, without copying it. The
+   * buffer holds size[0] x ... x size[VDim-1] voxels with ncomp interleaved
+   * components of type comp_type (e.g. itk::ImageIOBase::USHORT), with the
+   * first index varying fastest. The key is then used in place of a filename,
+   * as with AddCachedInputObject.
+   *
+   * When the component type matches the internal floating point type, the
+   * image is used in place. Otherwise it is converted in a single pass when
+   * the registration reads it. As with AddCachedInputObject, the caller must
+   * keep the buffer alive while the API is being used.
+   */
+  void AddCachedInputBuffer(std::string key, void *buffer,
+                            itk::ImageIOBase::IOComponentType comp_type, unsigned int ncomp,
+                            const typename ImageBaseType::SizeType &size,
+                            const typename ImageBaseType::SpacingType &spacing,
+                            const typename ImageBaseType::PointType &origin,
+                            const typename ImageBaseType::DirectionType &direction);
+
   /**
    * Add an image/matrix to the output cache. This has the same behavior as
    * the input cache, but there is an additional flag as to whether you want
@@ -146,9 +356,92 @@ public:
    */
   const MetricLogType &GetMetricLog() const;
 
+  /**
+   * Get the convergence record of each level of the last deformable registration.
+   * The entry for a level is added when it completes, before the profile callback
+   * for that level is called, so the callback can inspect it
+   */
+  const ConvergenceLogType &GetConvergenceLog() const;
+
   /** Get the last value of the metric recorded */
   MultiComponentMetricReport GetLastMetricReport() const;
 
+  /**
+   * Set a function that will be called with the timing profile of each level
+   * of deformable registration, as soon as that level completes
+   */
+  void SetProfileCallback(ProfileCallback callback, void *client_data = NULL);
+
+  /** Get the per-level timing profile from the last deformable registration */
+  const ProfileLogType &GetProfileLog() const;
+
+  /** Write the per-level timing profile to a JSON file */
+  void WriteProfileLog(const std::string &filename) const;
+
+  /**
+   * Set the workspace that provides memory for the intermediate images of
+   * deformable registration. By default, each GreedyApproach object uses its
+   * own workspace, which is kept between calls. Passing a caller-owned workspace
+   * lets the memory be shared by many GreedyApproach objects that run one after
+   * another. The workspace is not owned by this object. Pass NULL to revert
+   * to the internal workspace.
+   */
+  void SetWorkspace(GreedyWorkspace *workspace);
+
+  /** Get the workspace used for deformable registration */
+  GreedyWorkspace *GetWorkspace();
+
+  /**
+   * Start a registration session. Within a session, RunAffine and RunDeformable
+   * keep the fixed side of the registration (the fixed composite pyramid, the
+   * fixed and gradient masks, the NCC fixed sums) between calls, so that when
+   * many moving images are registered to the same fixed images, the fixed side
+   * is only read and built once. Each call then only reads the moving images
+   * and builds their pyramid. The fixed side is rebuilt automatically when the
+   * fixed inputs or the parameters that affect it change. Note that images in
+   * the input cache are identified by their keys, so a cached fixed image should
+   * not be changed under the same key during a session.
+   */
+  void BeginSession();
+
+  /** End the registration session, releasing the fixed side */
+  void EndSession();
+
+  /**
+   * Estimate the memory used by the affine or deformable registration described
+   * by the parameters, without reading or allocating any images. Only the headers
+   * of the input files are read, and images in the cache are used as they are. The
+   * estimate covers the images held by the registration and the working images
+   * of the metrics. It does not cover the temporary buffers of the ITK filters and
+   * image readers, the channels added for NaNs in the inputs, or the savings from
+   * -crop-to-mask and -mask-domain, so it is an upper bound for most problems
+   */
+  void EstimateMemory(const GreedyParameters &param, GreedyMemoryEstimate &est);
+
+  /**
+   * Get the result of the last call to RunAffine, RunDeformable or
+   * RunAlignMoments. See GreedyRegistrationResult.
+   */
+  ResultType &GetResult();
+
+  /**
+   * Keep the warps computed by RunDeformable in the result object. The warp
+   * memory is then handed over to the result rather than returned to the
+   * workspace. If compute_inverse is set, the inverse warp is computed even if
+   * no inverse warp filename is given. Warps and matrices whose filenames are
+   * left empty in the parameters are not written at all, so that registration
+   * can be run without any file output.
+   */
+  void SetKeepResultWarps(bool keep, bool compute_inverse = false);
+
+  /**
+   * Set the directory for the on-disk cache of decompressed, memory-mapped
+   * images (see GreedyMappedImageCache). Images read from files are then
+   * decoded only once across invocations. An empty string disables the cache.
+   * This is also set from the parameters by Run().
+   */
+  void SetMappedImageCacheDirectory(const std::string &dir);
+
   vnl_matrix<double> ReadAffineMatrixViaCache(const TransformSpec &ts);
 
   void WriteAffineMatrixViaCache(const std::string &filename, const vnl_matrix<double> &Qp);
@@ -191,10 +484,91 @@ protected:
   typedef std::map<std::string, CacheEntry> ImageCache;
   ImageCache m_ImageCache;
 
+  // Caller-owned buffers added with AddCachedInputBuffer. The views wrap the
+  // buffer without copying; buffers of other component types are converted
+  // when they are read
+  struct ImportedBuffer {
+    void *buffer;
+    itk::ImageIOBase::IOComponentType comp_type;
+    unsigned int ncomp;
+    typename ImageBaseType::Pointer geometry;
+    std::vector<itk::Object::Pointer> views;
+  };
+
+  typedef std::map<std::string, ImportedBuffer> ImportedBufferMap;
+  ImportedBufferMap m_ImportedBuffers;
+
+  // Convert an imported buffer to an image of the given type, or return NULL if
+  // the type does not store components of type TReal
+  template <class TImage>
+  itk::SmartPointer<TImage> ConvertImportedBuffer(const ImportedBuffer &ib);
+
   // A log of metric values used during registration - so metric can be looked up
   // in the callbacks to RunAffine, etc.
   MetricLogType m_MetricLog;
 
+  // How each level of deformable registration ended
+  ConvergenceLogType m_ConvergenceLog;
+
+  // Per-level timing profile of deformable registration
+  ProfileLogType m_ProfileLog;
+  ProfileCallback m_ProfileCallback;
+  void *m_ProfileCallbackData;
+
+  // Memory pool for the intermediate images of deformable registration
+  GreedyWorkspace m_InternalWorkspace;
+  GreedyWorkspace *m_Workspace;
+
+  // On-disk cache of decompressed images shared between greedy processes
+  GreedyMappedImageCache m_MappedImageCache;
+
+  // Registration session that keeps the fixed side of the helper between calls,
+  // along with the parameters that the fixed side was built with
+  OFHelperType *m_SessionHelper;
+  std::string m_SessionKey;
+  std::vector<CompositeImagePointer> m_SessionFixed;
+
+  // Get the helper for a registration: the session helper, if a session has
+  // been started, or otherwise the local helper passed in
+  OFHelperType &GetRegistrationHelper(const GreedyParameters &param, const char *mode,
+                                      OFHelperType &local_helper);
+
+  // State of a deformable registration at the start of an iteration, as saved
+  // in the checkpoint file. The fields are in voxel units of the level
+  struct DeformableCheckpoint {
+    unsigned int level, iter;
+    MetricLogType metric_log;
+    ConvergenceLogType convergence_log;
+    std::vector<TReal> warp, inverse_warp;
+  };
+
+  // Sizes of the blocks that RunDeformable reserves in the workspace, for the
+  // reference space of the finest level
+  static std::vector<size_t> GetDeformableWorkspaceSizes(const GreedyParameters &param,
+                                                         ImageBaseType *ref_fine,
+                                                         bool flag_track_inverse);
+
+  // Read the size and the number of components of an input image from the cache,
+  // or from the header of the image file
+  void ReadImageHeader(const std::string &filename, typename ImageBaseType::SizeType &size,
+                       unsigned int &ncomp);
+
+  // A string that identifies the registration problem, stored in the checkpoint
+  static std::string GetCheckpointKey(const GreedyParameters &param);
+
+  // Write the checkpoint (atomically, through a temporary file), and read it back.
+  // Reading returns false if there is no checkpoint file, and throws if the file
+  // is from a different registration problem
+  void WriteDeformableCheckpoint(const std::string &filename, const std::string &key,
+                                 unsigned int level, unsigned int iter,
+                                 VectorImageType *warp, VectorImageType *inverse_warp);
+  bool ReadDeformableCheckpoint(const std::string &filename, const std::string &key,
+                                DeformableCheckpoint &ckpt);
+
+  // The result of the last registration
+  ResultType m_Result;
+  bool m_KeepResultWarps, m_ResultComputeInverse;
+
   // This function reads the image from disk, or from a memory location mapped to a
   // string. The first approach is used by the command-line interface, and the second
   // approach is used by the API, allowing images to be passed from other software.
@@ -217,16 +591,88 @@ protected:
   void WriteImageViaCache(TImage *img, const std::string &filename,
                           typename LDDMMType::IOComponentType comp = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE);
 
-  // Write a compressed warp via cache (in float format)
+  // Write a compressed warp via cache (in float format). Files with the .qwarp
+  // extension are stored quantized with the given number of bits and shrink factor
   void WriteCompressedWarpInPhysicalSpaceViaCache(
-    ImageBaseType *moving_ref_space, VectorImageType *warp, const char *filename, double precision);
+    ImageBaseType *moving_ref_space, VectorImageType *warp, const char *filename, double precision,
+    int quant_bits = 16, int quant_shrink = 1);
 
   void ReadImages(GreedyParameters &param, OFHelperType &ofhelper);
 
+  // Read the images for metric computation, and compute the metric for the images
+  // already read into the helper, with the initial transform in param
+  void ReadImagesForMetric(GreedyParameters &param, OFHelperType &of_helper);
+  void ComputeMetricWithHelper(GreedyParameters &param, OFHelperType &of_helper,
+                               MultiComponentMetricReport &metric_report);
+
+  // Read the initial warp (-id), which is in physical units, and initialize the
+  // warp of a pyramid level from it. The warp is resampled to the level first and
+  // converted to voxel units of that level there, so that no pass is made over
+  // the full resolution warp once it is read
+  void ReadInitialWarp(const std::string &filename, ImageBaseType *refspace, VectorImageType *result);
+
   void ReadTransformChain(const std::vector<TransformSpec> &tran_chain,
                           ImageBaseType *ref_space,
                           VectorImagePointer &out_warp);
 
+  // An element of a compiled transform chain: an affine transform x -> A x + b in
+  // physical (ITK) coordinates or, if the warp is set, a displacement field in
+  // physical units with its exponent already applied
+  struct CompiledTransform
+    {
+    vnl_matrix<double> A;
+    vnl_vector<double> b;
+    VectorImagePointer warp;
+
+    // Optional bricked copy of the warp, used in place of it for composition
+    typename LDDMMType::BrickedVectorImagePointer bricked_warp;
+    };
+
+  typedef std::vector<CompiledTransform> CompiledTransformChain;
+
+  // Read the transforms in a chain, folding consecutive affine transforms into one
+  void CompileTransformChain(const std::vector<TransformSpec> &tran_chain,
+                             CompiledTransformChain &compiled);
+
+  // Compose a compiled chain into a single warp over the reference space
+  void ComposeTransformChain(const CompiledTransformChain &compiled,
+                             ImageBaseType *ref_space,
+                             VectorImagePointer &out_warp);
+
+  // Reslice a single image in slabs of slab_size slices along the last axis. For
+  // each slab, the transform chain is composed over the slab only and only the
+  // part of the moving image that the slab maps into is read
+  void ResliceImageStreaming(const ResliceSpec &spec, ImageBaseType *ref,
+                             const CompiledTransformChain &compiled,
+                             int slab_size, GreedyParameters::Verbosity verbosity);
+
+  // Reslice an image through the composed warp if it is not NULL, otherwise through
+  // the compiled chain
+  CompositeImagePointer ResliceCompositeImage(CompositeImageType *moving, ImageBaseType *ref,
+                                              VectorImageType *warp,
+                                              const CompiledTransformChain &compiled,
+                                              bool use_nn, TReal outside_value);
+
+  // Reslice a label image by smoothing the indicator image of each label and taking
+  // the label with the largest warped value at each voxel. The labels are processed
+  // in batches of batch_size, which bounds the memory use
+  void ResliceLabelImage(const ResliceSpec &spec, ImageBaseType *ref,
+                         VectorImageType *warp, const CompiledTransformChain &compiled,
+                         unsigned int batch_size);
+
+  // Map points given in RAS coordinates (VDim values per point) through the compiled
+  // chain in place. The chain is evaluated at each point, sampling the warps with
+  // linear interpolation, and the points are processed in parallel chunks
+  void WarpMeshPoints(const CompiledTransformChain &compiled, TReal *points, long n_points);
+
+  // Reslice a mesh or a CSV point list through the compiled chain. CSV files and
+  // legacy ASCII VTK files are streamed in blocks of points, other formats are
+  // read whole with ITK
+  void ResliceMesh(const ResliceMeshSpec &spec, const CompiledTransformChain &compiled);
+
+  // The streaming source composes the transform chain one slab at a time
+  friend class GreedyResliceStreamingSource<VDim, TReal>;
+
   // Compute the moments of a composite image (mean and covariance matrix of coordinate weighted by intensity)
   void ComputeImageMoments(CompositeImageType *image, const std::vector<double> &weights, VecFx &m1, MatFx &m2);
 
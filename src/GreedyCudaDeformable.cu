@@ -0,0 +1,912 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "GreedyCudaDeformable.h"
+#include "GreedyException.h"
+
+#include <cuda_runtime.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+// Threads per block for all kernels. The block reductions assume a power of two
+#define GREEDY_CUDA_BLOCK 256
+
+#define GREEDY_CUDA_CHECK(call) \
+  { \
+  cudaError_t rc = (call); \
+  if(rc != cudaSuccess) \
+    throw GreedyException("CUDA error at %s:%d: %s", __FILE__, __LINE__, cudaGetErrorString(rc)); \
+  }
+
+namespace greedy_cuda
+{
+
+// Size of a grid, passed to the kernels by value. Unused dimensions have size 1
+struct Grid
+{
+  int size[3];
+  long n;
+};
+
+// Scaled component weights, passed to the kernels by value
+struct Weights
+{
+  float w[GreedyCudaDeformable::MaxComponents];
+};
+
+// Status of a sample, as in FastLinearInterpolator
+enum SampleStatus { INSIDE = 0, OUTSIDE, BORDER };
+
+// Corners of the interpolation cell of a sample. The offsets of the corners that
+// fall outside of the image are -1, and these corners read as zero
+struct Corners
+{
+  int status;
+  float f[3];
+  long off[8];
+};
+
+inline int NumBlocks(long n)
+{
+  return (int) ((n + GREEDY_CUDA_BLOCK - 1) / GREEDY_CUDA_BLOCK);
+}
+
+__device__ inline float Lerp(float a, float l, float h)
+{
+  return l + a * (h - l);
+}
+
+__device__ inline void VoxelIndex(const Grid &g, long i, int *idx)
+{
+  idx[0] = (int) (i % g.size[0]);
+  long r = i / g.size[0];
+  idx[1] = (int) (r % g.size[1]);
+  idx[2] = (int) (r / g.size[1]);
+}
+
+template <int VDim>
+__device__ Corners ComputeCorners(const Grid &g, const float *pos)
+{
+  Corners c;
+  int i0[3] = { 0, 0, 0 }, i1[3] = { 0, 0, 0 };
+  bool inside = true, border = true;
+  for(int d = 0; d < 3; d++)
+    {
+    c.f[d] = 0.0f;
+    if(d < VDim)
+      {
+      i0[d] = (int) floorf(pos[d]);
+      i1[d] = i0[d] + 1;
+      c.f[d] = pos[d] - i0[d];
+      inside = inside && i0[d] >= 0 && i1[d] < g.size[d];
+      border = border && i0[d] >= -1 && i1[d] <= g.size[d];
+      }
+    }
+
+  c.status = inside ? INSIDE : (border ? BORDER : OUTSIDE);
+
+  // Corner q has bit 0 set for x1, bit 1 for y1 and bit 2 for z1
+  for(int q = 0; q < (1 << VDim); q++)
+    {
+    int x = (q & 1) ? i1[0] : i0[0];
+    int y = (q & 2) ? i1[1] : i0[1];
+    int z = (q & 4) ? i1[2] : i0[2];
+    bool valid = x >= 0 && x < g.size[0] && y >= 0 && y < g.size[1] && z >= 0 && z < g.size[2];
+    c.off[q] = valid ? x + g.size[0] * (y + g.size[1] * (long) z) : -1;
+    }
+
+  return c;
+}
+
+// Interpolate component k of an image with nc components, and optionally its
+// gradient, in the same order of operations as FastLinearInterpolator
+template <int VDim>
+__device__ float SampleComponent(const float *img, int nc, int k, const Corners &c, float *grad)
+{
+  float v[8];
+  for(int q = 0; q < (1 << VDim); q++)
+    v[q] = c.off[q] >= 0 ? img[c.off[q] * nc + k] : 0.0f;
+
+  float dx0 = Lerp(c.f[0], v[0], v[1]);
+  float dx1 = Lerp(c.f[0], v[2], v[3]);
+  if(VDim == 2)
+    {
+    if(grad)
+      {
+      grad[0] = Lerp(c.f[1], v[1] - v[0], v[3] - v[2]);
+      grad[1] = dx1 - dx0;
+      }
+    return Lerp(c.f[1], dx0, dx1);
+    }
+  else
+    {
+    float dx01 = Lerp(c.f[0], v[4], v[5]);
+    float dx11 = Lerp(c.f[0], v[6], v[7]);
+    float dxy0 = Lerp(c.f[1], dx0, dx1);
+    float dxy1 = Lerp(c.f[1], dx01, dx11);
+    if(grad)
+      {
+      grad[0] = Lerp(c.f[2], Lerp(c.f[1], v[1] - v[0], v[3] - v[2]),
+                     Lerp(c.f[1], v[5] - v[4], v[7] - v[6]));
+      grad[1] = Lerp(c.f[2], dx1 - dx0, dx11 - dx01);
+      grad[2] = dxy1 - dxy0;
+      }
+    return Lerp(c.f[2], dxy0, dxy1);
+    }
+}
+
+// Reduce n_vals values over the threads of a block, by sum or by max. Thread 0
+// stores the results in out. Must be reached by all the threads of the block
+__device__ void BlockReduce(const double *vals, int n_vals, bool use_max, double *out)
+{
+  __shared__ double sdata[GREEDY_CUDA_BLOCK];
+  for(int q = 0; q < n_vals; q++)
+    {
+    sdata[threadIdx.x] = vals[q];
+    __syncthreads();
+    for(int s = blockDim.x / 2; s > 0; s >>= 1)
+      {
+      if(threadIdx.x < s)
+        sdata[threadIdx.x] = use_max
+                             ? fmax(sdata[threadIdx.x], sdata[threadIdx.x + s])
+                             : sdata[threadIdx.x] + sdata[threadIdx.x + s];
+      __syncthreads();
+      }
+    if(threadIdx.x == 0)
+      out[q] = sdata[0];
+    __syncthreads();
+    }
+}
+
+// Combine the per-block results (n_values per block) with a single block
+__global__ void ReducePartialKernel(const double *partial, int n_blocks, int n_values,
+                                    bool use_max, double *result)
+{
+  double acc[2 + GreedyCudaDeformable::MaxComponents];
+  for(int q = 0; q < n_values; q++)
+    {
+    acc[q] = 0.0;
+    for(int b = threadIdx.x; b < n_blocks; b += blockDim.x)
+      {
+      double v = partial[b * n_values + q];
+      acc[q] = use_max ? fmax(acc[q], v) : acc[q] + v;
+      }
+    }
+  BlockReduce(acc, n_values, use_max, result);
+}
+
+// SSD metric and gradient, as in MultiImageOpticalFlowImageFilter. Each block
+// stores the sums of the metric, the sample count and the component metrics
+template <int VDim>
+__global__ void SSDKernel(Grid gf, Grid gm, int nc, const float *fix, const float *mov,
+                          const float *phi, const float *mask, Weights wgt,
+                          float *grad_out, double *partial)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  double vals[2 + GreedyCudaDeformable::MaxComponents];
+  for(int q = 0; q < 2 + nc; q++)
+    vals[q] = 0.0;
+
+  if(i < gf.n)
+    {
+    int idx[3];
+    VoxelIndex(gf, i, idx);
+    float pos[3];
+    for(int d = 0; d < VDim; d++)
+      pos[d] = idx[d] + phi[i * VDim + d];
+
+    float grad[3] = { 0.0f, 0.0f, 0.0f };
+    Corners c = ComputeCorners<VDim>(gm, pos);
+    if(c.status != OUTSIDE)
+      {
+      for(int k = 0; k < nc; k++)
+        {
+        float grad_mov[3];
+        float x_mov = SampleComponent<VDim>(mov, nc, k, c, grad_mov);
+        double del = fix[i * nc + k] - x_mov;
+        double delw = wgt.w[k] * del;
+        double del2w = delw * del;
+        vals[0] += del2w;
+        vals[2 + k] += del2w;
+        for(int d = 0; d < VDim; d++)
+          grad[d] += delw * grad_mov[d];
+        }
+      vals[1] = 1.0;
+      }
+
+    float m = mask ? mask[i] : 1.0f;
+    for(int d = 0; d < VDim; d++)
+      grad_out[i * VDim + d] = grad[d] * m;
+    }
+
+  BlockReduce(vals, 2 + nc, false, partial + blockIdx.x * (2 + nc));
+}
+
+// The channels summed over the NCC neighborhoods, as in MultiImageNCCPrecomputeFilter:
+// for each component 1, F, M, F^2, M^2, FM, and (dM, F dM, M dM) for each dimension.
+// Samples that are not inside the moving image, or that are NaN, are left out
+template <int VDim>
+__global__ void NCCPrecomputeKernel(Grid gf, Grid gm, int nc, const float *fix, const float *mov,
+                                    const float *phi, const float *mask, float *out)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i >= gf.n)
+    return;
+
+  const int nch_comp = 6 + 3 * VDim;
+  float *p = out + i * nc * nch_comp;
+
+  Corners c;
+  bool valid = !mask || mask[i] > 0.0f;
+  if(valid)
+    {
+    int idx[3];
+    VoxelIndex(gf, i, idx);
+    float pos[3];
+    for(int d = 0; d < VDim; d++)
+      pos[d] = idx[d] + phi[i * VDim + d];
+    c = ComputeCorners<VDim>(gm, pos);
+    valid = (c.status == INSIDE);
+    }
+
+  for(int k = 0; k < nc; k++)
+    {
+    float grad_mov[3];
+    float x_fix = fix[i * nc + k];
+    float x_mov = valid ? SampleComponent<VDim>(mov, nc, k, c, grad_mov) : 0.0f;
+    if(!valid || isnan(x_mov) || isnan(x_fix))
+      {
+      for(int j = 0; j < nch_comp; j++)
+        *p++ = 0.0f;
+      continue;
+      }
+
+    *p++ = 1.0f;
+    *p++ = x_fix;
+    *p++ = x_mov;
+    *p++ = x_fix * x_fix;
+    *p++ = x_mov * x_mov;
+    *p++ = x_fix * x_mov;
+    for(int d = 0; d < VDim; d++)
+      {
+      *p++ = grad_mov[d];
+      *p++ = x_fix * grad_mov[d];
+      *p++ = x_mov * grad_mov[d];
+      }
+    }
+}
+
+// Sums over a window of radius r along one axis, truncated at the edges of the
+// image. Each thread runs the sum for one channel of one line of the image
+__global__ void BoxSumKernel(Grid g, int axis, int r, int nch, const float *src, float *trg)
+{
+  long t = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  int len = g.size[axis];
+  long n_lines = g.n / len;
+  if(t >= n_lines * nch)
+    return;
+
+  // Voxels of the line are base + j * stride, with base = lo + stride * len * hi
+  int ch = (int) (t % nch);
+  long line = t / nch;
+  long stride = 1;
+  for(int d = 0; d < axis; d++)
+    stride *= g.size[d];
+  long base = (line % stride) + (line / stride) * stride * len;
+
+  const float *p_src = src + base * nch + ch;
+  float *p_trg = trg + base * nch + ch;
+  long step = stride * nch;
+
+  double sum = 0.0;
+  for(int j = 0; j < r && j < len; j++)
+    sum += p_src[j * step];
+  for(int j = 0; j < len; j++)
+    {
+    if(j + r < len)
+      sum += p_src[(j + r) * step];
+    p_trg[j * step] = (float) sum;
+    if(j - r >= 0)
+      sum -= p_src[(j - r) * step];
+    }
+}
+
+// NCC metric and gradient from the neighborhood sums, as in
+// MultiImageNNCPostComputeFunction, over the voxels where the mask is above 0.5
+template <int VDim>
+__global__ void NCCPostKernel(Grid gf, int nc, const float *sums, const float *mask, Weights wgt,
+                              float *grad_out, double *partial)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  double vals[2 + GreedyCudaDeformable::MaxComponents];
+  for(int q = 0; q < 2 + nc; q++)
+    vals[q] = 0.0;
+
+  if(i < gf.n)
+    {
+    const int nch_comp = 6 + 3 * VDim;
+    const double eps = 1e-8;
+    float grad[3] = { 0.0f, 0.0f, 0.0f };
+    if(!mask || mask[i] > 0.5f)
+      {
+      const float *p = sums + i * nc * nch_comp;
+      for(int k = 0; k < nc; k++, p += nch_comp)
+        {
+        double n = p[0];
+        if(n == 0.0)
+          continue;
+
+        double one_over_n = 1.0 / n;
+        double x_fix = p[1], x_mov = p[2], x_fix_sq = p[3], x_mov_sq = p[4], x_fix_mov = p[5];
+        double x_fix_over_n = x_fix * one_over_n;
+        double x_mov_over_n = x_mov * one_over_n;
+        double var_fix = x_fix_sq - x_fix * x_fix_over_n;
+        double var_mov = x_mov_sq - x_mov * x_mov_over_n;
+        if(var_fix < eps || var_mov < eps)
+          continue;
+
+        double cov_fix_mov = x_fix_mov - x_fix * x_mov_over_n;
+        double one_over_denom = 1.0 / (var_fix * var_mov);
+        double cov_fix_mov_over_denom = cov_fix_mov * one_over_denom;
+        double ncc_fix_mov = cov_fix_mov * cov_fix_mov_over_denom;
+
+        float w = (cov_fix_mov < 0) ? -wgt.w[k] : wgt.w[k];
+        w *= n;
+
+        for(int d = 0; d < VDim; d++)
+          {
+          double x_grad_mov_i = p[6 + 3 * d];
+          double x_fix_grad_mov_i = p[7 + 3 * d];
+          double x_mov_grad_mov_i = p[8 + 3 * d];
+          double grad_cov_fix_mov_i = x_fix_grad_mov_i - x_fix_over_n * x_grad_mov_i;
+          double half_grad_var_mov_i = x_mov_grad_mov_i - x_mov_over_n * x_grad_mov_i;
+          double grad_ncc_fix_mov_i =
+              2 * cov_fix_mov_over_denom
+              * (grad_cov_fix_mov_i - var_fix * half_grad_var_mov_i * cov_fix_mov_over_denom);
+          grad[d] += (float) (w * grad_ncc_fix_mov_i);
+          }
+
+        float weighted_metric = (float) (w * ncc_fix_mov);
+        vals[0] += weighted_metric;
+        vals[2 + k] += weighted_metric;
+        }
+      vals[1] = 1.0;
+      }
+
+    for(int d = 0; d < VDim; d++)
+      grad_out[i * VDim + d] = grad[d];
+    }
+
+  BlockReduce(vals, 2 + nc, false, partial + blockIdx.x * (2 + nc));
+}
+
+// Convolution of a vector field with a symmetric kernel along one axis. The field
+// is extended by its value at the edge. The kernel holds the weights for 0 to r
+template <int VDim>
+__global__ void SmoothKernel(Grid g, int axis, int r, const float *kernel, const float *src, float *trg)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i >= g.n)
+    return;
+
+  int idx[3];
+  VoxelIndex(g, i, idx);
+  long stride = axis == 0 ? 1 : (axis == 1 ? g.size[0] : (long) g.size[0] * g.size[1]);
+  int pos = idx[axis], len = g.size[axis];
+
+  float sum[3] = { 0.0f, 0.0f, 0.0f };
+  for(int j = -r; j <= r; j++)
+    {
+    int q = min(max(pos + j, 0), len - 1);
+    float w = kernel[j < 0 ? -j : j];
+    const float *v = src + (i + (q - pos) * stride) * VDim;
+    for(int d = 0; d < VDim; d++)
+      sum[d] += w * v[d];
+    }
+
+  for(int d = 0; d < VDim; d++)
+    trg[i * VDim + d] = sum[d];
+}
+
+// Set the vectors outside of the interior region to zero, as in vimg_clear_outside
+template <int VDim>
+__global__ void ClearOutsideKernel(Grid g, int3 lo, int3 hi, float *field)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i >= g.n)
+    return;
+
+  int idx[3];
+  VoxelIndex(g, i, idx);
+  if(idx[0] < lo.x || idx[0] >= hi.x || idx[1] < lo.y || idx[1] >= hi.y
+     || (VDim == 3 && (idx[2] < lo.z || idx[2] >= hi.z)))
+    {
+    for(int d = 0; d < VDim; d++)
+      field[i * VDim + d] = 0.0f;
+    }
+}
+
+// Composition out = a o (id + b) + b, as in FastWarpCompositeImageFilter with the
+// deformation added and zero outside of the image
+template <int VDim>
+__global__ void ComposeKernel(Grid g, const float *a, const float *b, float *out)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i >= g.n)
+    return;
+
+  int idx[3];
+  VoxelIndex(g, i, idx);
+  float pos[3];
+  for(int d = 0; d < VDim; d++)
+    pos[d] = idx[d] + b[i * VDim + d];
+
+  Corners c = ComputeCorners<VDim>(g, pos);
+  for(int d = 0; d < VDim; d++)
+    {
+    float a_d = (c.status == OUTSIDE) ? 0.0f : SampleComponent<VDim>(a, VDim, d, c, NULL);
+    out[i * VDim + d] = a_d + b[i * VDim + d];
+    }
+}
+
+// out = a + s * b, over n values
+__global__ void AddScaledKernel(long n, const float *a, const float *b, float s, float *out)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i < n)
+    out[i] = a[i] + s * b[i];
+}
+
+// x = s * x, over n values
+__global__ void ScaleKernel(long n, float s, float *x)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  if(i < n)
+    x[i] *= s;
+}
+
+// Largest squared norm of the vectors of a field, per block
+template <int VDim>
+__global__ void MaxNormSquaredKernel(Grid g, const float *field, double *partial)
+{
+  long i = blockIdx.x * (long) blockDim.x + threadIdx.x;
+  double nsq = 0.0;
+  if(i < g.n)
+    {
+    for(int d = 0; d < VDim; d++)
+      nsq += field[i * VDim + d] * field[i * VDim + d];
+    }
+  BlockReduce(&nsq, 1, true, partial + blockIdx.x);
+}
+
+} // namespace greedy_cuda
+
+using namespace greedy_cuda;
+
+// Launch a kernel templated over the image dimension
+#define GREEDY_CUDA_LAUNCH(kernel, n_blocks, ...) \
+  { \
+  if(m_Dim == 2) \
+    kernel<2><<<(n_blocks), GREEDY_CUDA_BLOCK>>>(__VA_ARGS__); \
+  else \
+    kernel<3><<<(n_blocks), GREEDY_CUDA_BLOCK>>>(__VA_ARGS__); \
+  GREEDY_CUDA_CHECK(cudaGetLastError()); \
+  }
+
+static Grid MakeGrid(const int *size)
+{
+  Grid g;
+  g.n = 1;
+  for(int d = 0; d < 3; d++)
+    {
+    g.size[d] = size[d];
+    g.n *= size[d];
+    }
+  return g;
+}
+
+GreedyCudaDeformable
+::GreedyCudaDeformable(int dim, const int *fixed_size, const int *moving_size, int n_comp)
+  : m_Dim(dim), m_Comp(n_comp), m_Metric(SSD)
+{
+  if(dim != 2 && dim != 3)
+    throw GreedyException("GPU registration supports 2D and 3D images only");
+  if(n_comp < 1 || n_comp > MaxComponents)
+    throw GreedyException("GPU registration supports up to %d image components, %d given",
+                          MaxComponents, n_comp);
+
+  m_FixedVoxels = m_MovingVoxels = 1;
+  for(int d = 0; d < 3; d++)
+    {
+    m_FixedSize[d] = d < dim ? fixed_size[d] : 1;
+    m_MovingSize[d] = d < dim ? moving_size[d] : 1;
+    m_FixedVoxels *= m_FixedSize[d];
+    m_MovingVoxels *= m_MovingSize[d];
+    m_Radius[d] = 0;
+    m_PreRadius[d] = m_PostRadius[d] = 0;
+    m_PreKernel[d] = m_PostKernel[d] = NULL;
+    m_InteriorIndex[d] = 0;
+    m_InteriorSize[d] = m_FixedSize[d];
+    }
+
+  for(int k = 0; k < MaxComponents; k++)
+    m_Weights[k] = 1.0;
+
+  m_Fixed = m_Moving = m_FixedMask = NULL;
+  m_Field = m_FieldExp = m_Gradient = m_Update = m_Work = NULL;
+  m_NCCWork[0] = m_NCCWork[1] = NULL;
+  m_Partial = m_Reduced = NULL;
+
+  // The destructor is not called if the constructor throws, so release the
+  // device memory allocated so far before passing the error on
+  try
+    {
+    size_t fbytes = sizeof(float) * m_FixedVoxels;
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Fixed, fbytes * n_comp));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Moving, sizeof(float) * m_MovingVoxels * n_comp));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Field, fbytes * dim));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Gradient, fbytes * dim));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Update, fbytes * dim));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Work, fbytes * dim));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Partial, sizeof(double) * NumBlocks(m_FixedVoxels) * (2 + MaxComponents)));
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_Reduced, sizeof(double) * (2 + MaxComponents)));
+    }
+  catch(...)
+    {
+    this->ReleaseMemory();
+    throw;
+    }
+}
+
+GreedyCudaDeformable
+::~GreedyCudaDeformable()
+{
+  this->ReleaseMemory();
+}
+
+void
+GreedyCudaDeformable
+::ReleaseMemory()
+{
+  // Errors are ignored here, cudaFree accepts NULL
+  float *buffers[] = { m_Fixed, m_Moving, m_FixedMask, m_Field, m_FieldExp, m_Gradient,
+                       m_Update, m_Work, m_NCCWork[0], m_NCCWork[1] };
+  for(float *p : buffers)
+    cudaFree(p);
+  for(int d = 0; d < 3; d++)
+    {
+    cudaFree(m_PreKernel[d]);
+    cudaFree(m_PostKernel[d]);
+    }
+  cudaFree(m_Partial);
+  cudaFree(m_Reduced);
+}
+
+bool
+GreedyCudaDeformable
+::IsDeviceAvailable()
+{
+  int n_dev = 0;
+  return cudaGetDeviceCount(&n_dev) == cudaSuccess && n_dev > 0;
+}
+
+void
+GreedyCudaDeformable
+::SetFixedImage(const float *data)
+{
+  GREEDY_CUDA_CHECK(cudaMemcpy(m_Fixed, data, sizeof(float) * m_FixedVoxels * m_Comp,
+                               cudaMemcpyHostToDevice));
+}
+
+void
+GreedyCudaDeformable
+::SetMovingImage(const float *data)
+{
+  GREEDY_CUDA_CHECK(cudaMemcpy(m_Moving, data, sizeof(float) * m_MovingVoxels * m_Comp,
+                               cudaMemcpyHostToDevice));
+}
+
+void
+GreedyCudaDeformable
+::SetWeights(const double *weights)
+{
+  for(int k = 0; k < m_Comp; k++)
+    m_Weights[k] = weights[k];
+}
+
+void
+GreedyCudaDeformable
+::SetFixedMask(const float *mask)
+{
+  if(!mask)
+    {
+    cudaFree(m_FixedMask);
+    m_FixedMask = NULL;
+    return;
+    }
+
+  if(!m_FixedMask)
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_FixedMask, sizeof(float) * m_FixedVoxels));
+  GREEDY_CUDA_CHECK(cudaMemcpy(m_FixedMask, mask, sizeof(float) * m_FixedVoxels,
+                               cudaMemcpyHostToDevice));
+}
+
+void
+GreedyCudaDeformable
+::SetMetricToSSD()
+{
+  m_Metric = SSD;
+}
+
+void
+GreedyCudaDeformable
+::SetMetricToNCC(const int *radius)
+{
+  m_Metric = NCC;
+
+  // The radius is reduced for small images, as in AdjustNCCRadius
+  for(int d = 0; d < m_Dim; d++)
+    m_Radius[d] = (radius[d] * 2 + 1 >= m_FixedSize[d]) ? (m_FixedSize[d] - 1) / 2 : radius[d];
+
+  // Working images for the channels of the neighborhood sums
+  size_t bytes = sizeof(float) * m_FixedVoxels * m_Comp * (6 + 3 * m_Dim);
+  for(int i = 0; i < 2; i++)
+    if(!m_NCCWork[i])
+      GREEDY_CUDA_CHECK(cudaMalloc(&m_NCCWork[i], bytes));
+}
+
+void
+GreedyCudaDeformable
+::SetKernels(const double *sigma, int *radius, float **kernel)
+{
+  for(int d = 0; d < m_Dim; d++)
+    {
+    cudaFree(kernel[d]);
+    kernel[d] = NULL;
+    radius[d] = 0;
+    if(sigma[d] <= 0.0)
+      continue;
+
+    // Sampled Gaussian truncated at four sigmas, normalized to unit sum
+    radius[d] = (int) std::ceil(4.0 * sigma[d]);
+    std::vector<float> k(radius[d] + 1);
+    double sum = 0.0;
+    for(int j = 0; j <= radius[d]; j++)
+      {
+      k[j] = (float) std::exp(-0.5 * j * j / (sigma[d] * sigma[d]));
+      sum += (j == 0) ? k[j] : 2.0 * k[j];
+      }
+    for(int j = 0; j <= radius[d]; j++)
+      k[j] = (float) (k[j] / sum);
+
+    GREEDY_CUDA_CHECK(cudaMalloc(&kernel[d], sizeof(float) * k.size()));
+    GREEDY_CUDA_CHECK(cudaMemcpy(kernel[d], k.data(), sizeof(float) * k.size(),
+                                 cudaMemcpyHostToDevice));
+    }
+}
+
+void
+GreedyCudaDeformable
+::SetSmoothingSigmas(const double *sigma_pre, const double *sigma_post)
+{
+  this->SetKernels(sigma_pre, m_PreRadius, m_PreKernel);
+  this->SetKernels(sigma_post, m_PostRadius, m_PostKernel);
+}
+
+void
+GreedyCudaDeformable
+::SetSmoothingInterior(const int *index, const int *size)
+{
+  for(int d = 0; d < m_Dim; d++)
+    {
+    m_InteriorIndex[d] = index[d];
+    m_InteriorSize[d] = size[d];
+    }
+}
+
+void
+GreedyCudaDeformable
+::SetField(const float *u)
+{
+  GREEDY_CUDA_CHECK(cudaMemcpy(m_Field, u, sizeof(float) * m_FixedVoxels * m_Dim,
+                               cudaMemcpyHostToDevice));
+}
+
+void
+GreedyCudaDeformable
+::GetField(float *u) const
+{
+  GREEDY_CUDA_CHECK(cudaMemcpy(u, m_Field, sizeof(float) * m_FixedVoxels * m_Dim,
+                               cudaMemcpyDeviceToHost));
+}
+
+double
+GreedyCudaDeformable
+::ReduceSum(int n_blocks, int n_values, double *result)
+{
+  ReducePartialKernel<<<1, GREEDY_CUDA_BLOCK>>>(m_Partial, n_blocks, n_values, false, m_Reduced);
+  GREEDY_CUDA_CHECK(cudaGetLastError());
+  GREEDY_CUDA_CHECK(cudaMemcpy(result, m_Reduced, sizeof(double) * n_values, cudaMemcpyDeviceToHost));
+  return result[0];
+}
+
+void
+GreedyCudaDeformable
+::Exponentiate(int exponent)
+{
+  if(!m_FieldExp)
+    GREEDY_CUDA_CHECK(cudaMalloc(&m_FieldExp, sizeof(float) * m_FixedVoxels * m_Dim));
+
+  // Squarings alternate between the two buffers, starting in the one that makes
+  // the result end up in m_FieldExp, as in vimg_exp
+  Grid g = MakeGrid(m_FixedSize);
+  float *buf[2] = { m_FieldExp, m_Work };
+  int k = exponent % 2;
+  GREEDY_CUDA_CHECK(cudaMemcpy(buf[k], m_Field, sizeof(float) * g.n * m_Dim,
+                               cudaMemcpyDeviceToDevice));
+  for(int q = 0; q < exponent; q++, k = 1 - k)
+    GREEDY_CUDA_LAUNCH(ComposeKernel, NumBlocks(g.n), g, buf[k], buf[k], buf[1 - k]);
+}
+
+double
+GreedyCudaDeformable
+::ComputeMetricAndGradient(bool use_exponent, double eps, double *comp_metric)
+{
+  Grid gf = MakeGrid(m_FixedSize), gm = MakeGrid(m_MovingSize);
+  const float *phi = use_exponent ? m_FieldExp : m_Field;
+  int n_blocks = NumBlocks(gf.n);
+
+  // The weights are scaled by epsilon in single precision, as in the helper
+  Weights wgt;
+  for(int k = 0; k < m_Comp; k++)
+    wgt.w[k] = (float) (m_Weights[k] * eps);
+
+  if(m_Metric == SSD)
+    {
+    GREEDY_CUDA_LAUNCH(SSDKernel, n_blocks,
+                       gf, gm, m_Comp, m_Fixed, m_Moving, phi, m_FixedMask, wgt,
+                       m_Gradient, m_Partial);
+    }
+  else
+    {
+    // The NCC of each patch is weighted by its sample count over the patch size
+    double one_over_patch_size = 1.0;
+    for(int d = 0; d < m_Dim; d++)
+      one_over_patch_size /= (1 + 2.0 * m_Radius[d]);
+    for(int k = 0; k < m_Comp; k++)
+      wgt.w[k] = (float) (wgt.w[k] * one_over_patch_size);
+
+    GREEDY_CUDA_LAUNCH(NCCPrecomputeKernel, n_blocks,
+                       gf, gm, m_Comp, m_Fixed, m_Moving, phi, m_FixedMask, m_NCCWork[0]);
+
+    // Neighborhood sums, one axis at a time between the two working images
+    int nch = m_Comp * (6 + 3 * m_Dim), cur = 0;
+    for(int d = 0; d < m_Dim; d++, cur = 1 - cur)
+      {
+      BoxSumKernel<<<NumBlocks(gf.n / gf.size[d] * nch), GREEDY_CUDA_BLOCK>>>(
+          gf, d, m_Radius[d], nch, m_NCCWork[cur], m_NCCWork[1 - cur]);
+      GREEDY_CUDA_CHECK(cudaGetLastError());
+      }
+
+    GREEDY_CUDA_LAUNCH(NCCPostKernel, n_blocks,
+                       gf, m_Comp, m_NCCWork[cur], m_FixedMask, wgt, m_Gradient, m_Partial);
+    }
+
+  // The metric is averaged over the voxels that were counted
+  double result[2 + MaxComponents];
+  this->ReduceSum(n_blocks, 2 + m_Comp, result);
+  for(int k = 0; k < m_Comp; k++)
+    comp_metric[k] = result[2 + k] / result[1];
+  return result[0] / result[1];
+}
+
+void
+GreedyCudaDeformable
+::SmoothVectorField(const float *src, float *trg, int *radius, float **kernel)
+{
+  Grid g = MakeGrid(m_FixedSize);
+
+  // Each pass reads the output of the previous one, the passes alternate between
+  // the work field and the target so that the last pass writes the target
+  std::vector<int> axes;
+  for(int d = 0; d < m_Dim; d++)
+    if(kernel[d])
+      axes.push_back(d);
+
+  if(axes.empty())
+    {
+    GREEDY_CUDA_CHECK(cudaMemcpy(trg, src, sizeof(float) * g.n * m_Dim, cudaMemcpyDeviceToDevice));
+    }
+
+  const float *p_src = src;
+  for(unsigned int p = 0; p < axes.size(); p++)
+    {
+    float *p_trg = ((axes.size() - 1 - p) % 2 == 0) ? trg : m_Work;
+    int d = axes[p];
+    GREEDY_CUDA_LAUNCH(SmoothKernel, NumBlocks(g.n), g, d, radius[d], kernel[d], p_src, p_trg);
+    p_src = p_trg;
+    }
+
+  int3 lo = make_int3(m_InteriorIndex[0], m_InteriorIndex[1], m_InteriorIndex[2]);
+  int3 hi = make_int3(lo.x + m_InteriorSize[0], lo.y + m_InteriorSize[1], lo.z + m_InteriorSize[2]);
+  GREEDY_CUDA_LAUNCH(ClearOutsideKernel, NumBlocks(g.n), g, lo, hi, trg);
+}
+
+void
+GreedyCudaDeformable
+::SmoothGradient()
+{
+  this->SmoothVectorField(m_Gradient, m_Update, m_PreRadius, m_PreKernel);
+}
+
+void
+GreedyCudaDeformable
+::SmoothField()
+{
+  this->SmoothVectorField(m_Gradient, m_Field, m_PostRadius, m_PostKernel);
+}
+
+double
+GreedyCudaDeformable
+::GetUpdateMaximumNorm()
+{
+  Grid g = MakeGrid(m_FixedSize);
+  int n_blocks = NumBlocks(g.n);
+  GREEDY_CUDA_LAUNCH(MaxNormSquaredKernel, n_blocks, g, m_Update, m_Partial);
+
+  ReducePartialKernel<<<1, GREEDY_CUDA_BLOCK>>>(m_Partial, n_blocks, 1, true, m_Reduced);
+  GREEDY_CUDA_CHECK(cudaGetLastError());
+  double nsq_max;
+  GREEDY_CUDA_CHECK(cudaMemcpy(&nsq_max, m_Reduced, sizeof(double), cudaMemcpyDeviceToHost));
+  return std::sqrt(nsq_max);
+}
+
+void
+GreedyCudaDeformable
+::ScaleUpdate(double scale)
+{
+  long n = m_FixedVoxels * m_Dim;
+  ScaleKernel<<<NumBlocks(n), GREEDY_CUDA_BLOCK>>>(n, (float) scale, m_Update);
+  GREEDY_CUDA_CHECK(cudaGetLastError());
+}
+
+void
+GreedyCudaDeformable
+::ComposeUpdate()
+{
+  Grid g = MakeGrid(m_FixedSize);
+  GREEDY_CUDA_LAUNCH(ComposeKernel, NumBlocks(g.n), g, m_Field, m_Update, m_Gradient);
+}
+
+void
+GreedyCudaDeformable
+::AddScaledUpdate(double scale)
+{
+  long n = m_FixedVoxels * m_Dim;
+  AddScaledKernel<<<NumBlocks(n), GREEDY_CUDA_BLOCK>>>(n, m_Field, m_Update, (float) scale, m_Gradient);
+  GREEDY_CUDA_CHECK(cudaGetLastError());
+}
@@ -0,0 +1,209 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef GREEDYCUDADEFORMABLE_H
+#define GREEDYCUDADEFORMABLE_H
+
+#ifdef _GREEDY_CUDA_
+
+/**
+ * CUDA implementation of the iterations of greedy deformable registration at
+ * one pyramid level, used with -gpu when greedy is built with GREEDY_USE_CUDA.
+ *
+ * The fixed and moving composites of the level, the deformation field and all
+ * the intermediate fields stay in device memory for the whole level. The host
+ * only uploads the images and the initial field at the start of the level, and
+ * reads the field back at the end of the level and for checkpoints. Each step
+ * reproduces the CPU code it replaces in RunDeformable:
+ *
+ *   - ComputeMetricAndGradient: MultiImageOpticalFlowImageFilter (SSD) or
+ *     MultiComponentNCCImageMetric (NCC), with trilinear interpolation of the
+ *     moving image as in FastLinearInterpolator;
+ *   - SmoothGradient, SmoothField: vimg_smooth with a Gaussian, followed by
+ *     vimg_clear_outside. The Gaussian is a truncated FIR kernel rather than the
+ *     recursive approximation, so results agree with the CPU within tolerance;
+ *   - ComposeUpdate, AddScaledUpdate, Exponentiate: vimg_compose, the
+ *     stationary velocity update and vimg_exp.
+ *
+ * The interface only uses plain arrays, so that this header can be included
+ * by code that is not compiled by nvcc. Images are stored with x running
+ * fastest and the components of a voxel next to each other, as in ITK.
+ */
+class GreedyCudaDeformable
+{
+public:
+
+  enum MetricType { SSD = 0, NCC };
+
+  /** Largest number of components of the composites handled on the device */
+  static const int MaxComponents = 8;
+
+  /**
+   * Set up the device storage for a level. The deformation is defined on the
+   * fixed grid and is in voxel units of the moving grid, as in greedy. Image
+   * dimension is 2 or 3, sizes have dim entries
+   */
+  GreedyCudaDeformable(int dim, const int *fixed_size, const int *moving_size, int n_comp);
+
+  ~GreedyCudaDeformable();
+
+  /** Whether a CUDA device can be used */
+  static bool IsDeviceAvailable();
+
+  /** Upload the composite images, n_comp values per voxel */
+  void SetFixedImage(const float *data);
+  void SetMovingImage(const float *data);
+
+  /** Set the weights of the components */
+  void SetWeights(const double *weights);
+
+  /**
+   * Set the mask on the fixed grid, or NULL for no mask. With SSD, the gradient
+   * is multiplied by the mask. With NCC, the mask restricts the metric as in
+   * MultiComponentNCCImageMetric
+   */
+  void SetFixedMask(const float *mask);
+
+  /** Select the SSD metric, or the NCC metric with the given radius (dim entries) */
+  void SetMetricToSSD();
+  void SetMetricToNCC(const int *radius);
+
+  /** Set the sigmas of the gradient and field smoothing, in voxel units */
+  void SetSmoothingSigmas(const double *sigma_pre, const double *sigma_post);
+
+  /** Region outside of which the smoothed fields are set to zero */
+  void SetSmoothingInterior(const int *index, const int *size);
+
+  /** Upload the deformation field, or read it back */
+  void SetField(const float *u);
+  void GetField(float *u) const;
+
+  /** In stationary velocity mode, compute the exponent of the field (uk_exp) */
+  void Exponentiate(int exponent);
+
+  /**
+   * Compute the metric and its gradient (uk1) for the field, or for its
+   * exponent if use_exponent is set. The weights are scaled by eps as in the
+   * CPU code. Returns the total metric and fills comp_metric (n_comp values)
+   */
+  double ComputeMetricAndGradient(bool use_exponent, double eps, double *comp_metric);
+
+  /** Smooth the gradient with sigma_pre into the update (viTemp) */
+  void SmoothGradient();
+
+  /** Largest norm of the update vectors, and scaling of the update */
+  double GetUpdateMaximumNorm();
+  void ScaleUpdate(double scale);
+
+  /** Greedy update, uk1 = viTemp + uk o (id + viTemp) */
+  void ComposeUpdate();
+
+  /** Stationary velocity update, uk1 = uk + s * viTemp */
+  void AddScaledUpdate(double scale);
+
+  /** Smooth uk1 with sigma_post into the field (uk) */
+  void SmoothField();
+
+protected:
+
+  // Geometry of the fixed and moving grids, unused dimensions have size 1
+  int m_Dim, m_Comp;
+  int m_FixedSize[3], m_MovingSize[3];
+  long m_FixedVoxels, m_MovingVoxels;
+
+  // Metric settings
+  MetricType m_Metric;
+  int m_Radius[3];
+  double m_Weights[MaxComponents];
+
+  // Smoothing kernels (half kernels, center first) and the interior region
+  int m_PreRadius[3], m_PostRadius[3];
+  float *m_PreKernel[3], *m_PostKernel[3];
+  int m_InteriorIndex[3], m_InteriorSize[3];
+
+  // Device images
+  float *m_Fixed, *m_Moving, *m_FixedMask;
+
+  // Device fields: uk, uk_exp, uk1, viTemp and a work field
+  float *m_Field, *m_FieldExp, *m_Gradient, *m_Update, *m_Work;
+
+  // NCC working images with the channels of the neighborhood sums
+  float *m_NCCWork[2];
+
+  // Per-block partial results of the reductions, and the final values
+  double *m_Partial, *m_Reduced;
+
+  void SmoothVectorField(const float *src, float *trg, int *radius, float **kernel);
+  void SetKernels(const double *sigma, int *radius, float **kernel);
+  double ReduceSum(int n_blocks, int n_values, double *result);
+  void ReleaseMemory();
+};
+
+#else
+
+#include "GreedyException.h"
+
+/**
+ * Stand-in for builds without GREEDY_USE_CUDA, where no device is available
+ * and -gpu runs the iterations on the CPU
+ */
+class GreedyCudaDeformable
+{
+public:
+  enum MetricType { SSD = 0, NCC };
+  static const int MaxComponents = 8;
+
+  GreedyCudaDeformable(int, const int *, const int *, int)
+    { throw GreedyException("Code was not compiled with GREEDY_USE_CUDA"); }
+
+  static bool IsDeviceAvailable() { return false; }
+
+  void SetFixedImage(const float *) {}
+  void SetMovingImage(const float *) {}
+  void SetWeights(const double *) {}
+  void SetFixedMask(const float *) {}
+  void SetMetricToSSD() {}
+  void SetMetricToNCC(const int *) {}
+  void SetSmoothingSigmas(const double *, const double *) {}
+  void SetSmoothingInterior(const int *, const int *) {}
+  void SetField(const float *) {}
+  void GetField(float *) const {}
+  void Exponentiate(int) {}
+  double ComputeMetricAndGradient(bool, double, double *) { return 0.0; }
+  void SmoothGradient() {}
+  double GetUpdateMaximumNorm() { return 0.0; }
+  void ScaleUpdate(double) {}
+  void ComposeUpdate() {}
+  void AddScaledUpdate(double) {}
+  void SmoothField() {}
+
+protected:
+  int m_Comp;
+};
+
+#endif // _GREEDY_CUDA_
+
+#endif // GREEDYCUDADEFORMABLE_H
@@ -0,0 +1,201 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "GreedyMappedImageCache.h"
+#include <cstdio>
+#include <sstream>
+#include <functional>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static const char GREEDY_MAPPED_CACHE_MAGIC[] = "GRDYMC01";
+
+// Pixel data in the cache files start at a multiple of this offset
+static const size_t GREEDY_MAPPED_CACHE_ALIGN = 4096;
+
+void
+GreedyMappedImageCache
+::SetDirectory(const std::string &dir)
+{
+#ifdef WIN32
+  if(dir.size())
+    std::cerr << "Warning: memory-mapped image cache is not supported on this platform" << std::endl;
+  m_Directory.clear();
+#else
+  m_Directory = dir;
+  while(m_Directory.size() > 1 && m_Directory[m_Directory.size() - 1] == '/')
+    m_Directory.erase(m_Directory.size() - 1);
+#endif
+}
+
+void
+GreedyMappedImageCache
+::Unmap(void *base, size_t size)
+{
+#ifndef WIN32
+  munmap(base, size);
+#endif
+}
+
+std::string
+GreedyMappedImageCache
+::GetKey(const std::string &filename, const char *type_name) const
+{
+#ifdef WIN32
+  return std::string();
+#else
+  // The key is made up of the canonical path, with size and modification time
+  // of the file to detect changes
+  struct stat st;
+  if(stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return std::string();
+
+  char *real = realpath(filename.c_str(), NULL);
+  std::string path = real ? real : filename;
+  free(real);
+
+  std::ostringstream oss;
+  oss << path << "|" << (long long) st.st_size << "|" << (long long) st.st_mtime
+      << "|" << type_name;
+  return oss.str();
+#endif
+}
+
+std::string
+GreedyMappedImageCache
+::GetCacheFile(const std::string &key) const
+{
+  char hash[32];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) std::hash<std::string>()(key));
+  return m_Directory + "/" + hash + ".gmc";
+}
+
+bool
+GreedyMappedImageCache
+::OpenEntry(const std::string &filename, const char *type_name,
+            unsigned int dim, size_t element_size, MappedFile &mf) const
+{
+#ifdef WIN32
+  return false;
+#else
+  if(!this->IsEnabled())
+    return false;
+
+  std::string key = this->GetKey(filename, type_name);
+  if(key.empty())
+    return false;
+
+  int fd = open(this->GetCacheFile(key).c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header))
+    {
+    close(fd);
+    return false;
+    }
+
+  // Private mapping: pages are shared with other processes until written to
+  size_t map_size = (size_t) st.st_size;
+  void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+    return false;
+
+  // Check the header against the key and the expected layout
+  const Header *hdr = static_cast<const Header *>(base);
+  size_t data_offset = ((sizeof(Header) + hdr->key_length + GREEDY_MAPPED_CACHE_ALIGN - 1)
+                        / GREEDY_MAPPED_CACHE_ALIGN) * GREEDY_MAPPED_CACHE_ALIGN;
+  bool valid =
+      memcmp(hdr->magic, GREEDY_MAPPED_CACHE_MAGIC, 8) == 0
+      && hdr->dim == (itk::int32_t) dim
+      && hdr->element_size == (itk::int64_t) element_size
+      && hdr->key_length == (itk::int64_t) key.size()
+      && data_offset + hdr->n_elements * element_size <= map_size
+      && memcmp(static_cast<const char *>(base) + sizeof(Header), key.c_str(), key.size()) == 0;
+
+  if(!valid)
+    {
+    munmap(base, map_size);
+    return false;
+    }
+
+  mf.header = *hdr;
+  mf.base = base;
+  mf.data = static_cast<char *>(base) + data_offset;
+  mf.map_size = map_size;
+  return true;
+#endif
+}
+
+void
+GreedyMappedImageCache
+::WriteEntry(const std::string &filename, const char *type_name,
+             Header &header, const void *data) const
+{
+#ifndef WIN32
+  std::string key = this->GetKey(filename, type_name);
+  if(key.empty())
+    return;
+
+  memcpy(header.magic, GREEDY_MAPPED_CACHE_MAGIC, 8);
+  header.key_length = key.size();
+
+  size_t data_offset = ((sizeof(Header) + key.size() + GREEDY_MAPPED_CACHE_ALIGN - 1)
+                        / GREEDY_MAPPED_CACHE_ALIGN) * GREEDY_MAPPED_CACHE_ALIGN;
+  std::vector<char> preamble(data_offset, 0);
+  memcpy(&preamble[0], &header, sizeof(Header));
+  memcpy(&preamble[sizeof(Header)], key.c_str(), key.size());
+
+  // Write to a temporary file first and rename it into place, so that other
+  // processes never map a partially written entry
+  std::string fn_cache = this->GetCacheFile(key);
+  std::ostringstream oss;
+  oss << fn_cache << ".tmp" << getpid();
+  std::string fn_temp = oss.str();
+
+  FILE *f = fopen(fn_temp.c_str(), "wb");
+  if(!f)
+    return;
+
+  size_t n_bytes = header.n_elements * header.element_size;
+  bool ok = fwrite(&preamble[0], 1, data_offset, f) == data_offset
+            && fwrite(data, 1, n_bytes, f) == n_bytes;
+  ok = (fclose(f) == 0) && ok;
+
+  if(!ok || rename(fn_temp.c_str(), fn_cache.c_str()) != 0)
+    remove(fn_temp.c_str());
+#endif
+}
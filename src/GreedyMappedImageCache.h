@@ -0,0 +1,254 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef GREEDYMAPPEDIMAGECACHE_H
+#define GREEDYMAPPEDIMAGECACHE_H
+
+#include <string>
+#include <typeinfo>
+#include <cstring>
+#include "itkImage.h"
+#include "itkImageIOBase.h"
+#include "itkImportImageContainer.h"
+
+/**
+ * An on-disk cache of decompressed images that are read back using memory
+ * mapping. When an image is read from a file for the first time, a raw copy of
+ * its pixel data is stored in the cache directory, keyed by the path, size and
+ * modification time of the file and by the image type. Later reads of the same
+ * file, including reads by other greedy processes, map the raw copy instead of
+ * decoding the file again. Mappings are private and copy-on-write, so processes
+ * on the same node share the pages of the cached image until they modify them.
+ *
+ * The cache is disabled until a directory is set. Entries for files that have
+ * changed are not removed; the directory may be cleared at any time when no
+ * greedy processes are running.
+ */
+class GreedyMappedImageCache
+{
+public:
+
+  typedef itk::ImageIOBase::IOComponentType IOComponentType;
+
+  GreedyMappedImageCache() {}
+
+  /** Set the cache directory. An empty string disables the cache */
+  void SetDirectory(const std::string &dir);
+
+  const std::string &GetDirectory() const { return m_Directory; }
+
+  bool IsEnabled() const { return m_Directory.size() > 0; }
+
+  /**
+   * Map the cached copy of an image file. Returns NULL if the cache is disabled,
+   * if the file is not in the cache, or if the cached copy is out of date. The
+   * optional variant string distinguishes images derived from the same file.
+   */
+  template <class TImage>
+  typename TImage::Pointer Read(const std::string &filename, IOComponentType *comp_type = NULL,
+                                const std::string &variant = std::string());
+
+  /**
+   * Store an image that has just been read from the given file in the cache.
+   * The component type is the one reported by the image IO, so that it can be
+   * reported again on later reads. Failure to write the cache is not an error.
+   * Images computed from the file may be stored under a variant string; they
+   * become out of date when the file changes, like the file itself.
+   */
+  template <class TImage>
+  void Store(const std::string &filename, TImage *image, IOComponentType comp_type,
+             const std::string &variant = std::string());
+
+  /** Unmap a memory region previously mapped by the cache */
+  static void Unmap(void *base, size_t size);
+
+protected:
+
+  // Largest supported image dimension
+  static const unsigned int MAX_DIM = 4;
+
+  // Header of a cache file. The pixel data start at a page boundary after the
+  // header and the key string.
+  struct Header
+  {
+    char magic[8];
+    itk::int32_t dim, comp_type;
+    itk::int64_t n_comp, element_size, n_elements, key_length;
+    itk::int64_t index[MAX_DIM], size[MAX_DIM];
+    double origin[MAX_DIM], spacing[MAX_DIM], direction[MAX_DIM * MAX_DIM];
+  };
+
+  struct MappedFile
+  {
+    Header header;
+    void *base, *data;
+    size_t map_size;
+  };
+
+  // Key under which the cache stores the given file, empty if the file cannot
+  // be cached (e.g., it does not exist on disk)
+  std::string GetKey(const std::string &filename, const char *type_name) const;
+
+  // Path of the cache file for a key
+  std::string GetCacheFile(const std::string &key) const;
+
+  // Map the cache file for an image, checking that it matches the key and the
+  // element layout. Returns false on a miss.
+  bool OpenEntry(const std::string &filename, const char *type_name,
+                 unsigned int dim, size_t element_size, MappedFile &mf) const;
+
+  // Write the cache file for an image atomically
+  void WriteEntry(const std::string &filename, const char *type_name,
+                  Header &header, const void *data) const;
+
+  // Name of the image type used in the key, followed by the variant if given
+  template <class TImage>
+  static std::string GetTypeName(const std::string &variant)
+  {
+    std::string name = typeid(TImage).name();
+    return variant.size() ? name + "|" + variant : name;
+  }
+
+  std::string m_Directory;
+};
+
+/**
+ * Pixel container over a memory-mapped cache file. The mapping is released
+ * when the container is destroyed.
+ */
+template <typename TElementIdentifier, typename TElement>
+class GreedyMappedPixelContainer : public itk::ImportImageContainer<TElementIdentifier, TElement>
+{
+public:
+  typedef GreedyMappedPixelContainer Self;
+  typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+
+  itkNewMacro(Self)
+  itkTypeMacro(GreedyMappedPixelContainer, ImportImageContainer)
+
+  void SetMapping(void *base, size_t size)
+  {
+    m_MappedBase = base;
+    m_MappedSize = size;
+  }
+
+protected:
+  GreedyMappedPixelContainer() : m_MappedBase(NULL), m_MappedSize(0) {}
+
+  ~GreedyMappedPixelContainer()
+  {
+    // The imported buffer is not managed by the superclass, so it is safe to
+    // unmap it before the superclass destructor runs
+    if(m_MappedBase)
+      GreedyMappedImageCache::Unmap(m_MappedBase, m_MappedSize);
+  }
+
+  void *m_MappedBase;
+  size_t m_MappedSize;
+};
+
+template <class TImage>
+typename TImage::Pointer
+GreedyMappedImageCache
+::Read(const std::string &filename, IOComponentType *comp_type, const std::string &variant)
+{
+  typedef typename TImage::PixelContainer PixelContainer;
+  typedef typename PixelContainer::Element Element;
+  typedef GreedyMappedPixelContainer<typename PixelContainer::ElementIdentifier, Element> MappedContainer;
+
+  MappedFile mf;
+  std::string type_name = GetTypeName<TImage>(variant);
+  if(!this->OpenEntry(filename, type_name.c_str(), TImage::ImageDimension, sizeof(Element), mf))
+    return NULL;
+
+  const Header &hdr = mf.header;
+  typename TImage::RegionType region;
+  typename TImage::PointType origin;
+  typename TImage::SpacingType spacing;
+  typename TImage::DirectionType direction;
+  for(unsigned int d = 0; d < TImage::ImageDimension; d++)
+    {
+    region.SetIndex(d, hdr.index[d]);
+    region.SetSize(d, hdr.size[d]);
+    origin[d] = hdr.origin[d];
+    spacing[d] = hdr.spacing[d];
+    for(unsigned int e = 0; e < TImage::ImageDimension; e++)
+      direction(d, e) = hdr.direction[d * TImage::ImageDimension + e];
+    }
+
+  typename TImage::Pointer image = TImage::New();
+  image->SetRegions(region);
+  image->SetOrigin(origin);
+  image->SetSpacing(spacing);
+  image->SetDirection(direction);
+  image->SetNumberOfComponentsPerPixel(hdr.n_comp);
+
+  typename MappedContainer::Pointer pc = MappedContainer::New();
+  pc->SetImportPointer(static_cast<Element *>(mf.data), hdr.n_elements, false);
+  pc->SetMapping(mf.base, mf.map_size);
+  image->SetPixelContainer(pc);
+
+  if(comp_type)
+    *comp_type = (IOComponentType) hdr.comp_type;
+
+  return image;
+}
+
+template <class TImage>
+void
+GreedyMappedImageCache
+::Store(const std::string &filename, TImage *image, IOComponentType comp_type,
+        const std::string &variant)
+{
+  typedef typename TImage::PixelContainer::Element Element;
+  if(!this->IsEnabled() || TImage::ImageDimension > MAX_DIM)
+    return;
+
+  Header hdr;
+  memset(&hdr, 0, sizeof(Header));
+  hdr.dim = TImage::ImageDimension;
+  hdr.comp_type = (itk::int32_t) comp_type;
+  hdr.n_comp = image->GetNumberOfComponentsPerPixel();
+  hdr.element_size = sizeof(Element);
+  hdr.n_elements = image->GetPixelContainer()->Size();
+
+  typename TImage::RegionType region = image->GetBufferedRegion();
+  for(unsigned int d = 0; d < TImage::ImageDimension; d++)
+    {
+    hdr.index[d] = region.GetIndex()[d];
+    hdr.size[d] = region.GetSize()[d];
+    hdr.origin[d] = image->GetOrigin()[d];
+    hdr.spacing[d] = image->GetSpacing()[d];
+    for(unsigned int e = 0; e < TImage::ImageDimension; e++)
+      hdr.direction[d * TImage::ImageDimension + e] = image->GetDirection()(d, e);
+    }
+
+  std::string type_name = GetTypeName<TImage>(variant);
+  this->WriteEntry(filename, type_name.c_str(), hdr, image->GetBufferPointer());
+}
+
+#endif // GREEDYMAPPEDIMAGECACHE_H
@@ -38,32 +38,73 @@ GreedyParameters
   param.flag_debug_deriv = false;
   param.flag_debug_aff_obj = false;
   param.dump_frequency = 1;
+  param.checkpoint_interval = 10;
   param.epsilon_per_level = 1.0;
   param.sigma_pre.sigma = sqrt(3.0);
   param.sigma_pre.physical_units = false;
   param.sigma_post.sigma = sqrt(0.5);
   param.sigma_post.physical_units = false;
+  param.smoothing_method = GreedyParameters::SMOOTH_ITK;
+  param.smoothing_box_passes = 3;
+  param.smoothing_navier_alpha = 1.0;
   param.threads = 0;
+  param.flag_pin_threads = false;
   param.metric = GreedyParameters::SSD;
   param.time_step_mode = GreedyParameters::SCALE;
   param.deriv_epsilon = 1e-4;
   param.flag_powell = false;
+  param.flag_gauss_newton = false;
   param.warp_exponent = 6;
   param.warp_precision = 0.1;
+  param.warp_quant_bits = 16;
+  param.warp_quant_shrink = 1;
+  param.gzip_level = 0;
+  param.batch_jobs = 0;
+  param.initial_warp_skip_tol = 0.0;
   param.ncc_noise_factor = 0.001;
+  param.flag_ncc_precompute_fixed = false;
+  param.flag_ncc_compensated_sums = false;
+  param.flag_mi_parzen = false;
+  param.half_storage = GreedyParameters::HALF_NONE;
+  param.brute_levels = 1;
+  param.brute_refine_radius = 1;
+  param.flag_brute_subvoxel = false;
+  param.reslice_param.slab_size = 0;
+  param.reslice_param.label_batch_size = 16;
+  param.reslice_param.flag_bricked = false;
+  param.invwarp_param.tolerance = 1e-4;
+  param.invwarp_param.max_iter = 20;
+  param.jacobian_param.flag_direct = false;
   param.affine_init_mode = VOX_IDENTITY;
+  param.flag_affine_residual = false;
   param.affine_dof = GreedyParameters::DOF_AFFINE;
   param.affine_jitter = 0.5;
+  param.affine_sampling_fraction = 1.0;
+  param.flag_affine_sampling_stratified = false;
   param.flag_float_math = false;
+  param.flag_gpu = false;
+  param.flag_dry_run = false;
+  param.memory_budget = 0.0;
+  param.flag_release_inputs = false;
+  param.flag_release_levels = false;
   param.flag_stationary_velocity_mode = false;
+  param.flag_inverse_incremental = false;
   param.flag_incompressibility_mode = false;
+  param.incompressibility_solver = GreedyParameters::INCOMPR_MULTIGRID;
   param.flag_stationary_velocity_mode_use_lie_bracket = false;
+  param.sv_exp_refresh = 0;
+  param.mask_domain_margin = -1;
+  param.crop_to_mask_margin = -1;
   param.background = 0.0;
   param.current_weight = 1.0;
 
   param.iter_per_level.push_back(100);
   param.iter_per_level.push_back(100);
 
+  param.conv_tolerance = 0.0;
+  param.conv_update_norm = 0.0;
+  param.conv_window = 10;
+
   // Moments of inertia parameters
   param.moments_flip_determinant = 0;
   param.flag_moments_id_covariance = false;
@@ -83,6 +124,30 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->flag_float_math = true;
     }
+  else if(cmd == "-gpu")
+    {
+    // The device code works in single precision
+    this->flag_gpu = true;
+    this->flag_float_math = true;
+    }
+  else if(cmd == "-dry-run")
+    {
+    this->flag_dry_run = true;
+    }
+  else if(cmd == "-mem-budget")
+    {
+    this->memory_budget = cl.read_double();
+    if(this->memory_budget < 0)
+      throw GreedyException("Parameter to -mem-budget must be non-negative");
+    }
+  else if(cmd == "-release-inputs")
+    {
+    this->flag_release_inputs = true;
+    }
+  else if(cmd == "-release-levels")
+    {
+    this->flag_release_levels = true;
+    }
   else if(cmd == "-n")
     {
     this->iter_per_level = cl.read_int_vector();
@@ -95,6 +160,20 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->epsilon_per_level = cl.read_double_vector();
     }
+  else if(cmd == "-conv-tol")
+    {
+    this->conv_tolerance = cl.read_double_vector();
+    }
+  else if(cmd == "-conv-update")
+    {
+    this->conv_update_norm = cl.read_double_vector();
+    }
+  else if(cmd == "-conv-window")
+    {
+    this->conv_window = cl.read_integer();
+    if(this->conv_window < 1)
+      throw GreedyException("The -conv-window option requires a positive number of iterations");
+    }
   else if(cmd == "-m")
     {
     std::string metric_name = cl.read_string();
@@ -103,6 +182,11 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
       this->metric = GreedyParameters::NCC;
       this->metric_radius = cl.read_int_vector();
       }
+    else if(metric_name == "NCC_APPROX" || metric_name == "ncc_approx")
+      {
+      this->metric = GreedyParameters::NCC_APPROX;
+      this->metric_radius = cl.read_int_vector();
+      }
     else if(metric_name == "MI" || metric_name == "mi")
       {
       this->metric = GreedyParameters::MI;
@@ -116,6 +200,40 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
       this->metric = GreedyParameters::MAHALANOBIS;
       }
     }
+  else if(cmd == "-smooth-method")
+    {
+    std::string method = cl.read_string();
+    if(method == "ITK" || method == "itk")
+      {
+      this->smoothing_method = GreedyParameters::SMOOTH_ITK;
+      }
+    else if(method == "RECURSIVE" || method == "recursive")
+      {
+      this->smoothing_method = GreedyParameters::SMOOTH_RECURSIVE;
+      }
+    else if(method == "BOX" || method == "box")
+      {
+      this->smoothing_method = GreedyParameters::SMOOTH_BOX;
+      if(cl.command_arg_count() > 0)
+        this->smoothing_box_passes = cl.read_integer();
+      if(this->smoothing_box_passes < 1)
+        throw GreedyException("Number of box passes in -smooth-method must be positive");
+      }
+    else if(method == "FFT" || method == "fft")
+      {
+      this->smoothing_method = GreedyParameters::SMOOTH_FFT;
+      }
+    else if(method == "NAVIER" || method == "navier")
+      {
+      this->smoothing_method = GreedyParameters::SMOOTH_NAVIER;
+      if(cl.command_arg_count() > 0)
+        this->smoothing_navier_alpha = cl.read_double();
+      if(this->smoothing_navier_alpha <= 0.0)
+        throw GreedyException("Navier-Stokes alpha in -smooth-method must be positive");
+      }
+    else
+      throw GreedyException("Unknown smoothing method %s", method.c_str());
+    }
   else if(cmd == "-tscale")
     {
     std::string mode = cl.read_string();
@@ -128,6 +246,28 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->ncc_noise_factor = cl.read_double();
     }
+  else if(cmd == "-ncc-precompute-fixed")
+    {
+    this->flag_ncc_precompute_fixed = true;
+    }
+  else if(cmd == "-ncc-compensated")
+    {
+    this->flag_ncc_compensated_sums = true;
+    }
+  else if(cmd == "-mi-parzen")
+    {
+    this->flag_mi_parzen = true;
+    }
+  else if(cmd == "-half-storage")
+    {
+    std::string mode = cl.read_string();
+    if(mode == "fp16" || mode == "FP16")
+      this->half_storage = GreedyParameters::HALF_FP16;
+    else if(mode == "bf16" || mode == "BF16")
+      this->half_storage = GreedyParameters::HALF_BF16;
+    else
+      throw GreedyException("Unknown half precision storage type %s", mode.c_str());
+    }
   else if(cmd == "-s")
     {
     this->sigma_pre.sigma = cl.read_scalar_with_units(this->sigma_pre.physical_units);
@@ -145,6 +285,12 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->initial_warp = cl.read_existing_filename();
     }
+  else if(cmd == "-id-skip")
+    {
+    this->initial_warp_skip_tol = cl.read_double();
+    if(this->initial_warp_skip_tol < 0)
+      throw GreedyException("Parameter to -id-skip must be non-negative");
+    }
   else if(cmd == "-ia")
     {
     this->affine_init_mode = RAS_FILENAME;
@@ -158,6 +304,10 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->affine_init_mode = IMG_CENTERS;
     }
+  else if(cmd == "-ia-residual")
+    {
+    this->flag_affine_residual = true;
+    }
   else if(cmd == "-dof")
     {
     int dof = cl.read_integer();
@@ -171,6 +321,22 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->affine_jitter = cl.read_double();
     }
+  else if(cmd == "-affine-sample")
+    {
+    this->affine_sampling_fraction = cl.read_double();
+    if(this->affine_sampling_fraction <= 0.0 || this->affine_sampling_fraction > 1.0)
+      throw GreedyException("Sampling fraction in -affine-sample must be in (0, 1]");
+
+    this->flag_affine_sampling_stratified = false;
+    if(cl.command_arg_count() > 0)
+      {
+      std::string mode = cl.read_string();
+      if(mode == "stratified" || mode == "STRATIFIED")
+        this->flag_affine_sampling_stratified = true;
+      else if(mode != "random" && mode != "RANDOM")
+        throw GreedyException("Unknown sampling mode %s in -affine-sample", mode.c_str());
+      }
+    }
   else if(cmd == "-search")
     {
     this->rigid_search.iterations = cl.read_integer();
@@ -195,6 +361,10 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
 
     this->rigid_search.sigma_xyz = cl.read_double();
     }
+  else if(cmd == "-search-threads")
+    {
+    this->rigid_search.threads = cl.read_integer();
+    }
   else if(cmd == "-it")
     {
     int nFiles = cl.command_arg_count();
@@ -229,6 +399,10 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->flag_powell = true;
     }
+  else if(cmd == "-gn")
+    {
+    this->flag_gauss_newton = true;
+    }
   else if(cmd == "-dump-frequency" || cmd == "-dump-freq")
     {
     this->dump_frequency = cl.read_integer();
@@ -249,6 +423,48 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->threads = cl.read_integer();
     }
+  else if(cmd == "-pin-threads")
+    {
+    this->flag_pin_threads = true;
+    }
+  else if(cmd == "-profile")
+    {
+    this->profile_output = cl.read_output_filename();
+    }
+  else if(cmd == "-image-cache")
+    {
+    this->image_cache_dir = cl.read_string();
+    }
+  else if(cmd == "-checkpoint")
+    {
+    this->checkpoint_file = cl.read_output_filename();
+    }
+  else if(cmd == "-checkpoint-interval")
+    {
+    this->checkpoint_interval = cl.read_integer();
+    if(this->checkpoint_interval < 1)
+      throw GreedyException("The -checkpoint-interval option requires a positive number of iterations");
+    }
+  else if(cmd == "-batch")
+    {
+    this->batch_manifest = cl.read_existing_filename();
+    }
+  else if(cmd == "-batch-jobs")
+    {
+    this->batch_jobs = cl.read_integer();
+    if(this->batch_jobs < 0)
+      throw GreedyException("Parameter to -batch-jobs must be non-negative");
+    }
+  else if(cmd == "-timeseries")
+    {
+    this->timeseries_manifest = cl.read_existing_filename();
+    }
+  else if(cmd == "-pgz")
+    {
+    this->gzip_level = cl.read_integer();
+    if(this->gzip_level < 1 || this->gzip_level > 9)
+      throw GreedyException("Parameter to -pgz must be between 1 and 9");
+    }
   else if(cmd == "-a")
     {
     this->mode = GreedyParameters::AFFINE;
@@ -267,6 +483,26 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     this->mode = GreedyParameters::BRUTE;
     this->brute_search_radius = cl.read_int_vector();
     }
+  else if(cmd == "-brute-levels")
+    {
+    this->brute_levels = cl.read_integer();
+    if(this->brute_levels < 1)
+      throw GreedyException("Parameter to -brute-levels must be positive");
+    }
+  else if(cmd == "-brute-refine")
+    {
+    this->brute_refine_radius = cl.read_integer();
+    if(this->brute_refine_radius < 0)
+      throw GreedyException("Parameter to -brute-refine must be non-negative");
+    }
+  else if(cmd == "-brute-subvox")
+    {
+    this->flag_brute_subvoxel = true;
+    }
+  else if(cmd == "-brute-metric")
+    {
+    this->brute_metric_output = cl.read_output_filename();
+    }
   else if(cmd == "-r")
     {
     this->mode = GreedyParameters::RESLICE;
@@ -280,12 +516,29 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     this->invwarp_param.in_warp = cl.read_existing_filename();
     this->invwarp_param.out_warp = cl.read_output_filename();
     }
+  else if(cmd == "-iw-tol")
+    {
+    this->invwarp_param.tolerance = cl.read_double();
+    }
+  else if(cmd == "-iw-iter")
+    {
+    this->invwarp_param.max_iter = cl.read_integer();
+    }
   else if(cmd == "-jac")
     {
     this->mode = GreedyParameters::JACOBIAN_WARP;
     this->jacobian_param.in_warp = cl.read_existing_filename();
     this->jacobian_param.out_det_jac = cl.read_output_filename();
     }
+  else if(cmd == "-jac-direct")
+    {
+    this->jacobian_param.flag_direct = true;
+    }
+  else if(cmd == "-jac-stats")
+    {
+    this->jacobian_param.flag_direct = true;
+    this->jacobian_param.out_stats = cl.read_output_filename();
+    }
   else if(cmd == "-root")
     {
     this->mode = GreedyParameters::ROOT_WARP;
@@ -324,10 +577,26 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->reslice_param.out_jacobian_image = cl.read_output_filename();
     }
+  else if(cmd == "-rt")
+    {
+    this->reslice_param.slab_size = cl.read_integer();
+    }
+  else if(cmd == "-rlb")
+    {
+    this->reslice_param.label_batch_size = cl.read_integer();
+    }
+  else if(cmd == "-rbrick")
+    {
+    this->reslice_param.flag_bricked = true;
+    }
   else if(cmd == "-oinv")
     {
     this->inverse_warp = cl.read_output_filename();
     }
+  else if(cmd == "-oinv-inc")
+    {
+    this->flag_inverse_incremental = true;
+    }
   else if(cmd == "-oroot")
     {
     this->root_warp = cl.read_output_filename();
@@ -350,6 +619,36 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->flag_incompressibility_mode = true;
     }
+  else if(cmd == "-sv-incompr-solver")
+    {
+    std::string solver = cl.read_string();
+    if(solver == "MG" || solver == "mg")
+      this->incompressibility_solver = GreedyParameters::INCOMPR_MULTIGRID;
+    else if(solver == "DIRECT" || solver == "direct")
+      this->incompressibility_solver = GreedyParameters::INCOMPR_DIRECT;
+    else if(solver == "PCG" || solver == "pcg")
+      this->incompressibility_solver = GreedyParameters::INCOMPR_PCG;
+    else
+      throw GreedyException("Unknown incompressibility solver %s", solver.c_str());
+    }
+  else if(cmd == "-sv-incr")
+    {
+    this->sv_exp_refresh = cl.read_integer();
+    if(this->sv_exp_refresh < 0)
+      throw GreedyException("-sv-incr requires a non-negative integer");
+    }
+  else if(cmd == "-mask-domain")
+    {
+    this->mask_domain_margin = (cl.command_arg_count() > 0) ? cl.read_integer() : 0;
+    if(this->mask_domain_margin < 0)
+      throw GreedyException("-mask-domain requires a non-negative margin");
+    }
+  else if(cmd == "-crop-mask")
+    {
+    this->crop_to_mask_margin = (cl.command_arg_count() > 0) ? cl.read_integer() : 8;
+    if(this->crop_to_mask_margin < 0)
+      throw GreedyException("-crop-mask requires a non-negative margin");
+    }
   else if(cmd == "-ri")
     {
     std::string mode = cl.read_string();
@@ -380,6 +679,18 @@ bool GreedyParameters::ParseCommandLine(const std::string &cmd, CommandLineHelpe
     {
     this->warp_precision = cl.read_double();
     }
+  else if(cmd == "-wq")
+    {
+    this->warp_quant_bits = cl.read_integer();
+    if(this->warp_quant_bits != 8 && this->warp_quant_bits != 16)
+      throw GreedyException("Parameter to -wq must be 8 or 16");
+    }
+  else if(cmd == "-wq-shrink")
+    {
+    this->warp_quant_shrink = cl.read_integer();
+    if(this->warp_quant_shrink < 1)
+      throw GreedyException("Parameter to -wq-shrink must be positive");
+    }
   else if(cmd == "-det")
     {
     int det_value = cl.read_integer();
@@ -458,12 +769,36 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->flag_float_math)
     oss << " -float ";
 
+  if(this->flag_gpu)
+    oss << " -gpu";
+
+  if(this->flag_dry_run)
+    oss << " -dry-run";
+
+  if(this->memory_budget != def.memory_budget)
+    oss << " -mem-budget " << this->memory_budget;
+
+  if(this->flag_release_inputs)
+    oss << " -release-inputs";
+
+  if(this->flag_release_levels)
+    oss << " -release-levels";
+
   if(this->iter_per_level != def.iter_per_level)
     oss << " -n " << this->iter_per_level;
 
   if(this->epsilon_per_level != def.epsilon_per_level)
     oss << " -e " << this->epsilon_per_level;
 
+  if(this->conv_tolerance != def.conv_tolerance)
+    oss << " -conv-tol " << this->conv_tolerance;
+
+  if(this->conv_update_norm != def.conv_update_norm)
+    oss << " -conv-update " << this->conv_update_norm;
+
+  if(this->conv_window != def.conv_window)
+    oss << " -conv-window " << this->conv_window;
+
   if(this->metric != def.metric || this->metric_radius != def.metric_radius)
     {
     switch(this->metric)
@@ -474,6 +809,9 @@ std::string GreedyParameters::GenerateCommandLine()
       case GreedyParameters::NCC:
         oss << "-m NCC " << this->metric_radius;
         break;
+      case GreedyParameters::NCC_APPROX:
+        oss << "-m NCC_APPROX " << this->metric_radius;
+        break;
       case GreedyParameters::MI:
         oss << "-m MI";
         break;
@@ -497,6 +835,20 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->ncc_noise_factor != def.ncc_noise_factor)
     oss << " -noise " << this->ncc_noise_factor;
 
+  if(this->flag_ncc_precompute_fixed)
+    oss << " -ncc-precompute-fixed";
+
+  if(this->flag_ncc_compensated_sums)
+    oss << " -ncc-compensated";
+
+  if(this->flag_mi_parzen)
+    oss << " -mi-parzen";
+
+  if(this->half_storage == GreedyParameters::HALF_FP16)
+    oss << " -half-storage fp16";
+  else if(this->half_storage == GreedyParameters::HALF_BF16)
+    oss << " -half-storage bf16";
+
   if(this->sigma_pre != def.sigma_pre || this->sigma_post != def.sigma_post)
     {
     oss << " -s " << this->sigma_pre << this->sigma_post;
@@ -524,12 +876,22 @@ std::string GreedyParameters::GenerateCommandLine()
   else if(this->affine_init_mode == IMG_CENTERS)
     oss << " -ia-image-centers";
 
+  if(this->initial_warp_skip_tol != def.initial_warp_skip_tol)
+    oss << " -id-skip " << this->initial_warp_skip_tol;
+
+  if(this->flag_affine_residual)
+    oss << " -ia-residual";
+
   if(this->affine_dof != def.affine_dof)
     oss << " -dof " << this->affine_dof;
 
   if(this->affine_jitter != def.affine_jitter)
     oss << " -jitter " << this->affine_jitter;
 
+  if(this->affine_sampling_fraction != def.affine_sampling_fraction)
+    oss << " -affine-sample " << this->affine_sampling_fraction
+        << (this->flag_affine_sampling_stratified ? " stratified" : " random");
+
   if(this->rigid_search.iterations > 0)
     {
     oss << " -search ";
@@ -541,6 +903,9 @@ std::string GreedyParameters::GenerateCommandLine()
       oss << this->rigid_search.sigma_angle << " ";
 
     oss << this->rigid_search.sigma_xyz;
+
+    if(this->rigid_search.threads != def.rigid_search.threads)
+      oss << " -search-threads " << this->rigid_search.threads;
     }
 
   if(this->moving_pre_transforms.size())
@@ -575,6 +940,9 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->flag_powell)
     oss << " -powell";
 
+  if(this->flag_gauss_newton)
+    oss << " -gn";
+
   if(this->dump_frequency > 0)
     oss << " -dump-frequency " << this->dump_frequency;
 
@@ -590,6 +958,42 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->threads != def.threads)
     oss << " -threads " << this->threads;
 
+  if(this->flag_pin_threads)
+    oss << " -pin-threads";
+
+  if(this->smoothing_method == GreedyParameters::SMOOTH_RECURSIVE)
+    oss << " -smooth-method RECURSIVE";
+  else if(this->smoothing_method == GreedyParameters::SMOOTH_BOX)
+    oss << " -smooth-method BOX " << this->smoothing_box_passes;
+  else if(this->smoothing_method == GreedyParameters::SMOOTH_FFT)
+    oss << " -smooth-method FFT";
+  else if(this->smoothing_method == GreedyParameters::SMOOTH_NAVIER)
+    oss << " -smooth-method NAVIER " << this->smoothing_navier_alpha;
+
+  if(this->profile_output.size())
+    oss << " -profile " << this->profile_output;
+
+  if(this->image_cache_dir.size())
+    oss << " -image-cache " << this->image_cache_dir;
+
+  if(this->checkpoint_file.size())
+    oss << " -checkpoint " << this->checkpoint_file;
+
+  if(this->checkpoint_interval != def.checkpoint_interval)
+    oss << " -checkpoint-interval " << this->checkpoint_interval;
+
+  if(this->gzip_level != def.gzip_level)
+    oss << " -pgz " << this->gzip_level;
+
+  if(this->batch_manifest.size())
+    oss << " -batch " << this->batch_manifest;
+
+  if(this->batch_jobs != def.batch_jobs)
+    oss << " -batch-jobs " << this->batch_jobs;
+
+  if(this->timeseries_manifest.size())
+    oss << " -timeseries " << this->timeseries_manifest;
+
   if(this->mode == GreedyParameters::AFFINE)
     {
     oss << " -a";
@@ -607,6 +1011,18 @@ std::string GreedyParameters::GenerateCommandLine()
   else if(this->mode == GreedyParameters::BRUTE)
     {
     oss << " -brute " << this->brute_search_radius;
+
+    if(this->brute_levels != def.brute_levels)
+      oss << " -brute-levels " << this->brute_levels;
+
+    if(this->brute_refine_radius != def.brute_refine_radius)
+      oss << " -brute-refine " << this->brute_refine_radius;
+
+    if(this->flag_brute_subvoxel)
+      oss << " -brute-subvox";
+
+    if(this->brute_metric_output.size())
+      oss << " -brute-metric " << this->brute_metric_output;
     }
   else if(this->mode == GreedyParameters::RESLICE)
     {
@@ -619,6 +1035,15 @@ std::string GreedyParameters::GenerateCommandLine()
     if(this->reslice_param.out_jacobian_image.size())
       oss << " -rj " << this->reslice_param.out_jacobian_image;
 
+    if(this->reslice_param.slab_size != def.reslice_param.slab_size)
+      oss << " -rt " << this->reslice_param.slab_size;
+
+    if(this->reslice_param.label_batch_size != def.reslice_param.label_batch_size)
+      oss << " -rlb " << this->reslice_param.label_batch_size;
+
+    if(this->reslice_param.flag_bricked)
+      oss << " -rbrick";
+
     for(const ResliceSpec &rs : this->reslice_param.images)
       {
       switch(rs.interp.mode)
@@ -657,10 +1082,21 @@ std::string GreedyParameters::GenerateCommandLine()
   else if(this->mode == GreedyParameters::INVERT_WARP)
     {
     oss << " -iw " << this->invwarp_param.in_warp << " " << this->invwarp_param.out_warp;
+
+    if(this->invwarp_param.tolerance != def.invwarp_param.tolerance)
+      oss << " -iw-tol " << this->invwarp_param.tolerance;
+
+    if(this->invwarp_param.max_iter != def.invwarp_param.max_iter)
+      oss << " -iw-iter " << this->invwarp_param.max_iter;
     }
   else if(this->mode == GreedyParameters::JACOBIAN_WARP)
     {
     oss << " -jac " << this->jacobian_param.in_warp << " " << this->jacobian_param.out_det_jac;
+
+    if(this->jacobian_param.out_stats.size())
+      oss << " -jac-stats " << this->jacobian_param.out_stats;
+    else if(this->jacobian_param.flag_direct)
+      oss << " -jac-direct";
     }
   else if(this->mode == GreedyParameters::ROOT_WARP)
     {
@@ -674,6 +1110,9 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->inverse_warp.size())
     oss << " -oinv " << this->inverse_warp;
 
+  if(this->flag_inverse_incremental)
+    oss << " -oinv-inc";
+
   if(this->root_warp.size())
     oss << " -oroot " << this->root_warp;
 
@@ -691,9 +1130,29 @@ std::string GreedyParameters::GenerateCommandLine()
   if(this->flag_incompressibility_mode)
     oss << " -sv-incompr";
 
+  if(this->incompressibility_solver == GreedyParameters::INCOMPR_DIRECT)
+    oss << " -sv-incompr-solver DIRECT";
+  else if(this->incompressibility_solver == GreedyParameters::INCOMPR_PCG)
+    oss << " -sv-incompr-solver PCG";
+
+  if(this->sv_exp_refresh != def.sv_exp_refresh)
+    oss << " -sv-incr " << this->sv_exp_refresh;
+
+  if(this->mask_domain_margin != def.mask_domain_margin)
+    oss << " -mask-domain " << this->mask_domain_margin;
+
+  if(this->crop_to_mask_margin != def.crop_to_mask_margin)
+    oss << " -crop-mask " << this->crop_to_mask_margin;
+
   if(this->warp_precision != def.warp_precision)
     oss << " -wp " << this->warp_precision;
 
+  if(this->warp_quant_bits != def.warp_quant_bits)
+    oss << " -wq " << this->warp_quant_bits;
+
+  if(this->warp_quant_shrink != def.warp_quant_shrink)
+    oss << " -wq-shrink " << this->warp_quant_shrink;
+
   if(this->verbosity != def.verbosity)
     oss << " -V " << this->verbosity;
 
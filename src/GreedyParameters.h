@@ -74,8 +74,11 @@ struct RigidSearchSpec
   double sigma_xyz;
   double sigma_angle;
 
+  // Number of threads used to evaluate the candidates (0: ITK default)
+  int threads;
+
   RigidSearchSpec() : mode(RANDOM_NORMAL_ROTATION),
-    iterations(0), sigma_xyz(0.0), sigma_angle(0.0) {}
+    iterations(0), sigma_xyz(0.0), sigma_angle(0.0), threads(0) {}
 };
 
 struct InterpSpec
@@ -148,17 +151,37 @@ struct GreedyResliceParameters
 
   // Output jacobian
   std::string out_jacobian_image;
+
+  // Number of slices per slab when images are resliced in slabs (streaming), 0 = off
+  int slab_size;
+
+  // Number of labels smoothed and warped together in label-wise interpolation
+  int label_batch_size;
+
+  // Store the moving images and warps in bricks when reslicing through a warp
+  bool flag_bricked;
 };
 
 // Parameters for inverse warp command
 struct GreedyInvertWarpParameters
 {
   std::string in_warp, out_warp;
+
+  // Convergence control for the inversion of the small warp (tolerance in voxels)
+  double tolerance;
+  int max_iter;
 };
 
 struct GreedyJacobianParameters
 {
   std::string in_warp, out_det_jac;
+
+  // Compute the determinant directly from the warp, in a single pass and without
+  // forming the Jacobian matrix image, instead of composing the root warp
+  bool flag_direct;
+
+  // Optional text file for the summary statistics of the determinant
+  std::string out_stats;
 };
 
 
@@ -225,12 +248,15 @@ protected:
 
 struct GreedyParameters
 {
-  enum MetricType { SSD = 0, NCC, MI, NMI, MAHALANOBIS };
+  enum MetricType { SSD = 0, NCC, MI, NMI, MAHALANOBIS, NCC_APPROX };
   enum TimeStepMode { CONSTANT=0, SCALE, SCALEDOWN };
   enum Mode { GREEDY=0, AFFINE, BRUTE, RESLICE, INVERT_WARP, ROOT_WARP, JACOBIAN_WARP, MOMENTS, METRIC };
   enum AffineDOF { DOF_RIGID=6, DOF_SIMILARITY=7, DOF_AFFINE=12 };
   enum Verbosity { VERB_NONE=0, VERB_DEFAULT, VERB_VERBOSE, VERB_INVALID };
 
+  // Smoothing filter used in deformable mode (same values as LDDMMData::SmoothingMethod)
+  enum SmoothingMethod { SMOOTH_ITK=0, SMOOTH_RECURSIVE, SMOOTH_BOX, SMOOTH_FFT, SMOOTH_NAVIER };
+
   std::vector<ImagePairSpec> inputs;
   std::string output;
   unsigned int dim;
@@ -256,16 +282,34 @@ struct GreedyParameters
   Mode mode;
 
   bool flag_dump_moving, flag_debug_deriv, flag_powell;
+
+  // Use the Gauss-Newton / Levenberg-Marquardt affine optimizer
+  bool flag_gauss_newton;
   int dump_frequency, threads;
   double deriv_epsilon;
 
+  // Pin the threads of the parallel loop pool to cores
+  bool flag_pin_threads;
+
   double affine_jitter;
 
+  // Fraction of voxels used to compute the affine metric, and whether this
+  // sample is stratified (evenly spread over the mask) or purely random
+  double affine_sampling_fraction;
+  bool flag_affine_sampling_stratified;
+
   double background;
 
   // Smoothing parameters
   SmoothingParameters sigma_pre, sigma_post;
 
+  // Smoothing filter and number of passes for the box approximation. With
+  // SMOOTH_NAVIER, the gradient is regularized with the Green's function of a
+  // Navier-Stokes operator with given alpha (in voxel units) instead of sigma_pre
+  SmoothingMethod smoothing_method;
+  int smoothing_box_passes;
+  double smoothing_navier_alpha;
+
   MetricType metric;
   TimeStepMode time_step_mode;
 
@@ -274,10 +318,24 @@ struct GreedyParameters
   
   std::vector<int> iter_per_level;
 
+  // Early termination of a level of deformable registration. The level stops when
+  // the metric has changed by less than conv_tolerance (relative) over the last
+  // conv_window iterations and the largest update is below conv_update_norm voxels.
+  // A zero value disables that test; with both disabled, all iterations are run
+  PerLevelSpec<double> conv_tolerance, conv_update_norm;
+  int conv_window;
+
   std::vector<int> metric_radius;
 
   std::vector<int> brute_search_radius;
 
+  // Coarse-to-fine brute force search: number of levels, local search radius at the
+  // finer levels, sub-voxel refinement and optional output of the best metric
+  int brute_levels;
+  int brute_refine_radius;
+  bool flag_brute_subvoxel;
+  std::string brute_metric_output;
+
   // List of transforms to apply to the moving image before registration
   std::vector<TransformSpec> moving_pre_transforms;
 
@@ -286,9 +344,18 @@ struct GreedyParameters
   AffineDOF affine_dof;
   TransformSpec affine_init_transform;
 
+  // In deformable mode, keep the initial affine out of the deformation field. The
+  // affine is composed with the field inside the metric, the field only holds the
+  // residual deformation, and the output warp is to be applied with the affine
+  bool flag_affine_residual;
+
   // Filename of initial warp
   std::string initial_warp;
 
+  // With an initial warp, the coarse levels at which the initial warp is already
+  // converged (largest update below this many voxels) are skipped. 0: disabled
+  double initial_warp_skip_tol;
+
   // Mask for gradient computation (fixed mask)
   std::string gradient_mask;
 
@@ -305,12 +372,33 @@ struct GreedyParameters
   std::string inverse_warp, root_warp;
   int warp_exponent;
 
+  // Maintain the inverse warp during the greedy iterations instead of inverting
+  // the final warp after registration
+  bool flag_inverse_incremental;
+
   // Precision for output warps
   double warp_precision;
 
+  // Bits per component and grid shrink factor for warps saved in the
+  // quantized .qwarp format
+  int warp_quant_bits, warp_quant_shrink;
+
   // Noise for NCC
   double ncc_noise_factor;
 
+  // Precompute the fixed image neighborhood sums for NCC once per level
+  bool flag_ncc_precompute_fixed;
+
+  // Use compensated summation in the NCC neighborhood sums
+  bool flag_ncc_compensated_sums;
+
+  // Use B-spline Parzen windowing for the MI/NMI joint histogram
+  bool flag_mi_parzen;
+
+  // Storage of the images read by the SSD metric in deformable mode
+  enum HalfPrecisionStorage { HALF_NONE = 0, HALF_FP16, HALF_BF16 };
+  HalfPrecisionStorage half_storage;
+
   // Debugging matrices
   bool flag_debug_aff_obj;
 
@@ -331,9 +419,63 @@ struct GreedyParameters
   // Incompressibility mode (Mansi 2011 iLogDemons)
   bool flag_incompressibility_mode;
 
+  // Solver for the incompressibility PDE: matrix-free multigrid, or the direct or
+  // conjugate gradient sparse matrix solvers (require GREEDY_USE_SPARSE_SOLVERS)
+  enum IncompressibilitySolver { INCOMPR_MULTIGRID = 0, INCOMPR_DIRECT, INCOMPR_PCG };
+  IncompressibilitySolver incompressibility_solver;
+
+  // In stationary velocity mode, update exp(v) incrementally between iterations
+  // and only recompute it in full every N iterations (0: always recompute)
+  int sv_exp_refresh;
+
+  // Restrict the deformable iterations to the bounding box of the gradient mask,
+  // padded by this many voxels in addition to the smoothing/metric support (-1: off)
+  int mask_domain_margin;
+
+  // Crop the reference space to the bounding box of the mask, padded by this many
+  // voxels (-1: off)
+  int crop_to_mask_margin;
+
   // Floating point precision?
   bool flag_float_math;
 
+  // Run the deformable iterations on a CUDA device, where supported
+  bool flag_gpu;
+
+  // Only estimate the memory of the registration, and report it without running
+  bool flag_dry_run;
+
+  // Memory budget in megabytes (0: none). The memory saving options below, and
+  // single precision math, are turned on as needed to fit the estimate into it
+  double memory_budget;
+
+  // Drop the input images once the pyramids are built, and free the images of
+  // each level of deformable registration once the level is done
+  bool flag_release_inputs, flag_release_levels;
+
+  // JSON file to which the per-level timing profile is written
+  std::string profile_output;
+
+  // Directory for the on-disk cache of decompressed, memory-mapped input images
+  std::string image_cache_dir;
+
+  // Checkpoint file for deformable registration, written every checkpoint_interval
+  // iterations. A run that finds a matching checkpoint resumes from it
+  std::string checkpoint_file;
+  int checkpoint_interval;
+
+  // Compression level for multi-threaded gzip of .nii.gz outputs (0: use ITK)
+  int gzip_level;
+
+  // Manifest of moving/output (or fixed/moving/output) lines registered in one
+  // process, and the number of registrations run at a time (0: automatic)
+  std::string batch_manifest;
+  int batch_jobs;
+
+  // Manifest of the frames of a time series, registered in order to the same fixed
+  // image, each frame starting from the warp of the previous frame
+  std::string timeseries_manifest;
+
   // Weight applied to new image pairs
   double current_weight;
 
@@ -0,0 +1,239 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "GreedyWorkspace.h"
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+// Blocks at least this large are aligned to the huge page size
+static const size_t GREEDY_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+GreedyWorkspace::GreedyWorkspace()
+{
+  m_NumberOfAllocations = 0;
+}
+
+GreedyWorkspace::~GreedyWorkspace()
+{
+  this->Clear();
+}
+
+void
+GreedyWorkspace
+::AllocateBlock(Block &block, size_t bytes)
+{
+  this->FreeBlock(block);
+
+  // Round the size up to the alignment
+  size_t align = bytes >= GREEDY_HUGE_PAGE_SIZE ? GREEDY_HUGE_PAGE_SIZE : 64;
+  size_t size = ((bytes + align - 1) / align) * align;
+
+#ifdef WIN32
+  void *ptr = _aligned_malloc(size, align);
+#else
+  void *ptr = NULL;
+  if(posix_memalign(&ptr, align, size) != 0)
+    ptr = NULL;
+#endif
+
+  if(!ptr)
+    throw std::bad_alloc();
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if(align == GREEDY_HUGE_PAGE_SIZE)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+  block.ptr = ptr;
+  block.size = size;
+  m_NumberOfAllocations++;
+}
+
+void
+GreedyWorkspace
+::FreeBlock(Block &block)
+{
+  if(block.ptr)
+    FreeMemory(block.ptr);
+  block.ptr = NULL;
+  block.size = 0;
+}
+
+int
+GreedyWorkspace
+::FindFreeBlock(size_t bytes, const std::vector<bool> *skip) const
+{
+  int best = -1;
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    {
+    const Block &b = m_Blocks[i];
+    if(!b.in_use && b.size >= bytes && (!skip || !(*skip)[i]))
+      if(best < 0 || b.size < m_Blocks[best].size)
+        best = i;
+    }
+  return best;
+}
+
+void *
+GreedyWorkspace
+::Acquire(size_t bytes)
+{
+  // Use the smallest free block that fits
+  int ib = this->FindFreeBlock(bytes);
+
+  // Otherwise grow the largest free block, or add a new one
+  if(ib < 0)
+    {
+    for(unsigned int i = 0; i < m_Blocks.size(); i++)
+      if(!m_Blocks[i].in_use && (ib < 0 || m_Blocks[i].size > m_Blocks[ib].size))
+        ib = i;
+
+    if(ib < 0)
+      {
+      Block b = { NULL, 0, false };
+      m_Blocks.push_back(b);
+      ib = m_Blocks.size() - 1;
+      }
+
+    this->AllocateBlock(m_Blocks[ib], bytes);
+    }
+
+  m_Blocks[ib].in_use = true;
+  return m_Blocks[ib].ptr;
+}
+
+void
+GreedyWorkspace
+::Release(void *ptr)
+{
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    if(m_Blocks[i].ptr == ptr)
+      m_Blocks[i].in_use = false;
+}
+
+bool
+GreedyWorkspace
+::Detach(void *ptr)
+{
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    {
+    if(m_Blocks[i].ptr == ptr)
+      {
+      m_Blocks.erase(m_Blocks.begin() + i);
+      return true;
+      }
+    }
+  return false;
+}
+
+void
+GreedyWorkspace
+::FreeMemory(void *ptr)
+{
+#ifdef WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+void
+GreedyWorkspace
+::ReleaseAll()
+{
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    m_Blocks[i].in_use = false;
+}
+
+void
+GreedyWorkspace
+::Reserve(const std::vector<size_t> &sizes)
+{
+  // Match the largest requests first
+  std::vector<size_t> sorted = sizes;
+  std::sort(sorted.begin(), sorted.end(), std::greater<size_t>());
+
+  // Blocks that have been matched to a request
+  std::vector<bool> matched(m_Blocks.size(), false);
+  std::vector<size_t> unmatched;
+  for(unsigned int j = 0; j < sorted.size(); j++)
+    {
+    int ib = this->FindFreeBlock(sorted[j], &matched);
+    if(ib >= 0)
+      matched[ib] = true;
+    else
+      unmatched.push_back(sorted[j]);
+    }
+
+  // Grow the unmatched free blocks, or add new ones, for the remaining requests
+  for(unsigned int j = 0; j < unmatched.size(); j++)
+    {
+    int ib = -1;
+    for(unsigned int i = 0; i < m_Blocks.size(); i++)
+      if(!m_Blocks[i].in_use && !matched[i])
+        { ib = i; break; }
+
+    if(ib < 0)
+      {
+      Block b = { NULL, 0, false };
+      m_Blocks.push_back(b);
+      matched.push_back(false);
+      ib = m_Blocks.size() - 1;
+      }
+
+    this->AllocateBlock(m_Blocks[ib], unmatched[j]);
+    matched[ib] = true;
+    }
+}
+
+void
+GreedyWorkspace
+::Clear()
+{
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    this->FreeBlock(m_Blocks[i]);
+  m_Blocks.clear();
+}
+
+size_t
+GreedyWorkspace
+::GetTotalBytes() const
+{
+  size_t total = 0;
+  for(unsigned int i = 0; i < m_Blocks.size(); i++)
+    total += m_Blocks[i].size;
+  return total;
+}
@@ -0,0 +1,231 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef GREEDYWORKSPACE_H
+#define GREEDYWORKSPACE_H
+
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include "itkImage.h"
+#include "itkVectorImage.h"
+
+/**
+ * Number of pixel container elements per pixel. For itk::Image this is one,
+ * since the element is the whole pixel; for itk::VectorImage the element is a
+ * single component.
+ */
+template <class TImage>
+struct GreedyWorkspaceElementsPerPixel
+{
+  static size_t Get(const TImage *) { return 1; }
+};
+
+template <class TPixel, unsigned int VDim>
+struct GreedyWorkspaceElementsPerPixel< itk::VectorImage<TPixel, VDim> >
+{
+  static size_t Get(const itk::VectorImage<TPixel, VDim> *img)
+    { return img->GetNumberOfComponentsPerPixel(); }
+};
+
+/**
+ * A pool of memory blocks used to back the intermediate images of deformable
+ * registration. Blocks are retained when released, so that successive pyramid
+ * levels, and successive calls to GreedyApproach, reuse the same memory instead
+ * of going back to the heap. Large blocks are aligned to 2MB so that the kernel
+ * can back them with huge pages.
+ *
+ * The workspace may be owned by the caller and shared between GreedyApproach
+ * objects (see GreedyApproach::SetWorkspace), but it must only be used by one
+ * registration at a time.
+ */
+class GreedyWorkspace
+{
+public:
+
+  GreedyWorkspace();
+  ~GreedyWorkspace();
+
+  /** Get a block of at least the given number of bytes */
+  void *Acquire(size_t bytes);
+
+  /** Return a block previously obtained with Acquire to the pool */
+  void Release(void *ptr);
+
+  /** Return all blocks to the pool. Images using the blocks must no longer be used */
+  void ReleaseAll();
+
+  /**
+   * Make sure that the pool contains free blocks that can satisfy all of the
+   * requested sizes at once, so that later calls to Acquire do not allocate
+   */
+  void Reserve(const std::vector<size_t> &sizes);
+
+  /** Free all memory held by the pool */
+  void Clear();
+
+  /** Total number of bytes held by the pool */
+  size_t GetTotalBytes() const;
+
+  /** Number of times memory was requested from the system */
+  unsigned long GetNumberOfAllocations() const { return m_NumberOfAllocations; }
+
+  /**
+   * Allocate an image with the same geometry as the reference image, using a
+   * block from the pool as its buffer. The image is filled with zeros. The
+   * block must be returned with ReleaseImage when the image is no longer needed.
+   * For an itk::VectorImage, the number of components must be set on img first.
+   */
+  template <class TImage>
+  void AllocateImage(TImage *img, itk::ImageBase<TImage::ImageDimension> *ref)
+  {
+    typedef typename TImage::PixelContainer PixelContainer;
+    typedef typename PixelContainer::Element Element;
+
+    img->SetRegions(ref->GetBufferedRegion());
+    img->CopyInformation(ref);
+
+    size_t n = ref->GetBufferedRegion().GetNumberOfPixels()
+        * GreedyWorkspaceElementsPerPixel<TImage>::Get(img);
+    Element *data = static_cast<Element *>(this->Acquire(n * sizeof(Element)));
+
+    typename PixelContainer::Pointer pc = PixelContainer::New();
+    pc->SetImportPointer(data, n, false);
+    img->SetPixelContainer(pc);
+
+    // All pixel types used with the workspace are made up of floating point values
+    memset(data, 0, n * sizeof(Element));
+  }
+
+  /** Return the buffer of an image allocated with AllocateImage to the pool */
+  template <class TImage>
+  void ReleaseImage(TImage *img)
+  {
+    this->Release(img->GetBufferPointer());
+  }
+
+  /**
+   * Take the buffer of an image allocated with AllocateImage out of the pool, so
+   * that the image remains valid after ReleaseAll and after the workspace is
+   * destroyed. The buffer is freed along with the image's pixel container. Images
+   * not allocated from this workspace are left alone.
+   */
+  template <class TImage>
+  void DetachImage(TImage *img);
+
+  /** Remove the block at ptr from the pool without freeing it, false if not found */
+  bool Detach(void *ptr);
+
+  /** Free the memory of a block, used for blocks removed from the pool with Detach */
+  static void FreeMemory(void *ptr);
+
+  /**
+   * Number of bytes that AllocateImage will request for a given reference space.
+   * For an itk::VectorImage, pass the number of components per pixel.
+   */
+  template <class TImage>
+  static size_t GetImageBytes(itk::ImageBase<TImage::ImageDimension> *ref, size_t n_comp = 1)
+  {
+    return ref->GetBufferedRegion().GetNumberOfPixels() * n_comp
+        * sizeof(typename TImage::PixelContainer::Element);
+  }
+
+protected:
+
+  struct Block
+  {
+    void *ptr;
+    size_t size;
+    bool in_use;
+  };
+
+  std::vector<Block> m_Blocks;
+  unsigned long m_NumberOfAllocations;
+
+  // Find the smallest free block that fits the request, or -1
+  int FindFreeBlock(size_t bytes, const std::vector<bool> *skip = NULL) const;
+
+  // Allocate memory for a block, replacing its current memory
+  void AllocateBlock(Block &block, size_t bytes);
+  void FreeBlock(Block &block);
+
+private:
+
+  // Not copyable
+  GreedyWorkspace(const GreedyWorkspace &);
+  GreedyWorkspace &operator = (const GreedyWorkspace &);
+};
+
+/**
+ * Pixel container over a block detached from a GreedyWorkspace. The block is
+ * freed when the container is destroyed.
+ */
+template <typename TElementIdentifier, typename TElement>
+class GreedyDetachedPixelContainer : public itk::ImportImageContainer<TElementIdentifier, TElement>
+{
+public:
+  typedef GreedyDetachedPixelContainer Self;
+  typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+
+  itkNewMacro(Self)
+  itkTypeMacro(GreedyDetachedPixelContainer, ImportImageContainer)
+
+  void SetBlock(void *block) { m_Block = block; }
+
+protected:
+  GreedyDetachedPixelContainer() : m_Block(NULL) {}
+
+  ~GreedyDetachedPixelContainer()
+  {
+    // The imported buffer is not managed by the superclass
+    if(m_Block)
+      GreedyWorkspace::FreeMemory(m_Block);
+  }
+
+  void *m_Block;
+};
+
+template <class TImage>
+void
+GreedyWorkspace
+::DetachImage(TImage *img)
+{
+  typedef typename TImage::PixelContainer PixelContainer;
+  typedef typename PixelContainer::Element Element;
+  typedef GreedyDetachedPixelContainer<typename PixelContainer::ElementIdentifier, Element> DetachedContainer;
+
+  Element *data = img->GetBufferPointer();
+  if(!this->Detach(data))
+    return;
+
+  typename DetachedContainer::Pointer pc = DetachedContainer::New();
+  pc->SetImportPointer(data, img->GetPixelContainer()->Size(), false);
+  pc->SetBlock(data);
+  img->SetPixelContainer(pc);
+}
+
+#endif // GREEDYWORKSPACE_H
@@ -0,0 +1,282 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef BRICKEDIMAGE_H
+#define BRICKEDIMAGE_H
+
+#include "itkImageBase.h"
+#include "itkVariableLengthVector.h"
+#include "itkNumericTraits.h"
+#include "FastLinearInterpolator.h"
+#include <vector>
+#include <algorithm>
+
+/**
+ * \class BrickedImage
+ * \brief Read-only image whose voxels are stored in cubic bricks
+ *
+ * The voxels are grouped into bricks of 2^VLog2BrickSize voxels on a side, and
+ * each brick is stored contiguously, with the voxels in raster order inside the
+ * brick and the bricks in raster order in the buffer. Trilinear sampling along a
+ * deforming field then touches one or two bricks instead of four to eight
+ * distant rows of a raster image, which keeps the moving image reads in cache.
+ *
+ * Each brick also stores one extra layer of voxels on its upper face in every
+ * dimension, copied from the neighboring brick (clamped at the image edge). The
+ * 2^VDim corners of any interpolation cell are therefore in the same brick, at
+ * constant strides from each other, exactly as in a raster image. The price is
+ * ((B+1)/B)^VDim more memory, i.e., 42% for the default 8x8x8 bricks.
+ *
+ * Because of the duplicated voxels, the image is meant to be written only through
+ * Import(), from a raster itk::Image or itk::VectorImage, and read through the
+ * fast interpolators (FastLinearInterpolator.h) and FastWarpCompositeImageFilter.
+ * Export() converts back to a raster image. As for itk::Image vs. itk::VectorImage,
+ * TComponent can be a scalar with several components per voxel (composite images)
+ * or a vector such as itk::CovariantVector with one component (displacements).
+ */
+template <class TComponent, unsigned int VDim, unsigned int VLog2BrickSize = 3>
+class BrickedImage : public itk::ImageBase<VDim>
+{
+public:
+  typedef BrickedImage<TComponent, VDim, VLog2BrickSize>      Self;
+  typedef itk::ImageBase<VDim>                                Superclass;
+  typedef itk::SmartPointer<Self>                             Pointer;
+  typedef itk::SmartPointer<const Self>                       ConstPointer;
+
+  itkNewMacro(Self)
+
+  itkTypeMacro(BrickedImage, ImageBase)
+
+  itkStaticConstMacro(ImageDimension, unsigned int, VDim);
+
+  typedef TComponent                                          InternalPixelType;
+  typedef itk::VariableLengthVector<TComponent>               PixelType;
+  typedef typename Superclass::IndexType                      IndexType;
+  typedef typename Superclass::IndexValueType                 IndexValueType;
+  typedef typename Superclass::SizeType                       SizeType;
+  typedef typename Superclass::RegionType                     RegionType;
+  typedef typename Superclass::SpacingType                    SpacingType;
+  typedef typename Superclass::DirectionType                  DirectionType;
+  typedef typename Superclass::PointType                      PointType;
+
+  /** Voxels per brick on a side, and stored voxels per brick on a side */
+  enum { BrickSize = 1 << VLog2BrickSize, BrickStorageSize = BrickSize + 1 };
+
+  virtual unsigned int GetNumberOfComponentsPerPixel() const ITK_OVERRIDE
+    { return m_NumberOfComponents; }
+
+  virtual void SetNumberOfComponentsPerPixel(unsigned int n) ITK_OVERRIDE
+    { m_NumberOfComponents = n; }
+
+  /**
+   * Allocate the bricks for the buffered region, which must start at index zero
+   * like the images read by the fast interpolators
+   */
+  void Allocate()
+  {
+    const SizeType &size = this->GetBufferedRegion().GetSize();
+    long n_bricks = 1, brick_len = m_NumberOfComponents;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      m_Stride[d] = brick_len;
+      brick_len *= BrickStorageSize;
+      }
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      m_Size[d] = size[d];
+      m_NumberOfBricks[d] = (size[d] + BrickSize - 1) >> VLog2BrickSize;
+      m_BrickStride[d] = n_bricks * brick_len;
+      n_bricks *= m_NumberOfBricks[d];
+      }
+    m_BrickLength = brick_len;
+    m_Buffer.assign(n_bricks * brick_len, itk::NumericTraits<TComponent>::ZeroValue());
+  }
+
+  virtual void Initialize() ITK_OVERRIDE
+  {
+    Superclass::Initialize();
+    std::vector<TComponent>().swap(m_Buffer);
+  }
+
+  /** Copy the geometry and the voxels of a raster image, allocating the bricks */
+  template <class TImage>
+  void Import(const TImage *image)
+  {
+    // The number of TComponent values per voxel: nc for an itk::VectorImage with scalar
+    // components, one for an itk::Image whose pixel type is TComponent
+    typedef typename TImage::InternalPixelType ImageComponentType;
+    int inc = FastWarpCompositeImageFilterInputImageTraits<TImage>::GetPointerIncrementSize(image);
+
+    this->CopyInformation(image);
+    this->SetRegions(image->GetBufferedRegion());
+    this->SetNumberOfComponentsPerPixel(inc * sizeof(ImageComponentType) / sizeof(TComponent));
+    this->Allocate();
+
+    const TComponent *src = reinterpret_cast<const TComponent *>(image->GetBufferPointer());
+    long raster_stride[VDim];
+    this->ComputeRasterStrides(raster_stride);
+
+    // Visit the stored voxels in buffer order, so the writes are sequential and the
+    // reads of each brick row are contiguous in the raster image
+    TComponent *trg = &m_Buffer[0];
+    int brick[VDim], local[VDim];
+    std::fill(brick, brick + VDim, 0);
+    long n_bricks = m_Buffer.size() / m_BrickLength;
+    for(long ib = 0; ib < n_bricks; ib++)
+      {
+      std::fill(local, local + VDim, 0);
+      long n_local = m_BrickLength / m_NumberOfComponents;
+      for(long il = 0; il < n_local; il++)
+        {
+        long offset = 0;
+        for(unsigned int d = 0; d < VDim; d++)
+          offset += raster_stride[d] * std::min((brick[d] << VLog2BrickSize) + local[d], m_Size[d] - 1);
+
+        for(unsigned int k = 0; k < m_NumberOfComponents; k++)
+          *trg++ = src[offset + k];
+
+        Increment(local, BrickStorageSize);
+        }
+      Increment(brick, m_NumberOfBricks);
+      }
+  }
+
+  /** Copy the voxels into a raster image with the same geometry */
+  template <class TImage>
+  void Export(TImage *image) const
+  {
+    TComponent *trg = reinterpret_cast<TComponent *>(image->GetBufferPointer());
+    int idx[VDim];
+    std::fill(idx, idx + VDim, 0);
+    long n_vox = this->GetBufferedRegion().GetNumberOfPixels();
+    for(long i = 0; i < n_vox; i++)
+      {
+      const TComponent *src = &m_Buffer[this->ComputeOffset(idx)];
+      for(unsigned int k = 0; k < m_NumberOfComponents; k++)
+        *trg++ = src[k];
+      Increment(idx, m_Size);
+      }
+  }
+
+  const TComponent *GetBufferPointer() const { return m_Buffer.empty() ? NULL : &m_Buffer[0]; }
+  TComponent *GetBufferPointer() { return m_Buffer.empty() ? NULL : &m_Buffer[0]; }
+
+  /**
+   * Offset of the first component of voxel idx from the buffer pointer. The voxel
+   * at idx + e_d is found at offset + GetStride(d) for any idx[d] < size[d] - 1
+   */
+  inline long ComputeOffset(const int *idx) const
+  {
+    long offset = 0;
+    for(unsigned int d = 0; d < VDim; d++)
+      offset += (idx[d] >> VLog2BrickSize) * m_BrickStride[d]
+                + (idx[d] & (BrickSize - 1)) * m_Stride[d];
+    return offset;
+  }
+
+  /** Stride between neighboring voxels inside a brick, in components */
+  long GetStride(unsigned int d) const { return m_Stride[d]; }
+
+protected:
+  BrickedImage() : m_NumberOfComponents(1), m_BrickLength(0)
+  {
+    std::fill(m_Size, m_Size + VDim, 0);
+    std::fill(m_NumberOfBricks, m_NumberOfBricks + VDim, 0);
+    std::fill(m_Stride, m_Stride + VDim, 0);
+    std::fill(m_BrickStride, m_BrickStride + VDim, 0);
+  }
+
+  ~BrickedImage() {}
+
+  void ComputeRasterStrides(long *stride) const
+  {
+    long s = m_NumberOfComponents;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      stride[d] = s;
+      s *= m_Size[d];
+      }
+  }
+
+  // Advance a VDim counter with extent n (an int or an array of ints)
+  static void Increment(int *idx, int n)
+  {
+    for(unsigned int d = 0; d < VDim && ++idx[d] == n; d++)
+      idx[d] = 0;
+  }
+
+  static void Increment(int *idx, const int *n)
+  {
+    for(unsigned int d = 0; d < VDim && ++idx[d] == n[d]; d++)
+      idx[d] = 0;
+  }
+
+  std::vector<TComponent> m_Buffer;
+  unsigned int m_NumberOfComponents;
+  int m_Size[VDim], m_NumberOfBricks[VDim];
+  long m_Stride[VDim], m_BrickStride[VDim], m_BrickLength;
+
+private:
+  BrickedImage(const Self &); //purposely not implemented
+  void operator=(const Self &); //purposely not implemented
+};
+
+
+template <class TComponent, unsigned int VDim, unsigned int VLog2BrickSize>
+struct FastWarpCompositeImageFilterInputImageTraits< BrickedImage<TComponent, VDim, VLog2BrickSize> >
+{
+  static int GetPointerIncrementSize(const BrickedImage<TComponent, VDim, VLog2BrickSize> *image)
+  {
+    return image->GetNumberOfComponentsPerPixel();
+  }
+};
+
+/**
+ * Brick addressing for the fast interpolators. The strides between the corners of
+ * an interpolation cell are the strides inside a brick
+ */
+template <class TComponent, unsigned int VDim, unsigned int VLog2BrickSize>
+struct FastLinearInterpolatorAddressing< BrickedImage<TComponent, VDim, VLog2BrickSize> >
+{
+  typedef BrickedImage<TComponent, VDim, VLog2BrickSize> ImageType;
+
+  FastLinearInterpolatorAddressing(const ImageType *image, int) : image(image)
+  {
+    for(unsigned int d = 0; d < VDim; d++)
+      stride[d] = image->GetStride(d);
+  }
+
+  long GetStride(unsigned int d) const { return stride[d]; }
+
+  long Offset(int X, int Y) const { int idx[] = { X, Y }; return image->ComputeOffset(idx); }
+
+  long Offset(int X, int Y, int Z) const { int idx[] = { X, Y, Z }; return image->ComputeOffset(idx); }
+
+  const ImageType *image;
+  long stride[VDim];
+};
+
+#endif // BRICKEDIMAGE_H
@@ -0,0 +1,165 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef BRUTEFORCENCCSEARCHIMAGEFILTER_H
+#define BRUTEFORCENCCSEARCHIMAGEFILTER_H
+
+#include "lddmm_common.h"
+#include "itkImageToImageFilter.h"
+#include <vnl/vnl_vector.h>
+#include <vector>
+
+/**
+ * Brute force search for the best matching displacement at every voxel of the
+ * fixed image, using the NCC metric over a neighborhood of given radius.
+ *
+ * All integer offsets within the search radius are tested. Because a constant
+ * integer displacement is just a shifted read of the moving image, no
+ * interpolation is performed. Each thread handles its own piece of the output
+ * region for all offsets: it computes the neighborhood sums for the piece (plus a
+ * margin equal to the metric radius), evaluates the NCC and keeps track of the
+ * best offset at each voxel directly, so that no full metric image is ever formed.
+ *
+ * The metric uses the same weighting as MultiComponentNCCImageMetric. The moving
+ * image is indexed with the voxel indices of the fixed image, as is done with the
+ * voxel-space deformation fields elsewhere in greedy.
+ *
+ * Optionally, an initial displacement field (voxel units) can be supplied. It is
+ * rounded to the nearest voxel, and the search is then performed around it: the
+ * whole window of a voxel is compared with the moving image shifted by the rounded
+ * displacement of that voxel plus the offset. Voxels are grouped by their rounded
+ * displacement, and each group is searched with the box sums over its bounding box.
+ * This is used for local refinement in coarse-to-fine search. With a zero search
+ * radius, the filter simply evaluates the metric for the (rounded) initial
+ * displacement.
+ *
+ * Outputs are the best metric value (primary output) and the best displacement,
+ * in voxel units. Voxels excluded by the fixed mask receive zero metric and the
+ * rounded initial displacement (or zero).
+ */
+template <class TInputImage, class TMetricImage, class TDeformationField>
+class BruteForceNCCSearchImageFilter
+    : public itk::ImageToImageFilter<TInputImage, TMetricImage>
+{
+public:
+  typedef BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField> Self;
+  typedef itk::ImageToImageFilter<TInputImage, TMetricImage>       Superclass;
+  typedef itk::SmartPointer<Self>                                  Pointer;
+  typedef itk::SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( BruteForceNCCSearchImageFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension );
+
+  typedef TInputImage                                 InputImageType;
+  typedef TMetricImage                                MetricImageType;
+  typedef TDeformationField                           DeformationFieldType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+  typedef typename InputImageType::InternalPixelType  InputComponentType;
+  typedef typename InputImageType::IndexType          IndexType;
+  typedef typename InputImageType::SizeType           SizeType;
+  typedef typename InputImageType::RegionType         RegionType;
+  typedef typename MetricImageType::PixelType         MetricPixelType;
+  typedef typename DeformationFieldType::PixelType    DeformationVectorType;
+  typedef vnl_vector<float>                           WeightVectorType;
+
+  typedef typename itk::ProcessObject::DataObjectIdentifierType DataObjectIdentifierType;
+
+  /** Set the fixed image */
+  itkNamedInputMacro(FixedImage, InputImageType, "Primary")
+
+  /** Set the moving image */
+  itkNamedInputMacro(MovingImage, InputImageType, "moving")
+
+  /** Set the optional fixed mask; the search is only done where the mask exceeds 0.5 */
+  itkNamedInputMacro(FixedMaskImage, MetricImageType, "fixed_mask")
+
+  /** Set the optional initial displacement, around which the search is centered */
+  itkNamedInputMacro(InitialDisplacement, DeformationFieldType, "initial")
+
+  /** Set the radius of the NCC neighborhood */
+  itkSetMacro(Radius, SizeType)
+  itkGetMacro(Radius, SizeType)
+
+  /** Set the radius of the search neighborhood */
+  itkSetMacro(SearchRadius, SizeType)
+  itkGetMacro(SearchRadius, SizeType)
+
+  /** Set the weight vector - for different components in the input image */
+  itkSetMacro(Weights, WeightVectorType)
+  itkGetConstMacro(Weights, WeightVectorType)
+
+  /** Get the best metric value at each voxel - this is the main output */
+  itkNamedOutputMacro(MetricOutput, MetricImageType, "Primary")
+
+  /** Get the best displacement at each voxel, in voxel units */
+  itkNamedOutputMacro(DisplacementOutput, DeformationFieldType, "displacement")
+
+protected:
+
+  BruteForceNCCSearchImageFilter();
+  ~BruteForceNCCSearchImageFilter() {}
+
+  virtual typename itk::DataObject::Pointer MakeOutput(const DataObjectIdentifierType &) ITK_OVERRIDE;
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  // Compute the box sums of the working buffer along each dimension
+  void ComputeBoxSums(InputComponentType *buffer, const SizeType &size, int n_sums);
+
+  // Search the voxels of region for the best offset, reading the moving image
+  // with the given shift plus each offset. With an initial displacement, only the
+  // voxels whose rounded displacement equals the shift are updated
+  void SearchWithShift(const RegionType &region, const int *shift,
+                       std::vector<InputComponentType> &buffer);
+
+  // Round the initial displacement to the nearest voxel
+  static void RoundDisplacement(const DeformationVectorType *u, int *out);
+
+  SizeType m_Radius, m_SearchRadius;
+
+  WeightVectorType m_Weights;
+
+private:
+  BruteForceNCCSearchImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "BruteForceNCCSearchImageFilter.txx"
+#endif
+
+#endif // BRUTEFORCENCCSEARCHIMAGEFILTER_H
@@ -0,0 +1,357 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef BRUTEFORCENCCSEARCHIMAGEFILTER_TXX
+#define BRUTEFORCENCCSEARCHIMAGEFILTER_TXX
+
+#include "BruteForceNCCSearchImageFilter.h"
+#include "MultiComponentNCCImageMetric.h"
+#include "itkNeighborhood.h"
+#include "itkImageLinearIteratorWithIndex.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::BruteForceNCCSearchImageFilter()
+{
+  this->SetPrimaryOutput(this->MakeOutput("Primary"));
+  this->SetOutput("displacement", this->MakeOutput("displacement"));
+  m_Radius.Fill(1);
+  m_SearchRadius.Fill(1);
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+typename itk::DataObject::Pointer
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::MakeOutput(const DataObjectIdentifierType &key)
+{
+  if(key == "Primary")
+    return (MetricImageType::New()).GetPointer();
+  else if(key == "displacement")
+    return (DeformationFieldType::New()).GetPointer();
+  else
+    return NULL;
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+void
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  // The neighborhood sums and the shifted reads may reach anywhere in the inputs
+  this->GetFixedImage()->SetRequestedRegionToLargestPossibleRegion();
+  this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetFixedMaskImage())
+    this->GetFixedMaskImage()->SetRequestedRegionToLargestPossibleRegion();
+  if(this->GetInitialDisplacement())
+    this->GetInitialDisplacement()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+void
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::RoundDisplacement(const DeformationVectorType *u, int *out)
+{
+  for(int d = 0; d < ImageDimension; d++)
+    out[d] = u ? (int) floor((*u)[d] + 0.5) : 0;
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+void
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::ComputeBoxSums(InputComponentType *buffer, const SizeType &size, int n_sums)
+{
+  // Prefix sums are kept in double precision, so that the differences below do not
+  // lose accuracy when the buffer is single precision
+  std::vector<double> prefix;
+
+  long n_pix = 1;
+  for(int d = 0; d < ImageDimension; d++)
+    n_pix *= size[d];
+
+  // Number of pixels spanned by a unit step along the current dimension
+  long inner = 1;
+  for(int d = 0; d < ImageDimension; d++)
+    {
+    long len = size[d], r = m_Radius[d];
+    long outer = n_pix / (inner * len);
+    long stride = inner * n_sums;
+    prefix.resize((len + 1) * n_sums);
+
+    for(long o = 0; o < outer; o++)
+      {
+      for(long ii = 0; ii < inner; ii++)
+        {
+        InputComponentType *line = buffer + (o * inner * len + ii) * n_sums;
+
+        // Compute the prefix sums along the line
+        std::fill(prefix.begin(), prefix.begin() + n_sums, 0.0);
+        for(long i = 0; i < len; i++)
+          {
+          const InputComponentType *p = line + i * stride;
+          const double *pp = &prefix[i * n_sums];
+          double *pn = &prefix[(i + 1) * n_sums];
+          for(int q = 0; q < n_sums; q++)
+            pn[q] = pp[q] + p[q];
+          }
+
+        // Window sums, with the window truncated at the ends of the line
+        for(long i = 0; i < len; i++)
+          {
+          InputComponentType *p = line + i * stride;
+          const double *p0 = &prefix[std::max(i - r, 0l) * n_sums];
+          const double *p1 = &prefix[(std::min(i + r, len - 1) + 1) * n_sums];
+          for(int q = 0; q < n_sums; q++)
+            p[q] = (InputComponentType) (p1[q] - p0[q]);
+          }
+        }
+      }
+
+    inner *= len;
+    }
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+void
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  const MetricImageType *mask = this->GetFixedMaskImage();
+  const DeformationFieldType *init = this->GetInitialDisplacement();
+  MetricImageType *out_metric = this->GetMetricOutput();
+  DeformationFieldType *out_disp = this->GetDisplacementOutput();
+
+  // Initialize the outputs. Masked voxels receive zero metric and the rounded
+  // initial displacement. The unmasked voxels are grouped by their rounded initial
+  // displacement, keeping the bounding box of each group
+  typedef std::vector<int> ShiftType;
+  typedef std::map<ShiftType, std::pair<IndexType, IndexType> > GroupMap;
+  GroupMap groups;
+
+  int line_len = outputRegionForThread.GetSize(0);
+  ShiftType base(ImageDimension, 0);
+
+  typedef itk::ImageLinearIteratorWithIndex<MetricImageType> OutIter;
+  for(OutIter it(out_metric, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    IndexType idx = it.GetIndex();
+    long off = out_metric->ComputeOffset(idx);
+    MetricPixelType *p_m = out_metric->GetBufferPointer() + off;
+    DeformationVectorType *p_u = out_disp->GetBufferPointer() + off;
+    const MetricPixelType *p_mask = mask ? mask->GetBufferPointer() + off : NULL;
+    const DeformationVectorType *p_init = init ? init->GetBufferPointer() + off : NULL;
+    for(int i = 0; i < line_len; i++, idx[0]++)
+      {
+      RoundDisplacement(p_init ? p_init + i : NULL, &base[0]);
+      for(int d = 0; d < ImageDimension; d++)
+        p_u[i][d] = base[d];
+
+      if(p_mask && p_mask[i] <= 0.5)
+        {
+        p_m[i] = 0.0;
+        continue;
+        }
+
+      p_m[i] = itk::NumericTraits<MetricPixelType>::NonpositiveMin();
+      if(init)
+        {
+        typename GroupMap::iterator g = groups.find(base);
+        if(g == groups.end())
+          groups[base] = std::make_pair(idx, idx);
+        else
+          {
+          for(int d = 0; d < ImageDimension; d++)
+            {
+            g->second.first[d] = std::min(g->second.first[d], idx[d]);
+            g->second.second[d] = std::max(g->second.second[d], idx[d]);
+            }
+          }
+        }
+      }
+    }
+
+  // Search each group with its constant shift
+  std::vector<InputComponentType> buffer;
+  if(init)
+    {
+    for(typename GroupMap::const_iterator g = groups.begin(); g != groups.end(); ++g)
+      {
+      RegionType rgn_group;
+      rgn_group.SetIndex(g->second.first);
+      for(int d = 0; d < ImageDimension; d++)
+        rgn_group.SetSize(d, g->second.second[d] + 1 - g->second.first[d]);
+      this->SearchWithShift(rgn_group, &g->first[0], buffer);
+      }
+    }
+  else
+    {
+    this->SearchWithShift(outputRegionForThread, &base[0], buffer);
+    }
+}
+
+template <class TInputImage, class TMetricImage, class TDeformationField>
+void
+BruteForceNCCSearchImageFilter<TInputImage,TMetricImage,TDeformationField>
+::SearchWithShift(const RegionType &region, const int *shift,
+                  std::vector<InputComponentType> &buffer)
+{
+  const InputImageType *fixed = this->GetFixedImage();
+  const InputImageType *moving = this->GetMovingImage();
+  const MetricImageType *mask = this->GetFixedMaskImage();
+  const DeformationFieldType *init = this->GetInitialDisplacement();
+  MetricImageType *out_metric = this->GetMetricOutput();
+  DeformationFieldType *out_disp = this->GetDisplacementOutput();
+
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+
+  // For each component, the working buffer holds the count of valid pixels, the sums
+  // of the fixed and moving intensities, their squares, and their product
+  int n_sums = 6 * nc;
+
+  // The region over which the neighborhood sums are needed
+  RegionType rgn_pad = region;
+  rgn_pad.PadByRadius(m_Radius);
+  rgn_pad.Crop(fixed->GetBufferedRegion());
+  SizeType size_pad = rgn_pad.GetSize();
+
+  buffer.resize(rgn_pad.GetNumberOfPixels() * n_sums);
+  std::vector<double> comp_metric(nc);
+
+  // Offsets of unit steps in the padded region
+  long pad_stride[ImageDimension];
+  pad_stride[0] = 1;
+  for(int d = 1; d < ImageDimension; d++)
+    pad_stride[d] = pad_stride[d-1] * size_pad[d-1];
+
+  // Extent of the moving image
+  const RegionType &rgn_mov = moving->GetBufferedRegion();
+  long x_mov_0 = rgn_mov.GetIndex(0), x_mov_1 = x_mov_0 + rgn_mov.GetSize(0);
+  int line_len = region.GetSize(0), pad_line_len = size_pad[0];
+  int base[ImageDimension];
+
+  // Iterate over the offsets in the search neighborhood
+  itk::Neighborhood<float, ImageDimension> search_nbr;
+  search_nbr.SetRadius(m_SearchRadius);
+  for(unsigned int k = 0; k < search_nbr.Size(); k++)
+    {
+    // The whole window is read with the shift plus the search offset
+    typename itk::Neighborhood<float, ImageDimension>::OffsetType offset = search_nbr.GetOffset(k);
+    for(int d = 0; d < ImageDimension; d++)
+      offset[d] += shift[d];
+
+    // Fill the buffer with the products of the fixed and shifted moving intensities
+    InputComponentType *p_buf = &buffer[0];
+    typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> LineIter;
+    for(LineIter it(fixed, rgn_pad); !it.IsAtEnd(); it.NextLine())
+      {
+      IndexType idx = it.GetIndex();
+      const InputComponentType *p_fix = fixed->GetBufferPointer() + fixed->ComputeOffset(idx) * nc;
+
+      // Check if the shifted line intersects the moving image
+      IndexType idx_mov = idx + offset;
+      bool line_inside = true;
+      for(int d = 1; d < ImageDimension; d++)
+        if(idx_mov[d] < rgn_mov.GetIndex(d) || idx_mov[d] >= rgn_mov.GetIndex(d) + (long) rgn_mov.GetSize(d))
+          line_inside = false;
+
+      long off_mov = line_inside ? moving->ComputeOffset(idx_mov) : 0;
+
+      for(int i = 0; i < pad_line_len; i++, p_fix += nc)
+        {
+        long x = idx_mov[0] + i;
+        const InputComponentType *p_mov =
+            (line_inside && x >= x_mov_0 && x < x_mov_1) ? moving->GetBufferPointer() + (off_mov + i) * nc : NULL;
+
+        for(int c = 0; c < nc; c++, p_buf += 6)
+          {
+          InputComponentType f = p_fix[c], m = p_mov ? p_mov[c] : 0;
+          if(p_mov && !isnan(f) && !isnan(m))
+            {
+            p_buf[0] = 1; p_buf[1] = f; p_buf[2] = m;
+            p_buf[3] = f * f; p_buf[4] = m * m; p_buf[5] = f * m;
+            }
+          else
+            {
+            std::fill(p_buf, p_buf + 6, 0);
+            }
+          }
+        }
+      }
+
+    // Compute the neighborhood sums
+    this->ComputeBoxSums(&buffer[0], size_pad, n_sums);
+
+    // Compute the metric and keep the best offset at each voxel of the group
+    typedef itk::ImageLinearIteratorWithIndex<MetricImageType> OutIter;
+    for(OutIter it(out_metric, region); !it.IsAtEnd(); it.NextLine())
+      {
+      IndexType idx = it.GetIndex();
+      long off = out_metric->ComputeOffset(idx);
+      MetricPixelType *p_m = out_metric->GetBufferPointer() + off;
+      DeformationVectorType *p_u = out_disp->GetBufferPointer() + off;
+      const MetricPixelType *p_mask = mask ? mask->GetBufferPointer() + off : NULL;
+      const DeformationVectorType *p_init = init ? init->GetBufferPointer() + off : NULL;
+
+      long off_pad = 0;
+      for(int d = 0; d < ImageDimension; d++)
+        off_pad += (idx[d] - rgn_pad.GetIndex(d)) * pad_stride[d];
+      InputComponentType *p_sums = &buffer[off_pad * n_sums];
+
+      for(int i = 0; i < line_len; i++, p_sums += n_sums)
+        {
+        if(p_mask && p_mask[i] <= 0.5)
+          continue;
+
+        // The bounding box of the group also holds voxels of other groups
+        if(p_init)
+          {
+          RoundDisplacement(p_init + i, base);
+          if(!std::equal(base, base + ImageDimension, shift))
+            continue;
+          }
+
+        double metric;
+        MultiImageNNCPostComputeFunction<ImageDimension, 0>(
+              p_sums, p_sums + n_sums, nc, m_Weights.data_block(),
+              &metric, &comp_metric[0], (DeformationVectorType *)(NULL));
+        if(metric > p_m[i])
+          {
+          p_m[i] = (MetricPixelType) metric;
+          for(int d = 0; d < ImageDimension; d++)
+            p_u[i][d] = offset[d];
+          }
+        }
+      }
+    }
+}
+
+#endif // BRUTEFORCENCCSEARCHIMAGEFILTER_TXX
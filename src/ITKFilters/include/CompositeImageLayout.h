@@ -0,0 +1,95 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef COMPOSITEIMAGELAYOUT_H
+#define COMPOSITEIMAGELAYOUT_H
+
+/**
+ * Memory layout policies for the buffer of a multi-component (composite) image.
+ * The buffer is viewed as a set of planes. Each plane holds a fixed number of
+ * components for every voxel, stored voxel by voxel, so that within a plane the
+ * data looks like an interleaved image with GetPlaneWidth() components.
+ *
+ *   CompositeLayoutAoS       one plane with all components (itk::VectorImage order)
+ *   CompositeLayoutSoA       one plane per component (each component contiguous)
+ *   CompositeLayoutAoSoA<B>  planes of B components; the number of components
+ *                            must be a multiple of B (pad the image if needed)
+ *
+ * The buffer of an itk::VectorImage with nc components and n voxels can hold any
+ * of these layouts; the image itself is not aware of the layout, so only code
+ * templated over the layout policy may read it. Use CompositeLayoutConvert to
+ * move data between layouts.
+ */
+struct CompositeLayoutAoS
+{
+  static int GetNumberOfPlanes(int nc) { return 1; }
+  static int GetPlaneWidth(int nc) { return nc; }
+  static long GetOffset(long voxel, int comp, long n_voxels, int nc)
+    { return voxel * nc + comp; }
+};
+
+struct CompositeLayoutSoA
+{
+  static int GetNumberOfPlanes(int nc) { return nc; }
+  static int GetPlaneWidth(int nc) { return 1; }
+  static long GetOffset(long voxel, int comp, long n_voxels, int nc)
+    { return comp * n_voxels + voxel; }
+};
+
+template <int VBlock>
+struct CompositeLayoutAoSoA
+{
+  static int GetNumberOfPlanes(int nc) { return nc / VBlock; }
+  static int GetPlaneWidth(int nc) { return VBlock; }
+  static long GetOffset(long voxel, int comp, long n_voxels, int nc)
+    { return (comp / VBlock) * n_voxels * VBlock + voxel * VBlock + comp % VBlock; }
+};
+
+/** Check whether a number of components can be stored with a layout */
+template <class TLayout>
+bool CompositeLayoutIsValid(int nc)
+{
+  return nc > 0 && TLayout::GetNumberOfPlanes(nc) * TLayout::GetPlaneWidth(nc) == nc;
+}
+
+/**
+ * Copy a composite buffer from one layout to another. The source and target
+ * must not overlap.
+ */
+template <class TSourceLayout, class TTargetLayout, class TPixel>
+void CompositeLayoutConvert(const TPixel *src, TPixel *trg, long n_voxels, int nc)
+{
+  int ps = TSourceLayout::GetPlaneWidth(nc), pt = TTargetLayout::GetPlaneWidth(nc);
+  for(int k = 0; k < nc; k++)
+    {
+    const TPixel *p_src = src + TSourceLayout::GetOffset(0, k, n_voxels, nc);
+    TPixel *p_trg = trg + TTargetLayout::GetOffset(0, k, n_voxels, nc);
+    for(long v = 0; v < n_voxels; v++, p_src += ps, p_trg += pt)
+      *p_trg = *p_src;
+    }
+}
+
+#endif // COMPOSITEIMAGELAYOUT_H
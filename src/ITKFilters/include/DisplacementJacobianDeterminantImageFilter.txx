@@ -0,0 +1,171 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef __DisplacementJacobianDeterminantImageFilter_txx_
+#define __DisplacementJacobianDeterminantImageFilter_txx_
+
+#include "DisplacementJacobianDeterminantImageFilter.h"
+#include "itkImageLinearConstIteratorWithIndex.h"
+#include <vnl/vnl_matrix_fixed.h>
+#include <vnl/vnl_det.h>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// Histogram of the log determinant, in bins of 0.0025 over [-10, 10]
+const double JACOBIAN_HIST_LOG_MIN = -10.0;
+const double JACOBIAN_HIST_BIN = 0.0025;
+const unsigned int JACOBIAN_HIST_BINS = 8000;
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementJacobianDeterminantImageFilter<TInputImage,TOutputImage>
+::BeforeThreadedGenerateData()
+{
+  ThreadData td;
+  td.min = std::numeric_limits<double>::infinity();
+  td.max = -std::numeric_limits<double>::infinity();
+  td.sum = 0.0;
+  td.n_voxels = td.n_folding = 0;
+  td.hist.resize(JACOBIAN_HIST_BINS, 0);
+  m_ThreadData.assign(this->GetNumberOfThreads(), td);
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementJacobianDeterminantImageFilter<TInputImage,TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  const InputImageType *input = this->GetInput();
+  OutputImageType *output = this->GetOutput();
+  ThreadData &td = m_ThreadData[threadId];
+
+  // Strides and extents of the whole image, for the neighbor lookups
+  const typename InputImageType::RegionType &buffered = input->GetBufferedRegion();
+  const typename InputImageType::OffsetValueType *stride = input->GetOffsetTable();
+  const InputPixelType *buffer = input->GetBufferPointer();
+
+  // Iterate over the scanlines of the region
+  typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> LineIter;
+  LineIter it(input, outputRegionForThread);
+  it.SetDirection(0);
+
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> J;
+  for(it.GoToBegin(); !it.IsAtEnd(); it.NextLine())
+    {
+    typename InputImageType::IndexType idx = it.GetIndex();
+    long off = input->ComputeOffset(idx);
+    OutputPixelType *out = output->GetBufferPointer() + output->ComputeOffset(idx);
+    long line_end = idx[0] + outputRegionForThread.GetSize(0);
+
+    for(; idx[0] < line_end; idx[0]++, off++, out++)
+      {
+      // Central differences of the displacement along each dimension
+      for(unsigned int b = 0; b < ImageDimension; b++)
+        {
+        long i0 = idx[b] - buffered.GetIndex(b), n = buffered.GetSize(b);
+        long o_minus = (i0 > 0) ? -stride[b] : 0;
+        long o_plus = (i0 < n - 1) ? stride[b] : 0;
+        double scale = (o_plus != 0 && o_minus != 0) ? 0.5 : (n > 1 ? 1.0 : 0.0);
+        const InputPixelType &u_plus = buffer[off + o_plus], &u_minus = buffer[off + o_minus];
+        for(unsigned int a = 0; a < ImageDimension; a++)
+          J(a,b) = (a == b ? 1.0 : 0.0) + scale * (u_plus[a] - u_minus[a]);
+        }
+
+      double det = vnl_det(J);
+      *out = (OutputPixelType) det;
+
+      // Update the statistics
+      td.min = std::min(td.min, det);
+      td.max = std::max(td.max, det);
+      td.sum += det;
+      td.n_voxels++;
+      if(det <= 0.0)
+        {
+        td.n_folding++;
+        }
+      else
+        {
+        double bin = (std::log(det) - JACOBIAN_HIST_LOG_MIN) / JACOBIAN_HIST_BIN;
+        int ib = (int) std::max(0.0, std::min(bin, JACOBIAN_HIST_BINS - 1.0));
+        td.hist[ib]++;
+        }
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+DisplacementJacobianDeterminantImageFilter<TInputImage,TOutputImage>
+::AfterThreadedGenerateData()
+{
+  // Combine the thread accumulators
+  ThreadData all = m_ThreadData[0];
+  for(unsigned int t = 1; t < m_ThreadData.size(); t++)
+    {
+    const ThreadData &td = m_ThreadData[t];
+    all.min = std::min(all.min, td.min);
+    all.max = std::max(all.max, td.max);
+    all.sum += td.sum;
+    all.n_voxels += td.n_voxels;
+    all.n_folding += td.n_folding;
+    for(unsigned int i = 0; i < JACOBIAN_HIST_BINS; i++)
+      all.hist[i] += td.hist[i];
+    }
+
+  m_Statistics.min = all.min;
+  m_Statistics.max = all.max;
+  m_Statistics.mean = all.n_voxels ? all.sum / all.n_voxels : 0.0;
+  m_Statistics.n_voxels = all.n_voxels;
+  m_Statistics.n_folding = all.n_folding;
+
+  // Percentiles from the cumulative histogram, folding voxels come first
+  double pct[] = { 0.01, 0.05, 0.50, 0.95, 0.99 };
+  double *dst[] = { &m_Statistics.p01, &m_Statistics.p05, &m_Statistics.p50,
+                    &m_Statistics.p95, &m_Statistics.p99 };
+  for(unsigned int k = 0; k < 5; k++)
+    {
+    double rank = pct[k] * all.n_voxels;
+    unsigned long cum = all.n_folding;
+    if(cum > rank)
+      {
+      *dst[k] = std::min(all.min, 0.0);
+      continue;
+      }
+
+    unsigned int i = 0;
+    for(; i < JACOBIAN_HIST_BINS - 1 && cum + all.hist[i] <= rank; i++)
+      cum += all.hist[i];
+
+    double v = std::exp(JACOBIAN_HIST_LOG_MIN + (i + 0.5) * JACOBIAN_HIST_BIN);
+    *dst[k] = std::max(all.min, std::min(all.max, v));
+    }
+
+  m_ThreadData.clear();
+}
+
+#endif
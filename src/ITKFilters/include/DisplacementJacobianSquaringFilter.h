@@ -0,0 +1,103 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef DISPLACEMENTJACOBIANSQUARINGFILTER_H
+#define DISPLACEMENTJACOBIANSQUARINGFILTER_H
+
+#include "lddmm_common.h"
+#include "itkImageToImageFilter.h"
+
+/**
+ * One squaring step of the exponentiation of a displacement field u together with
+ * its Jacobian Du, computed in a single pass:
+ *
+ *   u'(x)  = u(x + u(x)) + u(x)
+ *   Du'(x) = Du(x + u(x)) (I + Du(x)) + Du(x)
+ *
+ * Both u and Du are sampled at x + u(x) with linear interpolation, so the warped
+ * position is computed once per voxel. The displacement is in voxel units. The
+ * Jacobian images are multi-component images with VDim x VDim components per
+ * pixel in row-major order, i.e., a matrix image wrapped as a VectorImage. The
+ * output Jacobian is written to the image passed to SetOutputJacobian, which
+ * must be allocated and must not be the input Jacobian; likewise, the output
+ * displacement must not be the input displacement.
+ */
+template <class TDisplacementField, class TCompositeImage>
+class DisplacementJacobianSquaringFilter
+    : public itk::ImageToImageFilter<TDisplacementField, TDisplacementField>
+{
+public:
+  typedef DisplacementJacobianSquaringFilter<TDisplacementField, TCompositeImage> Self;
+  typedef itk::ImageToImageFilter<TDisplacementField, TDisplacementField>        Superclass;
+  typedef itk::SmartPointer<Self>                                                Pointer;
+  typedef itk::SmartPointer<const Self>                                          ConstPointer;
+
+  itkNewMacro(Self)
+
+  itkTypeMacro(DisplacementJacobianSquaringFilter, ImageToImageFilter)
+
+  itkStaticConstMacro(ImageDimension, unsigned int, TDisplacementField::ImageDimension );
+
+  typedef TDisplacementField                          DisplacementFieldType;
+  typedef TCompositeImage                             CompositeImageType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+  typedef typename DisplacementFieldType::IndexType   IndexType;
+  typedef typename DisplacementFieldType::PixelType   DisplacementVectorType;
+  typedef typename CompositeImageType::InternalPixelType ComponentType;
+
+  /** The displacement field u */
+  itkNamedInputMacro(DisplacementField, DisplacementFieldType, "Primary")
+
+  /** The Jacobian Du of the displacement field */
+  itkNamedInputMacro(Jacobian, CompositeImageType, "jacobian")
+
+  /** The image where the Jacobian of the output displacement is stored */
+  void SetOutputJacobian(CompositeImageType *jac) { m_OutputJacobian = jac; }
+
+protected:
+
+  DisplacementJacobianSquaringFilter() : m_OutputJacobian(NULL) {}
+  ~DisplacementJacobianSquaringFilter() {}
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  CompositeImageType *m_OutputJacobian;
+
+private:
+  DisplacementJacobianSquaringFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "DisplacementJacobianSquaringFilter.txx"
+#endif
+
+#endif // DISPLACEMENTJACOBIANSQUARINGFILTER_H
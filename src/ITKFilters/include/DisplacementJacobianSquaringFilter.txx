@@ -0,0 +1,114 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef DISPLACEMENTJACOBIANSQUARINGFILTER_TXX
+#define DISPLACEMENTJACOBIANSQUARINGFILTER_TXX
+
+#include "DisplacementJacobianSquaringFilter.h"
+#include "FastLinearInterpolator.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include "itkImageLinearIteratorWithIndex.h"
+
+template <class TDisplacementField, class TCompositeImage>
+void
+DisplacementJacobianSquaringFilter<TDisplacementField, TCompositeImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  const unsigned int VDim = ImageDimension;
+  DisplacementFieldType *u = const_cast<DisplacementFieldType *>(this->GetDisplacementField());
+  CompositeImageType *jac = const_cast<CompositeImageType *>(this->GetJacobian());
+  DisplacementFieldType *out = this->GetOutput();
+
+  // Interpolators for the displacement and the Jacobian, outside of the image
+  // both are treated as zero, like in FastWarpCompositeImageFilter
+  typedef typename itk::NumericTraits<ComponentType>::RealType RealType;
+  typedef FastLinearInterpolator<DisplacementFieldType, RealType, ImageDimension> VecInterpolator;
+  typedef FastLinearInterpolator<CompositeImageType, RealType, ImageDimension> JacInterpolator;
+  VecInterpolator fi_u(u);
+  JacInterpolator fi_jac(jac);
+
+  typedef typename VecInterpolator::OutputComponentType VecSample;
+  typedef typename JacInterpolator::OutputComponentType JacSample;
+  VecSample u_wrp;
+  JacSample J_wrp[VDim * VDim];
+  RealType cix[VDim];
+
+  typedef itk::ImageLinearIteratorWithIndex<DisplacementFieldType> IterBase;
+  typedef IteratorExtender<IterBase> IterType;
+  int line_len = outputRegionForThread.GetSize(0);
+
+  for(IterType it(out, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    const DisplacementVectorType *p_u = it.GetPixelPointer(u);
+    DisplacementVectorType *p_out = it.GetPixelPointer(out);
+    const ComponentType *p_J = it.GetPixelPointer(jac);
+    ComponentType *p_Jout = it.GetPixelPointer(m_OutputJacobian);
+    IndexType idx = it.GetIndex();
+
+    for(int i = 0; i < line_len; i++, idx[0]++, p_J += VDim * VDim, p_Jout += VDim * VDim)
+      {
+      // The warped position x + u(x)
+      for(unsigned int a = 0; a < VDim; a++)
+        cix[a] = idx[a] + p_u[i][a];
+
+      // Sample both fields there, the samples are left at zero if outside
+      u_wrp.Fill(0.0);
+      for(unsigned int k = 0; k < VDim * VDim; k++)
+        J_wrp[k] = 0.0;
+      fi_u.Interpolate(cix, &u_wrp);
+      fi_jac.Interpolate(cix, J_wrp);
+
+      // Compose the displacement
+      for(unsigned int a = 0; a < VDim; a++)
+        p_out[i][a] = u_wrp[a] + p_u[i][a];
+
+      // Compose the Jacobian, Du(x+u) (I + Du(x)) + Du(x)
+      for(unsigned int a = 0; a < VDim; a++)
+        {
+        for(unsigned int b = 0; b < VDim; b++)
+          {
+          RealType v = J_wrp[a * VDim + b] + p_J[a * VDim + b];
+          for(unsigned int c = 0; c < VDim; c++)
+            v += J_wrp[a * VDim + c] * p_J[c * VDim + b];
+          p_Jout[a * VDim + b] = (ComponentType) v;
+          }
+        }
+      }
+    }
+}
+
+template <class TDisplacementField, class TCompositeImage>
+void
+DisplacementJacobianSquaringFilter<TDisplacementField, TCompositeImage>
+::GenerateInputRequestedRegion()
+{
+  // Both fields are sampled anywhere in the image
+  const_cast<DisplacementFieldType *>(this->GetDisplacementField())->SetRequestedRegionToLargestPossibleRegion();
+  const_cast<CompositeImageType *>(this->GetJacobian())->SetRequestedRegionToLargestPossibleRegion();
+}
+
+#endif // DISPLACEMENTJACOBIANSQUARINGFILTER_TXX
@@ -31,7 +31,14 @@
 #include "itkVectorImage.h"
 #include "itkNumericTraits.h"
 #include "itkNumericTraitsCovariantVectorPixel.h"
+#include "HalfPrecision.h"
+#include <algorithm>
 
+/**
+ * The type in which interpolated values are computed for a given input component
+ * type. For the 16-bit storage types (Float16, BFloat16) this is float or double,
+ * through the numeric traits in HalfPrecision.h
+ */
 template <class TFloat, class TInputComponentType>
 struct FastLinearInterpolatorOutputTraits
 {
@@ -69,6 +76,34 @@ struct FastWarpCompositeImageFilterInputImageTraits< itk::VectorImage<TPixel, VD
   }
 };
 
+/**
+ * Voxel addressing for the fast interpolators: the offset of a voxel from the
+ * buffer pointer, in components, and the strides to its neighbors. This is the
+ * raster order of itk::Image and itk::VectorImage; BrickedImage.h specializes it
+ * for bricked storage
+ */
+template <class TImage>
+struct FastLinearInterpolatorAddressing
+{
+  FastLinearInterpolatorAddressing(const TImage *image, int ncomp)
+  {
+    long s = ncomp;
+    for(unsigned int d = 0; d < TImage::ImageDimension; d++)
+      {
+      stride[d] = s;
+      s *= image->GetLargestPossibleRegion().GetSize()[d];
+      }
+  }
+
+  long GetStride(unsigned int d) const { return stride[d]; }
+
+  long Offset(int X, int Y) const { return X * stride[0] + Y * stride[1]; }
+
+  long Offset(int X, int Y, int Z) const { return X * stride[0] + Y * stride[1] + Z * stride[2]; }
+
+  long stride[TImage::ImageDimension];
+};
+
 
 /**
  * Base class for the fast linear interpolators
@@ -135,10 +170,13 @@ protected:
   InOut status;
 
 
+  // The inputs are converted to the output type first, so that storage types without
+  // arithmetic of their own (e.g., Float16) are interpolated in float or double
   template <class TInput>
   inline OutputComponentType lerp(RealType a, const TInput &l, const TInput &h)
   {
-    return l+((h-l)*a);
+    OutputComponentType lo = l, hi = h;
+    return lo+((hi-lo)*a);
   }
 };
 
@@ -167,6 +205,9 @@ public:
   InOut Interpolate(RealType *cix, OutputComponentType *out)
     { return Superclass::INSIDE; }
 
+  void Interpolate(int n, RealType *cix, OutputComponentType *out, InOut *result)
+    { for(int i = 0; i < n; i++) result[i] = Superclass::INSIDE; }
+
   InOut InterpolateNearestNeighbor(RealType *cix, OutputComponentType *out)
     { return Superclass::INSIDE; }
 
@@ -203,7 +244,8 @@ public:
   typedef typename Superclass::InOut                                       InOut;
   typedef typename Superclass::MaskPixelType                               MaskPixelType;
 
-  FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL) : Superclass(image, mask)
+  FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL)
+    : Superclass(image, mask), addr(image, this->nComp)
   {
     xsize = image->GetLargestPossibleRegion().GetSize()[0];
     ysize = image->GetLargestPossibleRegion().GetSize()[1];
@@ -233,13 +275,13 @@ public:
       dp = dens(x0, y0, z0);
       d000 = dp;
       d100 = dp+this->nComp;
-      dp += xsize*this->nComp;
+      dp += addr.GetStride(1);
       d010 = dp;
       d110 = dp+this->nComp;
-      dp += xsize*ysize*this->nComp;
+      dp += addr.GetStride(2);
       d011 = dp;
       d111 = dp+this->nComp;
-      dp -= xsize*this->nComp;
+      dp -= addr.GetStride(1);
       d001 = dp;
       d101 = dp+this->nComp;
 
@@ -327,36 +369,40 @@ public:
 
     if(this->status != Superclass::OUTSIDE)
       {
+      // Local copies of the corner pointers, so the compiler does not have to assume
+      // that writes to the output alias the member variables
+      const InputComponentType *c000 = d000, *c001 = d001, *c010 = d010, *c011 = d011;
+      const InputComponentType *c100 = d100, *c101 = d101, *c110 = d110, *c111 = d111;
+      const RealType wx = fx, wy = fy, wz = fz;
+
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++, grad++,
-          d000++, d001++, d010++, d011++,
-          d100++, d101++, d110++, d111++)
+      for(int iComp = 0; iComp < this->nComp; iComp++)
         {
         // Interpolate the image intensity
-        dx00 = Superclass::lerp(fx, *d000, *d100);
-        dx01 = Superclass::lerp(fx, *d001, *d101);
-        dx10 = Superclass::lerp(fx, *d010, *d110);
-        dx11 = Superclass::lerp(fx, *d011, *d111);
-        dxy0 = Superclass::lerp(fy, dx00, dx10);
-        dxy1 = Superclass::lerp(fy, dx01, dx11);
-        *(out++) = Superclass::lerp(fz, dxy0, dxy1);
+        dx00 = Superclass::lerp(wx, c000[iComp], c100[iComp]);
+        dx01 = Superclass::lerp(wx, c001[iComp], c101[iComp]);
+        dx10 = Superclass::lerp(wx, c010[iComp], c110[iComp]);
+        dx11 = Superclass::lerp(wx, c011[iComp], c111[iComp]);
+        dxy0 = Superclass::lerp(wy, dx00, dx10);
+        dxy1 = Superclass::lerp(wy, dx01, dx11);
+        out[iComp] = Superclass::lerp(wz, dxy0, dxy1);
 
         // Interpolate the gradient in x
-        dx00_x = *d100 - *d000;
-        dx01_x = *d101 - *d001;
-        dx10_x = *d110 - *d010;
-        dx11_x = *d111 - *d011;
-        dxy0_x = this->lerp(fy, dx00_x, dx10_x);
-        dxy1_x = this->lerp(fy, dx01_x, dx11_x);
-        (*grad)[0] = this->lerp(fz, dxy0_x, dxy1_x);
+        dx00_x = c100[iComp] - c000[iComp];
+        dx01_x = c101[iComp] - c001[iComp];
+        dx10_x = c110[iComp] - c010[iComp];
+        dx11_x = c111[iComp] - c011[iComp];
+        dxy0_x = this->lerp(wy, dx00_x, dx10_x);
+        dxy1_x = this->lerp(wy, dx01_x, dx11_x);
+        grad[iComp][0] = this->lerp(wz, dxy0_x, dxy1_x);
 
         // Interpolate the gradient in y
         dxy0_y = dx10 - dx00;
         dxy1_y = dx11 - dx01;
-        (*grad)[1] = this->lerp(fz, dxy0_y, dxy1_y);
+        grad[iComp][1] = this->lerp(wz, dxy0_y, dxy1_y);
 
         // Interpolate the gradient in z
-        (*grad)[2] = dxy1 - dxy0;
+        grad[iComp][2] = dxy1 - dxy0;
         }
       }
 
@@ -372,25 +418,117 @@ public:
 
     if(this->status != Superclass::OUTSIDE)
       {
+      // Local copies of the corner pointers (see InterpolateWithGradient)
+      const InputComponentType *c000 = d000, *c001 = d001, *c010 = d010, *c011 = d011;
+      const InputComponentType *c100 = d100, *c101 = d101, *c110 = d110, *c111 = d111;
+      const RealType wx = fx, wy = fy, wz = fz;
+
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
-          d000++, d001++, d010++, d011++,
-          d100++, d101++, d110++, d111++)
+      for(int iComp = 0; iComp < this->nComp; iComp++)
         {
         // Interpolate the image intensity
-        dx00 = Superclass::lerp(fx, *d000, *d100);
-        dx01 = Superclass::lerp(fx, *d001, *d101);
-        dx10 = Superclass::lerp(fx, *d010, *d110);
-        dx11 = Superclass::lerp(fx, *d011, *d111);
-        dxy0 = Superclass::lerp(fy, dx00, dx10);
-        dxy1 = Superclass::lerp(fy, dx01, dx11);
-        *(out++) = Superclass::lerp(fz, dxy0, dxy1);
+        dx00 = Superclass::lerp(wx, c000[iComp], c100[iComp]);
+        dx01 = Superclass::lerp(wx, c001[iComp], c101[iComp]);
+        dx10 = Superclass::lerp(wx, c010[iComp], c110[iComp]);
+        dx11 = Superclass::lerp(wx, c011[iComp], c111[iComp]);
+        dxy0 = Superclass::lerp(wy, dx00, dx10);
+        dxy1 = Superclass::lerp(wy, dx01, dx11);
+        out[iComp] = Superclass::lerp(wz, dxy0, dxy1);
         }
       }
 
     return this->status;
   }
 
+  /**
+   * Interpolate at n sample positions, stored consecutively in cix (three values
+   * per sample). The output for sample i is placed at out + i * nComp and its status in
+   * result[i]. Nothing is written to the output for samples that are OUTSIDE.
+   *
+   * The samples are taken in blocks, in three passes. First, the corner indices,
+   * fractions and the bounds check of the whole block are computed in a loop without
+   * branches. Then, for each component, the corner values of the samples that are
+   * inside an image without a mask are gathered into one array per corner, and
+   * interpolated in a loop over the block that has no branches or indirection, so
+   * that the compiler can vectorize it. Last, the remaining samples (image border,
+   * mask) go through ComputeCorners. The corner state of the interpolator is not
+   * updated by this method.
+   */
+  void Interpolate(int n, RealType *cix, OutputComponentType *out, InOut *result)
+  {
+    const int block = 64;
+    const InputComponentType *base[block];
+    RealType bfx[block], bfy[block], bfz[block];
+    unsigned char direct[block];
+    OutputComponentType v[8][block], vout[block];
+    long sy = addr.GetStride(1), sz = addr.GetStride(2);
+    int nc = this->nComp;
+
+    for(int i0 = 0; i0 < n; i0 += block)
+      {
+      int nb = std::min(block, n - i0);
+      RealType *c = cix + 3 * i0;
+
+      // Corners, fractions and bounds check
+      int n_direct = 0;
+      for(int i = 0; i < nb; i++)
+        {
+        RealType xf = floor(c[3*i]), yf = floor(c[3*i+1]), zf = floor(c[3*i+2]);
+        int x = (int) xf, y = (int) yf, z = (int) zf;
+        bfx[i] = c[3*i] - xf; bfy[i] = c[3*i+1] - yf; bfz[i] = c[3*i+2] - zf;
+        direct[i] = (x >= 0) & (x + 1 < xsize) & (y >= 0) & (y + 1 < ysize)
+                    & (z >= 0) & (z + 1 < zsize) & (this->mask_buffer == NULL);
+        n_direct += direct[i];
+        base[i] = direct[i] ? dens(x, y, z) : this->buffer;
+        }
+
+      // Gather the corners one component at a time and interpolate the block
+      for(int iComp = 0; n_direct > 0 && iComp < nc; iComp++)
+        {
+        for(int i = 0; i < nb; i++)
+          {
+          if(direct[i])
+            {
+            const InputComponentType *c000 = base[i] + iComp;
+            v[0][i] = c000[0];       v[1][i] = c000[nc];
+            v[2][i] = c000[sy];      v[3][i] = c000[sy + nc];
+            v[4][i] = c000[sz];      v[5][i] = c000[sz + nc];
+            v[6][i] = c000[sy + sz]; v[7][i] = c000[sy + sz + nc];
+            }
+          else
+            {
+            for(int k = 0; k < 8; k++)
+              v[k][i] = 0;
+            }
+          }
+
+        for(int i = 0; i < nb; i++)
+          {
+          OutputComponentType dx00 = Superclass::lerp(bfx[i], v[0][i], v[1][i]);
+          OutputComponentType dx10 = Superclass::lerp(bfx[i], v[2][i], v[3][i]);
+          OutputComponentType dx01 = Superclass::lerp(bfx[i], v[4][i], v[5][i]);
+          OutputComponentType dx11 = Superclass::lerp(bfx[i], v[6][i], v[7][i]);
+          OutputComponentType dxy0 = Superclass::lerp(bfy[i], dx00, dx10);
+          OutputComponentType dxy1 = Superclass::lerp(bfy[i], dx01, dx11);
+          vout[i] = Superclass::lerp(bfz[i], dxy0, dxy1);
+          }
+
+        for(int i = 0; i < nb; i++)
+          if(direct[i])
+            out[(long) (i0 + i) * nc + iComp] = vout[i];
+        }
+
+      // Samples on the border or with a mask
+      for(int i = 0; i < nb; i++)
+        {
+        if(direct[i])
+          result[i0 + i] = Superclass::INSIDE;
+        else
+          result[i0 + i] = this->Interpolate(c + 3 * i, out + (long) (i0 + i) * nc);
+        }
+      }
+  }
+
   InOut InterpolateNearestNeighbor(RealType *cix, OutputComponentType *out)
   {
     x0 = (int) floor(cix[0] + 0.5);
@@ -411,6 +549,7 @@ public:
     else return Superclass::OUTSIDE;
   }
 
+  // Only valid for raster images: a BrickedImage stores some voxels twice
   void Splat(RealType *cix, const InputComponentType *value)
   {
     // Compute the corners
@@ -620,7 +759,7 @@ protected:
 
   inline const InputComponentType *dens(int X, int Y, int Z)
   {
-    return this->buffer + this->nComp * (X+xsize*(Y+ysize*Z));
+    return this->buffer + addr.Offset(X, Y, Z);
   }
 
   inline const MaskPixelType *mens(int X, int Y, int Z)
@@ -631,6 +770,9 @@ protected:
   // Image size
   int xsize, ysize, zsize;
 
+  // Raster or bricked voxel addressing
+  FastLinearInterpolatorAddressing<TImage> addr;
+
   // State of current interpolation
   const InputComponentType *d000, *d001, *d010, *d011, *d100, *d101, *d110, *d111;
   RealType m000, m001, m010, m011, m100, m101, m110, m111;
@@ -659,7 +801,8 @@ public:
   typedef typename Superclass::InOut                                        InOut;
   typedef typename Superclass::MaskPixelType                                MaskPixelType;
 
-  FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL) : Superclass(image, mask)
+  FastLinearInterpolator(ImageType *image, MaskImageType *mask = NULL)
+    : Superclass(image, mask), addr(image, this->nComp)
   {
     xsize = image->GetLargestPossibleRegion().GetSize()[0];
     ysize = image->GetLargestPossibleRegion().GetSize()[1];
@@ -685,7 +828,7 @@ public:
       dp = dens(x0, y0);
       d00 = dp;
       d10 = dp+this->nComp;
-      dp += xsize*this->nComp;
+      dp += addr.GetStride(1);
       d01 = dp;
       d11 = dp+this->nComp;
 
@@ -758,20 +901,24 @@ public:
 
     if(this->status != Superclass::OUTSIDE)
       {
+      // Local copies of the corner pointers, so the compiler does not have to assume
+      // that writes to the output alias the member variables
+      const InputComponentType *c00 = d00, *c01 = d01, *c10 = d10, *c11 = d11;
+      const RealType wx = fx, wy = fy;
+
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++, grad++,
-          d00++, d01++, d10++, d11++)
+      for(int iComp = 0; iComp < this->nComp; iComp++)
         {
         // Interpolate the image intensity
-        dx0 = Superclass::lerp(fx, *d00, *d10);
-        dx1 = Superclass::lerp(fx, *d01, *d11);
-        *(out++) = Superclass::lerp(fy, dx0, dx1);
+        dx0 = Superclass::lerp(wx, c00[iComp], c10[iComp]);
+        dx1 = Superclass::lerp(wx, c01[iComp], c11[iComp]);
+        out[iComp] = Superclass::lerp(wy, dx0, dx1);
 
         // Interpolate the gradient in x
-        (*grad)[0] = this->lerp(fy, *d10 - *d00, *d11 - *d01);
+        grad[iComp][0] = this->lerp(wy, c10[iComp] - c00[iComp], c11[iComp] - c01[iComp]);
 
         // Interpolate the gradient in y
-        (*grad)[1] = dx1 - dx0;
+        grad[iComp][1] = dx1 - dx0;
         }
       }
 
@@ -787,20 +934,99 @@ public:
 
     if(this->status != Superclass::OUTSIDE)
       {
+      // Local copies of the corner pointers (see InterpolateWithGradient)
+      const InputComponentType *c00 = d00, *c01 = d01, *c10 = d10, *c11 = d11;
+      const RealType wx = fx, wy = fy;
+
       // Loop over the components
-      for(int iComp = 0; iComp < this->nComp; iComp++,
-          d00++, d01++, d10++, d11++)
+      for(int iComp = 0; iComp < this->nComp; iComp++)
         {
         // Interpolate the image intensity
-        dx0 = Superclass::lerp(fx, *d00, *d10);
-        dx1 = Superclass::lerp(fx, *d01, *d11);
-        *(out++) = Superclass::lerp(fy, dx0, dx1);
+        dx0 = Superclass::lerp(wx, c00[iComp], c10[iComp]);
+        dx1 = Superclass::lerp(wx, c01[iComp], c11[iComp]);
+        out[iComp] = Superclass::lerp(wy, dx0, dx1);
         }
       }
 
     return this->status;
   }
 
+  /**
+   * Interpolate at n sample positions, stored consecutively in cix (two values
+   * per sample). The output for sample i is placed at out + i * nComp and its status in
+   * result[i]. Nothing is written to the output for samples that are OUTSIDE. As in
+   * the 3D interpolator, the block is processed in three passes: corners, then a
+   * gather and a branch-free interpolation loop per component, and last the samples
+   * on the border or with a mask, which go through ComputeCorners.
+   */
+  void Interpolate(int n, RealType *cix, OutputComponentType *out, InOut *result)
+  {
+    const int block = 64;
+    const InputComponentType *base[block];
+    RealType bfx[block], bfy[block];
+    unsigned char direct[block];
+    OutputComponentType v[4][block], vout[block];
+    long sy = addr.GetStride(1);
+    int nc = this->nComp;
+
+    for(int i0 = 0; i0 < n; i0 += block)
+      {
+      int nb = std::min(block, n - i0);
+      RealType *c = cix + 2 * i0;
+
+      // Corners, fractions and bounds check
+      int n_direct = 0;
+      for(int i = 0; i < nb; i++)
+        {
+        RealType xf = floor(c[2*i]), yf = floor(c[2*i+1]);
+        int x = (int) xf, y = (int) yf;
+        bfx[i] = c[2*i] - xf; bfy[i] = c[2*i+1] - yf;
+        direct[i] = (x >= 0) & (x + 1 < xsize) & (y >= 0) & (y + 1 < ysize)
+                    & (this->mask_buffer == NULL);
+        n_direct += direct[i];
+        base[i] = direct[i] ? dens(x, y) : this->buffer;
+        }
+
+      // Gather the corners one component at a time and interpolate the block
+      for(int iComp = 0; n_direct > 0 && iComp < nc; iComp++)
+        {
+        for(int i = 0; i < nb; i++)
+          {
+          if(direct[i])
+            {
+            const InputComponentType *c00 = base[i] + iComp;
+            v[0][i] = c00[0];  v[1][i] = c00[nc];
+            v[2][i] = c00[sy]; v[3][i] = c00[sy + nc];
+            }
+          else
+            {
+            v[0][i] = v[1][i] = v[2][i] = v[3][i] = 0;
+            }
+          }
+
+        for(int i = 0; i < nb; i++)
+          {
+          OutputComponentType dx0 = Superclass::lerp(bfx[i], v[0][i], v[1][i]);
+          OutputComponentType dx1 = Superclass::lerp(bfx[i], v[2][i], v[3][i]);
+          vout[i] = Superclass::lerp(bfy[i], dx0, dx1);
+          }
+
+        for(int i = 0; i < nb; i++)
+          if(direct[i])
+            out[(long) (i0 + i) * nc + iComp] = vout[i];
+        }
+
+      // Samples on the border or with a mask
+      for(int i = 0; i < nb; i++)
+        {
+        if(direct[i])
+          result[i0 + i] = Superclass::INSIDE;
+        else
+          result[i0 + i] = this->Interpolate(c + 2 * i, out + (long) (i0 + i) * nc);
+        }
+      }
+  }
+
   InOut InterpolateNearestNeighbor(RealType *cix, OutputComponentType *out)
   {
     x0 = (int) floor(cix[0] + 0.5);
@@ -818,6 +1044,7 @@ public:
     else return Superclass::OUTSIDE;
   }
 
+  // Only valid for raster images: a BrickedImage stores some voxels twice
   void Splat(RealType *cix, const InputComponentType *value)
   {
     // Compute the corners
@@ -973,7 +1200,7 @@ protected:
 
   inline const InputComponentType *dens(int X, int Y)
   {
-    return this->buffer + this->nComp * (X+xsize*Y);
+    return this->buffer + addr.Offset(X, Y);
   }
 
   inline const MaskPixelType *mens(int X, int Y)
@@ -984,6 +1211,9 @@ protected:
   // Image size
   int xsize, ysize;
 
+  // Raster or bricked voxel addressing
+  FastLinearInterpolatorAddressing<TImage> addr;
+
   // State of current interpolation
   const InputComponentType *d00, *d01, *d10, *d11;
   RealType m00, m01, m10, m11;
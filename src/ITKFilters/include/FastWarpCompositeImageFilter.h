@@ -116,11 +116,22 @@ public:
   itkSetMacro(OutsideValue, OutputComponentType);
   itkGetMacro(OutsideValue, OutputComponentType);
 
+  /**
+   * When set, the deformation field is added to the warped image, i.e., the output
+   * is M(x + s * phi(x)) + phi(x). With the moving image equal to the deformation
+   * field, this computes the composition of the field with itself in a single pass,
+   * as needed for scaling and squaring. The moving image must have as many components
+   * as the deformation field vectors.
+   */
+  itkSetMacro(AddDeformationField, bool)
+  itkGetMacro(AddDeformationField, bool)
+
 protected:
 
   FastWarpCompositeImageFilter()
   : m_UsePhysicalSpace(false), m_DeformationScaling(1.0),
-    m_UseNearestNeighbor(false), m_ExtrapolateBorders(true), m_OutsideValue(0.0) { }
+    m_UseNearestNeighbor(false), m_ExtrapolateBorders(true), m_OutsideValue(0.0),
+    m_AddDeformationField(false) { }
 
   ~FastWarpCompositeImageFilter() {}
 
@@ -138,6 +149,8 @@ protected:
 
   OutputComponentType m_OutsideValue;
 
+  bool m_AddDeformationField;
+
 
 private:
   FastWarpCompositeImageFilter(const Self&); //purposely not implemented
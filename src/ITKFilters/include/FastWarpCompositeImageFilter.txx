@@ -30,6 +30,7 @@
 #include "FastLinearInterpolator.h"
 #include "FastWarpCompositeImageFilter.h"
 #include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <vector>
 
 template <class TInputImage, class TOutputImage, class TDeformationField>
 void
@@ -57,6 +58,12 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
 
   int ncomp = fi.GetPointerIncrement();
 
+  // Per-line buffers for the sample positions and the interpolation status. The
+  // positions for the whole line are computed first and then passed to the
+  // interpolator in a single batch
+  std::vector<FloatType> cix_line(line_len * ImageDimension);
+  std::vector<typename FastInterpolator::InOut> status_line(line_len);
+
   // Loop over the lines in the image
   for(IterType it(this->GetOutput(), outputRegionForThread); !it.IsAtEnd(); it.NextLine())
     {
@@ -67,24 +74,23 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
     // Voxel index
     IndexType idx = it.GetIndex();
 
-    // The current sample position
-    itk::ContinuousIndex<FloatType, ImageDimension> cix;
-    typename InputImageType::PointType p, pd, p_step;
+    // Pointer to the sample positions
+    FloatType *cix = &cix_line[0];
 
     if(m_UsePhysicalSpace)
       {
+      // The current sample position
+      itk::ContinuousIndex<FloatType, ImageDimension> cix_phys;
+      typename InputImageType::PointType p, pd, p_step;
+
       // Compute starting point and point step
       this->GetDeformationField()->TransformIndexToPhysicalPoint(idx, p);
       idx[0] += 1;
       this->GetDeformationField()->TransformIndexToPhysicalPoint(idx, p_step);
       for(int j = 0; j < ImageDimension; j++)
         p_step[j] -= p[j];
-      }
 
-    // Loop over the line
-    for(int i = 0; i < line_len; i++)
-      {
-      if(m_UsePhysicalSpace)
+      for(int i = 0; i < line_len; i++, cix += ImageDimension)
         {
         for(int j = 0; j < ImageDimension; j++)
           {
@@ -93,30 +99,50 @@ FastWarpCompositeImageFilter<TInputImage,TOutputImage,TDeformationField>
           }
 
         // TODO: this calls IsInside() internally, which limits efficiency
-        input->TransformPhysicalPointToContinuousIndex(pd, cix);
+        input->TransformPhysicalPointToContinuousIndex(pd, cix_phys);
+        for(int j = 0; j < ImageDimension; j++)
+          cix[j] = cix_phys[j];
         }
-      else
+      }
+    else
+      {
+      // In voxel space the positions are a simple multiply-add along the line
+      for(int i = 0; i < line_len; i++, cix += ImageDimension)
         {
         for(int j = 0; j < ImageDimension; j++)
           cix[j] = idx[j] + phi[i][j] * m_DeformationScaling;
         idx[0]++;
         }
+      }
 
-      // Perform the interpolation
-      typename  FastInterpolator::InOut status =
-          m_UseNearestNeighbor
-          ? fi.InterpolateNearestNeighbor(cix.GetDataPointer(), out)
-          : fi.Interpolate(cix.GetDataPointer(), out);
+    // Perform the interpolation for the whole line
+    cix = &cix_line[0];
+    if(m_UseNearestNeighbor)
+      {
+      for(int i = 0; i < line_len; i++, cix += ImageDimension)
+        status_line[i] = fi.InterpolateNearestNeighbor(cix, out + i * ncomp);
+      }
+    else
+      {
+      fi.Interpolate(line_len, cix, out, &status_line[0]);
+      }
 
-      if(status == FastInterpolator::INSIDE ||
-         (status == FastInterpolator::BORDER && m_ExtrapolateBorders))
+    // Assign the outside value to the samples that fell outside of the image
+    for(int i = 0; i < line_len; i++, out += ncomp)
+      {
+      typename FastInterpolator::InOut status = status_line[i];
+      if(status == FastInterpolator::OUTSIDE ||
+         (status == FastInterpolator::BORDER && !m_ExtrapolateBorders))
         {
-        out += ncomp;
+        for(int k = 0; k < ncomp; k++)
+          out[k] = m_OutsideValue;
         }
-      else
+
+      // Add the displacement itself if composing the field with itself
+      if(m_AddDeformationField)
         {
         for(int k = 0; k < ncomp; k++)
-          *out++ = m_OutsideValue;
+          out[k] += phi[i][k];
         }
       }
     }
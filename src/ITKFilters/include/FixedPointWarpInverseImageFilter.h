@@ -0,0 +1,134 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef FIXEDPOINTWARPINVERSEIMAGEFILTER_H
+#define FIXEDPOINTWARPINVERSEIMAGEFILTER_H
+
+#include "itkImageToImageFilter.h"
+#include <vector>
+
+/**
+ * Computes the inverse of a displacement field u (in voxel units) using the
+ * fixed-point iteration
+ *
+ *    v[0](x) = 0
+ *    v[t+1](x) = -u(x + v[t](x))
+ *
+ * The iteration for each voxel only depends on u, so each voxel is iterated on its
+ * own until the change falls below the tolerance, or until the maximum number of
+ * iterations is reached. The iteration converges when u is a contraction, so large
+ * warps should first be divided into small ones by taking square roots.
+ *
+ * After the filter runs, the largest and the mean residual (the norm of the last
+ * update, in voxel units) and the number of voxels that did not converge are available.
+ */
+template <class TDeformationField>
+class FixedPointWarpInverseImageFilter
+    : public itk::ImageToImageFilter<TDeformationField, TDeformationField>
+{
+public:
+  typedef FixedPointWarpInverseImageFilter<TDeformationField>            Self;
+  typedef itk::ImageToImageFilter<TDeformationField, TDeformationField>  Superclass;
+  typedef itk::SmartPointer<Self>                                        Pointer;
+  typedef itk::SmartPointer<const Self>                                  ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( FixedPointWarpInverseImageFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TDeformationField::ImageDimension );
+
+  typedef TDeformationField                           DeformationFieldType;
+  typedef typename DeformationFieldType::PixelType    DeformationVectorType;
+  typedef typename DeformationVectorType::ValueType   RealType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+
+  /** Stop iterating at a voxel once the update is below this value (voxel units) */
+  itkSetMacro(Tolerance, double)
+  itkGetMacro(Tolerance, double)
+
+  /** Maximum number of iterations at each voxel */
+  itkSetMacro(MaxIterations, int)
+  itkGetMacro(MaxIterations, int)
+
+  /** Largest residual over all voxels after the filter has run */
+  itkGetMacro(MaxResidual, double)
+
+  /** Mean residual over all voxels after the filter has run */
+  itkGetMacro(MeanResidual, double)
+
+  /** Mean number of iterations per voxel */
+  itkGetMacro(MeanIterations, double)
+
+  /** Number of voxels where the tolerance was not reached */
+  itkGetMacro(NumberOfUnconvergedVoxels, unsigned long)
+
+protected:
+
+  FixedPointWarpInverseImageFilter()
+    : m_Tolerance(1e-4), m_MaxIterations(20), m_MaxResidual(0.0), m_MeanResidual(0.0),
+      m_MeanIterations(0.0), m_NumberOfUnconvergedVoxels(0) {}
+
+  ~FixedPointWarpInverseImageFilter() {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  virtual void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                                    itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void AfterThreadedGenerateData() ITK_OVERRIDE;
+
+private:
+  FixedPointWarpInverseImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  double m_Tolerance;
+  int m_MaxIterations;
+
+  double m_MaxResidual, m_MeanResidual, m_MeanIterations;
+  unsigned long m_NumberOfUnconvergedVoxels;
+
+  // Per-thread statistics
+  struct ThreadData
+  {
+    double max_residual, sum_residual;
+    unsigned long n_iter, n_voxels, n_unconverged;
+    ThreadData() : max_residual(0.0), sum_residual(0.0), n_iter(0), n_voxels(0), n_unconverged(0) {}
+  };
+
+  std::vector<ThreadData> m_ThreadData;
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "FixedPointWarpInverseImageFilter.txx"
+#endif
+
+#endif // FIXEDPOINTWARPINVERSEIMAGEFILTER_H
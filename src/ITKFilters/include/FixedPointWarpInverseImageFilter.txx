@@ -0,0 +1,150 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef FIXEDPOINTWARPINVERSEIMAGEFILTER_TXX
+#define FIXEDPOINTWARPINVERSEIMAGEFILTER_TXX
+
+#include "FixedPointWarpInverseImageFilter.h"
+#include "FastLinearInterpolator.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include "itkImageLinearIteratorWithIndex.h"
+#include <algorithm>
+#include <cmath>
+
+template <class TDeformationField>
+void
+FixedPointWarpInverseImageFilter<TDeformationField>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  // The displacement may be sampled anywhere
+  DeformationFieldType *input = const_cast<DeformationFieldType *>(this->GetInput());
+  input->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TDeformationField>
+void
+FixedPointWarpInverseImageFilter<TDeformationField>
+::BeforeThreadedGenerateData()
+{
+  m_ThreadData.clear();
+  m_ThreadData.resize(this->GetNumberOfThreads());
+}
+
+template <class TDeformationField>
+void
+FixedPointWarpInverseImageFilter<TDeformationField>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  DeformationFieldType *u = const_cast<DeformationFieldType *>(this->GetInput());
+  DeformationFieldType *out = this->GetOutput();
+  ThreadData &td = m_ThreadData[threadId];
+
+  typedef FastLinearInterpolator<DeformationFieldType, RealType, ImageDimension> FastInterpolator;
+  typedef typename FastInterpolator::OutputComponentType InterpVectorType;
+  FastInterpolator fi(u);
+
+  double tol_sq = m_Tolerance * m_Tolerance;
+  int line_len = outputRegionForThread.GetSize(0);
+  RealType cix[ImageDimension];
+
+  typedef itk::ImageLinearIteratorWithIndex<DeformationFieldType> IterBase;
+  typedef IteratorExtender<IterBase> IterType;
+  for(IterType it(out, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    DeformationVectorType *v_line = it.GetPixelPointer(out);
+    typename DeformationFieldType::IndexType idx = it.GetIndex();
+
+    for(int i = 0; i < line_len; i++, idx[0]++)
+      {
+      DeformationVectorType v;
+      v.Fill(0.0);
+
+      // Iterate at this voxel until the update is small enough
+      double delta_sq = 0.0;
+      int iter = 0;
+      for(; iter < m_MaxIterations; iter++)
+        {
+        for(int d = 0; d < ImageDimension; d++)
+          cix[d] = idx[d] + v[d];
+
+        InterpVectorType w;
+        if(fi.Interpolate(cix, &w) == FastInterpolator::OUTSIDE)
+          w.Fill(0.0);
+
+        delta_sq = 0.0;
+        for(int d = 0; d < ImageDimension; d++)
+          {
+          double v_new = -w[d];
+          delta_sq += (v_new - v[d]) * (v_new - v[d]);
+          v[d] = v_new;
+          }
+
+        if(delta_sq < tol_sq)
+          {
+          iter++;
+          break;
+          }
+        }
+
+      v_line[i] = v;
+
+      // Update the statistics
+      double residual = sqrt(delta_sq);
+      td.max_residual = std::max(td.max_residual, residual);
+      td.sum_residual += residual;
+      td.n_iter += iter;
+      td.n_voxels++;
+      if(delta_sq >= tol_sq)
+        td.n_unconverged++;
+      }
+    }
+}
+
+template <class TDeformationField>
+void
+FixedPointWarpInverseImageFilter<TDeformationField>
+::AfterThreadedGenerateData()
+{
+  ThreadData total;
+  for(unsigned int i = 0; i < m_ThreadData.size(); i++)
+    {
+    total.max_residual = std::max(total.max_residual, m_ThreadData[i].max_residual);
+    total.sum_residual += m_ThreadData[i].sum_residual;
+    total.n_iter += m_ThreadData[i].n_iter;
+    total.n_voxels += m_ThreadData[i].n_voxels;
+    total.n_unconverged += m_ThreadData[i].n_unconverged;
+    }
+
+  m_MaxResidual = total.max_residual;
+  m_MeanResidual = total.n_voxels ? total.sum_residual / total.n_voxels : 0.0;
+  m_MeanIterations = total.n_voxels ? total.n_iter * 1.0 / total.n_voxels : 0.0;
+  m_NumberOfUnconvergedVoxels = total.n_unconverged;
+}
+
+#endif // FIXEDPOINTWARPINVERSEIMAGEFILTER_TXX
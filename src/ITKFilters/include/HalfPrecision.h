@@ -0,0 +1,173 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef HALFPRECISION_H
+#define HALFPRECISION_H
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+#include "itkNumericTraits.h"
+
+/**
+ * 16-bit floating point storage types. These are meant for storing image
+ * intensities compactly: values are converted to float on read and rounded
+ * (to nearest, ties to even) on write, and all arithmetic happens in float or
+ * double through the implicit conversion.
+ *
+ *   Float16   IEEE 754 binary16: 11 bits of precision, values up to 65504
+ *             (larger values become infinity)
+ *   BFloat16  upper half of a binary32: 8 bits of precision, same range as float
+ */
+class Float16
+{
+public:
+  Float16() : m_Bits(0) {}
+  Float16(float f) : m_Bits(FromFloat(f)) {}
+
+  operator float() const { return ToFloat(m_Bits); }
+
+  uint16_t GetBits() const { return m_Bits; }
+
+  static uint16_t FromFloat(float f)
+    {
+    uint32_t x; memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000, ax = x & 0x7FFFFFFF;
+
+    // Infinity and NaN
+    if(ax >= 0x7F800000)
+      return sign | (ax > 0x7F800000 ? 0x7E00 : 0x7C00);
+
+    // Values that round beyond the largest half become infinity
+    if(ax >= 0x477FF000)
+      return sign | 0x7C00;
+
+    // Values below the smallest normal half are rounded to a multiple of 2^-24
+    if(ax < 0x38800000)
+      {
+      float af; memcpy(&af, &ax, 4);
+      return sign | (uint16_t) nearbyintf(af * 16777216.0f);
+      }
+
+    // Normal values: rebias the exponent and round the mantissa to nearest even
+    ax += 0xC8000FFF + ((ax >> 13) & 1);
+    return sign | (ax >> 13);
+    }
+
+  static float ToFloat(uint16_t h)
+    {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F, mant = h & 0x3FF, x;
+    if(exp == 0)
+      {
+      float f = mant * (1.0f / 16777216.0f);
+      return sign ? -f : f;
+      }
+    else if(exp == 31)
+      x = sign | 0x7F800000 | (mant << 13);
+    else
+      x = sign | ((exp + 112) << 23) | (mant << 13);
+
+    float f; memcpy(&f, &x, 4);
+    return f;
+    }
+
+protected:
+  uint16_t m_Bits;
+};
+
+class BFloat16
+{
+public:
+  BFloat16() : m_Bits(0) {}
+  BFloat16(float f) : m_Bits(FromFloat(f)) {}
+
+  operator float() const { return ToFloat(m_Bits); }
+
+  uint16_t GetBits() const { return m_Bits; }
+
+  static uint16_t FromFloat(float f)
+    {
+    uint32_t x; memcpy(&x, &f, 4);
+
+    // Keep NaNs quiet, so that truncation does not turn them into infinity
+    if((x & 0x7FFFFFFF) > 0x7F800000)
+      return (x >> 16) | 0x0040;
+
+    x += 0x7FFF + ((x >> 16) & 1);
+    return x >> 16;
+    }
+
+  static float ToFloat(uint16_t h)
+    {
+    uint32_t x = (uint32_t) h << 16;
+    float f; memcpy(&f, &x, 4);
+    return f;
+    }
+
+protected:
+  uint16_t m_Bits;
+};
+
+/**
+ * Numeric traits, so that the 16-bit types can be used as the component type of
+ * the images read by FastLinearInterpolator and the metric filters. Interpolated
+ * values are computed in float (FloatType) or double (RealType).
+ */
+template <class THalf>
+class HalfPrecisionNumericTraits : public std::numeric_limits<float>
+{
+public:
+  typedef THalf   ValueType;
+  typedef float   PrintType;
+  typedef THalf   AbsType;
+  typedef double  AccumulateType;
+  typedef double  RealType;
+  typedef double  ScalarRealType;
+  typedef float   FloatType;
+
+  static THalf ZeroValue() { return THalf(0.0f); }
+  static THalf OneValue() { return THalf(1.0f); }
+  static THalf ZeroValue(const THalf &) { return ZeroValue(); }
+  static THalf OneValue(const THalf &) { return OneValue(); }
+
+  static bool IsPositive(THalf val) { return (float) val > 0.0f; }
+  static bool IsNonpositive(THalf val) { return (float) val <= 0.0f; }
+  static bool IsNegative(THalf val) { return (float) val < 0.0f; }
+  static bool IsNonnegative(THalf val) { return (float) val >= 0.0f; }
+
+  static unsigned int GetLength(const THalf &) { return 1; }
+  static unsigned int GetLength() { return 1; }
+};
+
+namespace itk
+{
+template <> class NumericTraits<Float16> : public HalfPrecisionNumericTraits<Float16> {};
+template <> class NumericTraits<BFloat16> : public HalfPrecisionNumericTraits<BFloat16> {};
+}
+
+#endif // HALFPRECISION_H
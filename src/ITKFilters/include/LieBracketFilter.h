@@ -21,6 +21,7 @@
 #include "itkImageToImageFilter.h"
 #include "itkCovariantVector.h"
 #include "itkImageRegionIterator.h"
+#include "itkImageLinearIteratorWithIndex.h"
 
 
 /** 
@@ -29,7 +30,13 @@
  *
  * Given vector field U and vector field V, this computes J(u) v - J(v) u
  *
- * Optionally, the result can be added to a third input, x with scaling alpha
+ * Optionally, the result can be added to a third input, x.
+ *
+ * The Jacobians are never formed: the central differences of u and v along all
+ * dimensions are taken in a single pass over the output, one line at a time.
+ * Derivatives are in voxel units with zero-flux Neumann boundary conditions,
+ * matching itk::GradientImageFilter. The output must not share a buffer with
+ * the inputs.
  */
 template< typename TInputImage, typename TOutputImage>
 class ITK_TEMPLATE_EXPORT LieBracketFilter:
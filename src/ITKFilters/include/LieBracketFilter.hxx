@@ -83,92 +83,84 @@ LieBracketFilter< TInputImage, TOutputImage>
   const InputImageType *v = this->GetFieldV();
   const InputImageType *x = this->GetFieldX();
 
-  // Define the zero vector
-  InputPixelType zero_vec(0.0);
+  typedef typename InputImageType::IndexType IndexType;
+  typedef typename InputImageType::OffsetValueType OffsetValueType;
+  const unsigned int D = InputImageDimension;
 
-  // As the first pass, initialize the output to x if x was passed in, zero otherwise
-  if(x)
-    {
-    itk::ImageRegionIterator<OutputImageType> it0_out(out, outputRegionForThread);
-    itk::ImageRegionConstIterator<InputImageType> it0_in(x, outputRegionForThread);
-    for(; !it0_out.IsAtEnd(); ++it0_in, ++it0_out)
-      it0_out.Value() = it0_in.Value();
-    }
-  else
-    {
-    itk::ImageRegionIterator<OutputImageType> it0_out(out, outputRegionForThread);
-    for(; !it0_out.IsAtEnd(); ++it0_out)
-      it0_out.Value() = zero_vec;
-    }
-
-  // The scaling factor
+  // The scaling factor of the central difference
   double scale = 0.5;
 
-  // Iterate over the x, y and z derivatives
-  for(unsigned int i = 0; i < InputImageDimension; ++i)
+  // The strides of the u and v images
+  const OffsetValueType *stride_u = u->GetOffsetTable();
+  const OffsetValueType *stride_v = v->GetOffsetTable();
+
+  // Buffered regions of u and v, used to test for neighbors
+  const typename InputImageType::RegionType &reg_u = u->GetBufferedRegion();
+  const typename InputImageType::RegionType &reg_v = v->GetBufferedRegion();
+
+  // The length of the lines along the fastest-varying dimension
+  int line_len = outputRegionForThread.GetSize(0);
+
+  // Iterate over the output in lines along dimension 0. All the partial
+  // derivatives of u and v are taken at each voxel in a single pass
+  typedef itk::ImageLinearIteratorWithIndex<OutputImageType> IterType;
+  IterType it(out, outputRegionForThread); it.SetDirection(0);
+
+  for(; !it.IsAtEnd(); it.NextLine())
     {
-    // Create an iterator over the output region that traverses in lines
-    typedef itk::ImageLinearIteratorWithIndex<OutputImageType> IterBase;
-    typedef IteratorExtender<IterBase> IterType;
-    IterType it(out, outputRegionForThread); it.SetDirection(i);
-
-    // Get the stride of the u and v images
-    typename InputImageType::OffsetValueType stride_u = u->GetOffsetTable()[i];
-    typename InputImageType::OffsetValueType stride_v = v->GetOffsetTable()[i];
-
-    // The length of the line in this dimension
-    int line_len = outputRegionForThread.GetSize(i);
-
-    // Test whether there is data to the left and to the right (or we should use zeros)
-    typename InputImageType::IndexType test_idx = it.GetIndex(); 
-    test_idx[i] = it.GetIndex()[i] - 1;
-    bool have_u_left = u->GetBufferedRegion().IsInside(test_idx);
-    bool have_v_left = v->GetBufferedRegion().IsInside(test_idx);
-    test_idx[i] = it.GetIndex()[i] + line_len;
-    bool have_u_right = u->GetBufferedRegion().IsInside(test_idx);
-    bool have_v_right = v->GetBufferedRegion().IsInside(test_idx);
-
-    // Iterate over the lines of the output
-    for(; !it.IsAtEnd(); it.NextLine())
+    IndexType idx = it.GetIndex();
+
+    // Get the pointers into the input and output images
+    const InputPixelType *ptr_u = u->GetBufferPointer() + u->ComputeOffset(idx);
+    const InputPixelType *ptr_v = v->GetBufferPointer() + v->ComputeOffset(idx);
+    const InputPixelType *ptr_x = x ? x->GetBufferPointer() + x->ComputeOffset(idx) : NULL;
+    OutputPixelType *ptr_out = out->GetBufferPointer() + out->ComputeOffset(idx);
+
+    // Offsets to the neighbors on either side in each dimension. Where the neighbor
+    // falls outside of the buffered region, the boundary voxel is repeated, which
+    // gives the same zero-flux Neumann derivative as itk::GradientImageFilter. For
+    // dimensions other than 0 the offsets are constant along the line; for dimension
+    // 0 they hold at the two ends of the line
+    OffsetValueType um[D], up[D], vm[D], vp[D];
+    for(unsigned int d = 0; d < D; d++)
       {
-      // Get the pointers into the u and v images
-      const InputPixelType *ptr_u = u->GetBufferPointer() + u->ComputeOffset(it.GetIndex());
-      const InputPixelType *ptr_v = v->GetBufferPointer() + v->ComputeOffset(it.GetIndex());
-
-      // Get the output pointer
-      OutputPixelType *ptr_out = out->GetBufferPointer() + out->ComputeOffset(it.GetIndex());
+      IndexType test_idx = idx;
+      test_idx[d] = idx[d] - 1;
+      um[d] = reg_u.IsInside(test_idx) ? -stride_u[d] : 0;
+      vm[d] = reg_v.IsInside(test_idx) ? -stride_v[d] : 0;
+      test_idx[d] = idx[d] + (d == 0 ? line_len : 1);
+      up[d] = reg_u.IsInside(test_idx) ? stride_u[d] : 0;
+      vp[d] = reg_v.IsInside(test_idx) ? stride_v[d] : 0;
+      }
 
-      // These variables store the u and v vectors before and after the current point
-      const InputPixelType *u_left = (have_u_left) ? (ptr_u - stride_u) : &zero_vec;
-      const InputPixelType *v_left = (have_v_left) ? (ptr_v - stride_v) : &zero_vec;
-      const InputPixelType *u_right, *v_right;
+    // The offsets along dimension 0 at the two ends of the line
+    OffsetValueType um0 = um[0], vm0 = vm[0], up0 = up[0], vp0 = vp[0];
 
-      // Iterate over the current line, except the last pixel
-      for(int j = 0; j < line_len - 1; j++)
+    for(int j = 0; j < line_len; j++, ++ptr_u, ++ptr_v, ++ptr_out)
+      {
+      um[0] = (j > 0) ? -stride_u[0] : um0;
+      vm[0] = (j > 0) ? -stride_v[0] : vm0;
+      up[0] = (j < line_len - 1) ? stride_u[0] : up0;
+      vp[0] = (j < line_len - 1) ? stride_v[0] : vp0;
+
+      // Start with x, or with zero
+      OutputPixelType res;
+      if(ptr_x)
+        res = *(ptr_x++);
+      else
+        res.Fill(0.0);
+
+      // Accumulate the directional derivatives of u along v and of v along u
+      const InputPixelType &u_c = *ptr_u, &v_c = *ptr_v;
+      for(unsigned int d = 0; d < D; d++)
         {
-        // Set the left and right pointers
-        u_right = ptr_u + stride_u; v_right = ptr_v + stride_v;
-
-        // Compute the directional derivative of u and v
-        for(int k = 0; k < InputImageDimension; k++)
-          ptr_out[k] += scale * (
-            ((*u_right)[k] - (*u_left)[k]) * (*ptr_v)[i] - 
-            ((*v_right)[k] - (*v_left)[k]) * (*ptr_u)[i]);
-
-        // Update the pointers
-        u_left = ptr_u; v_left = ptr_v;
-        ptr_u = u_right; ptr_v = v_right;
+        const InputPixelType &u_m = ptr_u[um[d]], &u_p = ptr_u[up[d]];
+        const InputPixelType &v_m = ptr_v[vm[d]], &v_p = ptr_v[vp[d]];
+        for(unsigned int k = 0; k < D; k++)
+          res[k] += scale * ((u_p[k] - u_m[k]) * v_c[d] - (v_p[k] - v_m[k]) * u_c[d]);
         }
 
-      // Last pixel - do the right side
-      u_right = have_u_right ? (ptr_u + stride_u) : &zero_vec;
-      v_right = have_v_right ? (ptr_v + stride_v) : &zero_vec;
-
-      // Compute the directional derivative of u and v
-      for(int k = 0; k < InputImageDimension; k++)
-        ptr_out[k] += scale * (
-          ((*u_right)[k] - (*u_left)[k]) * (*ptr_v)[i] - 
-          ((*v_right)[k] - (*v_left)[k]) * (*ptr_u)[i]);
+      *ptr_out = res;
       }
     }
 }
@@ -58,7 +58,8 @@ struct DefaultMahalanobisDistanceToTargetMetricTraits
  * and a multivariate Gaussian density on displacement at every voxel. The Gaussian
  * density is passed in as the fixed image, and encoded in a multi-component image
  * that at each voxel stores the mean displacement and the upper triangle and diagonal
- * of the inverse covariance matrix. The moving image is ignored.
+ * of the inverse covariance matrix, both in voxel units of the deformation field
+ * (see MultiImageOpticalFlowHelper::GetMahalanobisStats). The moving image is ignored.
  */
 template <class TMetricTraits>
 class ITK_EXPORT MahalanobisDistanceToTargetWarpMetric :
@@ -89,6 +90,7 @@ public:
   typedef typename Superclass::MetricPixelType               MetricPixelType;
   typedef typename Superclass::GradientPixelType             GradientPixelType;
   typedef typename Superclass::RealType                      RealType;
+  typedef typename Superclass::MaskImageType                 MaskImageType;
 
   typedef typename Superclass::IndexType                     IndexType;
   typedef typename Superclass::IndexValueType                IndexValueType;
@@ -121,6 +123,10 @@ protected:
   virtual void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
                                     itk::ThreadIdType threadId ) ITK_OVERRIDE;
 
+  // Dense metric and gradient, computed directly on the image buffers
+  void ThreadedGenerateDataDense(const OutputImageRegionType& outputRegionForThread,
+                                 typename Superclass::ThreadData &td);
+
 protected:
   MahalanobisDistanceToTargetWarpMetric() {}
 
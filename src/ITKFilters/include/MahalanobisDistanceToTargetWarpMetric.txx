@@ -118,7 +118,7 @@ public:
     TFloat s_ww = mah_data[13];
 
     // Compute
-    TFloat md = d_x * d_x * s_xx + d_y * d_y * s_yy + d_z * d_z * s_zz + d_w * s_ww +
+    TFloat md = d_x * d_x * s_xx + d_y * d_y * s_yy + d_z * d_z * s_zz + d_w * d_w * s_ww +
       2 * (d_x * d_y * s_xy + d_x * d_z * s_xz + d_x * d_w * s_xw + 
            d_y * d_z * s_yz + d_y * d_w * s_yw +
            d_z * d_w * s_zw);
@@ -144,12 +144,15 @@ void
 MahalanobisDistanceToTargetWarpMetric<TMetricTraits>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
 {
-  // Get the fixed image (means and inverse covariances)
-  InputImageType *stats = this->GetFixedImage();
-  int nc = stats->GetNumberOfComponentsPerPixel();
+  // Get the per-component metric array
+  typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
 
-  // Get the deformation field
-  DeformationFieldType *phi = this->GetDeformationField();
+  // The dense metric does not need any interpolation, so it reads the buffers directly
+  if(!this->m_ComputeAffine)
+    {
+    this->ThreadedGenerateDataDense(outputRegionForThread, td);
+    return;
+    }
 
   // Create an iterator specialized for going through metrics
   typedef MultiComponentMetricWorker<TMetricTraits, MetricImageType> InterpType;
@@ -158,19 +161,11 @@ MahalanobisDistanceToTargetWarpMetric<TMetricTraits>
   // The functor that does the actual computation
   typedef MahalanobisDistanceFunctor<typename TMetricTraits::RealType, ImageDimension> Functor;
 
-  // Get the per-component metric array
-  typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
-
   // Loop over the lines
   for (; !iter.IsAtEnd(); iter.NextLine())
     {
-    // If we are computing deforamble gradient, get a pointer to the gradient line
-
-    // Temporary gradient pixel
-    GradientPixelType grad_metric;
-
     // Are we computing affine?
-    if(this->m_ComputeAffine && this->m_ComputeGradient)
+    if(this->m_ComputeGradient)
       {
       GradientPixelType grad_metric;
       for(; !iter.IsAtEndOfLine(); ++iter)
@@ -192,35 +187,14 @@ MahalanobisDistanceToTargetWarpMetric<TMetricTraits>
           }
         }
       }
-    else if(this->m_ComputeGradient)
-      {
-      // Pointer to the gradient
-      GradientPixelType *grad_line =
-        this->GetDeformationGradientOutput()->GetBufferPointer() + iter.GetOffsetInPixels();
-
-        for(; !iter.IsAtEndOfLine(); ++iter, ++grad_line)
-          {
-          if(iter.CheckFixedMask())
-            {
-            RealType m = Functor::compute(
-              iter.GetFixedLine(), 
-              iter.GetDisplacement()->GetDataPointer(), 
-              grad_line->GetDataPointer());
-            *iter.GetOutputLine() = m;
-            td.metric += m;
-            td.mask += 1.0;
-            }
-          }
-      }
     else
       {
-      // No affine, no gradient
+      // Affine metric without the gradient
       for(; !iter.IsAtEndOfLine(); ++iter)
         {
         if(iter.CheckFixedMask())
           {
-          RealType m = Functor::compute(
-            iter.GetFixedLine(), iter.GetDisplacement()->GetDataPointer(), NULL);
+          RealType m = Functor::compute(iter.GetFixedLine(), iter.GetSamplePos().data_block(), NULL);
           *iter.GetOutputLine() = m;
           td.metric += m;
           td.mask += 1.0;
@@ -231,6 +205,64 @@ MahalanobisDistanceToTargetWarpMetric<TMetricTraits>
 }
 
 
+template <class TMetricTraits>
+void
+MahalanobisDistanceToTargetWarpMetric<TMetricTraits>
+::ThreadedGenerateDataDense(const OutputImageRegionType &outputRegionForThread,
+                            typename Superclass::ThreadData &td)
+{
+  // The packed per-voxel means and inverse covariances
+  InputImageType *stats = this->GetFixedImage();
+  int nc = stats->GetNumberOfComponentsPerPixel();
+  int line_len = outputRegionForThread.GetSize()[0];
+
+  // The functor that does the actual computation
+  typedef MahalanobisDistanceFunctor<RealType, ImageDimension> Functor;
+
+  // Images that are read and written
+  MetricImageType *metric = this->GetMetricOutput();
+  DeformationFieldType *phi = this->GetDeformationField();
+  GradientImageType *grad = this->m_ComputeGradient ? this->GetDeformationGradientOutput() : NULL;
+  MaskImageType *mask = this->GetFixedMaskImage();
+
+  // Iterate over the lines of the region
+  typedef itk::ImageLinearConstIteratorWithIndex<MetricImageType> IteratorTypeBase;
+  typedef IteratorExtender<IteratorTypeBase> IteratorType;
+  IteratorType it(metric, outputRegionForThread);
+  for (; !it.IsAtEnd(); it.NextLine())
+    {
+    long offset_in_pixels = it.GetPosition() - metric->GetBufferPointer();
+
+    // Pointers to the data for this line
+    const InputComponentType *p_stats = stats->GetBufferPointer() + nc * offset_in_pixels;
+    const RealType *p_phi = phi->GetBufferPointer()[offset_in_pixels].GetDataPointer();
+    MetricPixelType *p_metric = metric->GetBufferPointer() + offset_in_pixels;
+    RealType *p_grad = grad ? grad->GetBufferPointer()[offset_in_pixels].GetDataPointer() : NULL;
+    const typename MaskImageType::PixelType *p_mask =
+        mask ? mask->GetBufferPointer() + offset_in_pixels : NULL;
+
+    // Displacements and gradients are stored contiguously, ImageDimension values per voxel
+    for(int i = 0; i < line_len; ++i, p_stats += nc, p_phi += ImageDimension)
+      {
+      if(!p_mask || p_mask[i] > 0.0)
+        {
+        RealType m = Functor::compute(p_stats, p_phi, p_grad ? p_grad + i * ImageDimension : NULL);
+        p_metric[i] = m;
+        td.metric += m;
+        td.mask += 1.0;
+        }
+      else
+        {
+        p_metric[i] = 0.0;
+        if(p_grad)
+          for(unsigned int d = 0; d < ImageDimension; d++)
+            p_grad[i * ImageDimension + d] = 0.0;
+        }
+      }
+    }
+}
+
+
 
 
 #endif // __MahalanobisDistanceToTargetWarpMetric_txx
@@ -90,6 +90,40 @@ public:
    */
   itkSetObjectMacro(WorkingImage, InputImageType)
 
+  /**
+   * Set the gradient of the fixed image, as generated by ComputeFixedGradientImage.
+   * The gradient only depends on the fixed image, so callers that evaluate the
+   * metric repeatedly at the same resolution level should compute it once and
+   * pass it in. When it is not supplied, the filter computes it on each update.
+   */
+  itkSetObjectMacro(FixedGradientImage, InputImageType)
+  itkGetObjectMacro(FixedGradientImage, InputImageType)
+
+  /**
+   * Compute the gradient of the fixed image in voxel units by central differences
+   * (one-sided at the image boundary). The output has ImageDimension components
+   * for each component of the fixed image.
+   */
+  static typename InputImageType::Pointer ComputeFixedGradientImage(InputImageType *fixed);
+
+  /**
+   * Set the accumulated fixed image channels, as generated by ComputeFixedSumsImage
+   * for the radius of the metric. Like the gradient, these only depend on the fixed
+   * image, so they can be computed once per resolution level. When they are not
+   * supplied, the filter computes them on each update.
+   */
+  itkSetObjectMacro(FixedSumsImage, InputImageType)
+  itkGetObjectMacro(FixedSumsImage, InputImageType)
+
+  /**
+   * Compute the fixed image channels used by the metric. The output holds the
+   * neighborhood size n, then the mean-subtracted intensity I of each component,
+   * then for each component the neighborhood sums of I and of I^2. If n_threads
+   * is positive, the sums are accumulated with that many threads.
+   */
+  static typename InputImageType::Pointer ComputeFixedSumsImage(
+      InputImageType *fixed, const SizeType &radius, int n_threads = 0);
+
   /**
    * Get the gradient scaling factor. To get the actual gradient of the metric, multiply the
    * gradient output of this filter by the scaling factor. Explanation: for efficiency, the
@@ -123,12 +157,14 @@ private:
   // unnecessary memory allocation
   typename InputImageType::Pointer m_WorkingImage;
 
+  // Gradient of the fixed image, supplied by the user or computed on update
+  typename InputImageType::Pointer m_FixedGradientImage;
+
+  // Accumulated fixed image channels, supplied by the user or computed on update
+  typename InputImageType::Pointer m_FixedSumsImage;
+
   // Radius of the cross-correlation
   SizeType m_Radius;
-
-  // Whether to compute the approximate gradient of the metric, as in Avants et al., 2008.
-  // When not set, the exact gradient is computed
-  bool m_ApproximateGradient;
 };
 
 
@@ -142,9 +178,10 @@ private:
  *
  * This filter takes a pair of images plus a warp and computes the components that
  * are used to calculate the cross-correlation metric between them and
- * the gradient. These components are in the form I, I*J, and
+ * the gradient. These components are in the form J, I*J, and
  * so on. These components must then be mean-filtered and combined to get the
- * metric and the gradient.
+ * metric and the gradient. The channels that only involve the fixed image are
+ * read from the fixed sums image of the parent.
  *
  * The output of this filter must be a vector image. The input may be a vector image.
  *
@@ -65,26 +65,25 @@ int
 MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
 ::GetNumberOfOutputComponents()
 {
-  // This is complex! The number of components depends on what we are computing.
+  // The fixed channels come from the fixed sums image, so we only need 4 output
+  // pixels per input comp.
   int nc = m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel();
-
-  // If there are no gradients computed, we just need 7 output pixels per input comp.
-  return 1 + nc * 7;
+  return nc * 4;
 }
 
 /**
  * Compute the output for the region specified by outputRegionForThread.
  *
- * Coding:
- *    1
- *    f
- *    m
- *    f
+ * Coding (nc components of J, then three channels per component):
+ *    m ...
  *    m
- *    f*f
  *    m*m
  *    f*m
  *    ...
+ *
+ * In the FIRST stage only the leading m channels are filled with the raw moving
+ * intensities. In the SECOND stage, they have been replaced by their neighborhood
+ * sums, and all channels are filled with the mean-subtracted intensities.
  */
 template <class TMetricTraits, class TOutputImage>
 void
@@ -97,6 +96,10 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
 
   // Get the number of input and output components
   int ncomp_in = m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel();
+  int ncomp_fix = 1 + 3 * ncomp_in;
+
+  // The accumulated fixed channels
+  const InputComponentType *p_fix_sums = m_Parent->GetFixedSumsImage()->GetBufferPointer();
 
   // Create an iterator specialized for going through metrics
   typedef MultiComponentMetricWorker<TMetricTraits, TOutputImage> InterpType;
@@ -110,6 +113,7 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
       {
       // Get the output pointer for this voxel
       OutputComponentType *out = iter.GetOutputLine();
+      OutputComponentType *out_sums = out + ncomp_in;
 
       // Interpolate the moving image at the current position. The worker knows
       // whether to interpolate the gradient or not
@@ -118,71 +122,43 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
       // Border should be ok here because we are not sampling the gradient
       if(status == FastInterpolator::OUTSIDE)
         {
-        // Place a zero in the output
-        *out++ = 1.0;
-
-        // Iterate over the components
+        // The moving image contributes nothing outside
         for(int k = 0; k < ncomp_in; k++)
           {
-          InputComponentType x_fix = iter.GetFixedLine()[k];
-          *out++ = x_fix;
-          *out++ = 0.0;
-          *out++ = x_fix;
-          *out++ = 0.0;
-          *out++ = x_fix * x_fix;
-          *out++ = 0.0;
           *out++ = 0.0;
+          *out_sums++ = 0.0;
+          *out_sums++ = 0.0;
+          *out_sums++ = 0.0;
           }
         }
 
-      else
+      else if(m_Stage == FIRST)
         {
-        if(m_Stage == FIRST)
+        for(int k = 0; k < ncomp_in; k++)
           {
-          // Place a zero in the output
-          *out++ = 1.0;
-
-          // Iterate over the components
-          for(int k = 0; k < ncomp_in; k++)
-            {
-            InputComponentType x_mov = iter.GetMovingSample()[k];
-            InputComponentType x_fix = iter.GetFixedLine()[k];
-
-            // Write the five components
-            *out++ = x_fix;
-            *out++ = x_mov;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            *out++ = 0.0;
-            }
+          *out++ = iter.GetMovingSample()[k];
+          *out_sums++ = 0.0;
+          *out_sums++ = 0.0;
+          *out_sums++ = 0.0;
           }
-        else
+        }
+
+      else
+        {
+        // The fixed channels for this voxel: the number of neighbors from the
+        // first round, followed by the mean-subtracted fixed intensities
+        const InputComponentType *p_fix =
+            p_fix_sums + ncomp_fix * (iter.GetOffsetInPixels() + iter.GetLinePos());
+        InputComponentType n_nbr = *p_fix++;
+
+        for(int k = 0; k < ncomp_in; k++)
           {
-          // Get the number of neighbors from last round
-          InputComponentType n_nbr = *out;
-
-          // Place a one in the output
-          out++;
-
-          // Iterate over the components
-          for(int k = 0; k < ncomp_in; k++)
-            {
-            InputComponentType x_mov_raw = iter.GetMovingSample()[k];
-            InputComponentType x_fix_raw = iter.GetFixedLine()[k];
-
-            // Write the five components
-            InputComponentType x_fix = x_fix_raw - *out / n_nbr;
-            *out++ = x_fix;
-            InputComponentType x_mov = x_mov_raw - *out / n_nbr;
-            *out++ = x_mov;
-            *out++ = x_fix;
-            *out++ = x_mov;
-            *out++ = x_fix * x_fix;
-            *out++ = x_mov * x_mov;
-            *out++ = x_fix * x_mov;
-            }
+          InputComponentType x_fix = p_fix[k];
+          InputComponentType x_mov = iter.GetMovingSample()[k] - *out / n_nbr;
+          *out++ = x_mov;
+          *out_sums++ = x_mov;
+          *out_sums++ = x_mov * x_mov;
+          *out_sums++ = x_fix * x_mov;
           }
         }
       }
@@ -205,39 +181,39 @@ MultiImageApproximateNCCPrecomputeFilter<TMetricTraits,TOutputImage>
  * comparing Greedy with ANTS
  */
 template <class TPixel, class TWeight, class TMetric, class TGradient>
-TPixel *
+void
 MultiImageApproximateNNCPostComputeFunction(
-    TPixel *ptr, TPixel *ptr_end, TWeight *weights, TMetric *ptr_metric, TGradient *ptr_gradient, int ImageDimension,
-    const TPixel *grad_fix, bool debug)
+    const TPixel *ptr_fix, const TPixel *ptr_mov, int nc, TWeight *weights,
+    TMetric *ptr_metric, TMetric *ptr_comp_metrics,
+    TGradient *ptr_gradient, int ImageDimension, const TPixel *grad_fix)
 {
   // Get the size of the mean filter kernel
-  TPixel n = *ptr++, one_over_n = 1.0 / n;
+  TPixel n = *ptr_fix++, one_over_n = 1.0 / n;
 
-  // Loop over components
-  int i_wgt = 0;
+  // Channels of the fixed and moving images, see the precompute filter
+  const TPixel *ptr_fix_sums = ptr_fix + nc, *ptr_mov_sums = ptr_mov + nc;
 
   // Initialize metric to zero
   *ptr_metric = 0;
 
-  for(; ptr < ptr_end; ++i_wgt)
+  for(int i_wgt = 0; i_wgt < nc; ++i_wgt)
     {
-    TPixel I_bar = *ptr++;
-    TPixel J_bar = *ptr++;
-    TPixel I_2bar = *ptr++;
-    TPixel J_2bar = *ptr++;
-    TPixel x_fix_sq = *ptr++;
-    TPixel x_mov_sq = *ptr++;
-    TPixel x_fix_mov = *ptr++;
+    TPixel I_bar = *ptr_fix++;
+    TPixel J_bar = *ptr_mov++;
+    TPixel I_2bar = *ptr_fix_sums++;
+    TPixel x_fix_sq = *ptr_fix_sums++;
+    TPixel J_2bar = *ptr_mov_sums++;
+    TPixel x_mov_sq = *ptr_mov_sums++;
+    TPixel x_fix_mov = *ptr_mov_sums++;
 
     TPixel sff = x_fix_sq - I_2bar * I_2bar * one_over_n;
     TPixel smm = x_mov_sq - J_2bar * J_2bar * one_over_n;
     TPixel smf = x_fix_mov - I_2bar * J_2bar * one_over_n;
 
-
     if(sff == 0 || smm == 0)
       {
-      if(ptr_gradient)
-        ptr += 3 * ImageDimension;
+      if(grad_fix)
+        grad_fix += ImageDimension;
       continue;
       }
 
@@ -246,36 +222,119 @@ MultiImageApproximateNNCPostComputeFunction(
 
     if(ptr_gradient)
       {
-
       // Term to multiply the gradient by...
       TPixel factor = -2.0 * zoop * (J_bar - (smf / sff) * I_bar);
 
-      //  2.0 * sfm / (sff * smm) * ( Ji - sfm / sff * Ii )
-
-      if(debug)
-        {
-        printf("Ii = %f, Ji = %f, sff = %f, sfm = %f, smm = %f\n", I_bar, J_bar, sff, smf, smm);
-        printf("Metric = %f\n", zoop * smf);
-        printf("GradF = %f, %f, %f\n", grad_fix[0], grad_fix[1], grad_fix[2]);
-        }
-
       for(int i = 0; i < ImageDimension; i++)
-        {
         (*ptr_gradient)[i] += factor * (*grad_fix++);
-        }
+      }
+
+    // Accumulate the metric
+    *ptr_metric += zoop * smf;
+    ptr_comp_metrics[i_wgt] += zoop * smf;
+    }
+}
 
-      if(debug)
+
+template <class TMetricTraits>
+typename MultiComponentApproximateNCCImageMetric<TMetricTraits>::InputImageType::Pointer
+MultiComponentApproximateNCCImageMetric<TMetricTraits>
+::ComputeFixedGradientImage(InputImageType *fixed)
+{
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+
+  // Allocate the output image, with ImageDimension components per input component
+  typename InputImageType::Pointer grad = InputImageType::New();
+  grad->CopyInformation(fixed);
+  grad->SetNumberOfComponentsPerPixel(ImageDimension * nc);
+  grad->SetRegions(fixed->GetBufferedRegion());
+  grad->Allocate();
+
+  // Strides of the fixed image buffer along each dimension, in pixels
+  SizeType size = fixed->GetBufferedRegion().GetSize();
+  long stride[ImageDimension];
+  stride[0] = 1;
+  for(unsigned int d = 1; d < ImageDimension; d++)
+    stride[d] = stride[d-1] * size[d-1];
+
+  const InputComponentType *p_fix = fixed->GetBufferPointer();
+  InputComponentType *p_out = grad->GetBufferPointer();
+  long np = fixed->GetBufferedRegion().GetNumberOfPixels();
+  for(long i = 0; i < np; i++)
+    {
+    // Neighbors along each dimension, clamped to the image
+    long i_lo[ImageDimension], i_hi[ImageDimension];
+    for(unsigned int d = 0; d < ImageDimension; d++)
+      {
+      long pos = (i / stride[d]) % size[d];
+      i_lo[d] = pos > 0 ? i - stride[d] : i;
+      i_hi[d] = pos + 1 < (long) size[d] ? i + stride[d] : i;
+      }
+
+    for(int k = 0; k < nc; k++)
+      {
+      for(unsigned int d = 0; d < ImageDimension; d++)
         {
-        printf("Deriv = %g, %g, %g\n", (*ptr_gradient)[0], (*ptr_gradient)[1], (*ptr_gradient)[2]);
+        long span = (i_hi[d] - i_lo[d]) / stride[d];
+        *p_out++ = span > 0
+                   ? (p_fix[i_hi[d] * nc + k] - p_fix[i_lo[d] * nc + k]) / span
+                   : 0.0;
         }
       }
+    }
+
+  return grad;
+}
+
+
+template <class TMetricTraits>
+typename MultiComponentApproximateNCCImageMetric<TMetricTraits>::InputImageType::Pointer
+MultiComponentApproximateNCCImageMetric<TMetricTraits>
+::ComputeFixedSumsImage(InputImageType *fixed, const SizeType &radius, int n_threads)
+{
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+  int nc_out = 1 + 3 * nc;
+
+  // Allocate the output image
+  typename InputImageType::Pointer sums = InputImageType::New();
+  sums->CopyInformation(fixed);
+  sums->SetNumberOfComponentsPerPixel(nc_out);
+  sums->SetRegions(fixed->GetBufferedRegion());
+  sums->Allocate();
+
+  // First round: the count and the intensities, accumulated to get the means
+  const InputComponentType *p_fix = fixed->GetBufferPointer();
+  InputComponentType *p_out = sums->GetBufferPointer();
+  long np = fixed->GetBufferedRegion().GetNumberOfPixels();
+  for(long i = 0; i < np; i++, p_out += nc_out, p_fix += nc)
+    {
+    p_out[0] = 1.0;
+    for(int k = 0; k < nc; k++)
+      {
+      p_out[1 + k] = p_fix[k];
+      p_out[1 + nc + 2 * k] = 0.0;
+      p_out[2 + nc + 2 * k] = 0.0;
+      }
+    }
 
+  sums = AccumulateNeighborhoodSumsInPlace(sums.GetPointer(), radius, 0, 2 * nc, false, n_threads);
 
-    // Accumulate the metric
-    *ptr_metric += zoop * smf;
+  // Second round: subtract the means and accumulate I and I^2
+  p_fix = fixed->GetBufferPointer();
+  p_out = sums->GetBufferPointer();
+  for(long i = 0; i < np; i++, p_out += nc_out, p_fix += nc)
+    {
+    InputComponentType n_nbr = p_out[0];
+    for(int k = 0; k < nc; k++)
+      {
+      InputComponentType x_fix = p_fix[k] - p_out[1 + k] / n_nbr;
+      p_out[1 + k] = x_fix;
+      p_out[1 + nc + 2 * k] = x_fix;
+      p_out[2 + nc + 2 * k] = x_fix * x_fix;
+      }
     }
 
-  return ptr;
+  return AccumulateNeighborhoodSumsInPlace(sums.GetPointer(), radius, 1 + nc, 0, false, n_threads);
 }
 
 
@@ -289,6 +348,18 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
   // Call the parent method
   Superclass::BeforeThreadedGenerateData();
 
+  // The gradient of the fixed image, if not supplied by the caller
+  if(this->m_ComputeGradient && m_FixedGradientImage.IsNull())
+    m_FixedGradientImage = ComputeFixedGradientImage(this->GetFixedImage());
+
+  // The fixed image channels, if not supplied by the caller
+  if(m_FixedSumsImage.IsNull())
+    m_FixedSumsImage = ComputeFixedSumsImage(this->GetFixedImage(), m_Radius, this->GetNumberOfThreads());
+
+  // Allocate a working image if the user did not supply one
+  if(m_WorkingImage.IsNull())
+    m_WorkingImage = InputImageType::New();
+
   // Pre-compute filter 1
   typedef MultiImageApproximateNCCPrecomputeFilter<TMetricTraits, InputImageType> PreFilterType;
   typename PreFilterType::Pointer preFilter1 = PreFilterType::New();
@@ -298,23 +369,19 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
   preFilter1->SetInput(this->GetFixedImage());
 
   // Number of components in the working image
+  int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
   int ncomp = preFilter1->GetNumberOfOutputComponents();
 
-  // If the user supplied a working image, configure it and graft it as output
-  if(m_WorkingImage)
-    {
-    // Configure the working image
-    m_WorkingImage->CopyInformation(this->GetFixedImage());
-    m_WorkingImage->SetNumberOfComponentsPerPixel(ncomp);
-    m_WorkingImage->SetRegions(this->GetFixedImage()->GetBufferedRegion());
-    m_WorkingImage->Allocate();
-
-    // Graft the working image onto the filter's output
-    preFilter1->GraftOutput(m_WorkingImage);
-    }
+  // Configure the working image and graft it as output
+  m_WorkingImage->CopyInformation(this->GetFixedImage());
+  m_WorkingImage->SetNumberOfComponentsPerPixel(ncomp);
+  m_WorkingImage->SetRegions(this->GetFixedImage()->GetBufferedRegion());
+  m_WorkingImage->Allocate();
+  preFilter1->GraftOutput(m_WorkingImage);
 
   // Execute the filter
   preFilter1->SetStage(PreFilterType::FIRST);
+  preFilter1->SetNumberOfThreads(this->GetNumberOfThreads());
   preFilter1->Update();
 
 #ifdef DUMP_NCC
@@ -324,27 +391,9 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
   pwriter->Update();
 #endif
 
-  // First round of accumulation
-  typedef OneDimensionalInPlaceAccumulateFilter<InputImageType> AccumFilterType;
-
-  // Create a chain of separable 1-D filters
-  typename itk::ImageSource<InputImageType>::Pointer pipeTail;
-  for(int dir = 0; dir < ImageDimension; dir++)
-    {
-    typename AccumFilterType::Pointer accum = AccumFilterType::New();
-    if(pipeTail.IsNull())
-      accum->SetInput(preFilter1->GetOutput());
-    else
-      accum->SetInput(pipeTail->GetOutput());
-    accum->SetComponentRange(0, 5);
-    accum->SetDimension(dir);
-    accum->SetRadius(m_Radius[dir]);
-    pipeTail = accum;
-
-    accum->Update();
-    }
-
-  // At this point, we want to pull out components 1-3 from the working image
+  // First round of accumulation, of the moving intensities only
+  AccumulateNeighborhoodSumsInPlace(preFilter1->GetOutput(), m_Radius, 0, ncomp - nc_img,
+                                    false, this->GetNumberOfThreads());
 
   // Perform the second round of accumulation
   typename PreFilterType::Pointer preFilter2 = PreFilterType::New();
@@ -356,6 +405,7 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
 
   // Execute the filter
   preFilter2->SetStage(PreFilterType::SECOND);
+  preFilter2->SetNumberOfThreads(this->GetNumberOfThreads());
   preFilter2->Update();
 
 #ifdef DUMP_NCC
@@ -365,61 +415,45 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
   pwriter1->Update();
 #endif
 
-  // Create a chain of separable 1-D filters
-  pipeTail = NULL;
-  for(int dir = 0; dir < ImageDimension; dir++)
-    {
-    typename AccumFilterType::Pointer accum = AccumFilterType::New();
-    if(pipeTail.IsNull())
-      accum->SetInput(preFilter2->GetOutput());
-    else
-      accum->SetInput(pipeTail->GetOutput());
-    accum->SetComponentRange(3, 0);
-    accum->SetDimension(dir);
-    accum->SetRadius(m_Radius[dir]);
-    pipeTail = accum;
-
-    accum->Update();
-    }
+  // Second round, leaving the mean-subtracted moving intensities in place
+  AccumulateNeighborhoodSumsInPlace(preFilter2->GetOutput(), m_Radius, nc_img, 0,
+                                    false, this->GetNumberOfThreads());
 
 #ifdef DUMP_NCC
   typename itk::ImageFileWriter<InputImageType>::Pointer pwriter2 = itk::ImageFileWriter<InputImageType>::New();
-  pwriter2->SetInput(pipeTail->GetOutput());
+  pwriter2->SetInput(m_WorkingImage);
   pwriter2->SetFileName("nccaccum.nii.gz");
   pwriter2->Update();
 #endif
 }
 
-// TODO: this only needs to be computed once per resolution level
-#include <itkVectorImageCentralDifferenceImageFunction.h>
-
 template <class TMetricTraits>
 void
 MultiComponentApproximateNCCImageMetric<TMetricTraits>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
 {
+  int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
   int nc = m_WorkingImage->GetNumberOfComponentsPerPixel();
+  int nc_fix = m_FixedSumsImage->GetNumberOfComponentsPerPixel();
   int line_len = outputRegionForThread.GetSize()[0];
 
   // Our thread data
   typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
 
+  // Where to store the accumulated metric (gets copied to td, but should have TPixel type)
+  vnl_vector<InputComponentType> comp_metric(nc_img, 0.0);
+
   // Set up an iterator for the working image
   typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> InputIteratorTypeBase;
   typedef IteratorExtender<InputIteratorTypeBase> InputIteratorType;
   InputIteratorType it(m_WorkingImage, outputRegionForThread);
 
-  // TODO: this can be pre-computed!
-  /* BEGIN: fixed gradient comp */
-  // Set up the fixed gradient calculator
+  // The affine gradient is not implemented for this metric
+  if(this->m_ComputeAffine)
+    return;
 
-  typedef itk::VectorImageCentralDifferenceImageFunction<InputImageType, RealType> CDType;
-  typename CDType::Pointer cdiff = CDType::New();
-  cdiff->SetInputImage(this->GetFixedImage());
-  IndexType index;
-  int grad_fixed_length = ImageDimension * this->GetFixedImage()->GetNumberOfComponentsPerPixel();
-  RealType *grad_fixed = new RealType[grad_fixed_length];
-  itk::VariableLengthVector<RealType> grad_fixed_vec(grad_fixed, grad_fixed_length);
+  // Number of components in the fixed gradient image
+  int nc_grad = ImageDimension * nc_img;
 
   // Loop over the lines
   for (; !it.IsAtEnd(); it.NextLine())
@@ -428,67 +462,57 @@ MultiComponentApproximateNCCImageMetric<TMetricTraits>
     long offset_in_pixels = it.GetPosition() - m_WorkingImage->GetBufferPointer();
 
     // Pointer to the input pixel data for this line
-    InputComponentType *p_input = m_WorkingImage->GetBufferPointer() + nc * offset_in_pixels;
+    const InputComponentType *p_input = m_WorkingImage->GetBufferPointer() + nc * offset_in_pixels;
+
+    // Pointer to the fixed channels for this line
+    const InputComponentType *p_fix = m_FixedSumsImage->GetBufferPointer() + nc_fix * offset_in_pixels;
 
     // Pointer to the metric data for this line
     MetricPixelType *p_metric = this->GetMetricOutput()->GetBufferPointer() + offset_in_pixels;
 
     // The gradient output is optional
-    GradientPixelType *p_grad_metric = (this->m_ComputeGradient && !this->m_ComputeAffine)
+    GradientPixelType *p_grad_metric = this->m_ComputeGradient
                                        ? this->GetDeformationGradientOutput()->GetBufferPointer() + offset_in_pixels
                                        : NULL;
 
-    // Index: for gradient computation (remove later)
-    index = it.GetIndex();
+    // The fixed image gradient for this line
+    const InputComponentType *p_grad_fix = this->m_ComputeGradient
+                                           ? m_FixedGradientImage->GetBufferPointer() + nc_grad * offset_in_pixels
+                                           : NULL;
 
-    // Case 1 - dense gradient field requested
-    if(!this->m_ComputeAffine)
-      {
-      if(this->m_ComputeGradient)
-        {
-        // Loop over the pixels in the line
-        for(int i = 0; i < line_len; ++i)
-          {
-          // Clear the metric and the gradient
-          *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
-
-          // Gradient of the fixed image is passed in through the p_grad_metric!
-          *p_grad_metric = itk::NumericTraits<GradientPixelType>::Zero;
-
-          // Compute the gradient
-          index[0] = i;
-          cdiff->EvaluateAtIndex(index, grad_fixed_vec);
-
-          bool debugff = (it.GetIndex()[1] == 33 && it.GetIndex()[2] == 22 && i == 44);
-          p_input = MultiImageApproximateNNCPostComputeFunction(p_input, p_input + nc, this->m_Weights.data_block(),
-                                                                p_metric, p_grad_metric++, ImageDimension, grad_fixed, debugff);
-          // Accumulate the total metric
-          td.metric += *p_metric;
-          td.mask += 1.0;
-          }
-        }
-      else
-        {
-        // Loop over the pixels in the line
-        for(int i = 0; i < line_len; ++i)
-          {
-          // Clear the metric and the gradient
-          *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
+    // Get the fixed mask line
+    typename MaskImageType::PixelType *fixed_mask_line =
+        this->GetFixedMaskImage()
+        ? this->GetFixedMaskImage()->GetBufferPointer() + offset_in_pixels
+        : NULL;
 
-          // Apply the post computation
-          p_input = MultiImageApproximateNNCPostComputeFunction(p_input, p_input + nc, this->m_Weights.data_block(),
-                                                                p_metric, (GradientPixelType *)(NULL), ImageDimension,
-                                                                (const RealType *) NULL, false);
+    // Loop over the pixels in the line
+    for(int i = 0; i < line_len; ++i, ++p_metric, p_input += nc, p_fix += nc_fix)
+      {
+      // Clear the metric and the gradient
+      *p_metric = itk::NumericTraits<MetricPixelType>::ZeroValue();
+      if(p_grad_metric)
+        p_grad_metric[i] = itk::NumericTraits<GradientPixelType>::ZeroValue();
 
-          // Accumulate the total metric
-          td.metric += *p_metric;
-          td.mask += 1.0;
-          }
+      if(!fixed_mask_line || fixed_mask_line[i] > 0.5)
+        {
+        // Apply the post computation
+        MultiImageApproximateNNCPostComputeFunction(
+              p_fix, p_input, nc_img, this->m_Weights.data_block(),
+              p_metric, comp_metric.data_block(),
+              p_grad_metric ? p_grad_metric + i : (GradientPixelType *) NULL,
+              (int) ImageDimension, p_grad_fix ? p_grad_fix + nc_grad * i : NULL);
+
+        // Accumulate the total metric
+        td.metric += *p_metric;
+        td.mask += 1.0;
         }
       }
     }
 
-  delete[] grad_fixed;
+  // Typecast the per-component metrics
+  for(int a = 0; a < nc_img; a++)
+    td.comp_metric[a] = comp_metric[a];
 }
 
 
@@ -53,6 +53,17 @@ template <class TReal, unsigned int VDim> struct DefaultMultiComponentImageMetri
   typedef TReal RealType;
 };
 
+/**
+ * Traits for metrics whose fixed and moving images store their components in a
+ * type other than TReal, e.g., the 16-bit types in HalfPrecision.h. The metric
+ * arithmetic is still carried out in TReal
+ */
+template <class TReal, class TInputComponent, unsigned int VDim>
+struct MultiComponentImageMetricStorageTraits : public DefaultMultiComponentImageMetricTraits<TReal, VDim>
+{
+  typedef itk::VectorImage<TInputComponent, VDim> InputImageType;
+};
+
 
 /**
  * \class MultiComponentImageMetricBase
@@ -165,6 +176,21 @@ public:
 
   itkGetMacro(AffineTransform, TransformType *)
 
+  /**
+   * Set an affine transform that is composed with the deformation field, so that
+   * the moving image is sampled at A(x + phi(x)) rather than at x + phi(x). The
+   * composition is evaluated at each sample, and the deformation gradients are
+   * with respect to phi, i.e., the residual deformation after the affine. This
+   * is only used with a deformation field, and may be NULL (the default)
+   */
+  void SetDeformationAffineTransform(TransformType *transform)
+  {
+    this->m_DeformationAffineTransform = transform;
+    this->Modified();
+  }
+
+  itkGetMacro(DeformationAffineTransform, TransformType *)
+
   /** Set the weight vector - for different components in the input image */
   itkSetMacro(Weights, WeightVectorType)
   itkGetConstMacro(Weights, WeightVectorType)
@@ -200,6 +226,22 @@ public:
   /** Get the gradient of the affine transform */
   itkGetMacro(AffineTransformGradient, TransformType *)
 
+  /**
+   * Whether to also compute the Gauss-Newton approximation of the Hessian of the
+   * metric with respect to the affine parameters, i.e., J^T J for the residuals.
+   * This is only supported by metrics that are sums of squared residuals, and is
+   * only computed together with the affine gradient
+   */
+  itkSetMacro(ComputeAffineHessian, bool)
+  itkGetMacro(ComputeAffineHessian, bool)
+
+  /**
+   * Get the Gauss-Newton Hessian of the metric, in the order of the parameters
+   * of flatten_affine_transform(). Unlike the gradient, it is not arbitrarily scaled
+   */
+  const vnl_matrix<double> &GetAffineTransformHessian() const
+    { return m_AffineTransformHessian; }
+
   /**
    * Get the gradient scaling factor. To get the actual gradient of the metric, multiply the
    * gradient output of this filter by the scaling factor. Explanation: for efficiency, the
@@ -234,6 +276,11 @@ protected:
   virtual typename itk::DataObject::Pointer MakeOutput(const DataObjectIdentifierType &) ITK_OVERRIDE;
 
   void UpdateOutputs();
+
+  /** Whether the Gauss-Newton Hessian is accumulated in this run */
+  bool UseAffineHessian() const
+    { return m_ComputeAffineHessian && m_ComputeAffine && m_ComputeGradient; }
+
   void ToggleOutput(bool flag, const DataObjectIdentifierType &key);
 
   virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
@@ -247,6 +294,7 @@ protected:
   bool m_ComputeMovingDomainMask;
   bool m_ComputeGradient;
   bool m_ComputeAffine;
+  bool m_ComputeAffineHessian;
 
   // Data accumulated for each thread
   struct ThreadData {
@@ -256,6 +304,10 @@ protected:
     vnl_vector<double> comp_metric;
 
     vnl_vector<double> gradient, grad_mask;
+
+    // Gauss-Newton Hessian, only allocated when requested
+    vnl_matrix<double> hessian;
+
     ThreadData() : metric(0.0), mask(0.0),
       gradient(ImageDimension * (ImageDimension+1), 0.0),
       grad_mask(ImageDimension * (ImageDimension+1), 0.0) {}
@@ -273,6 +325,12 @@ protected:
   // Affine transform
   typename TransformType::Pointer m_AffineTransform, m_AffineTransformGradient;
 
+  // Gauss-Newton Hessian of the metric wrt the affine parameters
+  vnl_matrix<double> m_AffineTransformHessian;
+
+  // Affine transform composed with the deformation field
+  typename TransformType::Pointer m_DeformationAffineTransform;
+
 private:
   MultiComponentImageMetricBase(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
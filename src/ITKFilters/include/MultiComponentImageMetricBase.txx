@@ -40,6 +40,7 @@ MultiComponentImageMetricBase<TMetricTraits>
   this->m_ComputeGradient = false;
   this->m_ComputeMovingDomainMask = false;
   this->m_ComputeAffine = false;
+  this->m_ComputeAffineHessian = false;
 }
 
 
@@ -114,6 +115,8 @@ MultiComponentImageMetricBase<TMetricTraits>
     {
     ThreadData td;
     td.comp_metric = vnl_vector<double>(fixed->GetNumberOfComponentsPerPixel(), 0.0);
+    if(this->UseAffineHessian())
+      td.hessian = vnl_matrix<double>(td.gradient.size(), td.gradient.size(), 0.0);
     m_ThreadData.push_back(td);
     }
 }
@@ -137,6 +140,13 @@ MultiComponentImageMetricBase<TMetricTraits>
     m_AccumulatedData.gradient += m_ThreadData[i].gradient;
     m_AccumulatedData.grad_mask += m_ThreadData[i].grad_mask;
     m_AccumulatedData.comp_metric += m_ThreadData[i].comp_metric;
+    if(this->UseAffineHessian())
+      {
+      if(i == 0)
+        m_AccumulatedData.hessian = m_ThreadData[i].hessian;
+      else
+        m_AccumulatedData.hessian += m_ThreadData[i].hessian;
+      }
     }
 
   /*
@@ -165,6 +175,11 @@ MultiComponentImageMetricBase<TMetricTraits>
 
     // Pack into the output
     unflatten_affine_transform(grad_metric.data_block(), m_AffineTransformGradient.GetPointer());
+
+    // The metric is the sum of squared residuals over the mask, so its Hessian is
+    // approximated by twice J^T J over the mask. The mask gradient terms are omitted
+    if(this->UseAffineHessian())
+      m_AffineTransformHessian = m_AccumulatedData.hessian * (2.0 / m_AccumulatedData.mask);
     }
 }
 
@@ -258,6 +273,22 @@ public:
 
     m_SamplePos = vnl_vector<RealType>(ImageDimension, 0.0);
     m_SampleStep = vnl_vector<RealType>(ImageDimension, 0.0);
+    m_SampleBase = vnl_vector<RealType>(ImageDimension, 0.0);
+
+    // Affine transform composed with the deformation field, if any
+    TransformType *phi_affine = m_Metric->GetDeformationAffineTransform();
+    m_PhiAffine = !m_Affine && phi_affine;
+    if(m_PhiAffine)
+      {
+      m_PhiMatrix = vnl_matrix<RealType>(ImageDimension, ImageDimension);
+      m_PhiOffset = vnl_vector<RealType>(ImageDimension);
+      for(int d = 0; d < ImageDimension; d++)
+        {
+        m_PhiOffset[d] = phi_affine->GetOffset()[d];
+        for(int j = 0; j < ImageDimension; j++)
+          m_PhiMatrix(d,j) = phi_affine->GetMatrix()(d,j);
+        }
+      }
 
     this->SetupLine();
   }
@@ -326,6 +357,18 @@ public:
           m_SamplePos[d] += (*m_JitterLine)[d];
         }
       }
+    else if(m_PhiAffine)
+      {
+      // The sample position is A(x + phi(x)) = A x + M phi(x), and A x is updated
+      // incrementally along the line
+      for(int d = 0; d < ImageDimension; d++)
+        {
+        m_SampleBase[d] = m_PhiOffset[d];
+        for(int j = 0; j < ImageDimension; j++)
+          m_SampleBase[d] += m_PhiMatrix(d,j) * m_Index[j];
+        }
+      this->ComputeComposedSamplePos();
+      }
     else
       {
       for(int d = 0; d < ImageDimension; d++)
@@ -335,6 +378,34 @@ public:
       }
   }
 
+  void ComputeComposedSamplePos()
+  {
+    for(int d = 0; d < ImageDimension; d++)
+      {
+      m_SamplePos[d] = m_SampleBase[d];
+      for(int j = 0; j < ImageDimension; j++)
+        m_SamplePos[d] += m_PhiMatrix(d,j) * (*m_PhiLine)[j];
+      }
+  }
+
+  /**
+   * Map a gradient with respect to the sample position to the gradient with
+   * respect to the deformation field, when the field is composed with an affine
+   * transform (multiplication by the transpose of the affine matrix)
+   */
+  void MapGradientToDeformation(RealType *grad)
+  {
+    RealType g[ImageDimension];
+    for(int j = 0; j < ImageDimension; j++)
+      {
+      g[j] = 0.0;
+      for(int d = 0; d < ImageDimension; d++)
+        g[j] += m_PhiMatrix(d,j) * grad[d];
+      }
+    for(int j = 0; j < ImageDimension; j++)
+      grad[j] = g[j];
+  }
+
   Self &operator ++()
   {
     m_Index[0]++;
@@ -361,6 +432,13 @@ public:
             m_SamplePos[d] += m_SampleStep[d];
           }
         }
+      else if(m_PhiAffine)
+        {
+        m_PhiLine++;
+        for(int d = 0; d < ImageDimension; d++)
+          m_SampleBase[d] += m_PhiMatrix(d,0);
+        this->ComputeComposedSamplePos();
+        }
       else
         {
         m_PhiLine++;
@@ -418,6 +496,15 @@ public:
         // Compute the mask
         m_Mask = m_Interpolator.GetMaskAndGradient(m_MaskGradient);
         }
+
+      // Express the gradients with respect to the residual deformation
+      if(m_PhiAffine && status != InterpType::OUTSIDE)
+        {
+        for(int i = 0; i < m_FixedStep; i++)
+          this->MapGradientToDeformation(m_MovingSampleGradient[i]);
+        if(status == InterpType::BORDER)
+          this->MapGradientToDeformation(m_MaskGradient);
+        }
       }
     else
       {
@@ -447,6 +534,99 @@ public:
   void PartialVolumeHistogramGradientSample(const THistContainer &weights, RealType *out_ptr)
   {
     m_Interpolator.PartialVolumeHistogramGradientSample(m_SamplePos.data_block(), m_FixedLine, weights, out_ptr);
+    if(m_PhiAffine)
+      this->MapGradientToDeformation(out_ptr);
+  }
+
+  /**
+   * Cubic B-spline Parzen window sample. The fixed image is assumed to hold hard bin
+   * indices (precomputed once), while the moving bin index is interpolated at the
+   * sample position and spread over the four adjacent histogram bins. Bin zero is
+   * reserved for outside values, so samples that are not fully inside the moving image
+   * fall back to the partial volume sample.
+   */
+  template <class THistContainer>
+  void ParzenHistogramSample(THistContainer &hist, int n_bins)
+  {
+    if(m_Interpolator.Interpolate(m_SamplePos.data_block(), m_MovingSample) != InterpType::INSIDE)
+      {
+      this->PartialVolumeHistogramSample(hist);
+      return;
+      }
+
+    for(int c = 0; c < m_FixedStep; c++)
+      {
+      RealType *hist_line = hist[c][m_FixedLine[c]];
+      RealType m = m_MovingSample[c];
+      int k0 = (int) floor(m) - 1;
+      for(int k = k0; k < k0 + 4; k++)
+        hist_line[ParzenBin(k, n_bins)] += ParzenWeight(k - m);
+      }
+  }
+
+  /**
+   * Gradient of the Parzen window sample with respect to the sample position, given
+   * the derivatives of the metric with respect to the histogram bin counts
+   */
+  template <class THistContainer>
+  void ParzenHistogramGradientSample(const THistContainer &weights, int n_bins, RealType *out_ptr)
+  {
+    typename InterpType::InOut status = m_Interpolator.InterpolateWithGradient(
+          m_SamplePos.data_block(), m_MovingSample, m_MovingSampleGradient);
+    if(status != InterpType::INSIDE)
+      {
+      this->PartialVolumeHistogramGradientSample(weights, out_ptr);
+      return;
+      }
+
+    for(int d = 0; d < ImageDimension; d++)
+      out_ptr[d] = 0.0;
+
+    for(int c = 0; c < m_FixedStep; c++)
+      {
+      const RealType *f = weights[c][m_FixedLine[c]];
+      RealType m = m_MovingSample[c];
+      int k0 = (int) floor(m) - 1;
+
+      // Derivative of the metric with respect to the moving bin value
+      RealType dm = 0.0;
+      for(int k = k0; k < k0 + 4; k++)
+        dm -= f[ParzenBin(k, n_bins)] * ParzenWeightDeriv(k - m);
+
+      for(int d = 0; d < ImageDimension; d++)
+        out_ptr[d] += dm * m_MovingSampleGradient[c][d];
+      }
+
+    if(m_PhiAffine)
+      this->MapGradientToDeformation(out_ptr);
+  }
+
+  /** Cubic B-spline kernel */
+  static RealType ParzenWeight(RealType t)
+  {
+    RealType a = fabs(t);
+    if(a < 1.0)
+      return 2.0 / 3.0 - a * a + 0.5 * a * a * a;
+    else if(a < 2.0)
+      return (2.0 - a) * (2.0 - a) * (2.0 - a) / 6.0;
+    return 0.0;
+  }
+
+  /** Derivative of the cubic B-spline kernel */
+  static RealType ParzenWeightDeriv(RealType t)
+  {
+    RealType a = fabs(t);
+    if(a < 1.0)
+      return t * (1.5 * a - 2.0);
+    else if(a < 2.0)
+      return (t < 0 ? 0.5 : -0.5) * (2.0 - a) * (2.0 - a);
+    return 0.0;
+  }
+
+  /** Window taps that fall outside of the valid bins are folded into the end bins */
+  static int ParzenBin(int k, int n_bins)
+  {
+    return k < 1 ? 1 : (k >= n_bins ? n_bins - 1 : k);
   }
 
 
@@ -506,12 +686,16 @@ protected:
   IndexType m_Index;
   vnl_vector<RealType> m_SamplePos, m_SampleStep;
 
+  // Affine transform composed with the deformation field, and A x at the current voxel
+  vnl_matrix<RealType> m_PhiMatrix;
+  vnl_vector<RealType> m_PhiOffset, m_SampleBase;
+
   InterpType m_Interpolator;
 
   RealType *m_MovingSample, **m_MovingSampleGradient, *m_MaskGradient;
   RealType m_Mask;
 
-  bool m_Affine, m_Gradient;
+  bool m_Affine, m_PhiAffine, m_Gradient;
 
 };
 
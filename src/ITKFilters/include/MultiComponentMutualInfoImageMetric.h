@@ -158,6 +158,15 @@ public:
   itkSetMacro(ComputeNormalizedMutualInformation, bool)
   itkGetMacro(ComputeNormalizedMutualInformation, bool)
 
+  /**
+   * When this flag is On, the joint histogram is estimated using a cubic B-spline Parzen
+   * window on the moving image bin values (Mattes et al., IEEE TMI, 2003) instead of
+   * partial volume interpolation. The fixed image bins are used as is, so they are only
+   * computed once per level by the preprocessing filter.
+   */
+  itkSetMacro(ParzenWindow, bool)
+  itkGetMacro(ParzenWindow, bool)
+
 protected:
 
   virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
@@ -166,7 +175,7 @@ protected:
 
 protected:
   MultiComponentMutualInfoImageMetric()
-    : m_Bins(32), m_ComputeNormalizedMutualInformation(false) { }
+    : m_Bins(32), m_ComputeNormalizedMutualInformation(false), m_ParzenWindow(false) { }
 
   ~MultiComponentMutualInfoImageMetric() {}
 
@@ -177,12 +186,18 @@ private:
   // Barrier - for thread management
   typename itk::Barrier::Pointer m_Barrier;
 
+  // Number of threads that actually execute ThreadedGenerateData
+  itk::ThreadIdType m_NumberOfActiveThreads;
+
   // Number of bins
   unsigned int m_Bins;
 
   // What flavor of mutual information will we use
   bool m_ComputeNormalizedMutualInformation;
 
+  // Use Parzen windowing instead of partial volume interpolation
+  bool m_ParzenWindow;
+
   // Combined histogram representation
   struct Histogram
   {
@@ -206,6 +206,7 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
   itk::ImageRegion<ImageDimension> splitRegion;  // dummy region - just to call
                                                   // the following method
   nbOfThreads = this->SplitRequestedRegion(0, nbOfThreads, splitRegion);
+  m_NumberOfActiveThreads = nbOfThreads;
 
   // Initialize the barrier
   m_Barrier = itk::Barrier::New();
@@ -249,14 +250,37 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
       {
       // Get the current histogram corners
       if(iter.CheckFixedMask())
-        iter.PartialVolumeHistogramSample(thread_histogram);
+        {
+        if(m_ParzenWindow)
+          iter.ParzenHistogramSample(thread_histogram, m_Bins);
+        else
+          iter.PartialVolumeHistogramSample(thread_histogram);
+        }
       }
     }
 
   // Wait for all the threads to finish this computation
   m_Barrier->Wait();
 
-  // Add up and process the histograms - use the first one as the target for storage
+  // Merge the per-thread histograms into the histogram of thread 0. This is done in
+  // parallel, with the histogram rows of all components interleaved between threads
+  unsigned int n_hist = this->GetNumberOfThreads();
+  for(unsigned int r = threadId; r < ncomp * m_Bins; r += m_NumberOfActiveThreads)
+    {
+    int c = r / m_Bins, bf = r % m_Bins;
+    RealType *trg = m_MIThreadData[0][c][bf];
+    for (unsigned q = 1; q < n_hist; q++)
+      {
+      const RealType *src = m_MIThreadData[q][c][bf];
+      for(unsigned bm = 0; bm < m_Bins; bm++)
+        trg[bm] += src[bm];
+      }
+    }
+
+  // Wait for the merge to finish
+  m_Barrier->Wait();
+
+  // Process the histograms - use the first one as the target for storage
   if(threadId == 0)
     {
     // Initialize the histograms per component
@@ -272,18 +296,14 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
       // When computing the empirical joint probability, we will ignore outside values.
       // We need multiple passes through the histogram to calculate the emprirical prob.
 
-      // First pass, add thread data and compute the sum of all non-outside histogram bin balues
+      // First pass, copy the merged thread data and compute the sum of all non-outside histogram bin balues
       double hist_sum = 0.0;
       for (unsigned bf = 1; bf < m_Bins; bf++)
         {
         for(unsigned bm = 1; bm < m_Bins; bm++)
           {
-          // Reference to the joint probability entry
-          RealType &Pfm = hc.Pfm(bf,bm);
-
-          // Add the entries from all threads
-          for (unsigned q = 0; q < this->GetNumberOfThreads(); q++)
-            Pfm += m_MIThreadData[q][c][bf][bm];
+          // The entries from all threads have been merged above
+          hc.Pfm(bf,bm) = m_MIThreadData[0][c][bf][bm];
 
           // Accumulate the sum of all entries
           hist_sum += hc.Pfm(bf,bm);
@@ -382,7 +402,10 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
           GradientPixelType &grad_x = *grad_line;
 
           // Get the current histogram corners
-          iter_g.PartialVolumeHistogramGradientSample(m_GradWeights, grad_x.GetDataPointer());
+          if(m_ParzenWindow)
+            iter_g.ParzenHistogramGradientSample(m_GradWeights, m_Bins, grad_x.GetDataPointer());
+          else
+            iter_g.PartialVolumeHistogramGradientSample(m_GradWeights, grad_x.GetDataPointer());
           }
         }
       }
@@ -405,7 +428,10 @@ MultiComponentMutualInfoImageMetric<TMetricTraits>
         if(iter_g.CheckFixedMask())
           {
           // Get the current histogram corners
-          iter_g.PartialVolumeHistogramGradientSample(m_GradWeights, grad_x.GetDataPointer());
+          if(m_ParzenWindow)
+            iter_g.ParzenHistogramGradientSample(m_GradWeights, m_Bins, grad_x.GetDataPointer());
+          else
+            iter_g.PartialVolumeHistogramGradientSample(m_GradWeights, grad_x.GetDataPointer());
 
           // Add the gradient
           for(int i = 0, q = 0; i < ImageDimension; i++)
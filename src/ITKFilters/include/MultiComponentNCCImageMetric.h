@@ -29,6 +29,7 @@
 
 #include "MultiComponentImageMetricBase.h"
 #include "itkBarrier.h"
+#include <vector>
 
 /**
  * Normalized cross-correlation metric. This filter sets up a mini-pipeline with
@@ -109,6 +110,37 @@ public:
    */
   itkSetMacro(ReuseWorkingImageFixedComponents, bool)
 
+  /**
+   * Set the precomputed neighborhood sums of the fixed image, as generated by
+   * ComputeFixedSumsImage. When this image is supplied (only used for the dense
+   * gradient, not for affine), the working image only holds the channels that
+   * depend on the moving image, and the count, sum I and sum I^2 channels are
+   * read from this image instead. Where the neighborhood holds samples with the
+   * moving image outside, masked or NaN, the fixed sums are corrected by removing
+   * these samples, so the metric matches the joint accumulation.
+   */
+  itkSetObjectMacro(FixedSumsImage, InputImageType)
+  itkGetObjectMacro(FixedSumsImage, InputImageType)
+
+  /**
+   * Use compensated (Kahan) running sums when accumulating the working image.
+   * This is meant for float math, where it removes most of the drift in the
+   * neighborhood sums for large radii at a small extra cost
+   */
+  itkSetMacro(CompensatedSummation, bool)
+  itkGetMacro(CompensatedSummation, bool)
+
+  /**
+   * Compute the neighborhood sums of the fixed image used by SetFixedSumsImage.
+   * For each component, the output holds the number of valid voxels, the sum
+   * of intensities and the sum of squared intensities over the neighborhood.
+   * Voxels outside of the mask (value 0) or with NaN intensity are excluded.
+   * If n_threads is positive, the sums are accumulated with that many threads.
+   */
+  static typename InputImageType::Pointer ComputeFixedSumsImage(
+      InputImageType *fixed, MaskImageType *mask, const SizeType &radius,
+      bool compensated = false, int n_threads = 0);
+
   /**
    * Get the gradient scaling factor. To get the actual gradient of the metric, multiply the
    * gradient output of this filter by the scaling factor. Explanation: for efficiency, the
@@ -119,10 +151,19 @@ public:
    */
   virtual double GetGradientScalingFactor() const ITK_OVERRIDE { return 1.0; }
 
+  /**
+   * Markers of the samples that are counted in the fixed sums but have no valid
+   * moving value, one per voxel and component. Filled in by the precompute filter
+   * when the fixed sums are used, NULL otherwise
+   */
+  unsigned char *GetMissingSampleMarkers()
+    { return m_MissingSamples.size() ? &m_MissingSamples[0] : NULL; }
+
 
 protected:
   MultiComponentNCCImageMetric()
-    : m_ApproximateGradient(false), m_ReuseWorkingImageFixedComponents(false)
+    : m_ApproximateGradient(false), m_ReuseWorkingImageFixedComponents(false),
+      m_CompensatedSummation(false)
     { m_Radius.Fill(1); }
 
   ~MultiComponentNCCImageMetric() {}
@@ -134,6 +175,16 @@ protected:
   virtual void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
                                     itk::ThreadIdType threadId) ITK_OVERRIDE;
 
+  // The threaded code for a compile-time number of components (0 for any number)
+  template <int VComp>
+  void ThreadedGenerateDataForComponents(const OutputImageRegionType &outputRegionForThread,
+                                         itk::ThreadIdType threadId);
+
+  // Remove the samples with missing moving values in the neighborhood of idx from
+  // the precomputed fixed sums p_fix, storing the result in out
+  void CorrectFixedSums(const IndexType &idx, const InputComponentType *p_fix,
+                        InputComponentType *out);
+
 private:
   MultiComponentNCCImageMetric(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -146,6 +197,15 @@ private:
   // if the filter is being run repeatedly on the same image
   bool m_ReuseWorkingImageFixedComponents;
 
+  // Precomputed neighborhood sums of the fixed image (optional)
+  typename InputImageType::Pointer m_FixedSumsImage;
+
+  // Per-sample markers of missing moving values, used with the fixed sums
+  std::vector<unsigned char> m_MissingSamples;
+
+  // Whether the accumulation uses compensated sums
+  bool m_CompensatedSummation;
+
   // Radius of the cross-correlation
   SizeType m_Radius;
 
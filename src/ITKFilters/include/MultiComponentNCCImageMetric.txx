@@ -30,6 +30,8 @@
 #include "MultiComponentNCCImageMetric.h"
 #include "OneDimensionalInPlaceAccumulateFilter.h"
 #include "itkImageFileWriter.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include <algorithm>
 
 
 
@@ -70,13 +72,19 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
   // This is complex! The number of components depends on what we are computing.
   int nc = m_Parent->GetFixedImage()->GetNumberOfComponentsPerPixel();
 
+  // With precomputed fixed sums, the mask, I and I^2 channels are not needed, but
+  // one channel at the end of the pixel counts the samples with missing moving values
+  bool fixed_sums = m_Parent->GetFixedSumsImage() && !m_Parent->GetComputeAffine();
+  int n_sum = fixed_sums ? 3 : 6;
+  int n_miss = fixed_sums ? 1 : 0;
+
   // If there are no gradients computed, we just need 6 output pixels per input comp.
   if(!m_Parent->GetComputeGradient())
-    return nc * 6;
+    return nc * n_sum + n_miss;
 
   // If we are not computing affine transform, then the gradient requires 3 comps per dimension
   if(!m_Parent->GetComputeAffine())
-    return nc * (6 + 3 * ImageDimension);
+    return nc * (n_sum + 3 * ImageDimension) + n_miss;
 
   // Otherwise we need a ton of components, because for each gradient component we need it also
   // scaled by x, by y and by z.
@@ -103,7 +111,8 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
   // Number of output components per input component
   bool need_grad = m_Parent->GetComputeGradient();
   bool need_affine = m_Parent->GetComputeAffine();
-  int n_out_comp_per_input_comp = 6 + (need_grad
+  bool fixed_sums = m_Parent->GetFixedSumsImage() && !need_affine;
+  int n_out_comp_per_input_comp = (fixed_sums ? 3 : 6) + (need_grad
                                        ? ( need_affine
                                            ? 3 * ImageDimension * (1 + ImageDimension)
                                            : 3 * ImageDimension)
@@ -116,11 +125,19 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
   typedef MultiComponentMetricWorker<TMetricTraits, TOutputImage> InterpType;
   InterpType iter(m_Parent, this->GetOutput(), outputRegionForThread);
 
+  // With the fixed sums, the samples counted in the fixed sums that have no valid
+  // moving value are marked, so that the fixed sums can be corrected for them
+  unsigned char *p_marker = NULL;
+
   // Iterate over the lines
   for(; !iter.IsAtEnd(); iter.NextLine())
     {
+    if(fixed_sums)
+      p_marker = m_Parent->GetMissingSampleMarkers()
+                 + m_Parent->GetFixedImage()->ComputeOffset(iter.GetIndex()) * ncomp_in;
+
     // Iterate over the pixels in the line
-    for(; !iter.IsAtEndOfLine(); ++iter)
+    for(; !iter.IsAtEndOfLine(); ++iter, p_marker += fixed_sums ? ncomp_in : 0)
       {
       // The mask is 0.5 for points in range of the user mask, and 1.0 for the user mask
       // We can safely ignore the points outside of range - they have no impact on the
@@ -151,18 +168,37 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
            (!need_affine && status != FastInterpolator::INSIDE))
           {
           // Zero out the entire output line
+          int n_miss = 0;
           for(int k = 0; k < ncomp_in; k++)
+            {
             for(int j = 0; j < n_out_comp_per_input_comp; j++)
               *out++ = 0.0;
+
+            if(fixed_sums)
+              {
+              p_marker[k] = isnan(iter.GetFixedLine()[k]) ? 0 : 1;
+              n_miss += p_marker[k];
+              }
+            }
+
+          if(fixed_sums)
+            *out++ = n_miss;
           }
         else
           {
           // Iterate over the components
+          int n_miss = 0;
           for(int k = 0; k < ncomp_in; k++)
             {
             InputComponentType x_mov = iter.GetMovingSample()[k];
             InputComponentType x_fix = iter.GetFixedLine()[k];
 
+            if(fixed_sums)
+              {
+              p_marker[k] = (isnan(x_mov) && !isnan(x_fix)) ? 1 : 0;
+              n_miss += p_marker[k];
+              }
+
             // Check for NaN, which indicates that the pixel should not contribute to the metric
             if(isnan(x_mov) || isnan(x_fix))
               {
@@ -173,16 +209,26 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
               continue;
               }
 
-            // Mask value for this component, indicates that this voxel is being included
-            // in computing of cross-correlation
-            *out++ = 1.0;
-
-            // Write the five components that are averaged in the cross-correlation computation
-            *out++ = x_fix;
-            *out++ = x_mov;
-            *out++ = x_fix * x_fix;
-            *out++ = x_mov * x_mov;
-            *out++ = x_fix * x_mov;
+            if(fixed_sums)
+              {
+              // The mask, I and I^2 channels come from the precomputed fixed sums
+              *out++ = x_mov;
+              *out++ = x_mov * x_mov;
+              *out++ = x_fix * x_mov;
+              }
+            else
+              {
+              // Mask value for this component, indicates that this voxel is being included
+              // in computing of cross-correlation
+              *out++ = 1.0;
+
+              // Write the five components that are averaged in the cross-correlation computation
+              *out++ = x_fix;
+              *out++ = x_mov;
+              *out++ = x_fix * x_fix;
+              *out++ = x_mov * x_mov;
+              *out++ = x_fix * x_mov;
+              }
 
             // If gradient, do more
             if(m_Parent->GetComputeGradient())
@@ -211,6 +257,9 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
 
               }
             }
+
+          if(fixed_sums)
+            *out++ = n_miss;
           }
         }
       else
@@ -219,6 +268,10 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
         OutputComponentType *out = iter.GetOutputLine();
         for(int q = 0; q < ncomp_out; q++)
           *out++ = 0;
+
+        // Samples outside of the mask are not in the fixed sums either
+        if(fixed_sums)
+          std::fill(p_marker, p_marker + ncomp_in, 0);
         }
       }
     }
@@ -234,42 +287,69 @@ MultiImageNCCPrecomputeFilter<TMetricTraits,TOutputImage>
  * ========================================================================== */
 
 
-template <class TPixel, class TWeight, class TMetric, class TGradient>
+/**
+ * Compute the NCC metric and its gradient from the neighborhood sums for one
+ * voxel. If ptr_fix is supplied, the count, sum I and sum I^2 channels for each
+ * component are read from it, and ptr only holds the moving-dependent channels.
+ *
+ * The kernel is specialized for a compile-time number of components VComp, so
+ * that the component and dimension loops are unrolled. With VComp = 0, the number
+ * of components is n_comp. Returns ptr_end, i.e., the start of the next voxel.
+ */
+template <unsigned int VDim, int VComp, class TPixel, class TWeight, class TMetric, class TGradient>
 TPixel *
 MultiImageNNCPostComputeFunction(
     TPixel *ptr, TPixel *ptr_end, int n_comp, TWeight *weights,
     TMetric *ptr_metric, TMetric *ptr_comp_metrics,
-    TGradient *ptr_gradient, int ImageDimension)
+    TGradient *ptr_gradient,
+    const TPixel *ptr_fix = NULL)
 {
   // IMPORTANT: this code uses double precision because single precision float seems
   // to mess up and lead to unstable computations
+  const int ImageDimension = VDim;
+  const int nc = VComp > 0 ? VComp : n_comp;
 
   // Loop over components
-  int i_wgt = 0;
   const double eps = 1e-8;
 
   // Initialize metric to zero
   *ptr_metric = 0;
 
-  for(; ptr < ptr_end; ++i_wgt)
+  for(int i_wgt = 0; i_wgt < nc; ++i_wgt)
     {
     // Get the number of pixels going into the computation
-    double n = *ptr++;
+    double n = ptr_fix ? ptr_fix[0] : *ptr++;
     if(n == 0.0)
       {
       // Increment the pointer to the next component
-      ptr += ptr_gradient ? 5 + 3 * ImageDimension : 5;
+      int n_sum = ptr_fix ? 3 : 5;
+      ptr += ptr_gradient ? n_sum + 3 * ImageDimension : n_sum;
+      if(ptr_fix)
+        ptr_fix += 3;
       continue;
       }
 
     double one_over_n = 1.0 / n;
 
     // Read the sums and sums of squared
-    double x_fix = *ptr++;
-    double x_mov = *ptr++;
-    double x_fix_sq = *ptr++;
-    double x_mov_sq = *ptr++;
-    double x_fix_mov = *ptr++;
+    double x_fix, x_mov, x_fix_sq, x_mov_sq, x_fix_mov;
+    if(ptr_fix)
+      {
+      x_fix = ptr_fix[1];
+      x_fix_sq = ptr_fix[2];
+      ptr_fix += 3;
+      x_mov = *ptr++;
+      x_mov_sq = *ptr++;
+      x_fix_mov = *ptr++;
+      }
+    else
+      {
+      x_fix = *ptr++;
+      x_mov = *ptr++;
+      x_fix_sq = *ptr++;
+      x_mov_sq = *ptr++;
+      x_fix_mov = *ptr++;
+      }
 
     double x_fix_over_n = x_fix * one_over_n;
     double x_mov_over_n = x_mov * one_over_n;
@@ -324,32 +404,38 @@ MultiImageNNCPostComputeFunction(
 
     // Store the componentwise metric
     TMetric weighted_metric = (TMetric) (w * ncc_fix_mov);
-    (*ptr_comp_metrics++) += weighted_metric;
+    ptr_comp_metrics[i_wgt] += weighted_metric;
 
     // Accumulate the metric
     *ptr_metric += weighted_metric;
     }
 
-  return ptr;
+  return ptr_end;
 }
 
 
 
-template <class TPixel, class TWeight, class TMetric, class TGradient>
+/**
+ * Compute the NCC metric and its affine gradient from the neighborhood sums for
+ * one voxel. The specialization on VComp is the same as above
+ */
+template <unsigned int VDim, int VComp, class TPixel, class TWeight, class TMetric, class TGradient>
 TPixel *
 MultiImageNNCPostComputeAffineGradientFunction(
     TPixel *ptr, TPixel *ptr_end, int n_comp, TWeight *weights,
     TMetric *ptr_metric, TMetric *ptr_comp_metrics,
-    TGradient *ptr_affine_gradient, int ImageDimension)
+    TGradient *ptr_affine_gradient)
 {
+  const int ImageDimension = VDim;
+  const int nc = VComp > 0 ? VComp : n_comp;
+
   // Loop over components
-  int i_wgt = 0;
   const TPixel eps = 1e-2;
 
   // Initialize metric to zero
   *ptr_metric = 0;
 
-  for(; ptr < ptr_end; ++i_wgt)
+  for(int i_wgt = 0; i_wgt < nc; ++i_wgt)
     {
     // Get the number of pixels going into the computation
     double n = *ptr++;
@@ -415,16 +501,98 @@ MultiImageNNCPostComputeAffineGradientFunction(
 
     // Accumulate the metric
     TMetric weighted_metric = (TMetric) (w * ncc_fix_mov);
-    (*ptr_comp_metrics++) += weighted_metric;
+    ptr_comp_metrics[i_wgt] += weighted_metric;
     *ptr_metric += weighted_metric;
     }
 
-  return ptr;
+  return ptr_end;
 }
 
 
 
 
+template <class TMetricTraits>
+typename MultiComponentNCCImageMetric<TMetricTraits>::InputImageType::Pointer
+MultiComponentNCCImageMetric<TMetricTraits>
+::ComputeFixedSumsImage(InputImageType *fixed, MaskImageType *mask, const SizeType &radius,
+                        bool compensated, int n_threads)
+{
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+
+  // Allocate the output image, with three components per input component
+  typename InputImageType::Pointer sums = InputImageType::New();
+  sums->CopyInformation(fixed);
+  sums->SetNumberOfComponentsPerPixel(3 * nc);
+  sums->SetRegions(fixed->GetBufferedRegion());
+  sums->Allocate();
+
+  // Fill in the count, I and I^2 for every voxel. This follows the same rules
+  // as the precompute filter: voxels outside of the mask or NaN are excluded
+  const InputComponentType *p_fix = fixed->GetBufferPointer();
+  const typename MaskImageType::PixelType *p_mask = mask ? mask->GetBufferPointer() : NULL;
+  InputComponentType *p_out = sums->GetBufferPointer();
+  long np = fixed->GetBufferedRegion().GetNumberOfPixels();
+  for(long i = 0; i < np; i++)
+    {
+    bool in_mask = !p_mask || p_mask[i] > 0.0;
+    for(int k = 0; k < nc; k++)
+      {
+      InputComponentType x_fix = *p_fix++;
+      if(in_mask && !isnan(x_fix))
+        {
+        *p_out++ = 1.0;
+        *p_out++ = x_fix;
+        *p_out++ = x_fix * x_fix;
+        }
+      else
+        {
+        *p_out++ = 0.0;
+        *p_out++ = 0.0;
+        *p_out++ = 0.0;
+        }
+      }
+    }
+
+  // Compute the neighborhood sums
+  return AccumulateNeighborhoodSumsInPlace(sums.GetPointer(), radius, 0, 0, compensated, n_threads);
+}
+
+template <class TMetricTraits>
+void
+MultiComponentNCCImageMetric<TMetricTraits>
+::CorrectFixedSums(const IndexType &idx, const InputComponentType *p_fix, InputComponentType *out)
+{
+  const InputImageType *fixed = this->GetFixedImage();
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+  std::copy(p_fix, p_fix + 3 * nc, out);
+
+  // The neighborhood, truncated at the image boundary like the accumulated sums
+  SizeType one;
+  one.Fill(1);
+  typename InputImageType::RegionType window(idx, one);
+  window.PadByRadius(m_Radius);
+  window.Crop(fixed->GetBufferedRegion());
+
+  // Remove the marked samples, i.e., where the moving image is missing, which the
+  // joint accumulation would not have counted
+  const unsigned char *marker = &m_MissingSamples[0];
+  typedef itk::ImageRegionConstIteratorWithIndex<InputImageType> IterType;
+  for(IterType it(fixed, window); !it.IsAtEnd(); ++it)
+    {
+    long off = fixed->ComputeOffset(it.GetIndex()) * nc;
+    for(int k = 0; k < nc; k++)
+      {
+      if(marker[off + k])
+        {
+        InputComponentType x_fix = fixed->GetBufferPointer()[off + k];
+        out[3 * k] -= 1;
+        out[3 * k + 1] -= x_fix;
+        out[3 * k + 2] -= x_fix * x_fix;
+        }
+      }
+    }
+}
+
 template <class TMetricTraits>
 void
 MultiComponentNCCImageMetric<TMetricTraits>
@@ -465,7 +633,15 @@ MultiComponentNCCImageMetric<TMetricTraits>
     preFilter->GraftOutput(m_WorkingImage);
     }
 
-  // Execute the filter
+  // Markers of the missing moving samples, filled in by the precompute filter
+  if(m_FixedSumsImage && !this->m_ComputeAffine)
+    m_MissingSamples.resize(this->GetFixedImage()->GetBufferedRegion().GetNumberOfPixels()
+                            * this->GetFixedImage()->GetNumberOfComponentsPerPixel());
+  else
+    m_MissingSamples.clear();
+
+  // Execute the filter, with the threads given to this filter
+  preFilter->SetNumberOfThreads(this->GetNumberOfThreads());
   preFilter->Update();
 
   // Get the output image
@@ -486,7 +662,8 @@ MultiComponentNCCImageMetric<TMetricTraits>
   // image. Next, we run the fast sum computation to give us the local average of
   // intensities, products, gradients in the working image
   typename InputImageType::Pointer img_accum =
-      AccumulateNeighborhoodSumsInPlace(img_pre, m_Radius, ncomp_ignore, n_overalloc_comp);
+      AccumulateNeighborhoodSumsInPlace(img_pre, m_Radius, ncomp_ignore, n_overalloc_comp,
+                                        m_CompensatedSummation, this->GetNumberOfThreads());
 
 #ifdef DUMP_NCC
   typename itk::ImageFileWriter<InputImageType>::Pointer pwriter = itk::ImageFileWriter<InputImageType>::New();
@@ -505,6 +682,23 @@ template <class TMetricTraits>
 void
 MultiComponentNCCImageMetric<TMetricTraits>
 ::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
+{
+  // Almost all registrations use one to three components, for which the per-voxel
+  // kernels are compiled with a fixed number of components
+  switch(this->GetFixedImage()->GetNumberOfComponentsPerPixel())
+    {
+    case 1: this->template ThreadedGenerateDataForComponents<1>(outputRegionForThread, threadId); break;
+    case 2: this->template ThreadedGenerateDataForComponents<2>(outputRegionForThread, threadId); break;
+    case 3: this->template ThreadedGenerateDataForComponents<3>(outputRegionForThread, threadId); break;
+    default: this->template ThreadedGenerateDataForComponents<0>(outputRegionForThread, threadId); break;
+    }
+}
+
+template <class TMetricTraits>
+template <int VComp>
+void
+MultiComponentNCCImageMetric<TMetricTraits>
+::ThreadedGenerateDataForComponents(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
 {
   int nc_img = this->GetFixedImage()->GetNumberOfComponentsPerPixel();
   int nc = m_WorkingImage->GetNumberOfComponentsPerPixel();
@@ -516,6 +710,9 @@ MultiComponentNCCImageMetric<TMetricTraits>
   // Where to store the accumulated metric (gets copied to td, but should have TPixel type)
   vnl_vector<InputComponentType> comp_metric(nc_img, 0.0);
 
+  // Fixed sums corrected for the samples with missing moving values
+  vnl_vector<InputComponentType> fix_corr(3 * nc_img, 0.0);
+
   // Set up an iterator for the working image
   typedef itk::ImageLinearConstIteratorWithIndex<InputImageType> InputIteratorTypeBase;
   typedef IteratorExtender<InputIteratorTypeBase> InputIteratorType;
@@ -533,6 +730,15 @@ MultiComponentNCCImageMetric<TMetricTraits>
     // Pointer to the metric data for this line
     MetricPixelType *p_metric = this->GetMetricOutput()->GetBufferPointer() + offset_in_pixels;
 
+    // Pointer to the precomputed fixed sums, if used. The count of samples with
+    // missing moving values follows the channels of the last component
+    int nc_fix = 3 * nc_img;
+    const InputComponentType *p_fix = (m_FixedSumsImage && !this->m_ComputeAffine)
+                                      ? m_FixedSumsImage->GetBufferPointer() + nc_fix * offset_in_pixels
+                                      : NULL;
+    int i_miss = nc_img * (3 + (this->m_ComputeGradient ? 3 * ImageDimension : 0));
+    IndexType idx = it.GetIndex();
+
     // The gradient output is optional
     GradientPixelType *p_grad_metric = (this->m_ComputeGradient && !this->m_ComputeAffine)
                                        ? this->GetDeformationGradientOutput()->GetBufferPointer() + offset_in_pixels
@@ -568,8 +774,17 @@ MultiComponentNCCImageMetric<TMetricTraits>
 
           if(!fixed_mask_line || fixed_mask_line[i] > 0.5)
             {
-            p_input = MultiImageNNCPostComputeFunction(p_input, p_input + nc, nc_img, wgt_scaled.data_block(),
-                                                       p_metric, comp_metric.data_block(), p_grad_metric++, ImageDimension);
+            const InputComponentType *p_fix_vox = p_fix;
+            if(p_fix && p_input[i_miss] > 0.5)
+              {
+              idx[0] = it.GetIndex()[0] + i;
+              this->CorrectFixedSums(idx, p_fix, fix_corr.data_block());
+              p_fix_vox = fix_corr.data_block();
+              }
+
+            p_input = MultiImageNNCPostComputeFunction<ImageDimension, VComp>(
+                        p_input, p_input + nc, nc_img, wgt_scaled.data_block(),
+                        p_metric, comp_metric.data_block(), p_grad_metric++, p_fix_vox);
             // Accumulate the total metric
             td.metric += *p_metric;
             td.mask += 1.0;
@@ -579,6 +794,9 @@ MultiComponentNCCImageMetric<TMetricTraits>
             p_grad_metric++;
             p_input+=nc;
             }
+
+          if(p_fix)
+            p_fix += nc_fix;
           }
         }
       else
@@ -592,8 +810,17 @@ MultiComponentNCCImageMetric<TMetricTraits>
           // Apply the post computation
           if(!fixed_mask_line || fixed_mask_line[i] > 0.5)
             {
-            p_input = MultiImageNNCPostComputeFunction(p_input, p_input + nc, nc_img, wgt_scaled.data_block(),
-                                                       p_metric, comp_metric.data_block(), (GradientPixelType *)(NULL), ImageDimension);
+            const InputComponentType *p_fix_vox = p_fix;
+            if(p_fix && p_input[i_miss] > 0.5)
+              {
+              idx[0] = it.GetIndex()[0] + i;
+              this->CorrectFixedSums(idx, p_fix, fix_corr.data_block());
+              p_fix_vox = fix_corr.data_block();
+              }
+
+            p_input = MultiImageNNCPostComputeFunction<ImageDimension, VComp>(
+                        p_input, p_input + nc, nc_img, wgt_scaled.data_block(),
+                        p_metric, comp_metric.data_block(), (GradientPixelType *)(NULL), p_fix_vox);
 
             // Accumulate the total metric
             td.metric += *p_metric;
@@ -603,6 +830,9 @@ MultiComponentNCCImageMetric<TMetricTraits>
             {
             p_input+=nc;
             }
+
+          if(p_fix)
+            p_fix += nc_fix;
           }
         }
       }
@@ -626,9 +856,9 @@ MultiComponentNCCImageMetric<TMetricTraits>
           *p_metric = itk::NumericTraits<MetricPixelType>::Zero;
 
           // Apply the post computation
-          p_input = MultiImageNNCPostComputeAffineGradientFunction(
+          p_input = MultiImageNNCPostComputeAffineGradientFunction<ImageDimension, VComp>(
                       p_input, p_input + nc, nc_img, wgt_scaled.data_block(),
-                      p_metric, comp_metric.data_block(), p_grad, ImageDimension);
+                      p_metric, comp_metric.data_block(), p_grad);
 
           // Accumulate the total metric
           td.metric += *p_metric;
@@ -78,6 +78,7 @@ public:
 
   /** Inherit some types from the superclass. */
   typedef typename Superclass::InputImageType                InputImageType;
+  typedef typename Superclass::MaskImageType                 MaskImageType;
   typedef typename Superclass::InputPixelType                InputPixelType;
   typedef typename Superclass::InputComponentType            InputComponentType;
   typedef typename Superclass::MetricImageType               MetricImageType;
@@ -133,6 +134,13 @@ public:
   itkSetMacro(DemonsSigma, double)
   itkGetMacro(DemonsSigma, double)
 
+  /**
+   * Optional mask by which the deformable gradient is multiplied as it is written. This
+   * is not the same as the fixed mask: the metric is still computed over the whole image.
+   * Setting this mask saves a separate pass over the gradient image.
+   */
+  itkNamedInputMacro(GradientMaskImage, MaskImageType, "gradient_mask")
+
 
 protected:
   MultiImageOpticalFlowImageFilter() : m_UseDemonsGradientForm(false), m_DemonsSigma(0.1) {}
@@ -59,6 +59,11 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
   // Get the per-component metric array
   typename Superclass::ThreadData &td = this->m_ThreadData[threadId];
 
+  // Whether the Gauss-Newton Hessian is being accumulated, and its per-pixel term
+  // Sum_k w_k \Grad M_k \Grad M_k^T, which is expanded to the affine parameters
+  bool use_hessian = this->UseAffineHessian();
+  vnl_matrix_fixed<double, ImageDimension, ImageDimension> grad_outer;
+
   // Iterate over the lines
   for(; !iter.IsAtEnd(); iter.NextLine())
     {
@@ -68,6 +73,12 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
         ? this->GetDeformationGradientOutput()->GetBufferPointer() + iter.GetOffsetInPixels()
         : NULL;
 
+    // Gradient mask line, if the gradient is being masked
+    const typename MaskImageType::PixelType *grad_mask_line =
+        (grad_line && this->GetGradientMaskImage())
+        ? this->GetGradientMaskImage()->GetBufferPointer() + iter.GetOffsetInPixels()
+        : NULL;
+
     // Temporary gradient pixel
     GradientPixelType grad_metric;
 
@@ -92,6 +103,9 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
         // Outside interpolations are ignored
         if(status != FastInterpolator::OUTSIDE)
           {
+          if(use_hessian)
+            grad_outer.fill(0.0);
+
           // Iterate over the components
           for(int k = 0; k < ncomp; k++)
             {
@@ -127,6 +141,13 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
                 for(int i = 0; i < ImageDimension; i++)
                   grad_metric[i] += delw * grad_mov_k[i];
                 }
+
+              if(use_hessian)
+                {
+                for(int i = 0; i < ImageDimension; i++)
+                  for(int j = 0; j < ImageDimension; j++)
+                    grad_outer(i,j) += this->m_Weights[k] * grad_mov_k[i] * grad_mov_k[j];
+                }
               }
             }
 
@@ -139,6 +160,8 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
             for(int i = 0; i < ImageDimension; i++)
               grad_metric[i] = grad_metric[i] * mask - 0.5 * iter.GetMaskGradient()[i] * metric;
             metric = metric * mask;
+            if(use_hessian)
+              grad_outer *= mask;
 
             td.mask += mask;
             }
@@ -172,6 +195,22 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
                     td.grad_mask[q++] += iter.GetMaskGradient()[i] * iter.GetIndex()[j];
                   }
                 }
+
+              // The residual of parameter (i,a) has derivative \Grad M_i * x_a, where
+              // x = (1, index), so the Hessian term is grad_outer(i,j) * x_a * x_b
+              if(use_hessian)
+                {
+                double x[ImageDimension + 1];
+                x[0] = 1.0;
+                for(int a = 0; a < ImageDimension; a++)
+                  x[a+1] = iter.GetIndex()[a];
+
+                for(int i = 0, p = 0; i < ImageDimension; i++)
+                  for(int a = 0; a <= ImageDimension; a++, p++)
+                    for(int j = 0, q = 0; j < ImageDimension; j++)
+                      for(int b = 0; b <= ImageDimension; b++, q++)
+                        td.hessian(p,q) += grad_outer(i,j) * x[a] * x[b];
+                }
               }
             }
           } // not outside
@@ -180,7 +219,11 @@ MultiImageOpticalFlowImageFilter<TMetricTraits>
       // Last thing - update the output voxels
       *iter.GetOutputLine() = metric;
       if(grad_line)
+        {
+        if(grad_mask_line)
+          grad_metric *= grad_mask_line[iter.GetLinePos()];
         grad_line[iter.GetLinePos()] = grad_metric;
+        }
       }
     }
 }
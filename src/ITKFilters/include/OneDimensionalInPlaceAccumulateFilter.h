@@ -29,18 +29,24 @@
 
 #include "itkInPlaceImageFilter.h"
 #include "itkImageRegionSplitterDirection.h"
+#include "CompositeImageLayout.h"
 
 /**
  * This is a filter for fast computation of box sums in an image. It is mean to be
  * used once in each image dimension (i.e., a separable filter). The input to the
  * filter is assumed to be a VectorImage (the filter is optimized for this)
+ *
+ * The layout policy (see CompositeImageLayout.h) determines how the components are
+ * arranged in the buffer. Each plane of the layout is accumulated as an interleaved
+ * image of its own, so with the SoA and AoSoA layouts, the inner loops run over
+ * contiguous single components or blocks of components
  */
-template <class TInputImage>
+template <class TInputImage, class TLayout = CompositeLayoutAoS>
 class OneDimensionalInPlaceAccumulateFilter : public itk::InPlaceImageFilter<TInputImage, TInputImage>
 {
 public:
 
-  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage> Self;
+  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout> Self;
   typedef itk::InPlaceImageFilter<TInputImage, TInputImage> Superclass;
   typedef itk::SmartPointer<Self> Pointer;
   typedef itk::SmartPointer<const Self> ConstPointer;
@@ -81,11 +87,21 @@ public:
   itkGetMacro(ComponentOffsetFront, int)
   itkGetMacro(ComponentOffsetBack, int)
 
+  /**
+   * Use compensated (Kahan) summation for the running sums. This only affects
+   * float images, where the running sum otherwise drifts for long lines and
+   * large radii. Off by default
+   */
+  itkGetMacro(CompensatedSummation, bool)
+  itkSetMacro(CompensatedSummation, bool)
+
 protected:
 
   OneDimensionalInPlaceAccumulateFilter();
   ~OneDimensionalInPlaceAccumulateFilter() {}
 
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
   virtual void ThreadedGenerateData(
       const OutputImageRegionType & outputRegionForThread,
       itk::ThreadIdType threadId) ITK_OVERRIDE;
@@ -101,18 +117,23 @@ protected:
   // Range of included components
   int m_ComponentOffsetFront, m_ComponentOffsetBack;
 
+  // Whether compensated summation is used
+  bool m_CompensatedSummation;
+
   // Region splitter
   typename SplitterType::Pointer m_Splitter;
 
 };
 
 /**
- * This helper function strings N 1-D filters together
+ * This helper function strings N 1-D filters together. If n_threads is positive,
+ * each filter uses that many threads
  */
-template <class TInputImage>
+template <class TInputImage, class TLayout = CompositeLayoutAoS>
 typename TInputImage::Pointer
 AccumulateNeighborhoodSumsInPlace(TInputImage *image, const typename TInputImage::SizeType &radius,
-                                  int num_ignored_at_start = 0, int num_ignored_at_end = 0);
+                                  int num_ignored_at_start = 0, int num_ignored_at_end = 0,
+                                  bool compensated = false, int n_threads = 0);
 
 
 #ifndef ITK_MANUAL_INSTANTIATION
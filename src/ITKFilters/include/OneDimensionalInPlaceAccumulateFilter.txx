@@ -27,22 +27,24 @@
 #include "OneDimensionalInPlaceAccumulateFilter.h"
 #include <itkImageLinearIteratorWithIndex.h>
 #include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <algorithm>
 
 
-template <class TInputImage>
-OneDimensionalInPlaceAccumulateFilter<TInputImage>
+template <class TInputImage, class TLayout>
+OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout>
 ::OneDimensionalInPlaceAccumulateFilter()
 {
   m_Radius = 0;
   m_Dimension = 0;
   m_ComponentOffsetFront = m_ComponentOffsetBack = 0;
+  m_CompensatedSummation = false;
   m_Splitter = SplitterType::New();
   this->InPlaceOn();
 }
 
-template <class TInputImage>
+template <class TInputImage, class TLayout>
 const itk::ImageRegionSplitterBase *
-OneDimensionalInPlaceAccumulateFilter<TInputImage>
+OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout>
 ::GetImageRegionSplitter(void) const
 {
   m_Splitter->SetDirection(m_Dimension);
@@ -50,9 +52,9 @@ OneDimensionalInPlaceAccumulateFilter<TInputImage>
 }
 
 
-template <class TInputImage>
+template <class TInputImage, class TLayout>
 void
-OneDimensionalInPlaceAccumulateFilter<TInputImage>
+OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout>
 ::SetComponentRange(int num_ignored_at_start, int num_ignored_at_end)
 {
   m_ComponentOffsetFront = num_ignored_at_start;
@@ -60,15 +62,80 @@ OneDimensionalInPlaceAccumulateFilter<TInputImage>
   this->Modified();
 }
 
+template <class TInputImage, class TLayout>
+void
+OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout>
+::BeforeThreadedGenerateData()
+{
+  int nc = this->GetInput()->GetNumberOfComponentsPerPixel();
+  if(!CompositeLayoutIsValid<TLayout>(nc))
+    itkExceptionMacro(<< "The number of components " << nc << " does not fit the composite layout");
+}
+
+/**
+ * Find the range of components [c_first, c_last] within a plane of the layout, given
+ * the numbers of components skipped at the front and back of the whole pixel. Returns
+ * false if the plane has no components to accumulate.
+ */
+inline bool OneDimensionalInPlaceAccumulatePlaneRange(
+    int plane, int plane_width, int nc, int skip_front, int skip_back, int &c_first, int &c_last)
+{
+  int base = plane * plane_width;
+  c_first = std::max(skip_front - base, 0);
+  c_last = std::min((nc - 1 - skip_back) - base, plane_width - 1);
+  return c_first <= c_last;
+}
+
+/**
+ * When accumulating along dimensions other than the first, the lines are far apart
+ * in memory, and sweeping them one at a time stride-walks the whole image. Instead,
+ * the workers process blocks of lines that are adjacent along the first dimension.
+ * At each position along the line, the pixels of all the lines in the block are
+ * contiguous in memory, so the block is treated as one wide pixel. This constant
+ * is the target number of components in such a wide pixel.
+ */
+#define ACCUM_BLOCK_COMPONENTS 128
+
+/**
+ * Get the maximum number of lines in a block for a given dimension. Lines along
+ * the first dimension are contiguous already and are not blocked.
+ */
+inline int OneDimensionalInPlaceAccumulateMaxBlock(int dimension, int nc)
+{
+  return (dimension == 0 || nc >= ACCUM_BLOCK_COMPONENTS) ? 1 : ACCUM_BLOCK_COMPONENTS / nc;
+}
+
+/**
+ * Collect the next block of up to max_block lines that are adjacent in memory,
+ * i.e., whose starting pixels are consecutive. The iterator is advanced past the
+ * lines in the block. Returns the number of lines and the offset (in pixels) of
+ * the first line.
+ */
+template <class TIterator, class TPixel>
+int OneDimensionalInPlaceAccumulateNextBlock(
+    TIterator &itLine, const TPixel *buffer, int max_block, long &offset_in_pixels)
+{
+  offset_in_pixels = itLine.GetPosition() - buffer;
+  int n_lines = 1;
+  for(itLine.NextLine();
+      n_lines < max_block && !itLine.IsAtEnd() && itLine.GetPosition() - buffer == offset_in_pixels + n_lines;
+      itLine.NextLine())
+    {
+    n_lines++;
+    }
+
+  return n_lines;
+}
+
 /**
  * This worker class is defined to allow partial specialization of the ThreadedGenerateData
  * based on the pixel type (float/double)
  */
-template <class TPixel, class TInputImage>
+template <class TPixel, class TInputImage, class TLayout>
 class OneDimensionalInPlaceAccumulateFilterWorker
 {
 public:
-  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage> FilterType;
+  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout> FilterType;
   typedef typename FilterType::OutputImageRegionType OutputImageRegionType;
   typedef typename FilterType::InputImageType InputImageType;
   static void ThreadedGenerateData(FilterType *filter,
@@ -77,9 +144,9 @@ public:
 };
 
 
-template <class TPixel, class TInputImage>
+template <class TPixel, class TInputImage, class TLayout>
 void
-OneDimensionalInPlaceAccumulateFilterWorker<TPixel, TInputImage>
+OneDimensionalInPlaceAccumulateFilterWorker<TPixel, TInputImage, TLayout>
 ::ThreadedGenerateData(FilterType *filter,
                        const OutputImageRegionType & outputRegionForThread,
                        itk::ThreadIdType threadId)
@@ -102,14 +169,16 @@ OneDimensionalInPlaceAccumulateFilterWorker<TPixel, TInputImage>
   IteratorType itLine(image, outputRegionForThread);
   itLine.SetDirection(dimension);
 
-  // Get the number of components
-  int nc = image->GetNumberOfComponentsPerPixel();
+  // Get the number of components. Each plane of the layout is processed as an
+  // interleaved image with nc components
+  int nc_total = image->GetNumberOfComponentsPerPixel();
+  int nc = TLayout::GetPlaneWidth(nc_total);
+  int n_planes = TLayout::GetNumberOfPlanes(nc_total);
+  long plane_size = image->GetBufferedRegion().GetNumberOfPixels() * nc;
 
-  // Get the first and last component for accumulation - these are optionally
-  // specified by the user
-  int c_first = filter->GetComponentOffsetFront(),
-      c_last = (nc - 1) - filter->GetComponentOffsetBack();
-  int n_skipped = filter->GetComponentOffsetFront() + filter->GetComponentOffsetBack();
+  // The first and last component for accumulation within the current plane - these
+  // follow from the range optionally specified by the user
+  int c_first, c_last;
 
   // Get the offset corresponding to a move along the line for this iterator
   typename IteratorType::OffsetValueType jump = itLine.GetOffset(dimension) * nc;
@@ -121,25 +190,34 @@ OneDimensionalInPlaceAccumulateFilterWorker<TPixel, TInputImage>
   // Width of the kernel (in whole pixels, then in components)
   int kernel_width = 2 * radius + 1;
 
+  // Maximum number of adjacent lines processed together
+  int max_block = OneDimensionalInPlaceAccumulateMaxBlock(dimension, nc);
+
   // Allocate an array of the length of the line in components
-  TPixel *line = new TPixel[line_length_comp];
+  TPixel *line = new TPixel[line_length_comp * max_block];
   // double *line = new double[line_length_comp];
   // double *sum = new double[nc], *sum_end = sum + nc, *p_sum;
 
   // Allocate an array to hold the current running sum
   // OutputImageComponentType *sum = new OutputImageComponentType[nc], *sum_end = sum + nc, *p_sum;
-  TPixel *sum = new TPixel[nc];
-
-  // Pointers into the sum array for the included components
-  TPixel *sum_start = sum + c_first, *sum_end = sum + c_last + 1;
+  TPixel *sum = new TPixel[nc * max_block];
 
   // Two versions of the code - I thought that maybe the second version (further down) would be
   // more optimized by the compiler, but if anything, I see an opposite effect (although tiny)
 
 #ifdef _ACCUM_ITER_CODE_
 
+  // This version only supports the AoS layout
+  OneDimensionalInPlaceAccumulatePlaneRange(
+        0, nc, nc_total, filter->GetComponentOffsetFront(), filter->GetComponentOffsetBack(),
+        c_first, c_last);
+  int n_skipped = c_first + (nc - 1 - c_last);
+
   TPixel *p_sum;
 
+  // Pointers into the sum array for the included components
+  TPixel *sum_start = sum + c_first, *sum_end = sum + c_last + 1;
+
   // Start iterating over lines
   for(itLine.GoToBegin(); !itLine.IsAtEnd(); itLine.NextLine())
     {
@@ -227,79 +305,100 @@ OneDimensionalInPlaceAccumulateFilterWorker<TPixel, TInputImage>
 
 #else
 
-  // Start iterating over lines
-  for(itLine.GoToBegin(); !itLine.IsAtEnd(); itLine.NextLine())
+  for(int plane = 0; plane < n_planes; plane++)
+  {
+  if(!OneDimensionalInPlaceAccumulatePlaneRange(
+       plane, nc, nc_total, filter->GetComponentOffsetFront(), filter->GetComponentOffsetBack(),
+       c_first, c_last))
+    continue;
+
+  // Start of the plane in the buffer
+  const TPixel *plane_buffer = image->GetBufferPointer() + plane * plane_size;
+
+  // Start iterating over blocks of adjacent lines
+  itLine.GoToBegin();
+  while(!itLine.IsAtEnd())
     {
+    int i, k, q;
 
-    int i, k, m;
+    // Get the next block of lines, which are treated as a single line of wide pixels
+    long offset_in_pixels;
+    int n_lines = OneDimensionalInPlaceAccumulateNextBlock(
+                    itLine, image->GetBufferPointer(), max_block, offset_in_pixels);
+    int nc_block = n_lines * nc;
 
     // Initialize the sum to zero
-    for(int k = c_first; k <= c_last; k++)
-      sum[k] = itk::NumericTraits<TPixel>::Zero;
+    for(q = 0; q < nc_block; q += nc)
+      for(k = q + c_first; k <= q + c_last; k++)
+        sum[k] = itk::NumericTraits<TPixel>::Zero;
 
     // Pointer to the current position in the line
     TPixel *p_line = line, *p_tail = p_line;
 
     // Pointer to the beginning of the scan line
-    long offset_in_pixels = itLine.GetPosition() - image->GetBufferPointer();
     long offset_in_comp = offset_in_pixels * nc;
 
     // Where we are scanning from
-    const TPixel *p_scan_pixel = image->GetBufferPointer() + offset_in_comp;
+    const TPixel *p_scan_pixel = plane_buffer + offset_in_comp;
 
     // Pointer used for writing, it will trail the scan pointer
     TPixel *p_write_pixel = const_cast<TPixel *>(p_scan_pixel);
 
     // Compute the initial sum
-    for(i = 0, m = 0; i < radius; i++)
+    for(i = 0; i < radius; i++)
       {
-      for(k = c_first; k <= c_last; k++)
-        {
-        sum[k] += p_line[k] = p_scan_pixel[k];
-        }
+      for(q = 0; q < nc_block; q += nc)
+        for(k = q + c_first; k <= q + c_last; k++)
+          {
+          sum[k] += p_line[k] = p_scan_pixel[k];
+          }
       p_scan_pixel += jump;
-      p_line += nc;
+      p_line += nc_block;
       }
 
     // For the next Radius + 1 values, add to the sum and write
     for(; i < kernel_width; i++)
       {
-      for(k = c_first; k <= c_last; k++)
-        {
-        p_write_pixel[k] = (sum[k] += p_line[k] = p_scan_pixel[k]);
-        }
+      for(q = 0; q < nc_block; q += nc)
+        for(k = q + c_first; k <= q + c_last; k++)
+          {
+          p_write_pixel[k] = (sum[k] += p_line[k] = p_scan_pixel[k]);
+          }
 
       p_scan_pixel += jump;
       p_write_pixel += jump;
-      p_line += nc;
+      p_line += nc_block;
       }
 
     // Continue until we hit the end of the scanline
     for(; i < line_length; i++)
       {
-      for(k = c_first; k <= c_last; k++)
-        {
-        p_write_pixel[k] = (sum[k] += (p_line[k] = p_scan_pixel[k]) - p_tail[k]);
-        }
+      for(q = 0; q < nc_block; q += nc)
+        for(k = q + c_first; k <= q + c_last; k++)
+          {
+          p_write_pixel[k] = (sum[k] += (p_line[k] = p_scan_pixel[k]) - p_tail[k]);
+          }
 
       p_scan_pixel += jump;
       p_write_pixel += jump;
-      p_line += nc;
-      p_tail += nc;
+      p_line += nc_block;
+      p_tail += nc_block;
       }
 
     // Fill out the last bit
     for(; i < line_length + radius; i++)
       {
-      for(k = c_first; k <= c_last; k++)
-        {
-        p_write_pixel[k] = (sum[k] -= p_tail[k]);
-        }
+      for(q = 0; q < nc_block; q += nc)
+        for(k = q + c_first; k <= q + c_last; k++)
+          {
+          p_write_pixel[k] = (sum[k] -= p_tail[k]);
+          }
 
       p_write_pixel += jump;
-      p_tail += nc;
+      p_tail += nc_block;
       }
     }
+  }
 #endif
 
   delete[] sum;
@@ -344,15 +443,26 @@ inline void free_aligned(void *pointer)
 }
 #endif
 
+/**
+ * Kahan summation step: adds x to sum, carrying the lost low-order bits in comp
+ */
+inline __m128 accumulate_kahan_ps(__m128 sum, __m128 x, __m128 &comp)
+{
+  __m128 y = _mm_sub_ps(x, comp);
+  __m128 t = _mm_add_ps(sum, y);
+  comp = _mm_sub_ps(_mm_sub_ps(t, sum), y);
+  return t;
+}
+
 /**
  * A specialization of the threaded generate data method for floating point images that uses
  * SSE intrinsics for faster computation
  */
-template <class TInputImage>
-class OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
+template <class TInputImage, class TLayout>
+class OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage, TLayout>
 {
 public:
-  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage> FilterType;
+  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout> FilterType;
   typedef typename FilterType::OutputImageRegionType OutputImageRegionType;
   typedef typename FilterType::InputImageType InputImageType;
   static void ThreadedGenerateData(FilterType *filter,
@@ -360,9 +470,9 @@ public:
                                    itk::ThreadIdType threadId);
 };
 
-template <class TInputImage>
+template <class TInputImage, class TLayout>
 void
-OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
+OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage, TLayout>
 ::ThreadedGenerateData(FilterType *filter,
                        const OutputImageRegionType & outputRegionForThread,
                        itk::ThreadIdType threadId)
@@ -372,6 +482,7 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
   int radius = filter->GetRadius();
   int skip_front = filter->GetComponentOffsetFront();
   int skip_back = filter->GetComponentOffsetBack();
+  bool compensated = filter->GetCompensatedSummation();
 
   // Get the image
   InputImageType *image = const_cast<InputImageType *>(filter->GetInput());
@@ -387,13 +498,12 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
   IteratorType itLine(image, outputRegionForThread);
   itLine.SetDirection(dimension);
 
-  // Get the number of components
-  int nc = image->GetNumberOfComponentsPerPixel();
-
-  // Get the first and last component for accumulation - these are optionally
-  // specified by the user. The remaining components are left untouched
-  int c_first = skip_front, c_last = (nc - 1) - skip_back;
-  int n_skipped = skip_front + skip_back;
+  // Get the number of components. Each plane of the layout is processed as an
+  // interleaved image with nc components
+  int nc_total = image->GetNumberOfComponentsPerPixel();
+  int nc = TLayout::GetPlaneWidth(nc_total);
+  int n_planes = TLayout::GetNumberOfPlanes(nc_total);
+  long plane_size = image->GetBufferedRegion().GetNumberOfPixels() * nc;
 
   // Get the offset corresponding to a move along the line for this iterator
   typename IteratorType::OffsetValueType jump = itLine.GetOffset(dimension) * nc;
@@ -404,8 +514,40 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
   // Width of the kernel (in whole pixels, then in components)
   int kernel_width = 2 * radius + 1;
 
+  // The number of components used in a plane is at most nc. The buffers are sized
+  // for the widest block of lines that any plane can produce (see below)
+  int nc_padded_max = 4 * ((nc + 3) / 4);
+  int nc_block_max = (dimension == 0) ? nc_padded_max : std::max(nc_padded_max, ACCUM_BLOCK_COMPONENTS);
+
+  // The following arrays are allocated temporarily
+  float *scanline, *tailline, *sum_align;
+
+  // This is a byte-aligned copy of the pixel column from the image
+  allocate_aligned(line_length * nc_block_max, &scanline);
+
+  // This is a second aligned copy
+  allocate_aligned(line_length * nc_block_max, &tailline);
+
+  // Aligned sum array - where the sums are computed
+  allocate_aligned(nc_block_max, &sum_align);
+
+  // Aligned array of Kahan compensation terms
+  float *comp_align;
+  allocate_aligned(nc_block_max, &comp_align);
+
+  // Clear the padding, so that it does not hold garbage (e.g., denormals)
+  std::fill(scanline, scanline + line_length * nc_block_max, 0.0f);
+
+  for(int plane = 0; plane < n_planes; plane++)
+  {
+  // Get the first and last component for accumulation within this plane - these are
+  // optionally specified by the user. The remaining components are left untouched
+  int c_first, c_last;
+  if(!OneDimensionalInPlaceAccumulatePlaneRange(plane, nc, nc_total, skip_front, skip_back, c_first, c_last))
+    continue;
+
   // We want some alignment for SIMD purposes. So we need to make a stride be a factor of 16 bytes
-  int nc_used = nc - n_skipped;
+  int nc_used = c_last - c_first + 1;
   int bytes_per_pixel = sizeof(float) * nc_used;
 
   // Round up, so it works out to 16 bytes
@@ -416,47 +558,49 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
   // Number of chunks of four components per pixel
   int nc_padded = padded_bytes_per_pixel / sizeof(float);
 
-  // The following arrays are allocated temporarily
-  float *scanline, *tailline, *sum_align;
+  // Maximum number of adjacent lines processed together. Each line occupies nc_padded
+  // components of the wide pixel, so the SIMD loops below are unchanged
+  int max_block = OneDimensionalInPlaceAccumulateMaxBlock(dimension, nc_padded);
 
-  // This is a byte-aligned copy of the pixel column from the image
-  allocate_aligned(line_length * nc_padded, &scanline);
+  // Start of the plane in the buffer
+  const float *plane_buffer = image->GetBufferPointer() + plane * plane_size;
 
-  // This is a second aligned copy
-  allocate_aligned(line_length * nc_padded, &tailline);
+  // Start iterating over blocks of adjacent lines
+  itLine.GoToBegin();
+  while(!itLine.IsAtEnd())
+    {
+    int i, k, b;
 
-  // End of the scanline
-  float *p_scanline_end = scanline + line_length * nc_padded;
+    // Get the next block of lines, which are treated as a single line of wide pixels
+    long offset_in_pixels;
+    int n_lines = OneDimensionalInPlaceAccumulateNextBlock(
+                    itLine, image->GetBufferPointer(), max_block, offset_in_pixels);
+    int nc_block = n_lines * nc_padded;
 
-  // Aligned sum array - where the sums are computed
-  allocate_aligned(nc_padded, &sum_align);
-
-  // Start iterating over lines
-  for(itLine.GoToBegin(); !itLine.IsAtEnd(); itLine.NextLine())
-    {
-    int i, k;
+    // End of the scanline
+    float *p_scanline_end = scanline + line_length * nc_block;
 
     // Pointer to the beginning of the scan line
-    long offset_in_pixels = itLine.GetPosition() - image->GetBufferPointer();
     long offset_in_comp = offset_in_pixels * nc;
 
     // Get the pointer to first component in first pixel
-    const float *p_scan_pixel = image->GetBufferPointer() + offset_in_comp + c_first;
+    const float *p_scan_pixel = plane_buffer + offset_in_comp + c_first;
 
     // Registers
-    __m128 m_line, m_tail, m_sum_cur, m_sum_new;
+    __m128 m_line, m_tail, m_sum_cur, m_sum_new, m_comp;
 
     // Copy the contents of the image into the aligned line
     float *p_copy = scanline;
     const float *p_src = p_scan_pixel;
-    for(; p_copy < p_scanline_end; p_copy += nc_padded, p_src += jump)
+    for(; p_copy < p_scanline_end; p_copy += nc_block, p_src += jump)
       {
 #ifndef WIN32
       __builtin_prefetch(p_src + 5 * jump, 0, 0);
 #endif 
 
-      for (i = 0; i < nc_used; i++)
-        p_copy[i] = p_src[i];
+      for (b = 0; b < n_lines; b++)
+        for (i = 0; i < nc_used; i++)
+          p_copy[b * nc_padded + i] = p_src[b * nc + i];
       }
 
     // Make a copy of the scan line
@@ -467,8 +611,8 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
       }
 
     // Clear the sum array at the beginning
-    for(k = 0; k < nc_padded; k++)
-      sum_align[k] = 0.0;
+    for(k = 0; k < nc_block; k++)
+      sum_align[k] = comp_align[k] = 0.0;
 
     // Pointer to the current position in the line
     float *p_line = scanline, *p_tail = tailline;
@@ -477,77 +621,144 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
     float *p_write_pixel = scanline;
 
     // Pointer used for writing, it will trail the scan pointer
-    float *p_sum_end = sum_align + nc_padded, *p_sum;
+    float *p_sum_end = sum_align + nc_block, *p_sum;
 
-    // Compute the initial sum
-    for(i = 0; i < radius; i++)
+    if(!compensated)
       {
-      for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4)
+      // Compute the initial sum
+      for(i = 0; i < radius; i++)
         {
-        m_line = _mm_load_ps(p_line);
-        m_sum_cur = _mm_load_ps(p_sum);
-        m_sum_new = _mm_add_ps(m_sum_cur, m_line);
-        _mm_store_ps(p_sum, m_sum_new);
+        for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_sum_cur = _mm_load_ps(p_sum);
+          m_sum_new = _mm_add_ps(m_sum_cur, m_line);
+          _mm_store_ps(p_sum, m_sum_new);
+          }
         }
-      }
 
-    // For the next Radius + 1 values, add to the sum and write
-    for(; i < kernel_width; i++)
-      {
-      for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4, p_write_pixel+=4)
+      // For the next Radius + 1 values, add to the sum and write
+      for(; i < kernel_width; i++)
         {
-        m_line = _mm_load_ps(p_line);
-        m_sum_cur = _mm_load_ps(p_sum);
-        m_sum_new = _mm_add_ps(m_sum_cur, m_line);
-        _mm_store_ps(p_sum, m_sum_new);
-        _mm_store_ps(p_write_pixel, m_sum_new);
+        for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4, p_write_pixel+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_sum_cur = _mm_load_ps(p_sum);
+          m_sum_new = _mm_add_ps(m_sum_cur, m_line);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
         }
-      }
 
-    // Continue until we hit the end of the scanline
-    for(; i < line_length; i++)
-      {
-      for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4, p_tail+=4, p_write_pixel+=4)
+      // Continue until we hit the end of the scanline
+      for(; i < line_length; i++)
         {
-        m_line = _mm_load_ps(p_line);
-        m_tail = _mm_load_ps(p_tail);
-        m_sum_cur = _mm_load_ps(p_sum);
-        m_sum_new = _mm_add_ps(m_sum_cur, _mm_sub_ps(m_line, m_tail));
-        _mm_store_ps(p_sum, m_sum_new);
-        _mm_store_ps(p_write_pixel, m_sum_new);
+        for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_line+=4, p_tail+=4, p_write_pixel+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_tail = _mm_load_ps(p_tail);
+          m_sum_cur = _mm_load_ps(p_sum);
+          m_sum_new = _mm_add_ps(m_sum_cur, _mm_sub_ps(m_line, m_tail));
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
         }
-      }
 
-    // Fill out the last bit
-    for(; i < line_length + radius; i++)
+      // Fill out the last bit
+      for(; i < line_length + radius; i++)
+        {
+        for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_tail+=4, p_write_pixel+=4)
+          {
+          m_tail = _mm_load_ps(p_tail);
+          m_sum_cur = _mm_load_ps(p_sum);
+          m_sum_new = _mm_sub_ps(m_sum_cur, m_tail);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
+        }
+      }
+    else
       {
-      for(p_sum = sum_align; p_sum < p_sum_end; p_sum+=4, p_tail+=4, p_write_pixel+=4)
+      // Same as above, but with compensated summation
+      float *p_comp;
+
+      // Compute the initial sum
+      for(i = 0; i < radius; i++)
         {
-        m_tail = _mm_load_ps(p_tail);
-        m_sum_cur = _mm_load_ps(p_sum);
-        m_sum_new = _mm_sub_ps(m_sum_cur, m_tail);
-        _mm_store_ps(p_sum, m_sum_new);
-        _mm_store_ps(p_write_pixel, m_sum_new);
+        for(p_sum = sum_align, p_comp = comp_align; p_sum < p_sum_end; p_sum+=4, p_comp+=4, p_line+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_comp = _mm_load_ps(p_comp);
+          m_sum_new = accumulate_kahan_ps(_mm_load_ps(p_sum), m_line, m_comp);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_comp, m_comp);
+          }
+        }
+
+      // For the next Radius + 1 values, add to the sum and write
+      for(; i < kernel_width; i++)
+        {
+        for(p_sum = sum_align, p_comp = comp_align; p_sum < p_sum_end; p_sum+=4, p_comp+=4, p_line+=4, p_write_pixel+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_comp = _mm_load_ps(p_comp);
+          m_sum_new = accumulate_kahan_ps(_mm_load_ps(p_sum), m_line, m_comp);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_comp, m_comp);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
+        }
+
+      // Continue until we hit the end of the scanline
+      for(; i < line_length; i++)
+        {
+        for(p_sum = sum_align, p_comp = comp_align; p_sum < p_sum_end; p_sum+=4, p_comp+=4, p_line+=4, p_tail+=4, p_write_pixel+=4)
+          {
+          m_line = _mm_load_ps(p_line);
+          m_tail = _mm_load_ps(p_tail);
+          m_comp = _mm_load_ps(p_comp);
+          m_sum_new = accumulate_kahan_ps(_mm_load_ps(p_sum), _mm_sub_ps(m_line, m_tail), m_comp);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_comp, m_comp);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
+        }
+
+      // Fill out the last bit
+      for(; i < line_length + radius; i++)
+        {
+        for(p_sum = sum_align, p_comp = comp_align; p_sum < p_sum_end; p_sum+=4, p_comp+=4, p_tail+=4, p_write_pixel+=4)
+          {
+          m_tail = _mm_load_ps(p_tail);
+          m_comp = _mm_load_ps(p_comp);
+          m_sum_new = accumulate_kahan_ps(_mm_load_ps(p_sum), _mm_sub_ps(_mm_setzero_ps(), m_tail), m_comp);
+          _mm_store_ps(p_sum, m_sum_new);
+          _mm_store_ps(p_comp, m_comp);
+          _mm_store_ps(p_write_pixel, m_sum_new);
+          }
         }
       }
 
     // Copy the accumulated pixels back into the main image
     float *p_copy_back = const_cast<float *>(p_scan_pixel);
     const float *p_src_back = scanline;
-    for(; p_src_back < p_scanline_end; p_src_back += nc_padded, p_copy_back += jump)
+    for(; p_src_back < p_scanline_end; p_src_back += nc_block, p_copy_back += jump)
       {
 #ifndef WIN32
       __builtin_prefetch(p_copy_back + 5 * jump, 1, 0);
 #endif
-      for(i = 0; i < nc_used; i++)
-        p_copy_back[i] = p_src_back[i];
+      for(b = 0; b < n_lines; b++)
+        for(i = 0; i < nc_used; i++)
+          p_copy_back[b * nc + i] = p_src_back[b * nc_padded + i];
       }
     }
+  }
 
   // Free allocated memory
   free_aligned(tailline);
   free_aligned(scanline);
   free_aligned(sum_align);
+  free_aligned(comp_align);
 }
 
 #endif // _NCC_SSE_
@@ -556,26 +767,27 @@ OneDimensionalInPlaceAccumulateFilterWorker<float, TInputImage>
 /**
  * Default implementaton of the threaded generate data method
  */
-template <class TInputImage>
+template <class TInputImage, class TLayout>
 void
-OneDimensionalInPlaceAccumulateFilter<TInputImage>
+OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout>
 ::ThreadedGenerateData(
     const OutputImageRegionType & outputRegionForThread,
     itk::ThreadIdType threadId)
 {
-  typedef OneDimensionalInPlaceAccumulateFilterWorker<OutputImageComponentType, InputImageType> WorkerType;
+  typedef OneDimensionalInPlaceAccumulateFilterWorker<OutputImageComponentType, InputImageType, TLayout> WorkerType;
   WorkerType::ThreadedGenerateData(this, outputRegionForThread, threadId);
 }
 
 
 
 
-template <class TInputImage>
+template <class TInputImage, class TLayout>
 typename TInputImage::Pointer
 AccumulateNeighborhoodSumsInPlace(TInputImage *image, const typename TInputImage::SizeType &radius,
-                                  int num_ignored_at_start, int num_ignored_at_end)
+                                  int num_ignored_at_start, int num_ignored_at_end,
+                                  bool compensated, int n_threads)
 {
-  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage> AccumFilterType;
+  typedef OneDimensionalInPlaceAccumulateFilter<TInputImage, TLayout> AccumFilterType;
 
   typename itk::ImageSource<TInputImage>::Pointer pipeTail;
   for(int dir = 0; dir < TInputImage::ImageDimension; dir++)
@@ -585,6 +797,9 @@ AccumulateNeighborhoodSumsInPlace(TInputImage *image, const typename TInputImage
     accum->SetDimension(dir);
     accum->SetRadius(radius[dir]);
     accum->SetComponentRange(num_ignored_at_start, num_ignored_at_end);
+    accum->SetCompensatedSummation(compensated);
+    if(n_threads > 0)
+      accum->SetNumberOfThreads(n_threads);
     pipeTail = accum;
 
     accum->Update();
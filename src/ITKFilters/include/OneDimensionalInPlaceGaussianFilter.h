@@ -0,0 +1,153 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef ONEDIMENSIONALINPLACEGAUSSIANFILTER_H
+#define ONEDIMENSIONALINPLACEGAUSSIANFILTER_H
+
+#include "itkInPlaceImageFilter.h"
+#include "itkImageRegionSplitterDirection.h"
+#include "itkNumericTraitsCovariantVectorPixel.h"
+
+/**
+ * This is a filter for fast approximate Gaussian smoothing of multi-component images
+ * (vector fields, VectorImages) along a single image dimension. Like the accumulate
+ * filter, it is meant to be applied once in each dimension. All components of a pixel
+ * are filtered together, so each scanline is read and written only once regardless
+ * of the number of components.
+ *
+ * Two approximations are supported:
+ *   RECURSIVE     third-order recursive filter of Young and van Vliet (1995). The cost
+ *                 does not depend on sigma. The coefficients are only valid for sigma of
+ *                 0.5 voxels and up, so smaller positive sigmas are raised to 0.5.
+ *   EXTENDED_BOX  cascade of extended box filters (Gwosdek et al., 2011). The accuracy is
+ *                 controlled with the number of passes, 3 is adequate, 5 is very close
+ *                 to a true Gaussian.
+ *
+ * Boundaries are handled by replicating the edge pixels. Sigma is given in voxel units.
+ *
+ * Each scanline is copied into a buffer before it is filtered, so the filter may be
+ * run in place or with the output grafted onto the input.
+ */
+template <class TInputImage>
+class OneDimensionalInPlaceGaussianFilter : public itk::InPlaceImageFilter<TInputImage, TInputImage>
+{
+public:
+
+  typedef OneDimensionalInPlaceGaussianFilter<TInputImage> Self;
+  typedef itk::InPlaceImageFilter<TInputImage, TInputImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkTypeMacro(OneDimensionalInPlaceGaussianFilter, itk::InPlaceImageFilter)
+
+  itkNewMacro(Self)
+
+  /** Some convenient typedefs. */
+  typedef TInputImage                                  InputImageType;
+  typedef TInputImage                                  OutputImageType;
+  typedef typename OutputImageType::Pointer            OutputImagePointer;
+  typedef typename OutputImageType::RegionType         OutputImageRegionType;
+  typedef typename OutputImageType::InternalPixelType  OutputImageInternalPixelType;
+
+  /** Scalar type of the pixel components, e.g., float for CovariantVector<float,3> */
+  typedef typename itk::NumericTraits<OutputImageInternalPixelType>::ValueType ComponentType;
+
+  /** Precision used for the intermediate computations */
+  typedef typename itk::NumericTraits<ComponentType>::RealType RealType;
+
+  /** We use a custom splitter */
+  typedef itk::ImageRegionSplitterDirection    SplitterType;
+
+  /** ImageDimension constant */
+  itkStaticConstMacro(OutputImageDimension, unsigned int, TInputImage::ImageDimension);
+
+  /** Approximation method */
+  enum Method { RECURSIVE = 0, EXTENDED_BOX };
+
+  itkGetMacro(Dimension, int)
+  itkSetMacro(Dimension, int)
+
+  itkGetMacro(Sigma, double)
+  itkSetMacro(Sigma, double)
+
+  /** Smallest sigma (in voxels) applied by the RECURSIVE method */
+  static double GetMinimumRecursiveSigma() { return 0.5; }
+
+  itkGetMacro(Method, Method)
+  itkSetMacro(Method, Method)
+
+  itkGetMacro(NumberOfBoxPasses, int)
+  itkSetMacro(NumberOfBoxPasses, int)
+
+protected:
+
+  OneDimensionalInPlaceGaussianFilter();
+  ~OneDimensionalInPlaceGaussianFilter() {}
+
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  virtual void ThreadedGenerateData(
+      const OutputImageRegionType & outputRegionForThread,
+      itk::ThreadIdType threadId) ITK_OVERRIDE;
+
+  virtual const itk::ImageRegionSplitterBase *GetImageRegionSplitter(void) const ITK_OVERRIDE;
+
+  // Filter a single scanline of nc-component pixels. The line is padded by GetPadding()
+  // pixels on both sides, and the result is placed back into the line
+  void FilterLineRecursive(RealType *line, int length, int nc);
+  void FilterLineExtendedBox(RealType *line, RealType *work, RealType *sum, int length, int nc);
+
+  // Number of pixels of padding needed on each side of the scanline
+  int GetPadding() const;
+
+  // Dimension of smoothing
+  int m_Dimension;
+
+  // Standard deviation in voxel units
+  double m_Sigma;
+
+  // Approximation method and number of passes for the box method
+  Method m_Method;
+  int m_NumberOfBoxPasses;
+
+  // Coefficients of the recursive filter
+  RealType m_RecursiveB, m_RecursiveA[3];
+
+  // Radius and weights of the extended box filter
+  int m_BoxRadius;
+  RealType m_BoxInnerWeight, m_BoxOuterWeight;
+
+  // Region splitter
+  typename SplitterType::Pointer m_Splitter;
+
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "OneDimensionalInPlaceGaussianFilter.txx"
+#endif
+
+
+#endif // ONEDIMENSIONALINPLACEGAUSSIANFILTER_H
@@ -0,0 +1,261 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "OneDimensionalInPlaceGaussianFilter.h"
+#include <itkImageLinearIteratorWithIndex.h>
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <vector>
+#include <algorithm>
+
+
+template <class TInputImage>
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::OneDimensionalInPlaceGaussianFilter()
+{
+  m_Dimension = 0;
+  m_Sigma = 0.0;
+  m_Method = RECURSIVE;
+  m_NumberOfBoxPasses = 3;
+  m_RecursiveB = 1.0;
+  m_RecursiveA[0] = m_RecursiveA[1] = m_RecursiveA[2] = 0.0;
+  m_BoxRadius = 0;
+  m_BoxInnerWeight = 1.0;
+  m_BoxOuterWeight = 0.0;
+  m_Splitter = SplitterType::New();
+  this->InPlaceOn();
+}
+
+template <class TInputImage>
+const itk::ImageRegionSplitterBase *
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::GetImageRegionSplitter(void) const
+{
+  m_Splitter->SetDirection(m_Dimension);
+  return m_Splitter;
+}
+
+template <class TInputImage>
+int
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::GetPadding() const
+{
+  return (m_Method == RECURSIVE) ? 3 : m_BoxRadius + 1;
+}
+
+template <class TInputImage>
+void
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::BeforeThreadedGenerateData()
+{
+  double sigma = m_Sigma;
+
+  if(m_Method == RECURSIVE)
+    {
+    // Young and van Vliet (1995), Signal Processing 44:139-151, Eqs. 11b and 8c. The
+    // fit for q breaks down below half a voxel
+    sigma = std::max(sigma, GetMinimumRecursiveSigma());
+    double q = (sigma >= 2.5)
+               ? 0.98711 * sigma - 0.96330
+               : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double q2 = q * q, q3 = q2 * q;
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+    double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+    double b2 = -(1.4281 * q2 + 1.26661 * q3);
+    double b3 = 0.422205 * q3;
+
+    m_RecursiveA[0] = b1 / b0;
+    m_RecursiveA[1] = b2 / b0;
+    m_RecursiveA[2] = b3 / b0;
+    m_RecursiveB = 1.0 - (b1 + b2 + b3) / b0;
+    }
+  else
+    {
+    if(m_NumberOfBoxPasses < 1)
+      itkExceptionMacro(<< "Number of box filter passes must be positive");
+
+    // Each pass contributes 1/n of the total variance. The box of radius r has variance
+    // r(r+1)/3 and the remaining variance is made up by the fractional weight alpha given
+    // to the two pixels just outside of the box (Gwosdek et al., 2011, SSVM)
+    double s2 = sigma * sigma / m_NumberOfBoxPasses;
+    int r = (int) floor(0.5 * (sqrt(1.0 + 12.0 * s2) - 1.0));
+    double alpha = (2 * r + 1) * (s2 - r * (r + 1) / 3.0) / (2.0 * ((r + 1) * (r + 1) - s2));
+
+    m_BoxRadius = r;
+    m_BoxInnerWeight = 1.0 / (2 * r + 1 + 2 * alpha);
+    m_BoxOuterWeight = alpha * m_BoxInnerWeight;
+    }
+}
+
+/**
+ * Replicate the first and last pixel of a scanline into the padding
+ */
+template <class TReal>
+inline void
+OneDimensionalInPlaceGaussianFilterPadLine(TReal *line, int length, int nc, int pad)
+{
+  const TReal *first = line + pad * nc, *last = line + (pad + length - 1) * nc;
+  TReal *p_front = line, *p_back = line + (pad + length) * nc;
+  for(int j = 0; j < pad; j++, p_front += nc, p_back += nc)
+    {
+    for(int k = 0; k < nc; k++)
+      {
+      p_front[k] = first[k];
+      p_back[k] = last[k];
+      }
+    }
+}
+
+template <class TInputImage>
+void
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::FilterLineRecursive(RealType *line, int length, int nc)
+{
+  const RealType B = m_RecursiveB, a1 = m_RecursiveA[0], a2 = m_RecursiveA[1], a3 = m_RecursiveA[2];
+  const int nc2 = 2 * nc, nc3 = 3 * nc;
+
+  // Causal pass, the signal before the start of the line equals the first pixel
+  OneDimensionalInPlaceGaussianFilterPadLine(line, length, nc, 3);
+  RealType *p_start = line + 3 * nc, *p_end = p_start + length * nc, *p;
+  for(p = p_start; p < p_end; p += nc)
+    for(int k = 0; k < nc; k++)
+      p[k] = B * p[k] + a1 * p[k - nc] + a2 * p[k - nc2] + a3 * p[k - nc3];
+
+  // Anti-causal pass, the signal past the end of the line equals the last causal output
+  const RealType *p_last = p_end - nc;
+  for(int j = 0; j < 3; j++)
+    for(int k = 0; k < nc; k++)
+      p_end[j * nc + k] = p_last[k];
+
+  for(p = p_end - nc; p >= p_start; p -= nc)
+    for(int k = 0; k < nc; k++)
+      p[k] = B * p[k] + a1 * p[k + nc] + a2 * p[k + nc2] + a3 * p[k + nc3];
+}
+
+template <class TInputImage>
+void
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::FilterLineExtendedBox(RealType *line, RealType *work, RealType *sum, int length, int nc)
+{
+  const int r = m_BoxRadius, pad = r + 1;
+  const RealType c_in = m_BoxInnerWeight, c_out = m_BoxOuterWeight;
+  const int off_out = pad * nc, off_in = r * nc;
+
+  RealType *src = line, *trg = work;
+  for(int pass = 0; pass < m_NumberOfBoxPasses; pass++)
+    {
+    OneDimensionalInPlaceGaussianFilterPadLine(src, length, nc, pad);
+
+    // Initial box sum, centered on the first pixel
+    const RealType *p_src = src + pad * nc;
+    for(int k = 0; k < nc; k++)
+      sum[k] = 0.0;
+    for(const RealType *p = p_src - off_in; p <= p_src + off_in; p += nc)
+      for(int k = 0; k < nc; k++)
+        sum[k] += p[k];
+
+    // Slide the box along the line
+    RealType *p_trg = trg + pad * nc;
+    for(int i = 0; i < length; i++, p_src += nc, p_trg += nc)
+      {
+      const RealType *p_lo = p_src - off_out, *p_hi = p_src + off_out, *p_tail = p_src - off_in;
+      for(int k = 0; k < nc; k++)
+        {
+        p_trg[k] = c_in * sum[k] + c_out * (p_lo[k] + p_hi[k]);
+        sum[k] += p_hi[k] - p_tail[k];
+        }
+      }
+
+    std::swap(src, trg);
+    }
+
+  // Make sure the result ends up in the line
+  if(src != line)
+    std::copy(src + pad * nc, src + (pad + length) * nc, line + pad * nc);
+}
+
+template <class TInputImage>
+void
+OneDimensionalInPlaceGaussianFilter<TInputImage>
+::ThreadedGenerateData(
+    const OutputImageRegionType & outputRegionForThread,
+    itk::ThreadIdType threadId)
+{
+  const InputImageType *input = this->GetInput();
+  OutputImageType *output = this->GetOutput();
+
+  // Set up the iterator that will go through all the lines in the
+  // output region. We assume that the lines span the whole length of
+  // the input, i.e., the threading direction does not interfere
+  typedef itk::ImageLinearIteratorWithIndex<TInputImage> IteratorBaseType;
+  typedef IteratorExtenderWithOffset<IteratorBaseType> IteratorType;
+  IteratorType itLine(output, outputRegionForThread);
+  itLine.SetDirection(m_Dimension);
+
+  // Number of components, the pixels are treated as arrays of ComponentType
+  int nc = output->GetNumberOfComponentsPerPixel();
+  const ComponentType *in_buffer = reinterpret_cast<const ComponentType *>(input->GetBufferPointer());
+  ComponentType *out_buffer = reinterpret_cast<ComponentType *>(output->GetBufferPointer());
+
+  // Jump between consecutive pixels in the line (in components)
+  typename IteratorType::OffsetValueType jump = itLine.GetOffset(m_Dimension) * nc;
+
+  // Length of the line and the amount of padding
+  int line_length = outputRegionForThread.GetSize(m_Dimension);
+  int pad = this->GetPadding();
+
+  // Line buffers in interleaved (pixel-major) order, so that all components of a pixel
+  // are filtered together
+  std::vector<RealType> line((line_length + 2 * pad) * nc), work(line.size()), sum(nc);
+  RealType *p_line_start = &line[pad * nc];
+
+  for(itLine.GoToBegin(); !itLine.IsAtEnd(); itLine.NextLine())
+    {
+    long offset_in_comp = (itLine.GetPosition() - output->GetBufferPointer()) * nc;
+
+    // Copy the scanline into the buffer
+    const ComponentType *p_src = in_buffer + offset_in_comp;
+    RealType *p_line = p_line_start;
+    for(int i = 0; i < line_length; i++, p_src += jump, p_line += nc)
+      for(int k = 0; k < nc; k++)
+        p_line[k] = p_src[k];
+
+    // Apply the filter
+    if(m_Sigma > 0.0)
+      {
+      if(m_Method == RECURSIVE)
+        this->FilterLineRecursive(&line[0], line_length, nc);
+      else
+        this->FilterLineExtendedBox(&line[0], &work[0], &sum[0], line_length, nc);
+      }
+
+    // Copy the result back
+    ComponentType *p_trg = out_buffer + offset_in_comp;
+    p_line = p_line_start;
+    for(int i = 0; i < line_length; i++, p_trg += jump, p_line += nc)
+      for(int k = 0; k < nc; k++)
+        p_trg[k] = static_cast<ComponentType>(p_line[k]);
+    }
+}
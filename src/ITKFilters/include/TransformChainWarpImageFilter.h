@@ -0,0 +1,148 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef TRANSFORMCHAINWARPIMAGEFILTER_H
+#define TRANSFORMCHAINWARPIMAGEFILTER_H
+
+#include "lddmm_common.h"
+#include "itkImageToImageFilter.h"
+#include <vnl/vnl_matrix_fixed.h>
+#include <vnl/vnl_vector_fixed.h>
+#include <vector>
+
+/**
+ * This filter resamples a moving image into a reference space through a chain
+ * of transforms that is evaluated point by point, so that the chain never has
+ * to be composed into a deformation field. Each element of the chain is either
+ * an affine transform x -> A x + b or a displacement field, both in physical
+ * (ITK) coordinates. The elements are applied in the order in which they were
+ * added, i.e., output voxel x samples the moving image at T_n(...T_2(T_1(x))).
+ *
+ * Displacement fields are interpolated linearly and are taken to be zero
+ * outside of their domain. The moving image is interpolated linearly or with
+ * the nearest neighbor.
+ */
+template <class TInputImage, class TOutputImage, class TDeformationField>
+class TransformChainWarpImageFilter
+        : public itk::ImageToImageFilter<TInputImage, TOutputImage>
+{
+public:
+  typedef TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField> Self;
+  typedef itk::ImageToImageFilter<TInputImage, TOutputImage>       Superclass;
+  typedef itk::SmartPointer<Self>                                  Pointer;
+  typedef itk::SmartPointer<const Self>                            ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( TransformChainWarpImageFilter, ImageToImageFilter )
+
+  /** Determine the image dimension. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TInputImage::ImageDimension );
+
+  typedef TInputImage                                 InputImageType;
+  typedef TOutputImage                                OutputImageType;
+  typedef TDeformationField                           DeformationFieldType;
+  typedef typename Superclass::OutputImageRegionType  OutputImageRegionType;
+  typedef typename InputImageType::IndexType          IndexType;
+  typedef typename OutputImageType::InternalPixelType OutputComponentType;
+  typedef itk::ImageBase<ImageDimension>              ImageBaseType;
+
+  typedef vnl_matrix_fixed<double, ImageDimension, ImageDimension> MatrixType;
+  typedef vnl_vector_fixed<double, ImageDimension>                 VectorType;
+
+  /** Set the moving image */
+  itkNamedInputMacro(MovingImage, InputImageType, "Primary")
+
+  /** Set the reference space, which determines the geometry of the output */
+  void SetReferenceSpace(ImageBaseType *ref)
+    { m_ReferenceSpace = ref; this->Modified(); }
+
+  /** Append an affine transform x -> A x + b to the chain */
+  void AddAffineTransform(const MatrixType &A, const VectorType &b);
+
+  /** Append a displacement field in physical units to the chain */
+  void AddDeformationField(DeformationFieldType *warp);
+
+  /** Remove all transforms from the chain */
+  void ClearTransforms()
+    { m_Chain.clear(); this->Modified(); }
+
+  /** Number of transforms in the chain */
+  unsigned int GetNumberOfTransforms() const { return m_Chain.size(); }
+
+  /** Should nearest neighbor interpolation be used? */
+  itkSetMacro(UseNearestNeighbor, bool)
+  itkGetMacro(UseNearestNeighbor, bool)
+
+  /** The outside value is used for samples outside of the moving image */
+  itkSetMacro(OutsideValue, OutputComponentType)
+  itkGetMacro(OutsideValue, OutputComponentType)
+
+protected:
+
+  TransformChainWarpImageFilter()
+  : m_UseNearestNeighbor(false), m_OutsideValue(0.0) { }
+
+  ~TransformChainWarpImageFilter() {}
+
+  void ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
+                            itk::ThreadIdType threadId ) ITK_OVERRIDE;
+
+  virtual void VerifyInputInformation() ITK_OVERRIDE {}
+
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  // An element of the chain. If the warp is set, the element is a displacement
+  // field, otherwise it is the affine transform
+  struct ChainElement
+  {
+    MatrixType A;
+    VectorType b;
+    typename DeformationFieldType::Pointer warp;
+  };
+
+  std::vector<ChainElement> m_Chain;
+
+  typename ImageBaseType::Pointer m_ReferenceSpace;
+
+  bool m_UseNearestNeighbor;
+
+  OutputComponentType m_OutsideValue;
+
+private:
+  TransformChainWarpImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+};
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "TransformChainWarpImageFilter.txx"
+#endif
+
+#endif // TRANSFORMCHAINWARPIMAGEFILTER_H
@@ -0,0 +1,190 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef TRANSFORMCHAINWARPIMAGEFILTER_TXX
+#define TRANSFORMCHAINWARPIMAGEFILTER_TXX
+
+#include "FastLinearInterpolator.h"
+#include "TransformChainWarpImageFilter.h"
+#include "ImageRegionConstIteratorWithIndexOverride.h"
+#include <vector>
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+void
+TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField>
+::AddAffineTransform(const MatrixType &A, const VectorType &b)
+{
+  ChainElement e;
+  e.A = A;
+  e.b = b;
+  m_Chain.push_back(e);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+void
+TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField>
+::AddDeformationField(DeformationFieldType *warp)
+{
+  ChainElement e;
+  e.warp = warp;
+  m_Chain.push_back(e);
+  this->Modified();
+}
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+void
+TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType threadId)
+{
+  InputImageType *input = this->GetMovingImage();
+  OutputImageType *output = this->GetOutput();
+
+  int line_len = outputRegionForThread.GetSize(0);
+
+  // Determine the appropriate float/double type for the interpolator.
+  typedef typename itk::NumericTraits<OutputComponentType>::MeasurementVectorType::ValueType FloatType;
+
+  // Create a fast interpolator for the moving image
+  typedef FastLinearInterpolator<TInputImage, FloatType, ImageDimension> FastInterpolator;
+  FastInterpolator fi(input);
+  fi.SetOutsideValue(m_OutsideValue);
+  int ncomp = fi.GetPointerIncrement();
+
+  // Create an interpolator for each displacement field in the chain
+  typedef FastLinearInterpolator<DeformationFieldType, double, ImageDimension> WarpInterpolator;
+  typedef typename WarpInterpolator::OutputComponentType WarpVectorType;
+  std::vector<WarpInterpolator *> fi_warp(m_Chain.size(), NULL);
+  for(unsigned int k = 0; k < m_Chain.size(); k++)
+    if(m_Chain[k].warp)
+      fi_warp[k] = new WarpInterpolator(m_Chain[k].warp);
+
+  // Per-line buffers for the sample positions and the interpolation status
+  std::vector<FloatType> cix_line(line_len * ImageDimension);
+  std::vector<typename FastInterpolator::InOut> status_line(line_len);
+
+  typedef itk::ImageLinearIteratorWithIndex<OutputImageType> IterBase;
+  typedef IteratorExtender<IterBase> IterType;
+
+  for(IterType it(output, outputRegionForThread); !it.IsAtEnd(); it.NextLine())
+    {
+    OutputComponentType *out = it.GetPixelPointer(output);
+
+    // Compute starting point and point step along the line
+    IndexType idx = it.GetIndex();
+    itk::Point<double, ImageDimension> p0, p_step;
+    output->TransformIndexToPhysicalPoint(idx, p0);
+    idx[0] += 1;
+    output->TransformIndexToPhysicalPoint(idx, p_step);
+
+    // Map each point on the line through the chain
+    FloatType *cix = &cix_line[0];
+    for(int i = 0; i < line_len; i++, cix += ImageDimension)
+      {
+      itk::Point<double, ImageDimension> p;
+      for(int j = 0; j < ImageDimension; j++)
+        p[j] = p0[j] + i * (p_step[j] - p0[j]);
+
+      for(unsigned int k = 0; k < m_Chain.size(); k++)
+        {
+        const ChainElement &e = m_Chain[k];
+        if(e.warp)
+          {
+          itk::ContinuousIndex<double, ImageDimension> cix_w;
+          e.warp->TransformPhysicalPointToContinuousIndex(p, cix_w);
+
+          double cix_warp[ImageDimension];
+          for(int j = 0; j < ImageDimension; j++)
+            cix_warp[j] = cix_w[j];
+
+          WarpVectorType w;
+          if(fi_warp[k]->Interpolate(cix_warp, &w) != WarpInterpolator::OUTSIDE)
+            for(int j = 0; j < ImageDimension; j++)
+              p[j] += w[j];
+          }
+        else
+          {
+          VectorType q = e.A * p.GetVnlVector() + e.b;
+          for(int j = 0; j < ImageDimension; j++)
+            p[j] = q[j];
+          }
+        }
+
+      itk::ContinuousIndex<FloatType, ImageDimension> cix_mov;
+      input->TransformPhysicalPointToContinuousIndex(p, cix_mov);
+      for(int j = 0; j < ImageDimension; j++)
+        cix[j] = cix_mov[j];
+      }
+
+    // Perform the interpolation for the whole line
+    cix = &cix_line[0];
+    if(m_UseNearestNeighbor)
+      {
+      for(int i = 0; i < line_len; i++, cix += ImageDimension)
+        status_line[i] = fi.InterpolateNearestNeighbor(cix, out + i * ncomp);
+      }
+    else
+      {
+      fi.Interpolate(line_len, cix, out, &status_line[0]);
+      }
+
+    // Assign the outside value to the samples that fell outside of the image
+    for(int i = 0; i < line_len; i++, out += ncomp)
+      {
+      if(status_line[i] == FastInterpolator::OUTSIDE)
+        {
+        for(int k = 0; k < ncomp; k++)
+          out[k] = m_OutsideValue;
+        }
+      }
+    }
+
+  for(unsigned int k = 0; k < fi_warp.size(); k++)
+    delete fi_warp[k];
+}
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+void
+TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField>
+::GenerateInputRequestedRegion()
+{
+  this->GetMovingImage()->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template <class TInputImage, class TOutputImage, class TDeformationField>
+void
+TransformChainWarpImageFilter<TInputImage,TOutputImage,TDeformationField>
+::GenerateOutputInformation()
+{
+  Superclass::GenerateOutputInformation();
+
+  OutputImageType *output = this->GetOutput();
+  output->CopyInformation(m_ReferenceSpace);
+  output->SetNumberOfComponentsPerPixel(this->GetMovingImage()->GetNumberOfComponentsPerPixel());
+}
+
+#endif // TRANSFORMCHAINWARPIMAGEFILTER_TXX
@@ -37,12 +37,20 @@
 #include "MultiComponentApproximateNCCImageMetric.h"
 #include "MultiComponentMutualInfoImageMetric.h"
 #include "MahalanobisDistanceToTargetWarpMetric.h"
+#include "BruteForceNCCSearchImageFilter.h"
+#include "FixedPointWarpInverseImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
 #include "OneDimensionalInPlaceAccumulateFilter.h"
 #include "itkUnaryFunctorImageFilter.h"
 #include "itkImageFileWriter.h"
+#include "itkRegionOfInterestImageFilter.h"
 #include "GreedyException.h"
 #include "WarpFunctors.h"
+#include "CounterBasedRandom.h"
+#include "HalfPrecision.h"
+#include "ParallelFor.h"
+#include <map>
+#include <algorithm>
 
 template <class TFloat, unsigned int VDim>
 void
@@ -160,7 +168,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
       // Run the accumulation filter on the mask
       typename FloatImageType::Pointer mask_accum =
-          AccumulateNeighborhoodSumsInPlace(mask_copy.GetPointer(), radius);
+          AccumulateNeighborhoodSumsInPlace(mask_copy.GetPointer(), radius, 0, 0, false,
+                                            ParallelFor::GetNumberOfThreads());
 
       // Threshold the mask copy
       LDDMMType::img_threshold_in_place(mask_accum, 0.25, 1e100, 0.5, 0);
@@ -174,198 +183,437 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
-::BuildCompositeImages(double noise_sigma_relative)
+::BuildAffineSampleMasks(double fraction, bool stratified, const SizeType *ncc_radius)
 {
   typedef LDDMMData<TFloat, VDim> LDDMMType;
 
-  // Offsets into the composite images
-  int off_fixed = 0, off_moving = 0;
+  // Number of mask voxels per stratum
+  int stride = std::max(1, (int) (0.5 + 1.0 / fraction));
 
-  // Set up the composite images
-  m_FixedComposite.resize(m_PyramidFactors.size());
-  m_MovingComposite.resize(m_PyramidFactors.size());
+  m_AffineSampleMaskComposite.resize(m_PyramidFactors.size(), NULL);
+  for(int level = 0; level < m_PyramidFactors.size(); level++)
+    {
+    typename FloatImageType::Pointer sample = LDDMMType::new_img(this->GetReferenceSpace(level));
+    FloatImageType *mask = m_GradientMaskComposite[level];
+
+    TFloat *p_sample = sample->GetBufferPointer();
+    const TFloat *p_mask = mask ? mask->GetBufferPointer() : NULL;
+    size_t n = sample->GetBufferedRegion().GetNumberOfPixels();
+
+    // Fixed seed, so that the sample is the same between runs
+    vnl_random randy(12345);
+    int k_stratum = 0, k_pick = 0;
+    std::vector<size_t> picked;
+    for(size_t i = 0; i < n; i++)
+      {
+      // In the NCC mask format, 1.0 is inside the mask and 0.5 is the dilated border
+      TFloat m = p_mask ? p_mask[i] : 1.0;
+      bool pick = false;
+      if(m > 0.75)
+        {
+        if(stratified)
+          {
+          if(k_stratum == 0)
+            k_pick = randy.lrand32(0, stride - 1);
+          pick = (k_stratum == k_pick);
+          k_stratum = (k_stratum + 1) % stride;
+          }
+        else
+          {
+          pick = randy.drand32() < fraction;
+          }
+        }
 
-  // The fixed mask is binarized
-  if(m_FixedMaskImage)
-    LDDMMType::img_threshold_in_place(m_FixedMaskImage, 0.5, 1e100, 0.0, 1.0);
+      p_sample[i] = pick ? 1.0 : 0.0;
+      if(pick)
+        picked.push_back(i);
+      }
 
-  // Repeat for each of the input images
-  for(int j = 0; j < m_Fixed.size(); j++)
-    {
-    // Repeat for each component
-    for(unsigned k = 0; k < m_Fixed[j]->GetNumberOfComponentsPerPixel(); k++)
+    // With NCC, the neighborhoods of the sampled voxels feed the neighborhood sums,
+    // so they get the 0.5 border value. Voxels outside of all these neighborhoods
+    // stay at zero, and are neither interpolated nor counted
+    if(ncc_radius)
       {
-      // Extract the k-th image component from fixed and moving images
-      typedef itk::VectorIndexSelectionCastImageFilter<MultiComponentImageType, FloatImageType> ExtractType;
-      typename ExtractType::Pointer fltExtractFixed, fltExtractMoving;
+      typedef itk::ImageRegionIteratorWithIndex<FloatImageType> IterType;
+      SizeType one;
+      one.Fill(1);
+      for(size_t j = 0; j < picked.size(); j++)
+        {
+        typename FloatImageType::RegionType window(sample->ComputeIndex(picked[j]), one);
+        window.PadByRadius(*ncc_radius);
+        window.Crop(sample->GetBufferedRegion());
+        for(IterType it(sample, window); !it.IsAtEnd(); ++it)
+          {
+          if(it.Get() == 0.0 && (!p_mask || p_mask[sample->ComputeOffset(it.GetIndex())] > 0.0))
+            it.Set(0.5);
+          }
+        }
+      }
 
-      fltExtractFixed = ExtractType::New();
-      fltExtractFixed->SetInput(m_Fixed[j]);
-      fltExtractFixed->SetIndex(k);
-      fltExtractFixed->Update();
+    m_AffineSampleMaskComposite[level] = sample;
+    }
+}
 
-      fltExtractMoving = ExtractType::New();
-      fltExtractMoving->SetInput(m_Moving[j]);
-      fltExtractMoving->SetIndex(k);
-      fltExtractMoving->Update();
+/**
+ * Extract a region of an image into a new image that starts at index zero, with
+ * the origin moved to the corner of the region
+ */
+template <class TImage>
+typename TImage::Pointer
+ExtractImageRegionRebased(TImage *src, const itk::ImageRegion<TImage::ImageDimension> &region)
+{
+  typedef itk::RegionOfInterestImageFilter<TImage, TImage> ROIFilter;
+  typename ROIFilter::Pointer roi = ROIFilter::New();
+  roi->SetInput(src);
+  roi->SetRegionOfInterest(region);
+  ParallelFor::ApplyThreadQuota(roi);
+  roi->Update();
+
+  typename TImage::Pointer out = roi->GetOutput();
+  out->DisconnectPipeline();
+  return out;
+}
 
-      // Deal with additive noise
-      double noise_sigma_fixed = 0.0, noise_sigma_moving = 0.0;
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::CropInputsToMask()
+{
+  // Find the mask that defines the crop
+  FloatImageType *mask = m_GradientMaskImage ? m_GradientMaskImage.GetPointer() : m_FixedMaskImage.GetPointer();
+  if(!mask || m_Fixed.size() == 0 || m_UncroppedReferenceSpace)
+    return;
 
-      // Do the fixed and moving images have NaNs?
-      bool nans_fixed, nans_moving;
+  // The warps are written at the finest level, which must be at full resolution
+  if(m_PyramidFactors.back() != 1)
+    return;
 
-      // If the fixed mask is present, we use it to set nans in the fixed image
-      if(m_FixedMaskImage)
+  // The mask must be on the grid of the fixed images
+  MultiComponentImageType *fixed = m_Fixed[0];
+  RegionType full = fixed->GetBufferedRegion();
+  if(mask->GetBufferedRegion() != full)
+    throw GreedyException("Mask and fixed image have different dimensions, cannot crop to mask");
+
+  // Find the extent of the mask
+  itk::Index<VDim> lo, hi;
+  bool found = false;
+  typedef itk::ImageRegionConstIteratorWithIndex<FloatImageType> IterType;
+  for(IterType it(mask, full); !it.IsAtEnd(); ++it)
+    {
+    if(it.Get() > 0.5)
+      {
+      const itk::Index<VDim> &idx = it.GetIndex();
+      for(unsigned int d = 0; d < VDim; d++)
         {
-        LDDMMType::img_reconstitute_nans_in_place(fltExtractFixed->GetOutput(), m_FixedMaskImage);
-        LDDMMType::img_write(fltExtractFixed->GetOutput(), "/tmp/testnan.mha");
+        if(!found || idx[d] < lo[d]) lo[d] = idx[d];
+        if(!found || idx[d] > hi[d]) hi[d] = idx[d];
         }
+      found = true;
+      }
+    }
 
-      if(noise_sigma_relative > 0.0)
-        {
-        // Figure out the quartiles of the fixed image
-        typedef MutualInformationPreprocessingFilter<FloatImageType, FloatImageType> QuantileFilter;
-        typename QuantileFilter::Pointer fltQuantileFixed = QuantileFilter::New();
-        fltQuantileFixed->SetLowerQuantile(0.01);
-        fltQuantileFixed->SetUpperQuantile(0.99);
-        fltQuantileFixed->SetInput(fltExtractFixed->GetOutput());
-        fltQuantileFixed->Update();
-        double range_fixed = fltQuantileFixed->GetUpperQuantileValue(0) - fltQuantileFixed->GetLowerQuantileValue(0);
-        noise_sigma_fixed = noise_sigma_relative * range_fixed;
-
-        // Figure out the quartiles of the moving image
-        typename QuantileFilter::Pointer fltQuantileMoving = QuantileFilter::New();
-        fltQuantileMoving->SetLowerQuantile(0.01);
-        fltQuantileMoving->SetUpperQuantile(0.99);
-        fltQuantileMoving->SetInput(fltExtractMoving->GetOutput());
-        fltQuantileMoving->Update();
-        double range_moving = fltQuantileMoving->GetUpperQuantileValue(0) - fltQuantileMoving->GetLowerQuantileValue(0);
-        noise_sigma_moving = noise_sigma_relative * range_moving;
-
-        // Report noise levels
-        printf("Noise on image %d component %d: fixed = %g, moving = %g\n", j, k, noise_sigma_fixed, noise_sigma_moving);
-
-        // Record the number of NaNs
-        nans_fixed = fltQuantileFixed->GetNumberOfNaNs(0);
-        nans_moving = fltQuantileMoving->GetNumberOfNaNs(0);
-        }
-      else
-        {
-        nans_fixed = isnan(LDDMMType::img_voxel_sum(fltExtractFixed->GetOutput()));
-        nans_moving = isnan(LDDMMType::img_voxel_sum(fltExtractMoving->GetOutput()));
-        }
+  if(!found)
+    return;
 
-      // Report number of NaNs in fixed and moving images
-      if(j==0 && k==0)
-        {
-        printf("Number of NaNs: fixed: %d, moving %d\n", nans_fixed, nans_moving);
-        }
-      
-      // Split the extracted images into a NaN mask and a non-NaN component
-      FloatImagePointer nanMaskFixed, nanMaskMoving;
-      if(nans_fixed)
-        {
-        nanMaskFixed = LDDMMType::new_img(fltExtractFixed->GetOutput());
-        LDDMMType::img_filter_nans_in_place(fltExtractFixed->GetOutput(), nanMaskFixed);
-        }
-      
-      if(nans_moving)
+  RegionType region;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    region.SetIndex(d, lo[d] - m_CropToMaskMargin);
+    region.SetSize(d, hi[d] - lo[d] + 1 + 2 * m_CropToMaskMargin);
+    }
+  region.Crop(full);
+  if(region == full)
+    return;
+
+  // Remember the full reference space (geometry only)
+  m_UncroppedReferenceSpace = FloatImageType::New();
+  m_UncroppedReferenceSpace->CopyInformation(fixed);
+  m_UncroppedReferenceSpace->SetRegions(full);
+  m_CropRegion = region;
+
+  // Only the fixed side is cropped. The moving images are sampled through the
+  // deformation and may need content from outside of the mask box
+  for(unsigned int j = 0; j < m_Fixed.size(); j++)
+    m_Fixed[j] = ExtractImageRegionRebased(m_Fixed[j].GetPointer(), region);
+
+  if(m_GradientMaskImage)
+    m_GradientMaskImage = ExtractImageRegionRebased(m_GradientMaskImage.GetPointer(), region);
+  if(m_FixedMaskImage)
+    m_FixedMaskImage = ExtractImageRegionRebased(m_FixedMaskImage.GetPointer(), region);
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ReplaceMovingImages(const std::vector<MultiComponentImagePointer> &moving,
+                      FloatImageType *moving_mask, double noise_sigma_relative)
+{
+  if(moving.size() != m_Fixed.size() || m_FixedComposite.size() != m_PyramidFactors.size())
+    throw GreedyException("ReplaceMovingImages called before the composite images were built");
+
+  // Undo any restriction of the levels to a region
+  for(int level = 0; level < (int) m_PyramidFactors.size(); level++)
+    this->RestoreLevel(level);
+
+  // Store the new moving images. These are never cropped, see CropInputsToMask
+  for(unsigned int j = 0; j < moving.size(); j++)
+    {
+    if(moving[j]->GetNumberOfComponentsPerPixel() != m_Fixed[j]->GetNumberOfComponentsPerPixel())
+      throw GreedyException("Moving image %d has a different number of components than the fixed image", j);
+
+    m_Moving[j] = moving[j];
+    }
+
+  m_MovingMaskImage = moving_mask;
+
+  // The histograms depend on the moving images
+  m_FixedBinnedImage = NULL;
+  m_MovingBinnedImage = NULL;
+
+  // Rebuild the moving side of the composites
+  this->BuildCompositeImages(noise_sigma_relative, true);
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::VectorImagePointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::EmbedInUncroppedSpace(VectorImageType *field)
+{
+  if(m_UncroppedReferenceSpace.IsNull())
+    return field;
+
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
+  VectorImagePointer full = LDDMMType::new_vimg(m_UncroppedReferenceSpace);
+  PasteRegion(field, full, m_CropRegion);
+  return full;
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::BuildCompositePyramid(const MultiCompImageSet &inputs, FloatImageType *nan_mask,
+                        bool scale_with_factor, double noise_sigma_relative, int noise_stream,
+                        MultiCompImageSet &pyramid, std::vector<double> &noise_sigma, long &n_nans)
+{
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
+
+  // Total number of components over all the inputs
+  int nc = 0;
+  for(int j = 0; j < inputs.size(); j++)
+    nc += inputs[j]->GetNumberOfComponentsPerPixel();
+
+  // Interleave the inputs into a single full resolution composite
+  MultiComponentImagePointer full = LDDMMType::new_cimg(inputs[0], nc);
+  long nvox = full->GetBufferedRegion().GetNumberOfPixels();
+  for(int j = 0, off = 0; j < inputs.size(); j++)
+    {
+    int ncj = inputs[j]->GetNumberOfComponentsPerPixel();
+    const TFloat *src_ptr = inputs[j]->GetBufferPointer();
+    TFloat *trg_ptr = full->GetBufferPointer() + off;
+    for(long p = 0; p < nvox; p++, src_ptr += ncj, trg_ptr += nc)
+      for(int k = 0; k < ncj; k++)
+        trg_ptr[k] = src_ptr[k];
+    off += ncj;
+    }
+
+  // Voxels marked in the NaN mask are set to NaN in all components
+  if(nan_mask)
+    {
+    const TFloat *m_ptr = nan_mask->GetBufferPointer();
+    TFloat *ptr = full->GetBufferPointer();
+    for(long p = 0; p < nvox; p++, ptr += nc)
+      if(m_ptr[p] > 0)
+        for(int k = 0; k < nc; k++)
+          ptr[k] = nan("");
+    }
+
+  // Additive noise is relative to the 1% - 99% quantile range of each component
+  noise_sigma.assign(nc, 0.0);
+  if(noise_sigma_relative > 0.0)
+    {
+    typedef MutualInformationPreprocessingFilter<MultiComponentImageType, MultiComponentImageType> QuantileFilter;
+    typename QuantileFilter::Pointer fltQuantile = QuantileFilter::New();
+    fltQuantile->SetLowerQuantile(0.01);
+    fltQuantile->SetUpperQuantile(0.99);
+    fltQuantile->SetNoRemapping(true);
+    fltQuantile->SetInput(full);
+    ParallelFor::ApplyThreadQuota(fltQuantile);
+    fltQuantile->Update();
+    for(int k = 0; k < nc; k++)
+      noise_sigma[k] = noise_sigma_relative
+                       * (fltQuantile->GetUpperQuantileValue(k) - fltQuantile->GetLowerQuantileValue(k));
+    }
+
+  // Find the components that have NaNs. Each one gets an extra channel holding its
+  // NaN mask, which is downsampled along with the data, and the NaNs are set to zero
+  std::vector<long> comp_nans(nc, 0l);
+  const TFloat *c_ptr = full->GetBufferPointer();
+  for(long p = 0; p < nvox; p++)
+    for(int k = 0; k < nc; k++, c_ptr++)
+      if(isnan(*c_ptr))
+        comp_nans[k]++;
+  n_nans = comp_nans[0];
+
+  std::vector<int> nan_channel(nc, -1);
+  int nw = nc;
+  for(int k = 0; k < nc; k++)
+    if(comp_nans[k] > 0)
+      nan_channel[k] = nw++;
+
+  MultiComponentImagePointer work = full;
+  if(nw > nc)
+    {
+    work = LDDMMType::new_cimg(full, nw);
+    const TFloat *src_ptr = full->GetBufferPointer();
+    TFloat *trg_ptr = work->GetBufferPointer();
+    for(long p = 0; p < nvox; p++, src_ptr += nc, trg_ptr += nw)
+      {
+      for(int k = 0; k < nc; k++)
         {
-        nanMaskMoving = LDDMMType::new_img(fltExtractMoving->GetOutput());
-        LDDMMType::img_filter_nans_in_place(fltExtractMoving->GetOutput(), nanMaskMoving);
+        bool is_nan = isnan(src_ptr[k]);
+        trg_ptr[k] = is_nan ? 0.0 : src_ptr[k];
+        if(nan_channel[k] >= 0)
+          trg_ptr[nan_channel[k]] = is_nan ? 1.0 : 0.0;
         }
+      }
+    full = NULL;
+    }
 
-      // Compute the pyramid for this component
-      for(int i = 0; i < m_PyramidFactors.size(); i++)
+  // Build the working pyramid in order of increasing factor, each level from the
+  // coarsest level already built whose factor divides its own. The smoothing at each
+  // step brings the total to the 0.5 * factor voxels used by img_downsample
+  std::map<int, MultiComponentImagePointer> work_levels;
+  work_levels[1] = work;
+  std::vector<int> factors = m_PyramidFactors;
+  std::sort(factors.begin(), factors.end());
+  for(int i = 0; i < factors.size(); i++)
+    {
+    int f = factors[i];
+    if(work_levels.count(f))
+      continue;
+
+    int f_src = 1;
+    for(typename std::map<int, MultiComponentImagePointer>::iterator it = work_levels.begin();
+        it != work_levels.end(); ++it)
+      if(f % it->first == 0)
+        f_src = it->first;
+
+    Vec sigma;
+    double var_src = (f_src > 1) ? 0.25 * f_src * f_src : 0.0;
+    for(int d = 0; d < VDim; d++)
+      sigma[d] = sqrt(0.25 * f * f - var_src) * work->GetSpacing()[d];
+
+    MultiComponentImagePointer level = MultiComponentImageType::New();
+    LDDMMType::cimg_downsample(work_levels[f_src], level, f / f_src, sigma);
+    work_levels[f] = level;
+    }
+
+  // Produce the output composites, restoring the NaNs where more than half of the
+  // downsampled mask is set. For the Mahalanobis metric, the fixed image needs to be
+  // scaled by the factor of the pyramid level because it describes voxel coordinates.
+  // Noise comes from a counter-based generator keyed by voxel, component, level and
+  // side, so the pass can be split over threads and the result does not depend on
+  // the number of threads
+  CounterBasedRandom randy(12345);
+  pyramid.resize(m_PyramidFactors.size());
+  for(int i = 0; i < m_PyramidFactors.size(); i++)
+    {
+    int f = m_PyramidFactors[i];
+    MultiComponentImageType *wl = work_levels[f];
+    bool scale = scale_with_factor && f != 1;
+    bool noise = noise_sigma_relative > 0.0;
+
+    // Without NaN masks, the working level is updated in place
+    if(nw == nc)
+      pyramid[i] = wl;
+    else
+      pyramid[i] = LDDMMType::new_cimg(wl, nc);
+    if(nw == nc && !scale && !noise)
+      continue;
+
+    long nvox_l = wl->GetBufferedRegion().GetNumberOfPixels();
+    const TFloat *src_base = wl->GetBufferPointer();
+    TFloat *trg_base = pyramid[i]->GetBufferPointer();
+    double scale_factor = scale ? 1.0 / f : 1.0;
+    uint32_t stream = (uint32_t) (2 * i + noise_stream);
+
+    auto worker = [&](long p0, long p1)
+      {
+      const TFloat *src_ptr = src_base + p0 * nw;
+      TFloat *trg_ptr = trg_base + p0 * nc;
+      for(long p = p0; p < p1; p++, src_ptr += nw, trg_ptr += nc)
         {
-        // Downsample the image to the right pyramid level
-        typename FloatImageType::Pointer lFixed, lMoving;
-        if (m_PyramidFactors[i] == 1)
+        for(int k = 0; k < nc; k++)
           {
-          lFixed = fltExtractFixed->GetOutput();
-          if(nans_fixed)
-            LDDMMType::img_reconstitute_nans_in_place(lFixed, nanMaskFixed);
-
-          lMoving = fltExtractMoving->GetOutput();
-          if(nans_moving)
-            LDDMMType::img_reconstitute_nans_in_place(lMoving, nanMaskMoving);
+          if(nan_channel[k] >= 0 && src_ptr[nan_channel[k]] > 0.5)
+            trg_ptr[k] = nan("");
+          else
+            trg_ptr[k] = src_ptr[k] * scale_factor;
+          if(noise)
+            trg_ptr[k] += randy.Normal(p, k, stream) * noise_sigma[k];
           }
-        else
-          {
-          // Downsample the images
-          lFixed = FloatImageType::New();
-          lMoving = FloatImageType::New();
-          LDDMMType::img_downsample(fltExtractFixed->GetOutput(), lFixed, m_PyramidFactors[i]);
-          LDDMMType::img_downsample(fltExtractMoving->GetOutput(), lMoving, m_PyramidFactors[i]);
-
-          // Downsample the nan-masks
-          if(nans_fixed)
-            {
-            FloatImagePointer mask_ds = FloatImageType::New();
-            LDDMMType::img_downsample(nanMaskFixed, mask_ds, m_PyramidFactors[i]);
-            LDDMMType::img_threshold_in_place(mask_ds, 0.5, 100.0, 1, 0);
-            LDDMMType::img_reconstitute_nans_in_place(lFixed, mask_ds);
-            }
+        }
+      };
 
-          if(nans_moving)
-            {
-            FloatImagePointer mask_ds = FloatImageType::New();
-            LDDMMType::img_downsample(nanMaskMoving, mask_ds, m_PyramidFactors[i]);
-            LDDMMType::img_threshold_in_place(mask_ds, 0.5, 100.0, 1, 0);
-            LDDMMType::img_reconstitute_nans_in_place(lMoving, mask_ds);
-            }
+    ParallelFor::Run(nvox_l, 0, worker);
+    }
+}
 
-          // For the Mahalanobis metric, the fixed image needs to be scaled by the factor of the
-          // pyramid level because it describes voxel coordinates
-          if(m_ScaleFixedImageWithVoxelSize)
-            LDDMMType::img_scale_in_place(lFixed, 1.0 / m_PyramidFactors[i]);
-          }
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::BuildCompositeImages(double noise_sigma_relative, bool moving_only)
+{
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
 
-        // Add some noise to the images
-        if(noise_sigma_relative > 0.0)
-          {
-          vnl_random randy(12345);
-          for(long i = 0; i < lFixed->GetPixelContainer()->Size(); i++)
-            lFixed->GetBufferPointer()[i] += randy.normal() * noise_sigma_fixed;
-          for(long i = 0; i < lMoving->GetPixelContainer()->Size(); i++)
-            lMoving->GetBufferPointer()[i] += randy.normal() * noise_sigma_moving;
-          }
+  // Set up the composite images
+  m_FixedComposite.resize(m_PyramidFactors.size());
+  m_MovingComposite.resize(m_PyramidFactors.size());
 
-        // Compute the gradient of the moving image
-        //typename VectorImageType::Pointer gradMoving = LDDMMType::new_vimg(lMoving);
-        //LDDMMType::image_gradient(lMoving, gradMoving);
+  // Crop the inputs to the mask, if requested. When only the moving side is being
+  // rebuilt, the fixed side has been cropped already
+  if(m_CropToMaskMargin >= 0 && !moving_only)
+    this->CropInputsToMask();
 
-        // Allocate the composite images if they have not been allocated
-        if(j == 0 && k == 0)
-          {
-          m_FixedComposite[i] = MultiComponentImageType::New();
-          m_FixedComposite[i]->CopyInformation(lFixed);
-          m_FixedComposite[i]->SetNumberOfComponentsPerPixel(m_Weights.size());
-          m_FixedComposite[i]->SetRegions(lFixed->GetBufferedRegion());
-          m_FixedComposite[i]->Allocate();
-
-          m_MovingComposite[i] = MultiComponentImageType::New();
-          m_MovingComposite[i]->CopyInformation(lMoving);
-          m_MovingComposite[i]->SetNumberOfComponentsPerPixel(m_Weights.size());
-          m_MovingComposite[i]->SetRegions(lMoving->GetBufferedRegion());
-          m_MovingComposite[i]->Allocate();
-          }
+  // The fixed mask is binarized
+  if(m_FixedMaskImage && !moving_only)
+    LDDMMType::img_threshold_in_place(m_FixedMaskImage, 0.5, 1e100, 0.0, 1.0);
 
-        // Pack the data into the fixed and moving composite images
-        this->PlaceIntoComposite(lFixed, m_FixedComposite[i], off_fixed);
-        this->PlaceIntoComposite(lMoving, m_MovingComposite[i], off_moving);
-        }
+  // Build the pyramids of the fixed and moving composites. All components are
+  // downsampled together, each level from the next finer one
+  std::vector<double> noise_sigma_fixed, noise_sigma_moving;
+  long nans_fixed = 0, nans_moving = 0;
+  if(!moving_only)
+    this->BuildCompositePyramid(m_Fixed, m_FixedMaskImage, m_ScaleFixedImageWithVoxelSize,
+                                noise_sigma_relative, 0, m_FixedComposite, noise_sigma_fixed, nans_fixed);
+  this->BuildCompositePyramid(m_Moving, NULL, false,
+                              noise_sigma_relative, 1, m_MovingComposite, noise_sigma_moving, nans_moving);
+
+  // Report number of NaNs in fixed and moving images
+  if(moving_only)
+    printf("Number of NaNs: moving %ld\n", nans_moving);
+  else
+    printf("Number of NaNs: fixed: %ld, moving %ld\n", nans_fixed, nans_moving);
 
-      // Update the offsets
-      off_fixed++;
-      off_moving++;
+  // Report the noise levels
+  if(noise_sigma_relative > 0.0)
+    {
+    for(int k = 0; k < m_Weights.size(); k++)
+      {
+      if(moving_only)
+        printf("Noise on component %d: moving = %g\n", k, noise_sigma_moving[k]);
+      else
+        printf("Noise on component %d: fixed = %g, moving = %g\n", k, noise_sigma_fixed[k], noise_sigma_moving[k]);
       }
     }
 
   // Set up the mask pyramid
   m_GradientMaskComposite.resize(m_PyramidFactors.size(), NULL);
-  if(m_GradientMaskImage)
+  if(moving_only)
+    {
+    // The fixed side masks are kept
+    }
+  else if(m_GradientMaskImage)
     {
     for(int i = 0; i < m_PyramidFactors.size(); i++)
       {
@@ -416,6 +664,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     }
 
   // Set up the moving mask pyramid
+  m_MovingMaskComposite.clear();
   m_MovingMaskComposite.resize(m_PyramidFactors.size(), NULL);
   if(m_MovingMaskImage)
     {
@@ -442,7 +691,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
   // Set up the jitter images
   m_JitterComposite.resize(m_PyramidFactors.size(), NULL);
-  if(m_JitterSigma > 0)
+  if(m_JitterSigma > 0 && !moving_only)
     {
     for(int i = 0; i < m_PyramidFactors.size(); i++)
       {
@@ -468,6 +717,189 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     }
 }
 
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::RegionType
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetGradientMaskBoundingRegion(int level, int margin)
+{
+  RegionType full = m_FixedComposite[level]->GetBufferedRegion();
+  FloatImageType *mask = m_GradientMaskComposite[level];
+  if(!mask)
+    return full;
+
+  // Find the extent of the nonzero mask voxels
+  itk::Index<VDim> lo, hi;
+  bool found = false;
+  typedef itk::ImageRegionConstIteratorWithIndex<FloatImageType> IterType;
+  for(IterType it(mask, mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    if(it.Get() > 0.0)
+      {
+      const itk::Index<VDim> &idx = it.GetIndex();
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        if(!found || idx[d] < lo[d]) lo[d] = idx[d];
+        if(!found || idx[d] > hi[d]) hi[d] = idx[d];
+        }
+      found = true;
+      }
+    }
+
+  if(!found)
+    return full;
+
+  // Pad the box and clip it to the image
+  RegionType region;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    region.SetIndex(d, lo[d] - margin);
+    region.SetSize(d, hi[d] - lo[d] + 1 + 2 * margin);
+    }
+  region.Crop(full);
+
+  return region;
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::RestrictLevelToRegion(int level, const RegionType &region)
+{
+  if(m_MovingComposite[level]->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
+    throw GreedyException("Cannot restrict level %d to a region because the fixed and moving "
+                          "images are not on the same grid", level);
+
+  // Undo any previous restriction
+  this->RestoreLevel(level);
+
+  m_FullFixedComposite.resize(m_FixedComposite.size());
+  m_FullGradientMaskComposite.resize(m_FixedComposite.size());
+
+  // Only the fixed side is cropped. The moving composite and the moving mask are
+  // kept whole, so that the deformation can sample them outside of the region
+  m_FullFixedComposite[level] = m_FixedComposite[level];
+  m_FixedComposite[level] = ExtractImageRegionRebased(m_FixedComposite[level].GetPointer(), region);
+
+  if(m_GradientMaskComposite[level])
+    {
+    m_FullGradientMaskComposite[level] = m_GradientMaskComposite[level];
+    m_GradientMaskComposite[level] = ExtractImageRegionRebased(m_GradientMaskComposite[level].GetPointer(), region);
+    }
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::RestoreLevel(int level)
+{
+  if((int) m_FullFixedComposite.size() <= level || m_FullFixedComposite[level].IsNull())
+    return;
+
+  m_FixedComposite[level] = m_FullFixedComposite[level];
+  if(m_FullGradientMaskComposite[level])
+    m_GradientMaskComposite[level] = m_FullGradientMaskComposite[level];
+
+  m_FullFixedComposite[level] = NULL;
+  m_FullGradientMaskComposite[level] = NULL;
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::LinearTransformType::Pointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetRestrictedLevelAffine(const RegionType &region, LinearTransformType *def_affine)
+{
+  // A(x + r) = M x + (M r + b), where r is the index of the region
+  typename LinearTransformType::Pointer tran = LinearTransformType::New();
+  typename LinearTransformType::MatrixType M;
+  typename LinearTransformType::OffsetType b;
+  M.SetIdentity();
+  b.Fill(0.0);
+  if(def_affine)
+    {
+    M = def_affine->GetMatrix();
+    b = def_affine->GetOffset();
+    }
+
+  for(unsigned int d = 0; d < VDim; d++)
+    for(unsigned int j = 0; j < VDim; j++)
+      b[d] += M(d,j) * region.GetIndex(j);
+
+  tran->SetMatrix(M);
+  tran->SetOffset(b);
+  return tran;
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::MultiComponentImagePointer
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::MakeGeometryOnlyImage(MultiComponentImageType *src)
+{
+  MultiComponentImagePointer img = MultiComponentImageType::New();
+  img->CopyInformation(src);
+  img->SetRegions(src->GetBufferedRegion());
+  img->SetNumberOfComponentsPerPixel(src->GetNumberOfComponentsPerPixel());
+  return img;
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ReleaseInputImages()
+{
+  for(unsigned int j = 0; j < m_Fixed.size(); j++)
+    {
+    m_Fixed[j] = MakeGeometryOnlyImage(m_Fixed[j]);
+    m_Moving[j] = MakeGeometryOnlyImage(m_Moving[j]);
+    }
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ReleaseLevel(int level, bool release_fixed)
+{
+  m_MovingComposite[level] = MakeGeometryOnlyImage(m_MovingComposite[level]);
+  if(m_MovingMaskComposite[level] != m_MovingMaskImage)
+    m_MovingMaskComposite[level] = NULL;
+
+  if(release_fixed)
+    {
+    m_FixedComposite[level] = MakeGeometryOnlyImage(m_FixedComposite[level]);
+    if(m_GradientMaskComposite[level] != m_GradientMaskImage)
+      m_GradientMaskComposite[level] = NULL;
+    if((int) m_NCCFixedSums.size() > level)
+      m_NCCFixedSums[level] = NULL;
+    if((int) m_NCCApproxFixedGradient.size() > level)
+      m_NCCApproxFixedGradient[level] = NULL;
+    if((int) m_NCCApproxFixedSums.size() > level)
+      m_NCCApproxFixedSums[level] = NULL;
+    if((int) m_MahalanobisStats.size() > level)
+      m_MahalanobisStats[level] = NULL;
+    }
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ExtractRegion(VectorImageType *src, const RegionType &region, VectorImageType *dst)
+{
+  itk::ImageRegionConstIterator<VectorImageType> itSrc(src, region);
+  itk::ImageRegionIterator<VectorImageType> itDst(dst, dst->GetBufferedRegion());
+  for(; !itSrc.IsAtEnd(); ++itSrc, ++itDst)
+    itDst.Set(itSrc.Get());
+}
+
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::PasteRegion(VectorImageType *src, VectorImageType *dst, const RegionType &region)
+{
+  itk::ImageRegionConstIterator<VectorImageType> itSrc(src, src->GetBufferedRegion());
+  itk::ImageRegionIterator<VectorImageType> itDst(dst, region);
+  for(; !itSrc.IsAtEnd(); ++itSrc, ++itDst)
+    itDst.Set(itSrc.Get());
+}
+
 template <class TFloat, unsigned int VDim>
 typename MultiImageOpticalFlowHelper<TFloat, VDim>::ImageBaseType *
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -503,16 +935,58 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 }
 
 template <class TFloat, unsigned int VDim>
+template <class TStorage>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
-::ComputeOpticalFlowField(int level,
-                          VectorImageType *def,
-                          FloatImageType *out_metric_image,
-                          MultiComponentMetricReport &out_metric_report,
-                          VectorImageType *out_gradient,
-                          double result_scaling)
+::ComputeStorageImagesIfNeeded(int level)
 {
-  typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
+  typedef itk::VectorImage<TStorage, VDim> StorageImageType;
+  MultiComponentImageType *src[] = { m_FixedComposite[level], m_MovingComposite[level] };
+
+  // The copies are current if they are of the right type and were made from the
+  // same composites (modified times are unique, so they identify the images)
+  unsigned long mtime = std::max(src[0]->GetMTime(), src[1]->GetMTime());
+  if(dynamic_cast<StorageImageType *>(m_FixedStorageImage.GetPointer())
+     && m_StorageSourceMTime == mtime)
+    return;
+
+  itk::DataObject::Pointer trg[2];
+  for(int i = 0; i < 2; i++)
+    {
+    typename StorageImageType::Pointer img = StorageImageType::New();
+    img->CopyInformation(src[i]);
+    img->SetRegions(src[i]->GetBufferedRegion());
+    img->SetNumberOfComponentsPerPixel(src[i]->GetNumberOfComponentsPerPixel());
+    img->Allocate();
+
+    const TFloat *p_src = src[i]->GetBufferPointer();
+    TStorage *p_trg = img->GetBufferPointer();
+    long n = src[i]->GetPixelContainer()->Size();
+    for(long j = 0; j < n; j++)
+      p_trg[j] = TStorage((float) p_src[j]);
+
+    trg[i] = img.GetPointer();
+    }
+
+  m_FixedStorageImage = trg[0];
+  m_MovingStorageImage = trg[1];
+  m_StorageSourceMTime = mtime;
+}
+
+template <class TFloat, unsigned int VDim>
+template <class TImage>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeOpticalFlowFieldWithStorage(TImage *fixed, TImage *moving,
+                                     VectorImageType *def,
+                                     FloatImageType *out_metric_image,
+                                     MultiComponentMetricReport &out_metric_report,
+                                     VectorImageType *out_gradient,
+                                     double result_scaling,
+                                     FloatImageType *gradient_mask,
+                                     LinearTransformType *def_affine)
+{
+  typedef MultiComponentImageMetricStorageTraits<TFloat, typename TImage::InternalPixelType, VDim> TraitsType;
   typedef MultiImageOpticalFlowImageFilter<TraitsType> FilterType;
 
   typename FilterType::Pointer filter = FilterType::New();
@@ -528,13 +1002,17 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetDemonsSigma(0.01);
 
   // Run the filter
-  filter->SetFixedImage(m_FixedComposite[level]);
-  filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetFixedImage(fixed);
+  filter->SetMovingImage(moving);
   filter->SetDeformationField(def);
+  filter->SetDeformationAffineTransform(def_affine);
   filter->SetWeights(wscaled);
   filter->SetComputeGradient(true);
+  if(gradient_mask)
+    filter->SetGradientMaskImage(gradient_mask);
   filter->GetMetricOutput()->Graft(out_metric_image);
   filter->GetDeformationGradientOutput()->Graft(out_gradient);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 
   // Process the results
@@ -542,6 +1020,47 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   out_metric_report.TotalMetric = filter->GetMetricValue();
 }
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeOpticalFlowField(int level,
+                          VectorImageType *def,
+                          FloatImageType *out_metric_image,
+                          MultiComponentMetricReport &out_metric_report,
+                          VectorImageType *out_gradient,
+                          double result_scaling,
+                          FloatImageType *gradient_mask,
+                          LinearTransformType *def_affine)
+{
+  if(m_CompositeStorage == STORAGE_FLOAT16)
+    {
+    typedef itk::VectorImage<Float16, VDim> StorageImageType;
+    this->ComputeStorageImagesIfNeeded<Float16>(level);
+    this->ComputeOpticalFlowFieldWithStorage(
+          static_cast<StorageImageType *>(m_FixedStorageImage.GetPointer()),
+          static_cast<StorageImageType *>(m_MovingStorageImage.GetPointer()),
+          def, out_metric_image, out_metric_report, out_gradient, result_scaling, gradient_mask,
+          def_affine);
+    }
+  else if(m_CompositeStorage == STORAGE_BFLOAT16)
+    {
+    typedef itk::VectorImage<BFloat16, VDim> StorageImageType;
+    this->ComputeStorageImagesIfNeeded<BFloat16>(level);
+    this->ComputeOpticalFlowFieldWithStorage(
+          static_cast<StorageImageType *>(m_FixedStorageImage.GetPointer()),
+          static_cast<StorageImageType *>(m_MovingStorageImage.GetPointer()),
+          def, out_metric_image, out_metric_report, out_gradient, result_scaling, gradient_mask,
+          def_affine);
+    }
+  else
+    {
+    this->ComputeOpticalFlowFieldWithStorage(
+          m_FixedComposite[level].GetPointer(), m_MovingComposite[level].GetPointer(),
+          def, out_metric_image, out_metric_report, out_gradient, result_scaling, gradient_mask,
+          def_affine);
+    }
+}
+
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -557,6 +1076,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     fixed_binner->SetLowerQuantile(0.01);
     fixed_binner->SetUpperQuantile(0.99);
     fixed_binner->SetStartAtBinOne(true);
+    ParallelFor::ApplyThreadQuota(fixed_binner);
     fixed_binner->Update();
     m_FixedBinnedImage = fixed_binner->GetOutput();
 
@@ -567,6 +1087,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     moving_binner->SetLowerQuantile(0.01);
     moving_binner->SetUpperQuantile(0.99);
     moving_binner->SetStartAtBinOne(true);
+    ParallelFor::ApplyThreadQuota(moving_binner);
     moving_binner->Update();
     m_MovingBinnedImage = moving_binner->GetOutput();
     }
@@ -581,7 +1102,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                      FloatImageType *out_metric_image,
                      MultiComponentMetricReport &out_metric_report,
                      VectorImageType *out_gradient,
-                     double result_scaling)
+                     double result_scaling,
+                     LinearTransformType *def_affine)
 {
   // Scale the weights by epsilon
   vnl_vector<float> wscaled(m_Weights.size());
@@ -601,15 +1123,18 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typename MetricType::Pointer metric = MetricType::New();
 
   metric->SetComputeNormalizedMutualInformation(normalized_mutual_information);
+  metric->SetParzenWindow(m_MIParzenWindow);
   metric->SetFixedImage(m_FixedBinnedImage);
   metric->SetMovingImage(m_MovingBinnedImage);
   metric->SetDeformationField(def);
+  metric->SetDeformationAffineTransform(def_affine);
   metric->SetWeights(wscaled);
   metric->SetComputeGradient(true);
   metric->GetMetricOutput()->Graft(out_metric_image);
   metric->GetDeformationGradientOutput()->Graft(out_gradient);
   metric->GetMetricOutput()->Graft(out_metric_image);
   metric->SetBins(128);
+  ParallelFor::ApplyThreadQuota(metric);
   metric->Update();
 
   // Process the results
@@ -620,6 +1145,40 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 // #undef DUMP_NCC
 #define DUMP_NCC 1
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeNCCBruteForceSearch(int level,
+                             const SizeType &radius,
+                             const SizeType &search_radius,
+                             FloatImageType *out_metric_image,
+                             VectorImageType *out_displacement,
+                             VectorImageType *init_displacement)
+{
+  typedef BruteForceNCCSearchImageFilter<MultiComponentImageType, FloatImageType, VectorImageType> FilterType;
+  typename FilterType::Pointer filter = FilterType::New();
+
+  // Weights as expected by the filter
+  vnl_vector<float> wscaled(m_Weights.size());
+  for (unsigned i = 0; i < wscaled.size(); i++)
+    wscaled[i] = m_Weights[i];
+
+  // Check the radius against the size of the image
+  SizeType radius_fix = AdjustNCCRadius(level, radius, true);
+
+  filter->SetFixedImage(m_FixedComposite[level]);
+  filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  filter->SetWeights(wscaled);
+  filter->SetRadius(radius_fix);
+  filter->SetSearchRadius(search_radius);
+  filter->SetInitialDisplacement(init_displacement);
+  filter->GetMetricOutput()->Graft(out_metric_image);
+  filter->GetDisplacementOutput()->Graft(out_displacement);
+  ParallelFor::ApplyThreadQuota(filter);
+  filter->Update();
+}
+
 
 template <class TFloat, unsigned int VDim>
 typename MultiImageOpticalFlowHelper<TFloat, VDim>::SizeType
@@ -653,11 +1212,11 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                         FloatImageType *out_metric_image,
                         MultiComponentMetricReport &out_metric_report,
                         VectorImageType *out_gradient,
-                        double result_scaling)
+                        double result_scaling,
+                        LinearTransformType *def_affine)
 {
   typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
   typedef MultiComponentNCCImageMetric<TraitsType> FilterType;
-  // typedef MultiComponentApproximateNCCImageMetric<TraitsType> FilterType;
 
   typename FilterType::Pointer filter = FilterType::New();
 
@@ -681,6 +1240,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetFixedImage(m_FixedComposite[level]);
   filter->SetMovingImage(m_MovingComposite[level]);
   filter->SetDeformationField(def);
+  filter->SetDeformationAffineTransform(def_affine);
   filter->SetWeights(wscaled);
   filter->SetComputeGradient(true);
   filter->GetMetricOutput()->Graft(out_metric_image);
@@ -688,12 +1248,36 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetRadius(radius_fix);
   filter->SetWorkingImage(m_NCCWorkingImage);
   filter->SetReuseWorkingImageFixedComponents(!first_run);
+  filter->SetCompensatedSummation(m_NCCCompensatedSummation);
   filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
   filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
 
+  // Compute the fixed image neighborhood sums once per level and radius
+  if(m_NCCPrecomputeFixedSums)
+    {
+    if(m_NCCFixedSums.size() != m_FixedComposite.size())
+      {
+      m_NCCFixedSums.clear();
+      m_NCCFixedSums.resize(m_FixedComposite.size());
+      m_NCCFixedSumsRadius.resize(m_FixedComposite.size());
+      }
+
+    if(m_NCCFixedSums[level].IsNull() || m_NCCFixedSumsRadius[level] != radius_fix
+       || m_NCCFixedSums[level]->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
+      {
+      m_NCCFixedSums[level] = FilterType::ComputeFixedSumsImage(
+                                m_FixedComposite[level], m_GradientMaskComposite[level], radius_fix,
+                                m_NCCCompensatedSummation, ParallelFor::GetNumberOfThreads());
+      m_NCCFixedSumsRadius[level] = radius_fix;
+      }
+
+    filter->SetFixedSumsImage(m_NCCFixedSums[level]);
+    }
+
 
   // TODO: support moving masks...
   // filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 
   // Get the vector of the normalized metrics
@@ -701,6 +1285,145 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   out_metric_report.TotalMetric = filter->GetMetricValue();
 }
 
+template <class TFloat, unsigned int VDim>
+void
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::ComputeApproximateNCCMetricImage(int level,
+                                   VectorImageType *def,
+                                   const SizeType &radius,
+                                   FloatImageType *out_metric_image,
+                                   MultiComponentMetricReport &out_metric_report,
+                                   VectorImageType *out_gradient,
+                                   double result_scaling)
+{
+  typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
+  typedef MultiComponentApproximateNCCImageMetric<TraitsType> FilterType;
+
+  typename FilterType::Pointer filter = FilterType::New();
+
+  // Scale the weights by epsilon
+  vnl_vector<float> wscaled(m_Weights.size());
+  for (unsigned i = 0; i < wscaled.size(); i++)
+    wscaled[i] = m_Weights[i] * result_scaling;
+
+  // Allocate a working image
+  if(m_NCCApproxWorkingImage.IsNull())
+    m_NCCApproxWorkingImage = MultiComponentImageType::New();
+
+  // Is this the first time that this function is being called with this image?
+  bool first_run =
+      m_NCCApproxWorkingImage->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion();
+
+  // Check the radius against the size of the image
+  SizeType radius_fix = AdjustNCCRadius(level, radius, first_run);
+
+  // The accumulated fixed channels only change with the fixed composite and the radius
+  if(m_NCCApproxFixedSums.size() != m_FixedComposite.size())
+    {
+    m_NCCApproxFixedSums.clear();
+    m_NCCApproxFixedSums.resize(m_FixedComposite.size());
+    m_NCCApproxFixedSumsRadius.resize(m_FixedComposite.size());
+    }
+
+  if(m_NCCApproxFixedSums[level].IsNull() || m_NCCApproxFixedSumsRadius[level] != radius_fix
+     || m_NCCApproxFixedSums[level]->GetMTime() < m_FixedComposite[level]->GetMTime()
+     || m_NCCApproxFixedSums[level]->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
+    {
+    m_NCCApproxFixedSums[level] = FilterType::ComputeFixedSumsImage(
+                                    m_FixedComposite[level], radius_fix, ParallelFor::GetNumberOfThreads());
+    m_NCCApproxFixedSumsRadius[level] = radius_fix;
+    }
+
+  filter->SetFixedSumsImage(m_NCCApproxFixedSums[level]);
+
+  // The fixed image gradient only changes with the fixed composite, so compute it once per level
+  if(out_gradient)
+    {
+    if(m_NCCApproxFixedGradient.size() != m_FixedComposite.size())
+      {
+      m_NCCApproxFixedGradient.clear();
+      m_NCCApproxFixedGradient.resize(m_FixedComposite.size());
+      }
+
+    if(m_NCCApproxFixedGradient[level].IsNull()
+       || m_NCCApproxFixedGradient[level]->GetMTime() < m_FixedComposite[level]->GetMTime()
+       || m_NCCApproxFixedGradient[level]->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion())
+      {
+      m_NCCApproxFixedGradient[level] = FilterType::ComputeFixedGradientImage(m_FixedComposite[level]);
+      }
+
+    filter->SetFixedGradientImage(m_NCCApproxFixedGradient[level]);
+    }
+
+  // Run the filter
+  filter->SetFixedImage(m_FixedComposite[level]);
+  filter->SetMovingImage(m_MovingComposite[level]);
+  filter->SetDeformationField(def);
+  filter->SetWeights(wscaled);
+  filter->SetComputeGradient(out_gradient != NULL);
+  filter->GetMetricOutput()->Graft(out_metric_image);
+  if(out_gradient)
+    filter->GetDeformationGradientOutput()->Graft(out_gradient);
+  filter->SetRadius(radius_fix);
+  filter->SetWorkingImage(m_NCCApproxWorkingImage);
+  filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  ParallelFor::ApplyThreadQuota(filter);
+  filter->Update();
+
+  // Get the vector of the normalized metrics
+  out_metric_report.ComponentMetrics = filter->GetAllMetricValues();
+  out_metric_report.TotalMetric = filter->GetMetricValue();
+}
+
+template <class TFloat, unsigned int VDim>
+typename MultiImageOpticalFlowHelper<TFloat, VDim>::MultiComponentImageType *
+MultiImageOpticalFlowHelper<TFloat, VDim>
+::GetMahalanobisStats(int level)
+{
+  MultiComponentImageType *fixed = m_FixedComposite[level];
+  int nc = fixed->GetNumberOfComponentsPerPixel();
+  int nc_expected = VDim + VDim * (VDim + 1) / 2;
+  if(nc != nc_expected)
+    throw GreedyException("The Mahalanobis metric requires %d components in the fixed image, got %d",
+                          nc_expected, nc);
+
+  if(m_MahalanobisStats.size() != m_FixedComposite.size())
+    {
+    m_MahalanobisStats.clear();
+    m_MahalanobisStats.resize(m_FixedComposite.size());
+    }
+
+  MultiComponentImagePointer &stats = m_MahalanobisStats[level];
+  if(stats.IsNull()
+     || stats->GetMTime() < fixed->GetMTime()
+     || stats->GetBufferedRegion() != fixed->GetBufferedRegion())
+    {
+    // At a level downsampled by factor f, a displacement of one voxel is f voxels at
+    // full resolution. So the mean is divided by f and the inverse covariance times f^2
+    typedef LDDMMData<TFloat, VDim> LDDMMType;
+    stats = LDDMMType::new_cimg(fixed, nc);
+    double f = m_PyramidFactors[level];
+    double scale_mean = 1.0 / f, scale_icov = f * f;
+
+    const TFloat *src_base = fixed->GetBufferPointer();
+    TFloat *trg_base = stats->GetBufferPointer();
+    ParallelFor::Run(fixed->GetBufferedRegion().GetNumberOfPixels(), 0, [&](long p0, long p1)
+      {
+      const TFloat *src = src_base + p0 * nc;
+      TFloat *trg = trg_base + p0 * nc;
+      for(long p = p0; p < p1; p++)
+        {
+        for(int k = 0; k < (int) VDim; k++)
+          *trg++ = *src++ * scale_mean;
+        for(int k = VDim; k < nc; k++)
+          *trg++ = *src++ * scale_icov;
+        }
+      });
+    }
+
+  return stats;
+}
+
 template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
@@ -712,7 +1435,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typedef MahalanobisDistanceToTargetWarpMetric<TraitsType> FilterType;
   typename FilterType::Pointer filter = FilterType::New();
 
-  filter->SetFixedImage(m_FixedComposite[level]);
+  filter->SetFixedImage(this->GetMahalanobisStats(level));
   filter->SetMovingImage(m_MovingComposite[level]);
   filter->SetDeformationField(def);
   filter->SetComputeGradient(true);
@@ -721,6 +1444,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetFixedMaskImage(m_GradientMaskComposite[level]);
   filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
 
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 
   out_metric_report.ComponentMetrics = filter->GetAllMetricValues();
@@ -739,7 +1463,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     VectorImageType *wrkGradMask,
     VectorImageType *wrkPhi,
     MultiComponentMetricReport &out_metric,
-    LinearTransformType *grad)
+    LinearTransformType *grad,
+    vnl_matrix<double> *hessian)
 {
   // Scale the weights by epsilon
   vnl_vector<float> wscaled(m_Weights.size());
@@ -757,10 +1482,12 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   metric->SetAffineTransform(tran);
   metric->SetComputeMovingDomainMask(true);
   metric->GetMetricOutput()->Graft(wrkMetric);
-  metric->SetComputeGradient(grad != NULL);
-  metric->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  metric->SetComputeGradient(grad != NULL || hessian != NULL);
+  metric->SetComputeAffineHessian(hessian != NULL);
+  metric->SetFixedMaskImage(this->GetAffineMask(level));
   metric->SetMovingMaskImage(m_MovingMaskComposite[level]);
   metric->SetJitterImage(m_JitterComposite[level]);
+  ParallelFor::ApplyThreadQuota(metric);
   metric->Update();
 
   // TODO: erase this
@@ -781,6 +1508,9 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     grad->SetOffset(metric->GetAffineTransformGradient()->GetOffset());
     }
 
+  if(hessian)
+    *hessian = metric->GetAffineTransformHessian();
+
   out_metric.TotalMetric = metric->GetMetricValue();
   out_metric.ComponentMetrics = metric->GetAllMetricValues();
 }
@@ -819,6 +1549,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typename MetricType::Pointer metric = MetricType::New();
 
   metric->SetComputeNormalizedMutualInformation(normalized_mutual_info);
+  metric->SetParzenWindow(m_MIParzenWindow);
   metric->SetFixedImage(m_FixedBinnedImage);
   metric->SetMovingImage(m_MovingBinnedImage);
   metric->SetWeights(wscaled);
@@ -826,10 +1557,11 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   metric->SetComputeMovingDomainMask(true);
   metric->GetMetricOutput()->Graft(wrkMetric);
   metric->SetComputeGradient(grad != NULL);
-  metric->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  metric->SetFixedMaskImage(this->GetAffineMask(level));
   metric->SetMovingMaskImage(m_MovingMaskComposite[level]);
   metric->SetBins(128);
   metric->SetJitterImage(m_JitterComposite[level]);
+  ParallelFor::ApplyThreadQuota(metric);
   metric->Update();
 
   // Process the results
@@ -858,16 +1590,22 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
                                    VectorImageType *wrkGradMask,
                                    VectorImageType *wrkPhi,
                                    MultiComponentMetricReport &out_metric,
-                                   LinearTransformType *grad)
+                                   LinearTransformType *grad,
+                                   MultiComponentImageType *wrkNCC)
 {
   // Scale the weights by epsilon
   vnl_vector<float> wscaled(m_Weights.size());
   for (unsigned i = 0; i < wscaled.size(); i++)
     wscaled[i] = m_Weights[i];
 
-  // Allocate a working image
-  if(m_NCCWorkingImage.IsNull())
-    m_NCCWorkingImage = MultiComponentImageType::New();
+  // Use the shared working image unless the caller has its own
+  bool shared_work = (wrkNCC == NULL);
+  if(shared_work)
+    {
+    if(m_NCCWorkingImage.IsNull())
+      m_NCCWorkingImage = MultiComponentImageType::New();
+    wrkNCC = m_NCCWorkingImage;
+    }
 
   // Set up the optical flow computation
   typedef DefaultMultiComponentImageMetricTraits<TFloat, VDim> TraitsType;
@@ -876,10 +1614,11 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
   // Is this the first time that this function is being called with this image?
   bool first_run =
-      m_NCCWorkingImage->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion();
+      wrkNCC->GetBufferedRegion() != m_FixedComposite[level]->GetBufferedRegion();
 
-  // Check the radius against the size of the image
-  SizeType radius_fix = AdjustNCCRadius(level, radius, first_run);
+  // Check the radius against the size of the image. Private working images belong
+  // to concurrent evaluations, which should not all report the adjustment
+  SizeType radius_fix = AdjustNCCRadius(level, radius, first_run && shared_work);
 
   metric->SetFixedImage(m_FixedComposite[level]);
   metric->SetMovingImage(m_MovingComposite[level]);
@@ -889,11 +1628,13 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   metric->GetMetricOutput()->Graft(wrkMetric);
   metric->SetComputeGradient(grad != NULL);
   metric->SetRadius(radius_fix);
-  metric->SetWorkingImage(m_NCCWorkingImage);
+  metric->SetWorkingImage(wrkNCC);
+  metric->SetCompensatedSummation(m_NCCCompensatedSummation);
   metric->SetReuseWorkingImageFixedComponents(!first_run);
-  metric->SetFixedMaskImage(m_GradientMaskComposite[level]);
+  metric->SetFixedMaskImage(this->GetAffineMask(level));
   metric->SetMovingMaskImage(m_MovingMaskComposite[level]);
   metric->SetJitterImage(m_JitterComposite[level]);
+  ParallelFor::ApplyThreadQuota(metric);
   metric->Update();
 
   // Process the results
@@ -955,6 +1696,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
 
     // TODO: support moving masks...
     // filter->SetMovingMaskImage(m_MovingMaskComposite[level]);
+    ParallelFor::ApplyThreadQuota(filter2);
     filter2->Update();
     dummy.TotalMetric = filter2->GetMetricValue();
 
@@ -1043,6 +1785,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetFunctor(functor);
   filter->SetInput(warp);
   filter->GraftOutput(result);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1059,6 +1802,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   filter->SetFunctor(functor);
   filter->SetInput(warp);
   filter->GraftOutput(result);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1077,8 +1821,8 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
     // Resample the warp - no smoothing
     LDDMMType::vimg_resample_identity(srcWarp, this->GetReferenceSpace(trgLevel), trgWarp);
 
-    // Scale by the factor
-    LDDMMType::vimg_scale_in_place(trgWarp, src_factor / trg_factor);
+    // Scale by the factor (the factors are integers, so avoid integer division)
+    LDDMMType::vimg_scale_in_place(trgWarp, src_factor * 1.0 / trg_factor);
     }
   else if(src_factor == trg_factor)
     {
@@ -1114,6 +1858,7 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   typename Filter::Pointer filter = Filter::New();
   filter->SetFunctor(functor);
   filter->SetInput(warp);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 
   LDDMMData<float, VDim>::vimg_write(filter->GetOutput(), filename);
@@ -1213,7 +1958,8 @@ template <class TFloat, unsigned int VDim>
 void
 MultiImageOpticalFlowHelper<TFloat, VDim>
 ::ComputeDeformationFieldInverse(
-    VectorImageType *warp, VectorImageType *uInverse, int n_sqrt, bool verbose)
+    VectorImageType *warp, VectorImageType *uInverse, int n_sqrt, bool verbose,
+    double tol, int max_iter)
 {
   typedef LDDMMData<TFloat, VDim> LDDMMType;
 
@@ -1227,37 +1973,36 @@ MultiImageOpticalFlowHelper<TFloat, VDim>
   // Take the desired square root of the input warp and place into uForward
   ComputeWarpRoot(warp, uForward, n_sqrt);
 
-  // Clear uInverse
-  uInverse->FillBuffer(itk::NumericTraits<typename LDDMMType::Vec>::ZeroValue());
+  // At this point, uForward holds the small deformation. Invert it, iterating at
+  // each voxel until convergence
+  VectorImagePointer uSmallInverse = (n_sqrt > 0) ? LDDMMType::new_vimg(warp) : VectorImagePointer(uInverse);
 
-  // At this point, uForward holds the small deformation
-  // Try to compute the inverse of the current forward transformation
-  for(int i = 0; i < 20; i++)
-    {
-    // We are using uPhys as temporary storage
-    LDDMMType::interp_vimg(uForward, uInverse, 1.0, uWork);
-    LDDMMType::vimg_scale_in_place(uWork, -1.0);
+  typedef FixedPointWarpInverseImageFilter<VectorImageType> InverseFilter;
+  typename InverseFilter::Pointer fltInverse = InverseFilter::New();
+  fltInverse->SetInput(uForward);
+  fltInverse->SetTolerance(tol);
+  fltInverse->SetMaxIterations(max_iter);
+  fltInverse->GraftOutput(uSmallInverse);
+  ParallelFor::ApplyThreadQuota(fltInverse);
+  fltInverse->Update();
 
-    // Compute the maximum change from last iteration
-    LDDMMType::vimg_subtract_in_place(uInverse, uWork);
-
-    // std::cout << "inverse iter " << i << " change " << norm_max << std::endl;
-    LDDMMType::vimg_copy(uWork, uInverse);
-    }
-
-  // Compose the inverses
-  for(int i = 0; i < n_sqrt; i++)
+  if(verbose)
     {
-    LDDMMType::interp_vimg(uInverse, uInverse, 1.0, uWork);
-    LDDMMType::vimg_add_in_place(uInverse, uWork);
+    printf("Small warp inverse: mean iterations %6.2f, max residual %g, mean residual %g, unconverged voxels %lu\n",
+           fltInverse->GetMeanIterations(), fltInverse->GetMaxResidual(),
+           fltInverse->GetMeanResidual(), fltInverse->GetNumberOfUnconvergedVoxels());
     }
 
-  // If verbose, compute the maximum error
+  // Compose the inverses by repeated squaring
+  if(n_sqrt > 0)
+    LDDMMType::vimg_exp(uSmallInverse, uInverse, uWork, n_sqrt);
+
+  // If verbose, compute the maximum error of the composition with the input warp
   if(verbose)
     {
     FloatImagePointer iNorm = LDDMMType::new_img(uWork);
-    LDDMMType::interp_vimg(uInverse, uForward, 1.0, uWork);
-    LDDMMType::vimg_add_in_place(uWork, uForward);
+    LDDMMType::interp_vimg(uInverse, warp, 1.0, uWork);
+    LDDMMType::vimg_add_in_place(uWork, warp);
     TFloat norm_min, norm_max;
     LDDMMType::vimg_norm_min_max(uWork, iNorm, norm_min, norm_max);
     std::cout << "Warp inverse max residual: " << norm_max << std::endl;
@@ -58,6 +58,7 @@ public:
 
   typedef std::vector<int> PyramidFactorsType;
   typedef itk::Size<VDim> SizeType;
+  typedef itk::ImageRegion<VDim> RegionType;
   typedef itk::CovariantVector<TFloat, VDim> Vec;
 
   typedef itk::MatrixOffsetTransformBase<TFloat, VDim, VDim> LinearTransformType;
@@ -75,6 +76,56 @@ public:
    */
   void SetScaleFixedImageWithVoxelSize(bool onoff) { m_ScaleFixedImageWithVoxelSize = onoff; }
 
+  /**
+   * Set whether the neighborhood sums of the fixed image for the NCC metric should
+   * be computed once per level and reused across iterations, rather than being
+   * accumulated together with the moving image terms at every iteration
+   */
+  void SetNCCPrecomputeFixedSums(bool onoff) { m_NCCPrecomputeFixedSums = onoff; }
+
+  /**
+   * Crop the reference space to the bounding box of the gradient mask (or, if there
+   * is no gradient mask, the fixed mask), padded by margin voxels. The cropping is
+   * applied by BuildCompositeImages to the fixed images and the fixed and gradient
+   * masks, so that every level and every pass operates on the smaller space. The
+   * moving images are left whole, since the deformation may sample them outside of
+   * the crop. Negative margin disables cropping.
+   */
+  void SetCropToMask(int margin) { m_CropToMaskMargin = margin; }
+
+  /** Whether the reference space has been cropped by BuildCompositeImages */
+  bool IsCroppedToMask() const { return m_UncroppedReferenceSpace.IsNotNull(); }
+
+  /** The region of the uncropped reference space kept by the crop */
+  const RegionType &GetCropRegion() const { return m_CropRegion; }
+
+  /** The reference space at full resolution before cropping */
+  ImageBaseType *GetUncroppedReferenceSpace() { return m_UncroppedReferenceSpace; }
+
+  /**
+   * Place a deformation field (in voxel units) defined on the cropped reference space
+   * of the finest level into the uncropped reference space. The displacement outside
+   * of the crop is zero, so the field must not hold an initial transform (greedy
+   * rejects -crop-mask with one). If the space is not cropped, the input is returned.
+   */
+  VectorImagePointer EmbedInUncroppedSpace(VectorImageType *field);
+
+  /** Set whether the NCC neighborhood sums use compensated (Kahan) summation */
+  void SetNCCCompensatedSummation(bool onoff) { m_NCCCompensatedSummation = onoff; }
+
+  /** Set whether the MI/NMI histograms use B-spline Parzen windowing */
+  void SetMIParzenWindow(bool onoff) { m_MIParzenWindow = onoff; }
+
+  /**
+   * Storage of the fixed and moving composites read by the SSD metric in
+   * ComputeOpticalFlowField. With the 16-bit options, a copy of each level is
+   * converted once and the metric interpolates it with float arithmetic, which
+   * halves the memory traffic of the moving image reads. The copies are held in
+   * addition to the composites, which the other metrics and the output still use
+   */
+  enum CompositeStorage { STORAGE_FULL = 0, STORAGE_FLOAT16, STORAGE_BFLOAT16 };
+  void SetCompositeStorage(CompositeStorage storage) { m_CompositeStorage = storage; }
+
   /** Add a pair of multi-component images to the class - same weight for each component */
   void AddImagePair(MultiComponentImageType *fixed, MultiComponentImageType *moving, double weight);
 
@@ -96,8 +147,22 @@ public:
   /** Downsample an image, taking care of NaNs if necessary */
   void DownsampleImage(VectorImageType *src, VectorImageType *dst, int factor, bool has_nans);
   
-  /** Compute the composite image - must be run before any sampling is done */
-  void BuildCompositeImages(double noise_sigma_relative = 0.0);
+  /**
+   * Compute the composite image - must be run before any sampling is done. If
+   * moving_only is set, only the moving composites and the moving mask pyramid
+   * are rebuilt, and the fixed side built by an earlier call is kept
+   */
+  void BuildCompositeImages(double noise_sigma_relative = 0.0, bool moving_only = false);
+
+  /**
+   * Replace the moving images (and the moving mask, which may be NULL) after the
+   * composite images have been built, rebuilding only the moving side. The fixed
+   * composites, fixed and gradient masks, and precomputed fixed NCC sums are kept,
+   * so that many moving images can be registered to the same fixed images. The
+   * moving images must have the same number of components as before.
+   */
+  void ReplaceMovingImages(const std::vector<MultiComponentImagePointer> &moving,
+                           FloatImageType *moving_mask, double noise_sigma_relative = 0.0);
 
   /**
    * Apply a dilation to the fixed gradient masks - this is used with the NCC metric. The initial
@@ -111,6 +176,77 @@ public:
    */
   void DilateCompositeGradientMasksForNCC(SizeType radius);
 
+  /**
+   * Restrict the affine metrics to a fixed random subset of the voxels in the
+   * gradient mask (or the whole image if there is no mask). With stratified
+   * sampling, one voxel is picked at random out of every 1/fraction consecutive
+   * mask voxels, otherwise each mask voxel is picked with probability equal to
+   * fraction. The sample is drawn once, so all evaluations of the affine
+   * objective use the same voxels. Unsampled voxels are skipped by the metric
+   * and interpolation loops. For NCC, ncc_radius is the metric radius: the
+   * neighborhoods of the sampled voxels are still interpolated, since they feed
+   * the neighborhood sums, but voxels outside of all of them are skipped. Must be
+   * called after the composite images (and, for NCC, the dilated masks) have
+   * been built.
+   */
+  void BuildAffineSampleMasks(double fraction, bool stratified, const SizeType *ncc_radius = NULL);
+
+  /** Get the mask used for affine metric computation at a pyramid level */
+  FloatImageType *GetAffineMask(int level)
+    { return m_AffineSampleMaskComposite.size() ? m_AffineSampleMaskComposite[level] : m_GradientMaskComposite[level]; }
+
+  /**
+   * Get the bounding box of the nonzero voxels of the gradient mask at a pyramid
+   * level, padded by margin voxels on each side and clipped to the image. If there
+   * is no gradient mask, or the mask is empty, the whole image region is returned.
+   */
+  RegionType GetGradientMaskBoundingRegion(int level, int margin);
+
+  /**
+   * Restrict a pyramid level to a sub-region of the reference space. The fixed
+   * composite and the gradient mask at that level are replaced by crops, so that
+   * GetReferenceSpace() and all metric computations at that level operate on the
+   * sub-region only. The crops start at index zero, with the origin moved to the
+   * corner of the region. The moving composite and moving mask are not cropped, so
+   * the metrics must be given a deformation affine that shifts the sample positions
+   * by the index of the region (see GetRestrictedLevelAffine). This requires the
+   * moving composite to be on the same grid as the fixed composite. Use
+   * RestoreLevel() to undo.
+   */
+  void RestrictLevelToRegion(int level, const RegionType &region);
+
+  /** Undo the effect of RestrictLevelToRegion */
+  void RestoreLevel(int level);
+
+  /**
+   * The deformation affine for a level restricted to a region. This maps the voxels
+   * of the crop to the voxels of the uncropped moving composite, composed with the
+   * optional affine def_affine (in the voxel units of the uncropped level)
+   */
+  static typename LinearTransformType::Pointer GetRestrictedLevelAffine(
+      const RegionType &region, LinearTransformType *def_affine);
+
+  /**
+   * Drop the references to the input images once the composites are built. The
+   * finest level of each composite pyramid is a copy of the inputs, so this frees
+   * the inputs unless they are held elsewhere (e.g., by the image cache). The
+   * geometry and the number of components of the inputs are kept
+   */
+  void ReleaseInputImages();
+
+  /**
+   * Free the images of a level that is no longer needed. The composites keep their
+   * geometry, so GetReferenceSpace can still be used for the level. The fixed side
+   * is only freed if release_fixed is set, since a session reuses it
+   */
+  void ReleaseLevel(int level, bool release_fixed);
+
+  /** Copy a region of a vector image into a (cropped) image of the size of the region */
+  static void ExtractRegion(VectorImageType *src, const RegionType &region, VectorImageType *dst);
+
+  /** Copy a (cropped) vector image into a region of a larger image */
+  static void PasteRegion(VectorImageType *src, VectorImageType *dst, const RegionType &region);
+
   /** Get the reference image for level k */
   ImageBaseType *GetReferenceSpace(int level);
 
@@ -135,23 +271,60 @@ public:
   /** Get the component weights in the composite */
   const std::vector<double> &GetWeights() const { return m_Weights; }
 
-  /** Perform interpolation - compute [(I - J(Tx)) GradJ(Tx)] */
+  /**
+   * Perform interpolation - compute [(I - J(Tx)) GradJ(Tx)]. If a gradient mask is
+   * supplied, the gradient is multiplied by it in the same pass.
+   *
+   * In this and the other deformable metrics, an optional affine transform (in
+   * voxel units of the level) is composed with the deformation at each sample,
+   * i.e., the moving image is sampled at A(x + def(x)). The deformation is then
+   * the residual after the affine, and the gradient is with respect to it.
+   */
   void ComputeOpticalFlowField(
       int level, VectorImageType *def, FloatImageType *out_metric_image,
       MultiComponentMetricReport &out_metric_report,
-      VectorImageType *out_gradient, double result_scaling = 1.0);
+      VectorImageType *out_gradient, double result_scaling = 1.0,
+      FloatImageType *gradient_mask = NULL, LinearTransformType *def_affine = NULL);
 
   /** Perform interpolation - compute mutual information metric */
   void ComputeMIFlowField(
       int level, bool normalized_mutual_information,
       VectorImageType *def, FloatImageType *out_metric_image,
       MultiComponentMetricReport &out_metric_report,
-      VectorImageType *out_gradient, double result_scaling = 1.0);
+      VectorImageType *out_gradient, double result_scaling = 1.0,
+      LinearTransformType *def_affine = NULL);
 
   /** Compute the NCC metric without gradient */
   void ComputeNCCMetricImage(int level, VectorImageType *def, const SizeType &radius,
                              FloatImageType *out_metric_image, MultiComponentMetricReport &out_metric_report,
-                             VectorImageType *out_gradient = NULL, double result_scaling = 1.0);
+                             VectorImageType *out_gradient = NULL, double result_scaling = 1.0,
+                             LinearTransformType *def_affine = NULL);
+
+  /**
+   * Get the target warp statistics for the Mahalanobis metric at a level. The fixed
+   * composite holds the mean displacement and the upper triangle of the inverse
+   * covariance in full resolution voxel units; this image holds them converted to
+   * the voxel units of the level. It is computed once per level and cached.
+   */
+  MultiComponentImageType *GetMahalanobisStats(int level);
+
+  /**
+   * Compute the approximate NCC metric of Avants et al. (2008), as used in ANTS. The
+   * gradient is driven by the fixed image gradient, which is computed once per level
+   * and cached. The affine transform def_affine is not supported by this metric.
+   */
+  void ComputeApproximateNCCMetricImage(int level, VectorImageType *def, const SizeType &radius,
+                                        FloatImageType *out_metric_image, MultiComponentMetricReport &out_metric_report,
+                                        VectorImageType *out_gradient = NULL, double result_scaling = 1.0);
+
+  /**
+   * Brute force search for the integer displacement within search_radius that maximizes the
+   * NCC metric at each voxel. Outputs the best metric and the best displacement (voxel units).
+   * If an initial displacement is given, the search is centered on it (rounded to whole voxels)
+   */
+  void ComputeNCCBruteForceSearch(int level, const SizeType &radius, const SizeType &search_radius,
+                                  FloatImageType *out_metric_image, VectorImageType *out_displacement,
+                                  VectorImageType *init_displacement = NULL);
 
   /** Compute the Mahalanobis metric with gradient */
   void ComputeMahalanobisMetricImage(int level, VectorImageType *def,
@@ -166,7 +339,8 @@ public:
                                         VectorImageType *wrkGradMask,
                                         VectorImageType *wrkPhi,
                                         MultiComponentMetricReport &metrics,
-                                        LinearTransformType *grad = NULL);
+                                        LinearTransformType *grad = NULL,
+                                        vnl_matrix<double> *hessian = NULL);
 
 
   void ComputeAffineMIMatchAndGradient(int level, bool normalized_mutual_info,
@@ -179,6 +353,12 @@ public:
                                        MultiComponentMetricReport &metrics,
                                        LinearTransformType *grad = NULL);
 
+  /**
+   * Affine NCC metric and gradient. The precomputed fixed image terms are kept
+   * in wrkNCC, or in the working image of the helper if wrkNCC is NULL. Callers
+   * that evaluate the metric from several threads at once must each pass their
+   * own working image.
+   */
   void ComputeAffineNCCMatchAndGradient(int level, LinearTransformType *tran,
                                         const SizeType &radius,
                                         FloatImageType *wrkMetric,
@@ -187,7 +367,8 @@ public:
                                         VectorImageType *wrkGradMask,
                                         VectorImageType *wrkPhi,
                                         MultiComponentMetricReport &metrics,
-                                        LinearTransformType *grad = NULL);
+                                        LinearTransformType *grad = NULL,
+                                        MultiComponentImageType *wrkNCC = NULL);
 
   static void AffineToField(LinearTransformType *tran, VectorImageType *def);
 
@@ -209,10 +390,13 @@ public:
 
   /**
    * Invert a deformation field by first dividing it into small transformations using the
-   * square root command, and then inverting the small transformations
+   * square root command, and then inverting the small transformations. The small warp is
+   * inverted by a fixed-point iteration at each voxel, which stops once the update is
+   * below tol (voxel units) or after max_iter iterations
    */
   static void ComputeDeformationFieldInverse(
-    VectorImageType *warp, VectorImageType *result, int n_sqrt, bool verbose = false);
+    VectorImageType *warp, VectorImageType *result, int n_sqrt, bool verbose = false,
+    double tol = 1e-4, int max_iter = 20);
 
   /**
    * Compute the (2^k)-th root of a warp using an iterative scheme. For each
@@ -235,7 +419,9 @@ public:
     FloatImageType *error_norm = NULL, double tol = 0.0, int max_iter = 20);
 
   MultiImageOpticalFlowHelper() : 
-    m_JitterSigma(0.0), m_ScaleFixedImageWithVoxelSize(false) {}
+    m_JitterSigma(0.0), m_ScaleFixedImageWithVoxelSize(false), m_NCCPrecomputeFixedSums(false),
+    m_NCCCompensatedSummation(false), m_MIParzenWindow(false), m_CompositeStorage(STORAGE_FULL),
+    m_StorageSourceMTime(0), m_CropToMaskMargin(-1) {}
 
 protected:
 
@@ -259,6 +445,23 @@ protected:
   // Working memory image for NCC computation
   typename MultiComponentImageType::Pointer m_NCCWorkingImage;
 
+  // Precomputed neighborhood sums of the fixed image for NCC, per level
+  MultiCompImageSet m_NCCFixedSums;
+  std::vector<SizeType> m_NCCFixedSumsRadius;
+
+  // Working memory image for the approximate NCC metric, which has a different
+  // layout from the NCC working image
+  typename MultiComponentImageType::Pointer m_NCCApproxWorkingImage;
+
+  // Fixed image gradients and accumulated fixed channels for the approximate NCC
+  // metric, per level
+  MultiCompImageSet m_NCCApproxFixedGradient;
+  MultiCompImageSet m_NCCApproxFixedSums;
+  std::vector<SizeType> m_NCCApproxFixedSumsRadius;
+
+  // Target warp statistics for the Mahalanobis metric, per level
+  MultiCompImageSet m_MahalanobisStats;
+
   // Gradient mask image - used to multiply the gradient
   typename FloatImageType::Pointer m_GradientMaskImage;
 
@@ -271,6 +474,13 @@ protected:
   // Mask composites
   FloatImageSet m_GradientMaskComposite, m_MovingMaskComposite;
 
+  // Subsampled gradient masks used by the affine metrics
+  FloatImageSet m_AffineSampleMaskComposite;
+
+  // Full-size images at levels that have been restricted to a region
+  MultiCompImageSet m_FullFixedComposite;
+  FloatImageSet m_FullGradientMaskComposite;
+
   // Amount of jitter - for affine only
   double m_JitterSigma;
 
@@ -293,10 +503,62 @@ protected:
   typedef itk::VectorImage<unsigned char, VDim> BinnedImageType;
   typename BinnedImageType::Pointer m_FixedBinnedImage, m_MovingBinnedImage;
 
+  // Convert the fixed and moving composites for a level to the 16-bit storage type,
+  // unless the cached copies are already of this level
+  template <class TStorage>
+  void ComputeStorageImagesIfNeeded(int level);
+
+  // The SSD metric computation, with the fixed and moving images of type TImage
+  template <class TImage>
+  void ComputeOpticalFlowFieldWithStorage(TImage *fixed, TImage *moving,
+                                          VectorImageType *def,
+                                          FloatImageType *out_metric_image,
+                                          MultiComponentMetricReport &out_metric_report,
+                                          VectorImageType *out_gradient,
+                                          double result_scaling,
+                                          FloatImageType *gradient_mask,
+                                          LinearTransformType *def_affine);
+
+  // Fixed and moving images in 16-bit storage, and the state they were made from
+  itk::DataObject::Pointer m_FixedStorageImage, m_MovingStorageImage;
+  unsigned long m_StorageSourceMTime;
+
   // Whether the fixed images should be scaled down by the pyramid factors
   // when subsampling. This is needed for the Mahalanobis distance metric, but not for
   // any of the metrics that use image intensities
   bool m_ScaleFixedImageWithVoxelSize;
+
+  // Whether the fixed NCC neighborhood sums are precomputed
+  bool m_NCCPrecomputeFixedSums;
+
+  // Whether the NCC neighborhood sums use compensated summation
+  bool m_NCCCompensatedSummation;
+
+  // Whether the MI histograms use Parzen windowing
+  bool m_MIParzenWindow;
+
+  // Storage of the composites read by the SSD metric
+  CompositeStorage m_CompositeStorage;
+
+  // Cropping of the reference space to the mask
+  int m_CropToMaskMargin;
+  RegionType m_CropRegion;
+  typename FloatImageType::Pointer m_UncroppedReferenceSpace;
+
+  // Crop the inputs to the mask bounding box, called by BuildCompositeImages
+  void CropInputsToMask();
+
+  // An image with the geometry and number of components of the source, but no buffer
+  static MultiComponentImagePointer MakeGeometryOnlyImage(MultiComponentImageType *src);
+
+  // Interleave the inputs of one side into a composite and build its pyramid,
+  // called by BuildCompositeImages. Voxels in nan_mask are set to NaN. Noise is
+  // drawn from the generator stream noise_stream (0 = fixed, 1 = moving). The noise
+  // sigma for each component and the number of NaNs in component 0 are returned
+  void BuildCompositePyramid(const MultiCompImageSet &inputs, FloatImageType *nan_mask,
+                             bool scale_with_factor, double noise_sigma_relative, int noise_stream,
+                             MultiCompImageSet &pyramid, std::vector<double> &noise_sigma,
+                             long &n_nans);
 };
 
 #endif
@@ -0,0 +1,388 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "ParallelFor.h"
+#include "itkMultiThreader.h"
+#include "itkProcessObject.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _GREEDY_TBB_
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/global_control.h>
+#endif
+
+#if defined(__linux__) && !defined(_GREEDY_TBB_)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+int ParallelFor::m_NumberOfThreads = 0;
+bool ParallelFor::m_ThreadAffinity = false;
+
+namespace {
+
+// Thread quota of the current thread (0: none)
+thread_local int pf_thread_quota = 0;
+
+// Number of chunks per thread when the grain is not given
+const long PF_CHUNKS_PER_THREAD = 16;
+
+// Smallest automatic chunk, so that tiny loops are not split up too finely
+const long PF_MIN_GRAIN = 256;
+
+long pf_default_grain(long n, int n_threads)
+{
+  return std::max(PF_MIN_GRAIN, n / (n_threads * PF_CHUNKS_PER_THREAD) + 1);
+}
+
+#ifndef _GREEDY_TBB_
+
+// Whether the current thread is executing chunks of a loop
+thread_local bool pf_in_loop = false;
+
+/**
+ * A single parallel loop. The chunks are divided into contiguous shares, one per
+ * participant slot; each share has its own counter of the next chunk to take,
+ * on its own cache line
+ */
+struct ParallelForJob
+{
+  struct Share
+  {
+    std::atomic<long> next;
+    long end;
+    char pad[64 - sizeof(std::atomic<long>) - sizeof(long)];
+  };
+
+  const std::function<void(long, long)> *f;
+  long n, grain;
+  int n_shares;
+
+  // Thread quota of the thread that started the loop
+  int quota;
+  std::unique_ptr<Share[]> shares;
+
+  // Participants and pool threads referencing the job, guarded by the pool mutex
+  int n_participants, n_refs;
+
+  // Set once some participant has found no chunks left, so no new ones join
+  std::atomic<bool> exhausted;
+
+  // First exception thrown by the loop body
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  ParallelForJob(long n, long grain, int n_shares, const std::function<void(long, long)> *f)
+    : f(f), n(n), grain(grain), n_shares(n_shares), quota(pf_thread_quota),
+      shares(new Share[n_shares]), n_participants(0), n_refs(0), exhausted(false)
+  {
+    long n_chunks = (n + grain - 1) / grain;
+    for(int s = 0; s < n_shares; s++)
+      {
+      shares[s].next = (n_chunks * s) / n_shares;
+      shares[s].end = (n_chunks * (s + 1)) / n_shares;
+      }
+  }
+
+  // Process the chunks of the given share, then take chunks from the other shares
+  void Execute(int slot)
+  {
+    bool was_in_loop = pf_in_loop;
+    int was_quota = pf_thread_quota;
+    pf_in_loop = true;
+    pf_thread_quota = quota;
+    for(int k = 0; k < n_shares; k++)
+      {
+      Share &sh = shares[(slot + k) % n_shares];
+      for(long c = sh.next++; c < sh.end; c = sh.next++)
+        {
+        try
+          {
+          (*f)(c * grain, std::min(n, (c + 1) * grain));
+          }
+        catch(...)
+          {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if(!error)
+            error = std::current_exception();
+          }
+        }
+      }
+    exhausted = true;
+    pf_in_loop = was_in_loop;
+    pf_thread_quota = was_quota;
+  }
+};
+
+/**
+ * The persistent pool of threads. Loops in progress are kept in a list, and idle
+ * threads join the first loop that has room for another participant
+ */
+class ParallelForPool
+{
+public:
+  ParallelForPool(int n_threads, bool affinity) : m_Affinity(affinity), m_Shutdown(false)
+  {
+    for(int t = 0; t < n_threads; t++)
+      m_Threads.push_back(std::thread(&ParallelForPool::Worker, this, t, affinity));
+  }
+
+  ~ParallelForPool()
+  {
+    {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Shutdown = true;
+    }
+    m_WorkCondition.notify_all();
+    for(auto &t : m_Threads)
+      t.join();
+  }
+
+  int GetNumberOfThreads() const { return (int) m_Threads.size(); }
+
+  bool GetAffinity() const { return m_Affinity; }
+
+  void Run(ParallelForJob &job)
+  {
+    // The caller takes the first share
+    {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    job.n_participants = 1;
+    m_Jobs.push_back(&job);
+    }
+    m_WorkCondition.notify_all();
+
+    job.Execute(0);
+
+    // Once the job is off the list no new threads join, and the threads that did
+    // join still have to finish the chunks they took
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Jobs.remove(&job);
+    m_DoneCondition.wait(lock, [&job]() { return job.n_refs == 0; });
+  }
+
+protected:
+
+  ParallelForJob *FindJob()
+  {
+    for(ParallelForJob *job : m_Jobs)
+      if(!job->exhausted && job->n_participants < job->n_shares)
+        return job;
+    return NULL;
+  }
+
+  void Worker(int t, bool affinity)
+  {
+#if defined(__linux__)
+    if(affinity)
+      {
+      // The calling threads are not pinned, so leave core 0 to the main thread
+      unsigned int n_cpu = std::max(1u, std::thread::hardware_concurrency());
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET((t + 1) % n_cpu, &cpuset);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+      }
+#endif
+
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while(true)
+      {
+      ParallelForJob *job = NULL;
+      m_WorkCondition.wait(lock, [this, &job]() { return m_Shutdown || (job = FindJob()) != NULL; });
+      if(m_Shutdown)
+        return;
+
+      // Pool thread t always starts on share t+1, so uniform loops split the
+      // same way every time
+      job->n_participants++;
+      job->n_refs++;
+      lock.unlock();
+
+      job->Execute((t + 1) % job->n_shares);
+
+      lock.lock();
+      if(--job->n_refs == 0)
+        m_DoneCondition.notify_all();
+      }
+  }
+
+  std::vector<std::thread> m_Threads;
+  std::list<ParallelForJob *> m_Jobs;
+  std::mutex m_Mutex;
+  std::condition_variable m_WorkCondition, m_DoneCondition;
+  bool m_Affinity, m_Shutdown;
+};
+
+// The pool is created on first use. It is replaced when it is too small for a loop
+// or has the wrong affinity, but only when no other loops are using it, so that
+// the settings can be changed by concurrent registrations. It never shrinks
+std::unique_ptr<ParallelForPool> pf_pool;
+std::mutex pf_pool_mutex;
+int pf_active_loops = 0;
+
+ParallelForPool *pf_acquire_pool(int n_threads, bool affinity)
+{
+  std::lock_guard<std::mutex> lock(pf_pool_mutex);
+  if(!pf_pool || (pf_active_loops == 0 && (pf_pool->GetNumberOfThreads() < n_threads - 1
+                                           || pf_pool->GetAffinity() != affinity)))
+    {
+    n_threads = std::max(n_threads, pf_pool ? pf_pool->GetNumberOfThreads() + 1 : 1);
+    pf_pool.reset();
+    pf_pool.reset(new ParallelForPool(n_threads - 1, affinity));
+    }
+  pf_active_loops++;
+  return pf_pool.get();
+}
+
+void pf_release_pool()
+{
+  std::lock_guard<std::mutex> lock(pf_pool_mutex);
+  pf_active_loops--;
+}
+
+
+#else
+
+// The TBB parallelism limit, which only grows (see above)
+std::unique_ptr<tbb::global_control> pf_tbb_control;
+int pf_tbb_threads = 0;
+std::mutex pf_tbb_mutex;
+
+#endif
+
+} // namespace
+
+void ParallelFor::SetNumberOfThreads(int n)
+{
+  m_NumberOfThreads = std::max(0, n);
+
+#ifdef _GREEDY_TBB_
+  std::lock_guard<std::mutex> lock(pf_tbb_mutex);
+  if(m_NumberOfThreads > pf_tbb_threads)
+    {
+    pf_tbb_threads = m_NumberOfThreads;
+    pf_tbb_control.reset(new tbb::global_control(
+                           tbb::global_control::max_allowed_parallelism, pf_tbb_threads));
+    }
+#endif
+}
+
+int ParallelFor::GetNumberOfThreads()
+{
+  // The ITK default may be lower than the pool size, and the quota of the calling
+  // thread lowers it further, e.g., to split the threads between concurrent
+  // registrations
+  int n_itk = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  int n = m_NumberOfThreads > 0 ? std::min(m_NumberOfThreads, n_itk) : n_itk;
+  return pf_thread_quota > 0 ? std::max(1, std::min(n, pf_thread_quota)) : n;
+}
+
+ParallelFor::ThreadQuota::ThreadQuota(int n)
+  : m_Saved(pf_thread_quota)
+{
+  if(n > 0 && (pf_thread_quota <= 0 || n < pf_thread_quota))
+    pf_thread_quota = n;
+}
+
+ParallelFor::ThreadQuota::~ThreadQuota()
+{
+  pf_thread_quota = m_Saved;
+}
+
+void ParallelFor::ApplyThreadQuota(itk::ProcessObject *filter)
+{
+  if(!filter)
+    return;
+
+  filter->SetNumberOfThreads(GetNumberOfThreads());
+
+  // The filters upstream are updated along with this one
+  const itk::ProcessObject::DataObjectPointerArray &inputs = filter->GetInputs();
+  for(unsigned int i = 0; i < inputs.size(); i++)
+    {
+    if(inputs[i])
+      {
+      itk::ProcessObject::Pointer source = inputs[i]->GetSource();
+      if(source)
+        ApplyThreadQuota(source.GetPointer());
+      }
+    }
+}
+
+void ParallelFor::ApplyThreadQuota(itk::MultiThreader *threader)
+{
+  threader->SetNumberOfThreads(GetNumberOfThreads());
+}
+
+void ParallelFor::SetThreadAffinity(bool flag)
+{
+  m_ThreadAffinity = flag;
+}
+
+void ParallelFor::Run(long n, long grain, const std::function<void(long, long)> &f)
+{
+  if(n <= 0)
+    return;
+
+  int n_threads = GetNumberOfThreads();
+  if(grain <= 0)
+    grain = pf_default_grain(n, n_threads);
+
+#ifdef _GREEDY_TBB_
+  tbb::parallel_for(tbb::blocked_range<long>(0, n, grain),
+                    [&f](const tbb::blocked_range<long> &r) { f(r.begin(), r.end()); });
+#else
+  long n_chunks = (n + grain - 1) / grain;
+  int n_shares = (int) std::min((long) n_threads, n_chunks);
+  if(n_shares <= 1 || pf_in_loop)
+    {
+    f(0, n);
+    return;
+    }
+
+  // The pool is sized for the configured number of threads, while a loop may use
+  // fewer of them under a thread quota
+  int n_pool = m_NumberOfThreads > 0 ? m_NumberOfThreads : n_threads;
+  ParallelForPool *pool = pf_acquire_pool(n_pool, m_ThreadAffinity);
+
+  ParallelForJob job(n, grain, n_shares, &f);
+  pool->Run(job);
+  pf_release_pool();
+
+  if(job.error)
+    std::rethrow_exception(job.error);
+#endif
+}
@@ -0,0 +1,139 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+
+#include <functional>
+#include <algorithm>
+
+namespace itk
+{
+class ProcessObject;
+class MultiThreader;
+}
+
+/**
+ * Project-wide parallel loop over an index range, executed by a persistent pool
+ * of threads instead of a new split of the region with itk::MultiThreader for
+ * every operation.
+ *
+ * The range [0, n) is cut into chunks of at most 'grain' indices. Each thread
+ * taking part in a loop is first given a fixed contiguous share of the chunks
+ * (the caller gets the first share, pool thread t the share t+1), and threads
+ * that finish their share take the remaining chunks of the other shares. Thus
+ * the load is balanced when some chunks are cheaper than others (masked or
+ * outside regions), while in a uniform loop each thread mostly works on the
+ * same part of the range every time. Together with FillFirstTouch() for new
+ * buffers, this keeps the pages of an image on the NUMA node of the threads
+ * that process them.
+ *
+ * Several threads (e.g., concurrent registrations in batch mode) may run loops
+ * at the same time; the pool threads help whichever loops have room. A loop
+ * started from inside another loop is executed serially by the calling thread.
+ *
+ * Concurrent registrations split the threads with a ThreadQuota on each of their
+ * threads, which limits the loops they start and the ITK filters that are set up
+ * with ApplyThreadQuota. The ITK global default number of threads is shared by
+ * the whole process and is never changed for this purpose.
+ *
+ * When built with GREEDY_USE_TBB, the loops are run by TBB's work-stealing
+ * scheduler instead, and the thread affinity setting is ignored.
+ */
+class ParallelFor
+{
+public:
+
+  /**
+   * Set the number of threads that take part in a loop, including the calling
+   * thread, at most. Zero uses the ITK global default number of threads, which
+   * also limits the threads per loop when it is lower. The pool grows to this
+   * size once no loops are running; it does not shrink.
+   */
+  static void SetNumberOfThreads(int n);
+
+  /**
+   * Number of threads that take part in a loop started now by the calling thread,
+   * which is also the number given to ITK filters by ApplyThreadQuota
+   */
+  static int GetNumberOfThreads();
+
+  /**
+   * Limit the number of threads used by the calling thread to n for the lifetime of
+   * the object. Quotas nest, the lowest one applies. The chunks of a loop started
+   * under a quota run under the same quota on the pool threads.
+   */
+  class ThreadQuota
+  {
+  public:
+    ThreadQuota(int n);
+    ~ThreadQuota();
+
+  private:
+    int m_Saved;
+    ThreadQuota(const ThreadQuota &);
+    void operator = (const ThreadQuota &);
+  };
+
+  /**
+   * Set the number of threads of an ITK filter, and of the filters upstream of it in
+   * the pipeline, to GetNumberOfThreads(). Call this before updating the filter.
+   */
+  static void ApplyThreadQuota(itk::ProcessObject *filter);
+
+  /** Set the number of threads of a multithreader to GetNumberOfThreads() */
+  static void ApplyThreadQuota(itk::MultiThreader *threader);
+
+  /** Pin each pool thread to its own core (Linux only), from the next pool on */
+  static void SetThreadAffinity(bool flag);
+  static bool GetThreadAffinity() { return m_ThreadAffinity; }
+
+  /**
+   * Call f(begin, end) over the chunks of [0, n) in parallel and wait for the
+   * whole range to be processed. With grain <= 0, the chunk size is chosen so
+   * that each thread gets several chunks. The first exception thrown by f is
+   * rethrown by Run, after all other chunks have been processed.
+   */
+  static void Run(long n, long grain, const std::function<void(long, long)> &f);
+
+  /**
+   * Fill a newly allocated buffer in a parallel loop over its elements, so that
+   * its pages are first touched, and thus placed, by the threads that will work
+   * on them in later loops over the same range
+   */
+  template <class T>
+  static void FillFirstTouch(T *buffer, long n, const T &value)
+    {
+    Run(n, 0, [buffer, &value](long i0, long i1) { std::fill(buffer + i0, buffer + i1, value); });
+    }
+
+protected:
+
+  static int m_NumberOfThreads;
+  static bool m_ThreadAffinity;
+};
+
+#endif // PARALLELFOR_H
@@ -0,0 +1,417 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "ParallelGzip.h"
+#include "ParallelFor.h"
+#include "itkMultiThreader.h"
+#include "itkMacro.h"
+#include "itk_zlib.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+int ParallelGzip::m_CompressionLevel = 0;
+int ParallelGzip::m_NumberOfThreads = 0;
+
+// Uncompressed size of each block
+static const size_t PGZ_BLOCK_SIZE = 1 << 20;
+
+// Number of blocks held in memory per thread
+static const size_t PGZ_BLOCKS_PER_THREAD = 4;
+
+// Size of the member header (fixed part, XLEN and the 'GB' subfield holding the
+// total member size) and of the member trailer (CRC32 and ISIZE)
+static const size_t PGZ_HEADER_SIZE = 20;
+static const size_t PGZ_TRAILER_SIZE = 8;
+
+namespace {
+
+void pgz_put_le32(unsigned char *p, unsigned long v)
+{
+  p[0] = (unsigned char) (v & 0xff);
+  p[1] = (unsigned char) ((v >> 8) & 0xff);
+  p[2] = (unsigned char) ((v >> 16) & 0xff);
+  p[3] = (unsigned char) ((v >> 24) & 0xff);
+}
+
+unsigned long pgz_get_le32(const unsigned char *p)
+{
+  return ((unsigned long) p[0]) | ((unsigned long) p[1] << 8)
+      | ((unsigned long) p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+// Check that a member header is in the block format
+bool pgz_is_block_header(const unsigned char *h)
+{
+  return h[0] == 0x1f && h[1] == 0x8b && h[2] == 8 && (h[3] & 4)
+      && h[10] == 8 && h[11] == 0 && h[12] == 'G' && h[13] == 'B'
+      && h[14] == 4 && h[15] == 0;
+}
+
+struct PGZBlock
+{
+  // Uncompressed data and the complete gzip member
+  std::vector<unsigned char> raw, member;
+  bool ok;
+};
+
+struct PGZThreadData
+{
+  std::vector<PGZBlock> *blocks;
+  size_t n_blocks;
+  int level;
+  bool compress;
+};
+
+unsigned long pgz_crc(const std::vector<unsigned char> &data)
+{
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  return data.size() ? crc32(crc, &data[0], (uInt) data.size()) : crc;
+}
+
+void pgz_compress_block(PGZBlock &b, int level)
+{
+  b.ok = false;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if(deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return;
+
+  // Raw deflate data go between the header and the trailer
+  size_t bound = deflateBound(&strm, (uLong) b.raw.size());
+  b.member.resize(PGZ_HEADER_SIZE + bound + PGZ_TRAILER_SIZE);
+  strm.next_in = b.raw.size() ? &b.raw[0] : Z_NULL;
+  strm.avail_in = (uInt) b.raw.size();
+  strm.next_out = &b.member[PGZ_HEADER_SIZE];
+  strm.avail_out = (uInt) bound;
+  int rc = deflate(&strm, Z_FINISH);
+  size_t n_out = bound - strm.avail_out;
+  deflateEnd(&strm);
+  if(rc != Z_STREAM_END)
+    return;
+
+  size_t n_member = PGZ_HEADER_SIZE + n_out + PGZ_TRAILER_SIZE;
+  b.member.resize(n_member);
+
+  // Header with the FEXTRA flag and the member size in the 'GB' subfield
+  unsigned char *h = &b.member[0];
+  memset(h, 0, PGZ_HEADER_SIZE);
+  h[0] = 0x1f; h[1] = 0x8b; h[2] = 8; h[3] = 4; h[9] = 255;
+  h[10] = 8; h[12] = 'G'; h[13] = 'B'; h[14] = 4;
+  pgz_put_le32(h + 16, (unsigned long) n_member);
+
+  // Trailer
+  unsigned char *t = h + PGZ_HEADER_SIZE + n_out;
+  pgz_put_le32(t, pgz_crc(b.raw));
+  pgz_put_le32(t + 4, (unsigned long) b.raw.size());
+  b.ok = true;
+}
+
+void pgz_decompress_block(PGZBlock &b)
+{
+  b.ok = false;
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if(inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+    return;
+
+  // The output has been sized from the ISIZE field of the trailer
+  unsigned char dummy;
+  strm.next_in = &b.member[PGZ_HEADER_SIZE];
+  strm.avail_in = (uInt) (b.member.size() - PGZ_HEADER_SIZE - PGZ_TRAILER_SIZE);
+  strm.next_out = b.raw.size() ? &b.raw[0] : &dummy;
+  strm.avail_out = (uInt) b.raw.size();
+  int rc = inflate(&strm, Z_FINISH);
+  bool complete = (rc == Z_STREAM_END && strm.avail_out == 0);
+  inflateEnd(&strm);
+
+  const unsigned char *t = &b.member[b.member.size() - PGZ_TRAILER_SIZE];
+  b.ok = complete && pgz_get_le32(t) == pgz_crc(b.raw);
+}
+
+ITK_THREAD_RETURN_TYPE pgz_thread_callback(void *arg)
+{
+  itk::MultiThreader::ThreadInfoStruct *info = (itk::MultiThreader::ThreadInfoStruct *) arg;
+  PGZThreadData *data = (PGZThreadData *) info->UserData;
+
+  // Blocks are assigned to threads in an interleaved fashion
+  for(size_t i = info->ThreadID; i < data->n_blocks; i += info->NumberOfThreads)
+    {
+    if(data->compress)
+      pgz_compress_block((*data->blocks)[i], data->level);
+    else
+      pgz_decompress_block((*data->blocks)[i]);
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void pgz_process_blocks(PGZThreadData &td, int n_threads)
+{
+  n_threads = (int) std::min((size_t) n_threads, td.n_blocks);
+  if(n_threads > 1)
+    {
+    itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+    mt->SetNumberOfThreads(n_threads);
+    mt->SetSingleMethod(pgz_thread_callback, &td);
+    mt->SingleMethodExecute();
+    }
+  else
+    {
+    itk::MultiThreader::ThreadInfoStruct info;
+    info.ThreadID = 0;
+    info.NumberOfThreads = 1;
+    info.UserData = &td;
+    pgz_thread_callback(&info);
+    }
+}
+
+} // namespace
+
+void ParallelGzip::SetCompressionLevel(int level)
+{
+  m_CompressionLevel = std::max(0, std::min(9, level));
+}
+
+int ParallelGzip::GetCompressionLevel()
+{
+  return m_CompressionLevel;
+}
+
+void ParallelGzip::SetNumberOfThreads(int n)
+{
+  m_NumberOfThreads = std::max(0, n);
+}
+
+int ParallelGzip::GetNumberOfThreads()
+{
+  // By default, follow the thread quota of the calling thread
+  return m_NumberOfThreads > 0
+      ? m_NumberOfThreads
+      : ParallelFor::GetNumberOfThreads();
+}
+
+void ParallelGzip::CompressFile(const std::string &src, const std::string &dst)
+{
+  FILE *fin = fopen(src.c_str(), "rb");
+  if(!fin)
+    itkGenericExceptionMacro(<< "Unable to open " << src << " for reading");
+
+  FILE *fout = fopen(dst.c_str(), "wb");
+  if(!fout)
+    {
+    fclose(fin);
+    itkGenericExceptionMacro(<< "Unable to open " << dst << " for writing");
+    }
+
+  int n_threads = GetNumberOfThreads();
+  std::vector<PGZBlock> blocks(n_threads * PGZ_BLOCKS_PER_THREAD);
+  PGZThreadData td;
+  td.blocks = &blocks;
+  td.level = m_CompressionLevel > 0 ? m_CompressionLevel : Z_DEFAULT_COMPRESSION;
+  td.compress = true;
+
+  // Compress a batch of blocks at a time. An empty file still gets one member
+  bool eof = false, ok = true, first = true;
+  while(!eof && ok)
+    {
+    td.n_blocks = 0;
+    while(td.n_blocks < blocks.size() && !eof)
+      {
+      PGZBlock &b = blocks[td.n_blocks];
+      b.raw.resize(PGZ_BLOCK_SIZE);
+      size_t nr = fread(&b.raw[0], 1, PGZ_BLOCK_SIZE, fin);
+      b.raw.resize(nr);
+      eof = (nr < PGZ_BLOCK_SIZE);
+      if(nr > 0 || (first && td.n_blocks == 0))
+        td.n_blocks++;
+      }
+    first = false;
+
+    pgz_process_blocks(td, n_threads);
+
+    for(size_t i = 0; i < td.n_blocks && ok; i++)
+      ok = blocks[i].ok
+           && fwrite(&blocks[i].member[0], 1, blocks[i].member.size(), fout) == blocks[i].member.size();
+    }
+
+  ok = !ferror(fin) && ok;
+  fclose(fin);
+  ok = (fclose(fout) == 0) && ok;
+  if(!ok)
+    itkGenericExceptionMacro(<< "Error compressing " << src << " to " << dst);
+}
+
+bool ParallelGzip::DecompressFile(const std::string &src, const std::string &dst)
+{
+  // Errors opening the files are left for the caller (i.e., the ITK reader) to report
+  FILE *fin = fopen(src.c_str(), "rb");
+  if(!fin)
+    return false;
+
+  // Check if the file is in the block format
+  unsigned char h[PGZ_HEADER_SIZE];
+  if(fread(h, 1, PGZ_HEADER_SIZE, fin) != PGZ_HEADER_SIZE || !pgz_is_block_header(h))
+    {
+    fclose(fin);
+    return false;
+    }
+  rewind(fin);
+
+  FILE *fout = fopen(dst.c_str(), "wb");
+  if(!fout)
+    {
+    fclose(fin);
+    return false;
+    }
+
+  int n_threads = GetNumberOfThreads();
+  std::vector<PGZBlock> blocks(n_threads * PGZ_BLOCKS_PER_THREAD);
+  PGZThreadData td;
+  td.blocks = &blocks;
+  td.level = 0;
+  td.compress = false;
+
+  // Read a batch of members at a time, using the sizes stored in their headers
+  bool eof = false, ok = true;
+  while(!eof && ok)
+    {
+    td.n_blocks = 0;
+    while(td.n_blocks < blocks.size() && ok)
+      {
+      size_t nr = fread(h, 1, PGZ_HEADER_SIZE, fin);
+      if(nr == 0)
+        {
+        eof = true;
+        break;
+        }
+
+      size_t n_member = pgz_get_le32(h + 16);
+      if(nr < PGZ_HEADER_SIZE || !pgz_is_block_header(h)
+         || n_member < PGZ_HEADER_SIZE + PGZ_TRAILER_SIZE)
+        {
+        ok = false;
+        break;
+        }
+
+      PGZBlock &b = blocks[td.n_blocks++];
+      b.member.resize(n_member);
+      memcpy(&b.member[0], h, PGZ_HEADER_SIZE);
+      size_t n_rest = n_member - PGZ_HEADER_SIZE;
+      ok = fread(&b.member[PGZ_HEADER_SIZE], 1, n_rest, fin) == n_rest;
+      if(ok)
+        b.raw.resize(pgz_get_le32(&b.member[n_member - 4]));
+      }
+
+    if(ok)
+      pgz_process_blocks(td, n_threads);
+
+    for(size_t i = 0; i < td.n_blocks && ok; i++)
+      ok = blocks[i].ok
+           && (blocks[i].raw.empty()
+               || fwrite(&blocks[i].raw[0], 1, blocks[i].raw.size(), fout) == blocks[i].raw.size());
+    }
+
+  fclose(fin);
+  ok = (fclose(fout) == 0) && ok;
+  if(!ok)
+    {
+    remove(dst.c_str());
+    itkGenericExceptionMacro(<< "Error decompressing " << src << ", the file may be corrupt");
+    }
+
+  return true;
+}
+
+bool ParallelGzip::IsGzipNifti(const std::string &filename)
+{
+  return filename.size() > 7 && filename.compare(filename.size() - 7, 7, ".nii.gz") == 0;
+}
+
+std::string ParallelGzip::GetTempFilename(const std::string &filename)
+{
+  // The temporary file is placed next to the target, so it is on the same
+  // file system, and has the extension of an uncompressed NIfTI file. The
+  // process id keeps names apart between processes and the counter between
+  // threads of this process, e.g., batch jobs reading the same image
+  static std::atomic<unsigned long> counter(0);
+  std::ostringstream oss;
+  oss << filename << ".tmp" << getpid() << "_" << counter++ << ".nii";
+  return oss.str();
+}
+
+std::string ParallelGzip::PrepareWrite(const std::string &filename)
+{
+  if(m_CompressionLevel > 0 && IsGzipNifti(filename))
+    return GetTempFilename(filename);
+  return filename;
+}
+
+void ParallelGzip::FinishWrite(const std::string &filename, const std::string &fn_written)
+{
+  if(fn_written == filename)
+    return;
+
+  try
+    {
+    CompressFile(fn_written, filename);
+    }
+  catch(...)
+    {
+    remove(fn_written.c_str());
+    throw;
+    }
+  remove(fn_written.c_str());
+}
+
+std::string ParallelGzip::PrepareRead(const std::string &filename)
+{
+  if(IsGzipNifti(filename))
+    {
+    std::string fn_temp = GetTempFilename(filename);
+    if(DecompressFile(filename, fn_temp))
+      return fn_temp;
+    }
+  return filename;
+}
+
+void ParallelGzip::FinishRead(const std::string &filename, const std::string &fn_read)
+{
+  if(fn_read != filename)
+    remove(fn_read.c_str());
+}
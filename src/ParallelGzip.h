@@ -0,0 +1,101 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#ifndef PARALLELGZIP_H
+#define PARALLELGZIP_H
+
+#include <string>
+
+/**
+ * Multi-threaded gzip compression and decompression of NIfTI files, in the
+ * spirit of pigz. Files are compressed in independent blocks, each stored as a
+ * separate gzip member, so the output is a standard multi-member gzip file
+ * that any gzip reader (including ITK) can decode. The compressed size of each
+ * member is recorded in an extra header field (as in BGZF), which allows our
+ * own reader to locate the members and inflate them in parallel as well.
+ *
+ * The image writers and readers use this through PrepareWrite/FinishWrite and
+ * PrepareRead/FinishRead: the image is written to or read from an uncompressed
+ * temporary file next to the target, which is then compressed or was
+ * decompressed by this class. Parallel compression is off by default, in which
+ * case these methods return the original filename and ITK does the work.
+ */
+class ParallelGzip
+{
+public:
+
+  /**
+   * Enable parallel compression with the given zlib level (1-9). Zero disables
+   * parallel compression. Files written in the block format are always
+   * decompressed in parallel, regardless of this setting.
+   */
+  static void SetCompressionLevel(int level);
+  static int GetCompressionLevel();
+
+  /** Number of threads used, or zero to use ParallelFor::GetNumberOfThreads() */
+  static void SetNumberOfThreads(int n);
+  static int GetNumberOfThreads();
+
+  /** Compress a file in the parallel block format. Throws on failure */
+  static void CompressFile(const std::string &src, const std::string &dst);
+
+  /**
+   * Decompress a file in the parallel block format. Returns false without
+   * writing anything if the file is not in the block format, or if either file
+   * cannot be opened. Throws if the compressed data are corrupt.
+   */
+  static bool DecompressFile(const std::string &src, const std::string &dst);
+
+  /**
+   * Get the filename that an image writer should write to. If parallel
+   * compression is enabled and the file is a .nii.gz file, this is an
+   * uncompressed temporary file, otherwise the filename itself.
+   */
+  static std::string PrepareWrite(const std::string &filename);
+
+  /** Compress the temporary file returned by PrepareWrite, if any, into place */
+  static void FinishWrite(const std::string &filename, const std::string &fn_written);
+
+  /**
+   * Get the filename that an image reader should read from. If the file is a
+   * .nii.gz file in the block format, it is decompressed in parallel to a
+   * temporary file, whose name is returned. Otherwise returns the filename.
+   */
+  static std::string PrepareRead(const std::string &filename);
+
+  /** Remove the temporary file returned by PrepareRead, if any */
+  static void FinishRead(const std::string &filename, const std::string &fn_read);
+
+protected:
+
+  static bool IsGzipNifti(const std::string &filename);
+  static std::string GetTempFilename(const std::string &filename);
+
+  static int m_CompressionLevel;
+  static int m_NumberOfThreads;
+};
+
+#endif // PARALLELGZIP_H
@@ -0,0 +1,274 @@
+#include "PCGSolverInterface.h"
+#include "SparseSolverException.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+using namespace std;
+
+PCGSolverInterface::PCGSolverInterface(PreconditionerType type)
+{
+  m_Type = type;
+  n = 0;
+  xMatrix = NULL;
+  m_Sign = 1.0;
+  m_UseCholesky = false;
+  m_Tolerance = 1e-8;
+  m_MaxIterations = 1000;
+  m_LastIterations = 0;
+  m_LastResidual = 0.0;
+  m_UseInitialGuess = false;
+  flagVerbose = false;
+}
+
+void
+PCGSolverInterface
+::SymbolicFactorization(size_t n, int *idxRows, int *idxCols, double *xMatrix)
+{
+  this->n = n;
+  m_RowIndex.resize(n + 1);
+  for(size_t i = 0; i <= n; i++)
+    m_RowIndex[i] = idxRows[i] - 1;
+  m_ColIndex.resize(m_RowIndex[n]);
+  for(size_t k = 0; k < m_RowIndex[n]; k++)
+    m_ColIndex[k] = idxCols[k] - 1;
+}
+
+void
+PCGSolverInterface
+::SymbolicFactorization(const ImmutableSparseMatrix<double> &mat)
+{
+  this->n = mat.GetNumberOfRows();
+  m_RowIndex.assign(mat.GetRowIndex(), mat.GetRowIndex() + n + 1);
+  m_ColIndex.assign(mat.GetColIndex(), mat.GetColIndex() + mat.GetNumberOfSparseValues());
+}
+
+void
+PCGSolverInterface
+::NumericFactorization(const double *xMatrix)
+{
+  this->xMatrix = xMatrix;
+
+  // Extract the diagonal, which also gives the sign of the matrix
+  m_InvDiag.assign(n, 0.0);
+  for(size_t i = 0; i < n; i++)
+    for(size_t k = m_RowIndex[i]; k < m_RowIndex[i+1]; k++)
+      if(m_ColIndex[k] == i)
+        m_InvDiag[i] = xMatrix[k];
+
+  m_Sign = (n > 0 && m_InvDiag[0] < 0.0) ? -1.0 : 1.0;
+  for(size_t i = 0; i < n; i++)
+    {
+    double d = m_Sign * m_InvDiag[i];
+    if(d <= 0.0)
+      throw SparseSolverModelException("PCG solver requires a definite matrix with non-zero diagonal");
+    m_InvDiag[i] = 1.0 / d;
+    }
+
+  // Compute the incomplete Cholesky factor, fall back to Jacobi on breakdown
+  m_UseCholesky = false;
+  if(m_Type == INCOMPLETE_CHOLESKY)
+    {
+    m_UseCholesky = ComputeIncompleteCholesky();
+    if(!m_UseCholesky && flagVerbose)
+      printf("PCG: incomplete Cholesky breakdown, using Jacobi preconditioner\n");
+    }
+
+  // Allocate the work vectors
+  m_R.resize(n); m_Z.resize(n); m_P.resize(n); m_Q.resize(n);
+}
+
+bool
+PCGSolverInterface
+::ComputeIncompleteCholesky()
+{
+  // Pattern of the lower triangle, sorted by column within each row. The
+  // source index maps each entry of L to the entry of the matrix.
+  m_LRowIndex.assign(n + 1, 0);
+  m_LColIndex.clear();
+  m_LSource.clear();
+  vector<pair<size_t, size_t> > row;
+  for(size_t i = 0; i < n; i++)
+    {
+    row.clear();
+    for(size_t k = m_RowIndex[i]; k < m_RowIndex[i+1]; k++)
+      if(m_ColIndex[k] <= i)
+        row.push_back(make_pair(m_ColIndex[k], k));
+    sort(row.begin(), row.end());
+    if(row.empty() || row.back().first != i)
+      return false;
+    for(size_t q = 0; q < row.size(); q++)
+      {
+      m_LColIndex.push_back(row[q].first);
+      m_LSource.push_back(row[q].second);
+      }
+    m_LRowIndex[i+1] = m_LColIndex.size();
+    }
+
+  // Row-wise IC(0): L_ij = (a_ij - sum_k<j L_ik L_jk) / L_jj for j < i, and
+  // L_ii = sqrt(a_ii - sum_k<i L_ik^2). Rows i and j are merged to form the sums.
+  m_LValues.resize(m_LColIndex.size());
+  for(size_t i = 0; i < n; i++)
+    {
+    size_t ri0 = m_LRowIndex[i], ri1 = m_LRowIndex[i+1];
+    for(size_t p = ri0; p < ri1; p++)
+      {
+      size_t j = m_LColIndex[p];
+      double sum = m_Sign * xMatrix[m_LSource[p]];
+
+      // Dot product of row i and row j of L over columns less than j
+      size_t a = ri0, b = m_LRowIndex[j], b1 = m_LRowIndex[j+1] - 1;
+      while(a < p && b < b1)
+        {
+        if(m_LColIndex[a] == m_LColIndex[b])
+          sum -= m_LValues[a++] * m_LValues[b++];
+        else if(m_LColIndex[a] < m_LColIndex[b])
+          a++;
+        else
+          b++;
+        }
+
+      if(j < i)
+        m_LValues[p] = sum / m_LValues[b1];
+      else if(sum > 0.0)
+        m_LValues[p] = sqrt(sum);
+      else
+        return false;
+      }
+    }
+
+  return true;
+}
+
+void
+PCGSolverInterface
+::Multiply(const double *x, double *y) const
+{
+  for(size_t i = 0; i < n; i++)
+    {
+    double sum = 0.0;
+    for(size_t k = m_RowIndex[i]; k < m_RowIndex[i+1]; k++)
+      sum += xMatrix[k] * x[m_ColIndex[k]];
+    y[i] = m_Sign * sum;
+    }
+}
+
+void
+PCGSolverInterface
+::Precondition(const double *r, double *z) const
+{
+  if(m_UseCholesky)
+    {
+    // Forward substitution, L y = r
+    for(size_t i = 0; i < n; i++)
+      {
+      double sum = r[i];
+      size_t kd = m_LRowIndex[i+1] - 1;
+      for(size_t k = m_LRowIndex[i]; k < kd; k++)
+        sum -= m_LValues[k] * z[m_LColIndex[k]];
+      z[i] = sum / m_LValues[kd];
+      }
+
+    // Back substitution, L^T z = y, done column by column in place
+    for(size_t i = n; i-- > 0; )
+      {
+      size_t kd = m_LRowIndex[i+1] - 1;
+      z[i] /= m_LValues[kd];
+      for(size_t k = m_LRowIndex[i]; k < kd; k++)
+        z[m_LColIndex[k]] -= m_LValues[k] * z[i];
+      }
+    }
+  else
+    {
+    for(size_t i = 0; i < n; i++)
+      z[i] = m_InvDiag[i] * r[i];
+    }
+}
+
+void
+PCGSolverInterface
+::Solve(double *xRhs, double *xSoln)
+{
+  if(!xMatrix)
+    throw SparseSolverModelException("PCG solver called before NumericFactorization");
+
+  // Initial residual, with the right hand side sign-flipped along with the matrix
+  double b_norm = 0.0, r_norm = 0.0;
+  if(m_UseInitialGuess)
+    {
+    Multiply(xSoln, &m_Q[0]);
+    }
+  else
+    {
+    fill(xSoln, xSoln + n, 0.0);
+    fill(m_Q.begin(), m_Q.end(), 0.0);
+    }
+
+  for(size_t i = 0; i < n; i++)
+    {
+    double b = m_Sign * xRhs[i];
+    m_R[i] = b - m_Q[i];
+    b_norm += b * b;
+    r_norm += m_R[i] * m_R[i];
+    }
+  b_norm = sqrt(b_norm);
+  r_norm = sqrt(r_norm);
+
+  size_t it = 0;
+  double rz_old = 0.0;
+  for(; it < m_MaxIterations && r_norm > m_Tolerance * b_norm; it++)
+    {
+    Precondition(&m_R[0], &m_Z[0]);
+    double rz = 0.0;
+    for(size_t i = 0; i < n; i++)
+      rz += m_R[i] * m_Z[i];
+
+    double beta = (it == 0) ? 0.0 : rz / rz_old;
+    for(size_t i = 0; i < n; i++)
+      m_P[i] = m_Z[i] + beta * m_P[i];
+    rz_old = rz;
+
+    Multiply(&m_P[0], &m_Q[0]);
+    double pq = 0.0;
+    for(size_t i = 0; i < n; i++)
+      pq += m_P[i] * m_Q[i];
+    if(pq <= 0.0)
+      break;
+
+    double alpha = rz / pq;
+    r_norm = 0.0;
+    for(size_t i = 0; i < n; i++)
+      {
+      xSoln[i] += alpha * m_P[i];
+      m_R[i] -= alpha * m_Q[i];
+      r_norm += m_R[i] * m_R[i];
+      }
+    r_norm = sqrt(r_norm);
+    }
+
+  m_LastIterations = it;
+  m_LastResidual = b_norm > 0.0 ? r_norm / b_norm : 0.0;
+  if(flagVerbose)
+    printf("PCG: %d iterations, relative residual %g\n", (int) it, m_LastResidual);
+}
+
+void
+PCGSolverInterface
+::Solve(size_t nRHS, double *xRhs, double *xSoln)
+{
+  vector<double> soln;
+  for(size_t j = 0; j < nRHS; j++)
+    {
+    double *rhs = xRhs + j * n;
+    if(xSoln)
+      {
+      Solve(rhs, xSoln + j * n);
+      }
+    else
+      {
+      soln.assign(n, 0.0);
+      Solve(rhs, &soln[0]);
+      copy(soln.begin(), soln.end(), rhs);
+      }
+    }
+}
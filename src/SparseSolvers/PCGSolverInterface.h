@@ -0,0 +1,98 @@
+#ifndef __PCGSolverInterface_h_
+#define __PCGSolverInterface_h_
+
+#include <vector>
+#include "SparseSolver.h"
+#include "SparseMatrix.h"
+
+/**
+ * An iterative solver for symmetric definite systems, using the conjugate
+ * gradient method with a Jacobi or incomplete Cholesky (zero fill-in)
+ * preconditioner. Unlike the direct solvers, it needs no external library,
+ * and it can start from the solution passed in to Solve, which makes repeated
+ * solves of slowly changing systems cheap. The "factorization" calls only set
+ * up the preconditioner. Negative definite matrices are accepted and handled
+ * by flipping the sign of the system internally.
+ */
+class PCGSolverInterface : public SparseSolver
+{
+public:
+  enum PreconditionerType { JACOBI, INCOMPLETE_CHOLESKY };
+
+  // Store the structure of the matrix. THIS METHOD USED 1-BASED INDEXING!!!
+  void SymbolicFactorization(size_t n, int *idxRows, int *idxCols, double *xMatrix);
+
+  // Store the structure of the matrix
+  void SymbolicFactorization(const ImmutableSparseMatrix<double> &mat);
+
+  // Store the matrix values and compute the preconditioner
+  void NumericFactorization(const double *xMatrix);
+
+  // Numeric factorization using sparse matrix datatype
+  void NumericFactorization(const ImmutableSparseMatrix<double> &mat)
+    { NumericFactorization(mat.GetSparseData()); }
+
+  // Solve the system for the given right hand side, solution in xSoln
+  void Solve(double *xRhs, double *xSoln);
+
+  // Solve the system for a number of right hand sides, if the second vector
+  // is NULL, will solve in-place
+  void Solve(size_t nRHS, double *xRhs, double *xSoln);
+
+  // Relative residual tolerance and maximum number of iterations
+  void SetTolerance(double rel_tol, size_t max_iter)
+    { m_Tolerance = rel_tol; m_MaxIterations = max_iter; }
+
+  // Use the values in xSoln as the initial guess in Solve
+  void SetUseInitialGuess(bool flag)
+    { m_UseInitialGuess = flag; }
+
+  bool IsIterative() const
+    { return true; }
+
+  // Number of iterations and relative residual of the last solve
+  size_t GetLastIterations() const { return m_LastIterations; }
+  double GetLastResidual() const { return m_LastResidual; }
+
+  // Constructor, takes the preconditioner type
+  PCGSolverInterface(PreconditionerType type = INCOMPLETE_CHOLESKY);
+
+  virtual ~PCGSolverInterface() {}
+
+protected:
+
+  // y = A * x, with the sign flip applied
+  void Multiply(const double *x, double *y) const;
+
+  // z = M^-1 r
+  void Precondition(const double *r, double *z) const;
+
+  // Compute the incomplete Cholesky factor, returns false on breakdown
+  bool ComputeIncompleteCholesky();
+
+  PreconditionerType m_Type;
+
+  // Matrix in CSR format (0-based) and its values, which are not copied
+  size_t n;
+  std::vector<size_t> m_RowIndex, m_ColIndex;
+  const double *xMatrix;
+  double m_Sign;
+
+  // Inverse of the diagonal, for Jacobi
+  std::vector<double> m_InvDiag;
+
+  // Incomplete Cholesky factor L, lower triangular in CSR format with the
+  // columns sorted and the diagonal stored last in each row
+  std::vector<size_t> m_LRowIndex, m_LColIndex, m_LSource;
+  std::vector<double> m_LValues;
+  bool m_UseCholesky;
+
+  // Work vectors
+  std::vector<double> m_R, m_Z, m_P, m_Q;
+
+  double m_Tolerance, m_LastResidual;
+  size_t m_MaxIterations, m_LastIterations;
+  bool m_UseInitialGuess;
+};
+
+#endif //__PCGSolverInterface_h_
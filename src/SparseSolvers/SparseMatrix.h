@@ -13,6 +13,9 @@
 #include <list>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <functional>
 
 class AbstractImmutableSparseArray
 {
@@ -76,6 +79,50 @@ public:
     this->SetArrays(nr, nc, xRowIndex, xColIndex, data);
     }
 
+  // Parallel construction from a row generator, with no intermediate storage.
+  // The generator provides size_t RowSize(size_t row) and FillRow(size_t row,
+  // size_t *cols, TVal *vals), which must be safe to call from several threads.
+  // Row sizes are computed in parallel and prefix-summed into the row index,
+  // then the rows are filled in place in parallel. With nThreads = 0, the
+  // number of hardware threads is used
+  template <class TGenerator>
+  void SetFromGenerator(size_t rows, size_t cols, const TGenerator &gen, unsigned int nThreads = 0)
+    {
+    if(nThreads == 0)
+      nThreads = std::max(1u, std::thread::hardware_concurrency());
+    nThreads = (unsigned int) std::max((size_t) 1, std::min((size_t) nThreads, rows / 1024));
+
+    // Run a function over contiguous blocks of rows in parallel
+    auto parallel_rows = [rows, nThreads](const std::function<void(size_t, size_t)> &f)
+      {
+      std::vector<std::thread> workers;
+      for(unsigned int t = 0; t < nThreads; t++)
+        workers.push_back(std::thread(f, (rows * t) / nThreads, (rows * (t+1)) / nThreads));
+      for(auto &w : workers)
+        w.join();
+      };
+
+    size_t *rowIndex = new size_t[rows + 1];
+    rowIndex[0] = 0;
+    parallel_rows([&](size_t r0, size_t r1)
+      {
+      for(size_t i = r0; i < r1; i++)
+        rowIndex[i+1] = gen.RowSize(i);
+      });
+    for(size_t i = 0; i < rows; i++)
+      rowIndex[i+1] += rowIndex[i];
+
+    size_t *colIndex = new size_t[rowIndex[rows]];
+    TVal *data = new TVal[rowIndex[rows]];
+    parallel_rows([&](size_t r0, size_t r1)
+      {
+      for(size_t i = r0; i < r1; i++)
+        gen.FillRow(i, colIndex + rowIndex[i], data + rowIndex[i]);
+      });
+
+    this->SetArrays(rows, cols, rowIndex, colIndex, data);
+    }
+
   // Pointers to the data stored inside the matrix
   size_t *GetRowIndex() { return xRowIndex; }
   size_t *GetColIndex() { return xColIndex; }
@@ -1,13 +1,13 @@
 #include "SparseSolver.h"
 #include "SparseSolverException.h"
+#include "PCGSolverInterface.h"
 
 #ifdef HAVE_PARDISO
 
 #include "PardisoInterface.h"
 
-SparseSolver* 
-SparseSolver
-::MakeSolver(bool symmetric)
+static SparseSolver*
+MakeDirectSolver(bool symmetric)
 {
   if(symmetric)
     return new SymmetricPositiveDefiniteRealPARDISO();
@@ -19,9 +19,8 @@ SparseSolver
 
 #include "TaucsInterface.h"
 
-SparseSolver* 
-SparseSolver
-::MakeSolver(bool symmetric)
+static SparseSolver*
+MakeDirectSolver(bool symmetric)
 {
   return new TaucsSolverInterface(symmetric);
 }
@@ -30,9 +29,8 @@ SparseSolver
 
 #include "MKLSolverInterface.h"
 
-SparseSolver* 
-SparseSolver
-::MakeSolver(bool symmetric)
+static SparseSolver*
+MakeDirectSolver(bool symmetric)
 {
   return new MKLSolverInterface(symmetric ? 
     MKLSolverInterface::SPD : 
@@ -44,12 +42,36 @@ SparseSolver
 
 #else
 
-SparseSolver* 
-SparseSolver
-::MakeSolver(bool symmetric)
+static SparseSolver*
+MakeDirectSolver(bool symmetric)
 {
-  throw MedialModelException("The sparse solver has not been configured. Use PARDISO or TAUCS");
+  return NULL;
 }
 
 #endif
 
+SparseSolver*
+SparseSolver
+::MakeSolver(bool symmetric)
+{
+  return MakeSolver(symmetric, DEFAULT);
+}
+
+SparseSolver*
+SparseSolver
+::MakeSolver(bool symmetric, SolverType type)
+{
+  if(type == DEFAULT || type == DIRECT)
+    {
+    SparseSolver *solver = MakeDirectSolver(symmetric);
+    if(solver)
+      return solver;
+    if(type == DIRECT)
+      throw SparseSolverModelException(
+        "The direct sparse solver has not been configured. Use PARDISO, TAUCS or MKL");
+    }
+
+  return new PCGSolverInterface(type == PCG_JACOBI
+                                ? PCGSolverInterface::JACOBI
+                                : PCGSolverInterface::INCOMPLETE_CHOLESKY);
+}
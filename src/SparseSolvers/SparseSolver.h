@@ -33,9 +33,25 @@ public:
   virtual void SetVerbose(bool flag)
     { flagVerbose = flag; }
 
+  // Settings for iterative solvers, ignored by the direct solvers: the relative
+  // residual tolerance, the maximum number of iterations, and whether Solve
+  // starts from the values passed in xSoln rather than from zero
+  virtual void SetTolerance(double rel_tol, size_t max_iter) {}
+  virtual void SetUseInitialGuess(bool flag) {}
+  virtual bool IsIterative() const
+    { return false; }
+
+  // Kind of solver created by MakeSolver. DEFAULT is the direct solver that the
+  // library was configured with, or PCG_ICHOL if there is none. The PCG solvers
+  // require a symmetric definite matrix
+  enum SolverType { DEFAULT = 0, DIRECT, PCG_JACOBI, PCG_ICHOL };
+
   // Factory method to generate solver based on system settings
   static SparseSolver *MakeSolver(bool symmetric);
 
+  // Factory method to generate a solver of the given type
+  static SparseSolver *MakeSolver(bool symmetric, SolverType type);
+
 protected:
 
   bool flagVerbose;
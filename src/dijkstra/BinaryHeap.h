@@ -3,6 +3,8 @@
 
 #include <iostream>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 /**
  * This class defines the binary heap data structure. It is an array
@@ -271,4 +273,268 @@ private:
 
 };
 
+/**
+ * This is a d-ary alternative to the BinaryHeap above, with the same
+ * interface so that it can be plugged into DijkstraShortestPath. Each
+ * node has D children (4 by default), which makes the tree shallower and
+ * keeps the children of a node next to each other in memory. The weight
+ * of each element is also stored in the heap array alongside the element
+ * index, so that sifting compares contiguous values instead of looking
+ * every weight up in the external weight array. The external array is
+ * still kept up to date, as Dijkstra's algorithm reads distances from it.
+ */
+template<class TWeight, unsigned int D = 4>
+class DAryHeap {
+public:
+  DAryHeap(unsigned int nWeights, TWeight *inWeightArray)
+    {
+    m_WeightArray = inWeightArray;
+    m_ReserveSize = nWeights;
+    m_HeapIndex = new unsigned int[nWeights];
+    m_Heap = new Entry[nWeights];
+    m_HeapSize = 0;
+    }
+
+  ~DAryHeap()
+    {
+    delete[] m_Heap;
+    delete[] m_HeapIndex;
+    }
+
+  /** Reinitialize the heap to hold all elements with the same weight, O(n) */
+  void InsertAllElementsWithEqualWeights(TWeight weight)
+    {
+    m_HeapSize = m_ReserveSize;
+    for(unsigned int i = 0; i < m_ReserveSize; i++)
+      {
+      m_WeightArray[i] = weight;
+      Put(i, Entry(weight, i));
+      }
+    }
+
+  /** Insert an element with the weight currently in the weight array */
+  void InsertElement(unsigned int iElement)
+    { SiftUp(Entry(m_WeightArray[iElement], iElement), m_HeapSize++); }
+
+  /** Extract the smallest element from the heap, removing it */
+  unsigned int PopMinimum()
+    {
+    assert(m_HeapSize > 0);
+    unsigned int rtn = m_Heap[0].element;
+    m_HeapSize--;
+    if(m_HeapSize > 0)
+      SiftDown(m_Heap[m_HeapSize], 0);
+    m_HeapIndex[rtn] = m_ReserveSize;
+    return rtn;
+    }
+
+  /** Lower the weight of an element that is in the heap */
+  void DecreaseElementWeight(unsigned int iElement, TWeight xNewWeight)
+    {
+    assert(m_HeapIndex[iElement] < m_HeapSize
+      && xNewWeight <= m_WeightArray[iElement]);
+    m_WeightArray[iElement] = xNewWeight;
+    SiftUp(Entry(xNewWeight, iElement), m_HeapIndex[iElement]);
+    }
+
+  /** Increase the weight of an element that is in the heap */
+  void IncreaseElementWeight(unsigned int iElement, TWeight xNewWeight)
+    {
+    assert(m_HeapIndex[iElement] < m_HeapSize
+      && xNewWeight >= m_WeightArray[iElement]);
+    m_WeightArray[iElement] = xNewWeight;
+    SiftDown(Entry(xNewWeight, iElement), m_HeapIndex[iElement]);
+    }
+
+  /** Change the weight of an element in either direction */
+  void UpdateElementWeight(unsigned int iElement, TWeight weight)
+    {
+    if(weight < m_WeightArray[iElement])
+      DecreaseElementWeight(iElement, weight);
+    else
+      IncreaseElementWeight(iElement, weight);
+    }
+
+  /** Get the number of elements currently in the heap */
+  unsigned int GetSize()
+    { return m_HeapSize; }
+
+  /** Check if an element is in the heap or not, O(1) */
+  bool ContainsElement(unsigned int iPos)
+    { return m_HeapIndex[iPos] < m_HeapSize; }
+
+private:
+  struct Entry
+    {
+    TWeight weight;
+    unsigned int element;
+    Entry() {}
+    Entry(TWeight w, unsigned int e) : weight(w), element(e) {}
+    };
+
+  unsigned int m_ReserveSize, m_HeapSize;
+  TWeight *m_WeightArray;
+  unsigned int *m_HeapIndex;
+  Entry *m_Heap;
+
+  inline void Put(unsigned int iPos, const Entry &e)
+    {
+    m_Heap[iPos] = e;
+    m_HeapIndex[e.element] = iPos;
+    }
+
+  /** Move the hole at iPos up until the entry fits (iterative) */
+  void SiftUp(Entry e, unsigned int iPos)
+    {
+    while(iPos > 0)
+      {
+      unsigned int iParent = (iPos - 1) / D;
+      if(!(e.weight < m_Heap[iParent].weight))
+        break;
+      Put(iPos, m_Heap[iParent]);
+      iPos = iParent;
+      }
+    Put(iPos, e);
+    }
+
+  /** Move the hole at iPos down until the entry fits (iterative) */
+  void SiftDown(Entry e, unsigned int iPos)
+    {
+    while(true)
+      {
+      unsigned int iFirst = iPos * D + 1;
+      if(iFirst >= m_HeapSize)
+        break;
+
+      // Find the smallest of the (up to D) children
+      unsigned int iLast = std::min(iFirst + D, m_HeapSize);
+      unsigned int iBest = iFirst;
+      for(unsigned int c = iFirst + 1; c < iLast; c++)
+        if(m_Heap[c].weight < m_Heap[iBest].weight)
+          iBest = c;
+
+      if(!(m_Heap[iBest].weight < e.weight))
+        break;
+      Put(iPos, m_Heap[iBest]);
+      iPos = iBest;
+      }
+    Put(iPos, e);
+    }
+};
+
+/**
+ * This is a priority queue for Dijkstra's algorithm without decrease-key.
+ * Instead of moving an element within the heap when its weight is lowered,
+ * a new (weight, element) entry is pushed and the old one is left in place;
+ * stale entries are discarded when they reach the top. The interface is the
+ * same as that of BinaryHeap, so it can be plugged into DijkstraShortestPath.
+ *
+ * Elements whose weight is never lowered from the initial value (usually
+ * infinity) are never pushed at all; once the entries run out, they are
+ * handed out in index order, which is what BinaryHeap does for a set of
+ * equal weights as well, since their relative order carries no meaning.
+ */
+template<class TWeight>
+class LazyDeletionHeap {
+public:
+  LazyDeletionHeap(unsigned int nWeights, TWeight *inWeightArray)
+    {
+    m_WeightArray = inWeightArray;
+    m_ReserveSize = nWeights;
+    m_InHeap.assign(nWeights, 0);
+    m_HeapSize = 0;
+    m_NextUnreached = 0;
+    }
+
+  /** Reinitialize the heap to hold all elements with the same weight, O(n) */
+  void InsertAllElementsWithEqualWeights(TWeight weight)
+    {
+    m_Entries.clear();
+    for(unsigned int i = 0; i < m_ReserveSize; i++)
+      m_WeightArray[i] = weight;
+    m_InHeap.assign(m_ReserveSize, 1);
+    m_HeapSize = m_ReserveSize;
+    m_NextUnreached = 0;
+    }
+
+  /** Insert an element with the weight currently in the weight array */
+  void InsertElement(unsigned int iElement)
+    {
+    m_InHeap[iElement] = 1;
+    m_HeapSize++;
+    Push(iElement, m_WeightArray[iElement]);
+    }
+
+  /** Extract the smallest element from the heap, removing it */
+  unsigned int PopMinimum()
+    {
+    assert(m_HeapSize > 0);
+    unsigned int rtn = m_ReserveSize;
+
+    // Discard entries for elements that were popped already, or whose
+    // weight has been lowered since the entry was pushed
+    while(m_Entries.size())
+      {
+      Entry top = m_Entries.front();
+      std::pop_heap(m_Entries.begin(), m_Entries.end());
+      m_Entries.pop_back();
+      if(m_InHeap[top.element] && top.weight == m_WeightArray[top.element])
+        { rtn = top.element; break; }
+      }
+
+    // The remaining elements were never pushed, pop them in order
+    if(rtn == m_ReserveSize)
+      {
+      while(!m_InHeap[m_NextUnreached])
+        m_NextUnreached++;
+      rtn = m_NextUnreached;
+      }
+
+    m_InHeap[rtn] = 0;
+    m_HeapSize--;
+    return rtn;
+    }
+
+  /** Lower the weight of an element that is in the heap, amortized O(log n) */
+  void DecreaseElementWeight(unsigned int iElement, TWeight xNewWeight)
+    {
+    assert(m_InHeap[iElement] && xNewWeight <= m_WeightArray[iElement]);
+    m_WeightArray[iElement] = xNewWeight;
+    Push(iElement, xNewWeight);
+    }
+
+  /** Get the number of elements currently in the heap */
+  unsigned int GetSize()
+    { return m_HeapSize; }
+
+  /** Check if an element is in the heap or not, O(1) */
+  bool ContainsElement(unsigned int iPos)
+    { return m_InHeap[iPos] != 0; }
+
+private:
+  struct Entry
+    {
+    TWeight weight;
+    unsigned int element;
+
+    // Reversed so that std heap functions give a min-heap
+    bool operator < (const Entry &other) const
+      { return other.weight < weight; }
+    };
+
+  unsigned int m_ReserveSize, m_HeapSize, m_NextUnreached;
+  TWeight *m_WeightArray;
+  std::vector<char> m_InHeap;
+  std::vector<Entry> m_Entries;
+
+  void Push(unsigned int iElement, TWeight weight)
+    {
+    Entry e;
+    e.weight = weight;
+    e.element = iElement;
+    m_Entries.push_back(e);
+    std::push_heap(m_Entries.begin(), m_Entries.end());
+    }
+};
+
 #endif
@@ -29,12 +29,3 @@ void TestShortestPath()
     std::cout << "0" << std::endl;
     }
 }
-
-/* 
-int main(int argc, char *argv[])
-{
-  TestShortestPath();
-}
-*/ 
-
-
@@ -3,6 +3,10 @@
 
 #include "BinaryHeap.h"
 #include <limits>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 
 /**
  * This class implements the classic shortest path algorithm by the
@@ -23,11 +27,17 @@
  *
  * To determine the vertices adjacent to vertex i, one looks at the values
  * A[AI[i]], ... ,A[AI[i+1] - 1]. 
+ *
+ * The priority queue is a template parameter. Besides BinaryHeap, one can
+ * use DAryHeap (shallower, more cache-friendly) or LazyDeletionHeap (no
+ * decrease-key, stale entries skipped on pop); see BinaryHeap.h.
  */
-template <class TWeight>
+template <class TWeight, class THeap = BinaryHeap<TWeight> >
 class DijkstraShortestPath 
 {
 public:
+  typedef THeap HeapType;
+
   /** Constant representing infinite distance to soruce vertex, ie, no
    * path to source */
   static const TWeight INFINITE_WEIGHT;
@@ -57,15 +67,15 @@ public:
     m_Predecessor = new unsigned int[nVertices];
 
     // Create the Binary heap (priority que)
-    m_Heap = new BinaryHeap<TWeight>(m_NumberOfVertices, m_Distance);
+    m_Heap = new THeap(m_NumberOfVertices, m_Distance);
     }
 
   /** Destructor, cleans up pointers */
   virtual ~DijkstraShortestPath()
     {
     delete m_Heap;
-    delete m_Distance;
-    delete m_Predecessor;
+    delete[] m_Distance;
+    delete[] m_Predecessor;
     }
 
   /** 
@@ -150,7 +160,7 @@ public:
     { return m_Distance; }
 
 protected:
-  BinaryHeap<TWeight> *m_Heap;
+  THeap *m_Heap;
   TWeight *m_Distance;
   TWeight *m_EdgeWeight;
   unsigned int *m_Predecessor;
@@ -174,7 +184,7 @@ public:
     }
 
   virtual ~GraphVoronoiDiagram()
-    { delete m_Source; }
+    { delete[] m_Source; }
 
   /** Compute paths from multiple sources. Use this method to construct a
    * sort of a Voronoi diagram of the graph */ 
@@ -253,14 +263,114 @@ private:
   unsigned int *m_Source;
 };
 
-template<class TWeight>
+/**
+ * This class computes the shortest paths from a list of source vertices
+ * at once, splitting the sources between several threads. Each thread
+ * owns its own DijkstraShortestPath object (and thus its own heap and
+ * distance array), while the graph arrays are shared read-only. The
+ * distances from the k-th source are stored in row k of a matrix of
+ * size nSources x nVertices, and the sum of each row is stored as well,
+ * which is what one needs to find the center of the graph.
+ */
+template <class TWeight, class THeap = BinaryHeap<TWeight> >
+class DijkstraMultiSourceDistances
+{
+public:
+  typedef DijkstraShortestPath<TWeight, THeap> PathType;
+
+  DijkstraMultiSourceDistances(
+    unsigned int nVertices, unsigned int *xAdjacencyIndex,
+    unsigned int *xAdjacency, TWeight *xEdgeLen)
+    : m_NumberOfVertices(nVertices), m_AdjacencyIndex(xAdjacencyIndex),
+      m_Adjacency(xAdjacency), m_EdgeWeight(xEdgeLen) {}
+
+  /**
+   * Compute the distances from each of the sources to all vertices using
+   * nThreads threads (zero means use all available cores). The distances
+   * are summed as doubles, so that INFINITE_WEIGHT for disconnected vertices
+   * does not wrap around for integer weight types.
+   */
+  void ComputePathsFromSources(unsigned int nSources, const unsigned int *lSources,
+                               unsigned int nThreads = 0)
+    {
+    m_Sources.assign(lSources, lSources + nSources);
+    m_Distance.assign((size_t) nSources * m_NumberOfVertices, PathType::INFINITE_WEIGHT);
+    m_TotalDistance.assign(nSources, 0.0);
+
+    if(nThreads == 0)
+      nThreads = std::max(1u, std::thread::hardware_concurrency());
+    nThreads = std::max(1u, std::min(nThreads, nSources));
+
+    std::atomic<unsigned int> next(0);
+    auto worker = [&]()
+      {
+      PathType dijkstra(m_NumberOfVertices, m_AdjacencyIndex, m_Adjacency, m_EdgeWeight);
+      for(unsigned int k = next++; k < nSources; k = next++)
+        {
+        dijkstra.ComputePathsFromSource(m_Sources[k]);
+        const TWeight *dist = dijkstra.GetDistanceArray();
+        TWeight *row = &m_Distance[(size_t) k * m_NumberOfVertices];
+        double total = 0.0;
+        for(unsigned int j = 0; j < m_NumberOfVertices; j++)
+          {
+          row[j] = dist[j];
+          total += (double) dist[j];
+          }
+        m_TotalDistance[k] = total;
+        }
+      };
+
+    if(nThreads == 1)
+      {
+      worker();
+      }
+    else
+      {
+      std::vector<std::thread> pool;
+      for(unsigned int t = 0; t < nThreads; t++)
+        pool.push_back(std::thread(worker));
+      for(unsigned int t = 0; t < nThreads; t++)
+        pool[t].join();
+      }
+    }
+
+  /** Get the distances from the k-th source (not the k-th vertex!) */
+  const TWeight *GetDistanceArray(unsigned int k) const
+    { return &m_Distance[(size_t) k * m_NumberOfVertices]; }
+
+  /** Get the sum of distances from the k-th source to all vertices */
+  double GetTotalDistance(unsigned int k) const
+    { return m_TotalDistance[k]; }
+
+  /** Get the index (into the source list) of the source with the smallest
+   * total distance, i.e., the center of the graph among the sources. Ties
+   * are resolved in favor of the earlier source */
+  unsigned int GetCentralSource() const
+    {
+    unsigned int k_best = 0;
+    for(unsigned int k = 1; k < m_TotalDistance.size(); k++)
+      if(m_TotalDistance[k] < m_TotalDistance[k_best])
+        k_best = k;
+    return k_best;
+    }
+
+protected:
+  unsigned int m_NumberOfVertices;
+  unsigned int *m_AdjacencyIndex, *m_Adjacency;
+  TWeight *m_EdgeWeight;
+  std::vector<unsigned int> m_Sources;
+  std::vector<TWeight> m_Distance;
+  std::vector<double> m_TotalDistance;
+};
+
+template<class TWeight, class THeap>
 const TWeight
-DijkstraShortestPath<TWeight>
+DijkstraShortestPath<TWeight, THeap>
 ::INFINITE_WEIGHT = std::numeric_limits<TWeight>::max();
 
-template<class TWeight>
+template<class TWeight, class THeap>
 const unsigned int
-DijkstraShortestPath<TWeight>
+DijkstraShortestPath<TWeight, THeap>
 ::NO_PATH = std::numeric_limits<unsigned int>::max();
 
 #endif
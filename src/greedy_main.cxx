@@ -35,11 +35,17 @@
 #include <string>
 #include <algorithm>
 #include <cerrno>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "lddmm_common.h"
 #include "lddmm_data.h"
+#include "ParallelFor.h"
 
 #include <itkImageFileReader.h>
+#include <itkImageIOFactory.h>
 #include <itkAffineTransform.h>
 #include <itkTransformFactory.h>
 #include <itkTimeProbe.h>
@@ -82,11 +88,19 @@ int usage()
   printf("                               MI:           mutual information\n");
   printf("                               NMI:          normalized mutual information\n");
   printf("                               NCC <radius>: normalized cross-correlation\n");
+  printf("                               NCC_APPROX <radius>: approximate NCC as in ANTS, faster for large\n");
+  printf("                                            radii (deformable only, affine uses exact NCC)\n");
   printf("                               MAHAL:        Mahalanobis distance to target warp\n");
   printf("  -e epsilon             : step size (default = 1.0), \n");
   printf("                               may also be specified per level (e.g. 0.3x0.1)\n");
   printf("  -n NxNxN               : number of iterations per level of multi-res (100x100) \n");
+  printf("  -conv-tol VALUE        : end a level early when the metric changed by less than this fraction\n");
+  printf("                           over the last -conv-window iterations (def = 0, disabled)\n");
+  printf("  -conv-update VALUE     : ... and the largest smoothed update is below this length in voxels\n");
+  printf("                           (def = 0, disabled). Both may be specified per level (e.g. 1e-4x1e-3)\n");
+  printf("  -conv-window N         : number of iterations over which the metric change is measured (def = 10)\n");
   printf("  -threads N             : set the number of allowed concurrent threads\n");
+  printf("  -pin-threads           : pin the worker threads to cores (Linux), for NUMA systems\n");
   printf("  -gm mask.nii           : mask for gradient computation\n");
   printf("  -gm-trim <radius>      : generate mask for gradient computation by trimming the extent\n");
   printf("                           of the fixed image by given radius. This is useful during affine\n");
@@ -94,18 +108,47 @@ int usage()
   printf("                           is non-zero. The radius should match that of the NCC metric.");
   printf("  -fm mask.nii           : metric calculation exclusion mask for the fixed image\n");
   printf("  -mm mask.nii           : metric calculation exclusion mask for the moving image\n");
+  printf("  -crop-mask [N]         : crop the reference space to the bounding box of the gradient mask (or the\n");
+  printf("                           fixed mask), padded by N voxels (default N=8). Output warps are placed back\n");
+  printf("                           into the full space, with zero displacement outside of the box. In\n");
+  printf("                           deformable mode, not allowed with -id, or with -ia unless -ia-residual\n");
   printf("  -it filenames          : sequence of transforms to apply to the moving image first \n");
   printf("Specific to deformable mode: \n");
   printf("  -tscale MODE           : time step behavior mode: CONST, SCALE [def], SCALEDOWN\n");
   printf("  -s sigma1 sigma2       : smoothing for the greedy update step. Must specify units,\n");
   printf("                           either `vox` or `mm`. Default: 1.732vox, 0.7071vox\n");
+  printf("  -smooth-method MODE    : filter used for the smoothing in -s: ITK [def], RECURSIVE (fast\n");
+  printf("                           recursive Gaussian, sigma of at least 0.5vox, smaller sigmas are raised)\n");
+  printf("                           or BOX [N] (cascade of N extended box filters,\n");
+  printf("                           more passes is more accurate, def N=3), FFT (same Gaussians applied\n");
+  printf("                           in the Fourier domain, cost independent of sigma, periodic boundary)\n");
+  printf("                           or NAVIER [alpha] (FFT, the gradient is regularized with the Green's\n");
+  printf("                           function of the Navier-Stokes operator instead of sigma1, def alpha=1)\n");
+  printf("                           FFT and NAVIER require greedy to be built with FFTW\n");
   printf("  -oinv image.nii        : compute and write the inverse of the warp field into image.nii\n");
+  printf("  -oinv-inc              : update the inverse warp during the iterations instead of inverting\n");
+  printf("                           the final warp (faster, approximate; greedy mode only)\n");
   printf("  -oroot image.nii       : compute and write the (2^N-th) root of the warp field into image.nii, where\n");
   printf("                           N is the value of the -exp option. In stational velocity mode, it is advised\n");
   printf("                           to output the root warp, since it is used internally to represent the deformation\n");
   printf("  -wp VALUE              : Saved warp precision (in voxels; def=0.1; 0 for no compression).\n");
+  printf("  -wq 8|16               : Bits per component for warps saved with the .qwarp extension (def=16)\n");
+  printf("  -wq-shrink N           : Store .qwarp warps on a grid N times coarser, upsampled with cubic\n");
+  printf("                           B-splines when read (def=1)\n");
   printf("  -noise VALUE           : Standard deviation of white noise added to moving/fixed images when \n");
   printf("                           using NCC metric. Relative to intensity range. Def=0.001\n");
+  printf("  -ncc-precompute-fixed  : With NCC metric, compute the neighborhood sums of the fixed image once\n");
+  printf("                           per level instead of at every iteration. Near voxels where the moving\n");
+  printf("                           image is outside, masked or NaN, the sums are corrected voxel by voxel\n");
+  printf("  -ncc-compensated       : With NCC metric and -float, use compensated (Kahan) running sums for\n");
+  printf("                           the neighborhood sums. Gives close to double accuracy with float storage\n");
+  printf("  -mi-parzen             : With MI/NMI metrics, estimate the joint histogram with a cubic B-spline\n");
+  printf("                           Parzen window on the moving image instead of partial volume interpolation\n");
+  printf("  -half-storage fp16|bf16: With SSD metric in deformable mode, store the images read by the metric\n");
+  printf("                           in 16 bits. fp16 keeps 11 bits of precision but overflows above 65504,\n");
+  printf("                           bf16 keeps the range of float with 8 bits of precision. This reduces\n");
+  printf("                           memory traffic, not memory use: the 16-bit copies of the current level\n");
+  printf("                           are kept in addition to the float images\n");
   printf("  -exp N                 : The exponent used for warp inversion, root computation, and in stationary \n");
   printf("                           velocity field (Diff Demons) mode. N is a positive integer (default = 6) \n");
   printf("  -sv                    : Performs registration using the stationary velocity model, similar to diffeomoprhic \n");
@@ -117,24 +160,61 @@ int usage()
   printf("  -svlb                  : Same as -sv but uses the more accurate but also more expensive \n");
   printf("                           update of v, v <- v + u + [v,u]. Experimental feature \n");
   printf("  -sv-incompr            : Incompressibility mode, implements Mansi et al. 2011 iLogDemons\n");
+  printf("  -sv-incompr-solver MODE: Solver for the PDE in -sv-incompr mode: MG (matrix-free multigrid, def),\n");
+  printf("                           DIRECT (sparse factorization) or PCG (sparse conjugate gradients,\n");
+  printf("                           warm-started). DIRECT and PCG require greedy built with sparse solvers\n");
+  printf("  -sv-incr N             : In -sv mode, update exp(v) incrementally from the previous iteration\n");
+  printf("                           by composition, and only recompute it in full every N iterations \n");
+  printf("                           (default = 0, always recompute) \n");
+  printf("  -mask-domain [N]       : Only iterate over the bounding box of the gradient mask (-gm or -gm-trim),\n");
+  printf("                           padded by the smoothing and metric support plus N voxels (default N=0).\n");
+  printf("                           The deformation outside of the box is not updated\n");
   printf("  -id image.nii          : Specifies the initial warp to start iteration from. In stationary mode, this \n");
   printf("                           is the initial stationary velocity field (output by -oroot option)\n");
+  printf("  -id-skip tol           : skip the coarse levels at which the initial warp is already converged,\n");
+  printf("                           i.e., the largest update is below tol voxels (def: 0, disabled)\n");
   printf("Initial transform specification: \n");
   printf("  -ia filename           : initial affine matrix for optimization (not the same as -it) \n");
   printf("  -ia-identity           : initialize affine matrix based on NIFTI headers \n");
   printf("  -ia-image-centers      : initialize affine matrix based on matching image centers \n");
   printf("  -ia-image-side CODE    : initialize affine matrix based on matching center of one image side \n");
   printf("  -ia-moments <1|2>      : initialize affine matrix based on matching moments of inertia\n");
+  printf("  -ia-residual           : in deformable mode, compose the initial affine (-ia, -ia-identity) with the\n");
+  printf("                           warp inside the metric instead of adding it to the warp. The output warp (-o)\n");
+  printf("                           is then the residual, to be applied as '-r warp.nii.gz affine.mat'\n");
   printf("Specific to affine mode (-a):\n");
   printf("  -dof N                 : Degrees of freedom for affine reg. 6=rigid, 12=affine\n");
   printf("  -jitter sigma          : Jitter (in voxel units) applied to sample points (def: 0.5)\n");
+  printf("  -affine-sample f [mode]: Compute the affine metric on a fixed sample of a fraction f of the voxels\n");
+  printf("                           in the gradient mask. Mode is 'random' (default) or 'stratified' \n");
+  printf("                           With NCC, the neighborhoods of the sampled voxels are still interpolated\n");
   printf("  -search N <rot> <tran> : Random search over rigid transforms (N iter) before starting optimization\n");
   printf("                           'rot' may be the standard deviation of the random rotation angle (degrees) or \n");
   printf("                           keyword 'any' (any rotation) or 'flip' (any rotation or flip). \n");
   printf("                           'tran' is the standard deviation of the random offset, in physical units. \n");
+  printf("  -search-threads N      : Number of search candidates evaluated in parallel (def: number of threads)\n");
+  printf("  -gn                    : Use Gauss-Newton optimization with Levenberg-Marquardt damping instead of\n");
+  printf("                           LBFGS. Only for -m SSD and -dof 12. Typically converges in a few iterations\n");
   printf("Specific to moments of inertia mode (-moments 2): \n");
   printf("  -det <-1|1>            : Force the determinant of transform to be either 1 (no flip) or -1 (flip)\n");
   printf("  -cov-id                : Assume identity covariance (match centers and do flips only, no rotation)\n");
+  printf("Specific to brute force mode (-brute): \n");
+  printf("  -brute-levels N        : Coarse-to-fine search over N pyramid levels (def: 1). The full radius is\n");
+  printf("                           searched at the coarsest level, finer levels search locally around the\n");
+  printf("                           upsampled best displacement\n");
+  printf("  -brute-refine R        : Local search radius at the finer levels, in voxels (def: 1)\n");
+  printf("  -brute-subvox          : Refine the best displacement to sub-voxel precision by fitting a parabola\n");
+  printf("                           to the metric along each axis\n");
+  printf("  -brute-metric img.nii  : Save the best metric value at each voxel to img.nii\n");
+  printf("Specific to warp inversion mode (-iw): \n");
+  printf("  -iw-tol VALUE          : Tolerance (in voxels) of the per-voxel fixed-point iteration used to\n");
+  printf("                           invert the small warp (def: 1e-4)\n");
+  printf("  -iw-iter N             : Maximum number of fixed-point iterations per voxel (def: 20)\n");
+  printf("Specific to Jacobian mode (-jac): \n");
+  printf("  -jac-direct            : Compute the determinant from finite differences of the warp in a single\n");
+  printf("                           pass, without taking the root of the warp (uses much less memory), and\n");
+  printf("                           report its min, percentiles and number of folding voxels\n");
+  printf("  -jac-stats file.txt    : Same as -jac-direct, and also write the statistics to file.txt\n");
   printf("Specific to reslice mode (-r): \n");
   printf("  -rf fixed.nii          : fixed image for reslicing\n");
   printf("  -rm mov.nii out.nii    : moving/output image pair (may be repeated)\n");
@@ -143,6 +223,11 @@ int usage()
   printf("  -rb value              : background (i.e. outside) intensity for the next pair (default 0)\n");
   printf("  -rc outwarp            : write composed transforms to outwarp \n");
   printf("  -rj outjacobian        : write Jacobian determinant image to outjacobian \n");
+  printf("  -rt N                  : reslice images in slabs of N slices along the last axis, reading\n");
+  printf("                           and writing one slab at a time (for images larger than memory)\n");
+  printf("  -rlb N                 : number of labels smoothed and warped together with -ri LABEL (def: 16)\n");
+  printf("  -rbrick                : store moving images and warps in 8x8x8 bricks when reslicing through\n");
+  printf("                           a warp. Faster for large deformations, uses 1.4x the memory\n");
   printf("For developers: \n");
   printf("  -debug-deriv           : enable periodic checks of derivatives (debug) \n");
   printf("  -debug-deriv-eps       : epsilon for derivative debugging \n");
@@ -150,7 +235,35 @@ int usage()
   printf("  -dump-moving           : dump moving image at each iter\n");
   printf("  -dump-freq N           : dump frequency\n");
   printf("  -powell                : use Powell's method instead of LGBFS\n");
+  printf("  -profile file.json     : write per-level timing and memory profile of deformable registration\n");
+  printf("  -image-cache DIR       : keep decompressed copies of input images in DIR and memory-map them\n");
+  printf("                           on later reads, sharing pages between greedy processes\n");
+  printf("  -checkpoint file       : save the state of deformable registration to file, and resume from it\n");
+  printf("                           if it exists and was written with the same parameters. With -batch,\n");
+  printf("                           each job uses file.jobNNNN, numbered in manifest order\n");
+  printf("  -checkpoint-interval N : iterations between checkpoints (def = 10)\n");
+  printf("  -pgz LEVEL             : compress .nii.gz outputs with multiple threads at gzip level 1-9.\n");
+  printf("                           Files remain gzip-compatible and are decompressed in parallel\n");
   printf("  -float                 : use single precision floating point (off by default)\n");
+  printf("  -gpu                   : run the deformable iterations on a CUDA device (implies -float). Requires\n");
+  printf("                           greedy built with GREEDY_USE_CUDA. Supports the SSD and NCC metrics with\n");
+  printf("                           Gaussian smoothing; levels using other options run on the CPU\n");
+  printf("Memory planning: \n");
+  printf("  -dry-run               : estimate the peak memory of the registration from the image headers,\n");
+  printf("                           report it with the largest buffers of each stage, and exit\n");
+  printf("  -mem-budget MB         : fit the registration into this many megabytes, turning on the options\n");
+  printf("                           below and then -float until the estimate fits (def: 0, no budget)\n");
+  printf("  -release-inputs        : free the input images once the image pyramids are built\n");
+  printf("  -release-levels        : free the images of each level of deformable registration when done\n");
+  printf("Batch mode (-a, -moments or deformable): \n");
+  printf("  -batch manifest.txt    : run many registrations in one process. Each line of the manifest is\n");
+  printf("                           'moving output' (fixed image taken from -i) or 'fixed moving output'.\n");
+  printf("                           Jobs sharing a fixed image reuse its pyramid and masks\n");
+  printf("  -batch-jobs N          : number of registrations run at a time; the threads (-threads) are\n");
+  printf("                           divided between them (def: 0, about four threads per registration)\n");
+  printf("  -timeseries manifest   : register the frames of a time series to the fixed image given by -i.\n");
+  printf("                           Each line of the manifest is 'moving output', in time order. Each\n");
+  printf("                           frame starts from the warp of the previous frame (see -id-skip)\n");
   printf("  -version               : print version info\n");
   printf("  -V <level>             : set verbosity level (0: none, 1: default, 2: verbose)\n");
 
@@ -159,16 +272,345 @@ int usage()
 
 
 
+/**
+ * A single registration listed in the batch manifest
+ */
+struct GreedyBatchJob
+{
+  std::string fixed, moving, output;
+};
+
+/**
+ * Read the batch manifest. Each non-empty line holds either 'moving output',
+ * in which case the fixed image is taken from the -i option, or 'fixed moving
+ * output'. Text following a '#' is ignored. The jobs are ordered by fixed image
+ * so that consecutive jobs taken by a worker can share the fixed side.
+ */
+void ReadBatchManifest(const GreedyParameters &param, std::vector<GreedyBatchJob> &jobs)
+{
+  std::ifstream fin(param.batch_manifest.c_str());
+  if(!fin.good())
+    throw GreedyException("Unable to read batch manifest %s", param.batch_manifest.c_str());
+
+  std::string line;
+  for(int line_no = 1; std::getline(fin, line); line_no++)
+    {
+    size_t pos_comment = line.find('#');
+    if(pos_comment != std::string::npos)
+      line = line.substr(0, pos_comment);
+
+    std::istringstream iss(line);
+    std::vector<std::string> tokens;
+    std::string tok;
+    while(iss >> tok)
+      tokens.push_back(tok);
+
+    GreedyBatchJob job;
+    if(tokens.size() == 0)
+      continue;
+    else if(tokens.size() == 2)
+      {
+      if(param.inputs.size() == 0)
+        throw GreedyException("Line %d of batch manifest has no fixed image and no -i option was given",
+                              line_no);
+      job.fixed = param.inputs[0].fixed;
+      job.moving = tokens[0];
+      job.output = tokens[1];
+      }
+    else if(tokens.size() == 3)
+      {
+      job.fixed = tokens[0];
+      job.moving = tokens[1];
+      job.output = tokens[2];
+      }
+    else
+      throw GreedyException("Line %d of batch manifest must have two or three entries", line_no);
+
+    jobs.push_back(job);
+    }
+
+  std::stable_sort(jobs.begin(), jobs.end(),
+                   [](const GreedyBatchJob &a, const GreedyBatchJob &b) { return a.fixed < b.fixed; });
+}
+
 template <unsigned int VDim, typename TReal>
 class GreedyRunner
 {
 public:
+  typedef GreedyApproach<VDim, TReal> GreedyAPI;
+
   static int Run(GreedyParameters &param)
   {
+    // Plan the memory before anything is read. The plan may switch to single precision
+    if(param.flag_dry_run || param.memory_budget > 0)
+      {
+      if(PlanMemory(param))
+        return GreedyRunner<VDim, float>::Run(param);
+      if(param.flag_dry_run)
+        return 0;
+      }
+
+    if(param.timeseries_manifest.size())
+      return RunTimeSeries(param);
+
+    if(param.batch_manifest.size())
+      return RunBatch(param);
+
     // Use the threads parameter
-    GreedyApproach<VDim, TReal> greedy;   
+    GreedyAPI greedy;
     return greedy.Run(param);
   }
+
+  /**
+   * Estimate the memory of the registration and report it. With a memory budget,
+   * the options that lower the memory are turned on in order until the estimate
+   * fits: releasing the inputs and the finished levels, which do not change the
+   * result, and then single precision math. Returns true if the registration has
+   * to be run in single precision. In batch and time series modes, the estimate is
+   * for a single registration of the -i image pair
+   */
+  static bool PlanMemory(GreedyParameters &param)
+  {
+    GreedyAPI greedy;
+    GreedyMemoryEstimate est;
+    greedy.EstimateMemory(param, est);
+
+    double budget = param.memory_budget * 1024.0 * 1024.0;
+    if(budget > 0 && est.GetPeakBytes() > budget && !param.flag_release_inputs)
+      {
+      printf("Memory plan: releasing the input images after the pyramids are built\n");
+      param.flag_release_inputs = true;
+      greedy.EstimateMemory(param, est);
+      }
+
+    if(budget > 0 && est.GetPeakBytes() > budget && !param.flag_release_levels
+       && param.mode == GreedyParameters::GREEDY)
+      {
+      printf("Memory plan: releasing the images of each level when it is done\n");
+      param.flag_release_levels = true;
+      greedy.EstimateMemory(param, est);
+      }
+
+    if(budget > 0 && est.GetPeakBytes() > budget && !param.flag_float_math)
+      {
+      printf("Memory plan: switching to single precision math\n");
+      param.flag_float_math = true;
+      return true;
+      }
+
+    printf("%s", est.GetReport().c_str());
+    if(budget > 0 && est.GetPeakBytes() > budget)
+      printf("WARNING: the estimated peak memory exceeds the budget of %.1f MB\n", param.memory_budget);
+
+    return false;
+  }
+
+  /**
+   * Run all of the registrations in the batch manifest. A pool of workers takes
+   * jobs in turn, each worker keeping a registration session so that the fixed
+   * image is only read and preprocessed once for the jobs it shares.
+   */
+  static int RunBatch(GreedyParameters &param)
+  {
+    if(param.mode != GreedyParameters::GREEDY && param.mode != GreedyParameters::AFFINE
+       && param.mode != GreedyParameters::MOMENTS)
+      throw GreedyException("Batch mode is only supported for affine, moments and deformable registration");
+
+    if(param.inputs.size() > 1)
+      throw GreedyException("Batch mode supports a single -i image pair");
+
+    if(param.inverse_warp.size() || param.root_warp.size())
+      throw GreedyException("The -oinv and -oroot options can not be used in batch mode");
+
+    std::vector<GreedyBatchJob> jobs;
+    ReadBatchManifest(param, jobs);
+    if(jobs.size() == 0)
+      throw GreedyException("Batch manifest %s lists no registrations", param.batch_manifest.c_str());
+
+    // Split the threads between the concurrent registrations. Registrations of
+    // typical image sizes scale poorly past a few threads, so by default each one
+    // gets about four
+    GreedyAPI::ConfigThreads(param);
+    int n_threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    int n_workers = param.batch_jobs > 0 ? param.batch_jobs : std::max(1, (n_threads + 3) / 4);
+    n_workers = std::min(n_workers, (int) jobs.size());
+    int quota = std::max(1, n_threads / n_workers);
+
+    printf("Running %d registrations, %d at a time with %d threads each\n",
+           (int) jobs.size(), n_workers, quota);
+
+    // Make sure the image IO factories are registered before the workers start
+    itk::ImageIOFactory::CreateImageIO(jobs[0].fixed.c_str(), itk::ImageIOFactory::ReadMode);
+
+    std::atomic<unsigned int> next_job(0);
+    std::atomic<unsigned int> n_failed(0);
+    std::mutex out_mutex;
+
+    // Each worker limits the filters and loops of its registrations to its quota
+    // of threads, the ITK global default is left alone
+    auto worker = [&]()
+      {
+      ParallelFor::ThreadQuota thread_quota(quota);
+      GreedyAPI greedy;
+      greedy.BeginSession();
+
+      for(unsigned int i = next_job++; i < jobs.size(); i = next_job++)
+        {
+        const GreedyBatchJob &job = jobs[i];
+
+        // The threads are already configured, and concurrent jobs run quietly
+        GreedyParameters job_param = param;
+        job_param.batch_manifest.clear();
+        job_param.threads = 0;
+        if(n_workers > 1 && param.verbosity < GreedyParameters::VERB_VERBOSE)
+          job_param.verbosity = GreedyParameters::VERB_NONE;
+
+        ImagePairSpec pair = param.inputs.size() ? param.inputs[0] : ImagePairSpec();
+        pair.fixed = job.fixed;
+        pair.moving = job.moving;
+        job_param.inputs.assign(1, pair);
+        job_param.output = job.output;
+
+        // Each job keeps its own checkpoint, named by its position in the manifest
+        // so that a rerun of the same manifest resumes every job from its own
+        if(param.checkpoint_file.size())
+          {
+          char suffix[32];
+          sprintf(suffix, ".job%04d", i + 1);
+          job_param.checkpoint_file = param.checkpoint_file + suffix;
+          }
+
+        itk::TimeProbe tp;
+        tp.Start();
+        std::string error;
+        try
+          {
+          if(greedy.Run(job_param) != 0)
+            error = "registration returned an error code";
+          }
+        catch(std::exception &exc)
+          {
+          error = exc.what();
+          }
+        tp.Stop();
+
+        std::lock_guard<std::mutex> lock(out_mutex);
+        if(error.size())
+          {
+          n_failed++;
+          std::cerr << "Batch job " << i + 1 << " (" << job.moving << ") FAILED: " << error << std::endl;
+          }
+        else
+          {
+          printf("Batch job %d of %d: %s -> %s (%.1f s)\n", i + 1, (int) jobs.size(),
+                 job.moving.c_str(), job.output.c_str(), tp.GetTotal());
+          }
+        }
+
+      greedy.EndSession();
+      };
+
+    std::vector<std::thread> pool;
+    for(int w = 0; w < n_workers; w++)
+      pool.push_back(std::thread(worker));
+    for(auto &t : pool)
+      t.join();
+
+    if(n_failed > 0)
+      {
+      std::cerr << n_failed << " of " << jobs.size() << " batch registrations failed" << std::endl;
+      return -1;
+      }
+
+    return 0;
+  }
+
+  /**
+   * Register the frames of a time series to the same fixed image, in order. The
+   * registrations share a session, so the fixed pyramid is built once, and each
+   * frame starts from the warp of the previous frame, kept in memory. With -id-skip,
+   * the coarse levels at which the previous warp is already good are skipped
+   */
+  static int RunTimeSeries(GreedyParameters &param)
+  {
+    if(param.mode != GreedyParameters::GREEDY)
+      throw GreedyException("Time series mode is only supported for deformable registration");
+
+    if(param.batch_manifest.size())
+      throw GreedyException("The -timeseries and -batch options can not be combined");
+
+    if(param.inputs.size() != 1)
+      throw GreedyException("Time series mode requires a single -i image pair");
+
+    if(param.flag_stationary_velocity_mode)
+      throw GreedyException("Time series mode is not supported with -sv");
+
+    if(param.flag_affine_residual)
+      throw GreedyException("Time series mode is not supported with -ia-residual");
+
+    if(param.inverse_warp.size() || param.root_warp.size())
+      throw GreedyException("The -oinv and -oroot options can not be used in time series mode");
+
+    // The manifest has the same format as the batch manifest, but all of the frames
+    // are registered to the fixed image, so the order of the lines is kept
+    GreedyParameters manifest_param = param;
+    manifest_param.batch_manifest = param.timeseries_manifest;
+    std::vector<GreedyBatchJob> frames;
+    ReadBatchManifest(manifest_param, frames);
+    if(frames.size() == 0)
+      throw GreedyException("Time series manifest %s lists no frames", param.timeseries_manifest.c_str());
+    for(unsigned int i = 0; i < frames.size(); i++)
+      if(frames[i].fixed != param.inputs[0].fixed)
+        throw GreedyException("All frames of the time series must be registered to the -i fixed image");
+
+    GreedyAPI greedy;
+    greedy.BeginSession();
+    greedy.SetKeepResultWarps(true);
+
+    // The warp of the previous frame, held here since the result is reset by each run
+    const char *warm_start_key = "timeseries_warm_start";
+    typename GreedyAPI::VectorImagePointer warm_start;
+
+    for(unsigned int i = 0; i < frames.size(); i++)
+      {
+      GreedyParameters frame_param = param;
+      frame_param.timeseries_manifest.clear();
+      frame_param.inputs[0].moving = frames[i].moving;
+      frame_param.output = frames[i].output;
+      if(warm_start.IsNotNull())
+        frame_param.initial_warp = warm_start_key;
+
+      // Each frame keeps its own checkpoint, as in batch mode
+      if(param.checkpoint_file.size())
+        {
+        char suffix[32];
+        sprintf(suffix, ".frame%04d", i + 1);
+        frame_param.checkpoint_file = param.checkpoint_file + suffix;
+        }
+
+      itk::TimeProbe tp;
+      tp.Start();
+      int rc = greedy.Run(frame_param);
+      tp.Stop();
+      if(rc != 0)
+        throw GreedyException("Registration of frame %d (%s) failed", i + 1, frames[i].moving.c_str());
+
+      // Count the iterations actually run, over all levels
+      unsigned int n_iter = 0;
+      const typename GreedyAPI::ConvergenceLogType &clog = greedy.GetConvergenceLog();
+      for(unsigned int k = 0; k < clog.size(); k++)
+        n_iter += clog[k].iterations;
+
+      printf("Frame %d of %d: %s -> %s (%.1f s, %d iterations)\n", i + 1, (int) frames.size(),
+             frames[i].moving.c_str(), frames[i].output.c_str(), tp.GetTotal(), n_iter);
+
+      warm_start = greedy.GetResult().GetPhysicalWarp();
+      greedy.AddCachedInputObject(warm_start_key, warm_start);
+      }
+
+    greedy.EndSession();
+    return 0;
+  }
 };
 
 
@@ -211,6 +653,9 @@ int main(int argc, char *argv[])
     // Some parameters may be specified as either vector or scalar, and need to be verified
     if(!param.epsilon_per_level.CheckSize(param.iter_per_level.size()))
        throw GreedyException("Mismatch in size of vectors supplied with -n and -e options");
+    if(!param.conv_tolerance.CheckSize(param.iter_per_level.size())
+       || !param.conv_update_norm.CheckSize(param.iter_per_level.size()))
+       throw GreedyException("Mismatch in size of vectors supplied with -n and -conv-tol/-conv-update options");
 
     // Run the main code
     if(param.flag_float_math)
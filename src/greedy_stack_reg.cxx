@@ -35,6 +35,16 @@
 #include <algorithm>
 #include <numeric>
 #include <cerrno>
+#include <list>
+#include <deque>
+#include <set>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <functional>
 
 #include "itkMatrixOffsetTransformBase.h"
 #include "itkImageAlgorithm.h"
@@ -45,9 +55,13 @@
 #include "itkVectorIndexSelectionCastImageFilter.h"
 #include "itkComposeImageFilter.h"
 #include "itkInvertIntensityImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkImageSource.h"
+#include "itkImageIOFactory.h"
 
 #include "lddmm_common.h"
 #include "lddmm_data.h"
+#include "ParallelFor.h"
 
 #include <vnl_matrix_inverse.h>
 
@@ -56,8 +70,12 @@ struct StackParameters
   bool reuse;
   bool debug;
   std::string output_dir;
+
+  // Memory budget for cached images, in bytes
+  unsigned long cache_memory;
+
   StackParameters()
-    : reuse(false), debug(false) {}
+    : reuse(false), debug(false), cache_memory(8192ul * 1024ul * 1024ul) {}
 };
 
 
@@ -116,86 +134,194 @@ struct SplatParameters
   unsigned int histogram_points;
   bool histogram_invert;
 
+  // Number of z-slices per slab when splatting out of core (0: whole volume in memory)
+  unsigned int slab_size;
+
   SplatParameters()
     : z_first(0.0), z_last(0.0), z_step(0.0),
       source_stage(RAW), source_iter(0),
       mode(EXACT), z_exact_tol(1e-6), sigma(0.0),
       ignore_alt_headers(false), background(1, 0.0),
       sigma_inplane(0.0), output_spacing_xy(0.0),
-      histogram_normalize(false), histogram_points(7), histogram_invert(false) {}
+      histogram_normalize(false), histogram_points(7), histogram_invert(false),
+      slab_size(0) {}
 };
 
 
 
 /**
- * This class represents a reference to an image that may exist on disk, or may be
- * stored in memory. There is a limit on the amount of memory that can be used by
- * all the image refs, and images are rotated in and out of memory based on when
- * they were last accessed
+ * A cache of images read from disk, shared by all stages of the project. There is
+ * a limit on the amount of memory that can be used by the cached images, and the
+ * least recently used images are evicted when the limit is reached. Images that
+ * will be needed soon can be prefetched, in which case they are read on a
+ * background thread.
  */
 class ImageCache
 {
 public:
 
   ImageCache(unsigned long max_memory = 0l, unsigned int max_images = 0)
-    : m_MaxMemory(max_memory), m_UsedMemory(0l), m_MaxImages(max_images), m_Counter(0l) {}
+    : m_MaxMemory(max_memory), m_UsedMemory(0l), m_MaxImages(max_images),
+      m_Hits(0l), m_Misses(0l), m_Prefetched(0l), m_StopPrefetch(false) {}
+
+  ~ImageCache()
+  {
+    // Stop the prefetch thread, discarding any pending requests
+      {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_PrefetchQueue.clear();
+      m_StopPrefetch = true;
+      }
+    m_PrefetchCondition.notify_all();
+    if(m_PrefetchThread.joinable())
+      m_PrefetchThread.join();
+  }
+
+  void SetMaxMemory(unsigned long max_memory)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_MaxMemory = max_memory;
+    this->ShrinkCache(0, 0);
+  }
 
   template <typename TImage> typename TImage::Pointer GetImage(const std::string &filename)
   {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+
+    // If the image is being read by the prefetch thread, wait for it
+    m_LoadCondition.wait(lock, [&]{ return m_Loading.find(filename) == m_Loading.end(); });
+
     // Check the cache for the image
     auto it = m_Cache.find(filename);
     if(it != m_Cache.end())
       {
-      TImage *image = dynamic_cast<TImage *>(std::get<2>(it->second).GetPointer());
-      if(!image)
-        throw GreedyException("Type mismatch in image cache");
-      typename TImage::Pointer image_ptr = image;
-      return image_ptr;
+      m_Hits++;
+      m_LRU.splice(m_LRU.begin(), m_LRU, it->second.lru);
+      return CastEntry<TImage>(it->second);
       }
 
-    // Image does not exist in cache, load it
+    // Image does not exist in cache, load it without holding the lock
+    m_Misses++;
+    m_Loading.insert(filename);
+    lock.unlock();
+
+    typename TImage::Pointer image_ptr;
+    try
+      {
+      image_ptr = ReadImage<TImage>(filename);
+      }
+    catch(...)
+      {
+      lock.lock();
+      m_Loading.erase(filename);
+      m_LoadCondition.notify_all();
+      throw;
+      }
+
+    lock.lock();
+    m_Loading.erase(filename);
+    this->Insert(filename, image_ptr.GetPointer(), GetImageSize<TImage>(image_ptr));
+    m_LoadCondition.notify_all();
+
+    // Return the image
+    return image_ptr;
+  }
+
+  /** Request that an image be read into the cache in the background */
+  template <typename TImage> void Prefetch(const std::string &filename)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if(m_Cache.find(filename) != m_Cache.end() || m_Loading.find(filename) != m_Loading.end())
+      return;
+
+    m_PrefetchQueue.push_back(std::make_pair(filename, &ImageCache::PrefetchImage<TImage>));
+
+    // The prefetch thread is started on first use
+    if(!m_PrefetchThread.joinable())
+      m_PrefetchThread = std::thread(&ImageCache::PrefetchLoop, this);
+    m_PrefetchCondition.notify_one();
+  }
+
+  void PurgeCache()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Cache.clear();
+    m_LRU.clear();
+    m_UsedMemory = 0;
+  }
+
+  void PrintStatistics()
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    printf("Image cache: %lu hits, %lu misses, %lu prefetched; %ld images, %8.4f GB in use\n",
+           m_Hits, m_Misses, m_Prefetched, (long) m_Cache.size(),
+           m_UsedMemory / (1024.0 * 1024.0 * 1024.0));
+  }
+
+protected:
+
+  // Cache entry: size, pointer and position in the LRU list
+  struct CacheEntry
+  {
+    unsigned long size;
+    itk::Object::Pointer image;
+    std::list<std::string>::iterator lru;
+  };
+
+  typedef std::unordered_map<std::string, CacheEntry> CacheType;
+  typedef void (ImageCache::*PrefetchMethod)(const std::string &);
+
+  template <typename TImage> static typename TImage::Pointer ReadImage(const std::string &filename)
+  {
     typedef itk::ImageFileReader<TImage> ReaderType;
     typename ReaderType::Pointer reader = ReaderType::New();
     reader->SetFileName(filename.c_str());
     reader->Update();
     typename TImage::Pointer image_ptr = reader->GetOutput();
+    return image_ptr;
+  }
 
-    // Get the size of the image in bytes
-    unsigned long img_size = image_ptr->GetPixelContainer()->Size()
-                             * sizeof (typename TImage::PixelContainer::Element);
+  template <typename TImage> static typename TImage::Pointer CastEntry(const CacheEntry &entry)
+  {
+    TImage *image = dynamic_cast<TImage *>(entry.image.GetPointer());
+    if(!image)
+      throw GreedyException("Type mismatch in image cache");
+    typename TImage::Pointer image_ptr = image;
+    return image_ptr;
+  }
+
+  template <typename TImage> static unsigned long GetImageSize(TImage *image)
+  {
+    return image->GetPixelContainer()->Size()
+        * sizeof (typename TImage::PixelContainer::Element);
+  }
 
+  // Add an image to the cache as the most recently used. Called with the lock held
+  void Insert(const std::string &filename, itk::Object *image, unsigned long img_size)
+  {
     // If the size of the image is too large, we need to reduce the size of the cache
     this->ShrinkCache(img_size, 1);
 
-    // Add the new image
-    m_Cache[filename] = std::make_tuple(m_Counter++, img_size, image_ptr);
+    m_LRU.push_front(filename);
+    CacheEntry entry = { img_size, image, m_LRU.begin() };
+    m_Cache[filename] = entry;
     m_UsedMemory += img_size;
-
-    // Return the image
-    return image_ptr;
   }
 
+  // Evict least recently used images until the new images fit. Called with the lock held
   void ShrinkCache(unsigned long new_bytes, unsigned int new_images)
   {
-    // Remove something from the cache until it's not empty and the constraints of the
-    // cache are satisfied
-    while(IsCacheFull(new_bytes, new_images) && m_Cache.size() > 0)
-      {
-      // Find the oldest entry in the cache
-      std::map<unsigned long, std::string> sort_map;
-      for(auto it : m_Cache)
-        sort_map[std::get<0>(it.second)] = it.first;
-
-      // Remove the first (oldest) entry
-      auto it_erase = m_Cache.find(sort_map.begin()->second);
-      m_UsedMemory -= std::get<1>(it_erase->second);
+    while(IsCacheFull(new_bytes, new_images) && m_LRU.size() > 0)
+      {
+      auto it_erase = m_Cache.find(m_LRU.back());
+      m_UsedMemory -= it_erase->second.size;
       m_Cache.erase(it_erase);
+      m_LRU.pop_back();
       }
   }
 
-  bool IsCacheFull(unsigned long new_bytes, unsigned int new_images)
+  bool IsCacheFull(unsigned long new_bytes, unsigned int new_images) const
   {
-    printf("Cache usage: %8.4f GB, %ld images\n", m_UsedMemory / (1024.0*1024.0*1024.0), m_Cache.size());
     if(m_MaxMemory > 0 && m_UsedMemory + new_bytes > m_MaxMemory)
       return true;
 
@@ -205,24 +331,65 @@ public:
     return false;
   }
 
-  void PurgeCache()
+  // Read an image on the prefetch thread. Failures are ignored here, and will be
+  // reported when the image is requested with GetImage
+  template <typename TImage> void PrefetchImage(const std::string &filename)
   {
-    m_Cache.clear();
-    m_UsedMemory = 0;
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if(m_Cache.find(filename) != m_Cache.end() || m_Loading.find(filename) != m_Loading.end())
+      return;
+    m_Loading.insert(filename);
+    lock.unlock();
+
+    typename TImage::Pointer image_ptr;
+    try { image_ptr = ReadImage<TImage>(filename); }
+    catch(...) { image_ptr = NULL; }
+
+    lock.lock();
+    m_Loading.erase(filename);
+    if(image_ptr)
+      {
+      this->Insert(filename, image_ptr.GetPointer(), GetImageSize<TImage>(image_ptr));
+      m_Prefetched++;
+      }
+    m_LoadCondition.notify_all();
   }
 
-protected:
+  void PrefetchLoop()
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while(true)
+      {
+      m_PrefetchCondition.wait(lock, [&]{ return m_StopPrefetch || m_PrefetchQueue.size() > 0; });
+      if(m_StopPrefetch)
+        return;
 
-  // Cache entry (age, size, pointer)
-  typedef std::tuple<unsigned long, unsigned long, itk::Object::Pointer> CacheEntry;
-  typedef std::map<std::string, CacheEntry> CacheType;
+      std::pair<std::string, PrefetchMethod> request = m_PrefetchQueue.front();
+      m_PrefetchQueue.pop_front();
+      lock.unlock();
+      (this->*request.second)(request.first);
+      lock.lock();
+      }
+  }
 
-  // Cache for images
+  // Cache for images, and the filenames in order of last use (most recent first)
   CacheType m_Cache;
+  std::list<std::string> m_LRU;
 
   unsigned long m_MaxMemory, m_UsedMemory;
   unsigned int m_MaxImages;
-  unsigned long m_Counter;
+
+  // Statistics
+  unsigned long m_Hits, m_Misses, m_Prefetched;
+
+  // Synchronization with the prefetch thread. Images being read by either thread
+  // are listed in m_Loading
+  std::mutex m_Mutex;
+  std::condition_variable m_LoadCondition, m_PrefetchCondition;
+  std::set<std::string> m_Loading;
+  std::deque< std::pair<std::string, PrefetchMethod> > m_PrefetchQueue;
+  std::thread m_PrefetchThread;
+  bool m_StopPrefetch;
 };
 
 
@@ -277,6 +444,60 @@ int usage(const std::string &stage = std::string())
 }
 
 
+/**
+ * An image source that produces any requested region of its output by calling
+ * a user-supplied function. The geometry of the output is copied from a
+ * reference image, which does not need to have its pixels allocated. When such a
+ * source is written with stream divisions, the writer requests the volume one slab
+ * at a time, so only one slab needs to be held in memory.
+ */
+template <class TImage>
+class CallbackImageSource : public itk::ImageSource<TImage>
+{
+public:
+  typedef CallbackImageSource<TImage> Self;
+  typedef itk::ImageSource<TImage> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+  typedef std::function<void(TImage *)> FillFunction;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self)
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(CallbackImageSource, itk::ImageSource)
+
+  void SetReference(TImage *ref) { m_Reference = ref; this->Modified(); }
+  void SetFillFunction(const FillFunction &fn) { m_FillFunction = fn; this->Modified(); }
+
+protected:
+  CallbackImageSource() {}
+  ~CallbackImageSource() {}
+
+  virtual void GenerateOutputInformation() ITK_OVERRIDE
+  {
+    TImage *output = this->GetOutput();
+    output->CopyInformation(m_Reference);
+    output->SetLargestPossibleRegion(m_Reference->GetLargestPossibleRegion());
+    output->SetNumberOfComponentsPerPixel(m_Reference->GetNumberOfComponentsPerPixel());
+  }
+
+  virtual void GenerateData() ITK_OVERRIDE
+  {
+    TImage *output = this->GetOutput();
+    output->SetBufferedRegion(output->GetRequestedRegion());
+    output->Allocate();
+    m_FillFunction(output);
+  }
+
+  virtual void EnlargeOutputRequestedRegion(itk::DataObject *) ITK_OVERRIDE {}
+
+private:
+  typename TImage::Pointer m_Reference;
+  FillFunction m_FillFunction;
+};
+
+
 /**
  * A representation of the project
  */
@@ -308,6 +529,10 @@ public:
   typedef LDDMMType::ImageType MaskImageType;
   typedef LDDMMType::ImagePointer MaskImagePointer;
 
+  // References to slices sorted by the z-position
+  typedef std::pair<double, unsigned int> slice_ref;
+  typedef std::set<slice_ref> slice_ref_set;
+
   /** Set of enums used to refer to files in the project directory */
   enum FileIntent {
     MANIFEST_FILE = 0, CONFIG_ENTRY, AFFINE_MATRIX, METRIC_VALUE, ACCUM_MATRIX, ACCUM_RESLICE,
@@ -320,6 +545,7 @@ public:
   {
     m_ProjectDir = project_dir;
     m_GlobalParam = param;
+    m_ImageCache.SetMaxMemory(param.cache_memory);
   }
 
   /** Initialize the project */
@@ -437,7 +663,166 @@ public:
       }
   }
 
-  void ReconstructStack(double z_range, double z_exponent, double z_epsilon, const GreedyParameters &gparam)
+  // A rigid registration between a reference slice and one of its neighbors
+  struct SlicePairTask
+  {
+    unsigned int i_ref, i_mov, i_edge;
+    double hops, metric;
+  };
+
+  // Start reading the images used by a pair registration in the background
+  void PrefetchSlicePair(const SlicePairTask &task)
+  {
+    m_ImageCache.Prefetch<SlideImageType>(m_Slices[task.i_ref].raw_filename);
+    m_ImageCache.Prefetch<SlideImageType>(m_Slices[task.i_mov].raw_filename);
+    if(m_UseMasks)
+      m_ImageCache.Prefetch<MaskImageType>(m_Slices[task.i_ref].mask_filename);
+  }
+
+  // Perform the rigid registration for a pair of slices, or reuse the existing
+  // result, and store the normalized metric in the task
+  void RegisterSlicePair(SlicePairTask &task, const GreedyParameters &gparam)
+  {
+    const SliceData &s_ref = m_Slices[task.i_ref], &s_mov = m_Slices[task.i_mov];
+
+    // Get the filenames that will be generated by registration
+    std::string fn_matrix = GetFilenameForSlicePair(s_ref, s_mov, AFFINE_MATRIX);
+    std::string fn_metric = GetFilenameForSlicePair(s_ref, s_mov, METRIC_VALUE);
+
+    // Reuse existing registration results
+    if(CanSkipFile(fn_matrix) && CanSkipFile(fn_metric))
+      {
+      std::ifstream fin(fn_metric);
+      fin >> task.metric;
+      return;
+      }
+
+    // Load or retrieve the images
+    SlideImagePointer i_ref = m_ImageCache.GetImage<SlideImageType>(s_ref.raw_filename);
+    SlideImagePointer i_mov = m_ImageCache.GetImage<SlideImageType>(s_mov.raw_filename);
+    MaskImagePointer i_mask;
+    if(m_UseMasks)
+      i_mask = m_ImageCache.GetImage<MaskImageType>(s_ref.mask_filename);
+
+    // Perform the registration between i_ref and i_mov
+    GreedyAPI greedy_api;
+
+    // Make a copy of the template parameters
+    GreedyParameters my_param = gparam;
+
+    // Set up the image pair for registration
+    ImagePairSpec img_pair(s_ref.raw_filename, s_mov.raw_filename);
+    greedy_api.AddCachedInputObject(s_ref.raw_filename, i_ref.GetPointer());
+    greedy_api.AddCachedInputObject(s_mov.raw_filename, i_mov.GetPointer());
+    my_param.inputs.push_back(img_pair);
+
+    // Add mask if using them
+    if(m_UseMasks)
+      {
+      greedy_api.AddCachedInputObject(s_ref.mask_filename, i_mask.GetPointer());
+      my_param.gradient_mask = s_ref.mask_filename;
+      }
+
+    // Set other parameters
+    my_param.affine_dof = GreedyParameters::DOF_RIGID;
+    my_param.affine_init_mode = IMG_CENTERS;
+
+    // Set up the output of the affine
+    my_param.output = fn_matrix;
+
+    // Perform affine/rigid
+    printf("#############################\n");
+    printf("### Fixed :%s   Moving %s ###\n", s_ref.unique_id.c_str(), s_mov.unique_id.c_str());
+    printf("#############################\n");
+    std::cout << "greedy " << my_param.GenerateCommandLine() << std::endl;
+    greedy_api.RunAffine(my_param);
+
+    // Get the metric for the affine registration
+    double pair_metric = greedy_api.GetLastMetricReport().TotalMetric;
+    std::cout << "Last metric value: " << pair_metric << std::endl;
+
+    // Normalize the metric to give the actual mean NCC
+    pair_metric /= -10000.0 * i_ref->GetNumberOfComponentsPerPixel();
+    std::ofstream f_metric(fn_metric);
+    f_metric << pair_metric << std::endl;
+    task.metric = pair_metric;
+  }
+
+  // Run a worker function on n_jobs threads at once. Each job is given a quota of ITK
+  // threads, either threads_per_job or an equal share of all threads if zero. If any
+  // of the workers throws, the failed flag is raised so that the others can stop, and
+  // the first exception is rethrown once all workers have finished.
+  void RunConcurrentJobs(const std::function<void()> &worker,
+                         unsigned int n_jobs, unsigned int threads_per_job,
+                         std::atomic<bool> &failed)
+  {
+    failed = false;
+    if(n_jobs <= 1)
+      {
+      worker();
+      return;
+      }
+
+    int n_def_threads = ParallelFor::GetNumberOfThreads();
+    int quota = threads_per_job > 0 ? threads_per_job : std::max(1, n_def_threads / (int) n_jobs);
+    printf("Running %d jobs at a time with %d threads each\n", n_jobs, quota);
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    std::vector<std::thread> pool;
+    for(unsigned int j = 0; j < n_jobs; j++)
+      {
+      pool.push_back(std::thread([&]()
+        {
+        try
+          {
+          ParallelFor::ThreadQuota thread_quota(quota);
+          worker();
+          }
+        catch(...)
+          {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if(!error)
+            error = std::current_exception();
+          failed = true;
+          }
+        }));
+      }
+    for(auto &t : pool)
+      t.join();
+
+    if(error)
+      std::rethrow_exception(error);
+  }
+
+  // Run the pair registrations, with up to n_jobs registrations at a time
+  void RunSlicePairRegistrations(std::vector<SlicePairTask> &tasks,
+                                 unsigned int n_jobs, unsigned int threads_per_job,
+                                 const GreedyParameters &gparam)
+  {
+    n_jobs = std::max(1u, std::min(n_jobs, (unsigned int) tasks.size()));
+
+    // Tasks are handed out in order, and each job prefetches the images for the
+    // task that will come up after all of the running tasks
+    std::atomic<size_t> next_task(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]()
+    {
+      size_t i;
+      while(!failed && (i = next_task++) < tasks.size())
+        {
+        if(i + n_jobs < tasks.size())
+          PrefetchSlicePair(tasks[i + n_jobs]);
+        RegisterSlicePair(tasks[i], gparam);
+        }
+    };
+
+    RunConcurrentJobs(worker, n_jobs, threads_per_job, failed);
+  }
+
+  void ReconstructStack(double z_range, double z_exponent, double z_epsilon,
+                        unsigned int n_jobs, unsigned int threads_per_job,
+                        const GreedyParameters &gparam)
   {
     // Configure the threads
     GreedyAPI::ConfigThreads(gparam);
@@ -498,9 +883,8 @@ public:
         }
       }
 
-    // Set up a cache for loaded images. These images can be cycled in and out of memory
-    // depending on need. TODO: let user configure cache sizes
-    ImageCache slice_cache(0, 100);
+    // Loaded images are cycled in and out of memory by the project's image cache
+    ImageCache &slice_cache = m_ImageCache;
 
     // At this point we can create a rigid adjacency structure for the graph-theoretic algorithm,
     vnl_vector<unsigned int> G_adjidx(m_SortedSlices.size()+1, 0u);
@@ -519,130 +903,74 @@ public:
     typedef std::tuple<unsigned int, unsigned int, double> GraphEdge;
     std::set<GraphEdge> slice_graph;
 
-    // Perform rigid registration between pairs of images. We should do this in a way that
-    // the number of images loaded and unloaded is kept to a minimum, without filling memory.
-    // The best way to do so would be to progress in z order and release images that are too
-    // far behind in z to be included for the current 'reference' image
+    // Collect the pairs of slices to register. The pairs are listed in z order of the
+    // reference slice, so that the images shared by nearby pairs are loaded and unloaded
+    // a minimal number of times, without filling memory
+    std::vector<SlicePairTask> tasks;
     for(auto it : m_SortedSlices)
       {
       // Skip the slide if it is a follower (followers are not used as reference slices)
       if(!m_Slices[it.second].is_leader)
         continue;
 
-      const auto &nbr = slice_nbr[it.second];
-
-      // Read the reference slide from the cache
-      SlideImagePointer i_ref =
-          slice_cache.GetImage<SlideImageType>(m_Slices[it.second].raw_filename);
-
-      // Read the mask from the cache
-      MaskImagePointer i_mask;
-      if(m_UseMasks)
-        i_mask = slice_cache.GetImage<MaskImageType>(m_Slices[it.second].mask_filename);
-
-      // Iterate over the neighbor slices
       unsigned int n_pos = 0;
-      for(auto it_n : nbr)
+      for(auto it_n : slice_nbr[it.second])
         {
-        // Load or retrieve the corresponding image
-        SlideImagePointer i_mov =
-            slice_cache.GetImage<SlideImageType>(m_Slices[it_n.second].raw_filename);
-
-        // Get the filenames that will be generated by registration
-        std::string fn_matrix = GetFilenameForSlicePair(m_Slices[it.second], m_Slices[it_n.second], AFFINE_MATRIX);
-        std::string fn_metric = GetFilenameForSlicePair(m_Slices[it.second], m_Slices[it_n.second], METRIC_VALUE);
-        double pair_metric = 1e100;
-
-        // Perform registration or reuse existing registration results
-        if(CanSkipFile(fn_matrix) && CanSkipFile(fn_metric))
-          {
-          std::ifstream fin(fn_metric);
-          fin >> pair_metric;
-          }
-        else
-          {
-          // Perform the registration between i_ref and i_mov
-          GreedyAPI greedy_api;
-
-          // Make a copy of the template parameters
-          GreedyParameters my_param = gparam;
-
-          // Set up the image pair for registration
-          ImagePairSpec img_pair(m_Slices[it.second].raw_filename, m_Slices[it_n.second].raw_filename);
-          greedy_api.AddCachedInputObject(m_Slices[it.second].raw_filename, i_ref.GetPointer());
-          greedy_api.AddCachedInputObject(m_Slices[it_n.second].raw_filename, i_mov.GetPointer());
-          my_param.inputs.push_back(img_pair);
-
-          // Add mask if using them
-          if(m_UseMasks)
-            {
-            greedy_api.AddCachedInputObject(m_Slices[it.second].mask_filename, i_mask.GetPointer());
-            my_param.gradient_mask = m_Slices[it.second].mask_filename;
-            }
-
-          // Set other parameters
-          my_param.affine_dof = GreedyParameters::DOF_RIGID;
-          my_param.affine_init_mode = IMG_CENTERS;
-
-          // Set up the output of the affine
-          my_param.output = fn_matrix;
-
-          // Perform affine/rigid
-          printf("#############################\n");
-          printf("### Fixed :%s   Moving %s ###\n", m_Slices[it.second].unique_id.c_str(),m_Slices[it_n.second].unique_id.c_str());
-          printf("#############################\n");
-          std::cout << "greedy " << my_param.GenerateCommandLine() << std::endl;
-          greedy_api.RunAffine(my_param);
+        SlicePairTask task;
+        task.i_ref = it.second;
+        task.i_mov = it_n.second;
+        task.i_edge = G_adjidx[it.second] + n_pos++;
+        task.hops = fabs(it_n.first - it.first);
+        task.metric = 1e100;
+        tasks.push_back(task);
+        }
+      }
 
-          // Get the metric for the affine registration
-          pair_metric = greedy_api.GetLastMetricReport().TotalMetric;
-          std::cout << "Last metric value: " << pair_metric << std::endl;
+    // Perform rigid registration between the pairs of images, running several
+    // registrations at once if requested
+    RunSlicePairRegistrations(tasks, n_jobs, threads_per_job, gparam);
 
-          // Normalize the metric to give the actual mean NCC
-          pair_metric /= -10000.0 * i_ref->GetNumberOfComponentsPerPixel();
-          std::ofstream f_metric(fn_metric);
-          f_metric << pair_metric << std::endl;
-          }
-
-        // Map the metric value into a weight
-        double hops = fabs(it_n.first - it.first);
-        double weight = pow(1.0 - pair_metric, z_exponent) * hops * pow(1 + z_epsilon, hops);
-        printf("F: %s   M: %s   M=%f  W=%f\n",
-               m_Slices[it.second].unique_id.c_str(), m_Slices[it_n.second].unique_id.c_str(), pair_metric, weight);
+    for(auto &task : tasks)
+      {
+      // Map the metric value into a weight
+      double weight = pow(1.0 - task.metric, z_exponent) * task.hops * pow(1 + z_epsilon, task.hops);
+      printf("F: %s   M: %s   M=%f  W=%f\n",
+             m_Slices[task.i_ref].unique_id.c_str(), m_Slices[task.i_mov].unique_id.c_str(),
+             task.metric, weight);
 
-        // Regardless of whether we did registration or not, record the edge in the graph
-        G_edge_weight[G_adjidx[it.second] + n_pos++] = weight;
-        }
+      // Regardless of whether we did registration or not, record the edge in the graph
+      G_edge_weight[task.i_edge] = weight;
       }
 
     // Run the shortest path computations
     DijkstraShortestPath<double> dijkstra((unsigned int) m_Slices.size(),
                                           G_adjidx.data_block(), G_adj.data_block(), G_edge_weight.data_block());
 
-    // Compute the shortest paths from every slice to the rest and record the total distance. This will
-    // help generate the root of the tree
-    int i_root = -1;
-    double best_root_dist = 0.0;
+    // Compute the shortest paths from every leader slice to the rest and record the total
+    // distance. This will help generate the root of the tree. The sources are independent,
+    // so they are processed on all available threads
+    std::vector<unsigned int> leaders;
     for(unsigned int i = 0; i < m_Slices.size(); i++)
-      {
       if(m_Slices[i].is_leader)
+        leaders.push_back(i);
+
+    int i_root = -1;
+    if(leaders.size())
+      {
+      DijkstraMultiSourceDistances<double> msd((unsigned int) m_Slices.size(),
+                                               G_adjidx.data_block(), G_adj.data_block(), G_edge_weight.data_block());
+      msd.ComputePathsFromSources((unsigned int) leaders.size(), leaders.data(),
+                                  itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
+
+      for(unsigned int k = 0; k < leaders.size(); k++)
         {
-        dijkstra.ComputePathsFromSource(i);
-        std::cout << "Root distance " << m_Slices[i].unique_id << " : ";
-        double root_dist = 0.0;
+        std::cout << "Root distance " << m_Slices[leaders[k]].unique_id << " : ";
         for(unsigned int j = 0; j < m_Slices.size(); j++)
-          {
-          double dj = dijkstra.GetDistanceArray()[j];
-          root_dist += dj;
-          std::cout << dj << " ";
-          }
+          std::cout << msd.GetDistanceArray(k)[j] << " ";
         std::cout << std::endl;
-        if(i_root < 0 || best_root_dist > root_dist)
-          {
-          i_root = i;
-          best_root_dist = root_dist;
-          }
         }
+
+      i_root = leaders[msd.GetCentralSource()];
       }
 
     // No root? We have a problem
@@ -670,18 +998,13 @@ public:
     itk::Size<2> pad_size;
     pad_size.Fill(max_dim / 4);
     fltPad->SetPadBound(pad_size);
+    ParallelFor::ApplyThreadQuota(fltPad);
     fltPad->Update();
 
-    // Store the result
+    // Store the result. The padded image has a non-zero index, but GreedyAPI rebases
+    // cached input images to a zero index, so it can be passed in directly
     LDDMMType::ImagePointer img_root_padded = fltPad->GetOutput();
 
-    // The padded image has a non-zero index, which causes problems downstream for GreedyAPI.
-    // To account for this, we save and load the image
-    // TODO: handle this internally using a filter!
-    std::string fn_img_root_padded = GetFilenameForGlobal(TEMP_FILE, "padded_root.nii.gz");
-    LDDMMType::img_write(img_root_padded, fn_img_root_padded.c_str());
-    img_root_padded = LDDMMType::img_read(fn_img_root_padded.c_str());
-
     // Compute transformation for each slice
     for(unsigned int i = 0; i < m_Slices.size(); i++)
       {
@@ -741,9 +1064,10 @@ public:
         my_param.reslice_param.ref_image = "root_slice_padded";
         my_param.reslice_param.images.push_back(ResliceSpec(m_Slices[i].raw_filename, fn_accum_reslice));
         my_param.reslice_param.transforms.push_back(TransformSpec(fn_accum_matrix));
+        // Hold on to the slide, since the cache may evict it during reslicing
+        SlideImagePointer img_slide = slice_cache.GetImage<SlideImageType>(m_Slices[i].raw_filename);
         greedy_api.AddCachedInputObject("root_slice_padded", img_root_padded.GetPointer());
-        greedy_api.AddCachedInputObject(m_Slices[i].raw_filename,
-                                        slice_cache.GetImage<SlideImageType>(m_Slices[i].raw_filename));
+        greedy_api.AddCachedInputObject(m_Slices[i].raw_filename, img_slide.GetPointer());
         greedy_api.AddCachedOutputObject(fn_accum_reslice, img_reslice.GetPointer(), true);
         std::cout << "greedy " << my_param.GenerateCommandLine() << std::endl;
         greedy_api.RunReslice(my_param);
@@ -754,6 +1078,8 @@ public:
         img_reslice = LDDMMType::cimg_read(fn_accum_reslice.c_str());
         }
       }
+
+    slice_cache.PrintStatistics();
   }
 
   static SlideImagePointer ExtractSliceFromVolume(VolumePointer vol, double z_pos)
@@ -886,7 +1212,12 @@ public:
     // Now we have a large set of per-slice matrices. We next try each matrix on each pair of
     // slices and store the metric, with the goal of finding a matrix that will provide the
     // best possible match.
-    std::vector<double> accum_metric(m_Slices.size(), 0.0);
+    // All the problems are handed to the API as one batch, so that the images for
+    // each slice are read and pyramided once and the slices are evaluated in parallel.
+    GreedyAPI greedy_api;
+    std::vector<GreedyParameters> batch_param;
+    std::vector<std::pair<unsigned int, unsigned int> > batch_ik;
+    std::vector<LDDMMType::CompositeImagePointer> batch_images;
     for(unsigned int i = 0; i < m_Slices.size(); i++)
       {
       if(!m_Slices[i].is_leader)
@@ -899,21 +1230,25 @@ public:
       LDDMMType::CompositeImagePointer acc_slice =
         LDDMMType::cimg_read(GetFilenameForSlice(m_Slices[i], ACCUM_RESLICE).c_str());
 
+      // Cached objects are named per slice, since they share one API
+      char vol_key[64], acc_key[64];
+      sprintf(vol_key, "vol_slice_%03d", i);
+      sprintf(acc_key, "acc_slice_%03d", i);
+      greedy_api.AddCachedInputObject(vol_key, vol_slice.GetPointer());
+      greedy_api.AddCachedInputObject(acc_key, acc_slice.GetPointer());
+      batch_images.push_back(vol_slice);
+      batch_images.push_back(acc_slice);
+
       // Loop over matrices
       for(unsigned int k = 0; k < m_Slices.size(); k++)
         {
         if(!m_Slices[k].is_leader)
           continue;
 
-        // This API is for metric computation
-        GreedyAPI greedy_api;
         GreedyParameters my_param = gparam;
 
         // Same image pairs as before
-        ImagePairSpec img_pair("vol_slice", "acc_slice", 1.0);
-        greedy_api.AddCachedInputObject("vol_slice", vol_slice.GetPointer());
-        greedy_api.AddCachedInputObject("acc_slice", acc_slice.GetPointer());
-        my_param.inputs.push_back(img_pair);
+        my_param.inputs.push_back(ImagePairSpec(vol_key, acc_key, 1.0));
 
         // TODO: this is really bad, can't cache mask images
         if(fn_mask.length())
@@ -923,15 +1258,24 @@ public:
         my_param.affine_init_mode = RAS_FILENAME;
         my_param.affine_init_transform = GetFilenameForSlice(m_Slices[k], VOL_INIT_MATRIX);
 
-        // Run affine to get the metric value
-        MultiComponentMetricReport metric_report;
         std::cout << "greedy " << my_param.GenerateCommandLine() << std::endl;
-        greedy_api.ComputeMetric(my_param, metric_report);
-        printf("Slide %03d matrix %03d metric %8.4f\n", i, k, metric_report.TotalMetric);
-        accum_metric[k] += metric_report.TotalMetric;
+        batch_param.push_back(my_param);
+        batch_ik.push_back(std::make_pair(i, k));
         }
       }
 
+    // Compute all the metrics
+    std::vector<MultiComponentMetricReport> batch_report;
+    greedy_api.ComputeMetrics(batch_param, batch_report);
+
+    std::vector<double> accum_metric(m_Slices.size(), 0.0);
+    for(unsigned int j = 0; j < batch_param.size(); j++)
+      {
+      unsigned int i = batch_ik[j].first, k = batch_ik[j].second;
+      printf("Slide %03d matrix %03d metric %8.4f\n", i, k, batch_report[j].TotalMetric);
+      accum_metric[k] += batch_report[j].TotalMetric;
+      }
+
     // Now find the matrix with the best overall metric
     int k_best = -1; double m_best = 0.0;
     for(unsigned int k = 0; k < m_Slices.size(); k++)
@@ -1224,6 +1568,45 @@ public:
 
 
 
+  // Helper function: find the closest leader slices before and after slice k
+  slice_ref_set FindAdjacentLeaders(unsigned int k) const
+  {
+    slice_ref_set k_nbr;
+
+    // Find slice before k that is a leader slice
+    for(auto itr = m_SortedSlices.rbegin(); itr != m_SortedSlices.rend(); itr++)
+      {
+      if(itr->first < m_Slices[k].z_pos && m_Slices[itr->second].is_leader)
+        {
+        k_nbr.insert(*itr);
+        break;
+        }
+      }
+
+    // Find slice after k that is a leader slice
+    for(auto itf = m_SortedSlices.begin(); itf != m_SortedSlices.end(); itf++)
+      {
+      if(itf->first > m_Slices[k].z_pos && m_Slices[itf->second].is_leader)
+        {
+        k_nbr.insert(*itf);
+        break;
+        }
+      }
+
+    return k_nbr;
+  }
+
+  // Helper function: start reading the images that GetSlideOrAlternative would
+  // load for slide k in the background
+  void PrefetchSlideOrAlternative(ImageCache &slice_cache, int k,
+                                  const std::map<std::string, std::string> &alternates)
+  {
+    const auto &it = alternates.find(m_Slices[k].unique_id);
+    if(it != alternates.end())
+      slice_cache.Prefetch<SlideImageType>(it->second);
+    slice_cache.Prefetch<SlideImageType>(m_Slices[k].raw_filename);
+  }
+
   // Helper function: get the i-th slide or if an anternative manifest is provided, the corresponding
   // image from that manifest but remapped into the slide space
   SlideImagePointer GetSlideOrAlternative(ImageCache &slice_cache, int k,
@@ -1245,7 +1628,9 @@ public:
     // the origin and spacing so that the coordinates of the corners are indentical
     if(ignore_alt_header)
       {
+      // The header of the cached image is modified, which must not happen in two jobs at once
       SlideImagePointer main = slice_cache.GetImage<SlideImageType>(m_Slices[k].raw_filename);
+      std::lock_guard<std::mutex> lock(m_SlideHeaderMutex);
       alt->SetDirection(main->GetDirection());
       auto spc_main = main->GetSpacing(), spc_alt = spc_main;
       auto org_main = main->GetOrigin(), org_alt = org_main;
@@ -1277,11 +1662,12 @@ public:
                               const std::string &alt_volume,
                               const std::string &alt_slide_manifest,
                               bool ignore_masks,
+                              unsigned int n_jobs, unsigned int threads_per_job,
+                              bool checkpoint,
                               const GreedyParameters &gparam)
   {
-    // Set up a cache for loaded images. These images can be cycled in and out of memory
-    // depending on need. TODO: let user configure cache sizes
-    ImageCache slice_cache(0, 400);
+    // Loaded images are cycled in and out of memory by the project's image cache
+    ImageCache &slice_cache = m_ImageCache;
 
     // What iteration?
     if(i_first > i_last || i_first == 0 || i_last > n_affine + n_deform)
@@ -1303,8 +1689,12 @@ public:
       std::iota(ordering.begin(), ordering.end(), 0);
       std::random_shuffle(ordering.begin(), ordering.end());
 
-      // Keep track of which images have been visited already
-      std::vector<bool> visited(m_Slices.size(), false);
+      // Keep track of which images have been visited already. When slices are
+      // processed in parallel, all neighbors are taken from the previous iteration, so
+      // that the slices are independent of each other
+      std::vector<char> visited(m_Slices.size(), 0);
+      bool use_visited = (n_jobs <= 1);
+      std::mutex metric_mutex;
 
       // Keep track of the total neighbor metric and total volume metric
       double total_leader_to_nbr_metric = 0.0;
@@ -1317,9 +1707,31 @@ public:
       if(iter == i_first && i_init >= 0)
         prev_iter = (unsigned int) i_init;
 
-      // Iterate over the ordering
-      for(unsigned int k : ordering)
+      // Iterate over the ordering. Each job takes the next slice in the ordering
+      std::atomic<unsigned int> next_ord(0);
+      std::atomic<bool> failed(false);
+      auto worker = [&]()
+      {
+      for(unsigned int i_ord = next_ord++; i_ord < ordering.size() && !failed; i_ord = next_ord++)
         {
+        unsigned int k = ordering[i_ord];
+
+        // Read the images for the slide that comes up after the running ones, and its
+        // neighbors, in the background
+        if(i_ord + n_jobs < ordering.size())
+          {
+          unsigned int k_next = ordering[i_ord + n_jobs];
+          PrefetchSlideOrAlternative(slice_cache, k_next, alt_source);
+          slice_cache.Prefetch<SlideImageType>(
+                alt_volume.size()
+                ? GetFilenameForSlice(m_Slices[k_next], VOL_ALT_SLIDE, alt_volume.c_str())
+                : GetFilenameForSlice(m_Slices[k_next], VOL_SLIDE));
+          if(m_UseMasks && !ignore_masks)
+            slice_cache.Prefetch<MaskImageType>(m_Slices[k_next].mask_filename);
+          for(auto nbr : FindAdjacentLeaders(k_next))
+            PrefetchSlideOrAlternative(slice_cache, nbr.second, alt_source);
+          }
+
         // The output filename for this affine registration
         std::string fn_result =
             iter <= n_affine
@@ -1387,32 +1799,12 @@ public:
          * distance, and detecting and down-weighting 'bad' slices. For now just pick the slices
          * immediately below and above the current slice
          */
-        slice_ref_set k_nbr;
+        slice_ref_set k_nbr = FindAdjacentLeaders(k);
 
         // Keep track of total weight when using distance proportional weighting
         double tot_dist_wgt = 0.0;
-
-        // Find slice before k that is a leader slice
-        for(auto itr = m_SortedSlices.rbegin(); itr != m_SortedSlices.rend(); itr++)
-          {
-          if(itr->first < m_Slices[k].z_pos && m_Slices[itr->second].is_leader)
-            {
-            k_nbr.insert(*itr);
-            tot_dist_wgt += 1.0 / (m_Slices[k].z_pos - itr->first);
-            break;
-            }
-          }
-
-        // Find slice after k that is a leader slice
-        for(auto itf = m_SortedSlices.begin(); itf != m_SortedSlices.end(); itf++)
-          {
-          if(itf->first > m_Slices[k].z_pos && m_Slices[itf->second].is_leader)
-            {
-            k_nbr.insert(*itf);
-            tot_dist_wgt += 1.0 / (itf->first - m_Slices[k].z_pos);
-            break;
-            }
-          }
+        for(auto nbr : k_nbr)
+          tot_dist_wgt += 1.0 / fabs(m_Slices[k].z_pos - nbr.first);
 
         // Set up the prototype parameters (shared by all registrations) and parameters
         // specific for each registration that will need to be done
@@ -1436,6 +1828,11 @@ public:
 
           // Make sure the warps are not truncated, since histology is full-resolution
           param_reg.warp_precision = 0.0;
+
+          // Checkpoint the registrations of this slice next to its result, so that an
+          // interrupted run picks up where it left off within the slice
+          if(checkpoint)
+            param_reg.checkpoint_file = fn_result + ".checkpoint";
           }
 
         // Data associated with each moving image
@@ -1483,7 +1880,7 @@ public:
           SlideImagePointer native_neighbor = GetSlideOrAlternative(slice_cache, j, alt_source);
 
           // Which iteration to use, current or previous
-          unsigned int nbr_iter = visited[j] ? iter : prev_iter;
+          unsigned int nbr_iter = (use_visited && visited[j]) ? iter : prev_iter;
 
           // Figure out which matrix/warp to use
           std::string fn_matrix_j = GetFilenameForSlice(m_Slices[j], VOL_ITER_MATRIX, nbr_iter);
@@ -1719,9 +2116,18 @@ public:
             // Repeat over all target images
             for(unsigned int i = 0; i < targets.size(); i++)
               {
+              // Each target has its own checkpoint
+              GreedyParameters param_tgt = param_reg;
+              if(param_reg.checkpoint_file.size())
+                {
+                char suffix[32];
+                sprintf(suffix, ".%02d", i);
+                param_tgt.checkpoint_file = param_reg.checkpoint_file + suffix;
+                }
+
               // Do the deformable registration
               MultiComponentMetricReport mrpt =
-                DoLogDemonsRegistration(param_reg, resliced_slide, targets[i].image, resliced_mask, work_img);
+                DoLogDemonsRegistration(param_tgt, resliced_slide, targets[i].image, resliced_mask, work_img);
 
               // Record the metric
               targets[i].direct_reg_metric = mrpt.TotalMetric;
@@ -1860,6 +2266,7 @@ public:
           fprintf(f_dump, "%s\t%8.4f\t%8.4f\n", targets[i].desc.c_str(), targets[i].direct_reg_metric, mval);
 
           // Add the metric to the appropriate column
+          std::lock_guard<std::mutex> lock(metric_mutex);
           if(m_Slices[k].is_leader)
             {
             if(targets[i].flag_to_vol)
@@ -1878,13 +2285,18 @@ public:
         fclose(f_dump);
 
         // Mark this slice as visited
-        visited[k] = true;
+        visited[k] = 1;
         }
+      };
+
+      RunConcurrentJobs(worker, std::max(1u, n_jobs), threads_per_job, failed);
 
       printf("ITER %3d  METRICS: L2V = %8.4f  L2N = %8.4f  NL2V = %8.4f  NL2N = %8.4F\n",
              iter, total_leader_to_vol_metric, total_leader_to_nbr_metric,
              total_nonleader_to_vol_metric, total_nonleader_to_nbr_metric);
       }
+
+    slice_cache.PrintStatistics();
   }
 
 
@@ -1929,12 +2341,19 @@ public:
 
   void Splat(const SplatParameters &sparam, const GreedyParameters &gparam)
   {
+    // Only the exact mode is currently supported
+    if(sparam.mode != SplatParameters::EXACT)
+      throw GreedyException("Only exact mode is implemented.");
+
     // The target volume into which we will be doing the splatting. It must either
-    // be read from file or generated based on the 2D slices in the project
+    // be read from file or generated based on the 2D slices in the project. When
+    // splatting out of core, only the header of the target is set up here, and the
+    // voxels are produced one slab at a time as the output is written
     LDDMMType3D::CompositeImagePointer target;
+    bool out_of_core = sparam.slab_size > 0;
 
-    // Use an image cache
-    ImageCache icache(0, 20);
+    // Use the project's image cache
+    ImageCache &icache = m_ImageCache;
 
     // Before allocating the target, we need to know how many components to use. For
     // this we need to load the reference (root) slide
@@ -1971,17 +2390,39 @@ public:
                              alt_source.size());
       }
 
+    // The value assigned to voxels that no slide maps to
+    LDDMMType3D::CompositeImageType::PixelType background;
+    background.SetSize(n_comp_out);
+    background.Fill(gparam.current_interp.outside_value);
+
     // Was a referene volume specified?
     if(sparam.reference.length())
       {
-      // If the reference volume is specified, use it
-      LDDMMType3D::CompositeImagePointer ref = LDDMMType3D::cimg_read(sparam.reference.c_str());
-
-      // Create a new reference volume
-      if(ref->GetNumberOfComponentsPerPixel() == n_comp_out)
-        target = ref;
+      if(out_of_core)
+        {
+        // Read just the header of the reference volume. Slices that no slide maps
+        // to are filled with the background value rather than the reference voxels
+        typedef itk::ImageFileReader<LDDMMType3D::CompositeImageType> ReaderType;
+        ReaderType::Pointer reader = ReaderType::New();
+        reader->SetFileName(sparam.reference.c_str());
+        reader->UpdateOutputInformation();
+
+        target = LDDMMType3D::CompositeImageType::New();
+        target->CopyInformation(reader->GetOutput());
+        target->SetRegions(reader->GetOutput()->GetLargestPossibleRegion());
+        target->SetNumberOfComponentsPerPixel(n_comp_out);
+        }
       else
-        target = LDDMMType3D::new_cimg(ref, (int) n_comp_out);
+        {
+        // If the reference volume is specified, use it
+        LDDMMType3D::CompositeImagePointer ref = LDDMMType3D::cimg_read(sparam.reference.c_str());
+
+        // Create a new reference volume
+        if(ref->GetNumberOfComponentsPerPixel() == n_comp_out)
+          target = ref;
+        else
+          target = LDDMMType3D::new_cimg(ref, (int) n_comp_out);
+        }
       }
     else
       {
@@ -2052,25 +2493,39 @@ public:
       target->SetSpacing(spacing_3d);
       target->SetDirection(dir_3d);
       target->SetNumberOfComponentsPerPixel(n_comp_out);
-      target->Allocate();
-
-      LDDMMType3D::CompositeImageType::PixelType cpix;
-      cpix.SetSize(n_comp_out);
-      cpix.Fill(gparam.current_interp.outside_value);
-      target->FillBuffer(cpix);
+      if(!out_of_core)
+        {
+        target->Allocate();
+        target->FillBuffer(background);
+        }
       }
 
 
     // In addition to the target, we need a 2D reference image, which we will use
-    // as the target for 2D reslice operations
-    LDDMMType::CompositeImagePointer ref_2d = ExtractSliceFromVolume(target, target->GetOrigin()[2]);
+    // as the target for 2D reslice operations. Out of core, it is taken from a
+    // blank first slice of the target, since only the geometry of it matters
+    LDDMMType3D::CompositeImagePointer ref_vol = target;
+    if(out_of_core)
+      {
+      LDDMMType3D::RegionType region_first = target->GetLargestPossibleRegion();
+      region_first.SetSize(2, 1);
+      ref_vol = LDDMMType3D::CompositeImageType::New();
+      ref_vol->CopyInformation(target);
+      ref_vol->SetRegions(region_first);
+      ref_vol->SetNumberOfComponentsPerPixel(n_comp_out);
+      ref_vol->Allocate();
+      ref_vol->FillBuffer(background);
+      }
+    LDDMMType::CompositeImagePointer ref_2d = ExtractSliceFromVolume(ref_vol, target->GetOrigin()[2]);
 
     // In exact mode, we are not splatting, but rather just sampling along the z-axis.
-    if(sparam.mode == SplatParameters::EXACT)
+    // This is done for the buffered region of a slab, which out of core is just a
+    // part of the target volume, and otherwise the whole target volume.
+    auto splat_slab = [&](LDDMMType3D::CompositeImageType *slab)
       {
-      // We will iterate over the slices in the 3D volume
+      // We will iterate over the slices in the slab
       typedef itk::ImageSliceIteratorWithIndex<LDDMMType3D::CompositeImageType> SliceIter;
-      SliceIter it_slice(target, target->GetBufferedRegion());
+      SliceIter it_slice(slab, slab->GetBufferedRegion());
       it_slice.SetFirstDirection(0);
       it_slice.SetSecondDirection(1);
       for(; !it_slice.IsAtEnd(); it_slice.NextSlice())
@@ -2132,11 +2587,13 @@ public:
               typename InvertFilter::Pointer inv_ref = InvertFilter::New();
               inv_ref->SetInput(cmp_ref->GetOutput());
               inv_ref->SetMaximum(255);
+              ParallelFor::ApplyThreadQuota(inv_ref);
               inv_ref->Update();
 
               typename InvertFilter::Pointer inv_src = InvertFilter::New();
               inv_src->SetInput(cmp_src->GetOutput());
               inv_src->SetMaximum(255);
+              ParallelFor::ApplyThreadQuota(inv_src);
               inv_src->Update();
 
               hist->SetInput(inv_src->GetOutput());
@@ -2148,6 +2605,7 @@ public:
               hist->SetReferenceImage(cmp_ref->GetOutput());
               }
 
+            ParallelFor::ApplyThreadQuota(hist);
             hist->Update();
 
             if(sparam.histogram_invert)
@@ -2155,6 +2613,7 @@ public:
               typename InvertFilter::Pointer inv_out = InvertFilter::New();
               inv_out->SetInput(hist->GetOutput());
               inv_out->SetMaximum(255);
+              ParallelFor::ApplyThreadQuota(inv_out);
               inv_out->Update();
               compose->SetInput(i_comp, inv_out->GetOutput());
               }
@@ -2164,6 +2623,7 @@ public:
               }
             }
 
+          ParallelFor::ApplyThreadQuota(compose);
           compose->Update();
           img_source = compose->GetOutput();
           }
@@ -2241,16 +2701,53 @@ public:
         // Copy the pixels to destination. Some brute force pointer calculations here
         LDDMMType::CompositeImageType::InternalPixelType *p_src = resliced->GetBufferPointer();
         LDDMMType::CompositeImageType::InternalPixelType *p_trg =
-            target->GetBufferPointer() + it_slice.GetIndex()[2] * n_elts;
+            slab->GetBufferPointer()
+            + (it_slice.GetIndex()[2] - slab->GetBufferedRegion().GetIndex(2)) * n_elts;
 
         for(unsigned long i = 0; i < n_elts; i++)
           p_trg[i] = p_src[i];
         }
+      };
+
+    if(out_of_core)
+      {
+      // Let the writer pull the volume through a source that splats one slab at a time.
+      // Formats that cannot be written in pieces (e.g., compressed NIfTI) make the writer
+      // request the whole volume at once, so warn about that
+      unsigned int nz = target->GetLargestPossibleRegion().GetSize(2);
+      unsigned int n_slabs = (nz + sparam.slab_size - 1) / sparam.slab_size;
+      itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(
+                                       sparam.fn_output.c_str(), itk::ImageIOFactory::WriteMode);
+      if(io.IsNull() || !io->CanStreamWrite())
+        printf("Warning: format of %s does not support streamed writing, "
+               "the whole volume will be held in memory. Use .nii or .mha output.\n",
+               sparam.fn_output.c_str());
+
+      typedef CallbackImageSource<LDDMMType3D::CompositeImageType> SlabSource;
+      SlabSource::Pointer source = SlabSource::New();
+      source->SetReference(target);
+      source->SetFillFunction([&](LDDMMType3D::CompositeImageType *slab)
+        {
+        printf("Splatting slab %d to %d of %d\n",
+               (int) slab->GetBufferedRegion().GetIndex(2),
+               (int) (slab->GetBufferedRegion().GetIndex(2) + slab->GetBufferedRegion().GetSize(2) - 1),
+               (int) nz);
+        slab->FillBuffer(background);
+        splat_slab(slab);
+        });
+
+      LDDMMType3D::cimg_write(source->GetOutput(), sparam.fn_output.c_str(),
+                              itk::ImageIOBase::UNKNOWNCOMPONENTTYPE, n_slabs);
+      }
+    else
+      {
+      splat_slab(target);
+
+      // Write the image
+      LDDMMType3D::cimg_write(target, sparam.fn_output.c_str());
       }
-    else throw GreedyException("Only exact mode is implemented.");
 
-    // Write the image
-    LDDMMType3D::cimg_write(target, sparam.fn_output.c_str());
+    icache.PrintStatistics();
   }
 
   int FindSlideById(const std::string &id)
@@ -2327,12 +2824,16 @@ private:
   // Global parameters (parameters for the current run)
   StackParameters m_GlobalParam;
 
+  // Cache of images read from disk, shared by all stages
+  ImageCache m_ImageCache;
+
+  // Guards changes to the headers of cached slides
+  std::mutex m_SlideHeaderMutex;
+
   // A flat list of slices (in manifest order)
   std::vector<SliceData> m_Slices;
 
   // A list of slices sorted by the z-position
-  typedef std::pair<double, unsigned int> slice_ref;
-  typedef std::set<slice_ref> slice_ref_set;
   slice_ref_set m_SortedSlices;
 
   std::string GetFilenameForSlicePair(
@@ -2508,6 +3009,7 @@ void recon(StackParameters &param, CommandLineHelper &cl)
   double z_range = 0.0;
   double z_epsilon = 0.1;
   double z_exponent = 4.0;
+  unsigned int n_jobs = 1, threads_per_job = 0;
   std::string arg;
   while(cl.read_command(arg))
     {
@@ -2517,6 +3019,14 @@ void recon(StackParameters &param, CommandLineHelper &cl)
       z_exponent = cl.read_double();
       z_epsilon = cl.read_double();
       }
+    else if(arg == "-jobs")
+      {
+      n_jobs = (unsigned int) std::max(1, cl.read_integer());
+      }
+    else if(arg == "-job-threads")
+      {
+      threads_per_job = (unsigned int) std::max(1, cl.read_integer());
+      }
     else if(greedy_cmd.find(arg) != greedy_cmd.end())
       {
       gparam.ParseCommandLine(arg, cl);
@@ -2531,7 +3041,7 @@ void recon(StackParameters &param, CommandLineHelper &cl)
   // Create the project
   StackGreedyProject sgp(param.output_dir, param);
   sgp.RestoreProject();
-  sgp.ReconstructStack(z_range, z_exponent, z_epsilon, gparam);
+  sgp.ReconstructStack(z_range, z_exponent, z_epsilon, n_jobs, threads_per_job, gparam);
 }
 
 
@@ -2638,7 +3148,8 @@ void voliter(StackParameters &param, CommandLineHelper &cl)
 {
   // List of greedy commands that are recognized by this mode
   std::set<std::string> greedy_cmd {
-    "-m", "-n", "-threads", "-gm-trim", "-s", "-e", "-sv", "-exp", "-V", "-sv-incompr"
+    "-m", "-n", "-threads", "-gm-trim", "-s", "-e", "-sv", "-exp", "-V", "-sv-incompr",
+    "-checkpoint-interval"
   };
 
   // Greedy parameters for this mode
@@ -2653,6 +3164,8 @@ void voliter(StackParameters &param, CommandLineHelper &cl)
   bool dist_prop_wgt = false;
   bool multi_metric = false;
   bool ignore_masks = false;
+  bool checkpoint = false;
+  unsigned int n_jobs = 1, threads_per_job = 0;
   std::string alt_image, alt_slide_manifest;
 
   std::string arg;
@@ -2703,6 +3216,18 @@ void voliter(StackParameters &param, CommandLineHelper &cl)
       {
       ignore_masks = true;
       }
+    else if(arg == "-jobs")
+      {
+      n_jobs = (unsigned int) std::max(1, cl.read_integer());
+      }
+    else if(arg == "-job-threads")
+      {
+      threads_per_job = (unsigned int) std::max(1, cl.read_integer());
+      }
+    else if(arg == "-checkpoint")
+      {
+      checkpoint = true;
+      }
     else if(greedy_cmd.find(arg) != greedy_cmd.end())
       {
       gparam.ParseCommandLine(arg, cl);
@@ -2734,6 +3259,7 @@ void voliter(StackParameters &param, CommandLineHelper &cl)
     w_volume, w_volume_follower, 
     dist_prop_wgt, multi_metric, 
     alt_image, alt_slide_manifest, ignore_masks, 
+    n_jobs, threads_per_job, checkpoint,
     gparam);
 }
 
@@ -2830,6 +3356,10 @@ void splat(StackParameters &param, CommandLineHelper &cl)
       {
       sparam.histogram_invert = true;
       }
+    else if(arg == "-slab")
+      {
+      sparam.slab_size = (unsigned int) cl.read_integer();
+      }
     else if(greedy_cmd.find(arg) != greedy_cmd.end())
       {
       gparam.ParseCommandLine(arg, cl);
@@ -2875,6 +3405,10 @@ int main(int argc, char *argv[])
       {
       param.debug = true;
       }
+    else if(arg == "-cache-mem")
+      {
+      param.cache_memory = (unsigned long) (cl.read_double() * 1024.0 * 1024.0);
+      }
     else
       {
       std::cerr << "Unknown global option " << arg << std::endl;
@@ -54,8 +54,19 @@
 #include "itkMinimumMaximumImageFilter.h"
 #include "itkTernaryFunctorImageFilter.h"
 #include "itkShiftScaleImageFilter.h"
+#include "itkBSplineInterpolateImageFunction.h"
+#include "itk_zlib.h"
+#include "itkByteSwapper.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include <cstdlib>
+#include <limits>
 
 #include "FastWarpCompositeImageFilter.h"
+#include "ParallelFor.h"
+#include "DisplacementJacobianSquaringFilter.h"
+#include "OneDimensionalInPlaceGaussianFilter.h"
+#include "ParallelGzip.h"
 
 template <class TFloat, uint VDim>
 void 
@@ -75,7 +86,7 @@ LDDMMData<TFloat, VDim>
   img->SetRegions(ref->GetBufferedRegion());
   img->CopyInformation(ref);
   img->Allocate();
-  img->FillBuffer(Vec(0.0));
+  ParallelFor::FillFirstTouch(img->GetBufferPointer(), (long) img->GetPixelContainer()->Size(), Vec(0.0));
 }
 
 template <class TFloat, uint VDim>
@@ -96,7 +107,7 @@ LDDMMData<TFloat, VDim>
   img->SetRegions(ref->GetBufferedRegion());
   img->CopyInformation(ref);
   img->Allocate();
-  img->FillBuffer(Mat());
+  ParallelFor::FillFirstTouch(img->GetBufferPointer(), (long) img->GetPixelContainer()->Size(), Mat());
 }
 
 template <class TFloat, uint VDim>
@@ -118,11 +129,7 @@ LDDMMData<TFloat, VDim>
   img->CopyInformation(ref);
   img->SetNumberOfComponentsPerPixel(n_comp);
   img->Allocate();
-
-  typename CompositeImageType::PixelType cpix;
-  cpix.SetSize(n_comp);
-  cpix.Fill(0.0);
-  img->FillBuffer(cpix);
+  ParallelFor::FillFirstTouch(img->GetBufferPointer(), (long) img->GetPixelContainer()->Size(), (TFloat) 0.0);
 }
 
 template <class TFloat, uint VDim>
@@ -143,7 +150,7 @@ LDDMMData<TFloat, VDim>
   img->SetRegions(ref->GetBufferedRegion());
   img->CopyInformation(ref);
   img->Allocate();
-  img->FillBuffer(0.0);
+  ParallelFor::FillFirstTouch(img->GetBufferPointer(), (long) img->GetPixelContainer()->Size(), (TFloat) 0.0);
 }
 
 template <class TFloat, uint VDim>
@@ -221,6 +228,46 @@ LDDMMData<TFloat, VDim>
     }
 }
 
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::compute_gaussian_kernel_ft(ImageType *kernel, Vec sigma_vox)
+{
+  // The transform of a Gaussian is a Gaussian, exp(-2 pi^2 sigma^2 f^2), with the
+  // frequency f in cycles per voxel. Indices past n/2 are negative frequencies
+  ImageIterator it(kernel, kernel->GetBufferedRegion());
+  itk::Size<VDim> sz = kernel->GetBufferedRegion().GetSize();
+  for(; !it.IsAtEnd(); ++it)
+    {
+    double arg = 0.0;
+    for(uint j = 0; j < VDim; j++)
+      {
+      double k = it.GetIndex()[j];
+      double f = std::min(k, sz[j] - k) / sz[j];
+      arg += sigma_vox[j] * sigma_vox[j] * f * f;
+      }
+    it.Set((TFloat) exp(-2.0 * vnl_math::pi * vnl_math::pi * arg));
+    }
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::compute_navier_stokes_green_kernel_ft(ImageType *kernel, double alpha, double gamma)
+{
+  // The discrete Laplacian has eigenvalues -sum_j 2 (1 - cos(2 pi k_j / n_j))
+  ImageIterator it(kernel, kernel->GetBufferedRegion());
+  itk::Size<VDim> sz = kernel->GetBufferedRegion().GetSize();
+  for(; !it.IsAtEnd(); ++it)
+    {
+    double val = 0.0;
+    for(uint j = 0; j < VDim; j++)
+      val += 2.0 * (1.0 - cos(it.GetIndex()[j] * 2.0 * vnl_math::pi / sz[j]));
+    double k = 1.0 + (alpha / gamma) * val;
+    it.Set((TFloat) (1.0 / (k * k)));
+    }
+}
+
 template <class TFloat, uint VDim>
 void 
 LDDMMData<TFloat, VDim>
@@ -235,6 +282,7 @@ LDDMMData<TFloat, VDim>
   wf->SetDeformationScaling(def_scale);
   wf->SetUseNearestNeighbor(use_nn);
   wf->SetUsePhysicalSpace(phys_space);
+  ParallelFor::ApplyThreadQuota(wf);
   wf->Update();
 }
 
@@ -245,16 +293,81 @@ LDDMMData<TFloat, VDim>
   const VectorImageType *src, VectorImageType *trg, VectorImageType *work,
   int exponent, TFloat scale)
 {
+  // Each squaring alternates between trg and work. Start in whichever image makes
+  // the final result end up in trg
+  VectorImageType *buf[2] = { trg, work };
+  int k = exponent % 2;
+
   // Scale the image if needed
   if(scale != 1.0)
-    vimg_scale(src, scale, trg);
+    vimg_scale(src, scale, buf[k]);
   else
-    vimg_copy(src, trg);
+    vimg_copy(src, buf[k]);
 
-  for(int q = 0; q < exponent; q++)
+  // A single filter computes u(x + u(x)) + u(x) in one pass for each squaring
+  typedef FastWarpCompositeImageFilter<VectorImageType, VectorImageType, VectorImageType> WF;
+  typename WF::Pointer wf = WF::New();
+  wf->SetAddDeformationField(true);
+
+  for(int q = 0; q < exponent; q++, k = 1 - k)
     {
-    interp_vimg(trg, trg, 1.0, work);
-    vimg_add_in_place(trg, work);
+    wf->SetDeformationField(buf[k]);
+    wf->SetMovingImage(buf[k]);
+    wf->GraftOutput(buf[1 - k]);
+
+    // The inputs repeat every other step and are modified in place, so force an update
+    wf->Modified();
+    ParallelFor::ApplyThreadQuota(wf);
+    wf->Update();
+    }
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_exp_with_inverse(
+  const VectorImageType *src, VectorImageType *trg, VectorImageType *trg_inv,
+  VectorImageType *work, VectorImageType *work_inv,
+  int exponent, TFloat scale)
+{
+  // Same buffer alternation as in vimg_exp, for both the forward and inverse fields
+  VectorImageType *buf[2] = { trg, work };
+  VectorImageType *buf_inv[2] = { trg_inv, work_inv };
+  int k = exponent % 2;
+
+  // Scale the source into both starting buffers in a single pass
+  typedef itk::ImageRegionConstIterator<VectorImageType> SrcIter;
+  typedef itk::ImageRegionIterator<VectorImageType> TrgIter;
+  typename VectorImageType::RegionType region = src->GetBufferedRegion();
+  SrcIter it_src(src, region);
+  TrgIter it_fwd(buf[k], region), it_inv(buf_inv[k], region);
+  for(; !it_src.IsAtEnd(); ++it_src, ++it_fwd, ++it_inv)
+    {
+    it_fwd.Set(it_src.Get() * scale);
+    it_inv.Set(it_src.Get() * (-scale));
+    }
+
+  // One fused composition filter for each direction
+  typedef FastWarpCompositeImageFilter<VectorImageType, VectorImageType, VectorImageType> WF;
+  typename WF::Pointer wf = WF::New(), wf_inv = WF::New();
+  wf->SetAddDeformationField(true);
+  wf_inv->SetAddDeformationField(true);
+
+  for(int q = 0; q < exponent; q++, k = 1 - k)
+    {
+    wf->SetDeformationField(buf[k]);
+    wf->SetMovingImage(buf[k]);
+    wf->GraftOutput(buf[1 - k]);
+    wf->Modified();
+    ParallelFor::ApplyThreadQuota(wf);
+    wf->Update();
+
+    wf_inv->SetDeformationField(buf_inv[k]);
+    wf_inv->SetMovingImage(buf_inv[k]);
+    wf_inv->GraftOutput(buf_inv[1 - k]);
+    wf_inv->Modified();
+    ParallelFor::ApplyThreadQuota(wf_inv);
+    wf_inv->Update();
     }
 }
 
@@ -266,27 +379,46 @@ LDDMMData<TFloat, VDim>
   MatrixImageType *trg_jac, MatrixImageType *work_mat,
   int exponent, TFloat scale)
 {
+  // Each squaring alternates the displacement between trg and work and the Jacobian
+  // between trg_jac and work_mat. Start in whichever pair makes the final result
+  // end up in trg and trg_jac
+  VectorImageType *buf[2] = { trg, work };
+  MatrixImageType *buf_jac[2] = { trg_jac, work_mat };
+  int k = exponent % 2;
+
   // Scale the image if needed
   if(scale != 1.0)
-    vimg_scale(src, scale, trg);
+    vimg_scale(src, scale, buf[k]);
   else
-    vimg_copy(src, trg);
+    vimg_copy(src, buf[k]);
 
   // Compute the initial Jacobian
-  field_jacobian(trg, trg_jac);
+  field_jacobian(buf[k], buf_jac[k]);
 
-  // Perform the exponentiation
-  for(int q = 0; q < exponent; q++)
+  // The Jacobian images are handled as VDim x VDim component images
+  CompositeImagePointer wrap_jac[2];
+  for(int j = 0; j < 2; j++)
     {
-    // Compute the composition of the Jacobian with itself, place in jac_work
-    jacobian_of_composition(trg_jac, trg_jac, trg, work_mat);
-
-    // Copy the data (TODO: this is a little wasteful)
-    mimg_copy(work_mat, trg_jac);
+    wrap_jac[j] = CompositeImageType::New();
+    wrap_jac[j]->SetRegions(buf_jac[j]->GetBufferedRegion());
+    wrap_jac[j]->CopyInformation(buf_jac[j]);
+    wrap_jac[j]->SetNumberOfComponentsPerPixel(VDim * VDim);
+    wrap_jac[j]->GetPixelContainer()->SetImportPointer(
+      (TFloat *)(buf_jac[j]->GetPixelContainer()->GetImportPointer()),
+      VDim * VDim * buf_jac[j]->GetPixelContainer()->Size(), false);
+    }
 
-    // Update the velocity field
-    interp_vimg(trg, trg, 1.0, work);
-    vimg_add_in_place(trg, work);
+  // Each squaring updates the displacement and its Jacobian in a single pass
+  typedef DisplacementJacobianSquaringFilter<VectorImageType, CompositeImageType> SquaringFilter;
+  for(int q = 0; q < exponent; q++, k = 1 - k)
+    {
+    typename SquaringFilter::Pointer flt = SquaringFilter::New();
+    flt->SetDisplacementField(buf[k]);
+    flt->SetJacobian(wrap_jac[k]);
+    flt->SetOutputJacobian(wrap_jac[1-k]);
+    flt->GraftOutput(buf[1-k]);
+    ParallelFor::ApplyThreadQuota(flt);
+    flt->Update();
     }
 }
 
@@ -333,6 +465,7 @@ LDDMMData<TFloat, VDim>
   wf->SetUseNearestNeighbor(use_nn);
   wf->SetUsePhysicalSpace(phys_space);
   wf->SetOutsideValue(outside_value);
+  ParallelFor::ApplyThreadQuota(wf);
   wf->Update();
 
 /*
@@ -377,6 +510,43 @@ LDDMMData<TFloat, VDim>
   wf->SetUseNearestNeighbor(use_nn);
   wf->SetUsePhysicalSpace(phys_space);
   wf->SetOutsideValue(outside_value);
+  ParallelFor::ApplyThreadQuota(wf);
+  wf->Update();
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::interp_vimg(BrickedVectorImageType *data, VectorImageType *field,
+  TFloat def_scale, VectorImageType *out, bool use_nn, bool phys_space)
+{
+  typedef FastWarpCompositeImageFilter<BrickedVectorImageType, VectorImageType, VectorImageType> WF;
+  typename WF::Pointer wf = WF::New();
+  wf->SetDeformationField(field);
+  wf->SetMovingImage(data);
+  wf->GraftOutput(out);
+  wf->SetDeformationScaling(def_scale);
+  wf->SetUseNearestNeighbor(use_nn);
+  wf->SetUsePhysicalSpace(phys_space);
+  ParallelFor::ApplyThreadQuota(wf);
+  wf->Update();
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::interp_cimg(BrickedCompositeImageType *data, VectorImageType *field, CompositeImageType *out,
+              bool use_nn, bool phys_space, TFloat outside_value)
+{
+  typedef FastWarpCompositeImageFilter<BrickedCompositeImageType, CompositeImageType, VectorImageType> WF;
+  typename WF::Pointer wf = WF::New();
+  wf->SetDeformationField(field);
+  wf->SetMovingImage(data);
+  wf->GraftOutput(out);
+  wf->SetUseNearestNeighbor(use_nn);
+  wf->SetUsePhysicalSpace(phys_space);
+  wf->SetOutsideValue(outside_value);
+  ParallelFor::ApplyThreadQuota(wf);
   wf->Update();
 }
 
@@ -385,12 +555,13 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_add_in_place(VectorImageType *trg, VectorImageType *a)
 {
-  typedef itk::AddImageFilter<VectorImageType> AddFilter;
-  typename AddFilter::Pointer flt = AddFilter::New();
-  flt->SetInput(0,trg);
-  flt->SetInput(1,a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = (TFloat *) trg->GetBufferPointer();
+  const TFloat *p_a = (const TFloat *) a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size() * VDim, 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] += p_a[i];
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -398,12 +569,13 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_subtract_in_place(VectorImageType *trg, VectorImageType *a)
 {
-  typedef itk::SubtractImageFilter<VectorImageType> SubtractFilter;
-  typename SubtractFilter::Pointer flt = SubtractFilter::New();
-  flt->SetInput(0,trg);
-  flt->SetInput(1,a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = (TFloat *) trg->GetBufferPointer();
+  const TFloat *p_a = (const TFloat *) a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size() * VDim, 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] -= p_a[i];
+    });
 }
 
 // Scalar math
@@ -412,13 +584,13 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_multiply_in_place(VectorImageType *trg, ImageType *s)
 {
-  typedef itk::MultiplyImageFilter<
-    VectorImageType, ImageType, VectorImageType> MultiplyFilter;
-  typename MultiplyFilter::Pointer flt = MultiplyFilter::New();
-  flt->SetInput1(trg);
-  flt->SetInput2(s);
-  flt->GraftOutput(trg);
-  flt->Update();
+  Vec *p_trg = trg->GetBufferPointer();
+  const TFloat *p_s = s->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] *= p_s[i];
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -426,12 +598,12 @@ void
 LDDMMData<TFloat, VDim>
 ::img_scale_in_place(ImageType *img, TFloat scale)
 {
-  typedef itk::ShiftScaleImageFilter<ImageType, ImageType> FilterType;
-  typename FilterType::Pointer filter = FilterType::New();
-  filter->SetScale(scale);
-  filter->SetInput(img);
-  filter->GraftOutput(img);
-  filter->Update();
+  TFloat *p = img->GetBufferPointer();
+  ParallelFor::Run((long) img->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p[i] *= scale;
+    });
 }
 
 
@@ -446,6 +618,7 @@ LDDMMData<TFloat, VDim>
   flt->SetInput1(trg);
   flt->SetInput2(s);
   flt->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -456,12 +629,13 @@ void
 LDDMMData<TFloat, VDim>
 ::img_add_in_place(ImageType *trg, ImageType *a)
 {
-  typedef itk::AddImageFilter<ImageType> AddFilter;
-  typename AddFilter::Pointer flt = AddFilter::New();
-  flt->SetInput(0,trg);
-  flt->SetInput(1,a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = trg->GetBufferPointer();
+  const TFloat *p_a = a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] += p_a[i];
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -469,12 +643,13 @@ void
 LDDMMData<TFloat, VDim>
 ::img_subtract_in_place(ImageType *trg, ImageType *a)
 {
-  typedef itk::SubtractImageFilter<ImageType> SubtractFilter;
-  typename SubtractFilter::Pointer flt = SubtractFilter::New();
-  flt->SetInput(0,trg);
-  flt->SetInput(1,a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = trg->GetBufferPointer();
+  const TFloat *p_a = a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] -= p_a[i];
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -482,12 +657,13 @@ void
 LDDMMData<TFloat, VDim>
 ::img_multiply_in_place(ImageType *trg, ImageType *a)
 {
-  typedef itk::MultiplyImageFilter<ImageType> MultiplyFilter;
-  typename MultiplyFilter::Pointer flt = MultiplyFilter::New();
-  flt->SetInput(0,trg);
-  flt->SetInput(1,a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = trg->GetBufferPointer();
+  const TFloat *p_a = a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] *= p_a[i];
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -556,6 +732,7 @@ LDDMMData<TFloat, VDim>
   flt->SetFunctor(func);
   flt->SetInput(trg);
   flt->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -594,6 +771,7 @@ LDDMMData<TFloat, VDim>
   flt->SetFunctor(func);
   flt->SetInput(trg);
   flt->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -619,6 +797,7 @@ LDDMMData<TFloat, VDim>
   typedef itk::MinimumMaximumImageFilter<ImageType> FilterType;
   typename FilterType::Pointer filter = FilterType::New();
   filter->SetInput(src);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
   out_min = filter->GetMinimum();
   out_max = filter->GetMaximum();
@@ -649,17 +828,12 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_scale_in_place(VectorImageType *trg, TFloat s)
 {
-  typedef VectorScaleFunctor<TFloat, VDim> Functor;
-  typedef itk::UnaryFunctorImageFilter<
-    VectorImageType, VectorImageType, Functor> Filter;
-  typename Filter::Pointer flt = Filter::New();
-
-  Functor func;
-  func.Scale = s;
-  flt->SetFunctor(func);
-  flt->SetInput(trg);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = (TFloat *) trg->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size() * VDim, 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] *= s;
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -667,17 +841,13 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_scale(const VectorImageType*src, TFloat s, VectorImageType *trg)
 {
-  typedef VectorScaleFunctor<TFloat, VDim> Functor;
-  typedef itk::UnaryFunctorImageFilter<
-    VectorImageType, VectorImageType, Functor> Filter;
-  typename Filter::Pointer flt = Filter::New();
-
-  Functor func;
-  func.Scale = s;
-  flt->SetFunctor(func);
-  flt->SetInput(src);
-  flt->GraftOutput(trg);
-  flt->Update();
+  const TFloat *p_src = (const TFloat *) src->GetBufferPointer();
+  TFloat *p_trg = (TFloat *) trg->GetBufferPointer();
+  ParallelFor::Run((long) src->GetPixelContainer()->Size() * VDim, 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] = p_src[i] * s;
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -704,18 +874,13 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_add_scaled_in_place(VectorImageType *trg, VectorImageType *a, TFloat s)
 {
-  typedef VectorScaleAddFunctor<TFloat, VDim> Functor;
-  typedef itk::BinaryFunctorImageFilter<
-    VectorImageType, VectorImageType, VectorImageType, Functor> Filter;
-  typename Filter::Pointer flt = Filter::New();
-
-  Functor func;
-  func.Scale = s;
-  flt->SetFunctor(func);
-  flt->SetInput1(trg);
-  flt->SetInput2(a);
-  flt->GraftOutput(trg);
-  flt->Update();
+  TFloat *p_trg = (TFloat *) trg->GetBufferPointer();
+  const TFloat *p_a = (const TFloat *) a->GetBufferPointer();
+  ParallelFor::Run((long) trg->GetPixelContainer()->Size() * VDim, 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      p_trg[i] += p_a[i] * s;
+    });
 }
 
 template <class TFloat, uint VDim>
@@ -755,6 +920,7 @@ LDDMMData<TFloat, VDim>
   flt->SetInput1(a);
   flt->SetInput2(b);
   flt->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -871,6 +1037,7 @@ LDDMMData<TFloat, VDim>
     rof->SetInput2(grad->GetOutput());
     rof->SetFunctor(rop);
     rof->GraftOutput(out);
+    ParallelFor::ApplyThreadQuota(rof);
     rof->Update();
     }
 }
@@ -909,6 +1076,7 @@ LDDMMData<TFloat, VDim>
     typename CompFilterType::Pointer comp2 = CompFilterType::New();
     comp2->SetIndex(a);
     comp2->SetInput(grad->GetOutput());
+    ParallelFor::ApplyThreadQuota(comp2);
     comp2->Update();
 
     // Add the result
@@ -948,6 +1116,7 @@ LDDMMData<TFloat, VDim>
   flt->SetInput1(out_Dw);
   flt->SetInput2(Dv);
   flt->GraftOutput(out_Dw);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -994,6 +1163,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput(M);
   filter->SetFunctor(functor);
   filter->GraftOutput(out_det);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1050,6 +1220,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput3(b);
   filter->SetFunctor(functor);
   filter->GraftOutput(out);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1058,35 +1229,16 @@ LDDMMData<TFloat, VDim>
 template <class TFloat, uint VDim>
 void 
 LDDMMData<TFloat, VDim>
-::lie_bracket(VectorImageType *v, VectorImageType *u, MatrixImageType *work, VectorImageType *out)
+::lie_bracket(VectorImageType *v, VectorImageType *u, VectorImageType *out)
 {
-  // Compute Du, place it in work
-  field_jacobian(v, work);
-
-  // Multiply by v
-  mimg_vimg_product_plus_vimg(work, u, out, 1.0, 0.0, out);
-
-  // Compute Dv, place it in work
-  field_jacobian(u, work);
-
-  // Multiply by u and subtract from existing
-  mimg_vimg_product_plus_vimg(work, v, out, -1.0, 1.0, out);
-
-  // Alternative approach
-  VectorImagePointer alt = new_vimg(out);
-  
+  // Compute Dv u - Du v in a single stencil pass, without forming the Jacobians
   typedef LieBracketFilter<VectorImageType, VectorImageType> LieBracketFilterType;
   typename LieBracketFilterType::Pointer fltLieBracket = LieBracketFilterType::New();
   fltLieBracket->SetFieldU(v);
   fltLieBracket->SetFieldV(u);
-  fltLieBracket->GraftOutput(alt);
+  fltLieBracket->GraftOutput(out);
+  ParallelFor::ApplyThreadQuota(fltLieBracket);
   fltLieBracket->Update();
-
-  itk::Index<VDim> idx_probe; for(int a = 0; a < VDim; a++) idx_probe[a] = out->GetBufferedRegion().GetSize()[a] / 2;
-  Vec test1 = out->GetPixel(idx_probe);
-  Vec test2 = alt->GetPixel(idx_probe);
-  std::cout << "test1 = " << test1 << "   and   test2 = " << test2 << std::endl;
-  return;
 }
 
 
@@ -1101,6 +1253,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput(vec);
   filter->SetUseImageSpacingOff();
   filter->GraftOutput(out);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1116,6 +1269,7 @@ LDDMMData<TFloat, VDim>
   flt->GraftOutput(grad);
   flt->SetUseImageSpacing(use_spacing);
   flt->SetUseImageDirection(false);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -1131,6 +1285,7 @@ LDDMMData<TFloat, VDim>
   // flt->SetSigma(sigma);
   flt->SetVariance(sigma * sigma);
   flt->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(flt);
   flt->Update();
 }
 
@@ -1143,6 +1298,7 @@ LDDMMData<TFloat, VDim>
   typename Filter::Pointer fltSmooth = Filter::New();
   fltSmooth->SetInput(src);
   fltSmooth->SetSigmaArray(sigma);
+  ParallelFor::ApplyThreadQuota(fltSmooth);
   fltSmooth->Update();
 
   // TODO: this is a work-around for a stupid bug with this recursive filter. When the data
@@ -1171,6 +1327,7 @@ LDDMMData<TFloat, VDim>
   fltSmooth->SetSigmaArray(sigma);
   // fltSmooth->SetSigma(sigma);
   // fltSmooth->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(fltSmooth);
   fltSmooth->Update();
 
   // TODO: this is a work-around for a stupid bug with this recursive filter. When the data
@@ -1181,22 +1338,68 @@ LDDMMData<TFloat, VDim>
 template <class TFloat, uint VDim>
 void
 LDDMMData<TFloat, VDim>
-::vimg_smooth_withborder(VectorImageType *src, VectorImageType *trg, Vec sigma, int border_size)
+::vimg_smooth(VectorImageType *src, VectorImageType *trg, Vec sigma,
+              SmoothingMethod method, int box_passes)
 {
+  if(method == SMOOTH_ITK)
+    {
+    vimg_smooth(src, trg, sigma);
+    return;
+    }
 
-  // Define a region of interest
-  RegionType region = src->GetBufferedRegion();
-  region.ShrinkByRadius(border_size);
+  // Apply the 1D filter along each axis. The first pass reads from the source, the
+  // remaining passes filter the target in place. Sigma is in physical units.
+  typedef OneDimensionalInPlaceGaussianFilter<VectorImageType> FilterType;
+  for(uint d = 0; d < VDim; d++)
+    {
+    typename FilterType::Pointer flt = FilterType::New();
+    flt->SetInput(d == 0 ? src : trg);
+    flt->SetDimension(d);
+    flt->SetSigma(sigma[d] / src->GetSpacing()[d]);
+    flt->SetMethod(method == SMOOTH_BOX ? FilterType::EXTENDED_BOX : FilterType::RECURSIVE);
+    flt->SetNumberOfBoxPasses(box_passes);
+    flt->InPlaceOff();
+    flt->GraftOutput(trg);
+    ParallelFor::ApplyThreadQuota(flt);
+    flt->Update();
+    }
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_smooth_withborder(VectorImageType *src, VectorImageType *trg, Vec sigma, int border_size,
+                         SmoothingMethod method, int box_passes)
+{
 
   // Perform smoothing
-  vimg_smooth(src, trg, sigma);
+  vimg_smooth(src, trg, sigma, method, box_passes);
 
   // Clear the border
+  vimg_clear_border(trg, border_size);
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_clear_border(VectorImageType *trg, int border_size)
+{
+  // Define a region of interest
+  RegionType region = trg->GetBufferedRegion();
+  region.ShrinkByRadius(border_size);
+  vimg_clear_outside(trg, region);
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_clear_outside(VectorImageType *trg, const RegionType &interior)
+{
   Vec zerovec; zerovec.Fill(0);
   typedef itk::ImageRegionIteratorWithIndex<VectorImageType> VIterator;
   for(VIterator it(trg, trg->GetBufferedRegion()); !it.IsAtEnd(); ++it)
     {
-    if(!region.IsInside(it.GetIndex()))
+    if(!interior.IsInside(it.GetIndex()))
       {
       it.Set(zerovec);
       }
@@ -1204,16 +1407,12 @@ LDDMMData<TFloat, VDim>
 }
 
 
-template <class TFloat, unsigned int VDim>
-struct VectorSquareNormFunctor
+// Running range of the squared norm, for the fused reduction in vimg_norm_min_max
+template <class TFloat>
+struct NormSquareRange
 {
-  template <class TVector> TFloat operator() (const TVector &v)
-  {
-    TFloat norm_sqr = 0.0;
-    for(int i = 0; i < VDim; i++)
-      norm_sqr += v[i] * v[i];
-    return norm_sqr;
-  }
+  TFloat nsq_min, nsq_max;
+  NormSquareRange() : nsq_min(std::numeric_limits<TFloat>::max()), nsq_max(0.0) {}
 };
 
 template <class TFloat, uint VDim>
@@ -1222,19 +1421,33 @@ LDDMMData<TFloat, VDim>
 ::vimg_norm_min_max(VectorImageType *image, ImageType *normsqr,
                     TFloat &min_norm, TFloat &max_norm)
 {
-  // Compute the squared norm of the displacement
-  typedef VectorSquareNormFunctor<TFloat, VDim> NormFunctor;
-  typedef itk::UnaryFunctorImageFilter<VectorImageType, ImageType, NormFunctor> NormFilter;
-  typename NormFilter::Pointer fltNorm = NormFilter::New();
-  fltNorm->SetInput(image);
-  fltNorm->GraftOutput(normsqr);
-  fltNorm->Update();
+  // Compute the squared norm of the displacement and its range in a single pass
+  typedef NormSquareRange<TFloat> Range;
+  TFloat *p_nsq = normsqr ? normsqr->GetBufferPointer() : NULL;
+  Range r = vimg_reduce(image, Range(),
+    [p_nsq](Range &acc, long i, const Vec &v)
+      {
+      TFloat nsq = 0.0;
+      for(unsigned int d = 0; d < VDim; d++)
+        nsq += v[d] * v[d];
+      if(p_nsq)
+        p_nsq[i] = nsq;
+      acc.nsq_min = std::min(acc.nsq_min, nsq);
+      acc.nsq_max = std::max(acc.nsq_max, nsq);
+      },
+    [](const Range &x, const Range &y)
+      {
+      Range z;
+      z.nsq_min = std::min(x.nsq_min, y.nsq_min);
+      z.nsq_max = std::max(x.nsq_max, y.nsq_max);
+      return z;
+      });
 
-  // Compute the maximum squared norm of the displacement
-  img_min_max(normsqr, min_norm, max_norm);
+  if(image->GetPixelContainer()->Size() == 0)
+    r.nsq_min = 0.0;
 
-  min_norm = sqrt(min_norm);
-  max_norm = sqrt(max_norm);
+  min_norm = sqrt(r.nsq_min);
+  max_norm = sqrt(r.nsq_max);
 }
 
 template <class TFloat, uint VDim>
@@ -1243,20 +1456,12 @@ LDDMMData<TFloat, VDim>
 ::vimg_normalize_to_fixed_max_length(VectorImageType *trg, ImageType *normsqr,
                                      double max_displacement, bool scale_down_only)
 {
-  // Compute the squared norm of the displacement
-  typedef VectorSquareNormFunctor<TFloat, VDim> NormFunctor;
-  typedef itk::UnaryFunctorImageFilter<VectorImageType, ImageType, NormFunctor> NormFilter;
-  typename NormFilter::Pointer fltNorm = NormFilter::New();
-  fltNorm->SetInput(trg);
-  fltNorm->GraftOutput(normsqr);
-  fltNorm->Update();
-
-  // Compute the maximum squared norm of the displacement
-  TFloat nsq_min, nsq_max;
-  img_min_max(normsqr, nsq_min, nsq_max);
+  // Compute the maximum norm of the displacement
+  TFloat n_min, n_max;
+  vimg_norm_min_max(trg, normsqr, n_min, n_max);
 
   // Compute the scale functor
-  TFloat scale = max_displacement / sqrt(nsq_max);
+  TFloat scale = max_displacement / n_max;
 
   // Apply the scale
   if(scale_down_only && scale >= 1.0)
@@ -1265,24 +1470,108 @@ LDDMMData<TFloat, VDim>
     vimg_scale_in_place(trg, scale);
 }
 
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_compose(VectorImageType *a, VectorImageType *b, VectorImageType *out)
+{
+  // The warp filter samples a at x + b(x) and adds b(x) to the result
+  typedef FastWarpCompositeImageFilter<VectorImageType, VectorImageType, VectorImageType> WF;
+  typename WF::Pointer wf = WF::New();
+  wf->SetDeformationField(b);
+  wf->SetMovingImage(a);
+  wf->SetAddDeformationField(true);
+  wf->GraftOutput(out);
+  ParallelFor::ApplyThreadQuota(wf);
+  wf->Update();
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_refine_inverse(VectorImageType *u, VectorImageType *uinv,
+                      VectorImageType *work, unsigned int n_iter)
+{
+  // The iteration converges when u is a contraction, which holds for smooth updates
+  for(unsigned int i = 0; i < n_iter; i++)
+    {
+    interp_vimg(u, uinv, 1.0, work);
+    vimg_scale(work, -1.0, uinv);
+    }
+}
+
 
 
 namespace lddmm_data_io {
 
+template <class TImage>
+void
+write_image(TImage *image, const char *filename, unsigned int n_divisions)
+{
+  typedef itk::ImageFileWriter<TImage> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(image);
+
+  // Compressed files cannot be written in pieces
+  if(n_divisions > 1)
+    {
+    writer->SetFileName(filename);
+    writer->SetNumberOfStreamDivisions(n_divisions);
+    writer->Update();
+    return;
+    }
+
+  // With parallel gzip, the image is written uncompressed and then compressed
+  std::string fn_write = ParallelGzip::PrepareWrite(filename);
+  writer->SetFileName(fn_write.c_str());
+  writer->SetUseCompression(fn_write == filename);
+  try
+    {
+    writer->Update();
+    }
+  catch(...)
+    {
+    if(fn_write != filename)
+      remove(fn_write.c_str());
+    throw;
+    }
+  ParallelGzip::FinishWrite(filename, fn_write);
+}
+
+template <class TImage>
+typename TImage::Pointer
+read_image(const char *filename, itk::ImageIOBase::IOComponentType &comp)
+{
+  // Files compressed by ParallelGzip are decompressed in parallel first
+  std::string fn_read = ParallelGzip::PrepareRead(filename);
+
+  typedef itk::ImageFileReader<TImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(fn_read.c_str());
+  try
+    {
+    reader->Update();
+    }
+  catch(...)
+    {
+    ParallelGzip::FinishRead(filename, fn_read);
+    throw;
+    }
+  ParallelGzip::FinishRead(filename, fn_read);
+
+  comp = reader->GetImageIO()->GetComponentType();
+  typename TImage::Pointer image = reader->GetOutput();
+  return image;
+}
+
 template <class TInputImage, class TOutputImage>
 void
-write_cast(TInputImage *image, const char *filename)
+write_cast(TInputImage *image, const char *filename, unsigned int n_divisions)
 {
   typedef itk::CastImageFilter<TInputImage, TOutputImage> CastType;
   typename CastType::Pointer cast = CastType::New();
   cast->SetInput(image);
-
-  typedef itk::ImageFileWriter<TOutputImage> WriterType;
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetInput(cast->GetOutput());
-  writer->SetFileName(filename);
-  writer->SetUseCompression(true);
-  writer->Update();
+  write_image<TOutputImage>(cast->GetOutput(), filename, n_divisions);
 }
 
 
@@ -1312,47 +1601,43 @@ struct image_type_cast< itk::VectorImage<TPixel, VDim>, TOutputComponent>
 
 template <class TInputImage>
 void write_cast_to_iocomp(TInputImage *image, const char *filename,
-                          itk::ImageIOBase::IOComponentType comp)
+                          itk::ImageIOBase::IOComponentType comp,
+                          unsigned int n_divisions = 1)
 {
   switch(comp)
     {
     case itk::ImageIOBase::UCHAR :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned char>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned char>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::CHAR :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, char>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, char>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::USHORT :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned short>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned short>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::SHORT :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, short>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, short>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::UINT :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned int>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned int>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::INT :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, int>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, int>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::ULONG :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned long>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, unsigned long>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::LONG :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, long>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, long>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::FLOAT :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, float>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, float>::OutputImageType>(image, filename, n_divisions);
       break;
     case itk::ImageIOBase::DOUBLE :
-      write_cast<TInputImage, typename image_type_cast<TInputImage, double>::OutputImageType>(image, filename);
+      write_cast<TInputImage, typename image_type_cast<TInputImage, double>::OutputImageType>(image, filename, n_divisions);
       break;
     default:
-      typedef itk::ImageFileWriter<TInputImage> WriterType;
-      typename WriterType::Pointer writer = WriterType::New();
-      writer->SetInput(image);
-      writer->SetFileName(filename);
-      writer->SetUseCompression(true);
-      writer->Update();
+      write_image<TInputImage>(image, filename, n_divisions);
     }
 }
 
@@ -1388,6 +1673,56 @@ bool auto_cast(const TInputImage *source, itk::Object *target)
 }
 
 
+// Helpers for the quantized warp format. Large buffers are passed to zlib in
+// chunks because gzread/gzwrite take a 32-bit length
+inline void qwarp_put(gzFile f, const void *data, size_t n, const char *fn)
+{
+  const char *p = (const char *) data;
+  while(n > 0)
+    {
+    unsigned int chunk = (unsigned int) std::min(n, (size_t) (1 << 26));
+    if(gzwrite(f, p, chunk) != (int) chunk)
+      {
+      gzclose(f);
+      itkGenericExceptionMacro(<< "Error writing quantized warp " << fn);
+      }
+    p += chunk; n -= chunk;
+    }
+}
+
+inline void qwarp_get(gzFile f, void *data, size_t n, const char *fn)
+{
+  char *p = (char *) data;
+  while(n > 0)
+    {
+    unsigned int chunk = (unsigned int) std::min(n, (size_t) (1 << 26));
+    if(gzread(f, p, chunk) != (int) chunk)
+      {
+      gzclose(f);
+      itkGenericExceptionMacro(<< "Error reading quantized warp " << fn);
+      }
+    p += chunk; n -= chunk;
+    }
+}
+
+// Header fields are stored little-endian regardless of the host
+template <class T>
+inline void qwarp_put_le(gzFile f, const T *data, size_t n, const char *fn)
+{
+  std::vector<T> tmp(data, data + n);
+  itk::ByteSwapper<T>::SwapRangeFromSystemToLittleEndian(&tmp[0], n);
+  qwarp_put(f, &tmp[0], n * sizeof(T), fn);
+}
+
+template <class T>
+inline void qwarp_get_le(gzFile f, T *data, size_t n, const char *fn)
+{
+  qwarp_get(f, data, n * sizeof(T), fn);
+  itk::ByteSwapper<T>::SwapRangeFromSystemToLittleEndian(data, n);
+}
+
+static const char qwarp_magic[] = "GRDYQW02";
+
 } // namespace
 
 
@@ -1396,13 +1731,9 @@ typename LDDMMData<TFloat, VDim>::IOComponentType
 LDDMMData<TFloat, VDim>
 ::img_read(const char *fn, ImagePointer &trg)
 {
-  typedef itk::ImageFileReader<ImageType> ReaderType;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(fn);
-  reader->Update();
-  trg = reader->GetOutput();
-
-  return reader->GetImageIO()->GetComponentType();
+  IOComponentType comp;
+  trg = lddmm_data_io::read_image<ImageType>(fn, comp);
+  return comp;
 }
 
 template <class TFloat, uint VDim>
@@ -1426,9 +1757,10 @@ LDDMMData<TFloat, VDim>
 template <class TFloat, uint VDim>
 void
 LDDMMData<TFloat, VDim>
-::cimg_write(CompositeImageType *src, const char *fn, IOComponentType comp)
+::cimg_write(CompositeImageType *src, const char *fn, IOComponentType comp,
+             unsigned int n_divisions)
 {
-  lddmm_data_io::write_cast_to_iocomp(src, fn, comp);
+  lddmm_data_io::write_cast_to_iocomp(src, fn, comp, n_divisions);
 }
 
 
@@ -1437,13 +1769,15 @@ typename LDDMMData<TFloat, VDim>::IOComponentType
 LDDMMData<TFloat, VDim>
 ::vimg_read(const char *fn, VectorImagePointer &trg)
 {
-  typedef itk::ImageFileReader<VectorImageType> ReaderType;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(fn);
-  reader->Update();
-  trg = reader->GetOutput();
+  if(vimg_is_quantized(fn))
+    {
+    vimg_read_quantized(fn, trg);
+    return itk::ImageIOBase::FLOAT;
+    }
 
-  return reader->GetImageIO()->GetComponentType();
+  IOComponentType comp;
+  trg = lddmm_data_io::read_image<VectorImageType>(fn, comp);
+  return comp;
 }
 
 template <class TFloat, uint VDim>
@@ -1463,6 +1797,12 @@ void
 LDDMMData<TFloat, VDim>
 ::vimg_write(VectorImageType *src, const char *fn, IOComponentType comp)
 {
+  if(vimg_is_quantized(fn))
+    {
+    vimg_write_quantized(src, fn);
+    return;
+    }
+
   // Cast to vector image type
   typedef itk::VectorImage<TFloat, VDim> OutputImageType;
   typename OutputImageType::Pointer output = OutputImageType::New();
@@ -1479,18 +1819,260 @@ LDDMMData<TFloat, VDim>
   lddmm_data_io::write_cast_to_iocomp(output.GetPointer(), fn, comp);
 }
 
+template <class TFloat, uint VDim>
+bool
+LDDMMData<TFloat, VDim>
+::vimg_is_quantized(const char *fn)
+{
+  std::string s(fn);
+  return s.size() > 6 && s.compare(s.size() - 6, 6, ".qwarp") == 0;
+}
+
+/**
+ * Layout of the .qwarp file (gzip-compressed): 8 byte magic, int32 dimension,
+ * bits and shrink factor, then the full grid (int64 size, double origin,
+ * spacing and direction), the int64 size of the coarse grid, the double step
+ * of the coarse grid in full grid voxels, the double quantization scale and
+ * finally the quantized components, interleaved per voxel. All fields are
+ * little-endian. The coarse grid shares its origin with the full grid and its
+ * last sample falls on the last voxel, so the step is at most the shrink factor
+ * and the samples between voxels are linearly interpolated.
+ */
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_write_quantized(VectorImageType *src, const char *fn, int bits, int shrink)
+{
+  if(bits != 8 && bits != 16)
+    itkGenericExceptionMacro(<< "Quantized warps must use 8 or 16 bits, requested " << bits);
+  if(shrink < 1)
+    shrink = 1;
+
+  // Determine the size of the coarse grid, and the step that makes it span the
+  // full grid exactly
+  typename VectorImageType::RegionType region = src->GetBufferedRegion();
+  itk::int64_t sz_full[VDim], sz_low[VDim];
+  double step[VDim];
+  size_t n_low = 1;
+  for(uint d = 0; d < VDim; d++)
+    {
+    sz_full[d] = region.GetSize()[d];
+    sz_low[d] = (sz_full[d] - 1 + shrink - 1) / shrink + 1;
+    step[d] = sz_low[d] > 1 ? (sz_full[d] - 1) / (double) (sz_low[d] - 1) : 1.0;
+    n_low *= sz_low[d];
+    }
+
+  // Sample the displacements on the coarse grid, with linear interpolation
+  std::vector<TFloat> samples(n_low * VDim, 0.0);
+  double max_abs = 0.0;
+  for(size_t i = 0; i < n_low; i++)
+    {
+    size_t r = i;
+    itk::int64_t x0[VDim];
+    double fx[VDim];
+    for(uint d = 0; d < VDim; d++)
+      {
+      double x = (r % sz_low[d]) * step[d];
+      r /= sz_low[d];
+      x0[d] = std::max((itk::int64_t) 0, std::min((itk::int64_t) std::floor(x), sz_full[d] - 2));
+      fx[d] = std::max(0.0, std::min(1.0, x - x0[d]));
+      }
+
+    for(uint c = 0; c < (1u << VDim); c++)
+      {
+      double w = 1.0;
+      typename VectorImageType::IndexType idx;
+      for(uint d = 0; d < VDim; d++)
+        {
+        bool hi = (c >> d) & 1;
+        w *= hi ? fx[d] : 1.0 - fx[d];
+        idx[d] = region.GetIndex()[d] + x0[d] + (hi ? 1 : 0);
+        }
+      if(w == 0.0)
+        continue;
+
+      const Vec &v = src->GetPixel(idx);
+      for(uint d = 0; d < VDim; d++)
+        samples[i * VDim + d] += w * v[d];
+      }
+
+    for(uint d = 0; d < VDim; d++)
+      max_abs = std::max(max_abs, (double) std::fabs(samples[i * VDim + d]));
+    }
+
+  // Quantize the samples
+  int qmax = (bits == 8) ? 127 : 32767;
+  double scale = max_abs > 0.0 ? max_abs / qmax : 1.0;
+  size_t nbytes = bits / 8;
+  std::vector<unsigned char> qdata(samples.size() * nbytes);
+  for(size_t j = 0; j < samples.size(); j++)
+    {
+    int q = (int) std::floor(samples[j] / scale + 0.5);
+    q = std::max(-qmax, std::min(qmax, q));
+    unsigned int u = (unsigned int) q;
+    qdata[j * nbytes] = (unsigned char) (u & 0xff);
+    if(nbytes == 2)
+      qdata[j * nbytes + 1] = (unsigned char) ((u >> 8) & 0xff);
+    }
+
+  // Header fields
+  itk::int32_t hdr[3] = { (itk::int32_t) VDim, (itk::int32_t) bits, (itk::int32_t) shrink };
+  double origin[VDim], spacing[VDim], dir[VDim * VDim];
+  for(uint d = 0; d < VDim; d++)
+    {
+    origin[d] = src->GetOrigin()[d];
+    spacing[d] = src->GetSpacing()[d];
+    for(uint e = 0; e < VDim; e++)
+      dir[d * VDim + e] = src->GetDirection()(d, e);
+    }
+
+  gzFile f = gzopen(fn, "wb");
+  if(!f)
+    itkGenericExceptionMacro(<< "Unable to open " << fn << " for writing");
+
+  lddmm_data_io::qwarp_put(f, lddmm_data_io::qwarp_magic, 8, fn);
+  lddmm_data_io::qwarp_put_le(f, hdr, 3, fn);
+  lddmm_data_io::qwarp_put_le(f, sz_full, VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, origin, VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, spacing, VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, dir, VDim * VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, sz_low, VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, step, VDim, fn);
+  lddmm_data_io::qwarp_put_le(f, &scale, 1, fn);
+  lddmm_data_io::qwarp_put(f, &qdata[0], qdata.size(), fn);
+  gzclose(f);
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::vimg_read_quantized(const char *fn, VectorImagePointer &trg)
+{
+  gzFile f = gzopen(fn, "rb");
+  if(!f)
+    itkGenericExceptionMacro(<< "Unable to open " << fn << " for reading");
+
+  char magic[8];
+  lddmm_data_io::qwarp_get(f, magic, 8, fn);
+  if(strncmp(magic, lddmm_data_io::qwarp_magic, 8) != 0)
+    {
+    gzclose(f);
+    itkGenericExceptionMacro(<< fn << " is not a quantized warp file");
+    }
+
+  itk::int32_t hdr[3];
+  lddmm_data_io::qwarp_get_le(f, hdr, 3, fn);
+  if(hdr[0] != (itk::int32_t) VDim || (hdr[1] != 8 && hdr[1] != 16) || hdr[2] < 1)
+    {
+    gzclose(f);
+    itkGenericExceptionMacro(<< "Quantized warp " << fn << " has dimension " << hdr[0]
+                             << ", expected " << VDim);
+    }
+  int bits = hdr[1], shrink = hdr[2];
+
+  itk::int64_t sz_full[VDim], sz_low[VDim];
+  double origin[VDim], spacing[VDim], dir[VDim * VDim], step[VDim], scale;
+  lddmm_data_io::qwarp_get_le(f, sz_full, VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, origin, VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, spacing, VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, dir, VDim * VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, sz_low, VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, step, VDim, fn);
+  lddmm_data_io::qwarp_get_le(f, &scale, 1, fn);
+
+  // Geometry of the full and the coarse grids
+  typename VectorImageType::RegionType reg_full, reg_low;
+  typename VectorImageType::PointType org;
+  typename VectorImageType::SpacingType spc_full, spc_low;
+  typename VectorImageType::DirectionType dirm;
+  size_t n_low = 1;
+  for(uint d = 0; d < VDim; d++)
+    {
+    reg_full.SetSize(d, sz_full[d]);
+    reg_low.SetSize(d, sz_low[d]);
+    org[d] = origin[d];
+    spc_full[d] = spacing[d];
+    spc_low[d] = spacing[d] * step[d];
+    for(uint e = 0; e < VDim; e++)
+      dirm(d, e) = dir[d * VDim + e];
+    n_low *= sz_low[d];
+    }
+
+  size_t nbytes = bits / 8;
+  std::vector<unsigned char> qdata(n_low * VDim * nbytes);
+  lddmm_data_io::qwarp_get(f, &qdata[0], qdata.size(), fn);
+  gzclose(f);
+
+  // Dequantize onto the coarse grid
+  VectorImagePointer low = VectorImageType::New();
+  low->SetRegions(reg_low);
+  low->SetOrigin(org);
+  low->SetSpacing(spc_low);
+  low->SetDirection(dirm);
+  low->Allocate();
+
+  TFloat *p_low = (TFloat *) low->GetBufferPointer();
+  for(size_t j = 0; j < n_low * VDim; j++)
+    {
+    int q = (nbytes == 2)
+            ? (int) (short) (qdata[2 * j] | (qdata[2 * j + 1] << 8))
+            : (int) (signed char) qdata[j];
+    p_low[j] = (TFloat) (q * scale);
+    }
+
+  if(shrink == 1)
+    {
+    trg = low;
+    return;
+    }
+
+  // Upsample each component to the full grid using cubic B-splines
+  trg = VectorImageType::New();
+  trg->SetRegions(reg_full);
+  trg->SetOrigin(org);
+  trg->SetSpacing(spc_full);
+  trg->SetDirection(dirm);
+  trg->Allocate();
+  TFloat *p_full = (TFloat *) trg->GetBufferPointer();
+  size_t n_full = trg->GetPixelContainer()->Size();
+
+  for(uint a = 0; a < VDim; a++)
+    {
+    typedef itk::VectorIndexSelectionCastImageFilter<VectorImageType, ImageType> CompFilterType;
+    typename CompFilterType::Pointer comp = CompFilterType::New();
+    comp->SetIndex(a);
+    comp->SetInput(low);
+
+    typedef itk::BSplineInterpolateImageFunction<ImageType, double> InterpolatorType;
+    typename InterpolatorType::Pointer interp = InterpolatorType::New();
+    interp->SetSplineOrder(3);
+
+    typedef itk::ResampleImageFilter<ImageType, ImageType> ResampleFilterType;
+    typename ResampleFilterType::Pointer rs = ResampleFilterType::New();
+    rs->SetInput(comp->GetOutput());
+    rs->SetInterpolator(interp);
+    rs->SetSize(reg_full.GetSize());
+    rs->SetOutputOrigin(org);
+    rs->SetOutputSpacing(spc_full);
+    rs->SetOutputDirection(dirm);
+    rs->SetDefaultPixelValue(0.0);
+    ParallelFor::ApplyThreadQuota(rs);
+    rs->Update();
+
+    const TFloat *p_comp = rs->GetOutput()->GetBufferPointer();
+    for(size_t i = 0; i < n_full; i++)
+      p_full[i * VDim + a] = p_comp[i];
+    }
+}
+
 template <class TFloat, uint VDim>
 typename LDDMMData<TFloat, VDim>::IOComponentType
 LDDMMData<TFloat, VDim>
 ::cimg_read(const char *fn, CompositeImagePointer &trg)
 {
-  typedef itk::ImageFileReader<CompositeImageType> ReaderType;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(fn);
-  reader->Update();
-  trg = reader->GetOutput();
-
-  return reader->GetImageIO()->GetComponentType();
+  IOComponentType comp;
+  trg = lddmm_data_io::read_image<CompositeImageType>(fn, comp);
+  return comp;
 }
 
 
@@ -1529,6 +2111,7 @@ LDDMMData<TFloat, VDim>
   typename CastFilter::Pointer fltCast = CastFilter::New();
   fltCast->SetInput(src);
   fltCast->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(fltCast);
   fltCast->Update();
 }
 
@@ -1541,6 +2124,7 @@ LDDMMData<TFloat, VDim>
   typename CastFilter::Pointer fltCast = CastFilter::New();
   fltCast->SetInput(src);
   fltCast->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(fltCast);
   fltCast->Update();
 }
 
@@ -1553,6 +2137,7 @@ LDDMMData<TFloat, VDim>
   typename CastFilter::Pointer fltCast = CastFilter::New();
   fltCast->SetInput(src);
   fltCast->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(fltCast);
   fltCast->Update();
 }
 
@@ -1565,6 +2150,7 @@ LDDMMData<TFloat, VDim>
   typename CastFilter::Pointer fltCast = CastFilter::New();
   fltCast->SetInput(src);
   fltCast->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(fltCast);
   fltCast->Update();
 }
 
@@ -1603,6 +2189,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput(src);
   filter->SetShrinkFactors(factor);
   filter->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1625,6 +2212,7 @@ LDDMMData<TFloat, VDim>
   filter->UseReferenceImageOn();
   filter->SetReferenceImage(ref);
   filter->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1685,6 +2273,7 @@ LDDMMData<TFloat, VDim>
   trg->SetDirection(src->GetDirection());
   trg->Allocate();
   
+  ParallelFor::ApplyThreadQuota(fltSmooth);
   fltSmooth->Update();
   auto *smooth = fltSmooth->GetOutput();
 
@@ -1698,6 +2287,86 @@ LDDMMData<TFloat, VDim>
   filter->SetInterpolator(func);
 
   filter->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(filter);
+  filter->Update();
+}
+
+template <class TFloat, uint VDim>
+void
+LDDMMData<TFloat, VDim>
+::cimg_downsample(CompositeImageType *src, CompositeImageType *trg, double factor, Vec sigma)
+{
+  // Smooth all components together, one pass per axis. The first pass reads from the
+  // source, the remaining passes are applied in place
+  int nc = src->GetNumberOfComponentsPerPixel();
+  CompositeImagePointer smooth = CompositeImageType::New();
+  smooth->CopyInformation(src);
+  smooth->SetRegions(src->GetBufferedRegion());
+  smooth->SetNumberOfComponentsPerPixel(nc);
+  smooth->Allocate();
+
+  typedef OneDimensionalInPlaceGaussianFilter<CompositeImageType> SmoothType;
+  bool have_smooth = false;
+  for(uint d = 0; d < VDim; d++)
+    {
+    if(sigma[d] <= 0.0)
+      continue;
+
+    typename SmoothType::Pointer flt = SmoothType::New();
+    flt->SetInput(have_smooth ? smooth : src);
+    flt->SetDimension(d);
+    flt->SetSigma(sigma[d] / src->GetSpacing()[d]);
+    flt->SetMethod(SmoothType::RECURSIVE);
+    flt->InPlaceOff();
+    flt->GraftOutput(smooth);
+    ParallelFor::ApplyThreadQuota(flt);
+    flt->Update();
+    have_smooth = true;
+    }
+
+  if(!have_smooth)
+    cimg_copy(src, smooth);
+
+  // Compute the size of the new image
+  typename CompositeImageType::SizeType sz;
+  for(int i = 0; i < VDim; i++)
+    sz[i] = (unsigned long) vcl_ceil(src->GetBufferedRegion().GetSize()[i] / factor);
+
+  // Compute the spacing and origin of the new image, as in img_downsample
+  typename CompositeImageType::SpacingType spc_pre = src->GetSpacing();
+  typename CompositeImageType::SpacingType spc_post = spc_pre;
+  for(size_t i = 0; i < VDim; i++)
+    spc_post[i] *= src->GetBufferedRegion().GetSize()[i] * 1.0 / sz[i];
+
+  typename CompositeImageType::SpacingType off_pre = (src->GetDirection() * spc_pre) * 0.5;
+  typename CompositeImageType::SpacingType off_post = (src->GetDirection() * spc_post) * 0.5;
+  typename CompositeImageType::PointType origin_post = src->GetOrigin() - off_pre + off_post;
+
+  trg->SetRegions(sz);
+  trg->SetOrigin(origin_post);
+  trg->SetSpacing(spc_post);
+  trg->SetDirection(src->GetDirection());
+  trg->SetNumberOfComponentsPerPixel(nc);
+  trg->Allocate();
+
+  // Resample with linear interpolation, all components at once
+  typedef itk::ResampleImageFilter<CompositeImageType, CompositeImageType, TFloat> ResampleFilter;
+  typedef itk::IdentityTransform<TFloat, VDim> TranType;
+  typedef itk::LinearInterpolateImageFunction<CompositeImageType, TFloat> InterpType;
+
+  typename ResampleFilter::Pointer filter = ResampleFilter::New();
+  typename TranType::Pointer tran = TranType::New();
+  typename InterpType::Pointer func = InterpType::New();
+
+  filter->SetSize(sz);
+  filter->SetOutputSpacing(spc_post);
+  filter->SetOutputOrigin(origin_post);
+  filter->SetOutputDirection(src->GetDirection());
+  filter->SetInput(smooth);
+  filter->SetTransform(tran);
+  filter->SetInterpolator(func);
+  filter->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1722,6 +2391,7 @@ LDDMMData<TFloat, VDim>
   filter->SetOutputOrigin(ref->GetOrigin());
   filter->SetOutputDirection(ref->GetDirection());
   filter->GraftOutput(trg);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1748,6 +2418,7 @@ LDDMMData<TFloat, VDim>
   filter->SetUpperThreshold(ut);
   filter->SetInsideValue(fore);
   filter->SetOutsideValue(back);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1785,6 +2456,7 @@ LDDMMData<TFloat, VDim>
   typename MaskFilterType::Pointer mask = MaskFilterType::New();
   mask->SetInput(src);
   mask->GraftOutput(nan_mask);
+  ParallelFor::ApplyThreadQuota(mask);
   mask->Update();
 
   typedef FilterNaNFunctor<ImageType> RemoveFunctor;
@@ -1792,6 +2464,7 @@ LDDMMData<TFloat, VDim>
   typename RemoveFilterType::Pointer remove = RemoveFilterType::New();
   remove->SetInput(src);
   remove->GraftOutput(src);
+  ParallelFor::ApplyThreadQuota(remove);
   remove->Update();
 }
 
@@ -1818,6 +2491,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput1(src);
   filter->SetInput2(nan_mask);
   filter->GraftOutput(src);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1875,6 +2549,7 @@ LDDMMData<TFloat, VDim>
   filter->SetInput(src);
   filter->GraftOutput(trg);
   filter->SetFunctor(fnk);
+  ParallelFor::ApplyThreadQuota(filter);
   filter->Update();
 }
 
@@ -1884,18 +2559,55 @@ LDDMMData<TFloat, VDim>
 
 #ifdef _LDDMM_FFT_
 
+/**
+ * State of the FFTW library shared by all the FFT interfaces: the wisdom file,
+ * and whether the wisdom and the threads have been initialized. The FFTW
+ * planner is not thread-safe, so planning is serialized.
+ */
+struct LDDMMFFTWState
+{
+  std::string wisdom_file;
+  bool wisdom_loaded, threads_initialized;
+  itk::SimpleFastMutexLock mutex;
+
+  LDDMMFFTWState() : wisdom_loaded(false), threads_initialized(false)
+    {
+    const char *env = getenv("GREEDY_FFTW_WISDOM");
+    if(env)
+      wisdom_file = env;
+    }
+
+  static LDDMMFFTWState &Instance()
+    {
+    static LDDMMFFTWState state;
+    return state;
+    }
+};
 
 template <class TFloat, uint VDim>
+void
 LDDMMFFTInterface<TFloat, VDim>
-::LDDMMFFTInterface(ImageType *ref)
+::SetWisdomFile(const std::string &filename)
+{
+  LDDMMFFTWState &state = LDDMMFFTWState::Instance();
+  state.mutex.Lock();
+  state.wisdom_file = filename;
+  state.wisdom_loaded = false;
+  state.mutex.Unlock();
+}
+
+template <class TFloat, uint VDim>
+LDDMMFFTInterface<TFloat, VDim>
+::LDDMMFFTInterface(ImageBaseType *ref)
 {
   // Work out the data dimensions (large enough, and multiple of four)
   m_Size = ref->GetBufferedRegion().GetSize();
   m_Alloc = m_Size;
   m_Alloc[VDim-1] = 2 * (m_Size[VDim-1] / 2 + 1);
 
-  // Size for calling the plan routines
-  int n[VDim];
+  // Size for calling the plan routines, and the size of the padded real and
+  // complex arrays
+  int n[VDim], n_real[VDim], n_cplx[VDim];
 
   // Get the data dimensions
   m_AllocSize = 1; m_DataSize = 1;
@@ -1903,15 +2615,45 @@ LDDMMFFTInterface<TFloat, VDim>
     {
     m_AllocSize *= m_Alloc[i];
     m_DataSize *= m_Size[i];
-    n[i] = m_Size[i];
+    n[i] = n_real[i] = n_cplx[i] = m_Size[i];
+    }
+  n_real[VDim-1] = m_Alloc[VDim-1];
+  n_cplx[VDim-1] = m_Alloc[VDim-1] / 2;
+
+  // Allocate the complex data for all components (real data is packed in the complex data)
+  m_Data = (double *) fftw_malloc(VDim * m_AllocSize * sizeof(double));
+
+  LDDMMFFTWState &state = LDDMMFFTWState::Instance();
+  state.mutex.Lock();
+
+#ifdef _LDDMM_FFTW_THREADS_
+  if(!state.threads_initialized)
+    {
+    fftw_init_threads();
+    state.threads_initialized = true;
+    }
+  fftw_plan_with_nthreads(itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
+#endif
+
+  if(state.wisdom_file.size() && !state.wisdom_loaded)
+    {
+    fftw_import_wisdom_from_filename(state.wisdom_file.c_str());
+    state.wisdom_loaded = true;
     }
 
-  // Allocate the complex data (real data is packed in the complex data)
-  m_Data = (double *) fftw_malloc(m_AllocSize * sizeof(double));
+  // Create batched plans for forward and inverse transforms of all the components
+  m_Plan = fftw_plan_many_dft_r2c(
+             VDim, n, VDim, m_Data, n_real, 1, m_AllocSize,
+             (fftw_complex *) m_Data, n_cplx, 1, m_AllocSize / 2, FFTW_MEASURE);
+  m_InvPlan = fftw_plan_many_dft_c2r(
+                VDim, n, VDim, (fftw_complex *) m_Data, n_cplx, 1, m_AllocSize / 2,
+                m_Data, n_real, 1, m_AllocSize, FFTW_MEASURE);
 
-  // Create plans for forward and inverse transforms
-  m_Plan = fftw_plan_dft_r2c(VDim, n, m_Data, (fftw_complex *) m_Data, FFTW_MEASURE);
-  m_InvPlan = fftw_plan_dft_c2r(VDim, n, (fftw_complex *) m_Data, m_Data, FFTW_MEASURE);
+  // Save the wisdom, which now includes these plans
+  if(state.wisdom_file.size())
+    fftw_export_wisdom_to_filename(state.wisdom_file.c_str());
+
+  state.mutex.Unlock();
 }
 
 template <class TFloat, uint VDim>
@@ -1929,34 +2671,20 @@ LDDMMFFTInterface<TFloat, VDim>
   uint noutskip = kernel_ft->GetBufferedRegion().GetSize()[VDim-1] - nout;
   uint nstrides = m_AllocSize / m_Alloc[VDim-1];
 
-  for(uint d = 0; d < VDim; d++)
-    {
-    const Vec *src = img->GetBufferPointer();
-    double *dst = m_Data;
-
-    // Funky loop
-    for(double *end = dst + m_AllocSize; dst < end; dst+=nskip)
-      for(double *rowend = dst + ncopy; dst < rowend; dst++, src++)
-        *dst = (double) (*src)[d];
-
-    // Execute the plan
-    fftw_execute(m_Plan);
-
-    // Multiply or divide the complex values in m_Data by the kernel array
-    fftw_complex *c = (fftw_complex *) m_Data;
+  // Scatter the components into their arrays in one pass over the image
+  const Vec *src = img->GetBufferPointer();
+  for(uint off = 0; off < m_AllocSize; off += nskip)
+    for(uint rowend = off + ncopy; off < rowend; off++, src++)
+      for(uint d = 0; d < VDim; d++)
+        m_Data[d * m_AllocSize + off] = (double) (*src)[d];
 
-    // Scaling factor for producing final result
-    double scale = 1.0 / m_DataSize;
+  // Execute the plan for all components
+  fftw_execute(m_Plan);
 
-    /*
-    // Precision weirdness (results differ from MATLAB fft in 6th, 7th decimal digit)
-    uint tp = (m_Alloc[VDim-1] / 2) * 6 + 8;
-    printf("Before scaling, value at %d is %12.12lf, %12.12lf\n",
-      tp, c[tp][0], c[tp][1]);
-    printf("Kernel value at %d is %12.12lf\n", 128*6+8, kp[128*6+8]);
-    */
-
-    // Another such loop
+  // Multiply or divide the complex values of each component by the kernel array
+  for(uint d = 0; d < VDim; d++)
+    {
+    fftw_complex *c = ((fftw_complex *) m_Data) + d * (m_AllocSize / 2);
     TFloat *kp = kernel_ft->GetBufferPointer();
     if(inv_kernel)
       {
@@ -1984,29 +2712,20 @@ LDDMMFFTInterface<TFloat, VDim>
         kp += noutskip;
         }
       }
-
-    /*
-    fftw_complex *ctest = (fftw_complex *) m_Data;
-    printf("After scaling, value at %d is %12.12lf, %12.12lf\n",
-      tp, ctest[tp][0], ctest[tp][1]);
-    */
-
-    // Inverse transform
-    fftw_execute(m_InvPlan);
-
-    // Copy the results to the output image
-    const double *osrc = m_Data;
-    Vec *odst = out->GetBufferPointer();
-    for(uint i = 0; i < nstrides; i++, osrc+=nskip)
-      for(uint j = 0; j < ncopy; j++, odst++, osrc++)
-        (*odst)[d] = (TFloat) ((*osrc) * scale);
-
-    /*
-    odst = out->GetBufferPointer();
-    printf("Result %12.12lf\n",  odst[128*6+8][0]);
-    */
     }
 
+  // Inverse transform
+  fftw_execute(m_InvPlan);
+
+  // Scaling factor for producing final result
+  double scale = 1.0 / m_DataSize;
+
+  // Copy the results to the output image
+  Vec *odst = out->GetBufferPointer();
+  for(uint off = 0; off < m_AllocSize; off += nskip)
+    for(uint rowend = off + ncopy; off < rowend; off++, odst++)
+      for(uint d = 0; d < VDim; d++)
+        (*odst)[d] = (TFloat) (m_Data[d * m_AllocSize + off] * scale);
 }
 
 template <class TFloat, uint VDim>
@@ -2130,6 +2849,9 @@ template class LDDMMData<double, 3>;
 template class LDDMMData<double, 4>;
 
 #ifdef _LDDMM_FFT_
+template class LDDMMFFTInterface<float, 2>;
+template class LDDMMFFTInterface<float, 3>;
+template class LDDMMFFTInterface<float, 4>;
 template class LDDMMFFTInterface<double, 2>;
 template class LDDMMFFTInterface<double, 3>;
 template class LDDMMFFTInterface<double, 4>;
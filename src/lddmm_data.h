@@ -39,6 +39,9 @@
 
 #include <itkImageIOBase.h>
 
+#include "BrickedImage.h"
+#include "ParallelFor.h"
+
 #ifdef _LDDMM_FFT_
 #include <fftw3.h>
 #endif
@@ -68,6 +71,12 @@ public:
   typedef itk::VectorImage<TFloat, VDim> CompositeImageType;
   typedef typename CompositeImageType::Pointer CompositeImagePointer;
 
+  // Bricked copies of composite images and vector fields, read-only (BrickedImage.h)
+  typedef BrickedImage<TFloat, VDim> BrickedCompositeImageType;
+  typedef typename BrickedCompositeImageType::Pointer BrickedCompositeImagePointer;
+  typedef BrickedImage<Vec, VDim> BrickedVectorImageType;
+  typedef typename BrickedVectorImageType::Pointer BrickedVectorImagePointer;
+
   // Regions, etc
   typedef itk::ImageRegion<VDim> RegionType;
 
@@ -126,6 +135,15 @@ public:
   static void interp_cimg(CompositeImageType *data, VectorImageType *field, CompositeImageType *out,
                           bool use_nn = false, bool phys_space = false, TFloat outside_value = 0.0);
 
+  // Apply deformation to data stored in bricks, which is faster for large deformations
+  static void interp_vimg(
+    BrickedVectorImageType *data, VectorImageType *field,
+    TFloat def_scale, VectorImageType *out,
+    bool use_nn = false, bool phys_space = false);
+
+  static void interp_cimg(BrickedCompositeImageType *data, VectorImageType *field, CompositeImageType *out,
+                          bool use_nn = false, bool phys_space = false, TFloat outside_value = 0.0);
+
   // Apply deformation to matrix data
   static void interp_mimg(MatrixImageType *data, VectorImageType *field, MatrixImageType *out,
                           bool use_nn = false, bool phys_space = false);
@@ -160,18 +178,32 @@ public:
   // Take Jacobian of deformation field
   static void field_jacobian_det(VectorImageType *vec, ImageType *out);
 
-  // Compute the Lie bracket by computing two Jacobians and multiplying. This should be made faster
-  // by making a custom ITK filter
-  static void lie_bracket(VectorImageType *v, VectorImageType *u, MatrixImageType *work, VectorImageType *out);
+  // Compute the Lie bracket [v,u] = Dv u - Du v from central differences, without forming the
+  // Jacobian matrices. The output must not be either of the inputs
+  static void lie_bracket(VectorImageType *v, VectorImageType *u, VectorImageType *out);
+
+  // Methods for smoothing vector fields. SMOOTH_ITK uses ITK's recursive Gaussian filter one
+  // component at a time. SMOOTH_RECURSIVE (Young-van Vliet) and SMOOTH_BOX (extended box cascade,
+  // more passes are more accurate) filter all components of the field in one pass per axis
+  enum SmoothingMethod { SMOOTH_ITK = 0, SMOOTH_RECURSIVE, SMOOTH_BOX };
 
   // Smooth an image in-place
   static void img_smooth(ImageType *src, ImageType *out, double sigma);
   static void vimg_smooth(VectorImageType *src, VectorImageType *out, double sigma);
   static void vimg_smooth(VectorImageType *src, VectorImageType *out, Vec sigmas);
+  static void vimg_smooth(VectorImageType *src, VectorImageType *out, Vec sigmas,
+                          SmoothingMethod method, int box_passes = 3);
   static void cimg_smooth(CompositeImageType *src, CompositeImageType *out, Vec sigma);
 
   // Smooth a displacement field with a border of zeros around it
-  static void vimg_smooth_withborder(VectorImageType *src, VectorImageType *trg, Vec sigma, int border_size);
+  static void vimg_smooth_withborder(VectorImageType *src, VectorImageType *trg, Vec sigma, int border_size,
+                                     SmoothingMethod method = SMOOTH_ITK, int box_passes = 3);
+
+  // Set the vectors within border_size voxels of the edge of the image to zero
+  static void vimg_clear_border(VectorImageType *trg, int border_size);
+
+  // Set the vectors outside of the given region to zero
+  static void vimg_clear_outside(VectorImageType *trg, const RegionType &interior);
 
   // Take gradient of an image
   static void image_gradient(ImageType *src, VectorImageType *grad, bool use_spacing);
@@ -184,6 +216,30 @@ public:
   // compute trg = trg + s * a
   static void vimg_add_scaled_in_place(VectorImageType *trg, VectorImageType *a, TFloat s);
 
+  // Fused element-wise kernels: f(out[i], a[i], b[i]) is called for every voxel in one
+  // parallel pass, so that a chain of arithmetic steps reads and writes each field once.
+  // The images must have the same buffered region; out may also be one of the inputs
+  template <class TFunc>
+  static void vimg_apply(VectorImageType *out, TFunc f);
+  template <class TFunc>
+  static void vimg_apply(VectorImageType *out, const VectorImageType *a, TFunc f);
+  template <class TFunc>
+  static void vimg_apply(VectorImageType *out, const VectorImageType *a, const VectorImageType *b, TFunc f);
+
+  // Fused reduction: f(acc, i, a[i]) accumulates each voxel, with its offset i, into the
+  // result of its chunk (which starts at init), and the chunk results are merged with
+  // combine(x, y) in order, so the result does not depend on the number of threads
+  template <class TResult, class TFunc, class TCombine>
+  static TResult vimg_reduce(const VectorImageType *a, const TResult &init, TFunc f, TCombine combine);
+
+  // Composition out = a o (id + b) + b in a single pass, e.g., for compositive updates
+  static void vimg_compose(VectorImageType *a, VectorImageType *b, VectorImageType *out);
+
+  // Refine an approximate inverse uinv of id + u with n_iter fixed-point iterations
+  // uinv = -u o (id + uinv); work is a scratch image the size of u
+  static void vimg_refine_inverse(VectorImageType *u, VectorImageType *uinv,
+                                  VectorImageType *work, unsigned int n_iter);
+
   static void vimg_scale(const VectorImageType *src, TFloat s, VectorImageType *trg);
   static void vimg_multiply_in_place(VectorImageType *trg, ImageType *s);
   static void vimg_euclidean_inner_product(ImagePointer &trg, VectorImageType *a, VectorImageType *b);
@@ -192,12 +248,14 @@ public:
   // Matrix - matrix multiplication
   static void mimg_multiply_in_place(MatrixImageType *trg, MatrixImageType *s);
 
-  // Compute the range of the norm of a vector field
+  // Compute the range of the norm of a vector field. The squared norms are stored in
+  // normsqr, unless it is NULL
   static void vimg_norm_min_max(VectorImageType *image, ImageType *normsqr,
     TFloat &min_norm, TFloat &max_norm);
 
   // Update a vector image to make its maxumum length equal to given value. The
-  // second parameter is a working image that will return unnormalized lengths squared
+  // second parameter is a working image that will return unnormalized lengths squared,
+  // it may be NULL
   static void vimg_normalize_to_fixed_max_length(VectorImageType *trg,
                                                  ImageType *normsqr,
                                                  double max_displacement,
@@ -215,9 +273,21 @@ public:
   // Generate a kernel image for navier-stokes operator
   static void compute_navier_stokes_kernel(ImageType *kernel, double alpha, double gamma);
 
+  // Fourier domain multipliers for LDDMMFFTInterface::convolution_fft, for a
+  // Gaussian with given sigma (in voxels), and for the Green's function of the
+  // operator L = gamma - alpha * Laplacian, applied twice, i.e. (L^T L)^{-1},
+  // normalized to unit gain at DC (alpha in voxel units)
+  static void compute_gaussian_kernel_ft(ImageType *kernel, Vec sigma_vox);
+  static void compute_navier_stokes_green_kernel_ft(ImageType *kernel, double alpha, double gamma = 1.0);
+
   // Downsample and upsample images (includes smoothing, use sparingly)
   static void img_downsample(ImageType *src, ImageType *trg, double factor);
   static void img_shrink(ImageType *src, ImageType *trg, int factor);
+
+  // Downsample all components of a composite image together, with the same output geometry as
+  // img_downsample. The Gaussian pre-smoothing sigma (physical units) is given explicitly, so that
+  // a pyramid can be built from each level to the next one
+  static void cimg_downsample(CompositeImageType *src, CompositeImageType *trg, double factor, Vec sigma);
   static void img_resample_identity(ImageType *src, ImageBaseType *ref, ImageType *trg);
   static void vimg_resample_identity(VectorImageType *src, ImageBaseType *ref, VectorImageType *trg);
 
@@ -256,9 +326,23 @@ public:
   static void vimg_write(VectorImageType *src, const char *fn,
                          IOComponentType comp = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE);
 
-  // Write composite image, with optional output format specification
+  // Compact quantized warp format (.qwarp). Displacements are stored as 8 or 16
+  // bit integers with a single per-file scale, optionally on a grid that is
+  // coarser than the image grid by up to an integer shrink factor and spans it
+  // exactly. On read, the coarse grid is upsampled to the full grid with cubic
+  // B-spline interpolation.
+  // vimg_read() and vimg_write() route to these for files with .qwarp extension
+  static bool vimg_is_quantized(const char *fn);
+  static void vimg_write_quantized(VectorImageType *src, const char *fn,
+                                   int bits = 16, int shrink = 1);
+  static void vimg_read_quantized(const char *fn, VectorImagePointer &trg);
+
+  // Write composite image, with optional output format specification. If the
+  // number of divisions is greater than one, the image is requested from the
+  // upstream pipeline and written in that many pieces (no compression)
   static void cimg_write(CompositeImageType *src, const char *fn,
-                         IOComponentType comp = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE);
+                         IOComponentType comp = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE,
+                         unsigned int n_divisions = 1);
 
   static void vfield_read(uint nt, const char *fnpat, VelocityField &v);
 
@@ -281,7 +365,16 @@ public:
     const VectorImageType *src, VectorImageType *trg, VectorImageType *work,
     int exponent, TFloat scale = 1.0);
 
-  // Exponentiate a deformation field and its Jacobian
+  // Exponentiate a deformation field and its negative at the same time, so that
+  // trg = exp(scale * src) and trg_inv = exp(-scale * src). The squarings of the
+  // two fields are interleaved and share a single pass over the source
+  static void vimg_exp_with_inverse(
+    const VectorImageType *src, VectorImageType *trg, VectorImageType *trg_inv,
+    VectorImageType *work, VectorImageType *work_inv,
+    int exponent, TFloat scale = 1.0);
+
+  // Exponentiate a deformation field and its Jacobian. The work images are used as
+  // ping-pong buffers, each squaring updates both the field and the Jacobian in one pass
   static void vimg_exp_with_jacobian(
     const VectorImageType *src, VectorImageType *trg, VectorImageType *work,
     MatrixImageType *trg_jac, MatrixImageType *work_mat,
@@ -296,8 +389,11 @@ public:
   static void img_linear_to_const_rectifier_fn(ImageType *src, ImageType *trg, TFloat thresh);
   static void img_linear_to_const_rectifier_deriv(ImageType *src, ImageType *trg, TFloat thresh);
 
-  // PDE support (for incompressibility)
-  static void *poisson_pde_zero_boundary_initialize(ImageBaseType *ref, ImageType *mask = NULL);
+  // PDE support (for incompressibility). The default solver is matrix-free multigrid,
+  // the sparse direct and conjugate gradient solvers require compiling with sparse solvers
+  enum PoissonSolverMethod { POISSON_MULTIGRID = 0, POISSON_SPARSE_DIRECT, POISSON_SPARSE_PCG };
+  static void *poisson_pde_zero_boundary_initialize(ImageBaseType *ref, ImageType *mask = NULL,
+                                                    PoissonSolverMethod method = POISSON_MULTIGRID);
   static void poisson_pde_zero_boundary_solve(void *solver_data, ImageType *rhs, ImageType *solution);
   static void poisson_pde_zero_boundary_laplacian(void *solver_data, ImageType *u, ImageType *result);
   static void poisson_pde_zero_boundary_dealloc(void *solver_data);
@@ -309,8 +405,89 @@ protected:
 
 };
 
+template <class TFloat, uint VDim>
+template <class TFunc>
+void
+LDDMMData<TFloat, VDim>
+::vimg_apply(VectorImageType *out, TFunc f)
+{
+  Vec *p_out = out->GetBufferPointer();
+  ParallelFor::Run((long) out->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      f(p_out[i]);
+    });
+}
+
+template <class TFloat, uint VDim>
+template <class TFunc>
+void
+LDDMMData<TFloat, VDim>
+::vimg_apply(VectorImageType *out, const VectorImageType *a, TFunc f)
+{
+  Vec *p_out = out->GetBufferPointer();
+  const Vec *p_a = a->GetBufferPointer();
+  ParallelFor::Run((long) out->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      f(p_out[i], p_a[i]);
+    });
+}
+
+template <class TFloat, uint VDim>
+template <class TFunc>
+void
+LDDMMData<TFloat, VDim>
+::vimg_apply(VectorImageType *out, const VectorImageType *a, const VectorImageType *b, TFunc f)
+{
+  Vec *p_out = out->GetBufferPointer();
+  const Vec *p_a = a->GetBufferPointer(), *p_b = b->GetBufferPointer();
+  ParallelFor::Run((long) out->GetPixelContainer()->Size(), 0, [=](long i0, long i1)
+    {
+    for(long i = i0; i < i1; i++)
+      f(p_out[i], p_a[i], p_b[i]);
+    });
+}
+
+template <class TFloat, uint VDim>
+template <class TResult, class TFunc, class TCombine>
+TResult
+LDDMMData<TFloat, VDim>
+::vimg_reduce(const VectorImageType *a, const TResult &init, TFunc f, TCombine combine)
+{
+  // Fixed chunks, so that the partial results are merged the same way every time
+  const long grain = 16384;
+  long n = (long) a->GetPixelContainer()->Size();
+  long n_chunks = (n + grain - 1) / grain;
+  std::vector<TResult> partial(n_chunks, init);
+
+  // The loop is over the chunks, so each partial result is owned by one call
+  const Vec *p_a = a->GetBufferPointer();
+  ParallelFor::Run(n_chunks, 1, [=, &partial](long c0, long c1)
+    {
+    for(long c = c0; c < c1; c++)
+      {
+      TResult &acc = partial[c];
+      for(long i = c * grain; i < std::min(n, (c + 1) * grain); i++)
+        f(acc, i, p_a[i]);
+      }
+    });
+
+  TResult result = init;
+  for(size_t c = 0; c < partial.size(); c++)
+    result = combine(result, partial[c]);
+  return result;
+}
+
 #ifdef _LDDMM_FFT_
 
+/**
+ * Convolution of vector fields with a kernel given in the Fourier domain. All
+ * components are transformed with a single batched real-to-complex plan, which
+ * is multi-threaded when FFTW threads are available. Plans are created with
+ * FFTW_MEASURE, which is slow for large images, so the FFTW wisdom can be kept
+ * in a file (see SetWisdomFile) to pay the planning cost once per image size.
+ */
 template <class TFloat, uint VDim>
 class LDDMMFFTInterface
 {
@@ -319,20 +496,29 @@ public:
   typedef typename LDDMMData<TFloat, VDim>::VectorImageType VectorImageType;
   typedef typename LDDMMData<TFloat, VDim>::Vec Vec;
 
-  LDDMMFFTInterface(ImageType *ref);
+  typedef typename LDDMMData<TFloat, VDim>::ImageBaseType ImageBaseType;
+
+  LDDMMFFTInterface(ImageBaseType *ref);
   ~LDDMMFFTInterface();
 
   void convolution_fft(
     VectorImageType *img, ImageType *kernel_ft, bool inv_kernel, 
     VectorImageType *out);
 
+  /**
+   * Set the file from which FFTW wisdom is read before planning, and to which
+   * new wisdom is written after planning. By default, the file is given by the
+   * environment variable GREEDY_FFTW_WISDOM, and no file is used if it is unset.
+   */
+  static void SetWisdomFile(const std::string &filename);
+
 private:
 
   // Size of the input array and allocated array (bigger, for in-place math)
   itk::Size<VDim> m_Size, m_Alloc;
   uint m_AllocSize, m_DataSize;
 
-  // In-place data array
+  // In-place data array, holding the padded arrays of all components one after the other
   double *m_Data;
 
   // FFT plan
@@ -350,13 +536,17 @@ public:
   typedef typename LDDMMData<TFloat, VDim>::VectorImageType VectorImageType;
   typedef typename LDDMMData<TFloat, VDim>::Vec Vec;
 
-  LDDMMFFTInterface(ImageType *ref) {}
+  typedef typename LDDMMData<TFloat, VDim>::ImageBaseType ImageBaseType;
+
+  LDDMMFFTInterface(ImageBaseType *ref) {}
   ~LDDMMFFTInterface() {}
 
    void convolution_fft(
        VectorImageType *img, ImageType *kernel_ft, bool inv_kernel,
        VectorImageType *out) { throw std::string("Code was not compiled with _LDDMM_FFT_"); }
 
+  static void SetWisdomFile(const std::string &) {}
+
 };
 
 #endif // _LDDMM_FFT_
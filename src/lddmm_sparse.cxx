@@ -25,19 +25,415 @@
 
 =========================================================================*/
 #include "lddmm_data.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Common interface of the Poisson PDE solvers, which are handed to the caller
+ * as a void pointer by poisson_pde_zero_boundary_initialize
+ */
+template <class TFloat, uint VDim>
+class PoissonPDEZeroBoundarySolver
+{
+public:
+  typedef LDDMMData<TFloat, VDim> Data;
+  typedef typename Data::ImageType ImageType;
+
+  virtual ~PoissonPDEZeroBoundarySolver() {}
+  virtual void Solve(ImageType *rhs, ImageType *soln) = 0;
+  virtual void ComputeLaplacian(ImageType *u, ImageType *res) = 0;
+};
+
+/**
+ * Matrix-free solver for the Poisson equation on the image grid, with zero
+ * Dirichlet conditions outside of the image and outside of the optional mask.
+ * The equation is solved by conjugate gradients, preconditioned with a V-cycle
+ * of geometric multigrid. The grid is coarsened by a factor of two in each
+ * dimension by agglomerating voxels (a coarse voxel is active if any of its
+ * children is), with piecewise constant prolongation, restriction by averaging
+ * and the Galerkin scaling of the Laplacian weights. The solution of the last
+ * call to Solve is kept and used as the initial guess for the next call, which
+ * in the incompressibility iterations is a good guess, since the right hand
+ * side changes little from one iteration to the next.
+ */
+template <class TFloat, uint VDim>
+class PoissonPDEMultigrid : public PoissonPDEZeroBoundarySolver<TFloat, VDim>
+{
+public:
+  typedef LDDMMData<TFloat, VDim> Data;
+  typedef typename Data::ImageBaseType ImageBaseType;
+  typedef typename Data::ImageType ImageType;
+  typedef std::vector<double> Array;
+
+  PoissonPDEMultigrid(ImageBaseType *ref, ImageType *mask = NULL)
+    : m_MaxIterations(200), m_Tolerance(1e-6), m_Smoothing(2), m_CoarseSweeps(40)
+    {
+    // Set up the finest level from the image
+    Level fine;
+    fine.np = ref->GetBufferedRegion().GetNumberOfPixels();
+    fine.nchild = 1;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      fine.size[d] = ref->GetBufferedRegion().GetSize()[d];
+      double s = ref->GetSpacing()[d];
+      fine.w[d] = 1.0 / (s * s);
+      }
+    fine.active.resize(fine.np, 1);
+    if(mask)
+      {
+      const TFloat *pmask = mask->GetBufferPointer();
+      for(unsigned long i = 0; i < fine.np; i++)
+        fine.active[i] = (pmask[i] >= 1.0) ? 1 : 0;
+      }
+    m_Levels.push_back(fine);
+
+    // Coarsen the grid until it is small, dimensions of size < 4 are not coarsened
+    while(true)
+      {
+      Level &f = m_Levels.back();
+      Level c;
+      bool coarsened = false;
+      c.np = 1;
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        c.factor[d] = (f.size[d] >= 4) ? 2 : 1;
+        c.size[d] = (f.size[d] + c.factor[d] - 1) / c.factor[d];
+        c.w[d] = f.w[d] / c.factor[d];
+        c.np *= c.size[d];
+        coarsened |= (c.factor[d] > 1);
+        }
+      if(!coarsened || f.np <= 512)
+        break;
+
+      // Map each fine voxel to its parent, mark the parents of active voxels
+      c.active.resize(c.np, 0);
+      f.parent.resize(f.np);
+      ForEachVoxel(f, [&](unsigned long i, const long *pos)
+        {
+        unsigned long j = 0;
+        for(int d = VDim - 1; d >= 0; d--)
+          j = j * c.size[d] + pos[d] / c.factor[d];
+        f.parent[i] = j;
+        if(f.active[i])
+          c.active[j] = 1;
+        });
+
+      // The residual is restricted by the transpose of the prolongation, scaled
+      // by the number of children, which keeps the preconditioner symmetric
+      c.nchild = 1;
+      for(unsigned int d = 0; d < VDim; d++)
+        c.nchild *= c.factor[d];
+
+      m_Levels.push_back(c);
+      }
+
+    // Compute the diagonal of the operator and allocate the work arrays
+    for(unsigned int l = 0; l < m_Levels.size(); l++)
+      {
+      Level &L = m_Levels[l];
+      L.diag = 0.0;
+      for(unsigned int d = 0; d < VDim; d++)
+        L.diag += 2.0 * L.w[d];
+      L.x.resize(L.np, 0.0);
+      L.b.resize(L.np, 0.0);
+      L.r.resize(L.np, 0.0);
+      }
+
+    // Work arrays for conjugate gradients
+    m_X.resize(fine.np, 0.0);
+    m_B.resize(fine.np, 0.0);
+    m_R.resize(fine.np, 0.0);
+    m_Z.resize(fine.np, 0.0);
+    m_P.resize(fine.np, 0.0);
+    m_Q.resize(fine.np, 0.0);
+    }
+
+  virtual void Solve(ImageType *rhs, ImageType *soln) ITK_OVERRIDE
+    {
+    Level &L = m_Levels.front();
+
+    // We solve A x = b with A = -Laplacian, which is positive definite
+    const TFloat *prhs = rhs->GetBufferPointer();
+    double b_norm = 0.0;
+    for(unsigned long i = 0; i < L.np; i++)
+      {
+      m_B[i] = L.active[i] ? -prhs[i] : 0.0;
+      b_norm += m_B[i] * m_B[i];
+      }
+    b_norm = sqrt(b_norm);
+
+    // Residual of the initial guess, which is the last solution
+    ApplyOperator(L, m_X, m_Q);
+    double r_norm = 0.0;
+    for(unsigned long i = 0; i < L.np; i++)
+      {
+      m_R[i] = m_B[i] - m_Q[i];
+      r_norm += m_R[i] * m_R[i];
+      }
+    r_norm = sqrt(r_norm);
+
+    // Preconditioned conjugate gradients
+    double rz_old = 0.0;
+    for(unsigned int it = 0; it < m_MaxIterations && r_norm > m_Tolerance * b_norm; it++)
+      {
+      Precondition(m_R, m_Z);
+      double rz = Dot(m_R, m_Z);
+      if(it == 0)
+        m_P = m_Z;
+      else
+        {
+        double beta = rz / rz_old;
+        for(unsigned long i = 0; i < L.np; i++)
+          m_P[i] = m_Z[i] + beta * m_P[i];
+        }
+      rz_old = rz;
+
+      ApplyOperator(L, m_P, m_Q);
+      double pq = Dot(m_P, m_Q);
+      if(pq <= 0.0)
+        break;
+
+      double alpha = rz / pq;
+      r_norm = 0.0;
+      for(unsigned long i = 0; i < L.np; i++)
+        {
+        m_X[i] += alpha * m_P[i];
+        m_R[i] -= alpha * m_Q[i];
+        r_norm += m_R[i] * m_R[i];
+        }
+      r_norm = sqrt(r_norm);
+      }
+
+    TFloat *psoln = soln->GetBufferPointer();
+    for(unsigned long i = 0; i < L.np; i++)
+      psoln[i] = (TFloat) m_X[i];
+    }
+
+  virtual void ComputeLaplacian(ImageType *u, ImageType *res) ITK_OVERRIDE
+    {
+    Level &L = m_Levels.front();
+    const TFloat *pu = u->GetBufferPointer();
+    for(unsigned long i = 0; i < L.np; i++)
+      m_P[i] = L.active[i] ? pu[i] : 0.0;
+    ApplyOperator(L, m_P, m_Q);
+    TFloat *pres = res->GetBufferPointer();
+    for(unsigned long i = 0; i < L.np; i++)
+      pres[i] = (TFloat) -m_Q[i];
+    }
+
+private:
+
+  struct Level
+  {
+    // Dimensions, number of voxels, coarsening factor relative to the finer level
+    long size[VDim], factor[VDim];
+    unsigned long np;
+
+    // Weights of the neighbors in each dimension and of the center voxel
+    double w[VDim], diag;
+
+    // Voxels where the solution is not constrained to zero
+    std::vector<unsigned char> active;
+
+    // Index of the parent of each voxel on the next coarser level, and number
+    // of children of a voxel on the next finer level
+    std::vector<unsigned long> parent;
+    unsigned int nchild;
+
+    // Solution, right hand side and residual of the V-cycle
+    Array x, b, r;
+  };
+
+  // Visit the voxels of a level in buffer order, passing the index and position
+  template <class TFunction>
+  static void ForEachVoxel(const Level &L, TFunction f)
+    {
+    long pos[VDim];
+    for(unsigned int d = 0; d < VDim; d++)
+      pos[d] = 0;
+    for(unsigned long i = 0; i < L.np; i++)
+      {
+      f(i, pos);
+      for(unsigned int d = 0; d < VDim && ++pos[d] == L.size[d]; d++)
+        pos[d] = 0;
+      }
+    }
+
+  // Compute y = A x over the active voxels. Inactive voxels of x must be zero
+  static void ApplyOperator(const Level &L, const Array &x, Array &y)
+    {
+    ForEachVoxel(L, [&](unsigned long i, const long *pos)
+      {
+      if(!L.active[i])
+        {
+        y[i] = 0.0;
+        return;
+        }
+      double v = L.diag * x[i];
+      long stride = 1;
+      for(unsigned int d = 0; d < VDim; d++)
+        {
+        if(pos[d] > 0)
+          v -= L.w[d] * x[i - stride];
+        if(pos[d] < L.size[d] - 1)
+          v -= L.w[d] * x[i + stride];
+        stride *= L.size[d];
+        }
+      y[i] = v;
+      });
+    }
+
+  // Damped Jacobi sweeps for A x = b on a level, using r as work space
+  static void Smooth(Level &L, unsigned int sweeps)
+    {
+    const double omega = (VDim > 1) ? 0.8 : 2.0 / 3.0;
+    for(unsigned int k = 0; k < sweeps; k++)
+      {
+      ApplyOperator(L, L.x, L.r);
+      for(unsigned long i = 0; i < L.np; i++)
+        if(L.active[i])
+          L.x[i] += omega * (L.b[i] - L.r[i]) / L.diag;
+      }
+    }
+
+  // One V-cycle starting at level l with zero initial guess
+  void VCycle(unsigned int l)
+    {
+    Level &L = m_Levels[l];
+    std::fill(L.x.begin(), L.x.end(), 0.0);
+
+    // On the coarsest level, just smooth a lot
+    if(l + 1 == m_Levels.size())
+      {
+      Smooth(L, m_CoarseSweeps);
+      return;
+      }
+
+    Smooth(L, m_Smoothing);
+
+    // Restrict the residual to the coarse level by averaging
+    Level &C = m_Levels[l+1];
+    ApplyOperator(L, L.x, L.r);
+    std::fill(C.b.begin(), C.b.end(), 0.0);
+    for(unsigned long i = 0; i < L.np; i++)
+      if(L.active[i])
+        C.b[L.parent[i]] += L.b[i] - L.r[i];
+    for(unsigned long j = 0; j < C.np; j++)
+      C.b[j] /= C.nchild;
+
+    // Coarse grid correction, prolonged by piecewise constant interpolation
+    VCycle(l + 1);
+    for(unsigned long i = 0; i < L.np; i++)
+      if(L.active[i])
+        L.x[i] += C.x[L.parent[i]];
+
+    Smooth(L, m_Smoothing);
+    }
+
+  // Apply the multigrid preconditioner, z = M^-1 r
+  void Precondition(const Array &r, Array &z)
+    {
+    Level &L = m_Levels.front();
+    L.b = r;
+    VCycle(0);
+    z = L.x;
+    }
+
+  static double Dot(const Array &a, const Array &b)
+    {
+    double sum = 0.0;
+    for(unsigned long i = 0; i < a.size(); i++)
+      sum += a[i] * b[i];
+    return sum;
+    }
+
+  std::vector<Level> m_Levels;
+  Array m_X, m_B, m_R, m_Z, m_P, m_Q;
+  unsigned int m_MaxIterations;
+  double m_Tolerance;
+  unsigned int m_Smoothing, m_CoarseSweeps;
+};
 
 #ifdef _LDDMM_SPARSE_SOLVERS_
 
-// Use VNL sparse matrix as a temporary data structure
-#include <vnl/vnl_sparse_matrix.h>
 #include <SparseMatrix.h>
 #include <SparseSolver.h>
+#include "ParallelFor.h"
+
+/**
+ * Row generator for ImmutableSparseMatrix::SetFromGenerator that produces the
+ * discrete Laplacian with zero Dirichlet conditions. Each row corresponds to a
+ * variable (pixel inside the mask) and holds the center weight and the weights
+ * of the neighbors that are variables, in increasing column order.
+ */
+template <class TFloat, uint VDim>
+class PoissonLaplacianStencil
+{
+public:
+  typedef typename LDDMMData<TFloat, VDim>::ImageBaseType ImageBaseType;
+
+  PoissonLaplacianStencil(ImageBaseType *ref, const long *mindex, const std::vector<long> &var_pixel)
+    : m_MaskIndex(mindex), m_VarPixel(var_pixel)
+    {
+    const typename ImageBaseType::OffsetValueType *offsets = ref->GetOffsetTable();
+    m_CenterWeight = 0.0;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      double s = ref->GetSpacing()[d];
+      m_Size[d] = ref->GetBufferedRegion().GetSize()[d];
+      m_Offset[d] = offsets[d];
+      m_NeighborWeight[d] = 1.0 / (s * s);
+      m_CenterWeight -= 2.0 / (s * s);
+      }
+    }
+
+  // Visit the entries of a row in increasing column order. Since the variables
+  // are numbered in pixel order, this means in increasing pixel offset order
+  template <class TVisitor>
+  void VisitRow(size_t row, TVisitor visit) const
+    {
+    long i = m_VarPixel[row];
+    long pos[VDim], rem = i;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      pos[d] = rem % m_Size[d];
+      rem /= m_Size[d];
+      }
+
+    for(int d = VDim-1; d >= 0; d--)
+      if(pos[d] > 0 && m_MaskIndex[i - m_Offset[d]] >= 0)
+        visit(m_MaskIndex[i - m_Offset[d]], m_NeighborWeight[d]);
+    visit(row, m_CenterWeight);
+    for(unsigned int d = 0; d < VDim; d++)
+      if(pos[d] < m_Size[d] - 1 && m_MaskIndex[i + m_Offset[d]] >= 0)
+        visit(m_MaskIndex[i + m_Offset[d]], m_NeighborWeight[d]);
+    }
+
+  size_t RowSize(size_t row) const
+    {
+    size_t n = 0;
+    VisitRow(row, [&n](size_t, double) { n++; });
+    return n;
+    }
+
+  void FillRow(size_t row, size_t *cols, double *vals) const
+    {
+    VisitRow(row, [&cols, &vals](size_t col, double val) { *cols++ = col; *vals++ = val; });
+    }
+
+private:
+  const long *m_MaskIndex;
+  const std::vector<long> &m_VarPixel;
+  long m_Size[VDim], m_Offset[VDim];
+  double m_NeighborWeight[VDim], m_CenterWeight;
+};
 
 /**
  * A specialized implementation for double images
  */
 template <class TFloat, uint VDim>
-class PoissonPDEZeroBoundary
+class PoissonPDEZeroBoundary : public PoissonPDEZeroBoundarySolver<TFloat, VDim>
 {
 public:
   typedef LDDMMData<TFloat, VDim> Data;
@@ -47,8 +443,9 @@ public:
 
   typedef itk::Image<long, VDim> IndexImage;
   typedef itk::ImageRegionIteratorWithIndex<IndexImage> IndexIterator;
+  typedef PoissonLaplacianStencil<TFloat, VDim> LaplacianStencil;
 
-  PoissonPDEZeroBoundary(ImageBaseType *ref, ImageType *mask = NULL)
+  PoissonPDEZeroBoundary(ImageBaseType *ref, ImageType *mask = NULL, bool iterative = false)
     {
     // Number of pixels in the image (dimensions of the matrix)
     unsigned long np = ref->GetBufferedRegion().GetNumberOfPixels();
@@ -81,68 +478,30 @@ public:
         it_mindex.Set(nv++);
       }
 
-    // Create a sparse matrix representing the image Laplacian
-    vnl_sparse_matrix<double> S(nv, nv);
-
-    // Get the image offsets and size
-    const typename ImageBaseType::OffsetValueType *offsets = ref->GetOffsetTable();
-    typename ImageBaseType::SpacingType spacing = ref->GetSpacing();
-    typename ImageBaseType::IndexType i_start = ref->GetBufferedRegion().GetIndex();
-    typename ImageBaseType::IndexType i_end = i_start + ref->GetBufferedRegion().GetSize();
-
-    // Weights of the neighbor voxels and center voxel
-    vnl_vector_fixed<double, VDim> w_nbr;
-    double w_ctr = 0.0;
-    for(unsigned int d = 0; d < VDim; d++)
-      {
-      double s = ref->GetSpacing()[d];
-      w_nbr[d] = 1.0 / (s * s);
-      w_ctr -= 2.0 / (s * s); 
-      }
-
-    // Visit each pixel in order
-    long *mindex_ptr = m_MaskIndex->GetBufferPointer();
-    IndexIterator it(m_MaskIndex, m_MaskIndex->GetBufferedRegion());
-    for(unsigned int i=0; !it.IsAtEnd(); ++it, ++i)
-      {
-      // We must be inside the mask to have a row in the matrix
-      long j_center = mindex_ptr[i];
-      if(j_center >= 0)
-        {
-        // Add the central value
-        S.put(j_center, j_center, w_ctr);
-
-        // Add the neighbor values
-        for(unsigned int d = 0; d < VDim; d++)
-          {
-          unsigned int k = it.GetIndex()[d];
-          if(k > i_start[d])
-            {
-            long j_nbr = mindex_ptr[i-offsets[d]];
-            if(j_nbr >= 0)
-              S.put(j_center, j_nbr, w_nbr[d]);
-            }
-          if(k < i_end[d]-1)
-            {
-            long j_nbr = mindex_ptr[i+offsets[d]];
-            if(j_nbr >= 0)
-              S.put(j_center, j_nbr, w_nbr[d]);
-            }
-          }
-        }
-      }
-     
-    // Create a sparse matrix
-    m_LaplacianMatrix.SetFromVNL(S); 
-
-    // Create a sparse solver (not symmetric)
-    m_Solver = SparseSolver::MakeSolver(false);
+    // Map the variables back to pixels
+    std::vector<long> var_pixel(nv);
+    const long *mindex_ptr = m_MaskIndex->GetBufferPointer();
+    for(unsigned long i = 0; i < np; i++)
+      if(mindex_ptr[i] >= 0)
+        var_pixel[mindex_ptr[i]] = i;
+
+    // Create a sparse matrix representing the image Laplacian, filled in parallel
+    // from the seven-point (in 3D) stencil, with the threads given to greedy
+    LaplacianStencil stencil(ref, mindex_ptr, var_pixel);
+    m_LaplacianMatrix.SetFromGenerator(nv, nv, stencil, ParallelFor::GetNumberOfThreads());
+
+    // Create a sparse solver (not symmetric), or a conjugate gradient solver,
+    // which starts from the previous solution, kept in m_WorkV
+    m_Solver = SparseSolver::MakeSolver(false, iterative ? SparseSolver::PCG_ICHOL : SparseSolver::DIRECT);
+    m_Solver->SetTolerance(1e-6, 500);
+    m_Solver->SetUseInitialGuess(true);
     m_Solver->SymbolicFactorization(m_LaplacianMatrix);
     m_Solver->NumericFactorization(m_LaplacianMatrix.GetSparseData());
 
     // Allocate the work vectors
     m_WorkU.set_size(nv);
     m_WorkV.set_size(nv);
+    m_WorkV.fill(0.0);
     }
 
   ~PoissonPDEZeroBoundary()
@@ -170,7 +529,7 @@ public:
         pix[i] = vec[mindex_ptr[i]];
     }
 
-  void Solve(ImageType *rhs, ImageType *soln)
+  virtual void Solve(ImageType *rhs, ImageType *soln) ITK_OVERRIDE
     {
     PutImageIntoVector(rhs, m_WorkU);
     m_Solver->Solve(m_WorkU.data_block(), m_WorkV.data_block());
@@ -178,7 +537,7 @@ public:
     GetImageFromVector(m_WorkV, soln);
     }
 
-  void ComputeLaplacian(ImageType *u, ImageType *res)
+  virtual void ComputeLaplacian(ImageType *u, ImageType *res) ITK_OVERRIDE
     {
     PutImageIntoVector(u, m_WorkU);
     m_LaplacianMatrix.MultiplyByVector(m_WorkU, m_WorkV);
@@ -196,24 +555,23 @@ private:
 #else
 
 /*
- * Default implementation of the PDE solver is a dummy that does not work
+ * Without the sparse solvers, the sparse matrix solver is a dummy that does not work
  */
 template <class TFloat, uint VDim>
-class PoissonPDEZeroBoundary
+class PoissonPDEZeroBoundary : public PoissonPDEZeroBoundarySolver<TFloat, VDim>
 {
 public:
   typedef LDDMMData<TFloat, VDim> Data;
   typedef typename Data::ImageBaseType ImageBaseType;
   typedef typename Data::ImageType ImageType;
 
-  PoissonPDEZeroBoundary(ImageBaseType *ref, ImageType *mask = NULL)
+  PoissonPDEZeroBoundary(ImageBaseType *ref, ImageType *mask = NULL, bool iterative = false)
     {
-    std::cerr << "PDE solver not available" << std::endl;
-    throw std::exception();
+    itkGenericExceptionMacro(<< "Sparse PDE solvers not available, compile with sparse solvers");
     }
 
-  void Solve(ImageType *rhs, ImageType *soln) {}
-  void ComputeLaplacian(ImageType *u, ImageType *res) {}
+  virtual void Solve(ImageType *rhs, ImageType *soln) ITK_OVERRIDE {}
+  virtual void ComputeLaplacian(ImageType *u, ImageType *res) ITK_OVERRIDE {}
 };
 
 
@@ -221,20 +579,26 @@ public:
 
 
 /*
- * Initialize the sparse solver solving Poisson equation involving
- * the provided image, with zero Dirichlet boundary conditions
+ * Initialize the solver for the Poisson equation involving the provided
+ * image, with zero Dirichlet boundary conditions. By default this is the
+ * matrix-free multigrid solver, the sparse matrix solvers (direct or
+ * conjugate gradient) are used if requested (requires sparse solvers)
  *
  * This is meant to be called only once, then iteratively call solve
  *
- * It's the caller's job to delete the void *
+ * It's the caller's job to delete the void * with the dealloc function
  */
 template <class TFloat, uint VDim>
 void *
 LDDMMData<TFloat, VDim>
-::poisson_pde_zero_boundary_initialize(ImageBaseType *ref, ImageType *mask)
+::poisson_pde_zero_boundary_initialize(ImageBaseType *ref, ImageType *mask, PoissonSolverMethod method)
 {
-  typedef PoissonPDEZeroBoundary<TFloat, VDim> PDEType;
-  PDEType *pde = new PDEType(ref, mask);
+  typedef PoissonPDEZeroBoundarySolver<TFloat, VDim> PDEType;
+  PDEType *pde;
+  if(method == POISSON_MULTIGRID)
+    pde = new PoissonPDEMultigrid<TFloat, VDim>(ref, mask);
+  else
+    pde = new PoissonPDEZeroBoundary<TFloat, VDim>(ref, mask, method == POISSON_SPARSE_PCG);
   return pde;
 }
 
@@ -243,7 +607,7 @@ void
 LDDMMData<TFloat, VDim>
 ::poisson_pde_zero_boundary_dealloc(void *solver_data)
 {
-  typedef PoissonPDEZeroBoundary<TFloat, VDim> PDEType;
+  typedef PoissonPDEZeroBoundarySolver<TFloat, VDim> PDEType;
   PDEType *pde = static_cast<PDEType *>(solver_data);
   delete pde;
 }
@@ -253,7 +617,7 @@ void
 LDDMMData<TFloat, VDim>
 ::poisson_pde_zero_boundary_solve(void *solver_data, ImageType *rhs, ImageType *soln)
 {
-  typedef PoissonPDEZeroBoundary<TFloat, VDim> PDEType;
+  typedef PoissonPDEZeroBoundarySolver<TFloat, VDim> PDEType;
   PDEType *pde = static_cast<PDEType *>(solver_data);
   pde->Solve(rhs, soln);
 }
@@ -263,7 +627,7 @@ void
 LDDMMData<TFloat, VDim>
 ::poisson_pde_zero_boundary_laplacian(void *solver_data, ImageType *u, ImageType *result)
 {
-  typedef PoissonPDEZeroBoundary<TFloat, VDim> PDEType;
+  typedef PoissonPDEZeroBoundarySolver<TFloat, VDim> PDEType;
   PDEType *pde = static_cast<PDEType *>(solver_data);
   pde->ComputeLaplacian(u, result);
 }
@@ -2,9 +2,22 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <deque>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <exception>
+#include <itkMultiThreader.h>
+#include <list>
+#include <map>
 #include "FastLinearInterpolator.h"
+#include "GreedyMappedImageCache.h"
 
 #include "lddmm_data.h"
+#include "ParallelFor.h"
 
 #include "CommandLineHelper.h"
 
@@ -18,6 +31,19 @@ struct MACFParameters
   string fnSaliencyPattern, fnInitialRootPhiInvPattern;
   string fnOutIterDeltaSq, fnOutIterSubjDeltaSq;
 
+  // Distributed mode: directory shared by the processes, rank of this process
+  // and the number of processes
+  string fnDistDir;
+  int dist_rank, dist_size;
+
+  // Number of threads over which the pairs are divided (0: ITK default)
+  int threads;
+
+  // Directory where the pair data are cached, and memory budget for the pair
+  // data mapped from the cache (in MB)
+  string fnPairCacheDir;
+  double pair_memory_mb;
+
   int exponent;
   double sigma1, sigma2;
   double epsilon;
@@ -47,6 +73,10 @@ struct MACFParameters
     probe = false;
     mode = MODE_DIST_TO_WCENTER;
     rect_thresh = 0.0;
+    dist_rank = 0;
+    dist_size = 1;
+    threads = 0;
+    pair_memory_mb = 0.0;
 
     n_iter.push_back(100);
     n_iter.push_back(100);
@@ -82,9 +112,20 @@ int usage()
   printf("  -probe <N> <index>   : debugging information for specified image/index\n");
   printf("  -wssd                : optimize using the weighted sum of sqr. distances mode\n"); 
   printf("  -rect <thresh>       : apply a rectifier function to squared distances\n");
+  printf("  -threads <N>         : number of threads over which the ids and pairs are divided (def: all)\n");
   printf("transported weights:\n");
   printf("  -owtm <pattern_2s>   : write the weights transported to moving space to files\n");
   printf("  -wtm <pattern_2s>    : read transported weights (saves a lot of time upfront)\n");
+  printf("memory:\n");
+  printf("  -cache <dir>         : store the psi warps and weights of each pair, at each level, uncompressed\n");
+  printf("                         in dir. Later runs map them from dir instead of recomputing them. The pair\n");
+  printf("                         data are mapped when they are needed, and released when over budget (-mem)\n");
+  printf("  -mem <MB>            : memory budget for pair data mapped from the cache (def = 0, only keep the\n");
+  printf("                         pairs in use)\n");
+  printf("distributed optimization:\n");
+  printf("  -dist <dir> <r> <n>  : run as process r (0..n-1) of n. Each process loads the pairs of the ids\n");
+  printf("                         it owns and the processes exchange gradients and warps through the\n");
+  printf("                         files in directory dir, which must be shared by all of them\n");
   printf("patterns:\n");
   printf("  pattern_1s           : of form blah_%%1_blah.nii.gz\n");
   printf("  pattern_2s           : of form blah_%%1_blah_%%2_blah.nii.gz (1:fixed, 2:moving)\n");
@@ -114,6 +155,190 @@ string exp_pattern_2(const string &pattern, const string &id_fixed, const string
   return string_replace(string_replace(pattern, "%1", id_fixed), "%2", id_moving);
 }
 
+/**
+ * Exchange of images and scalars between MACF processes that share a directory.
+ * Id i is owned by the process with rank i % n_ranks. Each process writes its
+ * contributions to files in the directory and reads those of the other ranks,
+ * waiting for them to appear. The files are written under a temporary name and
+ * renamed, so a file that exists is complete. All ranks must call the collective
+ * operations in the same order. With a single rank all operations are no-ops.
+ */
+template <typename TFloat, unsigned int VDim>
+class MACFSharedDirectoryExchange
+{
+public:
+  typedef LDDMMData<TFloat, VDim> LDDMMType;
+  typedef typename LDDMMType::VectorImageType VectorImageType;
+  typedef typename VectorImageType::Pointer VectorImagePointer;
+  typedef typename VectorImageType::PixelType VectorType;
+
+  MACFSharedDirectoryExchange(const string &dir, int rank, int n_ranks)
+    : m_Dir(dir), m_Rank(rank), m_NumRanks(n_ranks), m_Counter(0) {}
+
+  bool IsDistributed() const { return m_NumRanks > 1; }
+
+  bool IsOwner(int i) const { return (i % m_NumRanks) == m_Rank; }
+
+  int GetOwner(int i) const { return i % m_NumRanks; }
+
+  /** Sum the partial images of all ranks. Only the owned images hold the sum */
+  void ReduceToOwners(vector<VectorImagePointer> &img)
+    {
+    if(!IsDistributed())
+      return;
+
+    int c = this->BeginCollective();
+    for(int i = 0; i < (int) img.size(); i++)
+      if(!IsOwner(i))
+        this->WriteImage(this->GetFileName(c, i, m_Rank), img[i]);
+
+    for(int i = 0; i < (int) img.size(); i++)
+      if(IsOwner(i))
+        for(int r = 0; r < m_NumRanks; r++)
+          if(r != m_Rank)
+            this->ReadImage(this->GetFileName(c, i, r), img[i], true);
+    }
+
+  /** Copy each image from its owner to all the other ranks */
+  void BroadcastFromOwners(vector<VectorImagePointer> &img)
+    {
+    if(!IsDistributed())
+      return;
+
+    int c = this->BeginCollective();
+    for(int i = 0; i < (int) img.size(); i++)
+      if(IsOwner(i))
+        this->WriteImage(this->GetFileName(c, i, m_Rank), img[i]);
+
+    for(int i = 0; i < (int) img.size(); i++)
+      if(!IsOwner(i))
+        this->ReadImage(this->GetFileName(c, i, GetOwner(i)), img[i], false);
+    }
+
+  /** Sum (or maximum) of a value over all ranks */
+  double AllReduce(double value, bool use_max = false)
+    {
+    if(!IsDistributed())
+      return value;
+
+    int c = this->BeginCollective();
+    string fn = this->GetFileName(c, -1, m_Rank);
+    FILE *f = fopen((fn + ".tmp").c_str(), "wt");
+    if(!f)
+      throw GreedyException("Unable to write to exchange directory %s", m_Dir.c_str());
+    fprintf(f, "%.17g\n", value);
+    fclose(f);
+    this->Publish(fn);
+
+    double result = value;
+    for(int r = 0; r < m_NumRanks; r++)
+      {
+      if(r != m_Rank)
+        {
+        FILE *fr = this->WaitAndOpen(this->GetFileName(c, -1, r));
+        double x = 0.0;
+        if(fscanf(fr, "%lf", &x) != 1)
+          throw GreedyException("Unable to read value of rank %d from exchange directory", r);
+        fclose(fr);
+        result = use_max ? std::max(result, x) : result + x;
+        }
+      }
+    return result;
+    }
+
+  /** Wait for all ranks to get here, and remove the files that are no longer needed */
+  void Finish()
+    {
+    if(!IsDistributed())
+      return;
+
+    this->AllReduce(0.0);
+    this->RemoveFiles(m_Counter - 1);
+    }
+
+protected:
+
+  /**
+   * Every collective reads data from every other rank, so when this rank starts
+   * collective c, all the other ranks have started c - 1 and are done reading the
+   * files of c - 2. Those can be removed.
+   */
+  int BeginCollective()
+    {
+    int c = m_Counter++;
+    this->RemoveFiles(c - 2);
+    return c;
+    }
+
+  string GetFileName(int c, int i, int rank)
+    {
+    char buffer[64];
+    if(i >= 0)
+      sprintf(buffer, "/macf_c%06d_i%05d_r%04d.dat", c, i, rank);
+    else
+      sprintf(buffer, "/macf_c%06d_r%04d.txt", c, rank);
+    return m_Dir + buffer;
+    }
+
+  void Publish(const string &fn)
+    {
+    if(rename((fn + ".tmp").c_str(), fn.c_str()) != 0)
+      throw GreedyException("Unable to rename exchange file %s", fn.c_str());
+    m_Written.push_back(make_pair(m_Counter - 1, fn));
+    }
+
+  void RemoveFiles(int c_last)
+    {
+    while(m_Written.size() && m_Written.front().first <= c_last)
+      {
+      remove(m_Written.front().second.c_str());
+      m_Written.pop_front();
+      }
+    }
+
+  FILE *WaitAndOpen(const string &fn)
+    {
+    FILE *f;
+    while(!(f = fopen(fn.c_str(), "rb")))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return f;
+    }
+
+  void WriteImage(const string &fn, VectorImageType *img)
+    {
+    size_t n = img->GetBufferedRegion().GetNumberOfPixels();
+    FILE *f = fopen((fn + ".tmp").c_str(), "wb");
+    if(!f || fwrite(img->GetBufferPointer(), sizeof(VectorType), n, f) != n)
+      throw GreedyException("Unable to write exchange file %s", fn.c_str());
+    fclose(f);
+    this->Publish(fn);
+    }
+
+  void ReadImage(const string &fn, VectorImageType *img, bool add)
+    {
+    size_t n = img->GetBufferedRegion().GetNumberOfPixels();
+    FILE *f = this->WaitAndOpen(fn);
+    VectorType *p = img->GetBufferPointer();
+    if(add)
+      {
+      m_Buffer.resize(n);
+      if(fread(&m_Buffer[0], sizeof(VectorType), n, f) != n)
+        throw GreedyException("Unable to read exchange file %s", fn.c_str());
+      for(size_t k = 0; k < n; k++)
+        p[k] += m_Buffer[k];
+      }
+    else if(fread(p, sizeof(VectorType), n, f) != n)
+      throw GreedyException("Unable to read exchange file %s", fn.c_str());
+    fclose(f);
+    img->Modified();
+    }
+
+  string m_Dir;
+  int m_Rank, m_NumRanks, m_Counter;
+  deque<pair<int, string> > m_Written;
+  vector<VectorType> m_Buffer;
+};
+
 template <typename TFloat, unsigned int VDim>
 class MACFWorker
 {
@@ -127,6 +352,7 @@ public:
   typedef typename VectorImageType::Pointer VectorImagePointer;
   typedef typename ImageType::Pointer ImagePointer;
   typedef typename MatrixImageType::Pointer MatrixImagePointer;
+  typedef MACFSharedDirectoryExchange<TFloat, VDim> ExchangeType;
 
   void ReadImages()
     {
@@ -138,6 +364,18 @@ public:
 
     // Allocate the main storage
     m_Size = m_Ids.size();
+    if(m_Size < m_Param.dist_size)
+      throw GreedyException("There are fewer ids than distributed processes");
+
+    // The ids owned by this process
+    m_Owned.clear();
+    for(int i = 0; i < m_Size; i++)
+      if(m_Exchange.IsOwner(i))
+        m_Owned.push_back(i);
+
+    // The ITK filters run single-threaded inside of the tasks, so all threads go to the tasks
+    m_NumThreads = m_Param.threads > 0
+                   ? m_Param.threads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
 
     // Create the levels
     m_Levels.resize(m_Param.n_iter.size());
@@ -160,6 +398,29 @@ public:
       lev->scalar_work2 = LDDMMType::new_img(lev->reference);
       lev->factor = factor;
 
+      // Working images for each thread. The first thread uses those of the level. In
+      // the WSSD mode, each other thread also accumulates its own gradients
+      lev->thread_work.resize(m_NumThreads);
+      for(int t = 0; t < m_NumThreads; t++)
+        {
+        ThreadWork &tw = lev->thread_work[t];
+        if(t == 0)
+          {
+          tw.work = lev->work; tw.work2 = lev->work2;
+          tw.scalar_work = lev->scalar_work; tw.scalar_work2 = lev->scalar_work2;
+          }
+        else
+          {
+          tw.work = LDDMMType::new_vimg(lev->reference);
+          tw.work2 = LDDMMType::new_vimg(lev->reference);
+          tw.scalar_work = LDDMMType::new_img(lev->reference);
+          tw.scalar_work2 = LDDMMType::new_img(lev->reference);
+          if(m_Param.mode == MACFParameters::MODE_SUM_WDISTANCE)
+            for(int i = 0; i < m_Size; i++)
+              tw.grad.push_back(LDDMMType::new_vimg(lev->reference));
+          }
+        }
+
       // Create all the image data
       lev->img_data.resize(m_Size);
       for(int i = 0; i < m_Size; i++)
@@ -180,7 +441,7 @@ public:
     for(int i = 0; i < m_Size; i++)
       {
       // Read the saliency images if they are requested
-      if(m_Param.fnSaliencyPattern.size())
+      if(m_Param.fnSaliencyPattern.size() && m_Exchange.IsOwner(i))
         {
         // Start with the last leve
         lev = m_Levels.rbegin();
@@ -195,10 +456,18 @@ public:
           lev->img_data[i].saliency = LDDMMType::img_downsample(uplev->img_data[i].saliency, 2);
         }
 
-      for(int j = 0; j < m_Size; j++)
+      // The pair data are only loaded by the process that owns the fixed id
+      for(int j = 0; j < m_Size && m_Exchange.IsOwner(i); j++)
         {
         if(i != j)
           {
+          // With the cache, pair data computed by an earlier run are mapped when needed
+          if(m_PairCache.IsEnabled() && m_Param.fnOutTransportedWeightsPattern.empty() && IsPairCached(i, j))
+            {
+            cout << "c" << flush;
+            continue;
+            }
+
           // Start with the last leve
           lev = m_Levels.rbegin();
 
@@ -287,6 +556,10 @@ public:
             pd.wgt_moving = LDDMMType::img_downsample(up_pd.wgt_moving, 2);
             }
 
+          // Move the pair data to the cache
+          if(m_PairCache.IsEnabled())
+            StorePairInCache(i, j);
+
           cout << "." << flush;
           }
         }
@@ -334,11 +607,13 @@ public:
     // Reference to the level data
     LevelData &lev = m_Levels[level];
 
-    // Compute the deltas and the objective
-    for(int i = 0; i < m_Size; i++)
+    // Compute the deltas and the objective. Each thread handles whole ids
+    this->ParallelFor(m_Owned.size(), [&](int k, int thread)
       {
       // Get a reference to the i-th image data
+      int i = m_Owned[k];
       ImageData &id = lev.img_data[i];
+      ThreadWork &tw = lev.thread_work[thread];
 
       // Set the delta to the current u_i
       LDDMMType::vimg_copy(id.u, id.delta);
@@ -348,29 +623,33 @@ public:
         {
         if(j != i)
           {
-          PairData &pd = id.pair_data[j];
-          LDDMMType::interp_vimg(lev.img_data[j].u, pd.psi_forward, 1.0, lev.work);
-          LDDMMType::vimg_add_in_place(lev.work, pd.psi_forward);
-          LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_fixed);
-          LDDMMType::vimg_subtract_in_place(id.delta, lev.work);
+          PairData pd = this->GetPairData(level, i, j);
+          LDDMMType::interp_vimg(lev.img_data[j].u, pd.psi_forward, 1.0, tw.work);
+          LDDMMType::vimg_add_in_place(tw.work, pd.psi_forward);
+          LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_fixed);
+          LDDMMType::vimg_subtract_in_place(id.delta, tw.work);
           }
         }
 
       // Compute the norm of the delta
       if(m_Param.fnSaliencyPattern.size())
         {
-        LDDMMType::vimg_euclidean_inner_product(lev.scalar_work, id.delta, id.delta);
-        LDDMMType::img_multiply_in_place(lev.scalar_work, id.saliency);
-        id.norm_delta = LDDMMType::img_voxel_sum(lev.scalar_work);
+        LDDMMType::vimg_euclidean_inner_product(tw.scalar_work, id.delta, id.delta);
+        LDDMMType::img_multiply_in_place(tw.scalar_work, id.saliency);
+        id.norm_delta = LDDMMType::img_voxel_sum(tw.scalar_work);
         }
       else
         {
         id.norm_delta = LDDMMType::vimg_euclidean_norm_sq(id.delta);
         }
+      });
 
-      // Add to the total error
-      total_error += id.norm_delta;
-      }
+    // Add to the total error
+    for(int k = 0; k < (int) m_Owned.size(); k++)
+      total_error += lev.img_data[m_Owned[k]].norm_delta;
+
+    // Sum the error over the processes
+    total_error = m_Exchange.AllReduce(total_error);
 
     // Extract the average error per pixel per image
     total_error /= m_Size * lev.reference->GetBufferedRegion().GetNumberOfPixels();
@@ -383,65 +662,185 @@ public:
     // Reference to the level data
     LevelData &lev = m_Levels[level];
 
-    double global_max_norm = 0.0;
-
-    // Compute gradients and their norms
-    for(int m = 0; m < m_Size; m++)
+    // Compute the gradients, each thread handling whole ids. In distributed mode,
+    // the gradients of the ids owned by other processes accumulate partial sums
+    this->ParallelFor(m_Size, [&](int m, int thread)
       {
-      // Get a reference to the i-th image data
+      // Get a reference to the m-th image data
       ImageData &id_m = lev.img_data[m];
+      ThreadWork &tw = lev.thread_work[thread];
 
-      // Start by adding the delta
-      LDDMMType::vimg_copy(id_m.delta, id_m.grad_u);
+      if(m_Exchange.IsOwner(m))
+        {
+        // Start by adding the delta
+        LDDMMType::vimg_copy(id_m.delta, id_m.grad_u);
 
-      // If using saliency, multiply by it
-      if(m_Param.fnSaliencyPattern.size())
-        LDDMMType::vimg_multiply_in_place(id_m.grad_u, id_m.saliency);
+        // If using saliency, multiply by it
+        if(m_Param.fnSaliencyPattern.size())
+          LDDMMType::vimg_multiply_in_place(id_m.grad_u, id_m.saliency);
+        }
+      else
+        {
+        LDDMMType::vimg_scale_in_place(id_m.grad_u, 0.0);
+        }
 
-      // Subtract each of the deltas warped into moving space
+      // Subtract each of the deltas warped into moving space. The pair (j,m) is
+      // stored with id j, so the term is computed by the process that owns j
       for(int j = 0; j < m_Size; j++)
         {
-        if(m != j)
+        if(m != j && m_Exchange.IsOwner(j))
           {
-          // Get a reference to the i-th image data
+          // Get a reference to the j-th image data
           ImageData &id_j = lev.img_data[j];
 
-          PairData &pd = id_j.pair_data[m];
-          LDDMMType::interp_vimg(id_j.delta, pd.psi_inverse, 1.0, lev.work);
-          LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_moving);
-          LDDMMType::vimg_subtract_in_place(id_m.grad_u, lev.work);
+          PairData pd = this->GetPairData(level, j, m);
+          LDDMMType::interp_vimg(id_j.delta, pd.psi_inverse, 1.0, tw.work);
+          LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_moving);
+          LDDMMType::vimg_subtract_in_place(id_m.grad_u, tw.work);
           }
         }
+      });
+
+    // Sum the partial gradients
+    this->ReduceGradients(level);
+
+    // Smooth the gradients and update the warps
+    this->SmoothGradientsAndUpdate(level, -1.0);
+    }
+
+  /**
+   * Smooth the gradients of the owned ids, scale them by the global maximum of
+   * their norm and take a step of given sign. The updated warps are then shared
+   * with the other processes
+   */
+  void SmoothGradientsAndUpdate(int level, double step_sign, bool verbose = false)
+    {
+    // Reference to the level data
+    LevelData &lev = m_Levels[level];
+
+    // Compute gradients and their norms
+    this->ParallelFor(m_Owned.size(), [&](int k, int thread)
+      {
+      // Get a reference to the m-th image data
+      ImageData &id_m = lev.img_data[m_Owned[k]];
+      ThreadWork &tw = lev.thread_work[thread];
 
       // Smooth the gradient 
-      LDDMMType::vimg_smooth_withborder(id_m.grad_u, lev.work, m_Param.sigma1, 1);
+      LDDMMType::vimg_smooth_withborder(id_m.grad_u, tw.work, m_Param.sigma1, 1);
 
       // Compute the norm of the gradient
       TFloat norm_min, norm_max;
-      LDDMMType::vimg_norm_min_max(id_m.grad_u, lev.scalar_work, norm_min, norm_max);
-      if(norm_max > global_max_norm)
-        global_max_norm = norm_max;
-      }
+      LDDMMType::vimg_norm_min_max(id_m.grad_u, tw.scalar_work, norm_min, norm_max);
+      id_m.norm_grad = norm_max;
+      });
+
+    double global_max_norm = 0.0;
+    for(int k = 0; k < (int) m_Owned.size(); k++)
+      global_max_norm = std::max(global_max_norm, lev.img_data[m_Owned[k]].norm_grad);
+    global_max_norm = m_Exchange.AllReduce(global_max_norm, true);
 
     // Compute the scaling factor
     double scale = 1.0 / (2 << m_Param.exponent);
     if(global_max_norm > m_Param.epsilon)
       scale = scale * m_Param.epsilon / global_max_norm;
 
+    if(verbose)
+      printf("GMN: %f, Eps: %f, Scale: %f\n", global_max_norm, m_Param.epsilon, scale);
+
     // Scale everything down by the max norm and smooth again
-    for(int m = 0; m < m_Size; m++)
+    this->ParallelFor(m_Owned.size(), [&](int k, int thread)
       {
-      // Get a reference to the i-th image data
-      ImageData &id_m = lev.img_data[m];
+      // Get a reference to the m-th image data
+      ImageData &id_m = lev.img_data[m_Owned[k]];
+      ThreadWork &tw = lev.thread_work[thread];
 
       // Compute the updated root warp
-      LDDMMType::vimg_copy(id_m.u_root, lev.work);
-      LDDMMType::vimg_add_scaled_in_place(lev.work, id_m.grad_u, -scale);
-      LDDMMType::vimg_smooth_withborder(lev.work, id_m.u_root, m_Param.sigma2, 1);
+      LDDMMType::vimg_copy(id_m.u_root, tw.work);
+      LDDMMType::vimg_add_scaled_in_place(tw.work, id_m.grad_u, step_sign * scale);
+      LDDMMType::vimg_smooth_withborder(tw.work, id_m.u_root, m_Param.sigma2, 1);
 
       // Exponentiate the root warps
-      LDDMMType::vimg_exp(id_m.u_root, id_m.u, lev.work, m_Param.exponent, 1.0);
+      LDDMMType::vimg_exp(id_m.u_root, id_m.u, tw.work, m_Param.exponent, 1.0);
+      });
+
+    // Share the updated warps
+    this->BroadcastWarps(level);
+    }
+
+  /** Number of threads used for n tasks */
+  int GetNumberOfThreadsUsed(int n)
+    {
+    return std::max(1, std::min(m_NumThreads, n));
+    }
+
+  /**
+   * Call f(k, thread) for the tasks k = 0..n-1. Task k always runs on thread
+   * k % n_threads, so the results do not depend on the scheduling. Each task
+   * thread runs under a thread quota of one, so the ITK filters and loops that
+   * the tasks call are single-threaded
+   */
+  template <class TFunction>
+  void ParallelFor(int n, TFunction f)
+    {
+    int n_threads = this->GetNumberOfThreadsUsed(n);
+    if(n_threads == 1)
+      {
+      for(int k = 0; k < n; k++)
+        f(k, 0);
+      return;
       }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    vector<std::thread> pool;
+    for(int t = 0; t < n_threads; t++)
+      {
+      pool.push_back(std::thread([&, t]()
+        {
+        try
+          {
+          ::ParallelFor::ThreadQuota quota(1);
+          for(int k = t; k < n; k += n_threads)
+            f(k, t);
+          }
+        catch(...)
+          {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if(!error)
+            error = std::current_exception();
+          }
+        }));
+      }
+    for(auto &th : pool)
+      th.join();
+
+    if(error)
+      std::rethrow_exception(error);
+    }
+
+  /** Image into which a thread accumulates the gradient of id m */
+  VectorImageType *GetGradientAccumulator(int level, int thread, int m)
+    {
+    LevelData &lev = m_Levels[level];
+    return thread == 0 ? lev.img_data[m].grad_u.GetPointer() : lev.thread_work[thread].grad[m].GetPointer();
+    }
+
+  void ReduceGradients(int level)
+    {
+    LevelData &lev = m_Levels[level];
+    vector<VectorImagePointer> grad(m_Size);
+    for(int m = 0; m < m_Size; m++)
+      grad[m] = lev.img_data[m].grad_u;
+    m_Exchange.ReduceToOwners(grad);
+    }
+
+  void BroadcastWarps(int level)
+    {
+    LevelData &lev = m_Levels[level];
+    vector<VectorImagePointer> u(m_Size);
+    for(int m = 0; m < m_Size; m++)
+      u[m] = lev.img_data[m].u;
+    m_Exchange.BroadcastFromOwners(u);
     }
 
 
@@ -468,7 +867,7 @@ public:
         {
         if(j != i)
           {
-          PairData &pd = id.pair_data[j];
+          PairData pd = this->GetPairData(level, i, j);
 
           // Compute \Delta_{ij} and place into lev.work
           LDDMMType::interp_vimg(lev.img_data[j].u, pd.psi_forward, 1.0, lev.work);
@@ -518,7 +917,7 @@ public:
           ImageData &id_j = lev.img_data[j];
 
           // Add up the other terms
-          PairData &pd = id_j.pair_data[m];
+          PairData pd = this->GetPairData(level, j, m);
 
           // Term phi_j^{-1} \circ \psi_{jm} - \phi_m^{-1}
           LDDMMType::interp_vimg(id_j.u, pd.psi_inverse, 1.0, lev.work);
@@ -571,15 +970,27 @@ public:
     // Reference to the level data
     LevelData &lev = m_Levels[level];
 
-    // Initialize all the gradients to zero
+    // Initialize all the gradients to zero, as well as the per-thread accumulators
+    int n_threads = this->GetNumberOfThreadsUsed(m_Owned.size());
     for(int i = 0; i < m_Size; i++)
       LDDMMType::vimg_scale_in_place(lev.img_data[i].grad_u, 0.0);
+    for(int t = 0; t < n_threads; t++)
+      {
+      lev.thread_work[t].error = 0.0;
+      for(int i = 0; i < (int) lev.thread_work[t].grad.size(); i++)
+        LDDMMType::vimg_scale_in_place(lev.thread_work[t].grad[i], 0.0);
+      }
 
-    // Iterate over all pairs
-    for(int i = 0; i < m_Size; i++)
+    // Iterate over all pairs whose fixed id is owned by this process. Each thread
+    // handles whole fixed ids, and the terms that go to the moving ids are added
+    // to the accumulators of the thread
+    this->ParallelFor(m_Owned.size(), [&](int k, int thread)
       {
       // Get a reference to the i-th image data
+      int i = m_Owned[k];
       ImageData &id_i = lev.img_data[i];
+      ThreadWork &tw = lev.thread_work[thread];
+      VectorImageType *grad_i = this->GetGradientAccumulator(level, thread, i);
 
       // Add all the differences
       for(int j = 0; j < m_Size; j++)
@@ -588,99 +999,113 @@ public:
           {
           // Get references to image and pair data
           ImageData &id_j = lev.img_data[j];
-          PairData &pd = id_i.pair_data[j];
+          PairData pd = this->GetPairData(level, i, j);
+          VectorImageType *grad_j = this->GetGradientAccumulator(level, thread, j);
 
           // Compute \Delta_{ij} in work
-          LDDMMType::interp_vimg(id_j.u, pd.psi_forward, 1.0, lev.work);
-          LDDMMType::vimg_add_in_place(lev.work, pd.psi_forward);
-          LDDMMType::vimg_scale_in_place(lev.work, -1.0);
-          LDDMMType::vimg_add_in_place(lev.work, id_i.u);
+          LDDMMType::interp_vimg(id_j.u, pd.psi_forward, 1.0, tw.work);
+          LDDMMType::vimg_add_in_place(tw.work, pd.psi_forward);
+          LDDMMType::vimg_scale_in_place(tw.work, -1.0);
+          LDDMMType::vimg_add_in_place(tw.work, id_i.u);
 
           // If using rectifier do this
           if(m_Param.rect_thresh > 0.0)
             {
             // Compute the norm of the delta (no weighting)
-            LDDMMType::vimg_euclidean_inner_product(lev.scalar_work, lev.work, lev.work);
+            LDDMMType::vimg_euclidean_inner_product(tw.scalar_work, tw.work, tw.work);
 
             // Apply the rectifier function to the norm
-            LDDMMType::img_linear_to_const_rectifier_deriv(lev.scalar_work, lev.scalar_work2, m_Param.rect_thresh);
+            LDDMMType::img_linear_to_const_rectifier_deriv(tw.scalar_work, tw.scalar_work2, m_Param.rect_thresh);
 
             // Multiply through by the weight - this is what gives us the objective function
-            LDDMMType::img_multiply_in_place(lev.scalar_work2, pd.wgt_fixed);
-            total_error += LDDMMType::img_voxel_sum(lev.scalar_work2);
+            LDDMMType::img_multiply_in_place(tw.scalar_work2, pd.wgt_fixed);
+            tw.error += LDDMMType::img_voxel_sum(tw.scalar_work2);
 
             // The contribution to i'th gradient 
-            LDDMMType::img_linear_to_const_rectifier_deriv(lev.scalar_work, lev.scalar_work2, m_Param.rect_thresh);
-            LDDMMType::img_multiply_in_place(lev.scalar_work2, pd.wgt_fixed);
-            LDDMMType::vimg_copy(lev.work, lev.work2);
-            LDDMMType::vimg_multiply_in_place(lev.work2, lev.scalar_work2);
-            LDDMMType::vimg_add_in_place(id_i.grad_u, lev.work2);
+            LDDMMType::img_linear_to_const_rectifier_deriv(tw.scalar_work, tw.scalar_work2, m_Param.rect_thresh);
+            LDDMMType::img_multiply_in_place(tw.scalar_work2, pd.wgt_fixed);
+            LDDMMType::vimg_copy(tw.work, tw.work2);
+            LDDMMType::vimg_multiply_in_place(tw.work2, tw.scalar_work2);
+            LDDMMType::vimg_add_in_place(grad_i, tw.work2);
 
-            // Transform the (unscaled) delta into moving space - in lev.work2
-            LDDMMType::interp_vimg(lev.work, pd.psi_inverse, 1.0, lev.work2);
+            // Transform the (unscaled) delta into moving space - in tw.work2
+            LDDMMType::interp_vimg(tw.work, pd.psi_inverse, 1.0, tw.work2);
 
             // Square and rectify the transformed delta
-            LDDMMType::vimg_euclidean_inner_product(lev.scalar_work, lev.work2, lev.work2);
-            LDDMMType::img_linear_to_const_rectifier_deriv(lev.scalar_work, lev.scalar_work2, m_Param.rect_thresh);
+            LDDMMType::vimg_euclidean_inner_product(tw.scalar_work, tw.work2, tw.work2);
+            LDDMMType::img_linear_to_const_rectifier_deriv(tw.scalar_work, tw.scalar_work2, m_Param.rect_thresh);
 
             // Multiply by the compressed moving weight 
-            LDDMMType::img_multiply_in_place(lev.scalar_work2, pd.wgt_moving);
+            LDDMMType::img_multiply_in_place(tw.scalar_work2, pd.wgt_moving);
 
             // Multiple the transformed delta by this product
-            LDDMMType::vimg_multiply_in_place(lev.work2, lev.scalar_work2);
+            LDDMMType::vimg_multiply_in_place(tw.work2, tw.scalar_work2);
 
             // Subtract this from the j'th gradient
-            LDDMMType::vimg_subtract_in_place(id_j.grad_u, lev.work2);
+            LDDMMType::vimg_subtract_in_place(grad_j, tw.work2);
             }
           else
             {
             // Copy the delta into work2
-            LDDMMType::vimg_copy(lev.work, lev.work2);
+            LDDMMType::vimg_copy(tw.work, tw.work2);
 
             // Scale the delta by the weight. This is added to i's gradient
-            LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_fixed);
+            LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_fixed);
 
             // Compute the weighted norm (w * |Delta|)
-            LDDMMType::vimg_euclidean_inner_product(lev.scalar_work, lev.work, lev.work2);
-            total_error += LDDMMType::img_voxel_sum(lev.scalar_work);
+            LDDMMType::vimg_euclidean_inner_product(tw.scalar_work, tw.work, tw.work2);
+            tw.error += LDDMMType::img_voxel_sum(tw.scalar_work);
 
             // Make contribution to the i'th gradient
-            LDDMMType::vimg_add_in_place(id_i.grad_u, lev.work);
+            LDDMMType::vimg_add_in_place(grad_i, tw.work);
 
-            // Transform the (unscaled) delta into moving space - in lev.work
-            LDDMMType::interp_vimg(lev.work2, pd.psi_inverse, 1.0, lev.work);
+            // Transform the (unscaled) delta into moving space - in tw.work
+            LDDMMType::interp_vimg(tw.work2, pd.psi_inverse, 1.0, tw.work);
 
             // Multiply by the compressed weight in moving space
-            LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_moving);
+            LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_moving);
 
             // This is added with a minus sign to the j's gradient
-            LDDMMType::vimg_subtract_in_place(id_j.grad_u, lev.work);
+            LDDMMType::vimg_subtract_in_place(grad_j, tw.work);
             }
 
           // Copy the delta into work2
-          LDDMMType::vimg_copy(lev.work, lev.work2);
+          LDDMMType::vimg_copy(tw.work, tw.work2);
 
           // Scale the delta by the weight. This is added to i's gradient
-          LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_fixed);
+          LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_fixed);
 
           // Compute the weighted norm (w * |Delta|)
-          LDDMMType::vimg_euclidean_inner_product(lev.scalar_work, lev.work, lev.work2);
-          total_error += LDDMMType::img_voxel_sum(lev.scalar_work);
+          LDDMMType::vimg_euclidean_inner_product(tw.scalar_work, tw.work, tw.work2);
+          tw.error += LDDMMType::img_voxel_sum(tw.scalar_work);
 
           // Make contribution to the i'th gradient
-          LDDMMType::vimg_add_in_place(id_i.grad_u, lev.work);
+          LDDMMType::vimg_add_in_place(grad_i, tw.work);
 
-          // Transform the (unscaled) delta into moving space - in lev.work
-          LDDMMType::interp_vimg(lev.work2, pd.psi_inverse, 1.0, lev.work);
+          // Transform the (unscaled) delta into moving space - in tw.work
+          LDDMMType::interp_vimg(tw.work2, pd.psi_inverse, 1.0, tw.work);
 
           // Multiply by the compressed weight in moving space
-          LDDMMType::vimg_multiply_in_place(lev.work, pd.wgt_moving);
+          LDDMMType::vimg_multiply_in_place(tw.work, pd.wgt_moving);
 
           // This is added with a minus sign to the j's gradient
-          LDDMMType::vimg_subtract_in_place(id_j.grad_u, lev.work);
+          LDDMMType::vimg_subtract_in_place(grad_j, tw.work);
           }
         }
-      }
+      });
+
+    // Add up the per-thread accumulators
+    this->ParallelFor(m_Size, [&](int m, int)
+      {
+      for(int t = 1; t < n_threads; t++)
+        LDDMMType::vimg_add_in_place(lev.img_data[m].grad_u, lev.thread_work[t].grad[m]);
+      });
+    for(int t = 0; t < n_threads; t++)
+      total_error += lev.thread_work[t].error;
+
+    // Sum the gradients and the error over the processes
+    this->ReduceGradients(level);
+    total_error = m_Exchange.AllReduce(total_error);
 
     // Extract the average error per pixel per image
     total_error /= m_Size * lev.reference->GetBufferedRegion().GetNumberOfPixels();
@@ -691,48 +1116,7 @@ public:
 
   void ComputeGradientAndUpdateNewest(int level)
     {
-    // Reference to the level data
-    LevelData &lev = m_Levels[level];
-
-    double global_max_norm = 0.0;
-
-    // Compute gradients and their norms
-    for(int m = 0; m < m_Size; m++)
-      {
-      // Get a reference to the i-th image data
-      ImageData &id_m = lev.img_data[m];
-
-      // Smooth the gradient 
-      LDDMMType::vimg_smooth_withborder(id_m.grad_u, lev.work, m_Param.sigma1, 1);
-
-      // Compute the norm of the gradient
-      TFloat norm_min, norm_max;
-      LDDMMType::vimg_norm_min_max(id_m.grad_u, lev.scalar_work, norm_min, norm_max);
-      if(norm_max > global_max_norm)
-        global_max_norm = norm_max;
-      }
-
-    // Compute the scaling factor
-    double scale = 1.0 / (2 << m_Param.exponent);
-    if(global_max_norm > m_Param.epsilon)
-      scale = scale * m_Param.epsilon / global_max_norm;
-
-    printf("GMN: %f, Eps: %f, Scale: %f\n", global_max_norm, m_Param.epsilon, scale);
-
-    // Scale everything down by the max norm and smooth again
-    for(int m = 0; m < m_Size; m++)
-      {
-      // Get a reference to the i-th image data
-      ImageData &id_m = lev.img_data[m];
-
-      // Compute the updated root warp
-      LDDMMType::vimg_copy(id_m.u_root, lev.work);
-      LDDMMType::vimg_add_scaled_in_place(lev.work, id_m.grad_u, -scale);
-      LDDMMType::vimg_smooth_withborder(lev.work, id_m.u_root, m_Param.sigma2, 1);
-
-      // Exponentiate the root warps
-      LDDMMType::vimg_exp(id_m.u_root, id_m.u, lev.work, m_Param.exponent, 1.0);
-      }
+    this->SmoothGradientsAndUpdate(level, -1.0, true);
     }
 
 
@@ -824,6 +1208,9 @@ public:
 
     for(int i = 0; i < m_Size; i++)
       {
+      if(!m_Exchange.IsOwner(i))
+        continue;
+
       // Map the warp back into physical units
       OFHelperType::VoxelWarpToPhysicalWarp(lev.img_data[i].u_root, lev.reference, lev.work);
       string fn = exp_pattern_1(m_Param.fnOutPhiPattern, m_Ids[i]);
@@ -836,14 +1223,17 @@ public:
     LevelData &src_lev = m_Levels[level-1];
     LevelData &trg_lev = m_Levels[level];
 
-    for(int i = 0; i < m_Size; i++)
+    this->ParallelFor(m_Owned.size(), [&](int k, int thread)
       {
-      ImageData &id_src = src_lev.img_data[i];
-      ImageData &id_trg = trg_lev.img_data[i];
+      ImageData &id_src = src_lev.img_data[m_Owned[k]];
+      ImageData &id_trg = trg_lev.img_data[m_Owned[k]];
       LDDMMType::vimg_resample_identity(id_src.u_root, trg_lev.reference, id_trg.u_root);
       LDDMMType::vimg_scale_in_place(id_trg.u_root, 2.0);
-      LDDMMType::vimg_exp(id_trg.u_root, id_trg.u, trg_lev.work, m_Param.exponent, 1.0);
-      }
+      LDDMMType::vimg_exp(id_trg.u_root, id_trg.u, trg_lev.thread_work[thread].work, m_Param.exponent, 1.0);
+      });
+
+    // Share the upsampled warps
+    this->BroadcastWarps(level);
     }
 
   bool DumpThisIter(int level, int iter)
@@ -871,7 +1261,7 @@ public:
       {
       if(i != m_Param.probe_image_index)
         {
-        PairData &pd = id.pair_data[i];
+        PairData pd = this->GetPairData(level, m_Param.probe_image_index, i);
         typename VectorImageType::PixelType psi_vec = pd.psi_forward->GetPixel(idx);
 
         cout << pd.wgt_fixed->GetPixel(idx) << ",";
@@ -976,14 +1366,26 @@ public:
 
   void Run()
     {
+    // The per-iteration outputs need the data of all the ids
+    if(m_Exchange.IsDistributed()
+       && (m_Param.fnOutIterTemplatePattern.size() || m_Param.fnOutIterDeltaSq.size() || m_Param.probe))
+      throw GreedyException("Options -otemp, -odelta and -probe are not supported with -dist");
+
     if(m_Param.mode == MACFParameters::MODE_DIST_TO_WCENTER)
       RunDWC();
     else
       RunWSSD();
+
+    m_Exchange.Finish();
     }
 
   MACFWorker(const MACFParameters &param) 
-    : m_Param(param) {}
+    : m_Param(param), m_Exchange(param.fnDistDir, param.dist_rank, param.dist_size)
+    {
+    m_PairCache.SetDirectory(param.fnPairCacheDir);
+    m_PairMemoryBudget = (size_t) (param.pair_memory_mb * 1024 * 1024);
+    m_PairResidentBytes = 0;
+    }
 
 protected:
 
@@ -1000,7 +1402,15 @@ protected:
     VectorImagePointer delta;
     ImagePointer saliency;
     ImagePointer img_gray;
-    double norm_delta;
+    double norm_delta, norm_grad;
+    };
+
+  struct ThreadWork
+    {
+    VectorImagePointer work, work2;
+    ImagePointer scalar_work, scalar_work2;
+    vector<VectorImagePointer> grad;
+    double error;
     };
 
   struct LevelData
@@ -1009,13 +1419,143 @@ protected:
     VectorImagePointer work, work2;
     ImagePointer scalar_work, scalar_work2;
     ImagePointer reference;
+    vector<ThreadWork> thread_work;
     int factor;
     };
 
+  /**
+   * Access the data of pair (i,j) at a level. With the cache, the data are mapped
+   * from the cache file if they are not resident, and the least recently used
+   * pairs are released when the resident data exceed the memory budget. The
+   * returned copy keeps the images alive while the caller uses them.
+   */
+  PairData GetPairData(int level, int i, int j)
+    {
+    PairData &pd = m_Levels[level].img_data[i].pair_data[j];
+    if(!m_PairCache.IsEnabled())
+      return pd;
+
+    std::lock_guard<std::mutex> lock(m_PairMutex);
+    long key = ((long) level * m_Size + i) * m_Size + j;
+    typename map<long, typename list<long>::iterator>::iterator it = m_PairResident.find(key);
+    if(it != m_PairResident.end())
+      {
+      m_PairLRU.splice(m_PairLRU.begin(), m_PairLRU, it->second);
+      return pd;
+      }
+
+    if(!this->ReadPairFromCache(level, i, j, pd))
+      throw GreedyException("Data for pair %s, %s are missing from cache %s",
+                            m_Ids[i].c_str(), m_Ids[j].c_str(), m_Param.fnPairCacheDir.c_str());
+
+    m_PairLRU.push_front(key);
+    m_PairResident[key] = m_PairLRU.begin();
+    m_PairResidentBytes += this->GetPairBytes(level);
+    PairData result = pd;
+
+    // Release the least recently used pairs. Threads using them still hold references
+    while(m_PairResidentBytes > m_PairMemoryBudget && m_PairLRU.size() > 1)
+      {
+      long k_old = m_PairLRU.back();
+      int l_old = k_old / ((long) m_Size * m_Size);
+      m_Levels[l_old].img_data[(k_old / m_Size) % m_Size].pair_data[k_old % m_Size] = PairData();
+      m_PairResidentBytes -= this->GetPairBytes(l_old);
+      m_PairResident.erase(k_old);
+      m_PairLRU.pop_back();
+      }
+
+    return result;
+    }
+
+  size_t GetPairBytes(int level)
+    {
+    size_t n = m_Levels[level].reference->GetBufferedRegion().GetNumberOfPixels();
+    return n * 2 * (sizeof(typename VectorImageType::PixelType) + sizeof(TFloat));
+    }
+
+  /**
+   * The cached pair data are keyed by their source files and become out of date
+   * when these change. Data that depend on more than one file are keyed by the
+   * psi warp, with the names of the other files in the variant string.
+   */
+  void GetPairCacheKeys(int level, int i, int j, string fn[4], string variant[4])
+    {
+    ostringstream oss;
+    oss << "macf|exp" << m_Param.exponent << "|factor" << m_Levels[level].factor << "|";
+    string prefix = oss.str();
+    string fn_psi = exp_pattern_2(m_Param.fnPsiPattern, m_Ids[i], m_Ids[j]);
+    string fn_wgt = exp_pattern_2(m_Param.fnWeightPattern, m_Ids[i], m_Ids[j]);
+
+    fn[0] = fn_psi; variant[0] = prefix + "psi_forward";
+    fn[1] = fn_psi; variant[1] = prefix + "psi_inverse";
+    fn[2] = fn_wgt; variant[2] = prefix + "wgt_fixed";
+    if(m_Param.fnTransportedWeightsPattern.size())
+      {
+      fn[3] = exp_pattern_2(m_Param.fnTransportedWeightsPattern, m_Ids[i], m_Ids[j]);
+      variant[3] = prefix + "wgt_moving";
+      }
+    else
+      {
+      fn[3] = fn_psi;
+      variant[3] = prefix + "wgt_moving|" + fn_wgt;
+      if(m_Param.fnSaliencyPattern.size())
+        variant[3] += "|" + exp_pattern_1(m_Param.fnSaliencyPattern, m_Ids[i]);
+      }
+    }
+
+  bool ReadPairFromCache(int level, int i, int j, PairData &pd)
+    {
+    string fn[4], variant[4];
+    this->GetPairCacheKeys(level, i, j, fn, variant);
+    pd.psi_forward = m_PairCache.template Read<VectorImageType>(fn[0], NULL, variant[0]);
+    pd.psi_inverse = m_PairCache.template Read<VectorImageType>(fn[1], NULL, variant[1]);
+    pd.wgt_fixed = m_PairCache.template Read<ImageType>(fn[2], NULL, variant[2]);
+    pd.wgt_moving = m_PairCache.template Read<ImageType>(fn[3], NULL, variant[3]);
+    return pd.psi_forward && pd.psi_inverse && pd.wgt_fixed && pd.wgt_moving;
+    }
+
+  bool IsPairCached(int i, int j)
+    {
+    for(int level = 0; level < (int) m_Levels.size(); level++)
+      {
+      PairData pd;
+      if(!this->ReadPairFromCache(level, i, j, pd))
+        return false;
+      }
+    return true;
+    }
+
+  /** Write the data of pair (i,j) at all levels to the cache and release them */
+  void StorePairInCache(int i, int j)
+    {
+    itk::ImageIOBase::IOComponentType comp =
+        sizeof(TFloat) == 4 ? itk::ImageIOBase::FLOAT : itk::ImageIOBase::DOUBLE;
+    for(int level = 0; level < (int) m_Levels.size(); level++)
+      {
+      string fn[4], variant[4];
+      this->GetPairCacheKeys(level, i, j, fn, variant);
+      PairData &pd = m_Levels[level].img_data[i].pair_data[j];
+      m_PairCache.Store(fn[0], pd.psi_forward.GetPointer(), comp, variant[0]);
+      m_PairCache.Store(fn[1], pd.psi_inverse.GetPointer(), comp, variant[1]);
+      m_PairCache.Store(fn[2], pd.wgt_fixed.GetPointer(), comp, variant[2]);
+      m_PairCache.Store(fn[3], pd.wgt_moving.GetPointer(), comp, variant[3]);
+      pd = PairData();
+      }
+    }
+
   vector<LevelData> m_Levels;
   MACFParameters m_Param;
+  ExchangeType m_Exchange;
   vector<string> m_Ids;
-  int m_Size;
+  vector<int> m_Owned;
+  int m_Size, m_NumThreads;
+
+  // Cache of the pair data, with the pairs currently mapped in LRU order
+  GreedyMappedImageCache m_PairCache;
+  list<long> m_PairLRU;
+  map<long, typename list<long>::iterator> m_PairResident;
+  size_t m_PairResidentBytes, m_PairMemoryBudget;
+  std::mutex m_PairMutex;
 };
 
 int main(int argc, char *argv[])
@@ -1123,6 +1663,29 @@ int main(int argc, char *argv[])
       {
       param.rect_thresh = cl.read_double();
       }
+    else if(arg == "-cache")
+      {
+      param.fnPairCacheDir = cl.read_string();
+      }
+    else if(arg == "-mem")
+      {
+      param.pair_memory_mb = cl.read_double();
+      }
+    else if(arg == "-threads")
+      {
+      param.threads = cl.read_integer();
+      }
+    else if(arg == "-dist")
+      {
+      param.fnDistDir = cl.read_string();
+      param.dist_rank = cl.read_integer();
+      param.dist_size = cl.read_integer();
+      if(param.dist_size < 1 || param.dist_rank < 0 || param.dist_rank >= param.dist_size)
+        {
+        printf("Invalid rank specification for -dist\n");
+        return -1;
+        }
+      }
     else
       {
       printf("Unknown parameter %s\n", arg.c_str());
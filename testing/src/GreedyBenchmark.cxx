@@ -0,0 +1,436 @@
+/*=========================================================================
+
+  Program:   ALFABIS fast medical image registration programs
+  Language:  C++
+  Website:   github.com/pyushkevich/greedy
+  Copyright (c) Paul Yushkevich, University of Pennsylvania. All rights reserved.
+
+  This program is part of ALFABIS: Adaptive Large-Scale Framework for
+  Automatic Biomedical Image Segmentation.
+
+  ALFABIS development is funded by the NIH grant R01 EB017255.
+
+  ALFABIS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ALFABIS is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with ALFABIS.  If not, see <http://www.gnu.org/licenses/>.
+
+=========================================================================*/
+#include "lddmm_data.h"
+#include "MultiImageRegistrationHelper.h"
+#include "MultiComponentMetricReport.h"
+#include "FastLinearInterpolator.h"
+#include "OneDimensionalInPlaceAccumulateFilter.h"
+#include "dijkstra/ShortestPath.h"
+#include "itkMultiThreader.h"
+#include <vnl/vnl_random.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+/**
+ * Microbenchmarks of the hot paths of greedy. Each benchmark is run on synthetic
+ * data (and optionally on a user-supplied image pair) for a range of image sizes
+ * and thread counts, and the timings are written out as JSON.
+ */
+
+typedef LDDMMData<float, 3> LDDMMType;
+typedef MultiImageOpticalFlowHelper<float, 3> OFHelperType;
+typedef LDDMMType::ImageType ImageType;
+typedef LDDMMType::ImagePointer ImagePointer;
+typedef LDDMMType::VectorImageType VectorImageType;
+typedef LDDMMType::VectorImagePointer VectorImagePointer;
+typedef LDDMMType::CompositeImageType CompositeImageType;
+typedef LDDMMType::CompositeImagePointer CompositeImagePointer;
+
+int usage()
+{
+  printf("greedy_bench: microbenchmarks for the greedy registration code\n");
+  printf("usage: \n");
+  printf("  greedy_bench [options]\n");
+  printf("options: \n");
+  printf("  -o file.json           : Write the results to a JSON file (default: stdout)\n");
+  printf("  -s N1,N2,...           : Image sizes (cubes) to test (default: 32,64,128)\n");
+  printf("  -t T1,T2,...           : Thread counts to test (default: 1 and the default thread count)\n");
+  printf("  -r N                   : Number of repetitions for each benchmark (default: 5)\n");
+  printf("  -b name                : Only run benchmarks whose name starts with this string\n");
+  printf("  -phantom fix mov       : Also run the benchmarks on a pair of images\n");
+  return -1;
+}
+
+// A single benchmark result
+struct BenchResult
+{
+  std::string name, data;
+  int threads;
+  unsigned long voxels;
+  double t_min, t_mean;
+};
+
+// Time a function over several repetitions
+template <class TFunc>
+void RunTimed(TFunc f, int reps, double &t_min, double &t_mean)
+{
+  t_min = 1e100; t_mean = 0.0;
+  for(int r = 0; r < reps; r++)
+    {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    f();
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    t_min = std::min(t_min, t);
+    t_mean += t / reps;
+    }
+}
+
+// Synthetic test image: a smooth blob with some texture
+CompositeImagePointer MakeSyntheticImage(int size, double shift)
+{
+  CompositeImagePointer img = CompositeImageType::New();
+  itk::ImageRegion<3> region;
+  region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+  img->SetRegions(region);
+  img->SetNumberOfComponentsPerPixel(1);
+  img->Allocate();
+
+  float *p = img->GetBufferPointer();
+  double c = 0.5 * size + shift, r = 0.3 * size;
+  for(int z = 0; z < size; z++)
+    for(int y = 0; y < size; y++)
+      for(int x = 0; x < size; x++)
+        {
+        double d2 = ((x-c)*(x-c) + (y-c)*(y-c) + (z-c)*(z-c)) / (r * r);
+        *p++ = 100.0 * exp(-d2) + 10.0 * sin(0.3 * x) * cos(0.2 * y);
+        }
+
+  return img;
+}
+
+// Smooth random displacement field in voxel units
+VectorImagePointer MakeRandomWarp(LDDMMType::ImageBaseType *ref, double amplitude)
+{
+  VectorImagePointer warp = LDDMMType::new_vimg(ref);
+  VectorImagePointer tmp = LDDMMType::new_vimg(ref);
+  vnl_random randy(12345);
+  LDDMMType::Vec *p = warp->GetBufferPointer();
+  unsigned long n = warp->GetBufferedRegion().GetNumberOfPixels();
+  for(unsigned long i = 0; i < n; i++)
+    for(int d = 0; d < 3; d++)
+      p[i][d] = randy.normal() * amplitude;
+
+  LDDMMType::vimg_smooth(warp, tmp, 2.0);
+  return tmp;
+}
+
+class Benchmark
+{
+public:
+  Benchmark(int reps, const std::string &filter) : m_Reps(reps), m_Filter(filter) {}
+
+  void Run(CompositeImageType *fix, CompositeImageType *mov, const std::string &data, int threads);
+
+  void RunShortestPath(unsigned int n, unsigned int z_range, const std::string &data);
+
+  const std::vector<BenchResult> &GetResults() const { return m_Results; }
+
+protected:
+  int m_Reps;
+  std::string m_Filter;
+  std::vector<BenchResult> m_Results;
+
+  template <class TFunc>
+  void Time(const std::string &name, const std::string &data, int threads, unsigned long nv, TFunc f)
+  {
+    if(m_Filter.size() && name.compare(0, m_Filter.size(), m_Filter) != 0)
+      return;
+
+    BenchResult res;
+    res.name = name; res.data = data; res.threads = threads; res.voxels = nv;
+
+    // Warm up once, then time
+    f();
+    RunTimed(f, m_Reps, res.t_min, res.t_mean);
+    m_Results.push_back(res);
+
+    fprintf(stderr, "%-24s %-12s threads=%2d  min=%9.5fs  mean=%9.5fs  %8.2f Mvox/s\n",
+            name.c_str(), data.c_str(), threads, res.t_min, res.t_mean, 1e-6 * nv / res.t_min);
+  }
+};
+
+void Benchmark::Run(CompositeImageType *fix, CompositeImageType *mov, const std::string &data, int threads)
+{
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads);
+  unsigned long nv = fix->GetBufferedRegion().GetNumberOfPixels();
+
+  // Set up the helper with a single pyramid level
+  OFHelperType of_helper;
+  of_helper.SetDefaultPyramidFactors(1);
+  of_helper.AddImagePair(fix, mov, 1.0);
+  of_helper.BuildCompositeImages(0.0);
+
+  LDDMMType::ImageBaseType *ref = of_helper.GetReferenceSpace(0);
+  VectorImagePointer warp = MakeRandomWarp(ref, 1.0);
+  VectorImagePointer vtmp = LDDMMType::new_vimg(ref);
+  VectorImagePointer vwork = LDDMMType::new_vimg(ref);
+  ImagePointer itmp = LDDMMType::new_img(ref);
+  MultiComponentMetricReport report;
+
+  // Interpolation of the moving image at warped positions, using the batched API
+  Time("interp_linear", data, threads, nv, [&]() {
+    typedef FastLinearInterpolator<CompositeImageType, float, 3> FastInterpolator;
+    FastInterpolator fi(mov);
+    int nc = fi.GetPointerIncrement();
+    itk::Size<3> sz = fix->GetBufferedRegion().GetSize();
+    std::vector<float> cix(sz[0] * 3), out(sz[0] * nc);
+    std::vector<FastInterpolator::InOut> status(sz[0]);
+    const LDDMMType::Vec *phi = warp->GetBufferPointer();
+    for(unsigned int z = 0; z < sz[2]; z++)
+      for(unsigned int y = 0; y < sz[1]; y++, phi += sz[0])
+        {
+        for(unsigned int x = 0; x < sz[0]; x++)
+          {
+          cix[3*x] = x + phi[x][0]; cix[3*x+1] = y + phi[x][1]; cix[3*x+2] = z + phi[x][2];
+          }
+        fi.Interpolate(sz[0], &cix[0], &out[0], &status[0]);
+        }
+  });
+
+  Time("interp_vimg", data, threads, nv, [&]() {
+    LDDMMType::interp_vimg(warp, warp, 1.0, vtmp);
+  });
+
+  // Smoothing of a vector field with each of the smoothing methods
+  LDDMMType::Vec sigma; sigma.Fill(2.0);
+  Time("smooth_itk", data, threads, nv, [&]() {
+    LDDMMType::vimg_smooth(warp, vtmp, sigma, LDDMMType::SMOOTH_ITK);
+  });
+  Time("smooth_recursive", data, threads, nv, [&]() {
+    LDDMMType::vimg_smooth(warp, vtmp, sigma, LDDMMType::SMOOTH_RECURSIVE);
+  });
+  Time("smooth_box", data, threads, nv, [&]() {
+    LDDMMType::vimg_smooth(warp, vtmp, sigma, LDDMMType::SMOOTH_BOX);
+  });
+
+  // Neighborhood accumulation used by NCC
+  Time("accumulate", data, threads, nv, [&]() {
+    typedef OneDimensionalInPlaceAccumulateFilter<CompositeImageType> AccumFilterType;
+    CompositeImagePointer work = LDDMMType::new_cimg(ref, 5);
+    itk::ImageSource<CompositeImageType>::Pointer pipeTail;
+    for(int dir = 0; dir < 3; dir++)
+      {
+      AccumFilterType::Pointer accum = AccumFilterType::New();
+      accum->SetInput(pipeTail.IsNull() ? work.GetPointer() : pipeTail->GetOutput());
+      accum->SetDimension(dir);
+      accum->SetRadius(2);
+      pipeTail = accum;
+      }
+    pipeTail->Update();
+  });
+
+  // Deformable metrics with gradient
+  Time("metric_ssd", data, threads, nv, [&]() {
+    of_helper.ComputeOpticalFlowField(0, warp, itmp, report, vtmp, 1.0);
+  });
+  Time("metric_ncc", data, threads, nv, [&]() {
+    itk::Size<3> radius; radius.Fill(2);
+    of_helper.ComputeNCCMetricImage(0, warp, radius, itmp, report, vtmp, 1.0);
+  });
+  Time("metric_ncc_approx", data, threads, nv, [&]() {
+    itk::Size<3> radius; radius.Fill(2);
+    of_helper.ComputeApproximateNCCMetricImage(0, warp, radius, itmp, report, vtmp, 1.0);
+  });
+
+  // Exact and approximate NCC with a large radius, where the approximation should pay off
+  Time("metric_ncc_r4", data, threads, nv, [&]() {
+    itk::Size<3> radius; radius.Fill(4);
+    of_helper.ComputeNCCMetricImage(0, warp, radius, itmp, report, vtmp, 1.0);
+  });
+  Time("metric_ncc_approx_r4", data, threads, nv, [&]() {
+    itk::Size<3> radius; radius.Fill(4);
+    of_helper.ComputeApproximateNCCMetricImage(0, warp, radius, itmp, report, vtmp, 1.0);
+  });
+  Time("metric_mi", data, threads, nv, [&]() {
+    of_helper.ComputeMIFlowField(0, false, warp, itmp, report, vtmp, 1.0);
+  });
+
+  // Exponentiation and square root of the warp
+  Time("vimg_exp", data, threads, nv, [&]() {
+    LDDMMType::vimg_exp(warp, vtmp, vwork, 6, 1.0);
+  });
+  Time("warp_root", data, threads, nv, [&]() {
+    OFHelperType::ComputeWarpRoot(warp, vtmp, 2, 1e-4, 20);
+  });
+}
+
+// Time the three heap implementations on a random graph that looks like the
+// slice graph in stack_greedy: each vertex is linked to the next z_range
+// vertices, with random weights. All sources are run, as in root selection.
+template <class THeap>
+double ShortestPathChecksum(unsigned int n, std::vector<unsigned int> &AI,
+                            std::vector<unsigned int> &A, std::vector<double> &w)
+{
+  DijkstraShortestPath<double, THeap> sp(n, &AI[0], &A[0], &w[0]);
+  double checksum = 0.0;
+  for(unsigned int i = 0; i < n; i++)
+    {
+    sp.ComputePathsFromSource(i);
+    for(unsigned int j = 0; j < n; j++)
+      checksum += sp.GetDistanceArray()[j];
+    }
+  return checksum;
+}
+
+void Benchmark::RunShortestPath(unsigned int n, unsigned int z_range, const std::string &data)
+{
+  // Build the adjacency in METIS format
+  vnl_random randy(12345);
+  std::vector<unsigned int> AI(1, 0), A;
+  std::vector<double> w;
+  for(unsigned int i = 0; i < n; i++)
+    {
+    for(unsigned int j = (i > z_range ? i - z_range : 0); j < std::min(n, i + z_range + 1); j++)
+      {
+      if(j != i)
+        {
+        A.push_back(j);
+        w.push_back(randy.drand64(0.1, 10.0) * (j > i ? j - i : i - j));
+        }
+      }
+    AI.push_back((unsigned int) A.size());
+    }
+
+  double c_bin = 0.0, c_dary = 0.0, c_lazy = 0.0;
+  Time("dijkstra_binary", data, 1, n, [&]() {
+    c_bin = ShortestPathChecksum<BinaryHeap<double> >(n, AI, A, w);
+  });
+  Time("dijkstra_dary4", data, 1, n, [&]() {
+    c_dary = ShortestPathChecksum<DAryHeap<double, 4> >(n, AI, A, w);
+  });
+  Time("dijkstra_lazy", data, 1, n, [&]() {
+    c_lazy = ShortestPathChecksum<LazyDeletionHeap<double> >(n, AI, A, w);
+  });
+
+  // All heaps must find the same distances, up to the order of the additions
+  double tol = 1e-9 * fabs(c_bin);
+  if(c_bin != 0.0 && ((c_dary != 0.0 && fabs(c_dary - c_bin) > tol)
+                      || (c_lazy != 0.0 && fabs(c_lazy - c_bin) > tol)))
+    fprintf(stderr, "WARNING: shortest path checksums differ: binary %g, d-ary %g, lazy %g\n",
+            c_bin, c_dary, c_lazy);
+}
+
+std::vector<int> ParseIntList(const char *arg)
+{
+  std::vector<int> v;
+  std::istringstream iss(arg);
+  std::string tok;
+  while(std::getline(iss, tok, ','))
+    v.push_back(atoi(tok.c_str()));
+  return v;
+}
+
+int main(int argc, char *argv[])
+{
+  std::string fn_out, filter, fn_fix, fn_mov;
+  std::vector<int> sizes, threads;
+  int reps = 5;
+
+  for(int i = 1; i < argc; i++)
+    {
+    std::string arg = argv[i];
+    if(arg == "-o" && i+1 < argc)
+      fn_out = argv[++i];
+    else if(arg == "-s" && i+1 < argc)
+      sizes = ParseIntList(argv[++i]);
+    else if(arg == "-t" && i+1 < argc)
+      threads = ParseIntList(argv[++i]);
+    else if(arg == "-r" && i+1 < argc)
+      reps = atoi(argv[++i]);
+    else if(arg == "-b" && i+1 < argc)
+      filter = argv[++i];
+    else if(arg == "-phantom" && i+2 < argc)
+      {
+      fn_fix = argv[++i];
+      fn_mov = argv[++i];
+      }
+    else
+      return usage();
+    }
+
+  if(sizes.size() == 0)
+    {
+    sizes.push_back(32); sizes.push_back(64); sizes.push_back(128);
+    }
+
+  int def_threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  if(threads.size() == 0)
+    {
+    threads.push_back(1);
+    if(def_threads > 1)
+      threads.push_back(def_threads);
+    }
+
+  Benchmark bench(reps, filter);
+  for(unsigned int it = 0; it < threads.size(); it++)
+    {
+    for(unsigned int is = 0; is < sizes.size(); is++)
+      {
+      CompositeImagePointer fix = MakeSyntheticImage(sizes[is], 0.0);
+      CompositeImagePointer mov = MakeSyntheticImage(sizes[is], 0.05 * sizes[is]);
+      std::ostringstream oss; oss << "synth" << sizes[is];
+      bench.Run(fix, mov, oss.str(), threads[it]);
+      }
+
+    if(fn_fix.size())
+      {
+      CompositeImagePointer fix = LDDMMType::cimg_read(fn_fix.c_str());
+      CompositeImagePointer mov = LDDMMType::cimg_read(fn_mov.c_str());
+      bench.Run(fix, mov, "phantom", threads[it]);
+      }
+    }
+
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(def_threads);
+
+  // The shortest path code is single-threaded, so it is run once per size, on a
+  // graph of 16 times as many vertices as the image size
+  for(unsigned int is = 0; is < sizes.size(); is++)
+    {
+    std::ostringstream oss; oss << "graph" << sizes[is] * 16;
+    bench.RunShortestPath(sizes[is] * 16, 8, oss.str());
+    }
+
+  // Write the results as JSON
+  std::ofstream fout;
+  if(fn_out.size())
+    fout.open(fn_out.c_str());
+  std::ostream &out = fn_out.size() ? fout : std::cout;
+
+  const std::vector<BenchResult> &res = bench.GetResults();
+  out << "{" << std::endl;
+  out << "  \"repetitions\": " << reps << "," << std::endl;
+  out << "  \"results\": [" << std::endl;
+  for(unsigned int i = 0; i < res.size(); i++)
+    {
+    out << "    { \"name\": \"" << res[i].name << "\", \"data\": \"" << res[i].data << "\""
+        << ", \"threads\": " << res[i].threads << ", \"voxels\": " << res[i].voxels
+        << ", \"t_min\": " << res[i].t_min << ", \"t_mean\": " << res[i].t_mean << " }"
+        << (i + 1 < res.size() ? "," : "") << std::endl;
+    }
+  out << "  ]" << std::endl;
+  out << "}" << std::endl;
+
+  return 0;
+}
@@ -28,10 +28,63 @@
 #include "itkImageFileWriter.h"
 #include "OneDimensionalInPlaceAccumulateFilter.h"
 #include "itkTimeProbe.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+typedef itk::VectorImage<float, 3> ImageType;
+
+/**
+ * Accumulate a copy of the input stored with the layout TLayout, padded with zero
+ * components to nc_pad components, and return the largest relative difference from
+ * the sums computed with the default (AoS) layout
+ */
+template <class TLayout>
+double CompareLayout(ImageType *ref_image, const std::vector<float> &input, int nc_pad,
+                     const ImageType::SizeType &radius)
+{
+  int nc = ref_image->GetNumberOfComponentsPerPixel();
+  long nv = ref_image->GetBufferedRegion().GetNumberOfPixels();
+
+  // Pad the input in AoS order
+  std::vector<float> padded(nv * nc_pad, 0.0f);
+  for(long v = 0; v < nv; v++)
+    for(int k = 0; k < nc; k++)
+      padded[v * nc_pad + k] = input[v * nc + k];
+
+  // Store it in the layout and accumulate
+  ImageType::Pointer work = ImageType::New();
+  work->CopyInformation(ref_image);
+  work->SetNumberOfComponentsPerPixel(nc_pad);
+  work->SetRegions(ref_image->GetBufferedRegion());
+  work->Allocate();
+  CompositeLayoutConvert<CompositeLayoutAoS, TLayout>(&padded[0], work->GetBufferPointer(), nv, nc_pad);
+
+  itk::TimeProbe tp;
+  tp.Start();
+  ImageType::Pointer accum = AccumulateNeighborhoodSumsInPlace<ImageType, TLayout>(work, radius);
+  tp.Stop();
+
+  // Back to AoS, and compare
+  CompositeLayoutConvert<TLayout, CompositeLayoutAoS>(accum->GetBufferPointer(), &padded[0], nv, nc_pad);
+  const float *p_ref = ref_image->GetBufferPointer();
+  double max_diff = 0.0;
+  for(long v = 0; v < nv; v++)
+    for(int k = 0; k < nc; k++)
+      {
+      double x_ref = p_ref[v * nc + k];
+      double diff = fabs(padded[v * nc_pad + k] - x_ref) / std::max(1.0, fabs(x_ref));
+      max_diff = std::max(max_diff, diff);
+      }
+
+  printf("Layout with %d planes, elapsed ms: %6.2f, max relative difference: %g\n",
+         TLayout::GetNumberOfPlanes(nc_pad), 1000 * tp.GetTotal(), max_diff);
+
+  return max_diff;
+}
 
 int main(int argc, char *argv[])
 {
-  typedef itk::VectorImage<float, 3> ImageType;
   typedef itk::ImageFileReader<ImageType> ReaderType;
   typedef itk::ImageFileWriter<ImageType> WriterType;
 
@@ -41,6 +94,12 @@ int main(int argc, char *argv[])
 
   ImageType::SizeType radius; radius.Fill(2);
 
+  // Keep a copy of the input, since the filter works in place
+  int nc = reader->GetOutput()->GetNumberOfComponentsPerPixel();
+  long nv = reader->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+  std::vector<float> input(reader->GetOutput()->GetBufferPointer(),
+                           reader->GetOutput()->GetBufferPointer() + nv * nc);
+
 
   typedef OneDimensionalInPlaceAccumulateFilter<ImageType> AccumFilterType;
 
@@ -65,4 +124,13 @@ int main(int argc, char *argv[])
   writer->SetFileName(argv[2]);
   writer->SetInput(pipeTail->GetOutput());
   writer->Update();
+
+  // The other layouts must give the same sums as the default one
+  double tol = 1e-5;
+  bool failed = false;
+  ImageType *ref_image = pipeTail->GetOutput();
+  failed |= CompareLayout<CompositeLayoutSoA>(ref_image, input, nc, radius) > tol;
+  failed |= CompareLayout<CompositeLayoutAoSoA<4> >(ref_image, input, 4 * ((nc + 3) / 4), radius) > tol;
+
+  return failed ? -1 : 0;
 }